@@ -10,22 +10,57 @@ static aligned realspace[SPACE / ALIGNMENT];
 #define space ((char *) realspace)
 static unsigned int avail = SPACE; /* multiple of ALIGNMENT; 0<=avail<=SPACE */
 
+/*
+Memory from malloc() carries its length in the ALIGNMENT bytes before
+it, so that alloc_bytes can count what is out: every byte alloc()
+has handed out beyond space and alloc_free() has not taken back,
+whatever part of the program asked for it.
+*/
+unsigned long alloc_bytes = 0;
+
 /*@null@*//*@out@*/char *alloc(n)
 unsigned int n;
 {
   char *x;
   n = ALIGNMENT + n - (n & (ALIGNMENT - 1)); /* XXX: could overflow */
   if (n <= avail) { avail -= n; return space + avail; }
-  x = malloc(n);
-  if (!x) errno = error_nomem;
-  return x;
+  x = malloc(n + ALIGNMENT);
+  if (!x) { errno = error_nomem; return 0; }
+  *(unsigned long *) x = n;
+  alloc_bytes += n;
+  return x + ALIGNMENT;
 }
 
 void alloc_free(x)
 char *x;
 {
+  if (!x) return;
   if (x >= space)
     if (x < space + SPACE)
       return; /* XXX: assuming that pointers are flat */
+  x -= ALIGNMENT;
+  alloc_bytes -= *(unsigned long *) x;
   free(x);
 }
+
+/* x grown in place of alloc(), copy, alloc_free(); 0 if x is in space */
+/*@null@*/char *alloc_resize(x,n)
+char *x;
+unsigned int n;
+{
+  unsigned long old;
+
+  if (!x) return 0;
+  if (x >= space)
+    if (x < space + SPACE)
+      return 0;
+  n = ALIGNMENT + n - (n & (ALIGNMENT - 1)); /* XXX: could overflow */
+  x -= ALIGNMENT;
+  old = *(unsigned long *) x;
+  x = realloc(x,n + ALIGNMENT);
+  if (!x) { errno = error_nomem; return 0; }
+  *(unsigned long *) x = n;
+  alloc_bytes += n;
+  alloc_bytes -= old;
+  return x + ALIGNMENT;
+}
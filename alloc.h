@@ -4,5 +4,8 @@
 extern /*@null@*//*@out@*/char *alloc();
 extern void alloc_free();
 extern int alloc_re();
+extern /*@null@*/char *alloc_resize();
+
+extern unsigned long alloc_bytes;
 
 #endif
@@ -8,10 +8,13 @@ unsigned int n;
 {
   char *y;
  
-  y = alloc(n);
-  if (!y) return 0;
-  byte_copy(y,m,*x);
-  alloc_free(*x);
+  y = alloc_resize(*x,n);
+  if (!y) {
+    y = alloc(n);
+    if (!y) return 0;
+    byte_copy(y,m,*x);
+    alloc_free(*x);
+  }
   *x = y;
   return 1;
 }
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "uint32.h"
 #include "uint16.h"
 #include "stralloc.h"
+#include "alloc.h"
 #include "error.h"
 #include "strerr.h"
 #include "getln.h"
@@ -12,10 +14,12 @@
 #include "scan.h"
 #include "byte.h"
 #include "str.h"
+#include "env.h"
 #include "ip4.h"
 #include "timeoutread.h"
 #include "timeoutwrite.h"
 #include "dns.h"
+#include "axfrline.h"
 
 #define FATAL "axfr-get: fatal: "
 
@@ -37,9 +41,9 @@ unsigned int x_copy(char *buf,unsigned int len,unsigned int pos,char *out,unsign
   if (!pos) die_parse();
   return pos;
 }
-unsigned int x_getname(char *buf,unsigned int len,unsigned int pos,char **out)
+unsigned int x_getname(char *buf,unsigned int len,unsigned int pos,char *out)
 {
-  pos = dns_packet_getname(buf,len,pos,out);
+  pos = dns_packet_getnamebuf(buf,len,pos,out);
   if (!pos) die_parse();
   return pos;
 }
@@ -63,6 +67,10 @@ void die_netwrite(void)
 {
   strerr_die2sys(111,FATAL,"unable to write to network: ");
 }
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
 void die_read(void)
 {
   strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
@@ -87,7 +95,7 @@ int safewrite(int fd,char *buf,unsigned int len)
   if (r <= 0) die_netwrite();
   return r;
 }
-char netreadspace[1024];
+char netreadspace[65536];
 buffer netread = BUFFER_INIT(saferead,6,netreadspace,sizeof netreadspace);
 char netwritespace[1024];
 buffer netwrite = BUFFER_INIT(safewrite,7,netwritespace,sizeof netwritespace);
@@ -104,164 +112,369 @@ void netget(char *buf,unsigned int len)
 
 int fd;
 buffer b;
-char bspace[1024];
+char bspace[65536];
 
-void put(char *buf,unsigned int len)
+void put(const char *buf,unsigned int len)
 {
   if (buffer_put(&b,buf,len) == -1) die_write();
 }
 
-int printable(char ch)
-{
-  if (ch == '.') return 1;
-  if ((ch >= 'a') && (ch <= 'z')) return 1;
-  if ((ch >= '0') && (ch <= '9')) return 1;
-  if ((ch >= 'A') && (ch <= 'Z')) return 1;
-  if (ch == '-') return 1;
-  return 0;
-}
-
-static char *d1;
-static char *d2;
-static char *d3;
+static char d1[DNS_NAME];
 
 stralloc line;
 int match;
 
 int numsoa;
 
+/*
+With $AXFRBINARY set, fn is written as tinydns-data's binary input,
+BINMAGIC and then one record for each line there would have been;
+line then holds a record instead of a line. A fn in the other form
+is not used for IXFR, nor taken as up to date.
+*/
+
+#define BINMAGIC "\0tdrr\0\0\1"
+
+int flagbinary;
+
 unsigned int doit(char *buf,unsigned int len,unsigned int pos)
 {
-  char data[20];
-  uint32 ttl;
+  if (flagbinary) return axfrrec(&line,zone,&numsoa,buf,len,pos);
+  return axfrline(&line,zone,&numsoa,buf,len,pos);
+}
+
+stralloc packet;
+uint16 numanswers;
+
+void query(const char type[2],uint32 serial)
+{
+  char out[32];
+  uint16 n;
+
+  n = byte_equal(type,2,DNS_T_IXFR);
+  if (!stralloc_copyb(&packet,"\0\0\0\0\0\1\0\0\0\0\0\0",12)) die_generate();
+  packet.s[9] = n;
+  if (!stralloc_catb(&packet,zone,zonelen)) die_generate();
+  if (!stralloc_catb(&packet,type,2)) die_generate();
+  if (!stralloc_catb(&packet,DNS_C_IN,2)) die_generate();
+  if (n) {
+    if (!stralloc_catb(&packet,zone,zonelen)) die_generate();
+    byte_zero(out,32);
+    byte_copy(out,4,DNS_T_SOA DNS_C_IN);
+    out[9] = 22;
+    uint32_pack_big(out + 12,serial);
+    if (!stralloc_catb(&packet,out,10)) die_generate();
+    if (!stralloc_catb(&packet,out + 10,22)) die_generate();
+  }
+  uint16_pack_big(out,packet.len);
+  buffer_put(&netwrite,out,2);
+  buffer_put(&netwrite,packet.s,packet.len);
+  buffer_flush(&netwrite);
+}
+
+/* reads one message; returns the position of its first answer */
+unsigned int netpacket(void)
+{
+  char out[12];
+  uint16 dlen;
+  uint16 numqueries;
+  unsigned int pos;
+
+  netget(out,2);
+  uint16_unpack_big(out,&dlen);
+  if (!stralloc_ready(&packet,dlen)) die_parse();
+  netget(packet.s,dlen);
+  packet.len = dlen;
+
+  pos = x_copy(packet.s,packet.len,0,out,12);
+  uint16_unpack_big(out + 4,&numqueries);
+  uint16_unpack_big(out + 6,&numanswers);
+
+  while (numqueries) {
+    --numqueries;
+    pos = x_skipname(packet.s,packet.len,pos);
+    pos += 4;
+  }
+  if (pos > packet.len) { errno = error_proto; die_parse(); }
+  return pos;
+}
+
+unsigned int nextrr(unsigned int pos)
+{
+  while (pos >= packet.len) pos = netpacket();
+  return pos;
+}
+
+unsigned int skiprr(unsigned int pos)
+{
+  char data[10];
   uint16 dlen;
-  uint16 typenum;
-  uint32 u32;
-  int i;
-
-  pos = x_getname(buf,len,pos,&d1);
-  pos = x_copy(buf,len,pos,data,10);
-  uint16_unpack_big(data,&typenum);
-  uint32_unpack_big(data + 4,&ttl);
+
+  pos = x_skipname(packet.s,packet.len,pos);
+  pos = x_copy(packet.s,packet.len,pos,data,10);
   uint16_unpack_big(data + 8,&dlen);
-  if (len - pos < dlen) { errno = error_proto; return 0; }
-  len = pos + dlen;
-
-  if (!dns_domain_suffix(d1,zone)) return len;
-  if (byte_diff(data + 2,2,DNS_C_IN)) return len;
-
-  if (byte_equal(data,2,DNS_T_SOA)) {
-    if (++numsoa >= 2) return len;
-    pos = x_getname(buf,len,pos,&d2);
-    pos = x_getname(buf,len,pos,&d3);
-    x_copy(buf,len,pos,data,20);
-    uint32_unpack_big(data,&u32);
-    if (!stralloc_copys(&line,"#")) return 0;
-    if (!stralloc_catulong0(&line,u32,0)) return 0;
-    if (!stralloc_cats(&line," auto axfr-get\n")) return 0;
-    if (!stralloc_cats(&line,"Z")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    if (!dns_domain_todot_cat(&line,d2)) return 0;
-    if (!stralloc_cats(&line,".:")) return 0;
-    if (!dns_domain_todot_cat(&line,d3)) return 0;
-    if (!stralloc_cats(&line,".")) return 0;
-    for (i = 0;i < 5;++i) {
-      uint32_unpack_big(data + 4 * i,&u32);
-      if (!stralloc_cats(&line,":")) return 0;
-      if (!stralloc_catulong0(&line,u32,0)) return 0;
+  if (packet.len - pos < dlen) { errno = error_proto; die_parse(); }
+  return pos + dlen;
+}
+
+/* 1 if the record at pos is the SOA record of the zone */
+int rrsoa(unsigned int pos,uint32 *serial)
+{
+  char data[10];
+
+  pos = x_getname(packet.s,packet.len,pos,d1);
+  pos = x_copy(packet.s,packet.len,pos,data,10);
+  if (byte_diff(data,4,DNS_T_SOA DNS_C_IN)) return 0;
+  if (!dns_domain_equal(d1,zone)) return 0;
+  pos = x_skipname(packet.s,packet.len,pos);
+  pos = x_skipname(packet.s,packet.len,pos);
+  x_copy(packet.s,packet.len,pos,data,4);
+  uint32_unpack_big(data,serial);
+  return 1;
+}
+
+stralloc soaline;
+
+void begin(void)
+{
+  fd = open_trunc(fntmp);
+  if (fd == -1) die_write();
+  buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
+  if (flagbinary) put(BINMAGIC,8);
+  put(soaline.s,soaline.len);
+}
+
+/* 1 if b, just opened, holds binary records; skips BINMAGIC */
+int binopen(void)
+{
+  int r;
+
+  r = buffer_feed(&b);
+  if (r == -1) die_read();
+  if ((r < 8) || byte_diff(buffer_PEEK(&b),8,BINMAGIC)) return 0;
+  buffer_SEEK(&b,8);
+  return 1;
+}
+
+/* reads len bytes from b into buf; 0 at the end of b */
+int binread(char *buf,unsigned int len)
+{
+  int r;
+  unsigned int got = 0;
+
+  while (got < len) {
+    r = buffer_get(&b,buf + got,len - got);
+    if (r == -1) die_read();
+    if (!r) {
+      if (!got) return 0;
+      errno = error_proto; die_read();
     }
+    got += r;
   }
-  else if (byte_equal(data,2,DNS_T_NS)) {
-    if (!stralloc_copys(&line,"&")) return 0;
-    if (byte_equal(d1,2,"\1*")) { errno = error_proto; return 0; }
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,"::")) return 0;
-    x_getname(buf,len,pos,&d1);
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,".")) return 0;
+  return 1;
+}
+
+/* sets line to the next record from b, length included; 0 at the end */
+int binget(void)
+{
+  char buf[2];
+  uint16 u;
+
+  line.len = 0;
+  if (!binread(buf,2)) return 0;
+  uint16_unpack_big(buf,&u);
+  if (!stralloc_ready(&line,u + 2)) nomem();
+  byte_copy(line.s,2,buf);
+  if (u && !binread(line.s + 2,u)) { errno = error_proto; die_read(); }
+  line.len = u + 2;
+  return 1;
+}
+
+/* 1 if the record in line is an SOA record, setting serial */
+int binsoa(uint32 *serial)
+{
+  unsigned int pos = 2;
+  int names = 3;
+  unsigned char ch;
+
+  while (names-- > 0) {
+    for (;;) {
+      if (pos >= line.len) return 0;
+      ch = line.s[pos];
+      pos += ch + 1;
+      if (!ch) break;
+    }
+    if (names == 2) {
+      if (pos + 16 > line.len) return 0;
+      if (byte_diff(line.s + pos,2,DNS_T_SOA)) return 0;
+      pos += 16;
+    }
+  }
+  if (pos + 4 > line.len) return 0;
+  uint32_unpack_big(line.s + pos,serial);
+  return 1;
+}
+
+void finish(void)
+{
+  if (buffer_flush(&b) == -1) die_write();
+  if (fsync(fd) == -1) die_write();
+  if (close(fd) == -1) die_write(); /* NFS dorks */
+  if (rename(fntmp,fn) == -1)
+    strerr_die6sys(111,FATAL,"unable to move ",fntmp," to ",fn,": ");
+  _exit(0);
+}
+
+void axfr(unsigned int pos)
+{
+  begin();
+  while (numsoa < 2) {
+    pos = nextrr(pos);
+    pos = doit(packet.s,packet.len,pos);
+    if (!pos) die_parse();
+    put(line.s,line.len);
   }
-  else if (byte_equal(data,2,DNS_T_CNAME)) {
-    if (!stralloc_copys(&line,"C")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    x_getname(buf,len,pos,&d1);
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,".")) return 0;
+  finish();
+}
+
+/*
+IXFR: every line of fn, and every line for a record that the changes
+delete or add, becomes an entry weighing 1, -1 or 1. Sorting them by
+text gives each line its count in the new zone; the lines kept go out
+in the order they had in fn, then in the order they came in.
+*/
+
+struct entry {
+  unsigned int pos; /* in text */
+  unsigned int len;
+  unsigned int seq;
+  int weight;
+} ;
+
+static stralloc text;
+static struct entry *entry;
+static unsigned int numentries = 0;
+static unsigned int maxentries = 0;
+
+void entry_add(const char *s,unsigned int len,int weight)
+{
+  struct entry *e;
+  unsigned int n;
+
+  if (numentries == maxentries) {
+    n = maxentries + (maxentries >> 1) + 64;
+    if (!entry) entry = (struct entry *) alloc(n * sizeof(struct entry));
+    else if (!alloc_re((char **) &entry,maxentries * sizeof(struct entry),n * sizeof(struct entry)))
+      nomem();
+    if (!entry) nomem();
+    maxentries = n;
   }
-  else if (byte_equal(data,2,DNS_T_PTR)) {
-    if (!stralloc_copys(&line,"^")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    x_getname(buf,len,pos,&d1);
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,".")) return 0;
+  e = entry + numentries;
+  e->pos = text.len;
+  e->len = len;
+  e->seq = numentries++;
+  e->weight = weight;
+  if (!stralloc_catb(&text,s,len)) nomem();
+}
+
+int entrytext(const void *x,const void *y)
+{
+  const struct entry *a = x;
+  const struct entry *c = y;
+  int r;
+
+  r = byte_diff(text.s + a->pos,a->len < c->len ? a->len : c->len,text.s + c->pos);
+  if (r) return r;
+  if (a->len != c->len) return (a->len < c->len) ? -1 : 1;
+  return (a->seq < c->seq) ? -1 : 1;
+}
+
+int entryseq(const void *x,const void *y)
+{
+  const struct entry *a = x;
+  const struct entry *c = y;
+
+  if (a->weight != c->weight) return (a->weight > c->weight) ? -1 : 1;
+  return (a->seq < c->seq) ? -1 : 1;
+}
+
+/* 1 if the changes from pos up to the final SOA record apply to fn */
+int ixfr(unsigned int pos,uint32 newserial)
+{
+  unsigned int i;
+  unsigned int j;
+  unsigned int keep;
+  int count;
+  int weight = -1;
+  uint32 u;
+
+  fd = open_read(fn);
+  if (fd == -1) die_read();
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+  if (binopen()) {
+    while (binget())
+      if (!binsoa(&u)) entry_add(line.s,line.len,1);
   }
-  else if (byte_equal(data,2,DNS_T_MX)) {
-    uint16 dist;
-    if (!stralloc_copys(&line,"@")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,"::")) return 0;
-    pos = x_copy(buf,len,pos,data,2);
-    uint16_unpack_big(data,&dist);
-    x_getname(buf,len,pos,&d1);
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,".:")) return 0;
-    if (!stralloc_catulong0(&line,dist,0)) return 0;
+  else for (;;) {
+    if (getln(&b,&line,&match,'\n') == -1) die_read();
+    if (!line.len) break;
+    if ((line.s[0] != '#') && (line.s[0] != 'Z')) {
+      if (!match)
+        if (!stralloc_cats(&line,"\n")) nomem();
+      entry_add(line.s,line.len,1);
+    }
+    if (!match) break;
   }
-  else if (byte_equal(data,2,DNS_T_A) && (dlen == 4)) {
-    char ipstr[IP4_FMT];
-    if (!stralloc_copys(&line,"+")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    x_copy(buf,len,pos,data,4);
-    if (!stralloc_catb(&line,ipstr,ip4_fmt(ipstr,data))) return 0;
+  close(fd);
+
+  for (;;) {
+    pos = nextrr(pos);
+    if (rrsoa(pos,&u)) {
+      if (weight < 0) weight = 1;
+      else if (u == newserial) break;
+      else weight = -1;
+      pos = skiprr(pos);
+      continue;
+    }
+    pos = doit(packet.s,packet.len,pos);
+    if (!pos) die_parse();
+    if (line.len) entry_add(line.s,line.len,weight);
   }
-  else {
-    unsigned char ch;
-    unsigned char ch2;
-    if (!stralloc_copys(&line,":")) return 0;
-    if (!dns_domain_todot_cat(&line,d1)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    if (!stralloc_catulong0(&line,typenum,0)) return 0;
-    if (!stralloc_cats(&line,":")) return 0;
-    for (i = 0;i < dlen;++i) {
-      pos = x_copy(buf,len,pos,data,1);
-      ch = data[0];
-      if (printable(ch)) {
-        if (!stralloc_catb(&line,&ch,1)) return 0;
-      }
-      else {
-        if (!stralloc_cats(&line,"\\")) return 0;
-        ch2 = '0' + ((ch >> 6) & 7);
-        if (!stralloc_catb(&line,&ch2,1)) return 0;
-        ch2 = '0' + ((ch >> 3) & 7);
-        if (!stralloc_catb(&line,&ch2,1)) return 0;
-        ch2 = '0' + (ch & 7);
-        if (!stralloc_catb(&line,&ch2,1)) return 0;
-      }
+
+  qsort(entry,numentries,sizeof(struct entry),entrytext);
+  keep = 0;
+  for (i = 0;i < numentries;i = j) {
+    count = 0;
+    for (j = i;j < numentries;++j) {
+      if (entry[j].len != entry[i].len) break;
+      if (byte_diff(text.s + entry[j].pos,entry[i].len,text.s + entry[i].pos)) break;
+      count += entry[j].weight;
     }
+    if (count < 0) return 0;
+    for (;i < j;++i)
+      if ((entry[i].weight > 0) && count) {
+        entry[i].weight = 2;
+        --count;
+        ++keep;
+      }
   }
-  if (!stralloc_cats(&line,":")) return 0;
-  if (!stralloc_catulong0(&line,ttl,0)) return 0;
-  if (!stralloc_cats(&line,"\n")) return 0;
-  put(line.s,line.len);
+  qsort(entry,numentries,sizeof(struct entry),entryseq);
 
-  return len;
+  begin();
+  for (i = 0;i < keep;++i)
+    put(text.s + entry[i].pos,entry[i].len);
+  finish();
+  return 1;
 }
 
-stralloc packet;
-
 int main(int argc,char **argv)
 {
   char out[20];
   unsigned long u;
-  uint16 dlen;
   unsigned int pos;
   uint32 oldserial = 0;
   uint32 newserial = 0;
-  uint16 numqueries;
-  uint16 numanswers;
+  uint32 serial;
 
   if (!*argv) die_usage();
 
@@ -274,47 +487,33 @@ int main(int argc,char **argv)
   if (!*++argv) die_usage();
   fntmp = *argv;
 
+  flagbinary = !!env_get("AXFRBINARY");
+
   fd = open_read(fn);
   if (fd == -1) {
     if (errno != error_noent) die_read();
   }
   else {
     buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
-    if (getln(&b,&line,&match,'\n') == -1) die_read();
-    if (!stralloc_0(&line)) die_read();
-    if (line.s[0] == '#') {
-      scan_ulong(line.s + 1,&u);
-      oldserial = u;
+    if (binopen()) {
+      if (flagbinary && binget()) binsoa(&oldserial);
+    }
+    else {
+      if (getln(&b,&line,&match,'\n') == -1) die_read();
+      if (!stralloc_0(&line)) die_read();
+      if (!flagbinary && (line.s[0] == '#')) {
+        scan_ulong(line.s + 1,&u);
+        oldserial = u;
+      }
     }
     close(fd);
   }
 
-  if (!stralloc_copyb(&packet,"\0\0\0\0\0\1\0\0\0\0\0\0",12)) die_generate();
-  if (!stralloc_catb(&packet,zone,zonelen)) die_generate();
-  if (!stralloc_catb(&packet,DNS_T_SOA DNS_C_IN,4)) die_generate();
-  uint16_pack_big(out,packet.len);
-  buffer_put(&netwrite,out,2);
-  buffer_put(&netwrite,packet.s,packet.len);
-  buffer_flush(&netwrite);
-
-  netget(out,2);
-  uint16_unpack_big(out,&dlen);
-  if (!stralloc_ready(&packet,dlen)) die_parse();
-  netget(packet.s,dlen);
-  packet.len = dlen;
-
-  pos = x_copy(packet.s,packet.len,0,out,12);
-  uint16_unpack_big(out + 4,&numqueries);
-  uint16_unpack_big(out + 6,&numanswers);
-
-  while (numqueries) {
-    --numqueries;
-    pos = x_skipname(packet.s,packet.len,pos);
-    pos += 4;
-  }
+  query(DNS_T_SOA,0);
+  pos = netpacket();
 
   if (!numanswers) { errno = error_proto; die_parse(); }
-  pos = x_getname(packet.s,packet.len,pos,&d1);
+  pos = x_getname(packet.s,packet.len,pos,d1);
   if (!dns_domain_equal(zone,d1)) { errno = error_proto; die_parse(); }
   pos = x_copy(packet.s,packet.len,pos,out,10);
   if (byte_diff(out,4,DNS_T_SOA DNS_C_IN)) { errno = error_proto; die_parse(); }
@@ -330,44 +529,27 @@ int main(int argc,char **argv)
       _exit(0);
 
 
-  fd = open_trunc(fntmp);
-  if (fd == -1) die_write();
-  buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
-
-  if (!stralloc_copyb(&packet,"\0\0\0\0\0\1\0\0\0\0\0\0",12)) die_generate();
-  if (!stralloc_catb(&packet,zone,zonelen)) die_generate();
-  if (!stralloc_catb(&packet,DNS_T_AXFR DNS_C_IN,4)) die_generate();
-  uint16_pack_big(out,packet.len);
-  buffer_put(&netwrite,out,2);
-  buffer_put(&netwrite,packet.s,packet.len);
-  buffer_flush(&netwrite);
-
-  numsoa = 0;
-  while (numsoa < 2) {
-    netget(out,2);
-    uint16_unpack_big(out,&dlen);
-    if (!stralloc_ready(&packet,dlen)) die_parse();
-    netget(packet.s,dlen);
-    packet.len = dlen;
-
-    pos = x_copy(packet.s,packet.len,0,out,12);
-    uint16_unpack_big(out + 4,&numqueries);
-
-    while (numqueries) {
-      --numqueries;
-      pos = x_skipname(packet.s,packet.len,pos);
-      pos += 4;
-    }
-    while (pos < packet.len) {
+  if (oldserial) {
+    query(DNS_T_IXFR,oldserial);
+    pos = netpacket();
+    if (numanswers) { /* else the server does not do IXFR */
+      if (!rrsoa(pos,&newserial)) { errno = error_proto; die_parse(); }
+      if (newserial == oldserial) _exit(0);
+      numsoa = 0;
       pos = doit(packet.s,packet.len,pos);
       if (!pos) die_parse();
+      if (!stralloc_copy(&soaline,&line)) nomem();
+      pos = nextrr(pos);
+      if (!rrsoa(pos,&serial) || (serial != oldserial)) axfr(pos);
+      ixfr(skiprr(pos),newserial);
+      numentries = 0; /* changes do not apply: start over */
+      text.len = 0;
     }
   }
 
-  if (buffer_flush(&b) == -1) die_write();
-  if (fsync(fd) == -1) die_write();
-  if (close(fd) == -1) die_write(); /* NFS dorks */
-  if (rename(fntmp,fn) == -1)
-    strerr_die6sys(111,FATAL,"unable to move ",fntmp," to ",fn,": ");
+  query(DNS_T_AXFR,0);
+  numsoa = 0;
+  soaline.len = 0;
+  axfr(netpacket());
   _exit(0);
 }
@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "uint16.h"
+#include "uint32.h"
+#include "stralloc.h"
+#include "alloc.h"
+#include "error.h"
+#include "strerr.h"
+#include "getln.h"
+#include "buffer.h"
+#include "exit.h"
+#include "open.h"
+#include "scan.h"
+#include "byte.h"
+#include "fmt.h"
+#include "str.h"
+#include "ip4.h"
+#include "env.h"
+#include "taia.h"
+#include "iopause.h"
+#include "socket.h"
+#include "case.h"
+#include "cdb.h"
+#include "dns.h"
+#include "axfrline.h"
+
+#define FATAL "axfr-pull: fatal: "
+#define WARNING "axfr-pull: warning: "
+
+/*
+axfr-pull keeps many zones up to date at once. Each line of the file
+named on the command line is zone:ip:fn, and fn is written as by
+axfr-get zone fn fn.tmp. A zone is checked when its SOA refresh time
+has gone by, or its retry time after a failure; it is transferred
+when the serial differs from the one in fn. At most $MAXCONN
+transfers run at once, at most $PERSERVER of them to any one server.
+
+If $IP is set, axfr-pull also listens for NOTIFY messages on UDP port
+53 of that address. A NOTIFY for a zone from that zone's server makes
+the zone due at once.
+*/
+
+#define REFRESH 3600 /* until the zone's SOA record is known */
+#define RETRY 300
+
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+void die_usage(void)
+{
+  strerr_die1x(100,"axfr-pull: usage: axfr-pull zones");
+}
+
+struct server {
+  char ip[4];
+  unsigned int active;
+  struct zone *head; /* due, waiting for a connection */
+  struct zone *tail;
+} ;
+
+struct zone {
+  char *name;
+  char *fn;
+  char *fntmp;
+  unsigned int server;
+  uint32 serial; /* from the first line of fn; 0 if none */
+  uint32 refresh;
+  uint32 retry;
+  struct taia when;
+  unsigned int heappos; /* NOTINHEAP if due or being transferred */
+  int flagnotify; /* check again as soon as this transfer is done */
+  struct zone *next;
+} ;
+
+#define NOTINHEAP ((unsigned int) -1)
+
+struct conn {
+  struct zone *z;
+  int fd; /* -1 if unused */
+  int flagaxfr; /* else waiting for the SOA answer */
+  int flagconnected;
+  stralloc in;
+  stralloc line;
+  int numsoa;
+  uint32 serial;
+  uint32 refresh;
+  uint32 retry;
+  int fdout;
+  buffer out;
+  char *outspace;
+  struct taia deadline;
+  iopause_fd *io;
+} ;
+
+#define OUTSPACE 8192
+
+static struct server *server;
+static unsigned int numservers = 0;
+static struct zone *zone;
+static unsigned int numzones = 0;
+static struct conn *conn;
+static unsigned long maxconn = 100;
+static unsigned long perserver = 4;
+static unsigned int numconn = 0;
+static iopause_fd *io;
+
+/* zones not yet due, in a heap ordered by when */
+
+static struct zone **heap;
+static unsigned int heaplen = 0;
+
+static void heap_up(struct zone *z,unsigned int i)
+{
+  unsigned int j;
+
+  while (i) {
+    j = (i - 1) >> 1;
+    if (!taia_less(&z->when,&heap[j]->when)) break;
+    heap[i] = heap[j];
+    heap[i]->heappos = i;
+    i = j;
+  }
+  heap[i] = z;
+  z->heappos = i;
+}
+
+static void heap_push(struct zone *z)
+{
+  heap_up(z,heaplen++);
+}
+
+static struct zone *heap_pop(void)
+{
+  struct zone *top;
+  struct zone *z;
+  unsigned int i;
+  unsigned int j;
+
+  top = heap[0];
+  z = heap[--heaplen];
+  i = 0;
+  for (;;) {
+    j = 2 * i + 1;
+    if (j >= heaplen) break;
+    if (j + 1 < heaplen)
+      if (taia_less(&heap[j + 1]->when,&heap[j]->when)) ++j;
+    if (!taia_less(&heap[j]->when,&z->when)) break;
+    heap[i] = heap[j];
+    heap[i]->heappos = i;
+    i = j;
+  }
+  if (heaplen) { heap[i] = z; z->heappos = i; }
+  top->heappos = NOTINHEAP;
+  return top;
+}
+
+static struct taia now;
+
+void schedule(struct zone *z,uint32 seconds)
+{
+  taia_uint(&z->when,seconds);
+  taia_add(&z->when,&z->when,&now);
+  heap_push(z);
+}
+
+/* zones by name, open addressing; several may share a name */
+
+static unsigned int *zoneslot;
+static unsigned int numzoneslots;
+
+void hashzones(void)
+{
+  unsigned int i;
+  unsigned int j;
+
+  numzoneslots = 64;
+  while (numzoneslots < 2 * numzones) numzoneslots <<= 1;
+  zoneslot = (unsigned int *) alloc(numzoneslots * sizeof(unsigned int));
+  if (!zoneslot) nomem();
+  byte_zero(zoneslot,numzoneslots * sizeof(unsigned int));
+  for (i = 0;i < numzones;++i) {
+    j = cdb_hash(zone[i].name,dns_domain_length(zone[i].name)) & (numzoneslots - 1);
+    while (zoneslot[j]) j = (j + 1) & (numzoneslots - 1);
+    zoneslot[j] = i + 1;
+  }
+}
+
+/* name must be in lowercase */
+struct zone *zone_find(const char *name,const char ip[4])
+{
+  unsigned int len;
+  unsigned int i;
+  struct zone *z;
+
+  len = dns_domain_length(name);
+  i = cdb_hash(name,len) & (numzoneslots - 1);
+  while (zoneslot[i]) {
+    z = zone + zoneslot[i] - 1;
+    if (byte_equal(z->name,len,name))
+      if (byte_equal(server[z->server].ip,4,ip))
+        return z;
+    i = (i + 1) & (numzoneslots - 1);
+  }
+  return 0;
+}
+
+/* configuration */
+
+static stralloc line;
+static stralloc f[3];
+static int match = 1;
+static char *d;
+
+void readserial(struct zone *z)
+{
+  buffer b;
+  char bspace[256];
+  unsigned long u;
+  int fd;
+  int flag;
+
+  z->serial = 0;
+  fd = open_read(z->fn);
+  if (fd == -1) {
+    if (errno != error_noent)
+      strerr_die4sys(111,FATAL,"unable to read ",z->fn,": ");
+    return;
+  }
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+  if (getln(&b,&line,&flag,'\n') == -1)
+    strerr_die4sys(111,FATAL,"unable to read ",z->fn,": ");
+  close(fd);
+  if (!stralloc_0(&line)) nomem();
+  if (line.s[0] == '#') {
+    scan_ulong(line.s + 1,&u);
+    z->serial = u;
+  }
+}
+
+char *copystring(stralloc *sa,const char *suffix)
+{
+  char *s;
+
+  if (!stralloc_cats(sa,suffix)) nomem();
+  s = alloc(sa->len + 1);
+  if (!s) nomem();
+  byte_copy(s,sa->len,sa->s);
+  s[sa->len] = 0;
+  return s;
+}
+
+void readzones(const char *fn)
+{
+  buffer b;
+  char bspace[1024];
+  struct zone *z;
+  unsigned int maxservers = 0;
+  unsigned int maxzones = 0;
+  unsigned int i;
+  unsigned int j;
+  char ip[4];
+  int fd;
+
+  fd = open_read(fn);
+  if (fd == -1) strerr_die4sys(111,FATAL,"unable to open ",fn,": ");
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+
+  while (match) {
+    if (getln(&b,&line,&match,'\n') == -1)
+      strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+    while (line.len && ((line.s[line.len - 1] == '\n') || (line.s[line.len - 1] == ' ')))
+      --line.len;
+    if (!line.len || (line.s[0] == '#')) continue;
+
+    j = 0;
+    for (i = 0;i < 3;++i) {
+      if (j >= line.len) {
+        if (!stralloc_copys(&f[i],"")) nomem();
+      }
+      else {
+        unsigned int k = byte_chr(line.s + j,line.len - j,':');
+        if (!stralloc_copyb(&f[i],line.s + j,k)) nomem();
+        j += k + 1;
+      }
+    }
+    if (!stralloc_0(&f[1])) nomem();
+    if (!f[0].len || !f[2].len || !ip4_scan(f[1].s,ip))
+      strerr_die4x(111,FATAL,"unable to parse ",fn,": need zone:ip:fn");
+
+    for (i = 0;i < numservers;++i)
+      if (byte_equal(server[i].ip,4,ip)) break;
+    if (i == numservers) {
+      if (numservers == maxservers) {
+        j = maxservers + (maxservers >> 1) + 16;
+        if (!server) server = (struct server *) alloc(j * sizeof(struct server));
+        else if (!alloc_re((char **) &server,maxservers * sizeof(struct server),j * sizeof(struct server)))
+          nomem();
+        if (!server) nomem();
+        maxservers = j;
+      }
+      byte_copy(server[i].ip,4,ip);
+      server[i].active = 0;
+      server[i].head = server[i].tail = 0;
+      ++numservers;
+    }
+
+    if (numzones == maxzones) {
+      j = maxzones + (maxzones >> 1) + 64;
+      if (!zone) zone = (struct zone *) alloc(j * sizeof(struct zone));
+      else if (!alloc_re((char **) &zone,maxzones * sizeof(struct zone),j * sizeof(struct zone)))
+        nomem();
+      if (!zone) nomem();
+      maxzones = j;
+    }
+    z = zone + numzones++;
+    if (!dns_domain_fromdot(&d,f[0].s,f[0].len)) nomem();
+    case_lowerb(d,dns_domain_length(d));
+    z->name = d;
+    d = 0;
+    z->server = i;
+    z->fn = copystring(&f[2],"");
+    z->fntmp = copystring(&f[2],".tmp");
+    z->refresh = REFRESH;
+    z->retry = RETRY;
+    z->heappos = NOTINHEAP;
+    z->flagnotify = 0;
+    z->next = 0;
+    readserial(z);
+  }
+  close(fd);
+}
+
+/* transfers */
+
+/* 0 if the query could not be written */
+int query(struct conn *c,const char type[2])
+{
+  char buf[2];
+  int r;
+
+  if (!stralloc_copyb(&line,"\0\0\0\0\0\0\0\1\0\0\0\0\0\0",14)) nomem();
+  if (!stralloc_catb(&line,c->z->name,dns_domain_length(c->z->name))) nomem();
+  if (!stralloc_catb(&line,type,2)) nomem();
+  if (!stralloc_catb(&line,DNS_C_IN,2)) nomem();
+  uint16_pack_big(buf,line.len - 2);
+  byte_copy(line.s,2,buf);
+  r = write(c->fd,line.s,line.len); /* a new connection has room for this */
+  if (r == line.len) return 1;
+  if (r >= 0) errno = error_again;
+  return 0;
+}
+
+void finish(struct conn *c,const char *why)
+{
+  struct zone *z = c->z;
+
+  if (c->fd != -1) {
+    iopause_forget(c->fd);
+    close(c->fd);
+  }
+  c->fd = -1;
+  if (c->flagaxfr) {
+    alloc_free(c->outspace);
+    if (c->fdout != -1) close(c->fdout);
+  }
+  --numconn;
+  --server[z->server].active;
+
+  if (why) {
+    strerr_warn6(WARNING,"unable to transfer ",z->fn,": ",why,": ",&strerr_sys);
+    schedule(z,z->flagnotify ? 0 : z->retry);
+    return;
+  }
+  z->refresh = c->refresh ? c->refresh : REFRESH;
+  z->retry = c->retry ? c->retry : RETRY;
+  schedule(z,z->flagnotify ? 0 : z->refresh);
+}
+
+void start(struct server *s)
+{
+  struct conn *c;
+  struct zone *z;
+
+  for (c = conn;c->fd != -1;++c) ;
+  z = s->head;
+  s->head = z->next;
+  z->next = 0;
+  z->flagnotify = 0;
+
+  c->z = z;
+  c->flagaxfr = 0;
+  c->flagconnected = 0;
+  c->in.len = 0;
+  c->deadline = now;
+  taia_uint(&c->deadline,60);
+  taia_add(&c->deadline,&c->deadline,&now);
+  ++numconn;
+  ++s->active;
+
+  c->fd = socket_tcp();
+  if (c->fd == -1) { finish(c,"socket"); return; }
+  if (socket_connect4(c->fd,s->ip,53) == 0) {
+    c->flagconnected = 1;
+    if (!query(c,DNS_T_SOA)) finish(c,"write");
+  }
+  else if ((errno != error_inprogress) && (errno != error_wouldblock))
+    finish(c,"connect");
+}
+
+/* handles one message: 1 if the zone is done, 0 if more is to come */
+int message(struct conn *c,char *buf,unsigned int len)
+{
+  char header[12];
+  char misc[20];
+  char strnum[FMT_ULONG];
+  uint16 numqueries;
+  uint16 numanswers;
+  unsigned int pos;
+
+  pos = dns_packet_copy(buf,len,0,header,12); if (!pos) return -1;
+  uint16_unpack_big(header + 4,&numqueries);
+  uint16_unpack_big(header + 6,&numanswers);
+  while (numqueries--) {
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return -1;
+    pos += 4;
+  }
+  if (pos > len) { errno = error_proto; return -1; }
+
+  if (!c->flagaxfr) {
+    if (!numanswers) { errno = error_proto; return -1; }
+    pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return -1;
+    if (!dns_domain_equal(d,c->z->name)) { errno = error_proto; return -1; }
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return -1;
+    if (byte_diff(misc,4,DNS_T_SOA DNS_C_IN)) { errno = error_proto; return -1; }
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return -1;
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return -1;
+    pos = dns_packet_copy(buf,len,pos,misc,20); if (!pos) return -1;
+    uint32_unpack_big(misc,&c->serial);
+    uint32_unpack_big(misc + 4,&c->refresh);
+    uint32_unpack_big(misc + 8,&c->retry);
+
+    if (c->serial && (c->serial == c->z->serial)) return 1;
+
+    c->fdout = open_trunc(c->z->fntmp);
+    if (c->fdout == -1) return -1;
+    c->outspace = alloc(OUTSPACE);
+    if (!c->outspace) { close(c->fdout); return -1; }
+    buffer_init(&c->out,buffer_unixwrite,c->fdout,c->outspace,OUTSPACE);
+    c->flagaxfr = 1;
+    c->numsoa = 0;
+    return query(c,DNS_T_AXFR) ? 0 : -1;
+  }
+
+  while (pos < len) {
+    pos = axfrline(&c->line,c->z->name,&c->numsoa,buf,len,pos);
+    if (!pos) return -1;
+    if (buffer_put(&c->out,c->line.s,c->line.len) == -1) return -1;
+    if (c->numsoa >= 2) break;
+  }
+  if (c->numsoa < 2) return 0;
+
+  if (buffer_flush(&c->out) == -1) return -1;
+  if (fsync(c->fdout) == -1) return -1;
+  if (close(c->fdout) == -1) { c->fdout = -1; return -1; } /* NFS dorks */
+  c->fdout = -1;
+  if (rename(c->z->fntmp,c->z->fn) == -1) return -1;
+  c->z->serial = c->serial;
+  buffer_puts(buffer_1,c->z->fn);
+  buffer_puts(buffer_1," ");
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,c->serial));
+  buffer_putflush(buffer_1,"\n",1);
+  return 1;
+}
+
+void doio(struct conn *c)
+{
+  uint16 len;
+  unsigned int pos;
+  int r;
+
+  if (c->flagconnected == 0) {
+    if (!c->io->revents) return;
+    if (!socket_connected(c->fd)) { finish(c,"connect"); return; }
+    c->flagconnected = 1;
+    if (!query(c,DNS_T_SOA)) finish(c,"write");
+    return;
+  }
+  if (!c->io->revents) return;
+
+  if (!stralloc_readyplus(&c->in,8192)) nomem();
+  r = read(c->fd,c->in.s + c->in.len,8192);
+  if (r == -1) {
+    if ((errno == error_again) || (errno == error_wouldblock)) return;
+    finish(c,"read");
+    return;
+  }
+  if (r == 0) { errno = error_proto; finish(c,"read"); return; }
+  c->in.len += r;
+  taia_uint(&c->deadline,60);
+  taia_add(&c->deadline,&c->deadline,&now);
+
+  pos = 0;
+  while (c->in.len - pos >= 2) {
+    uint16_unpack_big(c->in.s + pos,&len);
+    if (c->in.len - pos - 2 < len) break;
+    r = message(c,c->in.s + pos + 2,len);
+    pos += 2 + len;
+    if (r == -1) { finish(c,c->flagaxfr ? "AXFR" : "SOA"); return; }
+    if (r == 1) { finish(c,0); return; }
+  }
+  byte_copy(c->in.s,c->in.len - pos,c->in.s + pos);
+  c->in.len -= pos;
+}
+
+/* NOTIFY */
+
+static int udp53 = -1;
+
+void notify(char *buf,unsigned int len,const char ip[4],uint16 port)
+{
+  struct zone *z;
+  unsigned int pos;
+
+  if (len < 12) return;
+  if ((buf[2] & 0xf8) != 0x20) return; /* query, opcode NOTIFY */
+  if (buf[4] || (buf[5] != 1)) return;
+  pos = dns_packet_getname(buf,len,12,&d); if (!pos) return;
+  if (pos + 4 > len) return;
+  if (byte_diff(buf + pos,4,DNS_T_SOA DNS_C_IN)) return;
+  pos += 4;
+
+  case_lowerb(d,dns_domain_length(d));
+  z = zone_find(d,ip);
+  if (!z) return;
+
+  buf[2] |= 0x80;
+  buf[3] = 0;
+  byte_zero(buf + 6,6);
+  socket_send4(udp53,buf,pos,ip,port);
+
+  if (z->heappos == NOTINHEAP) {
+    z->flagnotify = 1;
+    return;
+  }
+  z->when = now;
+  heap_up(z,z->heappos);
+}
+
+int main(int argc,char **argv)
+{
+  struct taia deadline;
+  struct conn *c;
+  struct zone *z;
+  struct server *s;
+  unsigned int i;
+  unsigned int iolen;
+  char *x;
+  char ip[4];
+  char buf[512];
+  uint16 port;
+  int r;
+
+  if (!argv[1]) die_usage();
+
+  x = env_get("MAXCONN");
+  if (x) scan_ulong(x,&maxconn);
+  if (maxconn < 1) maxconn = 1;
+  x = env_get("PERSERVER");
+  if (x) scan_ulong(x,&perserver);
+  if (perserver < 1) perserver = 1;
+
+  readzones(argv[1]);
+  if (maxconn > numzones) maxconn = numzones ? numzones : 1;
+  hashzones();
+
+  x = env_get("IP");
+  if (x) {
+    if (!ip4_scan(x,ip))
+      strerr_die3x(111,FATAL,"unable to parse IP address ",x);
+    udp53 = socket_udp();
+    if (udp53 == -1)
+      strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+    if (socket_bind4_reuse(udp53,ip,53) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+  }
+
+  heap = (struct zone **) alloc((numzones + 1) * sizeof(struct zone *));
+  if (!heap) nomem();
+  conn = (struct conn *) alloc(maxconn * sizeof(struct conn));
+  if (!conn) nomem();
+  byte_zero(conn,maxconn * sizeof(struct conn));
+  for (i = 0;i < maxconn;++i) conn[i].fd = -1;
+  io = (iopause_fd *) alloc((maxconn + 1) * sizeof(iopause_fd));
+  if (!io) nomem();
+
+  taia_now(&now);
+  for (i = 0;i < numzones;++i) schedule(zone + i,0);
+
+  iopause_persistent();
+
+  for (;;) {
+    taia_now(&now);
+
+    while (heaplen && !taia_less(&now,&heap[0]->when)) {
+      z = heap_pop();
+      s = server + z->server;
+      if (s->head) s->tail->next = z;
+      else s->head = z;
+      s->tail = z;
+    }
+    for (i = 0;(i < numservers) && (numconn < maxconn);++i)
+      while (server[i].head && (server[i].active < perserver) && (numconn < maxconn))
+        start(server + i);
+
+    taia_uint(&deadline,60);
+    taia_add(&deadline,&deadline,&now);
+    if (heaplen && taia_less(&heap[0]->when,&deadline)) deadline = heap[0]->when;
+
+    iolen = 0;
+    for (i = 0;i < maxconn;++i) {
+      c = conn + i;
+      if (c->fd == -1) continue;
+      c->io = io + iolen++;
+      c->io->fd = c->fd;
+      c->io->events = c->flagconnected ? IOPAUSE_READ : IOPAUSE_WRITE;
+      if (taia_less(&c->deadline,&deadline)) deadline = c->deadline;
+    }
+    if (udp53 != -1) {
+      io[iolen].fd = udp53;
+      io[iolen].events = IOPAUSE_READ;
+      ++iolen;
+    }
+
+    iopause(io,iolen,&deadline,&now);
+    taia_now(&now);
+
+    if (udp53 != -1)
+      if (io[iolen - 1].revents)
+        while ((r = socket_recv4(udp53,buf,sizeof buf,ip,&port)) != -1)
+          notify(buf,r,ip,port);
+
+    for (i = 0;i < maxconn;++i) {
+      c = conn + i;
+      if (c->fd == -1) continue;
+      doio(c);
+      if (c->fd == -1) continue;
+      if (!taia_less(&now,&c->deadline)) {
+        errno = error_timeout;
+        finish(c,"timeout");
+      }
+    }
+  }
+}
@@ -1,5 +1,15 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <setjmp.h>
 #include "droproot.h"
+#include "error.h"
 #include "exit.h"
 #include "env.h"
 #include "uint32.h"
@@ -9,161 +19,382 @@
 #include "buffer.h"
 #include "timeoutread.h"
 #include "timeoutwrite.h"
+#include "iopause.h"
+#include "socket.h"
+#include "ndelay.h"
+#include "cdbmap.h"
+#include "txtdict.h"
 #include "open.h"
-#include "seek.h"
 #include "cdb.h"
+#include "clientloc.h"
 #include "stralloc.h"
+#include "alloc.h"
 #include "strerr.h"
 #include "str.h"
 #include "byte.h"
 #include "case.h"
 #include "dns.h"
 #include "scan.h"
+#include "fmt.h"
 #include "qlog.h"
 #include "response.h"
 
-extern int respond(char *,char *,char *);
+extern int respond(char *,char *,char *,uint32);
 
 #define FATAL "axfrdns: fatal: "
+#define WARNING "axfrdns: warning: "
+
+/*
+With $DAEMON set, axfrdns does not run under tcpserver. It listens on
+$IP port 53 itself and serves up to MAXTCP connections in one
+process, the oldest going when another arrives. Each answer is put
+together into the connection's out, and goes out as the client reads
+it; a connection whose client falls behind by TCPOUT bytes is not
+read from until it catches up, so a slow secondary holds up nobody
+else. A full transfer is put together TCPOUT bytes at a time, the
+next part only once the client has read the last, from the data.cdb
+it started with, opened for it; see struct xfer. A transfer from
+$AXFRSPOOL goes out from the file, one message at a time. A failure
+that would end axfrdns under tcpserver ends only the connection.
+$AXFR applies to every client; there are no tcprules. A connection
+idle for 60 seconds is closed.
+*/
+
+#define MAXTCP 100
+#define TCPBUF 514
+#define TCPOUT 65536
+
+/*
+Where a full transfer stopped: what doaxfr() was using, put aside by
+xferswap() while the connection catches up, and swapped back in to
+carry on. Between queries the globals hold no transfer, with fdcdb
+and spoolfd -1, and that is what a stopped transfer leaves behind.
+*/
+
+struct xfer {
+  struct cdb c;
+  int fdcdb;
+  struct cdb_scan scan;
+  int flagscan;
+  stralloc ranges;
+  unsigned int range;
+  stralloc soa;
+  char zone[DNS_NAME];
+  unsigned int zonelen;
+  char clientloc[2];
+  struct tai now;
+  int flagtimed;
+  int spoolfd;
+  stralloc spooltmp;
+  stralloc spoolfn;
+  buffer bspool;
+} ;
+
+struct tcpclient {
+  int tcp; /* -1: free */
+  char ip[4];
+  uint16 port;
+  struct taia timeout;
+  char buf[TCPBUF];
+  unsigned int len;
+  stralloc out;
+  unsigned int pos;
+  iopause_fd *io;
+  int spool; /* -1, or a spool file being sent */
+  char *map;
+  uint64 size;
+  uint64 off; /* next byte to send, in a message ending at end */
+  uint64 end;
+  char id[2];
+  int flagxfer; /* xfer holds a full transfer to carry on */
+  struct xfer xfer;
+} ;
+
+static int flagdaemon = 0;
+static struct tcpclient *cur = 0; /* with $DAEMON, the one being answered */
+static jmp_buf dropped; /* with $DAEMON, where a failure goes */
+
+static int spoolfd = -1; /* writing spooltmp; see spoolstart() */
+static stralloc spooltmp;
+
+static buffer bspool;
+
+static void spoolabandon(void)
+{
+  if (spoolfd == -1) return;
+  close(spoolfd);
+  unlink(spooltmp.s);
+  spoolfd = -1;
+  alloc_free(bspool.x);
+}
+
+/* ends axfrdns, or with $DAEMON only the connection */
+static void fail(const char *x,const char *y,const struct strerr *se)
+{
+  spoolabandon();
+  if (!flagdaemon) strerr_die(111,FATAL,x,y,0,0,0,se);
+  strerr_warn(WARNING,x,y,0,0,0,se);
+  longjmp(dropped,1);
+}
 
 void nomem()
 {
-  strerr_die2x(111,FATAL,"out of memory");
+  fail("out of memory",0,0);
 }
 void die_truncated()
 {
-  strerr_die2x(111,FATAL,"truncated request");
+  fail("truncated request",0,0);
 }
 void die_netwrite()
 {
-  strerr_die2sys(111,FATAL,"unable to write to network: ");
+  fail("unable to write to network: ",0,&strerr_sys);
 }
 void die_netread()
 {
-  strerr_die2sys(111,FATAL,"unable to read from network: ");
+  fail("unable to read from network: ",0,&strerr_sys);
 }
 void die_outside()
 {
-  strerr_die2x(111,FATAL,"unable to locate information in data.cdb");
+  fail("unable to locate information in data.cdb",0,0);
 }
 void die_cdbread()
 {
-  strerr_die2sys(111,FATAL,"unable to read data.cdb: ");
+  fail("unable to read data.cdb: ",0,&strerr_sys);
 }
 void die_cdbformat()
 {
-  strerr_die3x(111,FATAL,"unable to read data.cdb: ","format error");
+  fail("unable to read data.cdb: ","format error",0);
 }
 
 int safewrite(int fd,char *buf,unsigned int len)
 {
   int w;
 
+  if (cur) {
+    if (!stralloc_catb(&cur->out,buf,len)) nomem();
+    return len;
+  }
   w = timeoutwrite(60,fd,buf,len);
   if (w <= 0) die_netwrite();
   return w;
 }
 
-char netwritespace[1024];
+int safewritev(int fd,struct iovec *v,int n)
+{
+  int w;
+  int i;
+
+  if (cur) {
+    for (w = i = 0;i < n;++i) {
+      if (!stralloc_catb(&cur->out,v[i].iov_base,v[i].iov_len)) nomem();
+      w += v[i].iov_len;
+    }
+    return w;
+  }
+  w = timeoutwritev(60,fd,v,n);
+  if (w <= 0) die_netwrite();
+  return w;
+}
+
+char netwritespace[65536];
 buffer netwrite = BUFFER_INIT(safewrite,1,netwritespace,sizeof netwritespace);
 
-void print(char *buf,unsigned int len)
+/*
+With $AXFRSPOOL, a directory, each full transfer is also written
+there as sent, each message with its ID cleared, in a file for its
+zone and client location. The file starts with a key: the zone, the
+location, the SOA serial and which data.cdb the transfer came from.
+A later transfer whose key matches is sent from the file, each
+message with the client's ID, the rest by sendfile() where the
+system has it; so records are encoded once for each version of a
+zone, not once for each secondary. A transfer is written under a
+temporary name and renamed into place once complete. A zone with
+records that appear or expire at a set time is not kept, since what
+it sends depends on when.
+*/
+
+#define SPOOLBUF 8192
+
+static char *spooldir;
+static stralloc spoolkey;
+static stralloc spoolfn;
+static unsigned long spoolseq; /* with the pid, names spooltmp */
+static int flagtimed; /* the transfer has records with a ttd */
+
+static void spoolput(const char *buf,unsigned int len)
+{
+  char header[4];
+
+  if (spoolfd == -1) return;
+  uint16_pack_big(header,len);
+  byte_zero(header + 2,2);
+  if (buffer_put(&bspool,header,4) == -1) { spoolabandon(); return; }
+  if (buffer_put(&bspool,buf + 2,len - 2) == -1) spoolabandon();
+}
+
+void put(char *buf,unsigned int len)
 {
   char tcpheader[2];
+  spoolput(buf,len);
   uint16_pack_big(tcpheader,len);
   buffer_put(&netwrite,tcpheader,2);
   buffer_put(&netwrite,buf,len);
-  buffer_flush(&netwrite);
 }
 
+/* the message goes out with the header and anything queued, uncopied */
+void print(char *buf,unsigned int len)
+{
+  char tcpheader[2];
+  spoolput(buf,len);
+  uint16_pack_big(tcpheader,len);
+  buffer_put(&netwrite,tcpheader,2);
+  buffer_flushv(&netwrite,safewritev,buf,len);
+}
+
+/*
+$AXFR is read once, by axfrzones(), into a hash table of the zones it
+allows, lowercased, so axfrcheck() costs the same for one zone as for
+thousands.
+*/
+
 char *axfr;
-static char *axfrok;
+static stralloc axfrnames; /* the zones, one after another */
+static unsigned int *axfrset; /* 1 + position in axfrnames, or 0 */
+static unsigned int axfrmask;
 
-void axfrcheck(char *q)
+static unsigned int *axfrslot(const char *q,unsigned int len)
+{
+  unsigned int i;
+  const char *d;
+
+  i = cdb_hash(q,len) & axfrmask;
+  while (axfrset[i]) {
+    d = axfrnames.s + axfrset[i] - 1;
+    if ((dns_domain_length(d) == len) && byte_equal(d,len,q)) break;
+    i = (i + 1) & axfrmask;
+  }
+  return axfrset + i;
+}
+
+void axfrzones(void)
 {
+  char *q = 0;
+  unsigned int *slot;
+  unsigned int num;
+  unsigned int len;
+  unsigned int n;
   int i;
   int j;
 
   if (!axfr) return;
 
+  num = 1;
+  for (i = 0;axfr[i];++i)
+    if (axfr[i] == '/') ++num;
+  for (n = 64;n < 2 * num;n <<= 1) ;
+  axfrset = (unsigned int *) alloc(n * sizeof(unsigned int));
+  if (!axfrset) nomem();
+  byte_zero(axfrset,n * sizeof(unsigned int));
+  axfrmask = n - 1;
+
   i = j = 0;
   for (;;) {
     if (!axfr[i] || (axfr[i] == '/')) {
       if (i > j) {
-        if (!dns_domain_fromdot(&axfrok,axfr + j,i - j)) nomem();
-        if (dns_domain_equal(q,axfrok)) return;
+        if (!dns_domain_fromdot(&q,axfr + j,i - j)) nomem();
+        len = dns_domain_length(q);
+        case_lowerb(q,len);
+        slot = axfrslot(q,len);
+        if (!*slot) {
+          *slot = axfrnames.len + 1;
+          if (!stralloc_catb(&axfrnames,q,len)) nomem();
+        }
       }
       j = i + 1;
     }
     if (!axfr[i]) break;
     ++i;
   }
+  dns_domain_free(&q);
+}
 
-  strerr_die2x(111,FATAL,"disallowed zone transfer request");
+/* q is lowercased */
+void axfrcheck(char *q)
+{
+  if (!axfr) return;
+  if (*axfrslot(q,dns_domain_length(q))) return;
+  fail("disallowed zone transfer request",0,0);
 }
 
-static char *zone;
+static char zone[DNS_NAME];
 unsigned int zonelen;
 char typeclass[4];
 
-int fdcdb;
-buffer bcdb;
-char bcdbspace[1024];
-
-void get(char *buf,unsigned int len)
-{
-  int r;
-
-  while (len > 0) {
-    r = buffer_get(&bcdb,buf,len);
-    if (r < 0) die_cdbread();
-    if (!r) die_cdbformat();
-    buf += r;
-    len -= r;
-  }
-}
+int fdcdb = -1;
 
 char ip[4];
 unsigned long port;
 char clientloc[2];
 
 struct tai now;
+static struct cdb c;
 char data[32767];
 uint32 dlen;
 uint32 dpos;
 
+/* from tinydns-data's "\0c", for records packed as txtdict_pack() does */
+static char dict[TXTDICT_MAX];
+static unsigned int dictlen;
+static char unpacked[32767];
+
+static void dictread(void)
+{
+  dictlen = 0;
+  if (cdb_find(&c,"\0c",2) != 1) return;
+  if (cdb_datalen(&c) > sizeof dict) die_cdbformat();
+  if (cdb_read(&c,dict,cdb_datalen(&c),cdb_datapos(&c)) == -1) die_cdbread();
+  dictlen = cdb_datalen(&c);
+}
+
 void copy(char *buf,unsigned int len)
 {
   dpos = dns_packet_copy(data,dlen,dpos,buf,len);
   if (!dpos) die_cdbread();
 }
 
-void doname(stralloc *sa)
+int doname(void)
 {
-  static char *d;
-  dpos = dns_packet_getname(data,dlen,dpos,&d);
+  static char d[DNS_NAME];
+  dpos = dns_packet_getnamebuf(data,dlen,dpos,d);
   if (!dpos) die_cdbread();
-  if (!stralloc_catb(sa,d,dns_domain_length(d))) nomem();
+  return response_addname(d);
 }
 
-int build(stralloc *sa,char *q,int flagsoa,char id[2])
+/* adds one record to the message in response: 1 if added, 0 if */
+/* not in this zone transfer, -1 if it does not fit */
+
+int build(char *q,int flagsoa)
 {
-  unsigned int rdatapos;
   char misc[20];
   char type[2];
   char recordloc[2];
   char ttl[4];
   char ttd[8];
+  char owner[257];
   struct tai cutoff;
+  uint32 u;
+  int flagpacked;
+  int r;
 
   dpos = 0;
   copy(type,2);
+  if (byte_equal(type,2,"\0\0")) return 0; /* tombstone */
   if (flagsoa) if (byte_diff(type,2,DNS_T_SOA)) return 0;
   if (!flagsoa) if (byte_equal(type,2,DNS_T_SOA)) return 0;
 
-  if (!stralloc_copyb(sa,id,2)) nomem();
-  if (!stralloc_catb(sa,"\204\000\0\0\0\1\0\0\0\0",10)) nomem();
   copy(misc,1);
+  flagpacked = !!(misc[0] & 128);
+  misc[0] &= 127;
   if ((misc[0] == '=' + 1) || (misc[0] == '*' + 1)) {
     --misc[0];
     copy(recordloc,2);
@@ -171,14 +402,15 @@ int build(stralloc *sa,char *q,int flagsoa,char id[2])
   }
   if (misc[0] == '*') {
     if (flagsoa) return 0;
-    if (!stralloc_catb(sa,"\1*",2)) nomem();
+    byte_copy(owner,2,"\1*");
+    byte_copy(owner + 2,dns_domain_length(q),q);
+    q = owner;
   }
-  if (!stralloc_catb(sa,q,dns_domain_length(q))) nomem();
-  if (!stralloc_catb(sa,type,2)) nomem();
 
   copy(ttl,4);
   copy(ttd,8);
   if (byte_diff(ttd,8,"\0\0\0\0\0\0\0\0")) {
+    flagtimed = 1;
     tai_unpack(ttd,&cutoff);
     if (byte_equal(ttl,4,"\0\0\0\0")) {
       if (tai_less(&cutoff,&now)) return 0;
@@ -187,66 +419,416 @@ int build(stralloc *sa,char *q,int flagsoa,char id[2])
     else
       if (!tai_less(&cutoff,&now)) return 0;
   }
+  uint32_unpack_big(ttl,&u);
 
-  if (!stralloc_catb(sa,DNS_C_IN,2)) nomem();
-  if (!stralloc_catb(sa,ttl,4)) nomem();
-  if (!stralloc_catb(sa,"\0\0",2)) nomem();
-  rdatapos = sa->len;
+  if (!response_rstart(q,type,u)) return -1;
 
   if (byte_equal(type,2,DNS_T_SOA)) {
-    doname(sa);
-    doname(sa);
+    if (!doname()) return -1;
+    if (!doname()) return -1;
     copy(misc,20);
-    if (!stralloc_catb(sa,misc,20)) nomem();
+    if (!response_addbytes(misc,20)) return -1;
   }
   else if (byte_equal(type,2,DNS_T_NS) || byte_equal(type,2,DNS_T_PTR) || byte_equal(type,2,DNS_T_CNAME)) {
-    doname(sa);
+    if (!doname()) return -1;
   }
   else if (byte_equal(type,2,DNS_T_MX)) {
     copy(misc,2);
-    if (!stralloc_catb(sa,misc,2)) nomem();
-    doname(sa);
+    if (!response_addbytes(misc,2)) return -1;
+    if (!doname()) return -1;
+  }
+  else if (flagpacked) {
+    r = txtdict_unpack(dict,dictlen,data + dpos,dlen - dpos,unpacked,sizeof unpacked);
+    if (r == -1) die_cdbformat();
+    if (!response_addbytes(unpacked,r)) return -1;
   }
   else
-    if (!stralloc_catb(sa,data + dpos,dlen - dpos)) nomem();
+    if (!response_addbytes(data + dpos,dlen - dpos)) return -1;
 
-  if (sa->len > 65535) die_cdbformat();
-  uint16_pack_big(sa->s + rdatapos - 2,sa->len - rdatapos);
+  response_rfinish(RESPONSE_ANSWER);
   return 1;
 }
 
-static struct cdb c;
-static char *q;
+/* messages carry as many records as fit, names compressed */
+
+void start(char id[2])
+{
+  char header[12];
+
+  byte_copy(header,2,id);
+  byte_copy(header + 2,10,"\204\000\0\0\0\0\0\0\0\0");
+  response_restore(header,12,12);
+}
+
+void answer(char *q,int flagsoa,char id[2])
+{
+  unsigned int len = response_len;
+
+  if (build(q,flagsoa) != -1) return;
+  if (len <= 12) die_cdbformat();
+  response_len = len;
+  put(response,response_len);
+  start(id);
+  if (build(q,flagsoa) == -1) die_cdbformat();
+}
+
+static char q[DNS_NAME];
 static stralloc soa;
-static stralloc message;
 
-void doaxfr(char id[2])
+/* with a zone index from tinydns-data, only the zone's ranges are read */
+
+static stralloc ranges; /* 16 bytes each: first, last */
+static unsigned int range; /* the next one to scan */
+static struct cdb_scan scan;
+static int flagscan; /* scan is in a range */
+
+static uint64 unpack64(const char *s)
+{
+  uint32 lo;
+  uint32 hi;
+
+  uint32_unpack(s,&lo);
+  uint32_unpack(s + 4,&hi);
+  return ((uint64) hi << 32) + lo;
+}
+
+static void pack64(char *s,uint64 u)
+{
+  uint32_pack(s,(uint32) u);
+  uint32_pack(s + 4,(uint32) (u >> 32));
+}
+
+/* sends the records in zone from the ranges: 1 once all are sent, */
+/* 0 with $DAEMON when the connection has TCPOUT bytes to go, at the */
+/* end of a message, scan set to give the next record again */
+
+static int records(char id[2])
+{
+  unsigned int len;
+  unsigned int i;
+  uint64 pos;
+  int r;
+  struct dns_domain owner;
+  struct dns_domain zonedn;
+
+  dns_domain_handle(&zonedn,zone);
+
+  for (;;) {
+    if (!flagscan) {
+      if (range == ranges.len) return 1;
+      cdb_scanstart(&scan,&c,unpack64(ranges.s + range),unpack64(ranges.s + range + 8));
+      range += 16;
+      flagscan = 1;
+    }
+    pos = scan.pos;
+    r = cdb_scannext(&scan);
+    if (r == -1) {
+      if (errno == error_proto) die_cdbformat();
+      die_cdbread();
+    }
+    if (!r) { flagscan = 0; continue; }
+    if ((scan.klen > 1) && (scan.key[0] == 0)) continue; /* location or index */
+    if (scan.klen < 1) die_cdbformat();
+    i = dns_packet_getnamebuf(scan.key,scan.klen,0,q); /* then any location */
+    if ((i != scan.klen) && (i + 2 != scan.klen)) die_cdbformat();
+    owner.dn = q;
+    owner.len = i;
+    if (!dns_domain_under(&owner,&zonedn)) continue;
+    dlen = scan.dlen;
+    if (dlen > sizeof data) die_cdbformat();
+    byte_copy(data,dlen,scan.data);
+    if (cur && (cur->out.len + netwrite.p >= TCPOUT)) {
+      len = response_len;
+      if (build(q,0) != -1) continue;
+      if (len <= 12) die_cdbformat();
+      response_len = len;
+      put(response,response_len);
+      scan.pos = pos;
+      return 0;
+    }
+    answer(q,0,id);
+  }
+}
+
+/*
+IXFR: the changes from the client's serial up to the current one,
+taken from the journal that tinydns-data keeps under "\0j" and the
+zone. Each change goes out as the old SOA record, the records
+deleted, the new SOA record and the records added, all between two
+copies of the current SOA record. Without a journal that reaches
+the client's serial, the answer is a full AXFR.
+*/
+
+static stralloc journal;
+
+/* sends the SOA records at the zone name in s, then the rest */
+
+void part(char *s,uint32 len,char id[2])
 {
-  char key[512];
   uint32 klen;
-  char num[4];
-  uint32 eod;
-  uint32 pos;
+  uint32 i;
+  int flagsoa;
+
+  for (flagsoa = 1;flagsoa >= 0;--flagsoa)
+    for (i = 0;i < len;i += 8 + klen + dlen) {
+      if (len - i < 8) die_cdbformat();
+      uint32_unpack(s + i,&klen);
+      uint32_unpack(s + i + 4,&dlen);
+      if ((klen > len - i - 8) || (dlen > len - i - 8 - klen)) die_cdbformat();
+      if (dlen > sizeof data) die_cdbformat();
+      if (flagsoa && !dns_domain_equal(s + i + 8,zone)) continue;
+      byte_copy(data,dlen,s + i + 8 + klen);
+      answer(s + i + 8,flagsoa,id);
+    }
+}
+
+void soaserial(char serial[4])
+{
+  char misc[1];
+
+  dpos = 2;
+  copy(misc,1);
+  dpos += (misc[0] == '>') ? 14 : 12;
+  dpos = dns_packet_skipname(data,dlen,dpos);
+  if (dpos) dpos = dns_packet_skipname(data,dlen,dpos);
+  if (!dpos) die_cdbformat();
+  copy(serial,4);
+}
+
+/* 1 if the journal leads from serial to current, and is sent */
+
+int changes(char *serial,char current[4],char id[2])
+{
+  uint32 i;
+  uint32 u;
+  uint32 v;
+  uint32 from = 0;
+  int flagfound = 0;
+
+  for (i = 0;i < journal.len;i += 16 + u + v) {
+    if (journal.len - i < 16) die_cdbformat();
+    uint32_unpack(journal.s + i + 8,&u);
+    uint32_unpack(journal.s + i + 12,&v);
+    if ((u > journal.len) || (v > journal.len - u)) die_cdbformat();
+    if (journal.len - i - 16 < u + v) die_cdbformat();
+    if (byte_diff(journal.s + i,4,serial)) {
+      if (flagfound) return 0;
+      continue;
+    }
+    if (!flagfound) from = i;
+    flagfound = 1;
+    serial = journal.s + i + 4;
+  }
+  if (!flagfound || byte_diff(serial,4,current)) return 0;
+
+  for (i = from;i < journal.len;i += 16 + u + v) {
+    uint32_unpack(journal.s + i + 8,&u);
+    uint32_unpack(journal.s + i + 12,&v);
+    part(journal.s + i + 16,u,id);
+    part(journal.s + i + 16 + u,v,id);
+  }
+  return 1;
+}
+
+static void cork(int fd,int flag)
+{
+#ifdef TCP_CORK
+  setsockopt(fd,IPPROTO_TCP,TCP_CORK,&flag,sizeof flag);
+#endif
+}
+
+static void spoolname(char serial[4])
+{
+  char key[32];
+  char strnum[FMT_ULONG];
+  struct stat st;
+  uint32 h = 5381;
+  unsigned int i;
+
+  if (fstat(fdcdb,&st) == -1) die_cdbread();
+  uint32_pack(key,st.st_dev);
+  uint32_pack(key + 4,st.st_ino);
+  uint32_pack(key + 8,st.st_ino >> 16 >> 16);
+  uint32_pack(key + 12,st.st_mtime);
+  uint32_pack(key + 16,st.st_size);
+  uint32_pack(key + 20,((uint64) st.st_size) >> 32);
+  byte_copy(key + 24,4,serial);
+  byte_copy(key + 28,2,clientloc);
+  if (!stralloc_copyb(&spoolkey,key,30)) nomem();
+  if (!stralloc_catb(&spoolkey,zone,zonelen)) nomem();
+
+  for (i = 28;i < spoolkey.len;++i) /* location and zone */
+    h = (h + (h << 5)) ^ (unsigned char) spoolkey.s[i];
+  if (!stralloc_copys(&spoolfn,spooldir)) nomem();
+  if (!stralloc_cats(&spoolfn,"/")) nomem();
+  if (!stralloc_catb(&spoolfn,strnum,fmt_ulong(strnum,h))) nomem();
+  if (!stralloc_copy(&spooltmp,&spoolfn)) nomem();
+  if (!stralloc_0(&spoolfn)) nomem();
+  if (!stralloc_cats(&spooltmp,".tmp")) nomem();
+  if (!stralloc_catb(&spooltmp,strnum,fmt_ulong(strnum,getpid()))) nomem();
+  if (!stralloc_cats(&spooltmp,".")) nomem();
+  if (!stralloc_catb(&spooltmp,strnum,fmt_ulong(strnum,++spoolseq))) nomem();
+  if (!stralloc_0(&spooltmp)) nomem();
+}
+
+/* 1 if the transfer went out from the spool */
+static int spoolsend(char id[2])
+{
+  struct stat st;
+  char header[4];
+  char *map;
+  uint64 pos;
+  uint64 off;
+  uint64 size;
+  uint16 len;
+  int fd;
+  int w;
+
+  fd = open_read(spoolfn.s);
+  if (fd == -1) return 0;
+  if (fstat(fd,&st) == -1) { close(fd); return 0; }
+  size = st.st_size;
+  if (size < 2 + spoolkey.len) { close(fd); return 0; }
+  map = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
+  if (map == MAP_FAILED) { close(fd); return 0; }
+
+  uint16_unpack_big(map,&len);
+  pos = 2 + len;
+  if ((len != spoolkey.len) || byte_diff(map + 2,len,spoolkey.s)) pos = 0;
+  if (pos) /* every message whole, before any goes out */
+    while (pos < size) {
+      if (size - pos < 4) { pos = 0; break; }
+      uint16_unpack_big(map + pos,&len);
+      if ((len < 12) || (size - pos - 2 < len)) { pos = 0; break; }
+      pos += 2 + len;
+    }
+  if (!pos) { munmap(map,size); close(fd); return 0; }
+
+  if (cur) { /* t_spool() sends it */
+    cur->spool = fd;
+    cur->map = map;
+    cur->size = size;
+    cur->off = cur->end = 2 + spoolkey.len;
+    byte_copy(cur->id,2,id);
+    cork(cur->tcp,1);
+    return 1;
+  }
+
+  cork(1,1);
+  for (pos = 2 + spoolkey.len;pos < size;pos += 2 + len) {
+    uint16_unpack_big(map + pos,&len);
+    byte_copy(header,2,map + pos);
+    byte_copy(header + 2,2,id);
+    buffer_put(&netwrite,header,4);
+    buffer_flush(&netwrite);
+    off = pos + 4;
+    while (off < pos + 2 + len) {
+      w = timeoutsendfile(60,1,fd,&off,(unsigned int) (pos + 2 + len - off));
+      if (w <= 0) die_netwrite();
+    }
+  }
+  cork(1,0);
+  munmap(map,size);
+  close(fd);
+  return 1;
+}
+
+static void spoolstart(void)
+{
+  char header[2];
+  char *x;
+
+  x = alloc(SPOOLBUF);
+  if (!x) return;
+  spoolfd = open_trunc(spooltmp.s);
+  if (spoolfd == -1) { alloc_free(x); return; }
+  buffer_init(&bspool,buffer_unixwrite,spoolfd,x,SPOOLBUF);
+  uint16_pack_big(header,spoolkey.len);
+  if (buffer_put(&bspool,header,2) == -1) { spoolabandon(); return; }
+  if (buffer_put(&bspool,spoolkey.s,spoolkey.len) == -1) spoolabandon();
+}
+
+static void spoolfinish(void)
+{
+  if (spoolfd == -1) return;
+  if (flagtimed) { spoolabandon(); return; }
+  if (buffer_flush(&bspool) == -1) { spoolabandon(); return; }
+  if (fsync(spoolfd) == -1) { spoolabandon(); return; }
+  alloc_free(bspool.x);
+  if (close(spoolfd) == -1) { spoolfd = -1; unlink(spooltmp.s); return; }
+  spoolfd = -1;
+  if (rename(spooltmp.s,spoolfn.s) == -1) unlink(spooltmp.s);
+}
+
+static void xferfinish(char id[2])
+{
+  byte_copy(data,soa.len,soa.s);
+  dlen = soa.len;
+  answer(zone,1,id);
+  print(response,response_len);
+  spoolfinish();
+}
+
+static void swapbytes(void *a,void *b,unsigned int len)
+{
+  char *x = a;
+  char *y = b;
+  char ch;
+
+  while (len--) { ch = *x; *x++ = *y; *y++ = ch; }
+}
+
+#define SWAP(g,f) swapbytes(&(g),&(f),sizeof (g))
+
+static void xferswap(struct tcpclient *x)
+{
+  SWAP(c,x->xfer.c);
+  SWAP(fdcdb,x->xfer.fdcdb);
+  SWAP(scan,x->xfer.scan);
+  SWAP(flagscan,x->xfer.flagscan);
+  SWAP(ranges,x->xfer.ranges);
+  SWAP(range,x->xfer.range);
+  SWAP(soa,x->xfer.soa);
+  SWAP(zone,x->xfer.zone);
+  SWAP(zonelen,x->xfer.zonelen);
+  SWAP(clientloc,x->xfer.clientloc);
+  SWAP(now,x->xfer.now);
+  SWAP(flagtimed,x->xfer.flagtimed);
+  SWAP(spoolfd,x->xfer.spoolfd);
+  SWAP(spooltmp,x->xfer.spooltmp);
+  SWAP(spoolfn,x->xfer.spoolfn);
+  SWAP(bspool,x->xfer.bspool);
+}
+
+/* with $DAEMON: the rest waits in cur until its client catches up */
+static void xferstop(char id[2])
+{
+  buffer_flush(&netwrite);
+  byte_copy(cur->id,2,id);
+  xferswap(cur);
+  cur->flagxfer = 1;
+}
+
+void doaxfr(char id[2],char *serial)
+{
+  char zkey[259];
+  char current[4];
+  uint64 eod;
+  uint64 first;
+  uint64 last;
+  unsigned int i;
   int r;
 
   axfrcheck(zone);
 
   tai_now(&now);
-  cdb_init(&c,fdcdb);
+  flagtimed = 0;
 
-  byte_zero(clientloc,2);
-  key[0] = 0;
-  key[1] = '%';
-  byte_copy(key + 2,4,ip);
-  r = cdb_find(&c,key,6);
-  if (!r) r = cdb_find(&c,key,5);
-  if (!r) r = cdb_find(&c,key,4);
-  if (!r) r = cdb_find(&c,key,3);
-  if (!r) r = cdb_find(&c,key,2);
-  if (r == -1) die_cdbread();
-  if (r && (cdb_datalen(&c) == 2))
-    if (cdb_read(&c,clientloc,2,cdb_datapos(&c)) == -1) die_cdbread();
+  clientloc_init(&c);
+  if (clientloc_find(&c,ip,clientloc) == -1) die_cdbread();
+  dictread();
 
+  start(id);
   cdb_findstart(&c);
   for (;;) {
     r = cdb_findnext(&c,zone,zonelen);
@@ -255,45 +837,94 @@ void doaxfr(char id[2])
     dlen = cdb_datalen(&c);
     if (dlen > sizeof data) die_cdbformat();
     if (cdb_read(&c,data,dlen,cdb_datapos(&c)) == -1) die_cdbformat();
-    if (build(&soa,zone,1,id)) break;
+    r = build(zone,1);
+    if (r == -1) die_cdbformat();
+    if (r) break;
   }
+  if (!stralloc_copyb(&soa,data,dlen)) nomem();
 
-  cdb_free(&c);
-  print(soa.s,soa.len);
-
-  seek_begin(fdcdb);
-  buffer_init(&bcdb,buffer_unixread,fdcdb,bcdbspace,sizeof bcdbspace);
-
-  pos = 0;
-  get(num,4); pos += 4;
-  uint32_unpack(num,&eod);
-  while (pos < 2048) { get(num,4); pos += 4; }
-
-  while (pos < eod) {
-    if (eod - pos < 8) die_cdbformat();
-    get(num,4); pos += 4;
-    uint32_unpack(num,&klen);
-    get(num,4); pos += 4;
-    uint32_unpack(num,&dlen);
-    if (eod - pos < klen) die_cdbformat();
-    pos += klen;
-    if (eod - pos < dlen) die_cdbformat();
-    pos += dlen;
-
-    if (klen > sizeof key) die_cdbformat();
-    get(key,klen);
-    if (dlen > sizeof data) die_cdbformat();
-    get(data,dlen);
+  if (serial) {
+    soaserial(current);
+    if (byte_equal(serial,4,current)) {
+      print(response,response_len);
+      return;
+    }
+    byte_copy(zkey,2,"\0j");
+    byte_copy(zkey + 2,zonelen,zone);
+    r = cdb_find(&c,zkey,zonelen + 2);
+    if (r == -1) die_cdbread();
+    journal.len = 0;
+    if (r) {
+      if (!stralloc_ready(&journal,cdb_datalen(&c))) nomem();
+      if (cdb_read(&c,journal.s,cdb_datalen(&c),cdb_datapos(&c)) == -1) die_cdbread();
+      journal.len = cdb_datalen(&c);
+    }
+    if (changes(serial,current,id)) {
+      byte_copy(data,soa.len,soa.s);
+      dlen = soa.len;
+      answer(zone,1,id);
+      print(response,response_len);
+      return;
+    }
+  }
+
+  if (spooldir) {
+    byte_copy(data,soa.len,soa.s);
+    dlen = soa.len;
+    soaserial(current);
+    spoolname(current);
+    if (!flagtimed && spoolsend(id)) return;
+    spoolstart();
+  }
 
-    if ((klen > 1) && (key[0] == 0)) continue; /* location */
-    if (klen < 1) die_cdbformat();
-    if (dns_packet_getname(key,klen,0,&q) != klen) die_cdbformat();
-    if (!dns_domain_suffix(q,zone)) continue;
-    if (!build(&message,q,0,id)) continue;
-    print(message.s,message.len);
+  byte_copy(zkey,2,"\0z");
+  byte_copy(zkey + 2,zonelen,zone);
+  r = cdb_find(&c,zkey,zonelen + 2);
+  if (r == -1) die_cdbread();
+  if (r) {
+    dlen = cdb_datalen(&c);
+    if (dlen & 15) die_cdbformat();
+    if (!stralloc_ready(&ranges,dlen)) nomem();
+    if (cdb_read(&c,ranges.s,dlen,cdb_datapos(&c)) == -1) die_cdbread();
+    ranges.len = dlen;
   }
 
-  print(soa.s,soa.len);
+  if (cdb_eod(&c,&eod) == -1) die_cdbread();
+
+  if (!r) {
+    if (!stralloc_ready(&ranges,16)) nomem();
+    pack64(ranges.s,2048);
+    pack64(ranges.s + 8,eod);
+    ranges.len = 16;
+  }
+  else
+    for (i = 0;i < ranges.len;i += 16) {
+      first = unpack64(ranges.s + i);
+      last = unpack64(ranges.s + i + 8);
+      if ((first < 2048) || (first > last) || (last > eod)) die_cdbformat();
+    }
+
+  range = 0;
+  flagscan = 0;
+  if (!records(id)) { xferstop(id); return; }
+  xferfinish(id);
+}
+
+static void cdbopen(void)
+{
+  fdcdb = open_read("data.cdb");
+  if (fdcdb == -1) die_cdbread();
+  cdb_init(&c,fdcdb);
+}
+
+static void cdbclose(void)
+{
+  if (fdcdb == -1) return;
+  cdb_scanfree(&scan);
+  flagscan = 0;
+  cdb_free(&c);
+  close(fdcdb);
+  fdcdb = -1;
 }
 
 void netread(char *buf,unsigned int len)
@@ -312,20 +943,314 @@ char tcpheader[2];
 char buf[512];
 uint16 len;
 
-static char seed[128];
-
-int main()
+/* answers the query in buf */
+static void query(void)
 {
   unsigned int pos;
   char header[12];
   char qtype[2];
   char qclass[2];
+  char serial[4];
+  char misc[10];
+
+  pos = dns_packet_copy(buf,len,0,header,12); if (!pos) die_truncated();
+  if (header[2] & 254) fail("bogus query",0,0);
+  if (header[4] || (header[5] != 1)) fail("bogus query",0,0);
+
+  pos = dns_packet_getnamebuf(buf,len,pos,zone); if (!pos) die_truncated();
+  zonelen = dns_domain_length(zone);
+  pos = dns_packet_copy(buf,len,pos,qtype,2); if (!pos) die_truncated();
+  pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) die_truncated();
+
+  if (byte_diff(qclass,2,DNS_C_IN) && byte_diff(qclass,2,DNS_C_ANY))
+    fail("bogus query: bad class",0,0);
+
+  qlog(ip,port,header,zone,qtype," ");
+
+  if (byte_equal(qtype,2,DNS_T_AXFR)) {
+    case_lowerb(zone,zonelen);
+    cdbopen();
+    doaxfr(header,0);
+    cdbclose();
+  }
+  else if (byte_equal(qtype,2,DNS_T_IXFR)) {
+    if (header[8] || !header[9]) fail("bogus query: no SOA",0,0);
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) die_truncated();
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) die_truncated();
+    if (byte_diff(misc,2,DNS_T_SOA)) fail("bogus query: no SOA",0,0);
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) die_truncated();
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) die_truncated();
+    pos = dns_packet_copy(buf,len,pos,serial,4); if (!pos) die_truncated();
+    case_lowerb(zone,zonelen);
+    cdbopen();
+    doaxfr(header,serial);
+    cdbclose();
+  }
+  else {
+    if (!response_query(zone,qtype,qclass)) nomem();
+    response[2] |= 4;
+    case_lowerb(zone,zonelen);
+    response_id(header);
+    response[3] &= ~128;
+    if (!(header[2] & 1)) response[2] &= ~1;
+    if (!respond(zone,qtype,ip,cdb_hash(zone,zonelen))) die_outside();
+    print(response,response_len);
+  }
+}
+
+static struct tcpclient t[MAXTCP];
+static iopause_fd io[1 + MAXTCP];
+
+static void t_timeout(struct tcpclient *x)
+{
+  struct taia stamp;
+
+  taia_now(&stamp);
+  taia_uint(&x->timeout,60);
+  taia_add(&x->timeout,&x->timeout,&stamp);
+}
+
+static void t_unspool(struct tcpclient *x)
+{
+  if (x->spool == -1) return;
+  cork(x->tcp,0);
+  munmap(x->map,x->size);
+  close(x->spool);
+  x->spool = -1;
+}
+
+static void t_close(struct tcpclient *x)
+{
+  if (x->flagxfer) {
+    x->flagxfer = 0;
+    xferswap(x);
+    spoolabandon();
+    cdbclose();
+  }
+  t_unspool(x);
+  close(x->tcp);
+  x->tcp = -1;
+  x->out.len = 0;
+}
+
+/* answers each complete query, in order, until a transfer is being sent */
+static void t_answer(struct tcpclient *x)
+{
+  uint16 n;
+
+  while ((x->spool == -1) && !x->flagxfer && (x->len >= 2)) {
+    uint16_unpack_big(x->buf,&n);
+    if (n > 512) { strerr_warn2(WARNING,"excessively large request",0); t_close(x); return; }
+    if (x->len < n + 2) return;
+
+    byte_copy(buf,n,x->buf + 2);
+    len = n;
+    byte_copy(ip,4,x->ip);
+    port = x->port;
+    cur = x;
+    if (setjmp(dropped)) {
+      cur = 0;
+      netwrite.p = 0;
+      cdbclose();
+      t_close(x);
+      return;
+    }
+    query();
+    cur = 0;
+
+    x->len -= n + 2;
+    byte_copy(x->buf,x->len,x->buf + n + 2);
+  }
+}
+
+/* the next TCPOUT bytes or so of a full transfer */
+static void t_xfer(struct tcpclient *x)
+{
+  cur = x;
+  if (setjmp(dropped)) {
+    cur = 0;
+    netwrite.p = 0;
+    cdbclose();
+    t_close(x);
+    return;
+  }
+  x->flagxfer = 0;
+  xferswap(x);
+  dictread();
+  start(x->id);
+  if (!records(x->id)) {
+    xferstop(x->id);
+    cur = 0;
+    return;
+  }
+  xferfinish(x->id);
+  cdbclose();
+  cur = 0;
+  t_answer(x);
+}
+
+/* the next piece of a transfer from the spool */
+static void t_spool(struct tcpclient *x)
+{
+  char header[4];
+  uint16 n;
+  int w;
+
+  if (x->off == x->end) {
+    if (x->end == x->size) {
+      t_unspool(x);
+      t_answer(x);
+      return;
+    }
+    uint16_unpack_big(x->map + x->end,&n);
+    byte_copy(header,2,x->map + x->end);
+    byte_copy(header + 2,2,x->id);
+    if (!stralloc_catb(&x->out,header,4)) { t_close(x); return; }
+    x->off = x->end + 4;
+    x->end += 2 + n;
+    return;
+  }
+  w = writefile(x->tcp,x->spool,&x->off,(unsigned int) (x->end - x->off));
+  if ((w == -1) && (errno == error_again)) return;
+  if (w <= 0) t_close(x);
+}
+
+static void t_rw(struct tcpclient *x)
+{
+  int r;
+
+  if (x->io->revents & IOPAUSE_WRITE) {
+    if (x->out.len) {
+      r = write(x->tcp,x->out.s + x->pos,x->out.len - x->pos);
+      if (r <= 0) { t_close(x); return; }
+      x->pos += r;
+      if (x->pos == x->out.len) x->pos = x->out.len = 0;
+    }
+    else if (x->flagxfer)
+      t_xfer(x);
+    else
+      t_spool(x);
+    if (x->tcp == -1) return;
+    t_timeout(x);
+  }
+
+  if (x->io->revents & IOPAUSE_READ) {
+    r = read(x->tcp,x->buf + x->len,TCPBUF - x->len);
+    if (r <= 0) { t_close(x); return; }
+    x->len += r;
+    t_timeout(x);
+    t_answer(x);
+  }
+}
+
+static void t_new(int tcp53)
+{
+  struct tcpclient *x;
+  int j;
+
+  x = 0;
+  for (j = 0;j < MAXTCP;++j)
+    if (t[j].tcp == -1) { x = t + j; break; }
+  if (!x) {
+    x = t;
+    for (j = 1;j < MAXTCP;++j)
+      if (taia_less(&t[j].timeout,&x->timeout)) x = t + j;
+    t_close(x);
+  }
+
+  x->tcp = socket_accept4(tcp53,x->ip,&x->port);
+  if (x->tcp == -1) return;
+  if (ndelay_on(x->tcp) == -1) { close(x->tcp); x->tcp = -1; return; }
+  x->len = 0;
+  x->out.len = 0;
+  x->pos = 0;
+  x->spool = -1;
+  t_timeout(x);
+}
+
+static void serve(int tcp53)
+{
+  struct taia stamp;
+  struct taia deadline;
+  unsigned int iolen;
+  int i;
+
+  for (i = 0;i < MAXTCP;++i) {
+    t[i].tcp = -1;
+    t[i].xfer.fdcdb = -1;
+    t[i].xfer.spoolfd = -1;
+  }
+
+  for (;;) {
+    taia_now(&stamp);
+    taia_uint(&deadline,120);
+    taia_add(&deadline,&deadline,&stamp);
+
+    io[0].fd = tcp53;
+    io[0].events = IOPAUSE_READ;
+    iolen = 1;
+    for (i = 0;i < MAXTCP;++i)
+      if (t[i].tcp != -1) {
+        t[i].io = io + iolen++;
+        t[i].io->fd = t[i].tcp;
+        t[i].io->events = 0;
+        if ((t[i].spool == -1) && !t[i].flagxfer && (t[i].out.len < TCPOUT) && (t[i].len < TCPBUF))
+          t[i].io->events |= IOPAUSE_READ;
+        if (t[i].out.len || (t[i].spool != -1) || t[i].flagxfer) t[i].io->events |= IOPAUSE_WRITE;
+        if (taia_less(&t[i].timeout,&deadline)) deadline = t[i].timeout;
+      }
+
+    iopause(io,iolen,&deadline,&stamp);
+    taia_now(&stamp);
+    cdbmap_quiescent();
+
+    for (i = 0;i < MAXTCP;++i)
+      if (t[i].tcp != -1) {
+        if (t[i].io->revents)
+          t_rw(t + i);
+        else if (!taia_less(&stamp,&t[i].timeout))
+          t_close(t + i);
+      }
+
+    if (io[0].revents) t_new(tcp53);
+  }
+}
+
+static char seed[128];
+
+int main()
+{
+  char myip[4];
   const char *x;
+  int tcp53;
+
+  tcp53 = -1;
+  if (env_get("DAEMON")) {
+    flagdaemon = 1;
+    x = env_get("IP");
+    if (!x)
+      strerr_die2x(111,FATAL,"$IP not set");
+    if (!ip4_scan(x,myip))
+      strerr_die3x(111,FATAL,"unable to parse IP address ",x);
+    tcp53 = socket_tcp();
+    if (tcp53 == -1)
+      strerr_die2sys(111,FATAL,"unable to create TCP socket: ");
+    if (socket_bind4_reuse(tcp53,myip,53) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind TCP socket: ");
+    if (socket_listen(tcp53,20) == -1)
+      strerr_die2sys(111,FATAL,"unable to listen on TCP socket: ");
+    if (ndelay_on(tcp53) == -1)
+      strerr_die2sys(111,FATAL,"unable to set TCP socket to non-blocking: ");
+  }
 
   droproot(FATAL);
   dns_random_init(seed);
 
   axfr = env_get("AXFR");
+  axfrzones();
+  spooldir = env_get("AXFRSPOOL");
+
+  if (flagdaemon) serve(tcp53);
   
   x = env_get("TCPREMOTEIP");
   if (x && ip4_scan(x,ip))
@@ -342,37 +1267,6 @@ int main()
     uint16_unpack_big(tcpheader,&len);
     if (len > 512) strerr_die2x(111,FATAL,"excessively large request");
     netread(buf,len);
-
-    pos = dns_packet_copy(buf,len,0,header,12); if (!pos) die_truncated();
-    if (header[2] & 254) strerr_die2x(111,FATAL,"bogus query");
-    if (header[4] || (header[5] != 1)) strerr_die2x(111,FATAL,"bogus query");
-
-    pos = dns_packet_getname(buf,len,pos,&zone); if (!pos) die_truncated();
-    zonelen = dns_domain_length(zone);
-    pos = dns_packet_copy(buf,len,pos,qtype,2); if (!pos) die_truncated();
-    pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) die_truncated();
-
-    if (byte_diff(qclass,2,DNS_C_IN) && byte_diff(qclass,2,DNS_C_ANY))
-      strerr_die2x(111,FATAL,"bogus query: bad class");
-
-    qlog(ip,port,header,zone,qtype," ");
-
-    if (byte_equal(qtype,2,DNS_T_AXFR)) {
-      case_lowerb(zone,zonelen);
-      fdcdb = open_read("data.cdb");
-      if (fdcdb == -1) die_cdbread();
-      doaxfr(header);
-      close(fdcdb);
-    }
-    else {
-      if (!response_query(zone,qtype,qclass)) nomem();
-      response[2] |= 4;
-      case_lowerb(zone,zonelen);
-      response_id(header);
-      response[3] &= ~128;
-      if (!(header[2] & 1)) response[2] &= ~1;
-      if (!respond(zone,qtype,ip)) die_outside();
-      print(response,response_len);
-    }
+    query();
   }
 }
@@ -0,0 +1,197 @@
+#include "uint32.h"
+#include "uint16.h"
+#include "stralloc.h"
+#include "error.h"
+#include "byte.h"
+#include "ip4.h"
+#include "dns.h"
+#include "axfrline.h"
+
+static int printable(char ch)
+{
+  if (ch == '.') return 1;
+  if ((ch >= 'a') && (ch <= 'z')) return 1;
+  if ((ch >= '0') && (ch <= '9')) return 1;
+  if ((ch >= 'A') && (ch <= 'Z')) return 1;
+  if (ch == '-') return 1;
+  return 0;
+}
+
+static char d1[DNS_NAME];
+static char d2[DNS_NAME];
+static char d3[DNS_NAME];
+
+unsigned int axfrline(stralloc *line,const char *zone,int *numsoa,const char *buf,unsigned int len,unsigned int pos)
+{
+  char data[20];
+  uint32 ttl;
+  uint16 dlen;
+  uint16 typenum;
+  uint32 u32;
+  int i;
+
+  line->len = 0;
+  pos = dns_packet_getnamebuf(buf,len,pos,d1); if (!pos) return 0;
+  pos = dns_packet_copy(buf,len,pos,data,10); if (!pos) return 0;
+  uint16_unpack_big(data,&typenum);
+  uint32_unpack_big(data + 4,&ttl);
+  uint16_unpack_big(data + 8,&dlen);
+  if (len - pos < dlen) { errno = error_proto; return 0; }
+  len = pos + dlen;
+
+  if (!dns_domain_suffix(d1,zone)) return len;
+  if (byte_diff(data + 2,2,DNS_C_IN)) return len;
+
+  if (byte_equal(data,2,DNS_T_SOA)) {
+    if (++*numsoa >= 2) return len;
+    pos = dns_packet_getnamebuf(buf,len,pos,d2); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(buf,len,pos,d3); if (!pos) return 0;
+    if (!dns_packet_copy(buf,len,pos,data,20)) return 0;
+    uint32_unpack_big(data,&u32);
+    if (!stralloc_copys(line,"#")) return 0;
+    if (!stralloc_catulong0(line,u32,0)) return 0;
+    if (!stralloc_cats(line," auto axfr-get\n")) return 0;
+    if (!stralloc_cats(line,"Z")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    if (!dns_domain_todot_cat(line,d2)) return 0;
+    if (!stralloc_cats(line,".:")) return 0;
+    if (!dns_domain_todot_cat(line,d3)) return 0;
+    if (!stralloc_cats(line,".")) return 0;
+    for (i = 0;i < 5;++i) {
+      uint32_unpack_big(data + 4 * i,&u32);
+      if (!stralloc_cats(line,":")) return 0;
+      if (!stralloc_catulong0(line,u32,0)) return 0;
+    }
+  }
+  else if (byte_equal(data,2,DNS_T_NS)) {
+    if (!stralloc_copys(line,"&")) return 0;
+    if (byte_equal(d1,2,"\1*")) { errno = error_proto; return 0; }
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,"::")) return 0;
+    if (!dns_packet_getnamebuf(buf,len,pos,d1)) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,".")) return 0;
+  }
+  else if (byte_equal(data,2,DNS_T_CNAME)) {
+    if (!stralloc_copys(line,"C")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    if (!dns_packet_getnamebuf(buf,len,pos,d1)) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,".")) return 0;
+  }
+  else if (byte_equal(data,2,DNS_T_PTR)) {
+    if (!stralloc_copys(line,"^")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    if (!dns_packet_getnamebuf(buf,len,pos,d1)) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,".")) return 0;
+  }
+  else if (byte_equal(data,2,DNS_T_MX)) {
+    uint16 dist;
+    if (!stralloc_copys(line,"@")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,"::")) return 0;
+    pos = dns_packet_copy(buf,len,pos,data,2); if (!pos) return 0;
+    uint16_unpack_big(data,&dist);
+    if (!dns_packet_getnamebuf(buf,len,pos,d1)) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,".:")) return 0;
+    if (!stralloc_catulong0(line,dist,0)) return 0;
+  }
+  else if (byte_equal(data,2,DNS_T_A) && (dlen == 4)) {
+    char ipstr[IP4_FMT];
+    if (!stralloc_copys(line,"+")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    if (!dns_packet_copy(buf,len,pos,data,4)) return 0;
+    if (!stralloc_catb(line,ipstr,ip4_fmt(ipstr,data))) return 0;
+  }
+  else {
+    unsigned char ch;
+    unsigned char ch2;
+    if (!stralloc_copys(line,":")) return 0;
+    if (!dns_domain_todot_cat(line,d1)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    if (!stralloc_catulong0(line,typenum,0)) return 0;
+    if (!stralloc_cats(line,":")) return 0;
+    for (i = 0;i < dlen;++i) {
+      pos = dns_packet_copy(buf,len,pos,data,1); if (!pos) return 0;
+      ch = data[0];
+      if (printable(ch)) {
+        if (!stralloc_catb(line,&ch,1)) return 0;
+      }
+      else {
+        if (!stralloc_cats(line,"\\")) return 0;
+        ch2 = '0' + ((ch >> 6) & 7);
+        if (!stralloc_catb(line,&ch2,1)) return 0;
+        ch2 = '0' + ((ch >> 3) & 7);
+        if (!stralloc_catb(line,&ch2,1)) return 0;
+        ch2 = '0' + (ch & 7);
+        if (!stralloc_catb(line,&ch2,1)) return 0;
+      }
+    }
+  }
+  if (!stralloc_cats(line,":")) return 0;
+  if (!stralloc_catulong0(line,ttl,0)) return 0;
+  if (!stralloc_cats(line,"\n")) return 0;
+
+  return len;
+}
+
+static char zero[10];
+
+unsigned int axfrrec(stralloc *rec,const char *zone,int *numsoa,const char *buf,unsigned int len,unsigned int pos)
+{
+  char data[10];
+  uint16 dlen;
+  unsigned int fixed = 0;
+  int names = 0;
+
+  rec->len = 0;
+  pos = dns_packet_getnamebuf(buf,len,pos,d1); if (!pos) return 0;
+  pos = dns_packet_copy(buf,len,pos,data,10); if (!pos) return 0;
+  uint16_unpack_big(data + 8,&dlen);
+  if (len - pos < dlen) { errno = error_proto; return 0; }
+  len = pos + dlen;
+
+  if (!dns_domain_suffix(d1,zone)) return len;
+  if (byte_diff(data + 2,2,DNS_C_IN)) return len;
+
+  if (byte_equal(data,2,DNS_T_SOA)) {
+    if (++*numsoa >= 2) return len;
+    names = 2;
+  }
+  else if (byte_equal(data,2,DNS_T_NS)) {
+    if (byte_equal(d1,2,"\1*")) { errno = error_proto; return 0; }
+    names = 1;
+  }
+  else if (byte_equal(data,2,DNS_T_CNAME) || byte_equal(data,2,DNS_T_PTR))
+    names = 1;
+  else if (byte_equal(data,2,DNS_T_MX)) {
+    fixed = 2;
+    names = 1;
+  }
+
+  if (!stralloc_copyb(rec,zero,2)) return 0;
+  if (!stralloc_catb(rec,d1,dns_domain_length(d1))) return 0;
+  if (!stralloc_catb(rec,data,2)) return 0;
+  if (!stralloc_catb(rec,data + 4,4)) return 0;
+  if (!stralloc_catb(rec,zero,10)) return 0;
+
+  if (len - pos < fixed) { errno = error_proto; return 0; }
+  if (!stralloc_catb(rec,buf + pos,fixed)) return 0;
+  pos += fixed;
+  while (names-- > 0) {
+    pos = dns_packet_getnamebuf(buf,len,pos,d2); if (!pos) return 0;
+    if (!stralloc_catb(rec,d2,dns_domain_length(d2))) return 0;
+  }
+  if (byte_equal(data,2,DNS_T_SOA) && (len - pos < 20)) { errno = error_proto; return 0; }
+  if (!stralloc_catb(rec,buf + pos,len - pos)) return 0;
+
+  if (rec->len - 2 > 65535) { errno = error_proto; return 0; }
+  uint16_pack_big(rec->s,rec->len - 2);
+  return len;
+}
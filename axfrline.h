@@ -0,0 +1,18 @@
+#ifndef AXFRLINE_H
+#define AXFRLINE_H
+
+#include "stralloc.h"
+
+/* sets line to the data line for the record at pos, or to nothing */
+/* if the record is not part of zone; returns the position after it */
+/* or 0, setting errno. *numsoa counts SOA records; only the first */
+/* one has a line, the # line and the Z line of a zone file */
+
+extern unsigned int axfrline(stralloc *,const char *,int *,const char *,unsigned int,unsigned int);
+
+/* the same, but sets the stralloc to a record of tinydns-data's */
+/* binary input, its 2-byte length first, names uncompressed */
+
+extern unsigned int axfrrec(stralloc *,const char *,int *,const char *,unsigned int,unsigned int);
+
+#endif
@@ -22,6 +22,7 @@ extern int buffer_putflush(buffer *,const char *,unsigned int);
 extern int buffer_puts(buffer *,const char *);
 extern int buffer_putsalign(buffer *,const char *);
 extern int buffer_putsflush(buffer *,const char *);
+extern int buffer_flushv(buffer *,int (*)(),char *,unsigned int);
 
 #define buffer_PUTC(s,c) \
   ( ((s)->n != (s)->p) \
@@ -49,6 +50,7 @@ extern int buffer_copy(buffer *,buffer *);
 
 extern int buffer_unixread(int,char *,unsigned int);
 extern int buffer_unixwrite(int,const char *,unsigned int);
+extern int buffer_unixwritev();
 
 extern buffer *buffer_0;
 extern buffer *buffer_0small;
@@ -0,0 +1,40 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "error.h"
+
+/*
+buffer_flushv() writes what is buffered in s and then buf, with opv,
+which works like writev(); so a caller can put a small header into s
+and send it with a large message that is never copied.
+*/
+
+int buffer_unixwritev(int fd,struct iovec *v,int n)
+{
+  return writev(fd,v,n);
+}
+
+int buffer_flushv(buffer *s,int (*opv)(),char *buf,unsigned int len)
+{
+  struct iovec v[2];
+  struct iovec *x;
+  int n;
+  int w;
+
+  v[0].iov_base = s->x; v[0].iov_len = s->p;
+  v[1].iov_base = buf; v[1].iov_len = len;
+  s->p = 0;
+  x = v; n = 2;
+  if (!x->iov_len) { ++x; --n; }
+
+  while (n) {
+    w = opv(s->fd,x,n);
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      return -1; /* note that some data may have been written */
+    }
+    while (n && (w >= x->iov_len)) { w -= x->iov_len; ++x; --n; }
+    if (n) { x->iov_base = (char *) x->iov_base + w; x->iov_len -= w; }
+  }
+  return 0;
+}
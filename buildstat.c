@@ -0,0 +1,223 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include "buffer.h"
+#include "byte.h"
+#include "fmt.h"
+#include "str.h"
+#include "env.h"
+#include "taia.h"
+#include "uint64.h"
+#include "buildstat.h"
+
+/*
+With $STATS set, tinydns-data and rbldns-data print where the time of
+a build went once data.cdb is in place, one "name value..." line each:
+
+  phase parse 812345 790000   microseconds of wall clock and of CPU
+  read 10345 104857600        microseconds in read() and bytes read
+  add 120345 98765432         microseconds in cdb_make_add(), bytes
+  lines + 100000 123099       lines of a type and lines per second
+  rss 65432                   peak resident kilobytes
+  written 123456789           bytes of data.cdb
+
+A phase runs from buildstat_phase() to the next; its CPU time takes
+in the workers it waited for. Time reading and adding is also part
+of the phase it falls in, and lines per second are over the whole
+parse phase. rbldns-data counts every address line as type 0.
+Workers keep their counts in their own rows of memory shared with
+the parent, as in metrics.c, so the lines parsed by $WORKERS
+processes add up. Without $STATS every call is a test of
+buildstat_flag and nothing more.
+*/
+
+int buildstat_flag = 0;
+
+#define PHASES 8
+
+static struct phase {
+  const char *name;
+  uint64 wall;
+  uint64 cpu;
+} phase[PHASES];
+static unsigned int numphases = 0;
+static struct taia wallstart;
+static uint64 cpustart;
+
+struct row {
+  uint64 lines[256];
+  uint64 usec[2];
+  uint64 bytes[2];
+} ;
+
+static struct row own;
+static struct row *rows = &own;
+static struct row *row = &own;
+static unsigned int numrows = 1;
+static struct taia started[2];
+
+static uint64 usec(const struct taia *t)
+{
+  return t->sec.x * 1000000 + t->nano / 1000;
+}
+
+static uint64 tv(const struct timeval *t)
+{
+  return (uint64) t->tv_sec * 1000000 + t->tv_usec;
+}
+
+/* CPU time of this process and the children it has waited for */
+static uint64 cpu(void)
+{
+  struct rusage self;
+  struct rusage children;
+
+  if (getrusage(RUSAGE_SELF,&self) == -1) return 0;
+  if (getrusage(RUSAGE_CHILDREN,&children) == -1) return 0;
+  return tv(&self.ru_utime) + tv(&self.ru_stime) + tv(&children.ru_utime) + tv(&children.ru_stime);
+}
+
+/* call before fork(), with the most workers there will be */
+void buildstat_init(unsigned int workers)
+{
+  char *x;
+
+  if (!env_get("STATS")) return;
+  buildstat_flag = 1;
+  x = mmap(0,(workers + 1) * sizeof(struct row),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANON,-1,0);
+  if (x != (char *) MAP_FAILED) {
+    rows = row = (struct row *) x;
+    byte_zero(rows,(workers + 1) * sizeof(struct row));
+    numrows = workers + 1;
+  }
+  taia_clock(&wallstart);
+  cpustart = cpu();
+}
+
+/* worker i counts in row i + 1; the parent has row 0 */
+void buildstat_worker(unsigned int i)
+{
+  if (i + 1 < numrows) row = rows + i + 1;
+}
+
+static void endphase(void)
+{
+  struct taia now;
+  struct taia t;
+  struct phase *p;
+  uint64 u;
+
+  if (!numphases) return;
+  p = phase + numphases - 1;
+  taia_clock(&now);
+  taia_sub(&t,&now,&wallstart);
+  p->wall = usec(&t);
+  wallstart = now;
+  u = cpu();
+  p->cpu = u - cpustart;
+  cpustart = u;
+}
+
+void buildstat_phase(const char *name)
+{
+  if (!buildstat_flag) return;
+  endphase();
+  if (numphases < PHASES) phase[numphases++].name = name;
+}
+
+void buildstat_line(unsigned char type)
+{
+  if (buildstat_flag) ++row->lines[type];
+}
+
+void buildstat_start(unsigned int what)
+{
+  if (buildstat_flag) taia_clock(&started[what]);
+}
+
+void buildstat_stop(unsigned int what,unsigned long bytes)
+{
+  struct taia now;
+
+  if (!buildstat_flag) return;
+  taia_clock(&now);
+  taia_sub(&now,&now,&started[what]);
+  row->usec[what] += usec(&now);
+  row->bytes[what] += bytes;
+}
+
+static char strnum[FMT_ULONG];
+
+static void put(const char *s)
+{
+  buffer_puts(buffer_1,s);
+}
+
+static void putnum(uint64 u)
+{
+  buffer_puts(buffer_1," ");
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,u));
+}
+
+void buildstat_report(const char *fn)
+{
+  struct rusage ru;
+  struct stat st;
+  uint64 parse = 0;
+  uint64 sum[2][2];
+  uint64 n;
+  unsigned int i;
+  unsigned int j;
+  long rss;
+  char ch;
+
+  if (!buildstat_flag) return;
+  endphase();
+
+  for (i = 0;i < numphases;++i) {
+    put("phase ");
+    put(phase[i].name);
+    putnum(phase[i].wall);
+    putnum(phase[i].cpu);
+    put("\n");
+    if (!str_diff(phase[i].name,"parse")) parse = phase[i].wall;
+  }
+
+  byte_zero(sum,sizeof sum);
+  for (j = 0;j < numrows;++j)
+    for (i = 0;i < 2;++i) {
+      sum[i][0] += rows[j].usec[i];
+      sum[i][1] += rows[j].bytes[i];
+    }
+  put("read"); putnum(sum[BUILDSTAT_READ][0]); putnum(sum[BUILDSTAT_READ][1]); put("\n");
+  put("add"); putnum(sum[BUILDSTAT_ADD][0]); putnum(sum[BUILDSTAT_ADD][1]); put("\n");
+
+  for (i = 0;i < 256;++i) {
+    n = 0;
+    for (j = 0;j < numrows;++j) n += rows[j].lines[i];
+    if (!n) continue;
+    put("lines ");
+    ch = i;
+    if (!i)
+      put("binary");
+    else
+      buffer_put(buffer_1,&ch,1);
+    putnum(n);
+    putnum(parse ? n * 1000000 / parse : 0);
+    put("\n");
+  }
+
+  rss = 0;
+  if (getrusage(RUSAGE_SELF,&ru) == 0) rss = ru.ru_maxrss;
+  if (getrusage(RUSAGE_CHILDREN,&ru) == 0)
+    if (ru.ru_maxrss > rss) rss = ru.ru_maxrss;
+  put("rss"); putnum(rss); put("\n");
+
+  if (stat(fn,&st) == 0) {
+    put("written"); putnum(st.st_size); put("\n");
+  }
+
+  buffer_flush(buffer_1);
+}
@@ -0,0 +1,17 @@
+#ifndef BUILDSTAT_H
+#define BUILDSTAT_H
+
+#define BUILDSTAT_READ 0
+#define BUILDSTAT_ADD 1
+
+extern int buildstat_flag;
+
+extern void buildstat_init(unsigned int);
+extern void buildstat_worker(unsigned int);
+extern void buildstat_phase(const char *);
+extern void buildstat_line(unsigned char);
+extern void buildstat_start(unsigned int);
+extern void buildstat_stop(unsigned int,unsigned long);
+extern void buildstat_report(const char *);
+
+#endif
@@ -1,10 +1,21 @@
 #include "byte.h"
+#include "word.h"
 
+/* works for overlapping areas with to below from, as callers rely on */
 void byte_copy(to,n,from)
 register char *to;
 register unsigned int n;
 register char *from;
 {
+#ifdef WORD_FAST
+  word w;
+
+  while (n >= sizeof w) {
+    word_load(w,from);
+    word_store(to,w);
+    to += sizeof w; from += sizeof w; n -= sizeof w;
+  }
+#endif
   for (;;) {
     if (!n) return; *to++ = *from++; --n;
     if (!n) return; *to++ = *from++; --n;
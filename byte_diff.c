@@ -1,10 +1,22 @@
 #include "byte.h"
+#include "word.h"
 
 int byte_diff(s,n,t)
 register char *s;
 register unsigned int n;
 register char *t;
 {
+#ifdef WORD_FAST
+  word x;
+  word y;
+
+  while (n >= sizeof x) {
+    word_load(x,s);
+    word_load(y,t);
+    if (x != y) break; /* the byte loop finds which */
+    s += sizeof x; t += sizeof x; n -= sizeof x;
+  }
+#endif
   for (;;) {
     if (!n) return 0; if (*s != *t) break; ++s; ++t; --n;
     if (!n) return 0; if (*s != *t) break; ++s; ++t; --n;
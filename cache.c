@@ -1,53 +1,316 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
 #include "alloc.h"
+#include "buffer.h"
+#include "error.h"
+#include "stralloc.h"
 #include "byte.h"
+#include "word.h"
+#include "fmt.h"
 #include "uint32.h"
 #include "exit.h"
 #include "tai.h"
+#include "siphash.h"
 #include "cache.h"
+#include "perfcount.h"
+#include "profile.h"
 
 uint64 cache_motion = 0;
+uint64 cache_hits = 0;
+uint64 cache_misses = 0;
+uint64 cache_expired = 0;
+uint64 cache_evictions = 0;
+uint64 cache_links = 0;
+uint64 cache_truncated = 0;
+uint64 cache_indexfull = 0;
+uint64 cache_reclaimed = 0;
+uint64 cache_compacted = 0;
+uint64 cache_probes[CACHE_PROBEBUCKETS];
+uint64 cache_ghostlookups = 0;
+uint64 cache_ghostmisses[CACHE_GHOSTSIZES];
+int cache_due = 0;
+int cache_stale = 0;
+
+struct slot {
+  uint32 hash; /* 0 if the slot is empty */
+  uint32 pos;
+} ;
 
 static char *x = 0;
 static uint32 size;
-static uint32 hsize;
 static uint32 writer;
 static uint32 oldest;
 static uint32 unused;
+static uint32 base;
+static uint32 top;
+static char *space = 0;
+static unsigned long spacemapped = 0;
+static struct slot *slot;
+static uint32 nslots;
+static uint32 wantslots = 0;
+static uint32 used;
+static uint32 maxused;
+static unsigned int prefetch = 0;
+static int flagsecondchance = 0;
+static int flagkeyed = 0;
+static int flaghuge = 0;
+static int flagclock = 0;
+static struct tai clocktime;
+static char hashkey[16];
+static uint32 stalemax = 0;
+static const char *shmfn = 0;
 
 /*
 100 <= size <= 1000000000.
-4 <= hsize <= size/16.
-hsize is a power of 2.
 
-hsize <= writer <= oldest <= unused <= size.
-If oldest == unused then unused == size.
+x is an arena of one or more rings; see cache_partition(). The ring
+in use runs from base to top, and for it:
 
-x is a hash table with the following structure:
-x[0...hsize-1]: hsize/4 head links.
-x[hsize...writer-1]: consecutive entries, newest entry on the right.
+base <= writer <= oldest <= unused <= top.
+If oldest == unused then unused == top.
+
+x[base...writer-1]: consecutive entries, newest entry on the right.
 x[writer...oldest-1]: free space for new entries.
 x[oldest...unused-1]: consecutive entries, oldest entry on the left.
-x[unused...size-1]: unused.
-
-Each hash bucket is a linked list containing the following items:
-the head link, the newest entry, the second-newest entry, etc.
-Each link is a 4-byte number giving the xor of
-the positions of the adjacent items in the list.
+x[unused...top-1]: unused.
 
-Entries are always inserted immediately after the head and removed at the tail.
+Entries are always inserted at writer and removed at oldest.
 
 Each entry contains the following information:
-4-byte link; 4-byte keylen; 4-byte datalen; 8-byte expire time; key; data.
+4-byte hash; 4-byte lengths (keylen in the high 12 bits, datalen in
+the low 20); 4-byte expire time (low 32 bits of the TAI second);
+4-byte original ttl (low 20 bits) and hit count (high 12 bits); key; data.
+Expire times are never more than 604800 seconds away, so the low 32
+bits compare correctly by their difference from the low 32 bits of now.
+
+slot is an open-addressing index of nslots slots, cache-line aligned,
+in the same allocation as x, just before it.
+nslots is a multiple of 8, at least 64: one for every 40 bytes of
+the cache, or as many as cache_slots() asked for. A cache of small
+entries fills a default index before its arena, and then evicts
+for want of slots; cache_indexfull counts those evictions.
+A key with hash h lives in the first slot at or after home(h),
+with linear probing. used <= maxused < nslots slots are occupied.
+Each occupied slot gives the full hash and the position of the newest
+entry for its key, so most keys that do not match are rejected
+without reading x. Older entries for the same key are in x but not
+in the index, and are simply dropped when they reach oldest.
+
+The hash is SipHash under a key derived from cache_seed(), so that
+outsiders cannot aim many keys at one stretch of slots. Without
+cache_seed(), an unkeyed hash is used. Keys are a 2-byte type and a
+name: the top 24 bits of the hash come from the name and the low 8
+from the type, and home() uses only the top 24. So every type stored
+under a name sits in one probe run, and cache_dir() finds them all
+in a single walk.
 */
 
+/*
+With cache_shared(fn), the index and x live in the file fn, mapped
+shared, so that every process mapping it, such as several dnscache
+processes on one host, or the workers of one, has one cache. The file
+starts with struct shared, holding what would otherwise be the static
+rings, used and hashkey, and a lock: 0, or the pid
+of the process holding it. Every cache_*() call holds the lock
+throughout, with the statics copied in and out; a process that finds
+the lock held by a process that no longer exists takes it over, and
+empties the cache, since the dead process may have left it half
+written. Data returned is copied out of the file first, since another
+process may overwrite x as soon as the lock is released. cache_dir()
+builds no directory, for the same reason; and cache_dump() copies the
+entries out under the lock and writes them after.
+
+The first process to map fn sets it up. Every process sharing fn
+must ask for the same cache size and partitions; cache_init() fails,
+with error_exist, if fn already has others.
+*/
+
+/*
+With cache_partition(infra,negative), x is cut into three rings, each
+with its own writer, oldest and unused, and each evicting only its
+own entries: infra percent of it for entries under the types given to
+cache_infra(), such as delegations, negative percent for entries
+with no data, and the rest for everything else. So a flood of one
+kind cannot push out the others. The index is shared; an entry that
+has been superseded by one in another ring is dropped when its own
+ring reaches it, as usual. Without partitions there is one ring, all
+of x.
+*/
+
+#define RINGS 3
+#define RING_OTHER 0
+#define RING_INFRA 1
+#define RING_NEGATIVE 2
+#define INFRATYPES 8
+
+static struct ring {
+  uint32 base;
+  uint32 top;
+  uint32 writer;
+  uint32 oldest;
+  uint32 unused;
+} ring[RINGS];
+
+static unsigned int cur = 0; /* the ring in writer, oldest, unused */
+static unsigned int share[RINGS]; /* percent of x */
+static char infratype[INFRATYPES][2];
+static unsigned int numinfra = 0;
+
+#define SHMMAGIC "dnscshm2"
+#define SHMHEADER 128
+
+struct shared {
+  char magic[8];
+  uint32 size;
+  uint32 nslots;
+  struct ring ring[RINGS];
+  uint32 used;
+  int flagkeyed;
+  char hashkey[16];
+  volatile int lock;
+} ;
+
+static struct shared *sh = 0;
+
+/*
+cache_resize(n) starts a new arena of size n, leaving the one in use
+as prev, and every cache_migrate(n) then moves at least n bytes'
+worth of prev's entries into the new one, oldest first, ring by ring,
+skipping what has expired for good or has a newer entry in the new
+arena, and giving back prev's pages as it goes; when prev is empty it
+is freed. Meanwhile a key missing from the new arena is looked for in
+prev, and moved at once if it is there. So the cache stays warm
+across a resize, and a shrink costs at most the old index and a
+little more until the move is done. The index is sized for n as
+cache_init() would size it, in proportion to cache_slots() if that
+was given. The ghosts of cache_ghost() go on simulating multiples of
+the first size. Not with cache_shared().
+*/
+
+struct arena {
+  char *space;
+  unsigned long spacemapped;
+  char *x;
+  uint32 size;
+  struct slot *slot;
+  uint32 nslots;
+  uint32 used;
+  uint32 maxused;
+  struct ring ring[RINGS];
+  unsigned int cur;
+} ;
+
+static struct arena prev; /* being emptied, if prev.x */
+static unsigned int migrating; /* the ring of prev being emptied */
+static uint32 initsize; /* as given to cache_init() */
+
 #define MAXKEYLEN 1000
 #define MAXDATALEN 1000000
+#define MAXPROBE 100
+#define HOT 8
+#define RESCUES 4
+#define DIRMAX 16
+#define HEADER 16
+#define STALETTL 30
 
 static void cache_impossible(void)
 {
   _exit(111);
 }
 
+static void rings(void);
+
+/* empties a shared cache whose last holder died holding the lock */
+static void takeover(void)
+{
+  byte_zero((char *) slot,nslots * sizeof(struct slot));
+  rings();
+  byte_copy((char *) sh->ring,sizeof ring,(char *) ring);
+  sh->used = 0;
+}
+
+static void lock(void)
+{
+  int pid;
+  int holder;
+  unsigned int loop;
+
+  if (!sh) return;
+  pid = getpid();
+  for (loop = 1;!__sync_bool_compare_and_swap(&sh->lock,0,pid);++loop) {
+    if (loop & 63) continue;
+    sched_yield();
+    if (loop & 1023) continue;
+    holder = sh->lock;
+    if (holder && (kill(holder,0) == -1) && (errno == error_srch))
+      if (__sync_bool_compare_and_swap(&sh->lock,holder,pid)) {
+        takeover();
+        break;
+      }
+  }
+  byte_copy((char *) ring,sizeof ring,(char *) sh->ring);
+  writer = ring[cur].writer;
+  oldest = ring[cur].oldest;
+  unused = ring[cur].unused;
+  used = sh->used;
+}
+
+static void unlock(void)
+{
+  if (!sh) return;
+  ring[cur].writer = writer;
+  ring[cur].oldest = oldest;
+  ring[cur].unused = unused;
+  byte_copy((char *) sh->ring,sizeof ring,(char *) ring);
+  sh->used = used;
+  __sync_lock_release(&sh->lock);
+}
+
+/* makes ring n the one in use */
+static void pick(unsigned int n)
+{
+  if (n == cur) return;
+  ring[cur].writer = writer;
+  ring[cur].oldest = oldest;
+  ring[cur].unused = unused;
+  cur = n;
+  writer = ring[n].writer;
+  oldest = ring[n].oldest;
+  unused = ring[n].unused;
+  base = ring[n].base;
+  top = ring[n].top;
+}
+
+/* the ring for an entry */
+static unsigned int class(const char *key,unsigned int keylen,unsigned int datalen)
+{
+  unsigned int i;
+
+  if (!datalen && (ring[RING_NEGATIVE].top > ring[RING_NEGATIVE].base))
+    return RING_NEGATIVE;
+  if ((keylen >= 2) && (ring[RING_INFRA].top > ring[RING_INFRA].base))
+    for (i = 0;i < numinfra;++i)
+      if (byte_equal(key,2,infratype[i]))
+        return RING_INFRA;
+  return RING_OTHER;
+}
+
+static char copy[MAXDATALEN];
+
+/* result, where no other process can change it */
+static char *out(char *result,unsigned int datalen)
+{
+  if (!sh || !result) return result;
+  byte_copy(copy,datalen,result);
+  return copy;
+}
+
 static void set4(uint32 pos,uint32 u)
 {
   if (pos > size - 4) cache_impossible();
@@ -62,75 +325,760 @@ static uint32 get4(uint32 pos)
   return result;
 }
 
-static unsigned int hash(const char *key,unsigned int keylen)
+/* the caller's clock if it offers one; otherwise the system's */
+static void readclock(struct tai *t)
+{
+  if (flagclock)
+    *t = clocktime;
+  else
+    tai_now(t);
+}
+
+static uint32 namehash(const char *name,unsigned int namelen)
 {
-  unsigned int result = 5381;
+  uint32 result = 5381;
 
-  while (keylen) {
+  if (flagkeyed)
+    result = siphash(hashkey,name,namelen);
+  else while (namelen) {
     result = (result << 5) + result;
-    result ^= (unsigned char) *key;
-    ++key;
-    --keylen;
+    result ^= (unsigned char) *name;
+    ++name;
+    --namelen;
   }
-  result <<= 2;
-  result &= hsize - 4;
+  return result << 8;
+}
+
+static uint32 hash(const char *key,unsigned int keylen)
+{
+  uint32 result;
+
+  if (keylen < 2)
+    result = namehash(key,keylen);
+  else
+    result = namehash(key + 2,keylen - 2) | (unsigned char) (key[0] * 37 + key[1]);
+  if (!result) result = 1;
   return result;
 }
 
-char *cache_get(const char *key,unsigned int keylen,unsigned int *datalen,uint32 *ttl)
+static uint32 home(uint32 h)
+{
+  h = (h >> 8) * 0x9e3779b1; /* spread the unkeyed hash into the high bits */
+  return ((uint64) h * nslots) >> 32;
+}
+
+static unsigned int keylenat(uint32 pos)
+{
+  return get4(pos + 4) >> 20;
+}
+
+static unsigned int datalenat(uint32 pos)
+{
+  return get4(pos + 4) & 0xfffff;
+}
+
+/* 1 if the entry at pos expired before now */
+static int expired(uint32 pos,const struct tai *now)
+{
+  return (get4(pos + 8) - (uint32) now->x) >> 31;
+}
+
+/* seconds from now until the entry at pos expires; it must not have */
+static uint32 left(uint32 pos,const struct tai *now)
+{
+  return get4(pos + 8) - (uint32) now->x;
+}
+
+/* 1 if the entry at pos expired too long ago even for cache_stale */
+static int gone(uint32 pos,const struct tai *now)
+{
+  return expired(pos,now) && ((uint32) now->x - get4(pos + 8) > stalemax);
+}
+
+static int samekey(uint32 pos,const char *key,unsigned int keylen)
+{
+  if (keylenat(pos) != keylen) return 0;
+  if (pos + HEADER + keylen > size) cache_impossible();
+  return word_equal(key,x + pos + HEADER,keylen);
+}
+
+/*
+cache_probes counts lookups by how many slots they read: bucket i,
+for i up to 6, those that read at most 2^i; then those that read
+more; then those cut off at MAXPROBE, which miss whether or not the
+key is there. cache_truncated counts every walk cut off, including
+insertions, which then store nothing, and cache_dir() walks.
+*/
+
+static void probed(unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0;i < CACHE_PROBEBUCKETS - 2;++i)
+    if (n <= (1 << i)) break;
+  ++cache_probes[i];
+}
+
+/* slot for key, or 0 */
+static struct slot *find(uint32 h,const char *key,unsigned int keylen)
+{
+  struct slot *s;
+  uint32 i;
+  unsigned int loop;
+
+  i = home(h);
+  for (loop = 0;loop < MAXPROBE;++loop) { /* to protect against hash flooding */
+    s = slot + i;
+    if (!s->hash) { probed(loop + 1); return 0; }
+    if (s->hash == h)
+      if (samekey(s->pos,key,keylen)) {
+        probed(loop + 1);
+        return s;
+      }
+    if (++i == nslots) i = 0;
+    ++cache_links;
+  }
+  ++cache_probes[CACHE_PROBEBUCKETS - 1];
+  ++cache_truncated;
+  return 0;
+}
+
+/* slot pointing at the entry at pos, or 0 if that entry was superseded */
+static struct slot *locate(uint32 pos)
+{
+  uint32 h;
+  uint32 i;
+  uint32 loop;
+
+  h = get4(pos);
+  i = home(h);
+  for (loop = 0;loop < nslots;++loop) {
+    if (!slot[i].hash) return 0;
+    if ((slot[i].hash == h) && (slot[i].pos == pos)) return slot + i;
+    if (++i == nslots) i = 0;
+  }
+  return 0;
+}
+
+static uint32 distance(uint32 i,uint32 j)
+{
+  return (j >= i) ? j - i : j + nslots - i;
+}
+
+/* backward-shift deletion, leaving no gaps in any probe sequence */
+static void unindex(struct slot *s)
+{
+  uint32 i;
+  uint32 j;
+
+  i = s - slot;
+  j = i;
+  for (;;) {
+    if (++j == nslots) j = 0;
+    if (!slot[j].hash) break;
+    if (distance(home(slot[j].hash),j) >= distance(i,j)) {
+      slot[i] = slot[j];
+      i = j;
+    }
+  }
+  slot[i].hash = 0;
+  --used;
+}
+
+/* exchanges the arena in use with prev */
+static void swap(void)
+{
+  struct arena a;
+
+  ring[cur].writer = writer;
+  ring[cur].oldest = oldest;
+  ring[cur].unused = unused;
+  a.space = space; a.spacemapped = spacemapped; a.x = x; a.size = size;
+  a.slot = slot; a.nslots = nslots; a.used = used; a.maxused = maxused;
+  byte_copy((char *) a.ring,sizeof ring,(char *) ring);
+  a.cur = cur;
+  space = prev.space; spacemapped = prev.spacemapped; x = prev.x; size = prev.size;
+  slot = prev.slot; nslots = prev.nslots; used = prev.used; maxused = prev.maxused;
+  byte_copy((char *) ring,sizeof ring,(char *) prev.ring);
+  cur = prev.cur;
+  prev = a;
+  writer = ring[cur].writer;
+  oldest = ring[cur].oldest;
+  unused = ring[cur].unused;
+  base = ring[cur].base;
+  top = ring[cur].top;
+}
+
+/*
+data of the entry at pos, unless it has expired; while cache_stale is
+set, also if it expired at most stalemax seconds ago, with ttl
+STALETTL (RFC 8767)
+*/
+static char *fetch(uint32 pos,unsigned int keylen,unsigned int *datalen,uint32 *ttl)
 {
-  struct tai expire;
   struct tai now;
-  uint32 pos;
-  uint32 prevpos;
-  uint32 nextpos;
   uint32 u;
-  unsigned int loop;
+  uint32 hits;
   double d;
 
+  readclock(&now);
+  if (expired(pos,&now)) {
+    if (!cache_stale || ((uint32) now.x - get4(pos + 8) > stalemax)) {
+      ++cache_expired;
+      return 0;
+    }
+    *ttl = STALETTL;
+    goto DATA;
+  }
+  ++cache_hits;
+
+  d = left(pos,&now);
+  if (d > 604800) d = 604800;
+  *ttl = d;
+
+  u = get4(pos + 12);
+  hits = u >> 20;
+  if (hits < 4095) ++hits;
+  if (prefetch && (hits >= HOT))
+    if (d * 100.0 < (double) (u & 0xfffff) * prefetch) {
+      cache_due = 1;
+      hits = 0;
+    }
+  set4(pos + 12,(hits << 20) | (u & 0xfffff));
+
+  DATA:
+  u = datalenat(pos);
+  if (u > size - pos - HEADER - keylen) cache_impossible();
+  *datalen = u;
+
+  return x + pos + HEADER + keylen;
+}
+
+static void insert(const char *,unsigned int,const char *,unsigned int,struct tai *,uint32);
+
+/* slot of key, moved into x from prev, or 0 */
+static struct slot *recall(uint32 h,const char *key,unsigned int keylen)
+{
+  struct tai now;
+  struct tai expire;
+  struct slot *s;
+  unsigned int datalen;
+  uint32 ttl;
+  char *data;
+
+  if (!prev.x) return 0;
+  readclock(&now);
+  swap();
+  s = find(h,key,keylen);
+  if (s && gone(s->pos,&now)) s = 0;
+  if (s) {
+    expire.x = get4(s->pos + 8); /* insert() keeps only the low 32 bits */
+    ttl = get4(s->pos + 12) & 0xfffff;
+    datalen = datalenat(s->pos);
+    if (datalen > size - s->pos - HEADER - keylen) cache_impossible();
+    data = x + s->pos + HEADER + keylen;
+  }
+  swap();
+  if (!s) return 0;
+  insert(key,keylen,data,datalen,&expire,ttl);
+  return find(h,key,keylen);
+}
+
+/*
+Second tier, with cache_tier(fn,n): the file fn, n bytes, meant for
+local flash, mapped shared and cut into TIERSLOT-byte buckets. An
+entry that reaches oldest unexpired, and is still the newest for its
+key, is copied, as laid out in x, into the one bucket its hash picks,
+replacing whatever was there, if it fits. A key missing from x is
+looked for in its bucket, and if it is there and unexpired it moves
+back into x. A bucket counts only if its key matches, so the file
+needs no setup, and what an earlier run left there may still hit.
+*/
+
+#define TIERSLOT 512
+
+static char *tier = 0;
+static uint32 tierslots;
+
+static char *bucket(uint32 h)
+{
+  h *= 0x9e3779b1;
+  return tier + TIERSLOT * (((uint64) h * tierslots) >> 32);
+}
+
+static void demote(uint32 pos,uint32 len)
+{
+  if (!tier || (len > TIERSLOT)) return;
+  byte_copy(bucket(get4(pos)),len,x + pos);
+}
+
+/* slot of key, moved back into x, or 0 */
+static struct slot *promote(uint32 h,const char *key,unsigned int keylen)
+{
+  char buf[TIERSLOT];
+  struct tai now;
+  struct tai expire;
+  unsigned int datalen;
+  char *b;
+  uint32 u;
+
+  if (!tier) return 0;
+  b = bucket(h);
+  uint32_unpack(b,&u);
+  if (u != h) return 0;
+  uint32_unpack(b + 4,&u);
+  if ((u >> 20) != keylen) return 0;
+  datalen = u & 0xfffff;
+  if (HEADER + keylen + datalen > TIERSLOT) return 0;
+  if (!word_equal(b + HEADER,key,keylen)) return 0;
+
+  byte_copy(buf,HEADER + keylen + datalen,b);
+  byte_zero(b,4); /* insert() may put another entry here */
+  readclock(&now);
+  uint32_unpack(buf + 8,&u);
+  if ((u - (uint32) now.x) >> 31) return 0;
+  expire = now;
+  expire.x += u - (uint32) now.x;
+  uint32_unpack(buf + 12,&u);
+  insert(key,keylen,buf + HEADER + keylen,datalen,&expire,u & 0xfffff);
+  return find(h,key,keylen);
+}
+
+/*
+With cache_ghost(), the cache also estimates how often it would miss
+at half, twice, four and eight times its size, and at its own size
+for comparison, following SHARDS (Waldspurger et al., FAST 2015).
+Only keys whose name hash falls in one GHOSTRATE-th of the range are
+followed. For each size, a FIFO of that size divided by GHOSTRATE is
+simulated on the followed keys alone: ghostmotion counts the bytes
+stored into it, and a direct-mapped table of ghosts remembers, for
+each followed key, the motion at which it was stored at each size.
+The key is still there if fewer than the simulated size of bytes
+have been stored since, and it has not expired. A key whose ghost
+was taken over by another key counts as gone at every size.
+
+Every lookup adds 1 to cache_ghostlookups; a lookup of a followed
+key that would miss at size i adds GHOSTRATE to cache_ghostmisses[i].
+Counting misses rather than hits is the SHARDS adjustment: a few hot
+names make up much of the lookups, and whether they happen to be
+followed would otherwise swing the estimate, while they hardly ever
+miss. 1 - misses/lookups estimates the hit ratio at each size. The
+estimate at the cache's own size shows how far the model is from the
+real cache, which also loses room to ring ends, a full index and
+partitions. Not with cache_shared(), where other processes store too.
+*/
+
+#define GHOSTRATE 64
+#define GHOSTBYTES 256 /* bytes of cache per ghost */
+
+/* simulated sizes, in halves of the cache */
+static const unsigned int ghosthalves[CACHE_GHOSTSIZES] = { 1, 2, 4, 8, 16 };
+
+struct ghost {
+  uint32 hash; /* 0 if the ghost is unused */
+  uint32 expire;
+  uint32 pos[CACHE_GHOSTSIZES];
+} ;
+
+static int flagghost = 0;
+static struct ghost *ghost = 0;
+static uint32 numghosts;
+static uint32 ghostmotion[CACHE_GHOSTSIZES];
+static uint32 ghostlimit[CACHE_GHOSTSIZES];
+
+static int followed(uint32 h)
+{
+  return (uint32) ((h >> 8) * 0x85ebca6b) < 0xffffffff / GHOSTRATE;
+}
+
+static struct ghost *ghostat(uint32 h)
+{
+  h *= 0xc2b2ae35;
+  return ghost + (((uint64) h * numghosts) >> 32);
+}
+
+/* 1 if the ghost, unexpired, is still held at size i */
+static int held(struct ghost *g,unsigned int i)
+{
+  return ghostmotion[i] - g->pos[i] < ghostlimit[i];
+}
+
+static int ghostlive(struct ghost *g)
+{
+  struct tai now;
+
+  readclock(&now);
+  return !((g->expire - (uint32) now.x) >> 31);
+}
+
+static void ghostget(uint32 h)
+{
+  struct ghost *g;
+  unsigned int i;
+  int live;
+
+  if (!ghost) return;
+  ++cache_ghostlookups;
+  if (!followed(h)) return;
+  g = ghostat(h);
+  live = (g->hash == h) && ghostlive(g);
+  for (i = 0;i < CACHE_GHOSTSIZES;++i)
+    if (!live || !held(g,i)) cache_ghostmisses[i] += GHOSTRATE;
+}
+
+/* a size that still holds the key would not have stored it again */
+static void ghostset(uint32 h,const struct tai *expire,uint32 len)
+{
+  struct ghost *g;
+  unsigned int i;
+  int live;
+
+  if (!ghost || !followed(h)) return;
+  g = ghostat(h);
+  live = (g->hash == h) && ghostlive(g);
+  g->hash = h;
+  g->expire = (uint32) expire->x;
+  for (i = 0;i < CACHE_GHOSTSIZES;++i)
+    if (!live || !held(g,i)) {
+      g->pos[i] = ghostmotion[i];
+      ghostmotion[i] += len;
+    }
+}
+
+static int ghosts(void)
+{
+  unsigned int i;
+
+  if (ghost) { alloc_free(ghost); ghost = 0; }
+  if (!flagghost || shmfn) return 1;
+  numghosts = size / GHOSTBYTES;
+  if (numghosts < 64) numghosts = 64;
+  ghost = (struct ghost *) alloc(numghosts * sizeof(struct ghost));
+  if (!ghost) return 0;
+  byte_zero((char *) ghost,numghosts * sizeof(struct ghost));
+  for (i = 0;i < CACHE_GHOSTSIZES;++i) {
+    ghostmotion[i] = 0;
+    ghostlimit[i] = (uint64) size * ghosthalves[i] / 2 / GHOSTRATE;
+  }
+  return 1;
+}
+
+static char *get(const char *key,unsigned int keylen,unsigned int *datalen,uint32 *ttl)
+{
+  struct slot *s;
+  uint32 h;
+
   if (!x) return 0;
   if (keylen > MAXKEYLEN) return 0;
 
-  prevpos = hash(key,keylen);
-  pos = get4(prevpos);
-  loop = 0;
+  h = hash(key,keylen);
+  ghostget(h);
+  s = find(h,key,keylen);
+  if (!s) s = recall(h,key,keylen);
+  if (!s) s = promote(h,key,keylen);
+  if (!s) { ++cache_misses; return 0; }
+  return fetch(s->pos,keylen,datalen,ttl);
+}
+
+char *cache_get(const char *key,unsigned int keylen,unsigned int *datalen,uint32 *ttl)
+{
+  char *result;
+  PERFCOUNT_BEGIN(PERF_CACHE_GET)
+  PROFILE_ENTER(PROFILE_CACHE)
+
+  lock();
+  result = get(key,keylen,datalen,ttl);
+  result = out(result,*datalen);
+  unlock();
+  PROFILE_LEAVE
+  PERFCOUNT_END(PERF_CACHE_GET)
+  return result;
+}
 
-  while (pos) {
-    if (get4(pos + 4) == keylen) {
-      if (pos + 20 + keylen > size) cache_impossible();
-      if (byte_equal(key,keylen,x + pos + 20)) {
-        tai_unpack(x + pos + 12,&expire);
-        tai_now(&now);
-        if (tai_less(&expire,&now)) return 0;
+static char dirkey[MAXKEYLEN];
+static unsigned int dirkeylen; /* 0 if there is no directory */
+static int dirvalid; /* 1 if dirpos lists every entry under dirkey + 2 */
+static uint32 dirpos[DIRMAX];
+static unsigned int dirlen;
+static uint32 dirhash;
+
+/*
+cache_dir(name) walks the probe run for name once, noting every
+entry stored under any type for it; cache_dirget(type) then answers
+as cache_get(type name) would, without hashing or probing again.
+Any cache_set() in between makes cache_dirget() fall back to a
+fresh lookup, as does a name with more than DIRMAX types.
+*/
 
-        tai_sub(&expire,&expire,&now);
-        d = tai_approx(&expire);
-        if (d > 604800) d = 604800;
-        *ttl = d;
+void cache_dir(const char *name,unsigned int namelen)
+{
+  struct slot *s;
+  uint32 h;
+  uint32 i;
+  uint32 pos;
+  unsigned int loop;
 
-        u = get4(pos + 8);
-        if (u > size - pos - 20 - keylen) cache_impossible();
-        *datalen = u;
+  dirvalid = 0;
+  dirkeylen = 0;
+  dirlen = 0;
+  if (!x) return;
+  if (namelen > MAXKEYLEN - 2) return;
+  byte_copy(dirkey + 2,namelen,name);
+  dirkeylen = namelen + 2;
+  if (sh || prev.x) return;
 
-        return x + pos + 20 + keylen;
+  h = namehash(name,namelen);
+  dirhash = h;
+  i = home(h);
+  for (loop = 0;loop < MAXPROBE;++loop) {
+    s = slot + i;
+    if (!s->hash) break;
+    if ((s->hash >> 8) == (h >> 8)) {
+      pos = s->pos;
+      if (keylenat(pos) == dirkeylen) {
+        if (pos + HEADER + dirkeylen > size) cache_impossible();
+        if (byte_equal(name,namelen,x + pos + HEADER + 2)) {
+          if (dirlen == DIRMAX) return;
+          dirpos[dirlen++] = pos;
+        }
       }
     }
-    nextpos = prevpos ^ get4(pos);
-    prevpos = pos;
-    pos = nextpos;
-    if (++loop > 100) return 0; /* to protect against hash flooding */
+    if (++i == nslots) i = 0;
+    ++cache_links;
   }
+  if (loop == MAXPROBE) { ++cache_truncated; return; }
+  dirvalid = 1;
+}
+
+char *cache_dirget(const char type[2],unsigned int *datalen,uint32 *ttl)
+{
+  struct slot *s;
+  unsigned int i;
+  char *result;
 
+  if (!dirkeylen) return 0;
+  if (!dirvalid) {
+    byte_copy(dirkey,2,type);
+    lock();
+    result = get(dirkey,dirkeylen,datalen,ttl);
+    result = out(result,*datalen);
+    unlock();
+    return result;
+  }
+  if (ghost) {
+    if (followed(dirhash)) {
+      byte_copy(dirkey,2,type);
+      ghostget(hash(dirkey,dirkeylen));
+    }
+    else
+      ++cache_ghostlookups;
+  }
+  for (i = 0;i < dirlen;++i)
+    if (byte_equal(type,2,x + dirpos[i] + HEADER))
+      return fetch(dirpos[i],dirkeylen,datalen,ttl);
+  if (tier) {
+    byte_copy(dirkey,2,type);
+    s = promote(hash(dirkey,dirkeylen),dirkey,dirkeylen);
+    if (s) return fetch(s->pos,dirkeylen,datalen,ttl);
+  }
+  ++cache_misses;
   return 0;
 }
 
-void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int datalen,uint32 ttl)
+static uint32 length(uint32 pos)
+{
+  uint32 len;
+
+  len = keylenat(pos) + datalenat(pos) + HEADER;
+  if (len > unused - pos) cache_impossible();
+  return len;
+}
+
+static void drop(uint32 len)
+{
+  oldest += len;
+  if (oldest == unused) {
+    unused = top;
+    oldest = top;
+  }
+}
+
+/* move a hot entry from oldest to writer, making it the newest */
+static int rescue(struct tai *now)
+{
+  struct slot *s;
+  uint32 len;
+  uint32 u;
+
+  u = get4(oldest + 12);
+  if (!(u >> 20)) return 0;
+
+  len = length(oldest);
+
+  if (expired(oldest,now)) return 0;
+  s = locate(oldest);
+  if (!s) return 0;
+
+  byte_copy(x + writer,len,x + oldest); /* writer <= oldest */
+  set4(writer + 12,u & 0xfffff);
+  s->pos = writer;
+  writer += len;
+
+  drop(len);
+  return 1;
+}
+
+/*
+cache_compact(n) works ahead of the writer. It looks at the next
+COMPACTWINDOW bytes from oldest in each ring in turn; if at least a
+quarter of them are dead, superseded or gone, it frees those and
+moves the live entries to writer, in order, so that a live entry is
+not evicted to make room that dead ones could have given. A window
+mostly live is left for eviction to take as usual, and is not looked
+at again until oldest moves or a second passes. It stops after
+looking at n bytes. cache_reclaimed counts the bytes freed this way,
+cache_compacted the bytes moved.
+*/
+
+#define COMPACTWINDOW 65536
+
+static unsigned int compacting; /* the ring cache_compact() looks at next */
+static uint32 lookedpos[RINGS]; /* oldest when last looked at */
+static uint32 lookedtime[RINGS];
+
+/* bytes looked at in the ring in use */
+static uint32 window(const struct tai *now)
+{
+  struct slot *s;
+  uint32 start;
+  uint32 end;
+  uint32 dead;
+  uint32 len;
+
+  if (oldest == unused) return 0;
+  if ((lookedpos[cur] == oldest) && (lookedtime[cur] == (uint32) now->x)) return 0;
+
+  start = oldest;
+  dead = 0;
+  for (end = start;(end < unused) && (end - start < COMPACTWINDOW);end += len) {
+    len = length(end);
+    if (!locate(end) || gone(end,now)) dead += len;
+  }
+  if (dead < (end - start) / 4) {
+    lookedpos[cur] = oldest;
+    lookedtime[cur] = now->x;
+    return end - start;
+  }
+
+  dirvalid = 0;
+  while (oldest < end) {
+    len = length(oldest);
+    s = locate(oldest);
+    if (s && !gone(oldest,now)) {
+      byte_copy(x + writer,len,x + oldest); /* writer <= oldest */
+      s->pos = writer;
+      writer += len;
+      cache_compacted += len;
+    }
+    else {
+      if (s) unindex(s);
+      cache_reclaimed += len;
+    }
+    drop(len);
+  }
+  return end - start;
+}
+
+void cache_compact(unsigned long n)
 {
   struct tai now;
-  struct tai expire;
+  unsigned long looked;
+  unsigned int i;
+
+  if (!x) return;
+  lock();
+  readclock(&now);
+  looked = 0;
+  for (i = 0;(i < RINGS) && (looked < n);++i) {
+    pick(compacting);
+    if (++compacting == RINGS) compacting = 0;
+    looked += window(&now);
+  }
+  unlock();
+}
+
+static void insert(const char *key,unsigned int keylen,const char *data,unsigned int datalen,struct tai *expire,uint32 ttl)
+{
+  struct tai now;
+  struct slot *s;
   unsigned int entrylen;
-  unsigned int keyhash;
-  uint32 pos;
+  unsigned int rescues;
+  unsigned int loop;
+  uint32 h;
+  uint32 i;
+
+  dirvalid = 0;
+  pick(class(key,keylen,datalen));
+  entrylen = keylen + datalen + HEADER;
+  if (entrylen > top - base) return;
+  rescues = flagsecondchance ? RESCUES : 0;
+  if (rescues || tier) readclock(&now);
+
+  while ((writer + entrylen > oldest) || (used >= maxused)) {
+    if (oldest == unused) {
+      if (writer == base) return;
+      unused = writer;
+      oldest = base;
+      writer = base;
+    }
+
+    if (rescues) {
+      --rescues;
+      if (rescue(&now)) continue;
+    }
+
+    if (writer + entrylen <= oldest) ++cache_indexfull;
+    s = locate(oldest);
+    if (s) {
+      if (tier && !expired(oldest,&now)) demote(oldest,length(oldest));
+      unindex(s);
+    }
+    ++cache_evictions;
+    drop(length(oldest));
+  }
+
+  h = hash(key,keylen);
+  i = home(h);
+  for (loop = 0;;++loop) {
+    if (loop >= MAXPROBE) { ++cache_truncated; return; }
+    s = slot + i;
+    if (!s->hash) {
+      s->hash = h;
+      ++used;
+      break;
+    }
+    if (s->hash == h)
+      if (samekey(s->pos,key,keylen))
+        break;
+    if (++i == nslots) i = 0;
+  }
+  s->pos = writer;
+
+  set4(writer,h);
+  set4(writer + 4,(keylen << 20) | datalen);
+  set4(writer + 8,(uint32) expire->x);
+  set4(writer + 12,ttl & 0xfffff);
+  byte_copy(x + writer + HEADER,keylen,key);
+  byte_copy(x + writer + HEADER + keylen,datalen,data);
+
+  writer += entrylen;
+  cache_motion += entrylen;
+}
+
+static void set(const char *key,unsigned int keylen,const char *data,unsigned int datalen,uint32 ttl)
+{
+  struct tai now;
+  struct tai expire;
 
   if (!x) return;
   if (keylen > MAXKEYLEN) return;
@@ -139,69 +1087,656 @@ void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int
   if (!ttl) return;
   if (ttl > 604800) ttl = 604800;
 
-  entrylen = keylen + datalen + 20;
+  readclock(&now);
+  tai_uint(&expire,ttl);
+  tai_add(&expire,&expire,&now);
+
+  if (ghost) ghostset(hash(key,keylen),&expire,keylen + datalen + HEADER);
+  insert(key,keylen,data,datalen,&expire,ttl);
+}
 
-  while (writer + entrylen > oldest) {
-    if (oldest == unused) {
-      if (writer <= hsize) return;
-      unused = writer;
-      oldest = hsize;
-      writer = hsize;
+void cache_set(const char *key,unsigned int keylen,const char *data,unsigned int datalen,uint32 ttl)
+{
+  PERFCOUNT_BEGIN(PERF_CACHE_SET)
+  PROFILE_ENTER(PROFILE_CACHE)
+
+  lock();
+  set(key,keylen,data,datalen,ttl);
+  unlock();
+  PROFILE_LEAVE
+  PERFCOUNT_END(PERF_CACHE_SET)
+}
+
+/*
+A dump file is DUMPMAGIC and a 4-byte version, then a sequence of
+entries, oldest first, each entry without its hash: 4-byte keylen;
+4-byte datalen; 8-byte expire time; 4-byte original ttl and hit
+count; key; data. cache_load() inserts them in the same order, so the
+loaded cache ages out in the same order as the dumped cache. It
+rejects, with error_proto, a file of another version, or with no
+header at all, rather than load it as garbage; DUMPVERSION goes up
+with every change to the entries.
+*/
+
+#define DUMPMAGIC "dnscdump"
+#define DUMPVERSION 1
+
+static int dumpentries(buffer *b,uint32 pos,uint32 end,const struct tai *now)
+{
+  struct tai expire;
+  char misc[20];
+  uint32 len;
+  uint32 u;
+
+  while (pos < end) {
+    len = length(pos);
+    if (len > end - pos) cache_impossible();
+    uint32_pack(misc,keylenat(pos));
+    uint32_pack(misc + 4,datalenat(pos));
+    expire = *now;
+    u = get4(pos + 8) - (uint32) now->x;
+    if (u >> 31) expire.x -= (uint32) -u; else expire.x += u;
+    tai_pack(misc + 8,&expire);
+    uint32_pack(misc + 16,get4(pos + 12));
+    if (buffer_put(b,misc,20) == -1) return -1;
+    if (buffer_put(b,x + pos + HEADER,len - HEADER) == -1) return -1;
+    pos += len;
+  }
+  return 0;
+}
+
+static stralloc dumped; /* a shared cache's entries, copied out */
+
+static int dumpcopy(int fd,const char *buf,unsigned int len)
+{
+  if (!stralloc_catb(&dumped,buf,len)) return -1;
+  return len;
+}
+
+int cache_dump(int fd)
+{
+  char bspace[8192];
+  char misc[12];
+  buffer b;
+  struct tai now;
+  unsigned int i;
+  int r;
+
+  if (!x) return 0;
+
+  readclock(&now);
+  if (sh) {
+    dumped.len = 0;
+    buffer_init(&b,dumpcopy,fd,bspace,sizeof bspace);
+  }
+  else
+    buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
+  byte_copy(misc,8,DUMPMAGIC);
+  uint32_pack(misc + 8,DUMPVERSION);
+  if (buffer_put(&b,misc,12) == -1) return -1;
+  lock();
+  r = 0;
+  if (prev.x) { /* older than anything in x */
+    swap();
+    for (i = 0;(r == 0) && (i < RINGS);++i) {
+      pick(i);
+      r = dumpentries(&b,oldest,unused,&now);
+      if (r == 0) r = dumpentries(&b,base,writer,&now);
     }
+    swap();
+  }
+  for (i = 0;(r == 0) && (i < RINGS);++i) {
+    pick(i);
+    r = dumpentries(&b,oldest,unused,&now);
+    if (r == 0) r = dumpentries(&b,base,writer,&now);
+  }
+  if ((r == 0) && sh) r = buffer_flush(&b);
+  unlock();
+  if (r == -1) return -1;
+  if (!sh) return buffer_flush(&b);
 
-    pos = get4(oldest);
-    set4(pos,get4(pos) ^ oldest);
-  
-    oldest += get4(oldest + 4) + get4(oldest + 8) + 20;
-    if (oldest > unused) cache_impossible();
-    if (oldest == unused) {
-      unused = size;
-      oldest = size;
+  buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
+  r = buffer_putflush(&b,dumped.s,dumped.len);
+  alloc_free(dumped.s);
+  dumped.s = 0;
+  dumped.a = 0;
+  dumped.len = 0;
+  return r;
+}
+
+/*
+cache_state() writes, as text, the size of the cache and its index,
+during a resize the size and entries of the arena being emptied,
+where each ring's writer, oldest and unused are, and how far each
+entry in the index sits from its home slot: "probe c0 c1 ...", with
+ci counting distances under 2^i. For a shared cache only the ring
+positions are read under the lock, so that the scan holds up no one;
+the histogram may then be a little off.
+*/
+
+#define PROBEBUCKETS 12
+
+static int putnum(buffer *b,const char *s,unsigned long u)
+{
+  char strnum[FMT_ULONG];
+
+  if (buffer_puts(b,s) == -1) return -1;
+  return buffer_put(b,strnum,fmt_ulong(strnum,u));
+}
+
+int cache_state(int fd)
+{
+  char bspace[1024];
+  buffer b;
+  struct ring r[RINGS];
+  unsigned long probe[PROBEBUCKETS];
+  uint32 d;
+  uint32 i;
+  uint32 n;
+  unsigned int j;
+
+  if (!x) return 0;
+
+  lock();
+  ring[cur].writer = writer;
+  ring[cur].oldest = oldest;
+  ring[cur].unused = unused;
+  byte_copy((char *) r,sizeof r,(char *) ring);
+  n = used;
+  unlock();
+
+  for (j = 0;j < PROBEBUCKETS;++j) probe[j] = 0;
+  for (i = 0;i < nslots;++i)
+    if (slot[i].hash) {
+      d = distance(home(slot[i].hash),i);
+      for (j = 0;j < PROBEBUCKETS - 1;++j)
+        if (d < (1 << j)) break;
+      ++probe[j];
     }
+
+  buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
+  if (putnum(&b,"cache size ",size) == -1) return -1;
+  if (putnum(&b," slots ",nslots) == -1) return -1;
+  if (putnum(&b," used ",n) == -1) return -1;
+  if (prev.x) {
+    if (putnum(&b," migrating ",prev.size) == -1) return -1;
+    if (putnum(&b," ",prev.used) == -1) return -1;
+  }
+  if (buffer_puts(&b,"\n") == -1) return -1;
+  for (j = 0;j < RINGS;++j) {
+    if (r[j].top <= r[j].base) continue;
+    if (putnum(&b,"ring ",j) == -1) return -1;
+    if (putnum(&b," base ",r[j].base) == -1) return -1;
+    if (putnum(&b," top ",r[j].top) == -1) return -1;
+    if (putnum(&b," writer ",r[j].writer) == -1) return -1;
+    if (putnum(&b," oldest ",r[j].oldest) == -1) return -1;
+    if (putnum(&b," unused ",r[j].unused) == -1) return -1;
+    if (buffer_puts(&b,"\n") == -1) return -1;
   }
+  if (buffer_puts(&b,"probe") == -1) return -1;
+  for (j = 0;j < PROBEBUCKETS;++j)
+    if (putnum(&b," ",probe[j]) == -1) return -1;
+  if (buffer_puts(&b,"\n") == -1) return -1;
+  return buffer_flush(&b);
+}
+
+static int getall(buffer *b,char *buf,unsigned int len)
+{
+  int r;
+
+  while (len > 0) {
+    r = buffer_get(b,buf,len);
+    if (r <= 0) return r;
+    buf += r;
+    len -= r;
+  }
+  return 1;
+}
 
-  keyhash = hash(key,keylen);
+int cache_load(int fd)
+{
+  static stralloc sa;
+  char bspace[8192];
+  buffer b;
+  char misc[20];
+  struct tai now;
+  struct tai expire;
+  struct tai limit;
+  uint32 keylen;
+  uint32 datalen;
+  uint32 ttl;
+  uint32 version;
+  int num;
+  int r;
 
+  if (!x) return 0;
+
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
   tai_now(&now);
-  tai_uint(&expire,ttl);
-  tai_add(&expire,&expire,&now);
+  tai_uint(&limit,604800);
+  tai_add(&limit,&limit,&now);
+  num = 0;
 
-  pos = get4(keyhash);
-  if (pos)
-    set4(pos,get4(pos) ^ keyhash ^ writer);
-  set4(writer,pos ^ keyhash);
-  set4(writer + 4,keylen);
-  set4(writer + 8,datalen);
-  tai_pack(x + writer + 12,&expire);
-  byte_copy(x + writer + 20,keylen,key);
-  byte_copy(x + writer + 20 + keylen,datalen,data);
-
-  set4(keyhash,writer);
-  writer += entrylen;
-  cache_motion += entrylen;
+  r = getall(&b,misc,12);
+  if (r == -1) return -1;
+  if (r == 0) return 0;
+  uint32_unpack(misc + 8,&version);
+  if (byte_diff(misc,8,DUMPMAGIC) || (version != DUMPVERSION)) {
+    errno = error_proto;
+    return -1;
+  }
+
+  for (;;) {
+    r = getall(&b,misc,20);
+    if (r == -1) return -1;
+    if (r == 0) return num;
+
+    uint32_unpack(misc,&keylen);
+    uint32_unpack(misc + 4,&datalen);
+    tai_unpack(misc + 8,&expire);
+    uint32_unpack(misc + 16,&ttl);
+    if ((keylen > MAXKEYLEN) || (datalen > MAXDATALEN)) {
+      errno = error_proto;
+      return -1;
+    }
+
+    if (!stralloc_ready(&sa,keylen + datalen)) return -1;
+    r = getall(&b,sa.s,keylen + datalen);
+    if (r == -1) return -1;
+    if (r == 0) { errno = error_proto; return -1; }
+
+    if (tai_less(&expire,&now)) continue;
+    if (tai_less(&limit,&expire)) expire = limit;
+    lock();
+    insert(sa.s,keylen,sa.s + keylen,datalen,&expire,ttl);
+    unlock();
+    ++num;
+  }
 }
 
-int cache_init(unsigned int cachesize)
+/* entries the index can find, some of them possibly expired */
+unsigned long cache_entries(void)
+{
+  if (sh) return sh->used;
+  return prev.x ? used + prev.used : used;
+}
+
+void cache_prefetch(unsigned int percent)
+{
+  if (percent > 100) percent = 100;
+  prefetch = percent;
+}
+
+void cache_secondchance(void)
+{
+  flagsecondchance = 1;
+}
+
+/* must be called before anything is stored */
+void cache_seed(const char seed[128])
+{
+  int i;
+
+  byte_zero(hashkey,sizeof hashkey);
+  for (i = 0;i < 128;++i)
+    hashkey[i & 15] ^= seed[i];
+  flagkeyed = 1;
+}
+
+/* cache_get() and cache_set() use *t as the time until the next call */
+void cache_clock(const struct tai *t)
+{
+  clocktime = *t;
+  flagclock = 1;
+}
+
+/* how long past expiry cache_stale lets an entry be used */
+void cache_stalemax(uint32 seconds)
+{
+  stalemax = seconds;
+}
+
+void cache_hugepages(void)
+{
+  flaghuge = 1;
+}
+
+/* must be called before cache_init() */
+void cache_ghost(void)
+{
+  flagghost = 1;
+}
+
+/* 0 on failure; a process may reuse a file, but not share it */
+int cache_tier(const char *fn,unsigned long n)
+{
+  char *p;
+  int fd;
+
+  n -= n % TIERSLOT;
+  if (!n) n = TIERSLOT;
+  fd = open(fn,O_RDWR | O_CREAT,0600);
+  if (fd == -1) return 0;
+  if (ftruncate(fd,n) == -1) { close(fd); return 0; }
+  p = mmap(0,n,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (p == MAP_FAILED) return 0;
+#ifdef MADV_RANDOM
+  madvise(p,n,MADV_RANDOM);
+#endif
+  tier = p;
+  tierslots = n / TIERSLOT;
+  return 1;
+}
+
+/* must be called before cache_init() */
+void cache_shared(const char *fn)
+{
+  shmfn = fn;
+}
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define HUGEPAGE 2097152
+
+/* anonymous memory comes zeroed, one page at a time on first touch */
+static char *mapspace(unsigned long n)
+{
+  char *p;
+
+#ifdef MAP_HUGETLB
+  spacemapped = (n + HUGEPAGE - 1) & ~(unsigned long) (HUGEPAGE - 1);
+  p = mmap(0,spacemapped,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+  if (p != MAP_FAILED) return p;
+#endif
+
+  spacemapped = n;
+  p = mmap(0,spacemapped,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+  if (p == MAP_FAILED) {
+    spacemapped = 0;
+    return 0;
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(p,spacemapped,MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+/* maps shmfn, setting it up unless it already matches; 0 on failure */
+static char *mapshared(unsigned long n)
+{
+  struct stat st;
+  char *p;
+  int fd;
+  int i;
+
+  fd = open(shmfn,O_RDWR | O_CREAT,0600);
+  if (fd == -1) return 0;
+  if (flock(fd,LOCK_EX) == -1) { close(fd); return 0; }
+  if (fstat(fd,&st) == -1) { close(fd); return 0; }
+  if (st.st_size != n) {
+    /* another process may have it mapped; cutting it would kill that */
+    if (st.st_size) { close(fd); errno = error_exist; return 0; }
+    if (ftruncate(fd,n) == -1) { close(fd); return 0; }
+  }
+  p = mmap(0,n,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  if (p == MAP_FAILED) { close(fd); return 0; }
+  sh = (struct shared *) p;
+  if (byte_diff(sh->magic,8,SHMMAGIC) || (sh->size != size) || (sh->nslots != nslots)) {
+    byte_zero(p,SHMHEADER + nslots * sizeof(struct slot));
+    sh->size = size;
+    sh->nslots = nslots;
+    byte_copy((char *) sh->ring,sizeof ring,(char *) ring);
+    sh->used = 0;
+    sh->flagkeyed = flagkeyed;
+    byte_copy(sh->hashkey,16,hashkey);
+    byte_copy(sh->magic,8,SHMMAGIC);
+  }
+  for (i = 0;i < RINGS;++i)
+    if ((sh->ring[i].base != ring[i].base) || (sh->ring[i].top != ring[i].top)) {
+      munmap(p,n);
+      sh = 0;
+      close(fd);
+      errno = error_exist;
+      return 0;
+    }
+  flagkeyed = sh->flagkeyed;
+  byte_copy(hashkey,16,sh->hashkey);
+  flock(fd,LOCK_UN); /* the map would keep it held */
+  close(fd);
+  spacemapped = n;
+  return p;
+}
+
+/* lays out the rings in x, all empty, and makes the last one in use */
+static void rings(void)
 {
-  if (x) {
-    alloc_free(x);
-    x = 0;
+  uint32 pos;
+  uint32 n;
+  int i;
+
+  pos = 0;
+  for (i = RINGS - 1;i >= 0;--i) {
+    n = i ? ((uint64) size * share[i]) / 100 : size - pos;
+    ring[i].base = pos;
+    ring[i].top = pos + n;
+    ring[i].writer = pos;
+    ring[i].oldest = pos + n;
+    ring[i].unused = pos + n;
+    pos += n;
   }
+  cur = 0;
+  writer = ring[0].writer;
+  oldest = ring[0].oldest;
+  unused = ring[0].unused;
+  base = ring[0].base;
+  top = ring[0].top;
+}
+
+/* must be called before cache_init(); 0 for the default */
+void cache_slots(unsigned long n)
+{
+  if (n > 0x1000000) n = 0x1000000;
+  wantslots = n;
+}
+
+/* must be called before cache_init(); percentages of the cache */
+void cache_partition(unsigned int infra,unsigned int negative)
+{
+  if (infra > 90) infra = 90;
+  if (negative > 90 - infra) negative = 90 - infra;
+  share[RING_INFRA] = infra;
+  share[RING_NEGATIVE] = negative;
+}
+
+/* entries under type go to the infra ring */
+void cache_infra(const char type[2])
+{
+  if (numinfra == INFRATYPES) return;
+  byte_copy(infratype[numinfra++],2,type);
+}
+
+/* sizes the index and the rings for an arena of cachesize */
+static void layout(unsigned int cachesize)
+{
+  uint64 n;
 
   if (cachesize > 1000000000) cachesize = 1000000000;
   if (cachesize < 100) cachesize = 100;
   size = cachesize;
 
-  hsize = 4;
-  while (hsize <= (size >> 5)) hsize <<= 1;
+  n = wantslots ? (uint64) wantslots * size / initsize : size / 40;
+  if (n > 0x1000000) n = 0x1000000;
+  nslots = (n + 7) & ~7;
+  if (nslots < 64) nslots = 64;
+  if (size >= nslots * 16) size -= nslots * 8; /* index comes out of the budget */
+  used = 0;
+  maxused = nslots - (nslots >> 2);
+  rings();
+}
+
+/* space for the arena laid out; 0 on failure */
+static int allocate(void)
+{
+  unsigned long u;
+
+  u = nslots * sizeof(struct slot) + 64 + size;
+  space = flaghuge ? mapspace(u) : alloc(u);
+  if (!space) return 0;
+  u = (unsigned long) space;
+  slot = (struct slot *) (space + ((64 - (u & 63)) & 63));
+  if (!spacemapped)
+    byte_zero((char *) slot,nslots * sizeof(struct slot));
+  x = (char *) (slot + nslots); /* x itself need not start zeroed */
+  return 1;
+}
+
+static void release(void)
+{
+  if (!space) return;
+  if (spacemapped)
+    munmap(space,spacemapped);
+  else
+    alloc_free(space);
+  space = 0;
+  spacemapped = 0;
+  x = 0;
+}
+
+int cache_init(unsigned int cachesize)
+{
+  if (prev.x) { swap(); release(); swap(); }
+  release();
+  sh = 0;
+
+  initsize = cachesize;
+  if (!initsize) initsize = 1;
+  layout(cachesize);
+  dirvalid = 0;
+  dirkeylen = 0;
+  if (!ghosts()) return 0;
+
+  if (shmfn) {
+    space = mapshared(SHMHEADER + nslots * sizeof(struct slot) + size);
+    if (!space) return 0;
+    slot = (struct slot *) (space + SHMHEADER);
+    x = (char *) (slot + nslots);
+    return 1;
+  }
+
+  return allocate();
+}
 
-  x = alloc(size);
+/* the size asked for last, arena and index; 0 if there is no cache */
+unsigned long cache_size(void)
+{
   if (!x) return 0;
-  byte_zero(x,size);
+  return size + nslots * sizeof(struct slot);
+}
 
-  writer = hsize;
-  oldest = size;
-  unused = size;
+/* bytes mapped for the cache, beyond what alloc() counts */
+unsigned long cache_mapped(void)
+{
+  return spacemapped + (prev.x ? prev.spacemapped : 0);
+}
+
+/* 1 if the move has started; 0 if there is no memory, or the cache is shared */
+int cache_resize(unsigned int cachesize)
+{
+  if (!x || sh) { errno = error_perm; return 0; }
+  while (cache_migrate(0xffffffff)) ;
 
+  swap();
+  layout(cachesize);
+  if (!allocate()) {
+    swap();
+    return 0;
+  }
+  migrating = 0;
+  dirvalid = 0;
+  return 1;
+}
+
+/* pages wholly in prev's x[from...to-1] back to the system */
+static void giveback(uint32 from,uint32 to)
+{
+  long page;
+  unsigned long u;
+  unsigned long v;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0) return;
+  u = (unsigned long) (x + from);
+  v = (unsigned long) (x + to);
+  u = (u + page - 1) & ~(page - 1);
+  v &= ~(page - 1);
+  if (u < v) madvise((char *) u,v - u,MADV_DONTNEED);
+}
+
+/* 1 if there is more to move */
+int cache_migrate(unsigned long n)
+{
+  struct tai now;
+  struct tai expire;
+  struct slot *s;
+  unsigned long moved;
+  unsigned int keylen;
+  unsigned int datalen;
+  uint32 from;
+  uint32 pos;
+  uint32 len;
+  uint32 ttl;
+  uint32 h;
+  char *key;
+
+  if (!prev.x) return 0;
+  readclock(&now);
+  moved = 0;
+
+  swap();
+  pick(migrating);
+  from = oldest;
+  while (moved < n) {
+    if (oldest == unused) {
+      giveback(from,unused);
+      if (writer == base) {
+        if (++migrating == RINGS) {
+          release();
+          swap();
+          return 0;
+        }
+        pick(migrating);
+        from = oldest;
+        continue;
+      }
+      unused = writer;
+      oldest = base;
+      writer = base;
+      from = base;
+    }
+
+    pos = oldest;
+    len = length(pos);
+    s = locate(pos);
+    if (s && !gone(pos,&now)) {
+      h = get4(pos);
+      keylen = keylenat(pos);
+      datalen = datalenat(pos);
+      expire.x = get4(pos + 8);
+      ttl = get4(pos + 12) & 0xfffff;
+      key = x + pos + HEADER;
+      swap();
+      if (!find(h,key,keylen))
+        insert(key,keylen,key + keylen,datalen,&expire,ttl);
+      swap();
+    }
+    if (s) unindex(s);
+    drop(len);
+    moved += len;
+  }
+  giveback(from,oldest);
+  swap();
   return 1;
 }
@@ -3,10 +3,53 @@
 
 #include "uint32.h"
 #include "uint64.h"
+#include "tai.h"
 
 extern uint64 cache_motion;
+extern uint64 cache_hits;
+extern uint64 cache_misses;
+extern uint64 cache_expired;
+extern uint64 cache_evictions;
+extern uint64 cache_links;
+extern uint64 cache_truncated;
+extern uint64 cache_indexfull;
+extern uint64 cache_reclaimed;
+extern uint64 cache_compacted;
+
+#define CACHE_PROBEBUCKETS 9 /* at most 1, 2, 4, ... 64 slots read; more; cut off */
+extern uint64 cache_probes[CACHE_PROBEBUCKETS];
+
+#define CACHE_GHOSTSIZES 5 /* half, same, twice, 4 and 8 times the size */
+extern uint64 cache_ghostlookups;
+extern uint64 cache_ghostmisses[CACHE_GHOSTSIZES];
+
+extern int cache_due;
+extern int cache_stale;
 extern int cache_init(unsigned int);
+extern int cache_resize(unsigned int);
+extern int cache_migrate(unsigned long);
+extern void cache_compact(unsigned long);
+extern unsigned long cache_size(void);
+extern unsigned long cache_mapped(void);
 extern void cache_set(const char *,unsigned int,const char *,unsigned int,uint32);
 extern char *cache_get(const char *,unsigned int,unsigned int *,uint32 *);
+extern void cache_dir(const char *,unsigned int);
+extern char *cache_dirget(const char [2],unsigned int *,uint32 *);
+extern int cache_dump(int);
+extern int cache_load(int);
+extern int cache_state(int);
+extern void cache_prefetch(unsigned int);
+extern unsigned long cache_entries(void);
+extern void cache_secondchance(void);
+extern void cache_seed(const char [128]);
+extern void cache_hugepages(void);
+extern void cache_ghost(void);
+extern void cache_shared(const char *);
+extern int cache_tier(const char *,unsigned long);
+extern void cache_stalemax(uint32);
+extern void cache_clock(const struct tai *);
+extern void cache_slots(unsigned long);
+extern void cache_partition(unsigned int,unsigned int);
+extern void cache_infra(const char [2]);
 
 #endif
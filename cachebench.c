@@ -0,0 +1,146 @@
+#include <unistd.h>
+#include "buffer.h"
+#include "exit.h"
+#include "byte.h"
+#include "cache.h"
+#include "scan.h"
+#include "fmt.h"
+#include "taia.h"
+#include "uint32.h"
+
+#define KEYLEN 16
+#define MAXKEYS 10000
+#define LOOKUPS 1000000
+
+char keys[MAXKEYS][KEYLEN];
+unsigned long numkeys = 2000;
+char seed[128];
+char strnum[FMT_ULONG];
+
+/* same as the unkeyed hash in cache.c */
+uint32 djb(const char *key,unsigned int keylen)
+{
+  uint32 result = 5381;
+
+  while (keylen) {
+    result = (result << 5) + result;
+    result ^= (unsigned char) *key;
+    ++key;
+    --keylen;
+  }
+  return result;
+}
+
+void prefix(char *key,unsigned long i)
+{
+  int j;
+
+  key[0] = 0; key[1] = 1;
+  for (j = 2;j < KEYLEN - 2;++j) {
+    key[j] = 'a' + (i % 26);
+    i /= 26;
+  }
+}
+
+/* keys that cache.c places near the start of the index */
+void makeflood(void)
+{
+  unsigned long i;
+  unsigned long n;
+
+  n = 0;
+  for (i = 0;n < numkeys;++i) {
+    prefix(keys[n],i);
+    keys[n][KEYLEN - 2] = 0;
+    keys[n][KEYLEN - 1] = 0;
+    if ((uint32) (djb(keys[n],KEYLEN) * 0x9e3779b1) < 0x100000) ++n;
+  }
+}
+
+void makerandom(void)
+{
+  unsigned long i;
+
+  for (i = 0;i < numkeys;++i) {
+    prefix(keys[i],i);
+    keys[i][KEYLEN - 2] = i * 7;
+    keys[i][KEYLEN - 1] = i * 13;
+  }
+}
+
+void put(const char *s)
+{
+  buffer_puts(buffer_1,s);
+}
+
+void putnum(unsigned long u)
+{
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,u));
+}
+
+void run(const char *name,int flagkeyed)
+{
+  struct taia start;
+  struct taia stop;
+  unsigned long i;
+  unsigned long hits;
+  unsigned long links;
+  unsigned int datalen;
+  uint32 ttl;
+  double secs;
+
+  if (flagkeyed) cache_seed(seed);
+  if (!cache_init(1000000)) _exit(111);
+
+  for (i = 0;i < numkeys;++i)
+    cache_set(keys[i],KEYLEN,"data",4,86400);
+
+  hits = cache_hits;
+  links = cache_links;
+  taia_now(&start);
+  for (i = 0;i < LOOKUPS;++i)
+    cache_get(keys[i % numkeys],KEYLEN,&datalen,&ttl);
+  taia_now(&stop);
+  hits = cache_hits - hits;
+  links = cache_links - links;
+
+  taia_sub(&stop,&stop,&start);
+  secs = taia_approx(&stop);
+  if (secs <= 0) secs = 0.000001;
+
+  put(name);
+  put(": hits "); putnum(hits);
+  put(" misses "); putnum(LOOKUPS - hits);
+  put(" links/lookup "); putnum(links / LOOKUPS);
+  put("."); putnum((links * 10 / LOOKUPS) % 10);
+  put(" lookups/sec "); putnum((unsigned long) (LOOKUPS / secs));
+  put("\n");
+  buffer_flush(buffer_1);
+}
+
+int main(int argc,char **argv)
+{
+  struct taia now;
+  int i;
+
+  if (argv[1]) scan_ulong(argv[1],&numkeys);
+  if (numkeys < 1) numkeys = 1;
+  if (numkeys > MAXKEYS) numkeys = MAXKEYS;
+
+  taia_now(&now);
+  taia_pack(seed,&now);
+  i = getpid();
+  byte_copy(seed + 16,sizeof i,(char *) &i);
+
+  /* cache_seed() cannot be undone, so the unkeyed runs go first */
+  makerandom();
+  run("unkeyed random",0);
+  makeflood();
+  run("unkeyed flood",0);
+  makerandom();
+  run("siphash random",1);
+  makeflood();
+  run("siphash flood",1);
+
+  _exit(0);
+}
@@ -1,7 +1,12 @@
+#include <unistd.h>
 #include "buffer.h"
 #include "exit.h"
 #include "cache.h"
 #include "str.h"
+#include "env.h"
+#include "fmt.h"
+#include "open.h"
+#include "error.h"
 
 int main(int argc,char **argv)
 {
@@ -10,12 +15,35 @@ int main(int argc,char **argv)
   char *y;
   unsigned int u;
   uint32 ttl;
+  char strnum[FMT_ULONG];
+  int fd;
+  int r;
 
+  if (env_get("HUGEPAGES")) cache_hugepages();
   if (!cache_init(200)) _exit(111);
+  if (env_get("SECONDCHANCE")) cache_secondchance();
 
   if (*argv) ++argv;
 
   while (x = *argv++) {
+    if (*x == '+') { /* dump to the file */
+      fd = open_trunc(x + 1);
+      if ((fd == -1) || (cache_dump(fd) == -1)) _exit(111);
+      close(fd);
+      continue;
+    }
+    if (*x == '-') { /* load from the file */
+      fd = open_read(x + 1);
+      if (fd == -1) _exit(111);
+      r = cache_load(fd);
+      close(fd);
+      if (r == -1)
+        buffer_puts(buffer_1,error_str(errno));
+      else
+        buffer_put(buffer_1,strnum,fmt_ulong(strnum,r));
+      buffer_puts(buffer_1,"\n");
+      continue;
+    }
     i = str_chr(x,':');
     if (x[i])
       cache_set(x,i,x + i + 1,str_len(x) - i - 1,86400);
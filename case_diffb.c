@@ -1,9 +1,22 @@
 #include "case.h"
+#include "word.h"
 
 int case_diffb(register const char *s,register unsigned int len,register const char *t)
 {
   register unsigned char x;
   register unsigned char y;
+#ifdef WORD_FAST
+  word u;
+  word v;
+
+  while (len >= sizeof u) {
+    word_load(u,s);
+    word_load(v,t);
+    if (u != v)
+      if ((u | word_upper(u)) != (v | word_upper(v))) break;
+    s += sizeof u; t += sizeof u; len -= sizeof u;
+  }
+#endif
 
   while (len > 0) {
     --len;
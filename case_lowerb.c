@@ -1,8 +1,19 @@
 #include "case.h"
+#include "word.h"
 
 void case_lowerb(char *s,unsigned int len)
 {
   unsigned char x;
+#ifdef WORD_FAST
+  word w;
+
+  while (len >= sizeof w) {
+    word_load(w,s);
+    w |= word_upper(w);
+    word_store(s,w);
+    s += sizeof w; len -= sizeof w;
+  }
+#endif
   while (len > 0) {
     --len;
     x = *s - 'A';
@@ -7,7 +7,9 @@
 #include "error.h"
 #include "seek.h"
 #include "byte.h"
+#include "word.h"
 #include "cdb.h"
+#include "perfcount.h"
 
 void cdb_free(struct cdb *c)
 {
@@ -20,28 +22,53 @@ void cdb_free(struct cdb *c)
 void cdb_findstart(struct cdb *c)
 {
   c->loop = 0;
+  c->flaghash = 0;
+}
+
+/* as cdb_findstart(), for a key the caller knows the cdb_hash() of */
+void cdb_findstarthash(struct cdb *c,uint32 h)
+{
+  c->loop = 0;
+  c->khash = h;
+  c->flaghash = 1;
+}
+
+static uint64 unpack64(const char *s)
+{
+  uint32 lo;
+  uint32 hi;
+
+  uint32_unpack(s,&lo);
+  uint32_unpack(s + 4,&hi);
+  return (((uint64) hi) << 32) + lo;
 }
 
 void cdb_init(struct cdb *c,int fd)
 {
   struct stat st;
+  char buf[24];
   char *x;
 
   cdb_free(c);
   cdb_findstart(c);
   c->fd = fd;
+  c->dir = 0;
 
   if (fstat(fd,&st) == 0)
-    if (st.st_size <= 0xffffffff) {
+    if ((size_t) st.st_size == st.st_size) {
       x = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
       if (x + 1) {
 	c->size = st.st_size;
 	c->map = x;
       }
     }
+
+  if (cdb_read(c,buf,24,0) == 0)
+    if (byte_equal(buf,16,CDB64_MAGIC))
+      c->dir = unpack64(buf + 16);
 }
 
-int cdb_read(struct cdb *c,char *buf,unsigned int len,uint32 pos)
+int cdb_read(struct cdb *c,char *buf,unsigned int len,uint64 pos)
 {
   if (c->map) {
     if ((pos > c->size) || (c->size - pos < len)) goto FORMAT;
@@ -67,11 +94,32 @@ int cdb_read(struct cdb *c,char *buf,unsigned int len,uint32 pos)
   return -1;
 }
 
-static int match(struct cdb *c,const char *key,unsigned int len,uint32 pos)
+const char *cdb_get(struct cdb *c,char *buf,unsigned int len,uint64 pos)
+{
+  if (c->map) {
+    if ((pos > c->size) || (c->size - pos < len)) {
+      errno = error_proto;
+      return 0;
+    }
+    return c->map + pos;
+  }
+  if (cdb_read(c,buf,len,pos) == -1) return 0;
+  return buf;
+}
+
+static int match(struct cdb *c,const char *key,unsigned int len,uint64 pos)
 {
   char buf[32];
   int n;
 
+  if (c->map) {
+    if ((pos > c->size) || (c->size - pos < len)) {
+      errno = error_proto;
+      return -1;
+    }
+    return word_equal(c->map + pos,key,len);
+  }
+
   while (len > 0) {
     n = sizeof buf;
     if (n > len) n = len;
@@ -84,42 +132,100 @@ static int match(struct cdb *c,const char *key,unsigned int len,uint32 pos)
   return 1;
 }
 
-int cdb_findnext(struct cdb *c,const char *key,unsigned int len)
+/* records run from 2048 to the first hash table */
+
+int cdb_eod(struct cdb *c,uint64 *eod)
 {
   char buf[8];
+  uint32 u;
+
+  if (c->dir) {
+    if (cdb_read(c,buf,8,c->dir) == -1) return -1;
+    *eod = unpack64(buf);
+    return 0;
+  }
+  if (cdb_read(c,buf,4,0) == -1) return -1;
+  uint32_unpack(buf,&u);
+  *eod = u;
+  return 0;
+}
+
+/* which hash table h goes in, and how many slots it has */
+
+static int table(struct cdb *c,uint32 h,uint64 *hpos,uint32 *hslots)
+{
+  char buf[16];
+  uint64 u;
   uint32 pos;
+
+  if (c->dir) {
+    if (cdb_read(c,buf,16,c->dir + ((h & 255) << 4)) == -1) return -1;
+    *hpos = unpack64(buf);
+    u = unpack64(buf + 8);
+    if (u > 0xffffffff) { errno = error_proto; return -1; }
+    *hslots = u;
+    return 0;
+  }
+  if (cdb_read(c,buf,8,(h << 3) & 2047) == -1) return -1;
+  uint32_unpack(buf,&pos);
+  uint32_unpack(buf + 4,hslots);
+  *hpos = pos;
+  return 0;
+}
+
+#define SLOT(c) ((c)->dir ? 16 : 8)
+
+static int slot(struct cdb *c,uint64 kpos,uint32 *h,uint64 *pos)
+{
+  char buf[16];
+  const char *x;
+  uint32 u;
+
+  if (c->dir) {
+    x = cdb_get(c,buf,16,kpos); if (!x) return -1;
+    uint32_unpack(x,h);
+    *pos = unpack64(x + 8);
+    return 0;
+  }
+  x = cdb_get(c,buf,8,kpos); if (!x) return -1;
+  uint32_unpack(x,h);
+  uint32_unpack(x + 4,&u);
+  *pos = u;
+  return 0;
+}
+
+static int findnext(struct cdb *c,const char *key,unsigned int len)
+{
+  char buf[8];
+  const char *x;
+  uint64 pos;
   uint32 u;
 
   if (!c->loop) {
-    u = cdb_hash(key,len);
-    if (cdb_read(c,buf,8,(u << 3) & 2047) == -1) return -1;
-    uint32_unpack(buf + 4,&c->hslots);
+    u = c->flaghash ? c->khash : cdb_hash(key,len);
+    if (table(c,u,&c->hpos,&c->hslots) == -1) return -1;
     if (!c->hslots) return 0;
-    uint32_unpack(buf,&c->hpos);
     c->khash = u;
     u >>= 8;
     u %= c->hslots;
-    u <<= 3;
-    c->kpos = c->hpos + u;
+    c->kpos = c->hpos + (uint64) u * SLOT(c);
   }
 
   while (c->loop < c->hslots) {
-    if (cdb_read(c,buf,8,c->kpos) == -1) return -1;
-    uint32_unpack(buf + 4,&pos);
+    if (slot(c,c->kpos,&u,&pos) == -1) return -1;
     if (!pos) return 0;
     c->loop += 1;
-    c->kpos += 8;
-    if (c->kpos == c->hpos + (c->hslots << 3)) c->kpos = c->hpos;
-    uint32_unpack(buf,&u);
+    c->kpos += SLOT(c);
+    if (c->kpos == c->hpos + (uint64) c->hslots * SLOT(c)) c->kpos = c->hpos;
     if (u == c->khash) {
-      if (cdb_read(c,buf,8,pos) == -1) return -1;
-      uint32_unpack(buf,&u);
+      x = cdb_get(c,buf,8,pos); if (!x) return -1;
+      uint32_unpack(x,&u);
       if (u == len)
 	switch(match(c,key,len,pos + 8)) {
 	  case -1:
 	    return -1;
 	  case 1:
-	    uint32_unpack(buf + 4,&c->dlen);
+	    uint32_unpack(x + 4,&c->dlen);
 	    c->dpos = pos + 8 + len;
 	    return 1;
 	}
@@ -129,8 +235,89 @@ int cdb_findnext(struct cdb *c,const char *key,unsigned int len)
   return 0;
 }
 
+int cdb_findnext(struct cdb *c,const char *key,unsigned int len)
+{
+  int r;
+  PERFCOUNT_BEGIN(PERF_CDB_FINDNEXT)
+
+  r = findnext(c,key,len);
+  PERFCOUNT_END(PERF_CDB_FINDNEXT)
+  return r;
+}
+
 int cdb_find(struct cdb *c,const char *key,unsigned int len)
 {
   cdb_findstart(c);
   return cdb_findnext(c,key,len);
 }
+
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p) ;
+#endif
+
+/* map offset of the first hash slot searched for h, or 0 */
+
+static uint64 firstslot(struct cdb *c,uint32 h)
+{
+  uint64 hpos;
+  uint32 hslots;
+
+  if (table(c,h,&hpos,&hslots) == -1) return 0;
+  if (!hslots) return 0;
+  hpos += (uint64) ((h >> 8) % hslots) * SLOT(c);
+  if ((hpos > c->size) || (c->size - hpos < SLOT(c))) return 0;
+  return hpos;
+}
+
+void cdb_prefetch(struct cdb *c,const char *key,unsigned int len)
+{
+  uint64 pos;
+
+  if (!c->map) return;
+  pos = firstslot(c,cdb_hash(key,len));
+  if (pos) prefetch(c->map + pos);
+}
+
+/*
+cdb_findfirst() looks for key[0], key[1], ... in turn and stops at the
+first one present, as a loop of cdb_find() would, returning its index
+plus 1. First it prefetches the hash slots of all the keys, then the
+records those slots point to, so that the cache misses of the
+lookups overlap instead of following one another.
+*/
+
+#define FINDMANY 32
+
+int cdb_findfirst(struct cdb *c,const char * const *key,const unsigned int *len,unsigned int n)
+{
+  uint32 hash[FINDMANY];
+  uint64 first[FINDMANY];
+  uint32 u;
+  uint64 pos;
+  unsigned int m;
+  unsigned int i;
+  int r;
+
+  if (c->map) {
+    m = n;
+    if (m > FINDMANY) m = FINDMANY;
+    for (i = 0;i < m;++i) {
+      hash[i] = cdb_hash(key[i],len[i]);
+      first[i] = firstslot(c,hash[i]);
+      if (first[i]) prefetch(c->map + first[i]);
+    }
+    for (i = 0;i < m;++i)
+      if (first[i])
+        if (slot(c,first[i],&u,&pos) == 0)
+          if ((u == hash[i]) && pos && (pos < c->size)) prefetch(c->map + pos);
+  }
+
+  for (i = 0;i < n;++i) {
+    r = cdb_find(c,key[i],len[i]);
+    if (r == -1) return -1;
+    if (r) return i + 1;
+  }
+  return 0;
+}
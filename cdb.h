@@ -4,34 +4,92 @@
 #define CDB_H
 
 #include "uint32.h"
+#include "uint64.h"
 
 #define CDB_HASHSTART 5381
 extern uint32 cdb_hashadd(uint32,unsigned char);
 extern uint32 cdb_hash(const char *,unsigned int);
 
+/*
+A cdb64 file starts with CDB64_MAGIC and the 8-byte position of a
+directory of 256 16-byte (position, slots) pairs, stored after the
+hash tables; its hash slots are 16 bytes, a 4-byte hash, 4 zero
+bytes and an 8-byte position. Records are laid out as in a cdb.
+The magic cannot begin a cdb: it would put table 0 at 0xffffffff.
+*/
+
+#define CDB64_MAGIC "\377\377\377\377\377\377\377\377cdb64\0\0\0"
+
 struct cdb {
   char *map; /* 0 if no map is available */
   int fd;
-  uint32 size; /* initialized if map is nonzero */
+  uint64 size; /* initialized if map is nonzero */
+  uint64 dir; /* 0 for a cdb, else position of the cdb64 directory */
   uint32 loop; /* number of hash slots searched under this key */
-  uint32 khash; /* initialized if loop is nonzero */
-  uint32 kpos; /* initialized if loop is nonzero */
-  uint32 hpos; /* initialized if loop is nonzero */
+  uint32 khash; /* initialized if loop is nonzero, or if flaghash */
+  int flaghash; /* 1 if khash came from cdb_findstarthash() */
+  uint64 kpos; /* initialized if loop is nonzero */
+  uint64 hpos; /* initialized if loop is nonzero */
   uint32 hslots; /* initialized if loop is nonzero */
-  uint32 dpos; /* initialized if cdb_findnext() returns 1 */
+  uint64 dpos; /* initialized if cdb_findnext() returns 1 */
   uint32 dlen; /* initialized if cdb_findnext() returns 1 */
 } ;
 
 extern void cdb_free(struct cdb *);
 extern void cdb_init(struct cdb *,int fd);
 
-extern int cdb_read(struct cdb *,char *,unsigned int,uint32);
+extern int cdb_read(struct cdb *,char *,unsigned int,uint64);
+extern const char *cdb_get(struct cdb *,char *,unsigned int,uint64);
+extern int cdb_eod(struct cdb *,uint64 *);
 
 extern void cdb_findstart(struct cdb *);
+extern void cdb_findstarthash(struct cdb *,uint32);
 extern int cdb_findnext(struct cdb *,const char *,unsigned int);
 extern int cdb_find(struct cdb *,const char *,unsigned int);
 
+extern void cdb_prefetch(struct cdb *,const char *,unsigned int);
+extern int cdb_findfirst(struct cdb *,const char * const *,const unsigned int *,unsigned int);
+
 #define cdb_datapos(c) ((c)->dpos)
 #define cdb_datalen(c) ((c)->dlen)
 
+/*
+Scans go through records in file order. cdb_scanstart(s,c,pos,end)
+sets s up for the records from pos to end, such as a range from a
+zone index; cdb_scanall(s,c) for all of them; cdb_scanshard(s,c,i,n)
+for the i-th of n parts of them, cut where records start, so that n
+scans, in n processes say, together go through each record once.
+Finding the cuts reads every hash table. cdb_scannext(s) returns 1
+and sets s->key, s->klen, s->data, s->dlen to the next record, 0 at
+the end, -1 on error, setting errno. With c mapped, key and data
+point into the map, and the kernel is asked to read CDB_SCANAHEAD
+bytes ahead of the scan; else they point into a buffer of s's own,
+good until the next call, kept for later scans with s, and freed by
+cdb_scanfree(s). s starts out zero, as a static one does.
+*/
+
+#define CDB_SCANAHEAD 1048576
+#define CDB_SCANCHUNK 65536 /* bytes read at once without a map */
+
+struct cdb_scan {
+  struct cdb *c;
+  uint64 pos;
+  uint64 end;
+  uint64 ahead; /* asked for up to here */
+  char *buf; /* without a map */
+  unsigned int bufsize;
+  uint64 bufpos; /* buf holds buflen bytes from here */
+  unsigned int buflen;
+  const char *key;
+  uint32 klen;
+  const char *data;
+  uint32 dlen;
+} ;
+
+extern void cdb_scanstart(struct cdb_scan *,struct cdb *,uint64,uint64);
+extern int cdb_scanall(struct cdb_scan *,struct cdb *);
+extern int cdb_scanshard(struct cdb_scan *,struct cdb *,unsigned int,unsigned int);
+extern int cdb_scannext(struct cdb_scan *);
+extern void cdb_scanfree(struct cdb_scan *);
+
 #endif
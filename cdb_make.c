@@ -1,8 +1,12 @@
 /* Public domain. */
 
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "seek.h"
 #include "error.h"
 #include "alloc.h"
+#include "byte.h"
 #include "cdb.h"
 #include "cdb_make.h"
 
@@ -12,15 +16,202 @@ int cdb_make_start(struct cdb_make *c,int fd)
   c->split = 0;
   c->hash = 0;
   c->numentries = 0;
+  c->flag64 = 0;
   c->fd = fd;
+  c->fdspill = -1;
+  c->nummem = 0;
+  c->numruns = 0;
+  c->runs = 0;
+  c->numspilled = 0;
+  c->big = 0;
+  c->workers = 1;
   c->pos = sizeof c->final;
+  byte_zero(c->final,sizeof c->final);
   buffer_init(&c->b,buffer_unixwrite,fd,c->bspace,sizeof c->bspace);
-  return seek_set(fd,c->pos);
+  if (seek_begin(fd) == -1) return -1;
+  return buffer_putalign(&c->b,c->final,sizeof c->final);
+}
+
+int cdb_make_start64(struct cdb_make *c,int fd)
+{
+  if (cdb_make_start(c,fd) == -1) return -1;
+  c->flag64 = 1;
+  return 0;
+}
+
+/*
+The header goes to the buffer as zeros to begin with, so that writes
+start at offset 0 and each one but the last fills the whole buffer;
+cdb_make_finish() puts the real header in place with one pwrite(2).
+cdb_make_buffer(), called right after cdb_make_start(), swaps the
+built-in 8K for len bytes, a multiple of the page size for aligned
+writes. If that memory is not there, the 8K stays.
+*/
+
+void cdb_make_buffer(struct cdb_make *c,unsigned int len)
+{
+  char *x;
+
+  if (len <= sizeof c->bspace) return;
+  x = alloc(len);
+  if (!x) return;
+  c->big = x;
+  buffer_init(&c->b,buffer_unixwrite,c->fd,x,len);
+  buffer_putalign(&c->b,c->final,sizeof c->final);
+}
+
+/* everything added so far is then in the file, from 2048 to c->pos */
+
+int cdb_make_flush(struct cdb_make *c)
+{
+  return buffer_flush(&c->b);
+}
+
+/*
+With a spill file, every CDB_SPILL hash/pos pairs are sorted by table
+and appended to it as a run, 12 bytes a pair. cdb_make_finish() then
+reads back one table at a time, so it needs memory for the largest
+table rather than for every record. The output is the same.
+*/
+
+void cdb_make_spill(struct cdb_make *c,int fd)
+{
+  c->fdspill = fd;
+  buffer_init(&c->bs,buffer_unixwrite,fd,c->bsspace,sizeof c->bsspace);
+}
+
+static void freelist(struct cdb_make *c)
+{
+  struct cdb_hplist *x;
+
+  while ((x = c->head)) {
+    c->head = x->next;
+    alloc_free((char *) x);
+  }
+}
+
+static int spill(struct cdb_make *c)
+{
+  char buf[12];
+  uint32 u;
+  uint64 *run;
+  struct cdb_hplist *x;
+  int i;
+
+  if (!alloc_re((char **) &c->runs,c->numruns * 257 * sizeof(uint64),(c->numruns + 1) * 257 * sizeof(uint64)))
+    return -1;
+  run = c->runs + c->numruns * 257;
+
+  for (i = 0;i < 256;++i)
+    c->count[i] = 0;
+  for (x = c->head;x;x = x->next) {
+    i = x->num;
+    while (i--)
+      ++c->count[255 & x->hp[i].h];
+  }
+  u = 0;
+  for (i = 0;i < 256;++i) {
+    run[i] = c->numspilled + u;
+    u += c->count[i];
+    c->start[i] = u;
+  }
+  run[256] = c->numspilled + u;
+
+  c->split = (struct cdb_hp *) alloc(u * sizeof(struct cdb_hp) + 1);
+  if (!c->split) return -1;
+  for (x = c->head;x;x = x->next) {
+    i = x->num;
+    while (i--)
+      c->split[--c->start[255 & x->hp[i].h]] = x->hp[i];
+  }
+  freelist(c);
+
+  for (i = 0;i < u;++i) {
+    uint32_pack(buf,c->split[i].h);
+    uint32_pack(buf + 4,(uint32) c->split[i].p);
+    uint32_pack(buf + 8,(uint32) (c->split[i].p >> 32));
+    if (buffer_put(&c->bs,buf,12) == -1) break;
+  }
+  alloc_free((char *) c->split);
+  c->split = 0;
+  if (i < u) return -1;
+
+  c->numspilled += u;
+  c->nummem = 0;
+  ++c->numruns;
+  return 0;
+}
+
+static int readall(int fd,char *buf,uint64 len,uint64 pos)
+{
+  int r;
+
+  while (len) {
+    r = pread(fd,buf,len > 65536 ? 65536 : len,(off_t) pos);
+    if (r == -1) {
+      if (errno == error_intr) continue;
+      return -1;
+    }
+    if (r == 0) { errno = error_io; return -1; }
+    buf += r;
+    len -= r;
+    pos += r;
+  }
+  return 0;
+}
+
+static int writeall(int fd,const char *buf,uint64 len,uint64 pos)
+{
+  int w;
+
+  while (len) {
+    w = pwrite(fd,buf,len > 65536 ? 65536 : len,(off_t) pos);
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      return -1;
+    }
+    if (w == 0) { errno = error_io; return -1; }
+    buf += w;
+    len -= w;
+    pos += w;
+  }
+  return 0;
+}
+
+/* reads table i of every run into c->split, using c->hash as space */
+static int unspill(struct cdb_make *c,int i)
+{
+  uint32 r;
+  uint32 u;
+  uint32 n;
+  uint32 h;
+  uint32 lo;
+  uint32 hi;
+  uint64 *run;
+  char *buf;
+
+  n = 0;
+  buf = (char *) c->hash;
+  for (r = 0;r < c->numruns;++r) {
+    run = c->runs + r * 257;
+    u = run[i + 1] - run[i];
+    if (!u) continue;
+    if (readall(c->fdspill,buf + n * 12,(uint64) u * 12,run[i] * 12) == -1) return -1;
+    n += u;
+  }
+  for (u = 0;u < n;++u) {
+    uint32_unpack(buf + u * 12,&h);
+    uint32_unpack(buf + u * 12 + 4,&lo);
+    uint32_unpack(buf + u * 12 + 8,&hi);
+    c->split[u].h = h;
+    c->split[u].p = ((uint64) hi << 32) + lo;
+  }
+  return 0;
 }
 
 static int posplus(struct cdb_make *c,uint32 len)
 {
-  uint32 newpos = c->pos + len;
+  uint64 newpos = c->pos + len;
   if (newpos < len) { errno = error_nomem; return -1; }
   c->pos = newpos;
   return 0;
@@ -42,6 +233,9 @@ int cdb_make_addend(struct cdb_make *c,unsigned int keylen,unsigned int datalen,
   head->hp[head->num].p = c->pos;
   ++head->num;
   ++c->numentries;
+  if (c->fdspill != -1)
+    if (++c->nummem >= CDB_SPILL)
+      if (spill(c) == -1) return -1;
   if (posplus(c,8) == -1) return -1;
   if (posplus(c,keylen) == -1) return -1;
   if (posplus(c,datalen) == -1) return -1;
@@ -69,17 +263,140 @@ int cdb_make_add(struct cdb_make *c,const char *key,unsigned int keylen,const ch
   return cdb_make_addend(c,keylen,datalen,cdb_hash(key,keylen));
 }
 
+static void pack64(char *s,uint64 u)
+{
+  uint32_pack(s,(uint32) u);
+  uint32_pack(s + 4,(uint32) (u >> 32));
+}
+
+/* fills c->hash with table i */
+static int fill(struct cdb_make *c,int i)
+{
+  struct cdb_hp *hp;
+  uint32 count;
+  uint32 len;
+  uint32 where;
+  uint32 u;
+
+  count = c->count[i];
+  len = count + count; /* no overflow possible */
+
+  hp = c->split + c->start[i];
+  if (c->fdspill != -1) {
+    if (unspill(c,i) == -1) return -1;
+    hp = c->split;
+  }
+
+  for (u = 0;u < len;++u)
+    c->hash[u].h = c->hash[u].p = 0;
+
+  for (u = 0;u < count;++u) {
+    where = (hp->h >> 8) % len;
+    while (c->hash[where].p)
+      if (++where == len)
+        where = 0;
+    c->hash[where] = *hp++;
+  }
+  return 0;
+}
+
+static void slot(struct cdb_make *c,char buf[16],uint32 u)
+{
+  uint32_pack(buf,c->hash[u].h);
+  if (c->flag64) {
+    uint32_pack(buf + 4,0);
+    pack64(buf + 8,c->hash[u].p);
+  }
+  else
+    uint32_pack(buf + 4,(uint32) c->hash[u].p);
+}
+
+/*
+With cdb_make_workers(c,n), cdb_make_finish() forks n processes once
+the pairs are split by table. Process w fills every table i with i%n
+equal to w, in its own copy of c->hash, and writes it in place with
+pwrite(2), the position of each table being known from the counts.
+The spill file is read with pread(2), so the processes do not share
+an offset. The output is the same as from one process.
+*/
+
+void cdb_make_workers(struct cdb_make *c,unsigned int n)
+{
+  c->workers = n ? n : 1;
+}
+
+static void worker(struct cdb_make *c,unsigned int w,unsigned int slotsize)
+{
+  uint32 len;
+  uint32 u;
+  uint64 pos;
+  unsigned int n;
+  int i;
+
+  for (i = w;i < 256;i += c->workers) {
+    if (fill(c,i) == -1) _exit(111);
+    len = 2 * c->count[i];
+    pos = c->table[i];
+    n = 0;
+    for (u = 0;u < len;++u) {
+      slot(c,c->bspace + n,u);
+      n += slotsize;
+      if ((n + slotsize > sizeof c->bspace) || (u + 1 == len)) {
+        if (writeall(c->fd,c->bspace,n,pos) == -1) _exit(111);
+        pos += n;
+        n = 0;
+      }
+    }
+  }
+  _exit(0);
+}
+
+static int parallel(struct cdb_make *c,unsigned int slotsize)
+{
+  int pid[256];
+  unsigned int n;
+  unsigned int w;
+  int wstat;
+  int r;
+
+  n = c->workers;
+  if (n > 256) n = 256;
+  c->workers = n;
+  for (w = 0;w < n;++w) {
+    pid[w] = fork();
+    if (pid[w] == 0) worker(c,w,slotsize);
+    if (pid[w] == -1) break;
+  }
+
+  r = 0;
+  if (w < n) r = -1;
+  while (w--) {
+    while (waitpid(pid[w],&wstat,0) == -1)
+      if (errno != error_intr) return -1;
+    if (!WIFEXITED(wstat) || WEXITSTATUS(wstat)) { errno = error_io; r = -1; }
+  }
+  return r;
+}
+
+/* the result is a cdb if it fits in 4 gigabytes, else a cdb64 */
+
 int cdb_make_finish(struct cdb_make *c)
 {
-  char buf[8];
+  char buf[16];
   int i;
   uint32 len;
   uint32 u;
   uint32 memsize;
   uint32 count;
-  uint32 where;
+  uint64 tables;
+  unsigned int slotsize;
   struct cdb_hplist *x;
-  struct cdb_hp *hp;
+
+  if (c->fdspill != -1) {
+    if (c->head)
+      if (spill(c) == -1) return -1;
+    if (buffer_flush(&c->bs) == -1) return -1;
+  }
 
   for (i = 0;i < 256;++i)
     c->count[i] = 0;
@@ -89,6 +406,16 @@ int cdb_make_finish(struct cdb_make *c)
     while (i--)
       ++c->count[255 & x->hp[i].h];
   }
+  for (u = 0;u < c->numruns;++u)
+    for (i = 0;i < 256;++i)
+      c->count[i] += c->runs[u * 257 + i + 1] - c->runs[u * 257 + i];
+
+  tables = 0;
+  for (i = 0;i < 256;++i)
+    tables += 16 * (uint64) c->count[i];
+  if (c->pos + tables > 0xffffffff) c->flag64 = 1;
+  tables = 0;
+  slotsize = c->flag64 ? 16 : 8;
 
   memsize = 1;
   for (i = 0;i < 256;++i) {
@@ -97,7 +424,11 @@ int cdb_make_finish(struct cdb_make *c)
       memsize = u;
   }
 
-  memsize += c->numentries; /* no overflow possible up to now */
+  /* with a spill file, split holds one table at a time */
+  count = c->numentries;
+  if (c->fdspill != -1) count = memsize / 2;
+
+  memsize += count; /* no overflow possible up to now */
   u = (uint32) 0 - (uint32) 1;
   u /= sizeof(struct cdb_hp);
   if (memsize > u) { errno = error_nomem; return -1; }
@@ -105,7 +436,7 @@ int cdb_make_finish(struct cdb_make *c)
   c->split = (struct cdb_hp *) alloc(memsize * sizeof(struct cdb_hp));
   if (!c->split) return -1;
 
-  c->hash = c->split + c->numentries;
+  c->hash = c->split + count;
 
   u = 0;
   for (i = 0;i < 256;++i) {
@@ -120,33 +451,44 @@ int cdb_make_finish(struct cdb_make *c)
   }
 
   for (i = 0;i < 256;++i) {
-    count = c->count[i];
-
-    len = count + count; /* no overflow possible */
-    uint32_pack(c->final + 8 * i,c->pos);
-    uint32_pack(c->final + 8 * i + 4,len);
-
-    for (u = 0;u < len;++u)
-      c->hash[u].h = c->hash[u].p = 0;
-
-    hp = c->split + c->start[i];
-    for (u = 0;u < count;++u) {
-      where = (hp->h >> 8) % len;
-      while (c->hash[where].p)
-	if (++where == len)
-	  where = 0;
-      c->hash[where] = *hp++;
+    c->table[i] = c->pos + tables;
+    uint32_pack(c->final + 8 * i,(uint32) c->table[i]);
+    uint32_pack(c->final + 8 * i + 4,c->count[i] * 2);
+    tables += slotsize * 2 * (uint64) c->count[i];
+  }
+
+  if (c->workers > 1) {
+    if (buffer_flush(&c->b) == -1) return -1;
+    if (parallel(c,slotsize) == -1) return -1;
+    c->pos += tables;
+    if (seek_set(c->fd,(seek_pos) c->pos) == -1) return -1;
+  }
+  else
+    for (i = 0;i < 256;++i) {
+      if (fill(c,i) == -1) return -1;
+      len = 2 * c->count[i];
+      for (u = 0;u < len;++u) {
+        slot(c,buf,u);
+        if (buffer_putalign(&c->b,buf,slotsize) == -1) return -1;
+        if (posplus(c,slotsize) == -1) return -1;
+      }
     }
 
-    for (u = 0;u < len;++u) {
-      uint32_pack(buf,c->hash[u].h);
-      uint32_pack(buf + 4,c->hash[u].p);
-      if (buffer_putalign(&c->b,buf,8) == -1) return -1;
-      if (posplus(c,8) == -1) return -1;
+  if (c->flag64) {
+    byte_zero(c->final,sizeof c->final);
+    byte_copy(c->final,16,CDB64_MAGIC);
+    pack64(c->final + 16,c->pos);
+    for (i = 0;i < 256;++i) {
+      pack64(buf,c->table[i]);
+      pack64(buf + 8,2 * (uint64) c->count[i]);
+      if (buffer_putalign(&c->b,buf,16) == -1) return -1;
+      if (posplus(c,16) == -1) return -1;
     }
   }
 
   if (buffer_flush(&c->b) == -1) return -1;
-  if (seek_begin(c->fd) == -1) return -1;
-  return buffer_putflush(&c->b,c->final,sizeof c->final);
+  if (c->big) alloc_free(c->big);
+  c->big = 0;
+
+  return writeall(c->fd,c->final,sizeof c->final,0);
 }
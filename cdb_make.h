@@ -5,10 +5,13 @@
 
 #include "buffer.h"
 #include "uint32.h"
+#include "uint64.h"
 
 #define CDB_HPLIST 1000
+#define CDB_SPILL 1000000 /* pairs kept in memory before spilling */
+#define CDB_BUFFER 4194304 /* a good size for cdb_make_buffer() */
 
-struct cdb_hp { uint32 h; uint32 p; } ;
+struct cdb_hp { uint32 h; uint64 p; } ;
 
 struct cdb_hplist {
   struct cdb_hp hp[CDB_HPLIST];
@@ -26,11 +29,27 @@ struct cdb_make {
   struct cdb_hp *hash;
   uint32 numentries;
   buffer b;
-  uint32 pos;
+  uint64 pos;
+  uint64 table[256];
+  int flag64; /* write a cdb64 even if a cdb would do */
   int fd;
+  int fdspill; /* -1: keep every hash/pos pair in memory */
+  uint32 nummem;
+  uint32 numruns;
+  uint64 *runs; /* 257 pair indexes for each spilled run */
+  uint64 numspilled;
+  buffer bs;
+  char bsspace[4096];
+  char *big; /* 0, or the buffer from cdb_make_buffer() */
+  unsigned int workers; /* processes filling hash tables */
 } ;
 
 extern int cdb_make_start(struct cdb_make *,int);
+extern int cdb_make_start64(struct cdb_make *,int);
+extern void cdb_make_spill(struct cdb_make *,int);
+extern void cdb_make_buffer(struct cdb_make *,unsigned int);
+extern void cdb_make_workers(struct cdb_make *,unsigned int);
+extern int cdb_make_flush(struct cdb_make *);
 extern int cdb_make_addbegin(struct cdb_make *,unsigned int,unsigned int);
 extern int cdb_make_addend(struct cdb_make *,unsigned int,unsigned int,uint32);
 extern int cdb_make_add(struct cdb_make *,const char *,unsigned int,const char *,unsigned int);
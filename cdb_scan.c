@@ -0,0 +1,190 @@
+/* Public domain. */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "error.h"
+#include "alloc.h"
+#include "byte.h"
+#include "cdb.h"
+
+void cdb_scanstart(struct cdb_scan *s,struct cdb *c,uint64 pos,uint64 end)
+{
+  s->c = c;
+  s->pos = pos;
+  s->end = end;
+  s->ahead = pos;
+  s->buflen = 0;
+}
+
+int cdb_scanall(struct cdb_scan *s,struct cdb *c)
+{
+  uint64 eod;
+
+  if (cdb_eod(c,&eod) == -1) return -1;
+  cdb_scanstart(s,c,2048,eod);
+  return 0;
+}
+
+static uint64 unpack64(const char *s)
+{
+  uint32 lo;
+  uint32 hi;
+
+  uint32_unpack(s,&lo);
+  uint32_unpack(s + 4,&hi);
+  return (((uint64) hi) << 32) + lo;
+}
+
+/* the first record at or after t, from the hash tables */
+/* first[0] for t[0], first[1] for t[1] */
+
+static int cut(struct cdb *c,uint64 eod,const uint64 t[2],uint64 first[2])
+{
+  char head[16];
+  char buf[1024];
+  const char *x;
+  uint64 hpos;
+  uint64 slots;
+  uint64 pos;
+  uint32 u;
+  unsigned int slotlen;
+  unsigned int n;
+  unsigned int i;
+  unsigned int j;
+
+  slotlen = c->dir ? 16 : 8;
+  first[0] = first[1] = eod;
+  for (i = 0;i < 256;++i) {
+    if (c->dir) {
+      if (cdb_read(c,head,16,c->dir + (i << 4)) == -1) return -1;
+      hpos = unpack64(head);
+      slots = unpack64(head + 8);
+    }
+    else {
+      if (cdb_read(c,head,8,i << 3) == -1) return -1;
+      uint32_unpack(head,&u); hpos = u;
+      uint32_unpack(head + 4,&u); slots = u;
+    }
+    while (slots) {
+      n = sizeof buf / slotlen;
+      if (n > slots) n = slots;
+      x = cdb_get(c,buf,n * slotlen,hpos);
+      if (!x) return -1;
+      hpos += n * slotlen;
+      slots -= n;
+      for (j = 0;j < n;++j,x += slotlen) {
+        if (c->dir)
+          pos = unpack64(x + 8);
+        else {
+          uint32_unpack(x + 4,&u);
+          pos = u;
+        }
+        if (!pos || (pos >= eod)) continue;
+        if ((pos >= t[0]) && (pos < first[0])) first[0] = pos;
+        if ((pos >= t[1]) && (pos < first[1])) first[1] = pos;
+      }
+    }
+  }
+  return 0;
+}
+
+int cdb_scanshard(struct cdb_scan *s,struct cdb *c,unsigned int i,unsigned int n)
+{
+  uint64 eod;
+  uint64 len;
+  uint64 t[2];
+  uint64 first[2];
+
+  if (!n || (i >= n)) { errno = error_proto; return -1; }
+  if (cdb_eod(c,&eod) == -1) return -1;
+  if (eod < 2048) { errno = error_proto; return -1; }
+  len = eod - 2048;
+  t[0] = 2048 + (len / n) * i + ((len % n) * i) / n;
+  t[1] = 2048 + (len / n) * (i + 1) + ((len % n) * (i + 1)) / n;
+  if (n > 1)
+    if (cut(c,eod,t,first) == -1) return -1;
+  if (!i) first[0] = 2048;
+  if (i + 1 == n) first[1] = eod;
+  cdb_scanstart(s,c,first[0],first[1]);
+  return 0;
+}
+
+#ifdef MADV_WILLNEED
+static long page = 0;
+#endif
+
+/* len bytes from pos, which the caller knows to be before s->end */
+
+static const char *get(struct cdb_scan *s,uint64 pos,unsigned int len)
+{
+  struct cdb *c = s->c;
+  unsigned int n;
+
+  if (c->map) {
+    if ((pos > c->size) || (c->size - pos < len)) { errno = error_proto; return 0; }
+#ifdef MADV_WILLNEED
+    if ((s->ahead < s->end) && (pos + len + CDB_SCANAHEAD / 2 > s->ahead)) {
+      uint64 a;
+      uint64 b;
+      if (!page) page = sysconf(_SC_PAGESIZE);
+      a = s->ahead;
+      if (page > 0) a -= a % page; /* the map starts on a page */
+      b = pos + len + CDB_SCANAHEAD;
+      if (b > s->end) b = s->end;
+      if (b > a) madvise(c->map + a,b - a,MADV_WILLNEED);
+      s->ahead = b;
+    }
+#endif
+    return c->map + pos;
+  }
+
+  if ((pos >= s->bufpos) && (pos - s->bufpos <= s->buflen) && (s->bufpos + s->buflen - pos >= len))
+    return s->buf + (pos - s->bufpos);
+  n = CDB_SCANCHUNK;
+  if (n < len) n = len;
+  if (s->end - pos < n) n = s->end - pos;
+  if (n > s->bufsize) {
+    if (s->buf) alloc_free(s->buf);
+    s->buflen = s->bufsize = 0;
+    s->buf = alloc(n);
+    if (!s->buf) return 0;
+    s->bufsize = n;
+  }
+  s->buflen = 0;
+  if (cdb_read(c,s->buf,n,pos) == -1) return 0;
+  s->bufpos = pos;
+  s->buflen = n;
+  return s->buf;
+}
+
+int cdb_scannext(struct cdb_scan *s)
+{
+  const char *x;
+  uint32 klen;
+  uint32 dlen;
+
+  if (s->pos >= s->end) return 0;
+  if (s->end - s->pos < 8) { errno = error_proto; return -1; }
+  x = get(s,s->pos,8);
+  if (!x) return -1;
+  uint32_unpack(x,&klen);
+  uint32_unpack(x + 4,&dlen);
+  if (s->end - s->pos - 8 < (uint64) klen + dlen) { errno = error_proto; return -1; }
+  if ((uint64) klen + dlen > 0xffffffff - 8) { errno = error_proto; return -1; }
+  x = get(s,s->pos,8 + klen + dlen);
+  if (!x) return -1;
+  s->key = x + 8;
+  s->klen = klen;
+  s->data = x + 8 + klen;
+  s->dlen = dlen;
+  s->pos += 8 + (uint64) klen + dlen;
+  return 1;
+}
+
+void cdb_scanfree(struct cdb_scan *s)
+{
+  if (s->buf) alloc_free(s->buf);
+  s->buf = 0;
+  s->bufsize = s->buflen = 0;
+}
@@ -0,0 +1,226 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "open.h"
+#include "tai.h"
+#include "byte.h"
+#include "env.h"
+#include "cdb.h"
+#include "cdbmap.h"
+
+/* keeps one cdb open between queries; looks for a new one once a second */
+/* returns 2 if it had to open fn, 1 if it kept the old one */
+/* each struct cdb passed in, up to CDBMAPS of them, has its own file */
+/* fn is kept for cdbmap_quiescent(), and must stay where it is */
+
+/*
+A new file replacing an open one is not used at once. It is mapped
+as next, the kernel is asked to read all of it in, and queries keep
+going to the old file until mincore() says every page of the new one
+is in memory, or WARMMAX seconds have gone by; then it takes over.
+So the first queries after a reload do not wait for the disk. A
+freshly written file is usually in memory already and takes over on
+the spot. The first file, with nothing to fall back on, is used at
+once.
+
+With $CDBLOCK set, the hash tables of the file in use, everything
+after the records, stay locked in memory, as far as RLIMIT_MEMLOCK
+allows.
+
+A program with an event loop calls cdbmap_quiescent() where it is in
+the middle of no lookup, typically just after waking up. From then
+on the looking, warming and taking over happen only there, once a
+second, and cdbmap() itself just hands out the file in use, returning
+2 the first time after a new one took over; so a query never pays for
+a stat(), an open() or mincore(), and memory from the old file is
+unmapped only where nothing can still be reading it.
+*/
+
+#define CDBMAPS 64
+#define WARMMAX 30
+#define WARMCHUNK 4096 /* pages per mincore() */
+#define WARMSCAN 64 /* chunks per check */
+
+static struct map {
+  struct cdb *c;
+  int fd;
+  struct stat st;
+  struct tai checked;
+  struct cdb next; /* being warmed, if nextfd != -1 */
+  int nextfd;
+  struct stat nextst;
+  uint64 warmed; /* next is in memory below this */
+  struct tai warmstart;
+  const char *fn;
+  int fresh; /* 1 if cdbmap() has not yet said that next took over */
+} map[CDBMAPS];
+
+static int flaglock = -1; /* -1 until cdbmap() looks */
+static int flagquiescent = 0;
+static unsigned char vec[WARMCHUNK];
+
+static int same(const struct stat *a,const struct stat *b)
+{
+  return (a->st_ino == b->st_ino) && (a->st_dev == b->st_dev)
+    && (a->st_mtime == b->st_mtime) && (a->st_size == b->st_size);
+}
+
+static void dropnext(struct map *m)
+{
+  if (m->nextfd == -1) return;
+  cdb_free(&m->next);
+  close(m->nextfd);
+  m->nextfd = -1;
+}
+
+static void drop(struct map *m)
+{
+  dropnext(m);
+  if (m->fd == -1) return;
+  cdb_free(m->c);
+  close(m->fd);
+  m->fd = -1;
+}
+
+/* 1 if all of next is in memory; otherwise asks for the rest again */
+static int warm(struct map *m)
+{
+  long page;
+  uint64 len;
+  unsigned int n;
+  unsigned int i;
+  unsigned int chunk;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0) return 1;
+  for (chunk = 0;chunk < WARMSCAN;++chunk) {
+    if (m->warmed >= m->next.size) return 1;
+    len = m->next.size - m->warmed;
+    if (len > (uint64) WARMCHUNK * page) len = (uint64) WARMCHUNK * page;
+    if (mincore(m->next.map + m->warmed,len,(void *) vec) == -1) return 1;
+    n = (len + page - 1) / page;
+    for (i = 0;i < n;++i)
+      if (!(vec[i] & 1)) {
+        m->warmed += (uint64) i * page;
+        madvise(m->next.map + m->warmed,m->next.size - m->warmed,MADV_WILLNEED);
+        return 0;
+      }
+    m->warmed += len;
+  }
+  return m->warmed >= m->next.size;
+}
+
+static void lock(struct cdb *c)
+{
+  uint64 eod;
+  long page;
+
+  if (!c->map) return;
+  if (cdb_eod(c,&eod) == -1) return;
+  if (eod > c->size) return;
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0) return;
+  eod -= eod % page;
+  mlock(c->map + eod,c->size - eod);
+}
+
+static int refresh(struct map *m)
+{
+  struct cdb *c = m->c;
+  const char *fn = m->fn;
+  struct tai now;
+  struct tai t;
+  struct stat st2;
+  int newfd;
+
+  tai_now(&now);
+  if (!tai_less(&m->checked,&now)) {
+    if (m->fd == -1) return 0;
+    cdb_findstart(c);
+    return 1;
+  }
+  m->checked = now;
+
+  if (stat(fn,&st2) == -1) { drop(m); return 0; }
+  if (m->fd != -1)
+    if (same(&st2,&m->st)) {
+      dropnext(m);
+      cdb_findstart(c);
+      return 1;
+    }
+
+  if ((m->nextfd == -1) || !same(&st2,&m->nextst)) {
+    dropnext(m);
+    newfd = open_read(fn);
+    if (newfd == -1) { drop(m); return 0; }
+    if (fstat(newfd,&st2) == -1) { close(newfd); drop(m); return 0; }
+    byte_zero((char *) &m->next,sizeof m->next);
+    cdb_init(&m->next,newfd);
+    m->nextfd = newfd;
+    m->nextst = st2;
+    m->warmed = 0;
+    m->warmstart = now;
+    if (m->next.map)
+      madvise(m->next.map,m->next.size,MADV_WILLNEED);
+  }
+
+  if (m->fd != -1)
+    if (m->next.map && !warm(m)) {
+      tai_uint(&t,WARMMAX);
+      tai_add(&t,&m->warmstart,&t);
+      if (tai_less(&now,&t)) {
+        cdb_findstart(c);
+        return 1;
+      }
+    }
+
+  newfd = m->nextfd;
+  m->nextfd = -1;
+  drop(m);
+  *c = m->next;
+  cdb_findstart(c);
+  m->fd = newfd;
+  m->st = m->nextst;
+  if (flaglock) lock(c);
+  return 2;
+}
+
+int cdbmap(struct cdb *c,const char *fn)
+{
+  struct map *m;
+  int i;
+
+  if (flaglock == -1) flaglock = !!env_get("CDBLOCK");
+
+  for (i = 0;i < CDBMAPS;++i) {
+    m = map + i;
+    if (m->c == c) break;
+    if (!m->c) { m->c = c; m->fd = -1; m->nextfd = -1; break; }
+  }
+  if (i == CDBMAPS) return 0;
+  m->fn = fn;
+
+  if (flagquiescent && (m->fd != -1)) {
+    cdb_findstart(c);
+    if (!m->fresh) return 1;
+    m->fresh = 0;
+    return 2;
+  }
+  m->fresh = 0;
+  return refresh(m);
+}
+
+void cdbmap_quiescent(void)
+{
+  struct map *m;
+  int i;
+
+  flagquiescent = 1;
+  for (i = 0;i < CDBMAPS;++i) {
+    m = map + i;
+    if (!m->c) break;
+    if (m->fd == -1) continue; /* cdbmap() keeps looking itself */
+    if (refresh(m) == 2) m->fresh = 1;
+  }
+}
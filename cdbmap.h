@@ -0,0 +1,9 @@
+#ifndef CDBMAP_H
+#define CDBMAP_H
+
+#include "cdb.h"
+
+extern int cdbmap(struct cdb *,const char *);
+extern void cdbmap_quiescent(void);
+
+#endif
@@ -0,0 +1,136 @@
+#include "alloc.h"
+#include "byte.h"
+#include "uint32.h"
+#include "cdb.h"
+#include "clientloc.h"
+
+/*
+tinydns-data also lists every % line under "\0l": a length byte, that
+many bytes of IP prefix, and the location. clientloc_init() compiles
+the list into a trie of 256-slot nodes, one slot for each next byte
+of the address. A lookup is
+then at most four memory steps, and none at all if there are no %
+lines. Without "\0l" (an older data.cdb) we probe the cdb as before.
+*/
+
+struct slot {
+  uint32 next; /* node index, or 0 */
+  char loc[2];
+  char flagloc;
+} ;
+
+static struct slot *node; /* node 0 is the root */
+static unsigned int nodes;
+static unsigned int nodesalloc;
+static char rootloc[2];
+static int flagrootloc;
+static int flagtable;
+static unsigned int num;
+
+static int newnode(void)
+{
+  unsigned int n;
+
+  if (nodes == nodesalloc) {
+    n = nodesalloc + (nodesalloc >> 1) + 16;
+    if (!alloc_re((char **) &node,nodesalloc * 256 * sizeof(struct slot),n * 256 * sizeof(struct slot)))
+      return -1;
+    nodesalloc = n;
+  }
+  byte_zero(node + nodes * 256,256 * sizeof(struct slot));
+  return nodes++;
+}
+
+/* first one listed wins, as with cdb_find() */
+static int add(const char *prefix,unsigned int len,const char loc[2])
+{
+  struct slot *s;
+  unsigned int n;
+  unsigned int i;
+  int r;
+
+  if (!len) {
+    if (!flagrootloc) { byte_copy(rootloc,2,loc); flagrootloc = 1; }
+    return 0;
+  }
+  n = 0;
+  for (i = 0;i + 1 < len;++i) {
+    s = node + n * 256 + (unsigned char) prefix[i];
+    if (!s->next) {
+      r = newnode(); if (r == -1) return -1;
+      s = node + n * 256 + (unsigned char) prefix[i];
+      s->next = r;
+    }
+    n = s->next;
+  }
+  s = node + n * 256 + (unsigned char) prefix[i];
+  if (!s->flagloc) { byte_copy(s->loc,2,loc); s->flagloc = 1; }
+  return 0;
+}
+
+void clientloc_init(struct cdb *c)
+{
+  char *buf;
+  uint32 dlen;
+  uint32 pos;
+  unsigned int len;
+
+  flagtable = 0;
+  nodes = 0;
+  flagrootloc = 0;
+  num = 0;
+
+  if (cdb_find(c,"\0l",2) != 1) return;
+  dlen = cdb_datalen(c);
+  buf = alloc(dlen + 1);
+  if (!buf) return;
+  if (cdb_read(c,buf,dlen,cdb_datapos(c)) == -1) { alloc_free(buf); return; }
+
+  if (newnode() == -1) { alloc_free(buf); return; }
+  for (pos = 0;pos < dlen;pos += len + 3) {
+    len = (unsigned char) buf[pos];
+    if ((len > 4) || (dlen - pos < len + 3)) { alloc_free(buf); return; }
+    if (add(buf + pos + 1,len,buf + pos + 1 + len) == -1) { alloc_free(buf); return; }
+    ++num;
+  }
+
+  alloc_free(buf);
+  flagtable = 1;
+}
+
+int clientloc_find(struct cdb *c,const char ip[4],char loc[2])
+{
+  struct slot *s;
+  unsigned int n;
+  unsigned int i;
+  char key[6];
+  int r;
+
+  byte_zero(loc,2);
+
+  if (flagtable) {
+    if (!num) return 0;
+    if (flagrootloc) byte_copy(loc,2,rootloc);
+    n = 0;
+    for (i = 0;i < 4;++i) {
+      s = node + n * 256 + (unsigned char) ip[i];
+      if (s->flagloc) byte_copy(loc,2,s->loc);
+      n = s->next;
+      if (!n) break;
+    }
+    return 0;
+  }
+
+  key[0] = 0;
+  key[1] = '%';
+  byte_copy(key + 2,4,ip);
+  r = cdb_find(c,key,6);
+  if (!r) r = cdb_find(c,key,5);
+  if (!r) r = cdb_find(c,key,4);
+  if (!r) r = cdb_find(c,key,3);
+  if (!r) r = cdb_find(c,key,2);
+  if (r == -1) return -1;
+  if (r && (cdb_datalen(c) == 2))
+    if (cdb_read(c,loc,2,cdb_datapos(c)) == -1) return -1;
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef CLIENTLOC_H
+#define CLIENTLOC_H
+
+#include "cdb.h"
+
+extern void clientloc_init(struct cdb *);
+extern int clientloc_find(struct cdb *,const char *,char *);
+
+#endif
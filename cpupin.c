@@ -0,0 +1,27 @@
+#define _GNU_SOURCE
+#include "hasaffinity.h"
+#ifdef HASAFFINITY
+#include <sched.h>
+#include <unistd.h>
+#endif
+#include "cpupin.h"
+
+/* binds this process to one CPU, counting modulo the CPUs online */
+/* a no-op where that is not supported */
+
+int cpupin(unsigned long cpu)
+{
+#ifdef HASAFFINITY
+  cpu_set_t set;
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((n < 1) || (n > CPU_SETSIZE)) n = CPU_SETSIZE;
+  cpu %= n;
+  CPU_ZERO(&set);
+  CPU_SET(cpu,&set);
+  return sched_setaffinity(0,sizeof set,&set);
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,6 @@
+#ifndef CPUPIN_H
+#define CPUPIN_H
+
+extern int cpupin(unsigned long);
+
+#endif
@@ -4,8 +4,10 @@
 #include "stralloc.h"
 #include "iopause.h"
 #include "taia.h"
+#include "uint32.h"
 
 #define DNS_C_IN "\0\1"
+#define DNS_C_CH "\0\3"
 #define DNS_C_ANY "\0\377"
 
 #define DNS_T_A "\0\1"
@@ -20,9 +22,13 @@
 #define DNS_T_SIG "\0\30"
 #define DNS_T_KEY "\0\31"
 #define DNS_T_AAAA "\0\34"
+#define DNS_T_OPT "\0\51"
+#define DNS_T_IXFR "\0\373"
 #define DNS_T_AXFR "\0\374"
 #define DNS_T_ANY "\0\377"
 
+#define DNS_OPT_KEEPALIVE "\0\13" /* edns-tcp-keepalive, RFC 7828 */
+
 struct dns_transmit {
   char *query; /* 0, or dynamically allocated */
   unsigned int querylen;
@@ -33,6 +39,15 @@ struct dns_transmit {
   unsigned int udploop;
   unsigned int curserver;
   struct taia deadline;
+  struct taia sent; /* when the current UDP query went out */
+  int flagedns; /* query carries an OPT record */
+  int hedgestate;
+  unsigned int hedgeserver;
+  struct taia hedgetime; /* when to send, or when sent, to hedgeserver */
+  char outstanding[8]; /* servers with a UDP query out on s1 */
+  unsigned int numoutstanding;
+  unsigned int waits; /* for servers that were full */
+  unsigned int failed; /* bit j: server j answered with a failure */
   unsigned int pos;
   const char *servers;
   char localip[4];
@@ -44,30 +59,90 @@ extern unsigned int dns_random(unsigned int);
 
 extern void dns_sortip(char *,unsigned int);
 
+extern int dns_ip6_local(const char *);
+extern int dns_ip6_on(char *);
+extern int dns_ip6_handle(char *,const char *);
+extern int dns_ip6_addr(char *,const char *);
+
+extern void dns_rtt_answer(const char *,unsigned long);
+extern void dns_rtt_timeout(const char *,unsigned long);
+extern unsigned long dns_rtt_rto(const char *);
+extern void dns_rtt_sort(char *,unsigned int);
+extern void dns_rtt_sent(const char *);
+extern int dns_rtt_down(const char *);
+extern void dns_rtt_balance(void);
+extern void dns_rtt_done(const char *);
+extern void dns_rtt_limit(unsigned long,unsigned long);
+extern int dns_rtt_full(const char *);
+#define DNS_RTT_SIZE 1024
+extern int dns_rtt_entry(unsigned int,char *,unsigned long *);
+
+#define DNS_NAME 255 /* longest encoded name, for dns_packet_getnamebuf() */
+
+struct dns_domain {
+  const char *dn;
+  unsigned int len; /* dns_domain_length(dn) */
+} ;
+
 extern void dns_domain_free(char **);
 extern int dns_domain_copy(char **,const char *);
 extern unsigned int dns_domain_length(const char *);
 extern int dns_domain_equal(const char *,const char *);
 extern int dns_domain_suffix(const char *,const char *);
 extern unsigned int dns_domain_suffixpos(const char *,const char *);
+extern void dns_domain_handle(struct dns_domain *,const char *);
+extern int dns_domain_same(const struct dns_domain *,const struct dns_domain *);
+extern int dns_domain_under(const struct dns_domain *,const struct dns_domain *);
 extern int dns_domain_fromdot(char **,const char *,unsigned int);
 extern int dns_domain_todot_cat(stralloc *,const char *);
 
 extern unsigned int dns_packet_copy(const char *,unsigned int,unsigned int,char *,unsigned int);
 extern unsigned int dns_packet_getname(const char *,unsigned int,unsigned int,char **);
+extern unsigned int dns_packet_getnamebuf(const char *,unsigned int,unsigned int,char *);
+extern unsigned int dns_packet_getquestion(const char *,unsigned int,unsigned int,char *,char *,uint32 *);
 extern unsigned int dns_packet_skipname(const char *,unsigned int,unsigned int);
+extern unsigned int dns_packet_rrheader(const char *,unsigned int,unsigned int,char *,unsigned int *);
+extern int dns_packet_edns(const char *,unsigned int,unsigned int,unsigned int *);
+extern int dns_packet_ednsoption(const char *,unsigned int,unsigned int,const char *);
 
 extern int dns_transmit_start(struct dns_transmit *,const char *,int,const char *,const char *,const char *);
 extern void dns_transmit_free(struct dns_transmit *);
+extern int dns_transmit_packet(struct dns_transmit *,const char *,const char *,unsigned int);
 extern void dns_transmit_io(struct dns_transmit *,iopause_fd *,struct taia *);
+extern void dns_transmit_deadline(const struct dns_transmit *,struct taia *);
 extern int dns_transmit_get(struct dns_transmit *,const iopause_fd *,const struct taia *);
+extern void dns_transmit_hedge(unsigned int);
+extern void dns_transmit_edns(unsigned int);
 
 extern int dns_resolvconfip(char *);
 extern int dns_resolve(const char *,const char *);
 extern struct dns_transmit dns_resolve_tx;
 
+extern int dns_cache_init(unsigned int);
+extern int dns_cache_get(const char *,const char *,char **,unsigned int *);
+extern void dns_cache_set(const char *,const char *,const char *,unsigned int);
+
+struct dns_async {
+  struct dns_async_query *q;
+  unsigned int max;
+  unsigned int *active; /* in flight */
+  unsigned int numactive;
+  unsigned int *ready; /* finished, in a ring */
+  unsigned int readyhead;
+  unsigned int numready;
+  unsigned int *free;
+  unsigned int numfree;
+} ;
+
+extern int dns_async_init(struct dns_async *,unsigned int);
+extern int dns_async_start(struct dns_async *,const char *,const char *,void *);
+extern unsigned int dns_async_io(struct dns_async *,iopause_fd *,struct taia *);
+extern void dns_async_get(struct dns_async *,const struct taia *);
+extern int dns_async_reap(struct dns_async *,void **,char **,unsigned int *);
+
 extern int dns_ip4_packet(stralloc *,const char *,unsigned int);
 extern int dns_ip4(stralloc *,const stralloc *);
+extern int dns_ip4_literal(stralloc *,const stralloc *);
 extern int dns_name_packet(stralloc *,const char *,unsigned int);
 extern void dns_name4_domain(char *,const char *);
 #define DNS_NAME4_DOMAIN 31
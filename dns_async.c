@@ -0,0 +1,158 @@
+#include "alloc.h"
+#include "byte.h"
+#include "error.h"
+#include "dns.h"
+
+/*
+Many lookups at once, without blocking, for a program with its own
+iopause loop. dns_async_start() begins a lookup and tags it with a
+pointer; dns_async_io() adds the descriptors of the lookups in flight
+to the caller's iopause array; after iopause, dns_async_get() moves
+them along, and dns_async_reap() hands back each finished one. Each
+lookup is a dns_transmit to the servers in resolv.conf, and answers
+go through the dns_cache_get() cache like those of dns_resolve().
+*/
+
+struct dns_async_query {
+  struct dns_transmit dt;
+  char servers[64];
+  char *q;
+  char qtype[2];
+  void *data;
+  int result; /* 1: answered; -1: failed, with error */
+  int error;
+  char *packet;
+  unsigned int packetlen;
+  iopause_fd *io;
+} ;
+
+int dns_async_init(struct dns_async *a,unsigned int max)
+{
+  unsigned int i;
+
+  if (!max) max = 1;
+  a->q = (struct dns_async_query *) alloc(max * sizeof(struct dns_async_query));
+  if (!a->q) return -1;
+  a->active = (unsigned int *) alloc(3 * max * sizeof(unsigned int));
+  if (!a->active) { alloc_free((char *) a->q); return -1; }
+  byte_zero(a->q,max * sizeof(struct dns_async_query));
+  a->ready = a->active + max;
+  a->free = a->ready + max;
+  a->max = max;
+  a->numactive = 0;
+  a->readyhead = 0;
+  a->numready = 0;
+  for (i = 0;i < max;++i) a->free[i] = max - 1 - i;
+  a->numfree = max;
+  return 0;
+}
+
+static void finish(struct dns_async *a,unsigned int i,int r)
+{
+  struct dns_async_query *x = a->q + i;
+  unsigned int j;
+
+  x->result = r;
+  x->error = errno;
+  j = a->readyhead + a->numready++;
+  if (j >= a->max) j -= a->max;
+  a->ready[j] = i;
+}
+
+int dns_async_start(struct dns_async *a,const char *q,const char qtype[2],void *data)
+{
+  struct dns_async_query *x;
+  unsigned int i;
+  int r;
+
+  if (!a->numfree) { errno = error_again; return -1; }
+  i = a->free[a->numfree - 1];
+  x = a->q + i;
+
+  x->data = data;
+  byte_copy(x->qtype,2,qtype);
+  x->packet = 0;
+  if (!dns_domain_copy(&x->q,q)) return -1;
+
+  r = dns_cache_get(q,qtype,&x->packet,&x->packetlen);
+  if (r == -1) return -1;
+  --a->numfree;
+  if (r == 1) {
+    finish(a,i,1);
+    return 0;
+  }
+
+  if (dns_resolvconfip(x->servers) == -1) { ++a->numfree; return -1; }
+  if (dns_transmit_start(&x->dt,x->servers,1,q,qtype,"\0\0\0\0") == -1) {
+    ++a->numfree;
+    return -1;
+  }
+  a->active[a->numactive++] = i;
+  return 0;
+}
+
+/* x must have room for as many lookups as dns_async_init() allowed */
+unsigned int dns_async_io(struct dns_async *a,iopause_fd *x,struct taia *deadline)
+{
+  struct dns_async_query *y;
+  unsigned int n;
+
+  for (n = 0;n < a->numactive;++n) {
+    y = a->q + a->active[n];
+    y->io = x + n;
+    dns_transmit_io(&y->dt,y->io,deadline);
+  }
+  if (a->numready) byte_zero(deadline,sizeof(struct taia)); /* no waiting */
+  return n;
+}
+
+void dns_async_get(struct dns_async *a,const struct taia *stamp)
+{
+  struct dns_async_query *y;
+  unsigned int n;
+  int r;
+
+  n = 0;
+  while (n < a->numactive) {
+    y = a->q + a->active[n];
+    r = dns_transmit_get(&y->dt,y->io,stamp);
+    if (r == 0) { ++n; continue; }
+    if (r == 1) {
+      dns_cache_set(y->q,y->qtype,y->dt.packet,y->dt.packetlen);
+      y->packet = y->dt.packet;
+      y->packetlen = y->dt.packetlen;
+      y->dt.packet = 0;
+    }
+    finish(a,a->active[n],r);
+    dns_transmit_free(&y->dt);
+    a->active[n] = a->active[--a->numactive];
+  }
+}
+
+/*
+1: data is the tag of an answered lookup, and packet the answer, for
+the caller to alloc_free(). -1: the lookup tagged data failed, and
+errno says why. 0: no lookup has finished.
+*/
+int dns_async_reap(struct dns_async *a,void **data,char **packet,unsigned int *packetlen)
+{
+  struct dns_async_query *y;
+  unsigned int i;
+
+  if (!a->numready) return 0;
+  i = a->ready[a->readyhead];
+  if (++a->readyhead == a->max) a->readyhead = 0;
+  --a->numready;
+  a->free[a->numfree++] = i;
+
+  y = a->q + i;
+  *data = y->data;
+  if (y->result == -1) {
+    errno = y->error;
+    return -1;
+  }
+  *packet = y->packet;
+  *packetlen = y->packetlen;
+  y->packet = 0;
+  return 1;
+}
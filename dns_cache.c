@@ -0,0 +1,246 @@
+#include "alloc.h"
+#include "byte.h"
+#include "case.h"
+#include "uint16.h"
+#include "uint32.h"
+#include "taia.h"
+#include "dns.h"
+
+/*
+Answers kept in this process after dns_cache_init(n): at most n of
+them, each until the TTL in it runs out, the least recently used
+going first when there is no room. Only answers with rcode 0 or
+NXDOMAIN are kept; an answer with no records lasts as long as the
+SOA record in it says.
+*/
+
+#define NONE ((unsigned int) -1)
+#define MAXTTL 604800
+
+struct entry {
+  char *key; /* the name in lowercase, then the type */
+  unsigned int keylen;
+  char *packet;
+  unsigned int packetlen;
+  uint32 expire;
+  unsigned int hnext;
+  unsigned int prev; /* toward the most recently used */
+  unsigned int next;
+} ;
+
+static struct entry *e = 0;
+static unsigned int size = 0;
+static unsigned int used = 0;
+static unsigned int *head; /* hash chains */
+static unsigned int hashmask;
+static unsigned int newest = NONE;
+static unsigned int oldest = NONE;
+static unsigned int freelist = NONE; /* through hnext */
+
+static char key[257];
+static unsigned int keylen;
+
+static void makekey(const char *q,const char qtype[2])
+{
+  keylen = dns_domain_length(q);
+  if (keylen > 255) keylen = 255;
+  byte_copy(key,keylen,q);
+  case_lowerb(key,keylen);
+  byte_copy(key + keylen,2,qtype);
+  keylen += 2;
+}
+
+static unsigned int hash(void)
+{
+  unsigned int h = 5381;
+  unsigned int i;
+
+  for (i = 0;i < keylen;++i)
+    h = (h + (h << 5)) ^ (unsigned char) key[i];
+  return h & hashmask;
+}
+
+static uint32 now(void)
+{
+  struct taia t;
+
+  taia_now(&t);
+  return t.sec.x;
+}
+
+static void detach(unsigned int i)
+{
+  if (e[i].prev == NONE) newest = e[i].next;
+  else e[e[i].prev].next = e[i].next;
+  if (e[i].next == NONE) oldest = e[i].prev;
+  else e[e[i].next].prev = e[i].prev;
+}
+
+static void pushfront(unsigned int i)
+{
+  e[i].prev = NONE;
+  e[i].next = newest;
+  if (newest != NONE) e[newest].prev = i;
+  newest = i;
+  if (oldest == NONE) oldest = i;
+}
+
+static void drop(unsigned int i)
+{
+  unsigned int *p;
+
+  makekey(e[i].key,e[i].key + e[i].keylen - 2);
+  for (p = head + hash();*p != i;p = &e[*p].hnext) ;
+  *p = e[i].hnext;
+  detach(i);
+  alloc_free(e[i].key);
+  alloc_free(e[i].packet);
+  e[i].key = 0;
+}
+
+/* returns 0 if there was not enough memory; then there is no cache */
+int dns_cache_init(unsigned int n)
+{
+  unsigned int i;
+
+  if (!n) return 1;
+  for (i = 64;i < 2 * n;i <<= 1) ;
+  head = (unsigned int *) alloc(i * sizeof(unsigned int));
+  if (!head) return 0;
+  e = (struct entry *) alloc(n * sizeof(struct entry));
+  if (!e) { alloc_free((char *) head); return 0; }
+  hashmask = i - 1;
+  while (i) head[--i] = NONE;
+  size = n;
+  return 1;
+}
+
+static unsigned int find(void)
+{
+  unsigned int i;
+
+  for (i = head[hash()];i != NONE;i = e[i].hnext)
+    if ((e[i].keylen == keylen) && byte_equal(e[i].key,keylen,key))
+      return i;
+  return NONE;
+}
+
+/* 1 and a new copy of the answer, 0 if there is none, -1 for no memory */
+int dns_cache_get(const char *q,const char qtype[2],char **packet,unsigned int *packetlen)
+{
+  unsigned int i;
+
+  if (!size) return 0;
+  makekey(q,qtype);
+  i = find();
+  if (i == NONE) return 0;
+  if (now() >= e[i].expire) {
+    drop(i);
+    e[i].hnext = freelist;
+    freelist = i;
+    return 0;
+  }
+  detach(i);
+  pushfront(i);
+
+  *packet = alloc(e[i].packetlen);
+  if (!*packet) return -1;
+  byte_copy(*packet,e[i].packetlen,e[i].packet);
+  *packetlen = e[i].packetlen;
+  return 1;
+}
+
+/* the time to keep buf; 0 if it should not be kept */
+static uint32 ttl(const char *buf,unsigned int len)
+{
+  char header[12];
+  char misc[10];
+  uint16 numanswers;
+  uint16 numauthority;
+  uint16 datalen;
+  uint32 t;
+  uint32 u;
+  unsigned int pos;
+  int flagsoa = 0;
+
+  pos = dns_packet_copy(buf,len,0,header,12); if (!pos) return 0;
+  if ((header[3] & 15) && ((header[3] & 15) != 3)) return 0;
+  if (header[2] & 2) return 0; /* truncated */
+  uint16_unpack_big(header + 6,&numanswers);
+  uint16_unpack_big(header + 8,&numauthority);
+  pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+  pos += 4;
+
+  t = MAXTTL;
+  if (numanswers) {
+    while (numanswers--) {
+      pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+      pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return 0;
+      uint32_unpack_big(misc + 4,&u);
+      if (u < t) t = u;
+      uint16_unpack_big(misc + 8,&datalen);
+      pos += datalen;
+    }
+    return t;
+  }
+
+  while (numauthority--) {
+    pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return 0;
+    uint16_unpack_big(misc + 8,&datalen);
+    if (byte_equal(misc,2,DNS_T_SOA) && (datalen >= 20) && (pos + datalen <= len)) {
+      uint32_unpack_big(misc + 4,&u);
+      if (u < t) t = u;
+      uint32_unpack_big(buf + pos + datalen - 4,&u);
+      if (u < t) t = u;
+      flagsoa = 1;
+    }
+    pos += datalen;
+  }
+  return flagsoa ? t : 0;
+}
+
+void dns_cache_set(const char *q,const char qtype[2],const char *packet,unsigned int packetlen)
+{
+  unsigned int i;
+  uint32 t;
+  char *k;
+  char *p;
+
+  if (!size) return;
+  t = ttl(packet,packetlen);
+  if (!t) return;
+  if (t > MAXTTL) t = MAXTTL;
+
+  makekey(q,qtype);
+  k = alloc(keylen);
+  if (!k) return;
+  p = alloc(packetlen);
+  if (!p) { alloc_free(k); return; }
+  byte_copy(k,keylen,key);
+  byte_copy(p,packetlen,packet);
+
+  i = find();
+  if (i != NONE)
+    drop(i);
+  else if (freelist != NONE) {
+    i = freelist;
+    freelist = e[i].hnext;
+  }
+  else if (used < size)
+    i = used++;
+  else {
+    i = oldest;
+    drop(i);
+  }
+  makekey(q,qtype);
+
+  e[i].key = k;
+  e[i].keylen = keylen;
+  e[i].packet = p;
+  e[i].packetlen = packetlen;
+  e[i].expire = now() + t;
+  e[i].hnext = head[hash()];
+  head[hash()] = i;
+  pushfront(i);
+}
@@ -37,38 +37,76 @@ int dns_domain_copy(char **out,const char *in)
   return 1;
 }
 
-int dns_domain_equal(const char *dn1,const char *dn2)
+/*
+A struct dns_domain carries a name and its length, so that equality
+and suffix checks against it skip the label walk. A suffix is tested
+from the right: the last little->len bytes of big are compared first,
+and only then is the split point checked to be a label boundary.
+Length bytes are under 64, so case_diffb() leaves them alone.
+*/
+
+void dns_domain_handle(struct dns_domain *x,const char *dn)
 {
-  unsigned int len;
+  x->dn = dn;
+  x->len = dns_domain_length(dn);
+}
+
+int dns_domain_same(const struct dns_domain *x,const struct dns_domain *y)
+{
+  if (x->len != y->len) return 0;
+  return !case_diffb(x->dn,x->len,y->dn);
+}
 
-  len = dns_domain_length(dn1);
-  if (len != dns_domain_length(dn2)) return 0;
+static int boundary(const char *dn,unsigned int off)
+{
+  unsigned int pos = 0;
 
-  if (case_diffb(dn1,len,dn2)) return 0; /* safe since 63 < 'A' */
-  return 1;
+  while (pos < off)
+    pos += 1 + (unsigned int) (unsigned char) dn[pos];
+  return pos == off;
 }
 
-int dns_domain_suffix(const char *big,const char *little)
+int dns_domain_under(const struct dns_domain *big,const struct dns_domain *little)
+{
+  unsigned int off;
+
+  if (little->len > big->len) return 0;
+  off = big->len - little->len;
+  if (case_diffb(big->dn + off,little->len,little->dn)) return 0;
+  return boundary(big->dn,off);
+}
+
+int dns_domain_equal(const char *dn1,const char *dn2)
 {
   unsigned char c;
 
   for (;;) {
-    if (dns_domain_equal(big,little)) return 1;
-    c = *big++;
-    if (!c) return 0;
-    big += c;
+    c = *dn1;
+    if (c != (unsigned char) *dn2) return 0;
+    if (!c) return 1;
+    if (case_diffb(dn1 + 1,c,dn2 + 1)) return 0;
+    dn1 += c + 1;
+    dn2 += c + 1;
   }
 }
 
+int dns_domain_suffix(const char *big,const char *little)
+{
+  struct dns_domain b;
+  struct dns_domain l;
+
+  dns_domain_handle(&b,big);
+  dns_domain_handle(&l,little);
+  return dns_domain_under(&b,&l);
+}
+
 unsigned int dns_domain_suffixpos(const char *big,const char *little)
 {
-  const char *orig = big;
-  unsigned char c;
+  struct dns_domain b;
+  struct dns_domain l;
 
-  for (;;) {
-    if (dns_domain_equal(big,little)) return big - orig;
-    c = *big++;
-    if (!c) return 0;
-    big += c;
-  }
+  dns_domain_handle(&b,big);
+  dns_domain_handle(&l,little);
+  if (!dns_domain_under(&b,&l)) return 0;
+  return b.len - l.len;
 }
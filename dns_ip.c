@@ -36,7 +36,8 @@ int dns_ip4_packet(stralloc *out,const char *buf,unsigned int len)
 
 static char *q = 0;
 
-int dns_ip4(stralloc *out,const stralloc *fqdn)
+/* 1: fqdn is an address such as 1.2.3.4 or [1.2.3.4], now in out */
+int dns_ip4_literal(stralloc *out,const stralloc *fqdn)
 {
   unsigned int i;
   char code;
@@ -61,15 +62,24 @@ int dns_ip4(stralloc *out,const stralloc *fqdn)
       code += ch - '0';
       continue;
     }
-
-    if (!dns_domain_fromdot(&q,fqdn->s,fqdn->len)) return -1;
-    if (dns_resolve(q,DNS_T_A) == -1) return -1;
-    if (dns_ip4_packet(out,dns_resolve_tx.packet,dns_resolve_tx.packetlen) == -1) return -1;
-    dns_transmit_free(&dns_resolve_tx);
-    dns_domain_free(&q);
     return 0;
   }
 
   out->len &= ~3;
+  return 1;
+}
+
+int dns_ip4(stralloc *out,const stralloc *fqdn)
+{
+  int r;
+
+  r = dns_ip4_literal(out,fqdn);
+  if (r) return r == 1 ? 0 : -1;
+
+  if (!dns_domain_fromdot(&q,fqdn->s,fqdn->len)) return -1;
+  if (dns_resolve(q,DNS_T_A) == -1) return -1;
+  if (dns_ip4_packet(out,dns_resolve_tx.packet,dns_resolve_tx.packetlen) == -1) return -1;
+  dns_transmit_free(&dns_resolve_tx);
+  dns_domain_free(&q);
   return 0;
 }
@@ -0,0 +1,86 @@
+#include "alloc.h"
+#include "byte.h"
+#include "uint32.h"
+#include "dns.h"
+
+/*
+IPv6 servers ride in the 4-byte server slots as handles in 240/4,
+which is reserved and never a real server. dns_ip6_handle() gives the
+handle of an address, the same one every time; dns_ip6_addr() gives
+the address of a handle. dns_transmit sends to a handle over IPv6,
+from the address given to dns_ip6_local(); until that is called there
+are no handles. A handle means something only in the process that
+made it; one loaded from an old cache dump stands for nothing, and
+dns_transmit skips it.
+
+Handles are not reused. Once IP6MAX addresses have handles, further
+addresses get none, and their servers are reached over IPv4 or not at
+all.
+*/
+
+#define IP6MAX 65536
+#define IP6HASH (2 * IP6MAX)
+
+static char (*addr)[16]; /* by handle */
+static uint32 *slot; /* 1 + handle, by hash of address; 0 if empty */
+static uint32 num = 0;
+static char local[16];
+static int flagon = 0;
+
+int dns_ip6_local(const char ip[16])
+{
+  if (!addr) {
+    addr = (char (*)[16]) alloc(IP6MAX * 16);
+    if (!addr) return -1;
+    slot = (uint32 *) alloc(IP6HASH * sizeof(uint32));
+    if (!slot) { alloc_free((char *) addr); addr = 0; return -1; }
+    byte_zero((char *) slot,IP6HASH * sizeof(uint32));
+  }
+  byte_copy(local,16,ip);
+  flagon = 1;
+  return 0;
+}
+
+int dns_ip6_on(char ip[16])
+{
+  if (flagon && ip) byte_copy(ip,16,local);
+  return flagon;
+}
+
+static uint32 hash(const char ip[16])
+{
+  uint32 h = 5381;
+  int i;
+
+  for (i = 0;i < 16;++i) h = ((h << 5) + h) ^ (unsigned char) ip[i];
+  return h;
+}
+
+int dns_ip6_handle(char handle[4],const char ip[16])
+{
+  uint32 i;
+
+  if (!flagon) return 0;
+  for (i = hash(ip) % IP6HASH;slot[i];i = (i + 1) % IP6HASH)
+    if (byte_equal(addr[slot[i] - 1],16,ip)) break;
+  if (!slot[i]) {
+    if (num == IP6MAX) return 0;
+    byte_copy(addr[num],16,ip);
+    slot[i] = ++num;
+  }
+  uint32_pack_big(handle,0xf0000000 + slot[i] - 1);
+  return 1;
+}
+
+/* 6 if handle is a handle, with ip its address; 4 if an IPv4 address; 0 if neither */
+int dns_ip6_addr(char ip[16],const char handle[4])
+{
+  uint32 u;
+
+  if ((unsigned char) handle[0] < 0xf0) return 4;
+  uint32_unpack_big(handle,&u);
+  u -= 0xf0000000;
+  if (!flagon || (u >= num)) return 0;
+  byte_copy(ip,16,addr[u]);
+  return 6;
+}
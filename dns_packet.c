@@ -3,7 +3,10 @@ DNS should have used LZ77 instead of its own sophomoric compression algorithm.
 */
 
 #include "error.h"
+#include "byte.h"
+#include "uint16.h"
 #include "dns.h"
+#include "perfcount.h"
 
 unsigned int dns_packet_copy(const char *buf,unsigned int len,unsigned int pos,char *out,unsigned int outlen)
 {
@@ -15,6 +18,20 @@ unsigned int dns_packet_copy(const char *buf,unsigned int len,unsigned int pos,c
   return pos;
 }
 
+/*
+The 10 bytes after a record's owner name: type, class, TTL, rdata
+length. One bounds check for the lot, and the rdata length decoded
+in line, instead of dns_packet_copy() byte by byte and then
+uint16_unpack_big().
+*/
+unsigned int dns_packet_rrheader(const char *buf,unsigned int len,unsigned int pos,char header[10],unsigned int *datalen)
+{
+  if ((len < 10) || (pos > len - 10)) { errno = error_proto; return 0; }
+  byte_copy(header,10,buf + pos);
+  *datalen = uint16_UNPACK_BIG(buf + pos + 8);
+  return pos + 10;
+}
+
 unsigned int dns_packet_skipname(const char *buf,unsigned int len,unsigned int pos)
 {
   unsigned char ch;
@@ -32,14 +49,13 @@ unsigned int dns_packet_skipname(const char *buf,unsigned int len,unsigned int p
   return 0;
 }
 
-unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int pos,char **d)
+static unsigned int getname(const char *buf,unsigned int len,unsigned int pos,char name[DNS_NAME])
 {
   unsigned int loop = 0;
   unsigned int state = 0;
   unsigned int firstcompress = 0;
   unsigned int where;
   unsigned char ch;
-  char name[255];
   unsigned int namelen = 0;
 
   for (;;) {
@@ -47,7 +63,7 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
     if (++loop >= 1000) goto PROTO;
 
     if (state) {
-      if (namelen + 1 > sizeof name) goto PROTO; name[namelen++] = ch;
+      if (namelen + 1 > DNS_NAME) goto PROTO; name[namelen++] = ch;
       --state;
     }
     else {
@@ -60,14 +76,12 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
 	if (++loop >= 1000) goto PROTO;
       }
       if (ch >= 64) goto PROTO;
-      if (namelen + 1 > sizeof name) goto PROTO; name[namelen++] = ch;
+      if (namelen + 1 > DNS_NAME) goto PROTO; name[namelen++] = ch;
       if (!ch) break;
       state = ch;
     }
   }
 
-  if (!dns_domain_copy(d,name)) return 0;
-
   if (firstcompress) return firstcompress;
   return pos;
 
@@ -75,3 +89,152 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
   errno = error_proto;
   return 0;
 }
+
+/* name has room for DNS_NAME bytes; nothing is allocated */
+unsigned int dns_packet_getnamebuf(const char *buf,unsigned int len,unsigned int pos,char *name)
+{
+  unsigned int r;
+  PERFCOUNT_BEGIN(PERF_PACKET_GETNAME)
+
+  r = getname(buf,len,pos,name);
+  PERFCOUNT_END(PERF_PACKET_GETNAME)
+  return r;
+}
+
+/*
+dns_packet_getquestion() reads the name at pos into name, as
+dns_packet_getnamebuf() does, and in the same pass writes it
+lowercased into lower and sets *h to the cdb_hash() of lower. A
+compressed question is legal but never seen; it takes a second pass.
+*/
+
+#define HASHSTART 5381 /* CDB_HASHSTART */
+
+unsigned int dns_packet_getquestion(const char *buf,unsigned int len,unsigned int pos,char name[DNS_NAME],char lower[DNS_NAME],uint32 *h)
+{
+  unsigned int start = pos;
+  unsigned int state = 0;
+  unsigned int namelen = 0;
+  unsigned char ch;
+  uint32 u = HASHSTART;
+
+  for (;;) {
+    if (pos >= len) goto PROTO;
+    if (namelen >= DNS_NAME) goto PROTO;
+    ch = buf[pos++];
+    name[namelen] = ch;
+    if (state) {
+      --state;
+      if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
+    }
+    else {
+      if (ch >= 192) goto COMPRESSED;
+      if (ch >= 64) goto PROTO;
+      state = ch;
+      if (!ch) break;
+    }
+    lower[namelen++] = ch;
+    u = (u + (u << 5)) ^ ch;
+  }
+  lower[namelen] = 0;
+  *h = u + (u << 5); /* the final 0 */
+  return pos;
+
+  COMPRESSED:
+  pos = dns_packet_getnamebuf(buf,len,start,name);
+  if (!pos) return 0;
+  len = dns_domain_length(name);
+  u = HASHSTART;
+  for (namelen = 0;namelen < len;++namelen) {
+    ch = name[namelen];
+    if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
+    lower[namelen] = ch;
+    u = (u + (u << 5)) ^ ch;
+  }
+  *h = u;
+  return pos;
+
+  PROTO:
+  errno = error_proto;
+  return 0;
+}
+
+unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int pos,char **d)
+{
+  char name[DNS_NAME];
+
+  pos = dns_packet_getnamebuf(buf,len,pos,name);
+  if (!pos) return 0;
+  if (!dns_domain_copy(d,name)) return 0;
+  return pos;
+}
+
+/* pos is just past the question; position of the OPT rdata, or 0 */
+static unsigned int optfind(const char *buf,unsigned int len,unsigned int pos,char data[10])
+{
+  char header[12];
+  unsigned int skip;
+  unsigned int num;
+  uint16 u;
+  uint16 datalen;
+
+  if (!dns_packet_copy(buf,len,0,header,12)) return 0;
+  uint16_unpack_big(header + 6,&u); skip = u;
+  uint16_unpack_big(header + 8,&u); skip += u;
+  uint16_unpack_big(header + 10,&u); num = u;
+
+  while (skip + num) {
+    if (pos >= len) return 0;
+    if (!skip && !buf[pos]) {
+      pos = dns_packet_copy(buf,len,pos + 1,data,10); if (!pos) return 0;
+      if (byte_equal(data,2,DNS_T_OPT)) return pos;
+    }
+    else {
+      pos = dns_packet_skipname(buf,len,pos); if (!pos) return 0;
+      pos = dns_packet_copy(buf,len,pos,data,10); if (!pos) return 0;
+    }
+    uint16_unpack_big(data + 8,&datalen);
+    pos += datalen;
+    if (skip) --skip; else --num;
+  }
+  return 0;
+}
+
+/* pos is just past the question; 1 if OPT, -1 if OPT of unknown version */
+
+int dns_packet_edns(const char *buf,unsigned int len,unsigned int pos,unsigned int *size)
+{
+  char data[10];
+  uint16 u;
+
+  *size = 0;
+  if (!optfind(buf,len,pos,data)) return 0;
+  uint16_unpack_big(data + 2,&u);
+  *size = u;
+  if (*size < 512) *size = 512;
+  return data[5] ? -1 : 1;
+}
+
+/* 1 if the OPT record carries an option with this code */
+
+int dns_packet_ednsoption(const char *buf,unsigned int len,unsigned int pos,const char code[2])
+{
+  char data[10];
+  char opt[4];
+  uint16 datalen;
+  uint16 u;
+  unsigned int end;
+
+  pos = optfind(buf,len,pos,data);
+  if (!pos) return 0;
+  uint16_unpack_big(data + 8,&datalen);
+  end = pos + datalen;
+  if (end > len) return 0;
+  while (pos + 4 <= end) {
+    byte_copy(opt,4,buf + pos);
+    if (byte_equal(opt,2,code)) return 1;
+    uint16_unpack_big(opt + 2,&u);
+    pos += 4 + u;
+  }
+  return 0;
+}
@@ -2,23 +2,39 @@
 #include "dns.h"
 #include "taia.h"
 #include "uint32.h"
+#include "uint64.h"
+
+/*
+Each refill runs SURF on POOL consecutive counters at once: every
+step of the rounds is a loop over the POOL lanes, which the compiler
+can keep in vector registers. The output is what POOL separate SURF
+calls would give. dns_random(n) maps a word to [0,n) by multiplying,
+and draws again in the rare case where that would favor some values,
+so every value is equally likely.
+*/
+
+#define POOL 8
 
 static uint32 seed[32];
 static uint32 in[12];
-static uint32 out[8];
+static uint32 out[8 * POOL];
 static int outleft = 0;
 
 #define ROTATE(x,b) (((x) << (b)) | ((x) >> (32 - (b))))
-#define MUSH(i,b) x = t[i] += (((x ^ seed[i]) + sum) ^ ROTATE(x,b));
+#define MUSH(i,b) for (l = 0;l < POOL;++l) \
+  x[l] = t[i][l] += (((x[l] ^ seed[i]) + sum) ^ ROTATE(x[l],b));
 
 static void surf(void)
 {
-  uint32 t[12]; uint32 x; uint32 sum = 0;
-  int r; int i; int loop;
+  uint32 t[12][POOL]; uint32 x[POOL]; uint32 sum = 0;
+  int r; int i; int l; int loop;
 
-  for (i = 0;i < 12;++i) t[i] = in[i] ^ seed[12 + i];
-  for (i = 0;i < 8;++i) out[i] = seed[24 + i];
-  x = t[11];
+  for (l = 0;l < POOL;++l) {
+    if (!++in[0]) if (!++in[1]) if (!++in[2]) ++in[3];
+    for (i = 0;i < 12;++i) t[i][l] = in[i] ^ seed[12 + i];
+    for (i = 0;i < 8;++i) out[8 * l + i] = seed[24 + i];
+    x[l] = t[11][l];
+  }
   for (loop = 0;loop < 2;++loop) {
     for (r = 0;r < 16;++r) {
       sum += 0x9e3779b9;
@@ -26,7 +42,8 @@ static void surf(void)
       MUSH(4,5) MUSH(5,7) MUSH(6,9) MUSH(7,13)
       MUSH(8,5) MUSH(9,7) MUSH(10,9) MUSH(11,13)
     }
-    for (i = 0;i < 8;++i) out[i] ^= t[i + 4];
+    for (l = 0;l < POOL;++l)
+      for (i = 0;i < 8;++i) out[8 * l + i] ^= t[i + 4][l];
   }
 }
 
@@ -49,15 +66,27 @@ void dns_random_init(const char data[128])
   /* more space in 10 and 11, but this is probably enough */
 }
 
-unsigned int dns_random(unsigned int n)
+static uint32 next(void)
 {
-  if (!n) return 0;
-
   if (!outleft) {
-    if (!++in[0]) if (!++in[1]) if (!++in[2]) ++in[3];
     surf();
-    outleft = 8;
+    outleft = 8 * POOL;
   }
+  return out[--outleft];
+}
+
+unsigned int dns_random(unsigned int n)
+{
+  uint64 m;
+  uint32 limit;
 
-  return out[--outleft] % n;
+  if (!n) return 0;
+
+  m = (uint64) next() * (uint32) n;
+  if ((uint32) m < (uint32) n) {
+    limit = (uint32) -(uint32) n % (uint32) n; /* 2^32 mod n */
+    while ((uint32) m < limit)
+      m = (uint64) next() * (uint32) n;
+  }
+  return m >> 32;
 }
@@ -1,3 +1,5 @@
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "taia.h"
 #include "openreadclose.h"
 #include "byte.h"
@@ -59,28 +61,63 @@ static int init(char ip[64])
   return 0;
 }
 
+/* what resolv.conf looked like when it was read */
+struct stamp {
+  int flagexists;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+} ;
+
+static void stamp(struct stamp *s,const char *fn)
+{
+  struct stat st;
+
+  byte_zero(s,sizeof *s);
+  if (stat(fn,&st) == -1) return;
+  s->flagexists = 1;
+  s->dev = st.st_dev;
+  s->ino = st.st_ino;
+  s->mtime = st.st_mtime;
+  s->size = st.st_size;
+}
+
+static int samestamp(const struct stamp *s,const struct stamp *t)
+{
+  if (s->flagexists != t->flagexists) return 0;
+  if (!s->flagexists) return 1;
+  return (s->dev == t->dev) && (s->ino == t->ino)
+    && (s->mtime == t->mtime) && (s->size == t->size);
+}
+
 static int ok = 0;
-static unsigned int uses;
-static struct taia deadline;
+static struct taia deadline; /* when to look at resolv.conf again */
+static struct stamp seen;
 static char ip[64]; /* defined if ok */
 
+/*
+The servers are parsed once and kept until resolv.conf is replaced or
+changes, which is checked with stat() at most once a second.
+*/
 int dns_resolvconfip(char s[64])
 {
   struct taia now;
+  struct stamp st;
 
   taia_now(&now);
-  if (taia_less(&deadline,&now)) ok = 0;
-  if (!uses) ok = 0;
-
-  if (!ok) {
-    if (init(ip) == -1) return -1;
-    taia_uint(&deadline,600);
+  if (!ok || taia_less(&deadline,&now)) {
+    stamp(&st,"/etc/resolv.conf");
+    if (!ok || !samestamp(&st,&seen)) {
+      ok = 0;
+      if (init(ip) == -1) return -1;
+      seen = st;
+      ok = 1;
+    }
+    taia_uint(&deadline,1);
     taia_add(&deadline,&now,&deadline);
-    uses = 10000;
-    ok = 1;
   }
 
-  --uses;
   byte_copy(s,64,ip);
   return 0;
 }
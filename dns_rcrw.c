@@ -1,3 +1,5 @@
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "taia.h"
 #include "env.h"
@@ -104,28 +106,71 @@ static int init(stralloc *rules)
   return 0;
 }
 
+/* what a file looked like when it was read */
+struct stamp {
+  int flagexists;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+} ;
+
+static void stamp(struct stamp *s,const char *fn)
+{
+  struct stat st;
+
+  byte_zero(s,sizeof *s);
+  if (stat(fn,&st) == -1) return;
+  s->flagexists = 1;
+  s->dev = st.st_dev;
+  s->ino = st.st_ino;
+  s->mtime = st.st_mtime;
+  s->size = st.st_size;
+}
+
+static int samestamp(const struct stamp *s,const struct stamp *t)
+{
+  if (s->flagexists != t->flagexists) return 0;
+  if (!s->flagexists) return 1;
+  return (s->dev == t->dev) && (s->ino == t->ino)
+    && (s->mtime == t->mtime) && (s->size == t->size);
+}
+
 static int ok = 0;
-static unsigned int uses;
-static struct taia deadline;
+static struct taia deadline; /* when to look at the files again */
+static struct stamp seenrewrite;
+static struct stamp seenconf;
 static stralloc rules = {0}; /* defined if ok */
 
+/*
+The rules are built once and kept until the rewrite file or
+resolv.conf is replaced or changes, which is checked with stat() at
+most once a second.
+*/
 int dns_resolvconfrewrite(stralloc *out)
 {
   struct taia now;
+  struct stamp strewrite;
+  struct stamp stconf;
+  const char *x;
 
   taia_now(&now);
-  if (taia_less(&deadline,&now)) ok = 0;
-  if (!uses) ok = 0;
-
-  if (!ok) {
-    if (init(&rules) == -1) return -1;
-    taia_uint(&deadline,600);
+  if (!ok || taia_less(&deadline,&now)) {
+    x = env_get("DNSREWRITEFILE");
+    if (!x) x = "/etc/dnsrewrite";
+    stamp(&strewrite,x);
+    stamp(&stconf,"/etc/resolv.conf");
+    if (!ok || !samestamp(&strewrite,&seenrewrite) || !samestamp(&stconf,&seenconf)) {
+      ok = 0;
+      if (init(&rules) == -1) return -1;
+      seenrewrite = strewrite;
+      seenconf = stconf;
+      ok = 1;
+    }
+    taia_uint(&deadline,1);
     taia_add(&deadline,&now,&deadline);
-    uses = 10000;
-    ok = 1;
   }
 
-  --uses;
   if (!stralloc_copy(out,&rules)) return -1;
   return 0;
 }
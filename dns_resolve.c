@@ -13,17 +13,25 @@ int dns_resolve(const char *q,const char qtype[2])
   iopause_fd x[1];
   int r;
 
+  dns_transmit_free(&dns_resolve_tx);
+  r = dns_cache_get(q,qtype,&dns_resolve_tx.packet,&dns_resolve_tx.packetlen);
+  if (r == -1) return -1;
+  if (r == 1) return 0;
+
   if (dns_resolvconfip(servers) == -1) return -1;
   if (dns_transmit_start(&dns_resolve_tx,servers,1,q,qtype,"\0\0\0\0") == -1) return -1;
 
   for (;;) {
-    taia_now(&stamp);
+    taia_clock(&stamp);
     taia_uint(&deadline,120);
     taia_add(&deadline,&deadline,&stamp);
     dns_transmit_io(&dns_resolve_tx,x,&deadline);
     iopause(x,1,&deadline,&stamp);
     r = dns_transmit_get(&dns_resolve_tx,x,&stamp);
     if (r == -1) return -1;
-    if (r == 1) return 0;
+    if (r == 1) {
+      dns_cache_set(q,qtype,dns_resolve_tx.packet,dns_resolve_tx.packetlen);
+      return 0;
+    }
   }
 }
@@ -0,0 +1,320 @@
+#include "taia.h"
+#include "byte.h"
+#include "uint32.h"
+#include "dns.h"
+
+/*
+A table of the servers we have sent UDP queries to, by address.
+srtt and rttvar are in milliseconds, smoothed as for TCP (RFC 6298).
+loss is the smoothed fraction of queries that timed out, in 1/1024.
+An entry not updated for FORGET seconds counts as unknown again,
+so that a server that was slow or dead once gets another chance.
+
+After EJECT timeouts in a row a server is down for HOLD seconds:
+it sorts after every server that is not, and dns_rtt_down() says
+so, for whoever wants to probe it. One answer brings it back. Once
+the hold is over, a single further timeout puts it down again.
+
+A second table, of the same shape, counts for each server the UDP
+queries now outstanding, between dns_rtt_sent() and dns_rtt_done(),
+and those sent in the current second. With dns_rtt_balance(), as for
+forwarders, which all answer the same questions, a server's score
+grows with its outstanding queries, so that load spreads over the
+fast servers instead of piling onto the fastest one. With
+dns_rtt_limit(), dns_rtt_full() says when a server has as many
+outstanding queries, or has had as many queries this second, as it
+should get. A server whose slot is busy with another goes uncounted.
+*/
+
+#define SIZE DNS_RTT_SIZE /* 2^10, for slot() */
+#define FORGET 600
+#define UNKNOWN 200 /* milliseconds; score of a server we know nothing about */
+#define MINRTO 100
+#define EJECT 2
+#define HOLD 30
+#define DOWN 0x10000000 /* added to the score of a server that is down */
+
+struct rtt {
+  char ip[4];
+  uint32 when;
+  unsigned long srtt;
+  unsigned long rttvar;
+  unsigned long loss;
+  unsigned int fails; /* timeouts since the last answer */
+  uint32 down; /* down until then, if fails >= EJECT */
+} ;
+
+struct load {
+  char ip[4];
+  unsigned long inflight;
+  uint32 second;
+  unsigned long count; /* queries sent during second */
+} ;
+
+static struct rtt table[SIZE];
+static struct load loads[SIZE];
+static int flagused = 0;
+static int flagbalance = 0;
+static int flagload = 0;
+static unsigned long maxinflight = 0;
+static unsigned long maxrate = 0;
+
+void dns_rtt_balance(void)
+{
+  flagbalance = 1;
+  flagload = 1;
+}
+
+/* 0 for no limit */
+void dns_rtt_limit(unsigned long inflight,unsigned long rate)
+{
+  maxinflight = inflight;
+  maxrate = rate;
+  if (inflight || rate) flagload = 1;
+}
+
+static uint32 now(void)
+{
+  struct taia t;
+  taia_clock(&t);
+  return t.sec.x;
+}
+
+static unsigned int hash(const char ip[4])
+{
+  uint32 u;
+
+  uint32_unpack(ip,&u);
+  return ((u * 2654435761UL) & 0xffffffff) >> 22;
+}
+
+static struct rtt *slot(const char ip[4])
+{
+  return table + hash(ip);
+}
+
+static struct rtt *known(const char ip[4],uint32 t)
+{
+  struct rtt *r;
+
+  if (!flagused) return 0;
+  r = slot(ip);
+  if (byte_diff(r->ip,4,ip)) return 0;
+  if (t - r->when > FORGET) return 0;
+  return r;
+}
+
+void dns_rtt_answer(const char ip[4],unsigned long ms)
+{
+  struct rtt *r;
+  unsigned long diff;
+  uint32 t;
+
+  t = now();
+  r = known(ip,t);
+  if (!r) {
+    r = slot(ip);
+    byte_copy(r->ip,4,ip);
+    r->srtt = ms;
+    r->rttvar = ms / 2;
+    r->loss = 0;
+  }
+  else {
+    diff = (ms > r->srtt) ? ms - r->srtt : r->srtt - ms;
+    r->rttvar = (3 * r->rttvar + diff) / 4;
+    r->srtt = (7 * r->srtt + ms) / 8;
+    r->loss -= r->loss / 8;
+  }
+  r->fails = 0;
+  r->down = 0;
+  r->when = t;
+  flagused = 1;
+}
+
+/* we waited ms for an answer and gave up */
+void dns_rtt_timeout(const char ip[4],unsigned long ms)
+{
+  struct rtt *r;
+  uint32 t;
+
+  t = now();
+  r = known(ip,t);
+  if (!r) {
+    r = slot(ip);
+    byte_copy(r->ip,4,ip);
+    r->srtt = ms;
+    r->rttvar = ms / 2;
+    r->loss = 0;
+    r->fails = 0;
+  }
+  else if (r->srtt < ms)
+    r->srtt += (ms - r->srtt) / 8;
+  r->loss += (1024 - r->loss) / 8;
+  if (++r->fails >= EJECT) r->down = t + HOLD;
+  r->when = t;
+  flagused = 1;
+}
+
+/* ip's entry, or 0 if the slot is busy with another server */
+static struct load *claim(const char ip[4],uint32 t)
+{
+  struct load *l;
+
+  l = loads + hash(ip);
+  if (byte_equal(l->ip,4,ip)) return l;
+  if (l->inflight) return 0;
+  if ((l->second == t) && l->count) return 0;
+  byte_copy(l->ip,4,ip);
+  l->count = 0;
+  return l;
+}
+
+static unsigned long inflight(const char ip[4])
+{
+  struct load *l;
+
+  if (!flagload) return 0;
+  l = loads + hash(ip);
+  if (byte_diff(l->ip,4,ip)) return 0;
+  return l->inflight;
+}
+
+/* a UDP query has gone to ip */
+void dns_rtt_sent(const char ip[4])
+{
+  struct load *l;
+  uint32 t;
+
+  if (!flagload) return;
+  t = now();
+  l = claim(ip,t);
+  if (!l) return;
+  ++l->inflight;
+  if (l->second != t) { l->second = t; l->count = 0; }
+  ++l->count;
+}
+
+/* the query has had its answer or its timeout, or been abandoned */
+void dns_rtt_done(const char ip[4])
+{
+  struct load *l;
+
+  l = loads + hash(ip);
+  if (byte_diff(l->ip,4,ip)) return;
+  if (l->inflight) --l->inflight;
+}
+
+/* 1 if ip should not get another query yet */
+int dns_rtt_full(const char ip[4])
+{
+  struct load *l;
+
+  if (!maxinflight && !maxrate) return 0;
+  l = loads + hash(ip);
+  if (byte_diff(l->ip,4,ip)) return 0;
+  if (maxinflight && (l->inflight >= maxinflight)) return 1;
+  if (maxrate && (l->second == now()) && (l->count >= maxrate)) return 1;
+  return 0;
+}
+
+static int isdown(const struct rtt *r,uint32 t)
+{
+  return (r->fails >= EJECT) && ((uint32) (r->down - t - 1) < HOLD);
+}
+
+/* 1 if ip has been marked down and is still within its hold time */
+int dns_rtt_down(const char ip[4])
+{
+  struct rtt *r;
+  uint32 t;
+
+  t = now();
+  r = known(ip,t);
+  return r && isdown(r,t);
+}
+
+static unsigned long rto(const struct rtt *r)
+{
+  unsigned long u;
+
+  u = r->srtt + 4 * r->rttvar;
+  if (u < MINRTO) u = MINRTO;
+  return u;
+}
+
+/* retransmit timeout in milliseconds, or 0 if we know nothing */
+unsigned long dns_rtt_rto(const char ip[4])
+{
+  struct rtt *r;
+
+  r = known(ip,now());
+  if (!r) return 0;
+  return rto(r);
+}
+
+/* expected milliseconds to an answer, counting timeouts */
+static unsigned long score(const char ip[4],uint32 t)
+{
+  struct rtt *r;
+  unsigned long u;
+
+  if (byte_equal(ip,4,"\0\0\0\0")) return 0xffffffff;
+  r = known(ip,t);
+  if (!r) return UNKNOWN;
+  u = r->srtt + (r->loss * rto(r)) / (1025 - r->loss);
+  if (flagbalance)
+    u += u * inflight(ip);
+  if (u > DOWN) u = DOWN;
+  if (isdown(r,t)) u += DOWN;
+  return u;
+}
+
+/* stable: servers with equal scores keep their order */
+void dns_rtt_sort(char *s,unsigned int n)
+{
+  unsigned long sc[16];
+  unsigned long u;
+  unsigned int i;
+  unsigned int j;
+  char tmp[4];
+  uint32 t;
+
+  if (!flagused) return;
+  n >>= 2;
+  if (n > 16) n = 16;
+  t = now();
+  for (i = 0;i < n;++i)
+    sc[i] = score(s + 4 * i,t);
+
+  for (i = 1;i < n;++i)
+    for (j = i;(j > 0) && (sc[j - 1] > sc[j]);--j) {
+      u = sc[j]; sc[j] = sc[j - 1]; sc[j - 1] = u;
+      byte_copy(tmp,4,s + 4 * j);
+      byte_copy(s + 4 * j,4,s + 4 * j - 4);
+      byte_copy(s + 4 * j - 4,4,tmp);
+    }
+}
+
+/*
+Entry i of the table, for i from 0 to DNS_RTT_SIZE - 1: 0 if it is
+empty or forgotten; otherwise 1, with the server in ip and its srtt,
+rttvar, loss, fails and seconds left down in info.
+*/
+int dns_rtt_entry(unsigned int i,char ip[4],unsigned long info[5])
+{
+  struct rtt *r;
+  uint32 t;
+
+  if (!flagused || (i >= SIZE)) return 0;
+  r = table + i;
+  t = now();
+  if (byte_equal(r->ip,4,"\0\0\0\0")) return 0;
+  if (t - r->when > FORGET) return 0;
+  byte_copy(ip,4,r->ip);
+  info[0] = r->srtt;
+  info[1] = r->rttvar;
+  info[2] = r->loss;
+  info[3] = r->fails;
+  info[4] = isdown(r,t) ? r->down - t : 0;
+  return 1;
+}
@@ -6,71 +6,299 @@
 #include "error.h"
 #include "byte.h"
 #include "uint16.h"
+#include "uint32.h"
 #include "dns.h"
 
+/* the header checks read buf in place once len >= 12 is known */
+
 static int serverwantstcp(const char *buf,unsigned int len)
 {
-  char out[12];
-
-  if (!dns_packet_copy(buf,len,0,out,12)) return 1;
-  if (out[2] & 2) return 1;
+  if (len < 12) return 1;
+  if (buf[2] & 2) return 1;
   return 0;
 }
 
 static int serverfailed(const char *buf,unsigned int len)
 {
-  char out[12];
   unsigned int rcode;
 
-  if (!dns_packet_copy(buf,len,0,out,12)) return 1;
-  rcode = out[3];
-  rcode &= 15;
+  if (len < 12) return 1;
+  rcode = buf[3] & 15;
   if (rcode && (rcode != 3)) { errno = error_again; return 1; }
   return 0;
 }
 
+static int refusededns(const struct dns_transmit *d,const char *buf,unsigned int len)
+{
+  if (!d->flagedns) return 0;
+  if (len < 12) return 0;
+  if (byte_diff(buf,2,d->query + 2)) return 0;
+  if (!(buf[2] & 128)) return 0;
+  switch(buf[3] & 15) {
+    case 1: case 4: return 1; /* FORMERR, NOTIMP */
+  }
+  return 0;
+}
+
 static int irrelevant(const struct dns_transmit *d,const char *buf,unsigned int len)
 {
-  char out[12];
-  char *dn;
+  char dn[DNS_NAME];
   unsigned int pos;
 
-  pos = dns_packet_copy(buf,len,0,out,12); if (!pos) return 1;
-  if (byte_diff(out,2,d->query + 2)) return 1;
-  if (out[4] != 0) return 1;
-  if (out[5] != 1) return 1;
+  if (len < 12) return 1;
+  if (byte_diff(buf,2,d->query + 2)) return 1;
+  if (buf[4] != 0) return 1;
+  if (buf[5] != 1) return 1;
 
-  dn = 0;
-  pos = dns_packet_getname(buf,len,pos,&dn); if (!pos) return 1;
-  if (!dns_domain_equal(dn,d->query + 14)) { alloc_free(dn); return 1; }
-  alloc_free(dn);
+  pos = dns_packet_getnamebuf(buf,len,12,dn); if (!pos) return 1;
+  if (!dns_domain_equal(dn,d->query + 14)) return 1;
 
-  pos = dns_packet_copy(buf,len,pos,out,4); if (!pos) return 1;
-  if (byte_diff(out,2,d->qtype)) return 1;
-  if (byte_diff(out + 2,2,DNS_C_IN)) return 1;
+  if (pos > len - 4) return 1;
+  if (byte_diff(buf + pos,2,d->qtype)) return 1;
+  if (byte_diff(buf + pos + 2,2,DNS_C_IN)) return 1;
 
   return 0;
 }
 
+/*
+Queries and packets come from spare buffers in two sizes, kept after
+use, up to SPAREKEEP of each, instead of one alloc() and alloc_free()
+for each. A packet over SPARELARGE bytes, only ever from TCP, gets an
+alloc() of its own. A packet a caller takes out of d stays good for
+alloc_free().
+*/
+
+#define SPARESMALL 512
+#define SPARELARGE 4096
+#define SPAREKEEP 64
+
+static char *spare[2][SPAREKEEP];
+static unsigned int numspare[2];
+
+static char *bufget(unsigned int len)
+{
+  if (len > SPARELARGE) return alloc(len);
+  if (len > SPARESMALL) {
+    if (numspare[1]) return spare[1][--numspare[1]];
+    return alloc(SPARELARGE);
+  }
+  if (numspare[0]) return spare[0][--numspare[0]];
+  return alloc(SPARESMALL);
+}
+
+static void bufput(char *x,unsigned int len)
+{
+  int i;
+
+  if (len > SPARELARGE) { alloc_free(x); return; }
+  i = (len > SPARESMALL);
+  if (numspare[i] == SPAREKEEP) { alloc_free(x); return; }
+  spare[i][numspare[i]++] = x;
+}
+
 static void packetfree(struct dns_transmit *d)
 {
   if (!d->packet) return;
-  alloc_free(d->packet);
+  bufput(d->packet,d->packetlen);
   d->packet = 0;
 }
 
 static void queryfree(struct dns_transmit *d)
 {
   if (!d->query) return;
-  alloc_free(d->query);
+  bufput(d->query,d->querylen);
   d->query = 0;
 }
 
+/*
+With ednssize set, queries carry an OPT record advertising ednssize
+bytes of UDP payload. A server that answers such a query with FORMERR
+or NOTIMP gets it again without the OPT record.
+*/
+
+static unsigned int ednssize = 0;
+
+void dns_transmit_edns(unsigned int size)
+{
+  ednssize = size;
+}
+
+static void noedns(struct dns_transmit *d)
+{
+  d->flagedns = 0;
+  d->querylen -= 11;
+  uint16_pack_big(d->query,d->querylen - 2);
+  d->query[13] = 0;
+}
+
+/*
+Idle UDP sockets, each still bound to its random port and connected
+to the server it last queried. A socket is only ever reused for the
+same server and local address, so its port stays hidden from everyone
+else, exactly as if it were fresh; and it is retired after POOLUSES
+queries or POOLAGE seconds. The kernel matches the server address and
+port; irrelevant() matches the ID and question.
+
+TCP connections are kept the same way, once a response has been read
+in full and matched the query, so the stream is known to be in step.
+An idle connection is retired after TCPPOOLAGE seconds, before
+servers typically close theirs, or as soon as the server has closed
+it or sent something unasked. A query that fails on a reused
+connection before its response is complete goes to the same server
+again, rather than to the next one.
+*/
+
+#define POOL 64
+#define POOLUSES 64
+#define POOLAGE 60
+#define POOLFDS 1024
+#define TCPPOOL 16
+#define TCPPOOLAGE 5
+
+static struct {
+  int flagudp;
+  int flagtcp;
+  char ip[4];
+  char localip[4];
+  unsigned int uses;
+  uint32 born; /* UDP: when bound; TCP: when last put back */
+} pool[POOLFDS];
+static int idle[POOL];
+static unsigned int idlelen = 0;
+static int tcpidle[TCPPOOL];
+static unsigned int tcpidlelen = 0;
+
+static uint32 seconds(void)
+{
+  struct taia now;
+  taia_clock(&now);
+  return now.sec.x;
+}
+
+static void poolclose(int fd)
+{
+  if ((fd >= 0) && (fd < POOLFDS)) pool[fd].flagudp = pool[fd].flagtcp = 0;
+  close(fd);
+}
+
+/* an idle socket connected to ip from localip, or -1 */
+static int udptake(const char ip[4],const char localip[4])
+{
+  char ch;
+  unsigned int i;
+  int fd;
+
+  for (i = 0;i < idlelen;++i) {
+    fd = idle[i];
+    if (byte_equal(pool[fd].ip,4,ip) && byte_equal(pool[fd].localip,4,localip)) {
+      idle[i] = idle[--idlelen];
+      if (seconds() - pool[fd].born >= POOLAGE) { poolclose(fd); --i; continue; }
+      while (recv(fd,&ch,1,0) >= 0) ; /* anything that arrived while idle */
+      ++pool[fd].uses;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+static void poolnew(int fd,const char ip[4],const char localip[4],int flagtcp)
+{
+  if ((fd < 0) || (fd >= POOLFDS)) return;
+  pool[fd].flagudp = !flagtcp;
+  pool[fd].flagtcp = flagtcp;
+  byte_copy(pool[fd].ip,4,ip);
+  byte_copy(pool[fd].localip,4,localip);
+  pool[fd].uses = 1;
+  pool[fd].born = seconds();
+}
+
+/* an idle TCP connection to ip from localip, still open, or -1 */
+static int tcptake(const char ip[4],const char localip[4])
+{
+  char ch;
+  unsigned int i;
+  int fd;
+
+  for (i = 0;i < tcpidlelen;++i) {
+    fd = tcpidle[i];
+    if (byte_equal(pool[fd].ip,4,ip) && byte_equal(pool[fd].localip,4,localip)) {
+      tcpidle[i] = tcpidle[--tcpidlelen];
+      --i;
+      if (seconds() - pool[fd].born >= TCPPOOLAGE) { poolclose(fd); continue; }
+      if (recv(fd,&ch,1,MSG_PEEK) != -1) { poolclose(fd); continue; }
+      if ((errno != error_again) && (errno != error_wouldblock)) { poolclose(fd); continue; }
+      ++pool[fd].uses;
+      return fd;
+    }
+  }
+  return -1;
+}
+
+/* a UDP query has gone to ip on s1 */
+static void sent(struct dns_transmit *d,const char *ip)
+{
+  dns_rtt_sent(ip);
+  if (d->numoutstanding < 2)
+    byte_copy(d->outstanding + 4 * d->numoutstanding++,4,ip);
+}
+
+/* whatever went out on s1 is over */
+static void settle(struct dns_transmit *d)
+{
+  while (d->numoutstanding)
+    dns_rtt_done(d->outstanding + 4 * --d->numoutstanding);
+}
+
 static void socketfree(struct dns_transmit *d)
 {
+  int fd;
+
+  settle(d);
+  if (!d->s1) return;
+  fd = d->s1 - 1;
+  d->s1 = 0;
+  iopause_forget(fd);
+  if ((fd < POOLFDS) && pool[fd].flagudp)
+    if ((idlelen < POOL) && (pool[fd].uses < POOLUSES)) {
+      idle[idlelen++] = fd;
+      return;
+    }
+  poolclose(fd);
+}
+
+static void socketdrop(struct dns_transmit *d)
+{
+  settle(d);
+  if (!d->s1) return;
+  iopause_forget(d->s1 - 1);
+  poolclose(d->s1 - 1);
+  d->s1 = 0;
+}
+
+/* the TCP connection has just carried a complete, matching response */
+static void tcpput(struct dns_transmit *d)
+{
+  int fd;
+
   if (!d->s1) return;
-  close(d->s1 - 1);
+  fd = d->s1 - 1;
   d->s1 = 0;
+  iopause_forget(fd);
+  if ((fd < POOLFDS) && pool[fd].flagtcp)
+    if ((tcpidlelen < TCPPOOL) && (pool[fd].uses < POOLUSES)) {
+      pool[fd].born = seconds();
+      tcpidle[tcpidlelen++] = fd;
+      return;
+    }
+  poolclose(fd);
+}
+
+static int reused(const struct dns_transmit *d)
+{
+  int fd;
+
+  fd = d->s1 - 1;
+  return (fd >= 0) && (fd < POOLFDS) && pool[fd].flagtcp && (pool[fd].uses > 1);
 }
 
 void dns_transmit_free(struct dns_transmit *d)
@@ -80,6 +308,20 @@ void dns_transmit_free(struct dns_transmit *d)
   packetfree(d);
 }
 
+/* as if server 0 of servers had answered with buf; 0, or -1 if out of memory */
+int dns_transmit_packet(struct dns_transmit *d,const char servers[64],const char *buf,unsigned int len)
+{
+  dns_transmit_free(d);
+  errno = error_io;
+  d->packet = bufget(len);
+  if (!d->packet) return -1;
+  byte_copy(d->packet,len,buf);
+  d->packetlen = len;
+  d->servers = servers;
+  d->curserver = 0;
+  return 0;
+}
+
 static int randombind(struct dns_transmit *d)
 {
   int j;
@@ -92,39 +334,291 @@ static int randombind(struct dns_transmit *d)
   return -1;
 }
 
+/*
+A server address may be a handle from dns_ip6_handle(); such a server
+is reached over IPv6, from the address given to dns_ip6_local(). The
+RTT table knows a handle like any other address, so dns_rtt_sort()
+puts whichever of a server's two addresses answers faster first. A
+handle that stands for nothing is skipped, as is a server whose
+family the host cannot reach.
+*/
+
+static int usable(const char *ip)
+{
+  char ip6[16];
+
+  if (byte_equal(ip,4,"\0\0\0\0")) return 0;
+  return dns_ip6_addr(ip6,ip) != 0;
+}
+
+static int randombind6(struct dns_transmit *d)
+{
+  char ip6[16];
+  int j;
+
+  dns_ip6_on(ip6);
+  for (j = 0;j < 10;++j)
+    if (socket_bind6(d->s1 - 1,ip6,1025 + dns_random(64510)) == 0)
+      return 0;
+  if (socket_bind6(d->s1 - 1,ip6,0) == 0)
+    return 0;
+  return -1;
+}
+
+/* 0 with a fresh socket for ip in s1; -1 on failure; 1 to skip ip */
+static int newsocket(struct dns_transmit *d,const char *ip,int flagtcp)
+{
+  char ip6[16];
+
+  if (dns_ip6_addr(ip6,ip) == 6) {
+    d->s1 = 1 + (flagtcp ? socket_tcp6() : socket_udp6());
+    if (!d->s1) return 1;
+    if (randombind6(d) == -1) return 1;
+    return 0;
+  }
+  d->s1 = 1 + (flagtcp ? socket_tcp() : socket_udp());
+  if (!d->s1) return -1;
+  if (randombind(d) == -1) return -1;
+  return 0;
+}
+
+static int connectip(int fd,const char *ip)
+{
+  char ip6[16];
+
+  if (dns_ip6_addr(ip6,ip) == 6) return socket_connect6(fd,ip6,53);
+  return socket_connect4(fd,ip,53);
+}
+
+static int sendip(int fd,const char *buf,int len,const char *ip)
+{
+  char ip6[16];
+
+  if (dns_ip6_addr(ip6,ip) == 6) return socket_send6(fd,buf,len,ip6,53);
+  return socket_send4(fd,buf,len,ip,53);
+}
+
+static int samefamily(const char *ip,const char *ip2)
+{
+  char ip6[16];
+  return dns_ip6_addr(ip6,ip) == dns_ip6_addr(ip6,ip2);
+}
+
+/* from a hedging socket: ip is the server's address or handle, else 0 */
+static int recvip(struct dns_transmit *d,int fd,char *buf,int len,char ip[4],uint16 *port)
+{
+  char ip6[16];
+  char from[16];
+  const char *server;
+  int r;
+  int j;
+
+  server = d->servers + 4 * d->curserver;
+  if (dns_ip6_addr(ip6,server) != 6) return socket_recv4(fd,buf,len,ip,port);
+  r = socket_recv6(fd,buf,len,from,port);
+  if (r == -1) return -1;
+  byte_zero(ip,4);
+  for (j = 0;j < 2;++j) {
+    if (j) server = d->servers + 4 * d->hedgeserver;
+    if ((j && (d->hedgeserver >= 16)) || (dns_ip6_addr(ip6,server) != 6)) continue;
+    if (byte_equal(ip6,16,from)) byte_copy(ip,4,server);
+  }
+  return r;
+}
+
 static const int timeouts[4] = { 1, 3, 11, 45 };
 
+/* the static timeout, or less once we know how fast ip answers */
+static void udpdeadline(struct dns_transmit *d,const char *ip)
+{
+  unsigned long ms;
+  unsigned long rto;
+  struct taia t;
+
+  ms = 1000 * timeouts[d->udploop];
+  rto = dns_rtt_rto(ip);
+  if (rto) {
+    rto <<= d->udploop;
+    if (rto < ms) ms = rto;
+  }
+
+  taia_uint(&t,ms / 1000);
+  t.nano = (ms % 1000) * 1000000;
+  taia_add(&d->deadline,&d->sent,&t);
+}
+
+static unsigned long elapsed(const struct taia *since)
+{
+  struct taia now;
+
+  taia_clock(&now);
+  if (taia_less(&now,since)) return 0;
+  taia_sub(&now,&now,since);
+  return taia_approx(&now) * 1000.0;
+}
+
+/*
+Servers for which dns_rtt_full() says so are skipped in favor of the
+others. If none is left, the query waits, in tcpstate 6 with no
+socket, for QUEUEWAIT milliseconds at a time, and tries again from
+the first server it skipped, until QUEUEMAX waits have gone by; then
+it fails. A hedge to a full server waits likewise, but only until the
+first server's deadline.
+*/
+
+#define QUEUEWAIT 50
+#define QUEUEMAX 40
+
+static void waitfor(struct taia *t)
+{
+  struct taia wait;
+
+  taia_uint(&wait,0);
+  wait.nano = QUEUEWAIT * 1000000;
+  taia_add(t,t,&wait);
+}
+
+/*
+Hedging: if hedgems is set, the first UDP attempt of a transmission
+goes out on a fresh unconnected socket, and the next server after it
+gets the same query on the same socket hedgems later (or after the
+first server's RTO, if that is shorter), unless an answer came first.
+Either server's answer is taken.
+hedgestate: 0 no hedging; 1 may hedge; 2 waiting to hedge; 3 hedged.
+*/
+
+static unsigned int hedgems = 0;
+
+void dns_transmit_hedge(unsigned int ms)
+{
+  hedgems = ms;
+}
+
+static unsigned int nextserver(const struct dns_transmit *d)
+{
+  unsigned int j;
+
+  for (j = d->curserver + 1;j < 16;++j)
+    if (usable(d->servers + 4 * j))
+      break;
+  return j;
+}
+
+static int hedgestart(struct dns_transmit *d,const char *ip)
+{
+  unsigned long ms;
+  unsigned long rto;
+  struct taia t;
+  int r;
+
+  r = newsocket(d,ip,0);
+  if (r == -1) return -1;
+  if (r == 1) { socketdrop(d); return 0; }
+  if (sendip(d->s1 - 1,d->query + 2,d->querylen - 2,ip) != d->querylen - 2) {
+    socketdrop(d);
+    return 0;
+  }
+
+  sent(d,ip);
+  taia_clock(&d->sent);
+  udpdeadline(d,ip);
+  d->tcpstate = 0;
+  d->hedgeserver = nextserver(d);
+  d->hedgestate = 2;
+
+  ms = hedgems;
+  rto = dns_rtt_rto(ip);
+  if (rto && (rto < ms)) ms = rto;
+  taia_uint(&t,ms / 1000);
+  t.nano = (ms % 1000) * 1000000;
+  taia_add(&d->hedgetime,&d->sent,&t);
+  return 1;
+}
+
+static void hedgesend(struct dns_transmit *d)
+{
+  const char *ip;
+  struct taia deadline;
+  struct taia first;
+
+  ip = d->servers + 4 * d->hedgeserver;
+  if (dns_rtt_full(ip)) {
+    taia_clock(&d->hedgetime);
+    waitfor(&d->hedgetime);
+    return;
+  }
+  d->hedgestate = 3;
+  if (sendip(d->s1 - 1,d->query + 2,d->querylen - 2,ip) != d->querylen - 2) return;
+  sent(d,ip);
+
+  deadline = d->deadline;
+  first = d->sent;
+  taia_clock(&d->sent);
+  udpdeadline(d,ip);
+  d->hedgetime = d->sent;
+  d->sent = first;
+  if (taia_less(&d->deadline,&deadline)) d->deadline = deadline;
+}
+
 static int thisudp(struct dns_transmit *d)
 {
   const char *ip;
+  unsigned int skipped;
+  int r;
 
   socketfree(d);
 
   while (d->udploop < 4) {
+    skipped = 16;
     for (;d->curserver < 16;++d->curserver) {
       ip = d->servers + 4 * d->curserver;
-      if (byte_diff(ip,4,"\0\0\0\0")) {
-	d->query[2] = dns_random(256);
-	d->query[3] = dns_random(256);
-  
-        d->s1 = 1 + socket_udp();
-        if (!d->s1) { dns_transmit_free(d); return -1; }
-	if (randombind(d) == -1) { dns_transmit_free(d); return -1; }
-
-        if (socket_connect4(d->s1 - 1,ip,53) == 0)
-          if (send(d->s1 - 1,d->query + 2,d->querylen - 2,0) == d->querylen - 2) {
-            struct taia now;
-            taia_now(&now);
-            taia_uint(&d->deadline,timeouts[d->udploop]);
-            taia_add(&d->deadline,&d->deadline,&now);
-            d->tcpstate = 0;
-            return 0;
+      if (usable(ip)) {
+        if (dns_rtt_full(ip)) {
+          if (skipped == 16) skipped = d->curserver;
+          continue;
+        }
+	uint16_pack_big(d->query + 2,dns_random(65536));
+
+        if (d->hedgestate == 1) {
+          d->hedgestate = 0;
+          if ((nextserver(d) < 16) && samefamily(ip,d->servers + 4 * nextserver(d))) {
+            r = hedgestart(d,ip);
+            if (r == -1) { dns_transmit_free(d); return -1; }
+            if (r == 1) return 0;
+            continue;
           }
+        }
   
-        socketfree(d);
+        d->s1 = 1 + udptake(ip,d->localip);
+        if (!d->s1) {
+          r = newsocket(d,ip,0);
+          if (r == -1) { dns_transmit_free(d); return -1; }
+          if (r == 1) { socketdrop(d); continue; }
+          if (connectip(d->s1 - 1,ip) == -1) { socketdrop(d); continue; }
+          poolnew(d->s1 - 1,ip,d->localip,0);
+        }
+
+        if (iopause_send(d->s1 - 1,d->query + 2,d->querylen - 2) || (send(d->s1 - 1,d->query + 2,d->querylen - 2,0) == d->querylen - 2)) {
+          sent(d,ip);
+          taia_clock(&d->sent);
+          udpdeadline(d,ip);
+          d->tcpstate = 0;
+          return 0;
+        }
+  
+        socketdrop(d);
       }
     }
 
+    if (skipped < 16) {
+      if (++d->waits > QUEUEMAX) { dns_transmit_free(d); errno = error_again; return -1; }
+      d->curserver = skipped;
+      taia_clock(&d->deadline);
+      waitfor(&d->deadline);
+      d->tcpstate = 6;
+      return 0;
+    }
+
     ++d->udploop;
     d->curserver = 0;
   }
@@ -132,6 +626,13 @@ static int thisudp(struct dns_transmit *d)
   dns_transmit_free(d); return -1;
 }
 
+static int plainudp(struct dns_transmit *d)
+{
+  noedns(d);
+  d->hedgestate = 0;
+  return thisudp(d);
+}
+
 static int firstudp(struct dns_transmit *d)
 {
   d->curserver = 0;
@@ -148,24 +649,34 @@ static int thistcp(struct dns_transmit *d)
 {
   struct taia now;
   const char *ip;
+  int r;
 
   socketfree(d);
   packetfree(d);
 
   for (;d->curserver < 16;++d->curserver) {
     ip = d->servers + 4 * d->curserver;
-    if (byte_diff(ip,4,"\0\0\0\0")) {
-      d->query[2] = dns_random(256);
-      d->query[3] = dns_random(256);
+    if (usable(ip)) {
+      uint16_pack_big(d->query + 2,dns_random(65536));
 
-      d->s1 = 1 + socket_tcp();
-      if (!d->s1) { dns_transmit_free(d); return -1; }
-      if (randombind(d) == -1) { dns_transmit_free(d); return -1; }
-  
-      taia_now(&now);
+      taia_clock(&now);
       taia_uint(&d->deadline,10);
       taia_add(&d->deadline,&d->deadline,&now);
-      if (socket_connect4(d->s1 - 1,ip,53) == 0) {
+
+      d->s1 = 1 + tcptake(ip,d->localip);
+      if (d->s1) {
+        d->pos = 0;
+        d->tcpstate = 2;
+        return 0;
+      }
+
+      r = newsocket(d,ip,1);
+      if (r == -1) { dns_transmit_free(d); return -1; }
+      if (r == 1) { socketdrop(d); continue; }
+      poolnew(d->s1 - 1,ip,d->localip,1);
+  
+      if (connectip(d->s1 - 1,ip) == 0) {
+        d->pos = 0;
         d->tcpstate = 2;
         return 0;
       }
@@ -174,7 +685,7 @@ static int thistcp(struct dns_transmit *d)
         return 0;
       }
   
-      socketfree(d);
+      socketdrop(d);
     }
   }
 
@@ -193,6 +704,16 @@ static int nexttcp(struct dns_transmit *d)
   return thistcp(d);
 }
 
+/* the connection failed; if it was reused, the server may just have closed it */
+static int failtcp(struct dns_transmit *d)
+{
+  if (reused(d)) {
+    socketdrop(d);
+    return thistcp(d);
+  }
+  return nexttcp(d);
+}
+
 int dns_transmit_start(struct dns_transmit *d,const char servers[64],int flagrecursive,const char *q,const char qtype[2],const char localip[4])
 {
   unsigned int len;
@@ -201,21 +722,28 @@ int dns_transmit_start(struct dns_transmit *d,const char servers[64],int flagrec
   errno = error_io;
 
   len = dns_domain_length(q);
-  d->querylen = len + 18;
-  d->query = alloc(d->querylen);
+  d->querylen = len + 18 + 11;
+  d->query = bufget(d->querylen);
   if (!d->query) return -1;
 
-  uint16_pack_big(d->query,len + 16);
-  byte_copy(d->query + 2,12,flagrecursive ? "\0\0\1\0\0\1\0\0\0\0\0\0" : "\0\0\0\0\0\1\0\0\0\0\0\0gcc-bug-workaround");
+  uint16_pack_big(d->query,len + 16 + 11);
+  byte_copy(d->query + 2,12,flagrecursive ? "\0\0\1\0\0\1\0\0\0\0\0\1" : "\0\0\0\0\0\1\0\0\0\0\0\1gcc-bug-workaround");
   byte_copy(d->query + 14,len,q);
   byte_copy(d->query + 14 + len,2,qtype);
   byte_copy(d->query + 16 + len,2,DNS_C_IN);
+  byte_copy(d->query + 18 + len,11,"\0\0\51\0\0\0\0\0\0\0\0");
+  uint16_pack_big(d->query + 21 + len,ednssize);
+  d->flagedns = 1;
+  if (!ednssize) noedns(d);
 
   byte_copy(d->qtype,2,qtype);
   d->servers = servers;
   byte_copy(d->localip,4,localip);
 
   d->udploop = flagrecursive ? 1 : 0;
+  d->hedgestate = hedgems ? 1 : 0;
+  d->waits = 0;
+  d->failed = 0;
 
   if (len + 16 > 512) return firsttcp(d);
   return firstudp(d);
@@ -232,26 +760,54 @@ void dns_transmit_io(struct dns_transmit *d,iopause_fd *x,struct taia *deadline)
     case 1: case 2:
       x->events = IOPAUSE_WRITE;
       break;
+    default:
+      x->events = 0;
   }
 
+  dns_transmit_deadline(d,deadline);
+}
+
+/* shrinks *deadline to when dns_transmit_get() has work without I/O */
+void dns_transmit_deadline(const struct dns_transmit *d,struct taia *deadline)
+{
   if (taia_less(&d->deadline,deadline))
     *deadline = d->deadline;
+  if (d->hedgestate == 2)
+    if (taia_less(&d->hedgetime,deadline))
+      *deadline = d->hedgetime;
 }
 
 int dns_transmit_get(struct dns_transmit *d,const iopause_fd *x,const struct taia *when)
 {
-  char udpbuf[513];
+  char udpbuf[4097];
   unsigned char ch;
   int r;
   int fd;
+  char ip[4];
+  uint16 port;
+  const struct taia *since;
 
   errno = error_io;
   fd = d->s1 - 1;
 
   if (!x->revents) {
+    if (d->hedgestate == 2)
+      if (!taia_less(when,&d->hedgetime)) {
+        hedgesend(d);
+        return 0;
+      }
     if (taia_less(when,&d->deadline)) return 0;
+    if (d->tcpstate == 6) return thisudp(d);
     errno = error_timeout;
-    if (d->tcpstate == 0) return nextudp(d);
+    if (d->tcpstate == 0) {
+      dns_rtt_timeout(d->servers + 4 * d->curserver,elapsed(&d->sent));
+      if (d->hedgestate == 3) {
+        d->curserver = d->hedgeserver;
+        dns_rtt_timeout(d->servers + 4 * d->curserver,elapsed(&d->hedgetime));
+      }
+      d->hedgestate = 0;
+      return nextudp(d);
+    }
     return nexttcp(d);
   }
 
@@ -260,23 +816,52 @@ int dns_transmit_get(struct dns_transmit *d,const iopause_fd *x,const struct tai
 have attempted to send UDP query to each server udploop times
 have sent query to curserver on UDP socket s
 */
-    r = recv(fd,udpbuf,sizeof udpbuf,0);
-    if (r <= 0) {
-      if (errno == error_connrefused) if (d->udploop == 2) return 0;
-      return nextudp(d);
+    if (d->hedgestate >= 2) {
+      r = recvip(d,fd,udpbuf,sizeof udpbuf,ip,&port);
+      if (r == -1) return 0;
+      if (port != 53) return 0;
+      if (r + 1 > sizeof udpbuf) return 0;
+      if (byte_equal(ip,4,d->servers + 4 * d->curserver)) {
+        if (refusededns(d,udpbuf,r)) return plainudp(d);
+        if (irrelevant(d,udpbuf,r)) return 0;
+        since = &d->sent;
+      }
+      else if ((d->hedgestate == 3) && byte_equal(ip,4,d->servers + 4 * d->hedgeserver)) {
+        if (refusededns(d,udpbuf,r)) {
+          d->curserver = d->hedgeserver;
+          return plainudp(d);
+        }
+        if (irrelevant(d,udpbuf,r)) return 0;
+        d->curserver = d->hedgeserver;
+        since = &d->hedgetime;
+      }
+      else
+        return 0;
+      d->hedgestate = 0;
+    }
+    else {
+      r = recv(fd,udpbuf,sizeof udpbuf,0);
+      if (r <= 0) {
+        if (errno == error_connrefused) if (d->udploop == 2) return 0;
+        return nextudp(d);
+      }
+      if (r + 1 > sizeof udpbuf) return 0;
+      if (refusededns(d,udpbuf,r)) return plainudp(d);
+      if (irrelevant(d,udpbuf,r)) return 0;
+      since = &d->sent;
     }
-    if (r + 1 > sizeof udpbuf) return 0;
 
-    if (irrelevant(d,udpbuf,r)) return 0;
+    dns_rtt_answer(d->servers + 4 * d->curserver,elapsed(since));
     if (serverwantstcp(udpbuf,r)) return firsttcp(d);
     if (serverfailed(udpbuf,r)) {
+      d->failed |= 1 << d->curserver;
       if (d->udploop == 2) return 0;
       return nextudp(d);
     }
     socketfree(d);
 
     d->packetlen = r;
-    d->packet = alloc(d->packetlen);
+    d->packet = bufget(d->packetlen);
     if (!d->packet) { dns_transmit_free(d); return -1; }
     byte_copy(d->packet,d->packetlen,udpbuf);
     queryfree(d);
@@ -300,11 +885,11 @@ have connection to curserver on TCP socket s
 have sent pos bytes of query
 */
     r = write(fd,d->query + d->pos,d->querylen - d->pos);
-    if (r <= 0) return nexttcp(d);
+    if (r <= 0) return failtcp(d);
     d->pos += r;
     if (d->pos == d->querylen) {
       struct taia now;
-      taia_now(&now);
+      taia_clock(&now);
       taia_uint(&d->deadline,10);
       taia_add(&d->deadline,&d->deadline,&now);
       d->tcpstate = 3;
@@ -318,7 +903,7 @@ have sent entire query to curserver on TCP socket s
 pos not defined
 */
     r = read(fd,&ch,1);
-    if (r <= 0) return nexttcp(d);
+    if (r <= 0) return failtcp(d);
     d->packetlen = ch;
     d->tcpstate = 4;
     return 0;
@@ -331,12 +916,12 @@ pos not defined
 have received one byte of packet length into packetlen
 */
     r = read(fd,&ch,1);
-    if (r <= 0) return nexttcp(d);
+    if (r <= 0) return failtcp(d);
     d->packetlen <<= 8;
     d->packetlen += ch;
     d->tcpstate = 5;
     d->pos = 0;
-    d->packet = alloc(d->packetlen);
+    d->packet = bufget(d->packetlen);
     if (!d->packet) { dns_transmit_free(d); return -1; }
     return 0;
   }
@@ -349,14 +934,24 @@ packet is allocated
 have received pos bytes of packet
 */
     r = read(fd,d->packet + d->pos,d->packetlen - d->pos);
-    if (r <= 0) return nexttcp(d);
+    if (r <= 0) return failtcp(d);
     d->pos += r;
     if (d->pos < d->packetlen) return 0;
 
-    socketfree(d);
+    if (irrelevant(d,d->packet,d->packetlen))
+      socketdrop(d);
+    else
+      tcpput(d);
+    if (refusededns(d,d->packet,d->packetlen)) {
+      noedns(d);
+      return thistcp(d);
+    }
     if (irrelevant(d,d->packet,d->packetlen)) return nexttcp(d);
     if (serverwantstcp(d->packet,d->packetlen)) return nexttcp(d);
-    if (serverfailed(d->packet,d->packetlen)) return nexttcp(d);
+    if (serverfailed(d->packet,d->packetlen)) {
+      d->failed |= 1 << d->curserver;
+      return nexttcp(d);
+    }
 
     queryfree(d);
     return 1;
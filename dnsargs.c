@@ -0,0 +1,122 @@
+#include "buffer.h"
+#include "strerr.h"
+#include "alloc.h"
+#include "byte.h"
+#include "taia.h"
+#include "iopause.h"
+#include "error.h"
+#include "dns.h"
+#include "dnsargs.h"
+
+/*
+Looks up the arguments of dnsip, dnsname, dnsmx and dnstxt at once,
+at most n at a time, through dns_async_start(). query() turns an
+argument into a name and type to look up, returning 1, or answers it
+in out itself, returning 0, or fails, returning -1; parse() turns the
+answer into out; and print() writes it. Answers come in any order but
+are printed in the order of the arguments; the first that fails ends
+the program, as with the lookups one after another before.
+*/
+
+struct arg {
+  stralloc out;
+  int result; /* 0: in flight or waiting; 1: answered; -1: failed */
+  int error;
+} ;
+
+static void nomem(const char *fatal)
+{
+  strerr_die2x(111,fatal,"out of memory");
+}
+
+void dnsargs(const struct dnsargs *d,char **argv,unsigned int n)
+{
+  struct dns_async a;
+  struct taia stamp;
+  struct taia deadline;
+  struct arg *x;
+  iopause_fd *io;
+  unsigned int iolen;
+  unsigned int num;
+  unsigned int next; /* next argument to start */
+  unsigned int done; /* arguments printed */
+  unsigned int active;
+  char *q = 0;
+  char qtype[2];
+  char *packet;
+  unsigned int len;
+  void *data;
+  struct arg *y;
+  int r;
+
+  for (num = 0;argv[num];++num) ;
+  if (!num) return;
+  if (n > num) n = num;
+  if (!n) n = 1;
+
+  x = (struct arg *) alloc(num * sizeof(struct arg));
+  if (!x) nomem(d->fatal);
+  byte_zero(x,num * sizeof(struct arg));
+  if (dns_async_init(&a,n) == -1) nomem(d->fatal);
+  io = (iopause_fd *) alloc(n * sizeof(iopause_fd));
+  if (!io) nomem(d->fatal);
+
+  next = done = active = 0;
+  while (done < num) {
+    while ((next < num) && (active < n)) {
+      y = x + next;
+      r = d->query(argv[next],&y->out,&q,qtype);
+      if (r == 0)
+        y->result = 1;
+      else if ((r == -1) || (dns_async_start(&a,q,qtype,y) == -1)) {
+        y->result = -1;
+        y->error = errno;
+      }
+      else
+        ++active;
+      ++next;
+    }
+
+    while ((done < num) && x[done].result) {
+      y = x + done;
+      if (y->result == -1) {
+        errno = y->error;
+        strerr_die4sys(111,d->fatal,d->what,argv[done],": ");
+      }
+      d->print(argv[done],&y->out);
+      if (y->out.s) alloc_free(y->out.s);
+      y->out.s = 0;
+      y->out.len = y->out.a = 0;
+      ++done;
+    }
+    if (!active) continue;
+
+    taia_clock(&stamp);
+    taia_uint(&deadline,120);
+    taia_add(&deadline,&deadline,&stamp);
+    iolen = dns_async_io(&a,io,&deadline);
+    iopause(io,iolen,&deadline,&stamp);
+    dns_async_get(&a,&stamp);
+
+    while ((r = dns_async_reap(&a,&data,&packet,&len))) {
+      y = (struct arg *) data;
+      --active;
+      if (r == -1) {
+        y->result = -1;
+        y->error = errno;
+        continue;
+      }
+      if (d->parse(&y->out,packet,len) == -1) {
+        y->result = -1;
+        y->error = errno;
+      }
+      else
+        y->result = 1;
+      alloc_free(packet);
+    }
+  }
+
+  dns_domain_free(&q);
+  alloc_free((char *) io);
+  alloc_free((char *) x);
+}
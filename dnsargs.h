@@ -0,0 +1,16 @@
+#ifndef DNSARGS_H
+#define DNSARGS_H
+
+#include "stralloc.h"
+
+struct dnsargs {
+  const char *fatal;
+  const char *what; /* "unable to find IP address for " */
+  int (*query)(const char *,stralloc *,char **,char *);
+  int (*parse)(stralloc *,const char *,unsigned int);
+  void (*print)(const char *,stralloc *);
+} ;
+
+extern void dnsargs(const struct dnsargs *,char **,unsigned int);
+
+#endif
@@ -1,3 +1,9 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
 #include <unistd.h>
 #include "env.h"
 #include "exit.h"
@@ -5,7 +11,9 @@
 #include "strerr.h"
 #include "error.h"
 #include "ip4.h"
+#include "ip6.h"
 #include "uint16.h"
+#include "uint32.h"
 #include "uint64.h"
 #include "socket.h"
 #include "dns.h"
@@ -20,10 +28,24 @@
 #include "cache.h"
 #include "ndelay.h"
 #include "log.h"
+#include "logbuf.h"
+#include "logwait.h"
+#include "metrics.h"
 #include "okclient.h"
 #include "droproot.h"
-
-static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qclass[2],char id[2])
+#include "handoff.h"
+#include "overload.h"
+#include "siphash.h"
+#include "open.h"
+#include "buffer.h"
+#include "openreadclose.h"
+#include "sig.h"
+#include "stralloc.h"
+#include "timer.h"
+#include "cpupin.h"
+#include "profile.h"
+
+static unsigned int packetquery(char *buf,unsigned int len,char q[DNS_NAME],char qtype[2],char qclass[2],char id[2])
 {
   unsigned int pos;
   char header[12];
@@ -36,342 +58,1883 @@ static int packetquery(char *buf,unsigned int len,char **q,char qtype[2],char qc
   if (header[2] & 2) return 0;
   if (byte_diff(header + 4,2,"\0\1")) return 0;
 
-  pos = dns_packet_getname(buf,len,pos,q); if (!pos) return 0;
+  pos = dns_packet_getnamebuf(buf,len,pos,q); if (!pos) return 0;
   pos = dns_packet_copy(buf,len,pos,qtype,2); if (!pos) return 0;
   pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) return 0;
-  if (byte_diff(qclass,2,DNS_C_IN) && byte_diff(qclass,2,DNS_C_ANY)) return 0;
+  if (byte_diff(qclass,2,DNS_C_IN) && byte_diff(qclass,2,DNS_C_ANY))
+    if (byte_diff(qclass,2,DNS_C_CH)) return 0;
 
   byte_copy(id,2,header);
-  return 1;
+  return pos;
 }
 
 
 static char myipoutgoing[4];
 static char myipincoming[4];
-static char buf[1024];
 uint64 numqueries = 0;
 
+#define LATENCYBUCKETS 16
+static uint64 latency[LATENCYBUCKETS]; /* bucket i: under 2^i ms; last: the rest */
+
+static void latency_add(struct taia *start)
+{
+  struct taia now;
+  double d;
+  int i;
+
+  metrics_since(METRIC_LATENCY,start);
+  taia_clock(&now);
+  if (taia_less(&now,start)) { ++latency[0]; return; }
+  taia_sub(&now,&now,start);
+  d = taia_approx(&now) * 1000.0;
+  for (i = 0;i < LATENCYBUCKETS - 1;++i)
+    if (d < (double) (1 << i)) break;
+  ++latency[i];
+}
+
+/*
+Each pass of the event loop in doit() is timed in phases: setting up
+the io array, flushing the log, waiting in iopause(), handling what
+woke it up, and taking new queries; busy is the whole pass but the
+wait, which is how late a query arriving just after the wait can be
+seen. Each pass also samples how full the slots are and how many
+queries were evicted for lack of one. stats() logs and clears the
+histograms; the busy and wait times and the occupancy also go into
+the metrics, as running totals.
+*/
+
+#define PHASE_SETUP 0
+#define PHASE_FLUSH 1
+#define PHASE_WAIT 2
+#define PHASE_GET 3
+#define PHASE_NEW 4
+#define PHASE_BUSY 5
+#define PHASES 6
+static const char *phasename[PHASES] = {
+  "setup", "flush", "wait", "get", "new", "busy"
+} ;
+
+#define LAGBUCKETS 20
+static uint64 lag[PHASES][LAGBUCKETS]; /* bucket i: under 2^i usec; last: the rest */
+#define OCCUPANCYBUCKETS 11
+static uint64 occupancy[2][OCCUPANCYBUCKETS]; /* bucket i: i tenths of the slots in use */
+#define EVICTBUCKETS 8
+static uint64 evicted[2][EVICTBUCKETS]; /* bucket 0: none; i: under 2^i */
+static uint64 evictmark[2];
+
+static struct taia lapstart;
+static double busy;
+
+static unsigned int bucket(double d,unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0;i < n - 1;++i)
+    if (d < (double) (1 << i)) break;
+  return i;
+}
+
+/* ends phase p, which began at the end of the last one */
+static void lap(int p)
+{
+  struct taia now;
+  struct taia t;
+  double d;
+  unsigned int i;
+
+  taia_now(&now);
+  d = 0;
+  if (!taia_less(&now,&lapstart)) {
+    taia_sub(&t,&now,&lapstart);
+    d = taia_approx(&t) * 1000000.0;
+  }
+  lapstart = now;
+  i = bucket(d,LAGBUCKETS);
+  ++lag[p][i];
+  if (p == PHASE_WAIT)
+    ++metric[METRIC_LOOPWAIT + i];
+  else
+    busy += d;
+}
+
+
+/* no events: for query_get() on a timer, and for a slot started since
+the last iopause() */
+static iopause_fd noio;
+
+/* timer ids: slot number times 8, plus which kind of timer */
+#define TIMER_UDP 0
+#define TIMER_TCPQUERY 1
+#define TIMER_TCP 2
+#define TIMER_REFRESH 3
+#define TIMER_UDPSTALE 4
+#define TIMER_TCPSTALE 5
+
+/*
+Serve-stale: with $STALETIMEOUT set, a client whose query has not
+finished that many milliseconds after it came in, or has failed, gets
+an answer built from cache entries up to $STALEMAX seconds past
+expiry, with TTL 30. The query goes on and refreshes the cache; its
+real answer is then not sent.
+*/
+static unsigned long staletimeout = 0;
+
+static void stale_arm(struct timer *x,struct taia *start)
+{
+  struct taia when;
+
+  if (!staletimeout) return;
+  taia_uint(&when,staletimeout / 1000);
+  when.nano = (staletimeout % 1000) * 1000000;
+  taia_add(&when,&when,start);
+  timer_set(x,&when);
+}
+
+/* the answer in response is SERVFAIL */
+static int servfail(void)
+{
+  return (response_len > 3) && ((response[3] & 15) == 2);
+}
+
+#define MAXREFRESH 20
+static struct refresh {
+  struct query q;
+  iopause_fd *io;
+  int active;
+  int prime;
+} f[MAXREFRESH];
+int factive = 0;
+
+void f_start(struct query *z)
+{
+  int j;
+
+  if (!z->flagdue) return;
+  z->flagdue = 0;
+  for (j = 0;j < MAXREFRESH;++j)
+    if (!f[j].active) break;
+  if (j == MAXREFRESH) return;
+  if (query_refresh(&f[j].q,z->qname,z->type,z->class,z->localip) == 0) {
+    f[j].active = 1; ++factive;
+    f[j].io = &noio;
+  }
+}
+
+/*
+Priming: with $PRIME set, a worker starts by asking for the root NS
+set, the NS sets of the TLDs in $PRIMETLDS (by default the biggest
+ones), and type A for each name in the file $PRIME names, one name
+per line; empty lines and lines starting with # are skipped. Up to
+PRIMESLOTS of these go on at once in refresh slots, while clients are
+served as usual. When the last one is done, the log says how many
+there were and how long they took. With $CACHESHM, worker 0 alone
+primes the cache they all share.
+*/
+
+#define PRIMESLOTS (MAXREFRESH / 2)
+#define PRIMETLDS "com net org de uk cn jp ru br fr it nl au in info io"
+static stralloc prime = {0}; /* for each: type, name */
+static unsigned int primepos = 0;
+static unsigned int primeactive = 0;
+static unsigned int primenum = 0;
+static int flagprime = 0;
+static struct taia primestart;
+
+static void f_done(int j)
+{
+  f[j].active = 0; --factive;
+  if (f[j].prime) { f[j].prime = 0; --primeactive; }
+}
+
+static void prime_feed(void)
+{
+  struct taia now;
+  char type[2];
+  char class[2];
+  char *dn;
+  int j;
+  int r;
+
+  if (!flagprime) return;
+  byte_copy(class,2,DNS_C_IN);
+  while ((primepos < prime.len) && (primeactive < PRIMESLOTS)) {
+    for (j = 0;j < MAXREFRESH;++j)
+      if (!f[j].active) break;
+    if (j == MAXREFRESH) break;
+    byte_copy(type,2,prime.s + primepos);
+    dn = prime.s + primepos + 2;
+    primepos += 2 + dns_domain_length(dn);
+    ++primenum;
+    r = query_refresh(&f[j].q,dn,type,class,myipoutgoing);
+    if (r == 0) {
+      f[j].active = 1; ++factive;
+      f[j].prime = 1; ++primeactive;
+      f[j].io = &noio;
+    }
+  }
+  if ((primepos < prime.len) || primeactive) return;
+
+  flagprime = 0;
+  taia_clock(&now);
+  taia_sub(&now,&now,&primestart);
+  log_primed(primenum,(unsigned long) (taia_approx(&now) * 1000.0));
+}
+
+/*
+With $GLUELESS set to n, the server names a referral gives no
+addresses for, up to n waiting at once, are looked up, type A, in
+free refresh slots, all at the same time, each once, while the query
+that got the referral goes on with the first; see query_glueless().
+*/
+
+static void glueless_feed(void)
+{
+  char type[2];
+  char class[2];
+  char *dn;
+  int j;
+  int k;
+
+  byte_copy(type,2,DNS_T_A);
+  byte_copy(class,2,DNS_C_IN);
+  for (;;) {
+    for (j = 0;j < MAXREFRESH;++j)
+      if (!f[j].active) break;
+    if (j == MAXREFRESH) return;
+    dn = query_nextglueless();
+    if (!dn) return;
+    for (k = 0;k < MAXREFRESH;++k)
+      if (f[k].active && f[k].q.qname && dns_domain_equal(f[k].q.qname,dn))
+        break;
+    if (k < MAXREFRESH) continue; /* already being looked up */
+    log_prefetch(dn,type);
+    if (query_start(&f[j].q,dn,type,class,myipoutgoing) == 0) {
+      f[j].active = 1; ++factive;
+      f[j].io = &noio;
+    }
+  }
+}
+
+/*
+With $FORWARDONLY, every PROBEINTERVAL seconds each forwarder that
+dns_rtt has marked down, and that has no probe outstanding, is asked
+for the root NS set. An answer brings it back into use at once,
+before any client query has to find out; a timeout keeps it down.
+A probe makes one attempt only.
+*/
+
+#define PROBEINTERVAL 2
+static struct probe {
+  struct dns_transmit dt;
+  char servers[64]; /* just the one forwarder */
+  iopause_fd *io;
+  int active;
+} probe[16];
+static int flagforward = 0;
+static struct taia nextprobe;
+
+static void probe_start(void)
+{
+  char servers[64];
+  char root[1];
+  int j;
+  int k;
+
+  root[0] = 0;
+  if (!roots(servers,root)) return;
+  for (j = 0;j < 16;++j) {
+    if (probe[j].active) continue;
+    if (byte_equal(servers + 4 * j,4,"\0\0\0\0")) continue;
+    if (!dns_rtt_down(servers + 4 * j)) continue;
+    for (k = 0;k < 16;++k)
+      if (probe[k].active && byte_equal(probe[k].servers,4,servers + 4 * j)) break;
+    if (k < 16) continue; /* listed twice */
+    byte_zero(probe[j].servers,64);
+    byte_copy(probe[j].servers,4,servers + 4 * j);
+    if (dns_transmit_start(&probe[j].dt,probe[j].servers,1,root,DNS_T_NS,myipoutgoing) == 0)
+      probe[j].active = 1;
+  }
+}
+
 
 static int udp53;
 
-#define MAXUDP 200
+#define MAXUDP 200 /* default for $MAXUDP */
+/*
+Each client /24 has a load entry: its queries in progress in u, and a
+count of queries started this second. With $CLIENTMAX, a /24 gets at
+most that many UDP queries in progress; with $CLIENTRATE, at most that
+many new UDP queries a second. Queries over either are dropped before
+query_start. When every slot in u is busy, a new query evicts the
+oldest of the EVICTSCAN oldest queries whose client has more in
+progress than its own; if there is none, the new query is dropped.
+
+Entries live in an open-addressing table at least four times the size
+of u, probed at most LOADPROBES deep; an entry with nothing in
+progress may be taken over by another /24.
+*/
+
+#define LOADPROBES 16
+#define EVICTSCAN 64
+
+struct load {
+  uint32 prefix; /* the /24 in the high octets, plus 1; 0: unused */
+  unsigned long inflight;
+  uint32 when; /* second of the count in started */
+  unsigned long started;
+} ;
+
+static struct load *loads;
+static unsigned int numloads; /* power of 2 */
+static unsigned long clientmax = 0; /* 0: no limit */
+static unsigned long clientrate = 0; /* 0: no limit */
+
+static struct load *load_find(const char ip[4])
+{
+  struct load *l;
+  struct load *reuse;
+  uint32 prefix;
+  unsigned int h;
+  unsigned int i;
+
+  uint32_unpack_big(ip,&prefix);
+  prefix = (prefix & 0xffffff00) + 1;
+  h = (prefix * 0x9e3779b1) >> 8;
+
+  reuse = 0;
+  for (i = 0;i < LOADPROBES;++i) {
+    l = loads + ((h + i) & (numloads - 1));
+    if (l->prefix == prefix) return l;
+    if (!l->prefix) { if (!reuse) reuse = l; break; }
+    if (!reuse && !l->inflight) reuse = l;
+  }
+  if (!reuse) return loads + (h & (numloads - 1)); /* shared, rarely */
+  reuse->prefix = prefix;
+  reuse->inflight = 0;
+  reuse->when = 0;
+  reuse->started = 0;
+  return reuse;
+}
+
+static int load_admit(struct load *l,struct taia *now)
+{
+  if (clientmax && (l->inflight >= clientmax)) return 0;
+  if (clientrate) {
+    if (l->when != (uint32) now->sec.x) {
+      l->when = now->sec.x;
+      l->started = 0;
+    }
+    if (l->started >= clientrate) return 0;
+    ++l->started;
+  }
+  return 1;
+}
+
 static struct udpclient {
   struct query q;
+  struct load *load; /* client's entry in loads, if active */
   struct taia start;
+  struct timer stale;
+  int flagstale; /* answered from stale cache entries */
   uint64 active; /* query number, if active; otherwise 0 */
   iopause_fd *io;
   char ip[4];
   uint16 port;
   char id[2];
-} u[MAXUDP];
+  unsigned int udpsize; /* 0, or client's EDNS0 payload size */
+  uint32 duphash;
+  int dupnext; /* next active slot in the same udup chain */
+  int prev; /* previous active slot, if active */
+  int next; /* next active slot, if active; otherwise next free slot */
+} *u;
+static unsigned long maxudp = MAXUDP;
 int uactive = 0;
 
+/*
+Active slots are on a doubly linked list from uhead (oldest) to utail
+(newest); they are appended when they become active, so the list is
+ordered by start time. Inactive slots are on a free list from ufree.
+*/
+static int uhead = -1;
+static int utail = -1;
+static int ufree = -1;
+
+/*
+A client that hears nothing for a second or so asks again, from the
+same port with the same ID. While the first query is in progress, the
+retransmission is absorbed by its slot, which will answer it, instead
+of starting a resolution of its own and perhaps evicting some other
+client's. Active slots are chained from udup by a keyed hash of
+client address, port, ID, type, class and name.
+*/
+static int *udup; /* first active slot of each chain, or -1 */
+static unsigned int numudup; /* power of 2 */
+static char dupkey[16];
+
+static uint32 u_duphash(const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char qclass[2])
+{
+  char buf[12 + 255];
+  unsigned int len;
+
+  byte_copy(buf,4,ip);
+  uint16_pack_big(buf + 4,port);
+  byte_copy(buf + 6,2,id);
+  byte_copy(buf + 8,2,qtype);
+  byte_copy(buf + 10,2,qclass);
+  len = dns_domain_length(q);
+  byte_copy(buf + 12,len,q);
+  return siphash(dupkey,buf,12 + len);
+}
+
+/* active slot asking the same as a retransmission would, or -1 */
+static int u_dupfind(uint32 h,const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char qclass[2])
+{
+  int j;
+
+  for (j = udup[h & (numudup - 1)];j != -1;j = u[j].dupnext)
+    if ((u[j].duphash == h) && (u[j].port == port)
+        && byte_equal(u[j].ip,4,ip) && byte_equal(u[j].id,2,id)
+        && byte_equal(u[j].q.type,2,qtype) && byte_equal(u[j].q.class,2,qclass)
+        && dns_domain_equal(u[j].q.qname,q))
+      return j;
+  return -1;
+}
+
+static void u_dupunlink(int j)
+{
+  int *p;
+
+  for (p = udup + (u[j].duphash & (numudup - 1));*p != -1;p = &u[*p].dupnext)
+    if (*p == j) { *p = u[j].dupnext; return; }
+}
+
+static void u_init(void)
+{
+  int j;
+
+  for (j = 0;j < numudup;++j) udup[j] = -1;
+  for (j = maxudp - 1;j >= 0;--j) {
+    u[j].q.timer.id = 8 * j + TIMER_UDP;
+    u[j].stale.id = 8 * j + TIMER_UDPSTALE;
+    u[j].next = ufree;
+    ufree = j;
+  }
+}
+
+static void u_activate(int j)
+{
+  int *p;
+
+  p = udup + (u[j].duphash & (numudup - 1));
+  u[j].dupnext = *p;
+  *p = j;
+  ufree = u[j].next;
+  u[j].prev = utail;
+  u[j].next = -1;
+  if (utail == -1) uhead = j; else u[utail].next = j;
+  utail = j;
+}
+
+static void u_deactivate(int j)
+{
+  --u[j].load->inflight;
+  u_dupunlink(j);
+  if (u[j].prev == -1) uhead = u[j].next; else u[u[j].prev].next = u[j].next;
+  if (u[j].next == -1) utail = u[j].prev; else u[u[j].next].prev = u[j].prev;
+  u[j].next = ufree;
+  ufree = j;
+}
+
+void slow(struct query *z,uint64 *qnum)
+{
+  uint32 usec;
+  unsigned int i;
+
+  if (!query_slow(z,&usec)) return;
+  log_slow(qnum,usec);
+  for (i = 0;i < z->numtrace;++i)
+    log_slowevent(z->trace[i].what,z->trace[i].level,z->trace[i].usec,z->trace[i].ip,z->trace[i].n);
+  log_slowdone(z->tracelost);
+}
+
+static void u_stale(int);
+
 void u_drop(int j)
 {
   if (!u[j].active) return;
+  u_stale(j);
+  timer_clear(&u[j].stale);
+  slow(&u[j].q,&u[j].active);
   log_querydrop(&u[j].active);
+  ++metric[METRIC_DROPPED];
+  query_forget(&u[j].q);
   u[j].active = 0; --uactive;
+  u_deactivate(j);
+}
+
+#define EDNSMAX 4096
+static unsigned int ednssize = 0; /* 0: no EDNS0 for clients */
+
+#define UDPBATCH 32
+static char inbuf[UDPBATCH][1024];
+static char outbuf[UDPBATCH][EDNSMAX];
+static struct socket_dgram in[UDPBATCH];
+static struct socket_dgram out[UDPBATCH];
+static int outlen = 0;
+
+void u_flush(void)
+{
+  PROFILE_ENTER(PROFILE_SEND)
+
+  socket_send4_many(udp53,out,outlen);
+  outlen = 0;
+  PROFILE_LEAVE
+}
+
+void u_queue(char ip[4],uint16 port)
+{
+  struct socket_dgram *d;
+
+  if (outlen == UDPBATCH) u_flush();
+  d = out + outlen++;
+  d->buf = outbuf[outlen - 1];
+  byte_copy(d->buf,response_len,response);
+  d->len = response_len;
+  byte_copy(d->ip,4,ip);
+  d->port = port;
+}
+
+static void u_reply(char ip[4],uint16 port,char id[2],unsigned int udpsize)
+{
+  PROFILE_ENTER(PROFILE_RESPONSE)
+
+  response_id(id);
+  if (udpsize) {
+    if (response_len > udpsize - 11) response_tc();
+    response_opt(ednssize,0);
+  }
+  else
+    if (response_len > 512) response_tc();
+  u_queue(ip,port);
+  ++metric[METRIC_ANSWERS];
+  metrics_rcode(response);
+  PROFILE_LEAVE
+}
+
+static void u_send(int j)
+{
+  u_reply(u[j].ip,u[j].port,u[j].id,u[j].udpsize);
+  latency_add(&u[j].start);
+}
+
+static void u_stale(int j)
+{
+  if (!staletimeout || !u[j].active || u[j].flagstale) return;
+  if (!query_stale(&u[j].q)) return;
+  u[j].flagstale = 1;
+  ++metric[METRIC_STALE];
+  log_stale(&u[j].active,response_len);
+  u_send(j);
 }
 
 void u_respond(int j)
 {
   if (!u[j].active) return;
-  response_id(u[j].id);
-  if (response_len > 512) response_tc();
-  socket_send4(udp53,response,response_len,u[j].ip,u[j].port);
+  if (servfail()) u_stale(j);
+  if (!u[j].flagstale) u_send(j);
+  timer_clear(&u[j].stale);
+  slow(&u[j].q,&u[j].active);
   log_querydone(&u[j].active,response_len);
   u[j].active = 0; --uactive;
+  u_deactivate(j);
+  f_start(&u[j].q);
 }
 
-void u_new(void)
+/*
+A query the cache answers is answered at once, without a slot in u,
+so hits stay fast however many misses are waiting for slots. Only
+the rest are subject to the per-client limits and take a slot. With
+$OVERLOAD, while queries queue up faster than they are read, the rest
+are dropped, so the cache keeps answering what it can.
+*/
+static struct query hit;
+
+static void u_one(struct socket_dgram *d,struct taia *now)
 {
   int j;
-  int i;
   struct udpclient *x;
-  int len;
-  static char *q = 0;
+  struct load *l;
+  char q[DNS_NAME];
   char qtype[2];
   char qclass[2];
+  char id[2];
+  unsigned int pos;
+  unsigned int udpsize;
+  unsigned int n;
+  uint64 qnum;
+  uint32 h;
+  int r;
 
-  for (j = 0;j < MAXUDP;++j)
-    if (!u[j].active)
-      break;
+  if (d->len >= sizeof inbuf[0]) return;
+
+  if (d->port < 1024) if (d->port != 53) return;
+  if (!okclient(d->ip)) return;
+
+  profile_phase = PROFILE_PARSE;
+  pos = packetquery(d->buf,d->len,q,qtype,qclass,id);
+  udpsize = 0;
+  r = 0;
+  if (pos && ednssize)
+    r = dns_packet_edns(d->buf,d->len,pos,&udpsize);
+  profile_phase = PROFILE_OTHER;
+  if (!pos) return;
+  if (r == -1) {
+    if (!response_query(q,qtype,qclass)) return;
+    response_id(id);
+    response_opt(ednssize,1);
+    u_queue(d->ip,d->port);
+    return;
+  }
+  if (udpsize > ednssize) udpsize = ednssize;
 
-  if (j >= MAXUDP) {
-    j = 0;
-    for (i = 1;i < MAXUDP;++i)
-      if (taia_less(&u[i].start,&u[j].start))
-	j = i;
-    errno = error_timeout;
-    u_drop(j);
+  if (byte_equal(qclass,2,DNS_C_CH)) {
+    if (!metrics_answer(q,qtype)) return;
+    response_id(id);
+    if (response_len > (udpsize ? udpsize : 512)) response_tc();
+    u_queue(d->ip,d->port);
+    return;
   }
 
-  x = u + j;
-  taia_now(&x->start);
+  qnum = ++numqueries;
+  ++metric[METRIC_QUERIES];
+  log_for(&qnum);
+  log_query(&qnum,d->ip,d->port,id,q,qtype);
+
+  if (query_cached(&hit,q,qtype,qclass,myipoutgoing)) {
+    u_reply(d->ip,d->port,id,udpsize);
+    latency_add(now);
+    log_querydone(&qnum,response_len);
+    f_start(&hit);
+    return;
+  }
 
-  len = socket_recv4(udp53,buf,sizeof buf,x->ip,&x->port);
-  if (len == -1) return;
-  if (len >= sizeof buf) return;
-  if (x->port < 1024) if (x->port != 53) return;
-  if (!okclient(x->ip)) return;
+  h = u_duphash(d->ip,d->port,id,q,qtype,qclass);
+  j = u_dupfind(h,d->ip,d->port,id,q,qtype,qclass);
+  if (j != -1) {
+    log_queryretry(&qnum,&u[j].active);
+    ++metric[METRIC_RETRANSMITS];
+    return;
+  }
 
-  if (!packetquery(buf,len,&q,qtype,qclass,x->id)) return;
+  if (overload) {
+    errno = error_again;
+    log_querydrop(&qnum);
+    ++metric[METRIC_DROPPED];
+    ++metric[METRIC_SHED];
+    return;
+  }
 
-  x->active = ++numqueries; ++uactive;
-  log_query(&x->active,x->ip,x->port,x->id,q,qtype);
-  switch(query_start(&x->q,q,qtype,qclass,myipoutgoing)) {
+  l = load_find(d->ip);
+  if (!load_admit(l,now)) {
+    errno = error_again;
+    log_querydrop(&qnum);
+    ++metric[METRIC_DROPPED];
+    ++metric[METRIC_CLIENTLIMITED];
+    return;
+  }
+
+  if (ufree == -1) {
+    n = 0;
+    for (j = uhead;(j != -1) && (n < EVICTSCAN);j = u[j].next,++n)
+      if (u[j].load->inflight > l->inflight) break;
+    if ((j == -1) || (n == EVICTSCAN)) {
+      errno = error_timeout;
+      log_querydrop(&qnum);
+      ++metric[METRIC_DROPPED];
+      ++metric[METRIC_CLIENTLIMITED];
+      return;
+    }
+    errno = error_timeout;
+    u_drop(j);
+    ++metric[METRIC_UDPEVICTED];
+    log_for(&qnum);
+  }
+
+  j = ufree;
+  x = u + j;
+  x->start = *now;
+  byte_copy(x->ip,4,d->ip);
+  x->port = d->port;
+  byte_copy(x->id,2,id);
+  x->udpsize = udpsize;
+  x->duphash = h;
+  x->active = qnum; ++uactive;
+  x->io = &noio;
+  x->flagstale = 0;
+  x->load = l; ++l->inflight;
+  u_activate(j);
+  x->q.flagfrompeer = query_ispeer(x->ip);
+  switch(query_resume(&x->q,&hit,q,qtype,qclass,myipoutgoing)) {
     case -1:
       u_drop(j);
       return;
     case 1:
       u_respond(j);
+      return;
   }
+  stale_arm(&x->stale,now);
+}
+
+static struct overload udpload;
+
+void u_new(void)
+{
+  struct taia now;
+  int n;
+  int i;
+
+  for (i = 0;i < UDPBATCH;++i) in[i].buf = inbuf[i];
+  profile_phase = PROFILE_RECEIVE;
+  n = socket_recv4_many(udp53,in,UDPBATCH,sizeof inbuf[0]);
+  profile_phase = PROFILE_OTHER;
+  overload_read(&udpload,udp53,n,UDPBATCH);
+  if (n <= 0) return;
+  taia_clock(&now);
+  for (i = 0;i < n;++i)
+    u_one(in + i,&now);
+  profile_phase = PROFILE_OTHER;
 }
 
 
 static int tcp53;
 
-#define MAXTCP 20
+#define MAXTCP 20 /* default for $MAXTCP */
+#define TCPQUERIES 2 /* query slots per connection slot, for $MAXTCPQUERY */
+#define TCPTIMEOUT 10 /* default for $TCPTIMEOUT, in seconds */
+#define TCPPIPELINE 8 /* queries in progress per connection */
+#define TCPBUF 1026 /* length prefix plus the largest query u_one accepts */
+
 struct tcpclient {
+  struct timer timeout; /* closes the connection if it is idle then */
+  int active; /* 1 if open; otherwise 0 */
+  iopause_fd *io;
+  char ip[4]; /* send responses to this address */
+  uint16 port; /* send responses to this port */
+  int tcp; /* open TCP socket, if active */
+  unsigned int pending; /* queries in progress */
+  char buf[TCPBUF]; /* bytes read but not yet started as queries */
+  unsigned int len;
+  stralloc out; /* responses not yet written */
+  unsigned int pos; /* bytes of out written */
+  int prev; /* previous active slot, if active */
+  int next; /* next active slot, if active; otherwise next free slot */
+} *t;
+static unsigned long maxtcp = MAXTCP;
+static unsigned long tcptimeout = TCPTIMEOUT;
+int tactive = 0;
+
+/* same lists as for u */
+static int thead = -1;
+static int ttail = -1;
+static int tfree = -1;
+
+static struct tcpquery {
   struct query q;
   struct taia start;
-  struct taia timeout;
-  uint64 active; /* query number or 1, if active; otherwise 0 */
+  struct timer stale;
+  int flagstale; /* answered from stale cache entries */
+  uint64 active; /* query number, if active; otherwise 0 */
   iopause_fd *io;
-  char ip[4]; /* send response to this address */
-  uint16 port; /* send response to this port */
   char id[2];
-  int tcp; /* open TCP socket, if active */
-  int state;
-  char *buf; /* 0, or dynamically allocated of length len */
-  unsigned int len;
+  int edns; /* 1 if the query had OPT, 2 if it also asked for keepalive */
+  int client; /* slot in t, if active */
+  int prev; /* previous active slot, if active */
+  int next; /* next active slot, if active; otherwise next free slot */
+} *tq;
+static unsigned long maxtcpquery;
+
+/* same lists as for u */
+static int tqhead = -1;
+static int tqtail = -1;
+static int tqfree = -1;
+
+static void t_init(void)
+{
+  int j;
+
+  for (j = maxtcp - 1;j >= 0;--j) {
+    t[j].timeout.id = 8 * j + TIMER_TCP;
+    t[j].next = tfree;
+    tfree = j;
+  }
+  for (j = maxtcpquery - 1;j >= 0;--j) {
+    tq[j].q.timer.id = 8 * j + TIMER_TCPQUERY;
+    tq[j].stale.id = 8 * j + TIMER_TCPSTALE;
+    tq[j].next = tqfree;
+    tqfree = j;
+  }
+}
+
+static void t_activate(int j)
+{
+  tfree = t[j].next;
+  t[j].prev = ttail;
+  t[j].next = -1;
+  if (ttail == -1) thead = j; else t[ttail].next = j;
+  ttail = j;
+}
+
+static void t_deactivate(int j)
+{
+  if (t[j].prev == -1) thead = t[j].next; else t[t[j].prev].next = t[j].next;
+  if (t[j].next == -1) ttail = t[j].prev; else t[t[j].next].prev = t[j].prev;
+  t[j].next = tfree;
+  tfree = j;
+}
+
+/*
+A connection reads as much as it can into buf and starts every
+complete query there, up to TCPPIPELINE at once. Each query answers
+on its own; responses go onto out in the order they finish.
+
+A connection closes once it has been idle for $TCPTIMEOUT seconds.
+Every read or write moves it to the end of the active list, so the
+head is the connection idle longest, which t_new() closes when every
+slot is busy. A client that asks with edns-tcp-keepalive (RFC 7828)
+is told the timeout, or 0, asking it to close, once more than 7/8 of
+the slots are busy. An idle connection holds no query slot; those
+are $MAXTCPQUERY, shared by all connections.
+*/
+
+void t_timeout(int j)
+{
+  struct taia now;
+  struct taia when;
+  if (!t[j].active) return;
+  taia_clock(&now);
+  taia_uint(&when,tcptimeout);
+  taia_add(&when,&when,&now);
+  timer_set(&t[j].timeout,&when);
+  if (j == ttail) return;
+  if (t[j].prev == -1) thead = t[j].next; else t[t[j].prev].next = t[j].next;
+  t[t[j].next].prev = t[j].prev;
+  t[j].prev = ttail;
+  t[j].next = -1;
+  t[ttail].next = j;
+  ttail = j;
+}
+
+static void tq_activate(int k)
+{
+  tqfree = tq[k].next;
+  tq[k].prev = tqtail;
+  tq[k].next = -1;
+  if (tqtail == -1) tqhead = k; else tq[tqtail].next = k;
+  tqtail = k;
+}
+
+static void tq_free(int k)
+{
+  struct tcpclient *x;
+
+  tq[k].active = 0;
+  timer_clear(&tq[k].stale);
+  x = t + tq[k].client;
+  --x->pending;
+  if (!x->pending && !x->out.len && !x->timeout.pos)
+    timer_set(&x->timeout,&x->timeout.when); /* went off while busy */
+  if (tq[k].prev == -1) tqhead = tq[k].next; else tq[tq[k].prev].next = tq[k].next;
+  if (tq[k].next == -1) tqtail = tq[k].prev; else tq[tq[k].next].prev = tq[k].prev;
+  tq[k].next = tqfree;
+  tqfree = k;
+}
+
+void t_close(int j)
+{
+  int k;
+  int knext;
+
+  if (!t[j].active) return;
+  for (k = tqhead;t[j].pending && (k != -1);k = knext) {
+    knext = tq[k].next;
+    if (tq[k].client == j) {
+      log_querydrop(&tq[k].active);
+      ++metric[METRIC_DROPPED];
+      query_forget(&tq[k].q);
+      tq_free(k);
+    }
+  }
+  timer_clear(&t[j].timeout);
+  log_tcpclose(t[j].ip,t[j].port);
+  iopause_forget(t[j].tcp);
+  close(t[j].tcp);
+  t[j].out.len = 0;
+  t[j].active = 0; --tactive;
+  t_deactivate(j);
+}
+
+/* first active slot started after query number n; the list is in start order */
+static int tq_after(uint64 n)
+{
+  int k;
+
+  for (k = tqhead;k != -1;k = tq[k].next)
+    if (tq[k].active > n) break;
+  return k;
+}
+
+
+/*
+Sends a response with its length prefix. When nothing is queued ahead
+of it, one writev() goes straight from buf; whatever the socket does
+not take goes onto out for t_rw(), which also sees any error.
+*/
+static int t_out(struct tcpclient *x,char *buf,unsigned int len)
+{
+  struct iovec v[2];
+  char num[2];
+  unsigned int n;
+  int w;
+
+  uint16_pack_big(num,len);
+  w = 0;
+  if (!x->out.len) {
+    v[0].iov_base = num; v[0].iov_len = 2;
+    v[1].iov_base = buf; v[1].iov_len = len;
+    w = writev(x->tcp,v,2);
+    if (w < 0) w = 0;
+  }
+  if (w < 2)
+    if (!stralloc_catb(&x->out,num + w,2 - w)) return 0;
+  n = (w > 2) ? w - 2 : 0;
+  return stralloc_catb(&x->out,buf + n,len - n);
+}
+
+static void t_opt(int edns)
+{
+  char num[2];
+
+  if (!edns) return;
+  if (!response_opt(ednssize,0)) return;
+  if (edns == 2) {
+    uint16_pack_big(num,(8 * tactive > 7 * maxtcp) ? 0 : 10 * tcptimeout);
+    response_optadd(DNS_OPT_KEEPALIVE,num,2);
+  }
+}
+
+static int t_send(int k)
+{
+  latency_add(&tq[k].start);
+  response_id(tq[k].id);
+  ++metric[METRIC_ANSWERS];
+  metrics_rcode(response);
+  t_opt(tq[k].edns);
+  return t_out(t + tq[k].client,response,response_len);
+}
+
+/* may close the connection */
+static void t_stale(int k)
+{
+  if (!staletimeout || !tq[k].active || tq[k].flagstale) return;
+  if (!query_stale(&tq[k].q)) return;
+  tq[k].flagstale = 1;
+  ++metric[METRIC_STALE];
+  log_stale(&tq[k].active,response_len);
+  if (!t_send(k)) t_close(tq[k].client);
+}
+
+void t_drop(int k)
+{
+  t_stale(k);
+  if (!tq[k].active) return;
+  slow(&tq[k].q,&tq[k].active);
+  if (tq[k].flagstale) { /* the client has its answer */
+    log_querydrop(&tq[k].active);
+    ++metric[METRIC_DROPPED];
+    tq_free(k);
+    return;
+  }
+  errno = error_pipe;
+  t_close(tq[k].client);
+}
+
+void t_respond(int k)
+{
+  if (!tq[k].active) return;
+  if (servfail()) t_stale(k);
+  if (!tq[k].active) return;
+  if (!tq[k].flagstale) {
+    if (!t_send(k)) {
+      t_close(tq[k].client);
+      return;
+    }
+  }
+  slow(&tq[k].q,&tq[k].active);
+  log_querydone(&tq[k].active,response_len);
+  tq_free(k);
+  f_start(&tq[k].q);
+}
+
+static void t_start(int j)
+{
+  struct tcpclient *x;
+  struct tcpquery *y;
+  char q[DNS_NAME];
+  char qtype[2];
+  char qclass[2];
+  char num[2];
+  uint16 len;
   unsigned int pos;
-} t[MAXTCP];
-int tactive = 0;
+  unsigned int size;
+  int edns;
+  int k;
+
+  x = t + j;
+  while (x->active && (x->len >= 2) && (x->pending < TCPPIPELINE)) {
+    uint16_unpack_big(x->buf,&len);
+    if (!len || (len + 2 > TCPBUF)) { errno = error_proto; t_close(j); return; }
+    if (x->len < len + 2) return;
+
+    k = tqfree;
+    if (k == -1) return;
+    y = tq + k;
+
+    profile_phase = PROFILE_PARSE;
+    pos = packetquery(x->buf + 2,len,q,qtype,qclass,y->id);
+    profile_phase = PROFILE_OTHER;
+    if (!pos) { t_close(j); return; }
+    edns = 0;
+    if (ednssize)
+      switch(dns_packet_edns(x->buf + 2,len,pos,&size)) {
+        case -1: edns = -1; break;
+        case 1: edns = 1 + dns_packet_ednsoption(x->buf + 2,len,pos,DNS_OPT_KEEPALIVE);
+      }
+    x->len -= len + 2;
+    byte_copy(x->buf,x->len,x->buf + len + 2);
+
+    if (edns == -1) {
+      if (!response_query(q,qtype,qclass)) continue;
+      response_id(y->id);
+      response_opt(ednssize,1);
+      if (!t_out(x,response,response_len)) { t_close(j); return; }
+      continue;
+    }
+
+    if (byte_equal(qclass,2,DNS_C_CH)) {
+      if (!metrics_answer(q,qtype)) continue;
+      response_id(y->id);
+      uint16_pack_big(num,response_len);
+      if (!stralloc_catb(&x->out,num,2) || !stralloc_catb(&x->out,response,response_len)) {
+        t_close(j);
+        return;
+      }
+      continue;
+    }
+
+    taia_clock(&y->start);
+    y->client = j;
+    y->io = &noio;
+    y->edns = edns;
+    y->flagstale = 0;
+    y->active = ++numqueries; ++x->pending;
+    tq_activate(k);
+    ++metric[METRIC_QUERIES];
+    log_query(&y->active,x->ip,x->port,y->id,q,qtype);
+    y->q.flagfrompeer = query_ispeer(x->ip);
+    switch(query_start(&y->q,q,qtype,qclass,myipoutgoing)) {
+      case -1:
+        t_drop(k);
+        return;
+      case 1:
+        t_respond(k);
+        continue;
+    }
+    stale_arm(&y->stale,&y->start);
+  }
+}
+
+void t_rw(int j)
+{
+  struct tcpclient *x;
+  int r;
+
+  x = t + j;
+  if (x->io->revents & IOPAUSE_WRITE) {
+    profile_phase = PROFILE_SEND;
+    r = write(x->tcp,x->out.s + x->pos,x->out.len - x->pos);
+    profile_phase = PROFILE_OTHER;
+    if (r <= 0) { t_close(j); return; }
+    x->pos += r;
+    if (x->pos == x->out.len) x->pos = x->out.len = 0;
+  }
+
+  if (x->io->revents & IOPAUSE_READ) {
+    profile_phase = PROFILE_RECEIVE;
+    r = read(x->tcp,x->buf + x->len,TCPBUF - x->len);
+    profile_phase = PROFILE_OTHER;
+    if (r == 0) { errno = error_pipe; t_close(j); return; }
+    if (r < 0) { t_close(j); return; }
+    x->len += r;
+    t_start(j);
+  }
+}
+
+void t_new(void)
+{
+  int j;
+  struct tcpclient *x;
+
+  if (tfree == -1) {
+    errno = error_timeout;
+    t_close(thead);
+    ++metric[METRIC_TCPEVICTED];
+  }
+
+  j = tfree;
+  x = t + j;
+
+  x->tcp = socket_accept4(tcp53,x->ip,&x->port);
+  if (x->tcp == -1) return;
+  if (x->port < 1024) if (x->port != 53) { close(x->tcp); return; }
+  if (!okclient(x->ip)) { close(x->tcp); return; }
+  if (ndelay_on(x->tcp) == -1) { close(x->tcp); return; } /* Linux bug */
+
+  x->active = 1; ++tactive;
+  t_activate(j);
+  x->pending = 0;
+  x->len = 0;
+  x->out.len = 0;
+  x->pos = 0;
+  t_timeout(j);
+
+  log_tcpopen(x->ip,x->port);
+}
+
+
+static stralloc fndump = {0};
+static stralloc fndumptmp = {0};
+static stralloc fntier = {0};
+static int flagdump = 0;
+static int flagexit = 0;
+
+static int flaghup = 0;
+
+static void sighup(void) { flaghup = 1; }
+static void sigterm(void) { flagexit = 1; }
+
+static int flagstats = 0;
+static unsigned long statsinterval = 0;
+static struct taia nextstats;
+
+static void sigusr1(void) { flagstats = 1; }
+
+/* what the cache counters came to before stats() last cleared them */
+static uint64 sofar[9];
+static uint64 ghostsofar[CACHE_GHOSTSIZES + 1];
+
+static void metrics_copy(void)
+{
+  int i;
+
+  metric[METRIC_UDPACTIVE] = uactive;
+  metric[METRIC_TCPACTIVE] = tactive;
+  metric[METRIC_CACHEHITS] = sofar[0] + cache_hits;
+  metric[METRIC_CACHEMISSES] = sofar[1] + cache_misses;
+  metric[METRIC_CACHEEXPIRED] = sofar[2] + cache_expired;
+  metric[METRIC_CACHEEVICTIONS] = sofar[3] + cache_evictions;
+  metric[METRIC_UPSTREAM] = sofar[4] + query_sent;
+  metric[METRIC_CACHETRUNCATED] = sofar[5] + cache_truncated;
+  metric[METRIC_CACHEINDEXFULL] = sofar[6] + cache_indexfull;
+  metric[METRIC_CACHERECLAIMED] = sofar[7] + cache_reclaimed;
+  metric[METRIC_CACHECOMPACTED] = sofar[8] + cache_compacted;
+  metric[METRIC_CACHEENTRIES] = cache_entries();
+  metric[METRIC_GHOSTLOOKUPS] = ghostsofar[0] + cache_ghostlookups;
+  for (i = 0;i < CACHE_GHOSTSIZES;++i)
+    metric[METRIC_GHOSTMISSES + i] = ghostsofar[1 + i] + cache_ghostmisses[i];
+}
+
+static void lapdone(void)
+{
+  unsigned int i;
+  uint64 n;
+
+  i = bucket(busy,LAGBUCKETS);
+  ++lag[PHASE_BUSY][i];
+  ++metric[METRIC_LOOPBUSY + i];
+  busy = 0;
+
+  i = maxudp ? (10 * uactive) / maxudp : 0;
+  ++occupancy[0][i];
+  ++metric[METRIC_UDPOCCUPANCY + i];
+  i = maxtcp ? (10 * tactive) / maxtcp : 0;
+  ++occupancy[1][i];
+  ++metric[METRIC_TCPOCCUPANCY + i];
+
+  n = metric[METRIC_UDPEVICTED] - evictmark[0];
+  evictmark[0] = metric[METRIC_UDPEVICTED];
+  ++evicted[0][n ? bucket((double) n,EVICTBUCKETS) : 0];
+  n = metric[METRIC_TCPEVICTED] - evictmark[1];
+  evictmark[1] = metric[METRIC_TCPEVICTED];
+  ++evicted[1][n ? bucket((double) n,EVICTBUCKETS) : 0];
+}
+
+static void stats(void)
+{
+  int i;
+  int j;
+
+  flagstats = 0;
+  sofar[0] += cache_hits;
+  sofar[1] += cache_misses;
+  sofar[2] += cache_expired;
+  sofar[3] += cache_evictions;
+  sofar[4] += query_sent;
+  sofar[5] += cache_truncated;
+  sofar[6] += cache_indexfull;
+  sofar[7] += cache_reclaimed;
+  sofar[8] += cache_compacted;
+  ghostsofar[0] += cache_ghostlookups;
+  for (i = 0;i < CACHE_GHOSTSIZES;++i)
+    ghostsofar[1 + i] += cache_ghostmisses[i];
+  log_interval();
+  log_latency(latency,LATENCYBUCKETS);
+  log_ghost(cache_ghostlookups,cache_ghostmisses,CACHE_GHOSTSIZES);
+  log_perf();
+  log_top();
+  for (i = 0;i < PHASES;++i)
+    log_histogram("loop",phasename[i],lag[i],LAGBUCKETS);
+  log_histogram("occupancy","udp",occupancy[0],OCCUPANCYBUCKETS);
+  log_histogram("occupancy","tcp",occupancy[1],OCCUPANCYBUCKETS);
+  log_histogram("evicted","udp",evicted[0],EVICTBUCKETS);
+  log_histogram("evicted","tcp",evicted[1],EVICTBUCKETS);
+  log_histogram("probe","lookup",cache_probes,CACHE_PROBEBUCKETS);
+  log_cacheindex(cache_truncated,cache_indexfull);
+  cache_hits = 0;
+  cache_misses = 0;
+  cache_expired = 0;
+  cache_evictions = 0;
+  query_sent = 0;
+  cache_truncated = 0;
+  cache_indexfull = 0;
+  cache_reclaimed = 0;
+  cache_compacted = 0;
+  for (i = 0;i < CACHE_PROBEBUCKETS;++i) cache_probes[i] = 0;
+  cache_ghostlookups = 0;
+  for (i = 0;i < CACHE_GHOSTSIZES;++i) cache_ghostmisses[i] = 0;
+  for (i = 0;i < LATENCYBUCKETS;++i) latency[i] = 0;
+  for (i = 0;i < PHASES;++i)
+    for (j = 0;j < LAGBUCKETS;++j) lag[i][j] = 0;
+  for (i = 0;i < 2;++i) {
+    for (j = 0;j < OCCUPANCYBUCKETS;++j) occupancy[i][j] = 0;
+    for (j = 0;j < EVICTBUCKETS;++j) evicted[i][j] = 0;
+  }
+}
+
+/*
+$MEMLIMIT is a soft limit on the memory a worker holds: what alloc()
+has out, for query state, TCP buffers, packets and the cache itself,
+plus pages mapped for the cache. Once a second, if the worker is
+over it, the cache shrinks to leave an eighth of the limit free, but
+to no less than a sixteenth of its size; when there is more free,
+the cache grows back toward its size, again leaving an eighth free.
+Changes under an eighth of the cache are not worth a resize.
+SIGHUP also takes a new size for the cache, in bytes for all workers
+as $CACHESIZE, from the file cachesize, if there is one, up to
+CACHEMAX for each worker; the loop resizes once no move is under way,
+and under $MEMLIMIT only shrinks, leaving growth to the check above.
+Entries move to a resized cache MIGRATESTEP bytes at a time, once a
+pass of the event loop, which does not wait while any are left; see
+cache.c.
+Otherwise each pass lets cache_compact() look at COMPACTSTEP bytes
+ahead of the oldest entries, to free what has expired there.
+*/
+
+#define MIGRATESTEP 262144
+#define COMPACTSTEP 65536
+#define CACHEMAX 1000000000 /* as cache.c has it */
+
+static unsigned long memlimit = 0; /* 0: none */
+static unsigned long cachewant; /* this worker's share of the cache size */
+static unsigned long cacheparts = 1; /* workers sharing out the cache size */
+static struct taia nextmem;
+static int flagmigrating = 0;
+static int flagresize = 0; /* cachewant is new */
+
+static void resize(unsigned long n)
+{
+  unsigned long from;
+
+  from = cache_size();
+  if (cache_resize(n)) {
+    flagmigrating = 1;
+    log_cacheresize(from,n,0);
+  }
+  else
+    log_cacheresize(from,n,-1);
+}
+
+static void memcheck(void)
+{
+  unsigned long total;
+  unsigned long now;
+  unsigned long n;
+
+  if (!memlimit || flagmigrating) return;
+  total = alloc_bytes + cache_mapped();
+  now = cache_size();
+  if (total > memlimit) {
+    n = total - memlimit + memlimit / 8;
+    n = (n < now) ? now - n : 0;
+    if (n < cachewant / 16) n = cachewant / 16;
+    if (n < now - now / 8) resize(n);
+    return;
+  }
+  if (now >= cachewant) return;
+  n = memlimit - total;
+  if (n <= memlimit / 8) return;
+  n = now + n - memlimit / 8;
+  if (n > cachewant) n = cachewant;
+  if ((n == cachewant) || (n >= now + now / 8)) resize(n);
+}
+
+static stralloc newsize = {0};
+
+/* SIGHUP: servers/ and ip/ anew; the old ones stay if either fails */
+static void reload(void)
+{
+  unsigned long n;
+
+  flaghup = 0;
+  log_reload("servers",roots_init() ? 0 : -1);
+  log_reload("ip",okclient_init() ? 0 : -1);
+  if (fndump.s) flagdump = 1;
+
+  if (openreadclose("cachesize",&newsize,32) != 1) return;
+  if (!stralloc_0(&newsize)) return;
+  if (!scan_ulong(newsize.s,&n)) return;
+  n /= cacheparts;
+  cachewant = (n > CACHEMAX) ? CACHEMAX : n;
+  flagresize = 1;
+}
+
+/* to cachewant, as given by SIGHUP, once no move is under way */
+static void sizecheck(void)
+{
+  unsigned long now;
+
+  flagresize = 0;
+  now = cache_size();
+  if (cachewant == now) return;
+  if (memlimit && (cachewant > now)) return; /* memcheck() grows it */
+  resize(cachewant);
+}
+
+static void dump(void)
+{
+  int fd;
+
+  flagdump = 0;
+  fd = open_trunc(fndumptmp.s);
+  if (fd == -1) { log_cachedump(-1); return; }
+  if ((cache_dump(fd) == -1) || (fsync(fd) == -1)) {
+    log_cachedump(-1);
+    close(fd);
+    return;
+  }
+  if (close(fd) == -1) { log_cachedump(-1); return; }
+  if (rename(fndumptmp.s,fndump.s) == -1) { log_cachedump(-1); return; }
+  log_cachedump(0);
+}
 
 /*
-state 1: buf 0; normal state at beginning of TCP connection
-state 2: buf 0; have read 1 byte of query packet length into len
-state 3: buf allocated; have read pos bytes of buf
-state 0: buf 0; handling query in q
-state -1: buf allocated; have written pos bytes
+SIGUSR2, with $STATEDUMP: what this process is doing, written to that
+file (with ".i" for worker i) by a child, so the loop pauses only for
+the fork(). A line for each query in a slot, "udp slot client qtype
+name level server ms", and likewise "tcp" and "refresh"; a line
+"tcpconn slot client pending unwritten" for each TCP connection; the
+cache, see cache_state(); and the RTT table, "rtt ip srtt rttvar loss
+fails down". Addresses are in hex, as in the log; server is "-" while
+the query is not talking to one, as for a query waiting on another.
 */
 
-void t_free(int j)
+static stralloc fnstate = {0};
+static stralloc fnstatetmp = {0};
+static int flagstate = 0;
+static int statepid = 0;
+
+static void sigusr2(void) { flagstate = 1; }
+
+static char statespace[4096];
+static buffer sb;
+static stralloc statename = {0};
+static struct taia statenow;
+
+static void sputs(const char *s)
 {
-  if (!t[j].buf) return;
-  alloc_free(t[j].buf);
-  t[j].buf = 0;
+  buffer_puts(&sb,s);
 }
 
-void t_timeout(int j)
+static void snum(unsigned long n)
 {
-  struct taia now;
-  if (!t[j].active) return;
-  taia_now(&now);
-  taia_uint(&t[j].timeout,10);
-  taia_add(&t[j].timeout,&t[j].timeout,&now);
+  char strnum[FMT_ULONG];
+  buffer_put(&sb,strnum,fmt_ulong(strnum,n));
 }
 
-void t_close(int j)
+static void shex(const char *s,unsigned int n)
 {
-  if (!t[j].active) return;
-  t_free(j);
-  log_tcpclose(t[j].ip,t[j].port);
-  close(t[j].tcp);
-  t[j].active = 0; --tactive;
+  static const char digit[16] = "0123456789abcdef";
+
+  while (n-- > 0) {
+    buffer_put(&sb,digit + ((unsigned char) *s >> 4),1);
+    buffer_put(&sb,digit + (*s++ & 15),1);
+  }
 }
 
-void t_drop(int j)
+static void sclient(const char ip[4],uint16 port)
 {
-  log_querydrop(&t[j].active);
-  errno = error_pipe;
-  t_close(j);
+  char p[2];
+
+  shex(ip,4);
+  sputs(":");
+  uint16_pack_big(p,port);
+  shex(p,2);
 }
 
-void t_respond(int j)
+static void squery(const char *what,int j,const char *ip,uint16 port,struct query *z,const struct taia *start)
 {
-  if (!t[j].active) return;
-  log_querydone(&t[j].active,response_len);
-  response_id(t[j].id);
-  t[j].len = response_len + 2;
-  t_free(j);
-  t[j].buf = alloc(response_len + 2);
-  if (!t[j].buf) { t_close(j); return; }
-  uint16_pack_big(t[j].buf,response_len);
-  byte_copy(t[j].buf + 2,response_len,response);
-  t[j].pos = 0;
-  t[j].state = -1;
+  struct taia elapsed;
+  const char *d;
+
+  sputs(what); sputs(" ");
+  snum(j); sputs(" ");
+  if (ip) sclient(ip,port); else sputs("-");
+  sputs(" ");
+  snum(uint16_UNPACK_BIG(z->type)); sputs(" ");
+  d = (z->level < QUERY_MAXLEVEL) ? z->name[z->level] : 0;
+  if (!d) d = z->qname;
+  statename.len = 0;
+  if (d && dns_domain_todot_cat(&statename,d))
+    buffer_put(&sb,statename.s,statename.len);
+  else
+    sputs("-");
+  sputs(" ");
+  snum(z->level); sputs(" ");
+  if (!z->leader && z->dt.query && z->dt.servers && (z->dt.curserver < 16))
+    shex(z->dt.servers + 4 * z->dt.curserver,4);
+  else
+    sputs("-");
+  sputs(" ");
+  if (start && !taia_less(&statenow,start)) {
+    taia_sub(&elapsed,&statenow,start);
+    snum((unsigned long) (taia_approx(&elapsed) * 1000.0));
+  }
+  else
+    sputs("-");
+  sputs("\n");
 }
 
-void t_rw(int j)
+static int statewrite(int fd)
 {
-  struct tcpclient *x;
-  char ch;
-  static char *q = 0;
-  char qtype[2];
-  char qclass[2];
-  int r;
+  unsigned long info[5];
+  char ip[4];
+  unsigned int i;
+  int j;
 
-  x = t + j;
-  if (x->state == -1) {
-    r = write(x->tcp,x->buf + x->pos,x->len - x->pos);
-    if (r <= 0) { t_close(j); return; }
-    x->pos += r;
-    if (x->pos == x->len) {
-      t_free(j);
-      x->state = 1; /* could drop connection immediately */
-    }
-    return;
+  taia_clock(&statenow);
+  buffer_init(&sb,buffer_unixwrite,fd,statespace,sizeof statespace);
+
+  for (j = uhead;j != -1;j = u[j].next)
+    squery("udp",j,u[j].ip,u[j].port,&u[j].q,&u[j].start);
+  for (j = tqhead;j != -1;j = tq[j].next)
+    squery("tcp",j,t[tq[j].client].ip,t[tq[j].client].port,&tq[j].q,&tq[j].start);
+  for (j = 0;j < MAXREFRESH;++j)
+    if (f[j].active)
+      squery("refresh",j,0,0,&f[j].q,0);
+  for (j = thead;j != -1;j = t[j].next) {
+    sputs("tcpconn "); snum(j); sputs(" ");
+    sclient(t[j].ip,t[j].port); sputs(" ");
+    snum(t[j].pending); sputs(" ");
+    snum(t[j].out.len - t[j].pos); sputs("\n");
   }
+  if (buffer_flush(&sb) == -1) return -1;
 
-  r = read(x->tcp,&ch,1);
-  if (r == 0) { errno = error_pipe; t_close(j); return; }
-  if (r < 0) { t_close(j); return; }
+  if (cache_state(fd) == -1) return -1;
 
-  if (x->state == 1) {
-    x->len = (unsigned char) ch;
-    x->len <<= 8;
-    x->state = 2;
-    return;
-  }
-  if (x->state == 2) {
-    x->len += (unsigned char) ch;
-    if (!x->len) { errno = error_proto; t_close(j); return; }
-    x->buf = alloc(x->len);
-    if (!x->buf) { t_close(j); return; }
-    x->pos = 0;
-    x->state = 3;
-    return;
-  }
+  for (i = 0;i < DNS_RTT_SIZE;++i)
+    if (dns_rtt_entry(i,ip,info)) {
+      sputs("rtt "); shex(ip,4);
+      for (j = 0;j < 5;++j) { sputs(" "); snum(info[j]); }
+      sputs("\n");
+    }
+  return buffer_flush(&sb);
+}
 
-  if (x->state != 3) return; /* impossible */
+static void statedump(void)
+{
+  int fd;
+
+  flagstate = 0;
+  if (!fnstate.s) return;
+  if (statepid) return; /* the last one is still being written */
+  statepid = fork();
+  if (statepid == -1) { statepid = 0; log_statedump(-1); return; }
+  if (statepid) return;
+
+  fd = open_trunc(fnstatetmp.s);
+  if (fd == -1) _exit(111);
+  if (statewrite(fd) == -1) _exit(111);
+  if (close(fd) == -1) _exit(111);
+  if (rename(fnstatetmp.s,fnstate.s) == -1) _exit(111);
+  _exit(0);
+}
 
-  x->buf[x->pos++] = ch;
-  if (x->pos < x->len) return;
+static void statereap(void)
+{
+  int wstat;
 
-  if (!packetquery(x->buf,x->len,&q,qtype,qclass,x->id)) { t_close(j); return; }
+  if (!statepid) return;
+  if (waitpid(statepid,&wstat,WNOHANG) != statepid) return;
+  statepid = 0;
+  log_statedump((WIFEXITED(wstat) && !WEXITSTATUS(wstat)) ? 0 : -1);
+}
 
-  x->active = ++numqueries;
-  log_query(&x->active,x->ip,x->port,x->id,q,qtype);
-  switch(query_start(&x->q,q,qtype,qclass,myipoutgoing)) {
-    case -1:
-      t_drop(j);
-      return;
-    case 1:
-      t_respond(j);
-      return;
-  }
-  t_free(j);
-  x->state = 0;
+iopause_fd *io; /* 3 + maxudp + maxtcp + maxtcpquery + MAXREFRESH + 16 */
+iopause_fd *udp53io;
+iopause_fd *tcp53io;
+
+/*
+Stealing: with $STEAL and $WORKERS, the workers share one UDP socket
+and one TCP socket instead of each having its own hashed share of
+the clients, so a query goes to whichever worker reads it first. Each
+worker also posts its UDP queries in progress where all can see, and
+leaves the UDP socket alone while another worker has STEALSLACK fewer;
+a worker stuck with a burst of slow queries then takes no more, and
+the idle ones take them instead. Best with $CACHESHM, so that every
+worker answers from the same cache.
+*/
+
+#define STEALSLACK 8
+
+static unsigned long *workload = 0; /* one per worker, shared; or 0 */
+static unsigned long numworkload = 0;
+static unsigned long myworkload = 0;
+
+/* 1 if this worker should read new queries from the UDP socket now */
+static int u_take(void)
+{
+  unsigned long mine;
+  unsigned long j;
+
+  if (!workload) return 1;
+  mine = uactive;
+  workload[myworkload] = mine;
+  for (j = 0;j < numworkload;++j)
+    if (workload[j] + STEALSLACK < mine) return 0;
+  return 1;
 }
 
-void t_new(void)
+static void expire(struct timer *x,struct taia *stamp)
 {
-  int i;
   int j;
-  struct tcpclient *x;
+  int r;
 
-  for (j = 0;j < MAXTCP;++j)
-    if (!t[j].active)
+  j = x->id / 8;
+  switch(x->id % 8) {
+    case TIMER_UDP:
+      log_for(&u[j].active);
+      r = query_get(&u[j].q,&noio,stamp);
+      if (r == -1) u_drop(j);
+      if (r == 1) u_respond(j);
+      break;
+    case TIMER_TCPQUERY:
+      log_for(&tq[j].active);
+      r = query_get(&tq[j].q,&noio,stamp);
+      if (r == -1) t_drop(j);
+      if (r == 1) t_respond(j);
+      break;
+    case TIMER_TCP:
+      if (!t[j].pending && !t[j].out.len) {
+        errno = error_timeout;
+        t_close(j);
+      }
+      break;
+    case TIMER_REFRESH:
+      log_for(0);
+      if (query_get(&f[j].q,&noio,stamp))
+        f_done(j);
+      break;
+    case TIMER_UDPSTALE:
+      log_for(&u[j].active);
+      u_stale(j);
+      break;
+    case TIMER_TCPSTALE:
+      log_for(&tq[j].active);
+      t_stale(j);
       break;
-
-  if (j >= MAXTCP) {
-    j = 0;
-    for (i = 1;i < MAXTCP;++i)
-      if (taia_less(&t[i].start,&t[j].start))
-	j = i;
-    errno = error_timeout;
-    if (t[j].state == 0)
-      t_drop(j);
-    else
-      t_close(j);
   }
+}
 
-  x = t + j;
-  taia_now(&x->start);
+/*
+$HANDOFF, a path: a successor started with the same $HANDOFF takes
+this process's sockets, still bound and with the queries queued on
+them, instead of binding its own; see handoff_get(). On SIGTERM each
+worker writes its $CACHEDUMP as before and forks. The parent exits,
+so the successor can start; the child stops reading new queries,
+finishes the queries it has, and, in worker 0, offers the sockets at
+the path. It exits once its queries are done and the sockets are
+taken, or HANDOFFWAIT seconds after the SIGTERM. Once the sockets
+are taken, or at once in the other workers, it closes its TCP
+sockets. A successor with another number of sockets binds its own,
+trying for up to HANDOFFWAIT seconds while the predecessor lets go of
+the port.
+*/
 
-  x->tcp = socket_accept4(tcp53,x->ip,&x->port);
-  if (x->tcp == -1) return;
-  if (x->port < 1024) if (x->port != 53) { close(x->tcp); return; }
-  if (!okclient(x->ip)) { close(x->tcp); return; }
-  if (ndelay_on(x->tcp) == -1) { close(x->tcp); return; } /* Linux bug */
+#define HANDOFFWAIT 30
 
-  x->active = 1; ++tactive;
-  x->state = 1;
-  t_timeout(j);
+static int handoffsocket = -1;
+static int handed[128]; /* UDP and TCP socket for each of numsockets */
+static unsigned int numhanded = 0;
+static iopause_fd *handoffio;
+static int flagdrain = 0;
+static int flagtaken = 0;
+static struct taia drainend;
 
-  log_tcpopen(x->ip,x->port);
+/* closes the TCP sockets, which no longer take connections */
+static void unlisten(void)
+{
+  unsigned int i;
+
+  for (i = 0;i < numhanded;i += 2) {
+    iopause_forget(handed[i + 1]);
+    close(handed[i + 1]);
+  }
 }
 
+static void drain(void)
+{
+  struct taia wait;
+
+  if (fork()) _exit(0);
+  sig_uncatch(sig_term);
+  flagexit = 0;
+  flagdrain = 1;
+  if (myworkload) { /* worker 0 offers the sockets */
+    flagtaken = 1;
+    unlisten();
+  }
+  taia_clock(&drainend);
+  taia_uint(&wait,HANDOFFWAIT);
+  taia_add(&drainend,&drainend,&wait);
+}
 
-iopause_fd io[3 + MAXUDP + MAXTCP];
-iopause_fd *udp53io;
-iopause_fd *tcp53io;
+static int drained(void)
+{
+  int j;
+
+  if ((uhead != -1) || (tqhead != -1)) return 0;
+  for (j = thead;j != -1;j = t[j].next)
+    if (t[j].pending || t[j].out.len) return 0;
+  return 1;
+}
 
 static void doit(void)
 {
   int j;
+  int jnext;
+  int k;
+  int knext;
+  uint64 qnum;
   struct taia deadline;
   struct taia stamp;
+  struct tai wall;
+  struct timer *x;
   int iolen;
   int r;
 
+  taia_now(&lapstart);
   for (;;) {
-    taia_now(&stamp);
+    taia_tick(&stamp);
     taia_uint(&deadline,120);
     taia_add(&deadline,&deadline,&stamp);
 
+    if (statsinterval) {
+      if (!taia_less(&stamp,&nextstats)) {
+        stats();
+        taia_uint(&nextstats,statsinterval);
+        taia_add(&nextstats,&nextstats,&stamp);
+      }
+      if (taia_less(&nextstats,&deadline)) deadline = nextstats;
+    }
+
+    if (memlimit) {
+      if (!taia_less(&stamp,&nextmem)) {
+        memcheck();
+        taia_uint(&nextmem,1);
+        taia_add(&nextmem,&nextmem,&stamp);
+      }
+      if (taia_less(&nextmem,&deadline)) deadline = nextmem;
+    }
+    if (flagmigrating) {
+      flagmigrating = cache_migrate(MIGRATESTEP);
+      if (flagmigrating) deadline = stamp;
+    }
+    else if (flagresize) {
+      sizecheck();
+      if (flagmigrating) deadline = stamp;
+    }
+    else
+      cache_compact(COMPACTSTEP);
+
+    prime_feed();
+    glueless_feed();
+
     iolen = 0;
 
-    udp53io = io + iolen++;
-    udp53io->fd = udp53;
-    udp53io->events = IOPAUSE_READ;
+    udp53io = 0;
+    tcp53io = 0;
+    handoffio = 0;
+    if (flagdrain) {
+      if (!taia_less(&stamp,&drainend)) { u_flush(); _exit(0); }
+      if (flagtaken && drained()) { u_flush(); _exit(0); }
+      if (taia_less(&drainend,&deadline)) deadline = drainend;
+      if (!flagtaken) {
+        handoffio = io + iolen++;
+        handoffio->fd = handoffsocket;
+        handoffio->events = IOPAUSE_READ;
+      }
+    }
+    else {
+      if (u_take()) {
+        udp53io = io + iolen++;
+        udp53io->fd = udp53;
+        udp53io->events = IOPAUSE_READ;
+      }
+      tcp53io = io + iolen++;
+      tcp53io->fd = tcp53;
+      tcp53io->events = IOPAUSE_READ;
+    }
 
-    tcp53io = io + iolen++;
-    tcp53io->fd = tcp53;
-    tcp53io->events = IOPAUSE_READ;
+    x = timer_first();
+    if (x)
+      if (taia_less(&x->when,&deadline)) deadline = x->when;
 
-    for (j = 0;j < MAXUDP;++j)
-      if (u[j].active) {
-	u[j].io = io + iolen++;
-	query_io(&u[j].q,u[j].io,&deadline);
+    for (j = uhead;j != -1;j = u[j].next) {
+      u[j].io = io + iolen++;
+      query_io(&u[j].q,u[j].io);
+    }
+    for (j = thead;j != -1;j = t[j].next) {
+      t[j].io = io + iolen++;
+      t[j].io->fd = t[j].tcp;
+      t[j].io->events = 0;
+      if (t[j].out.len)
+	t[j].io->events |= IOPAUSE_WRITE;
+      if ((t[j].pending < TCPPIPELINE) && (t[j].len < TCPBUF))
+	t[j].io->events |= IOPAUSE_READ;
+    }
+    for (k = tqhead;k != -1;k = tq[k].next) {
+      tq[k].io = io + iolen++;
+      query_io(&tq[k].q,tq[k].io);
+    }
+    for (j = 0;j < MAXREFRESH;++j)
+      if (f[j].active) {
+	f[j].io = io + iolen++;
+	query_io(&f[j].q,f[j].io);
       }
-    for (j = 0;j < MAXTCP;++j)
-      if (t[j].active) {
-	t[j].io = io + iolen++;
-	if (t[j].state == 0)
-	  query_io(&t[j].q,t[j].io,&deadline);
-	else {
-	  if (taia_less(&t[j].timeout,&deadline)) deadline = t[j].timeout;
-	  t[j].io->fd = t[j].tcp;
-	  t[j].io->events = (t[j].state > 0) ? IOPAUSE_READ : IOPAUSE_WRITE;
-	}
+
+    if (flagforward) {
+      if (!taia_less(&stamp,&nextprobe)) {
+        probe_start();
+        taia_uint(&nextprobe,PROBEINTERVAL);
+        taia_add(&nextprobe,&nextprobe,&stamp);
       }
+      if (taia_less(&nextprobe,&deadline)) deadline = nextprobe;
+      for (j = 0;j < 16;++j)
+        if (probe[j].active) {
+          probe[j].io = io + iolen++;
+          dns_transmit_io(&probe[j].dt,probe[j].io,&deadline);
+        }
+    }
 
+    lap(PHASE_SETUP);
+    metrics_copy();
+    logbuf_flush();
+    lap(PHASE_FLUSH);
+    profile_phase = PROFILE_WAIT;
     iopause(io,iolen,&deadline,&stamp);
+    profile_phase = PROFILE_OTHER;
+    lap(PHASE_WAIT);
+    taia_tick(&stamp);
+    tai_now(&wall);
+    cache_clock(&wall);
+
+    if (flaghup) reload();
+    if (flagstate) statedump();
+    statereap();
+    if (flagdump || flagexit) {
+      if (fndump.s) dump();
+      flagdump = 0;
+      if (flagexit) {
+        if (handoffsocket == -1) { u_flush(); _exit(0); }
+        drain();
+      }
+    }
+    if (flagstats) stats();
+
+    for (j = uhead;j != -1;j = jnext) {
+      jnext = u[j].next;
+      if (!u[j].io->revents) continue;
+      log_for(&u[j].active);
+      r = query_get(&u[j].q,u[j].io,&stamp);
+      if (r == -1) u_drop(j);
+      if (r == 1) u_respond(j);
+    }
 
-    for (j = 0;j < MAXUDP;++j)
-      if (u[j].active) {
-	r = query_get(&u[j].q,u[j].io,&stamp);
-	if (r == -1) u_drop(j);
-	if (r == 1) u_respond(j);
+    for (k = tqhead;k != -1;k = knext) {
+      knext = tq[k].next;
+      if (!tq[k].io->revents) continue;
+      qnum = tq[k].active;
+      log_for(&tq[k].active);
+      r = query_get(&tq[k].q,tq[k].io,&stamp);
+      if (r == -1) t_drop(k);
+      if (r == 1) t_respond(k);
+      if (knext != -1)
+	if (!tq[knext].active) /* t_close() freed it with k */
+	  knext = tq_after(qnum);
+    }
+
+    k = ttail; /* t_timeout() moves slots after it */
+    for (j = thead;j != -1;j = jnext) {
+      jnext = (j == k) ? -1 : t[j].next;
+      if (t[j].io->revents) {
+	t_timeout(j);
+	t_rw(j);
       }
+    }
+    for (j = thead;j != -1;j = jnext) {
+      jnext = t[j].next;
+      t_start(j);
+    }
 
-    for (j = 0;j < MAXTCP;++j)
-      if (t[j].active) {
-	if (t[j].io->revents)
-	  t_timeout(j);
-	if (t[j].state == 0) {
-	  r = query_get(&t[j].q,t[j].io,&stamp);
-	  if (r == -1) t_drop(j);
-	  if (r == 1) t_respond(j);
-	}
-	else
-	  if (t[j].io->revents || taia_less(&t[j].timeout,&stamp))
-	    t_rw(j);
+    log_for(0);
+    for (j = 0;j < MAXREFRESH;++j)
+      if (f[j].active && f[j].io->revents)
+	if (query_get(&f[j].q,f[j].io,&stamp))
+	  f_done(j);
+
+    for (j = 0;j < 16;++j)
+      if (probe[j].active) {
+        r = dns_transmit_get(&probe[j].dt,probe[j].io,&stamp);
+        if (r || (probe[j].dt.udploop > 1)) { /* one try is enough */
+          dns_transmit_free(&probe[j].dt);
+          probe[j].active = 0;
+        }
       }
 
+    while ((x = timer_due(&stamp)))
+      expire(x,&stamp);
+
+    lap(PHASE_GET);
+
     if (udp53io)
       if (udp53io->revents)
 	u_new();
@@ -379,17 +1942,351 @@ static void doit(void)
     if (tcp53io)
       if (tcp53io->revents)
 	t_new();
+
+    if (handoffio)
+      if (handoffio->revents)
+        if (handoff_put(handoffsocket,handed,numhanded) == 1) {
+          close(handoffsocket);
+          flagtaken = 1;
+          unlisten();
+        }
+
+    u_flush();
+    lap(PHASE_NEW);
+    lapdone();
   }
 }
   
 #define FATAL "dnscache: fatal: "
 
+/*
+With $PINCPU, worker i runs only on CPU $PINCPU + i, pinned before it
+allocates its slots and, without $CACHESHM, its share of the cache,
+so those come from that CPU's memory node. With $STEER as well, and
+workers not stealing, the kernel hands what it takes in on CPU
+$PINCPU + i to worker i rather than by hash of the client; see
+socket_steercpu().
+*/
+
+#define MAXWORKERS 64
+static int udpworker[MAXWORKERS];
+static int tcpworker[MAXWORKERS];
+static int pidworker[MAXWORKERS];
+static unsigned long numworkers = 1;
+static unsigned long numsockets = 1; /* 1 if stealing; else numworkers */
+static char *pincpu = 0;
+static unsigned long cpu = 0;
+static unsigned long profilehz = 0; /* $PROFILE; see profile.c */
+static char *cacheshm = 0;
+
 char seed[128];
+static char *cachesizestr;
+static unsigned long cachesize;
+static unsigned long cacheslots = 0;
+
+static void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+
+/* n, or as many as slotalloc() gives when each slot takes each bytes */
+static unsigned long slotcap(unsigned long n,unsigned long each)
+{
+  if (n > 0x7fffffff / each) n = 0x7fffffff / each;
+  return n;
+}
+
+static char *slotalloc(unsigned long n,unsigned int each)
+{
+  char *x;
+
+  if (n > 0x7fffffff / each) nomem();
+  x = alloc(n * each);
+  if (!x) nomem();
+  byte_zero(x,n * each);
+  return x;
+}
+
+static void slots(void)
+{
+  int j;
+
+  u = (struct udpclient *) slotalloc(maxudp,sizeof(struct udpclient));
+  for (numloads = 64;numloads < 4 * maxudp;numloads <<= 1) ;
+  loads = (struct load *) slotalloc(numloads,sizeof(struct load));
+  for (numudup = 64;numudup < maxudp;numudup <<= 1) ;
+  udup = (int *) slotalloc(numudup,sizeof(int));
+  t = (struct tcpclient *) slotalloc(maxtcp,sizeof(struct tcpclient));
+  tq = (struct tcpquery *) slotalloc(maxtcpquery,sizeof(struct tcpquery));
+  io = (iopause_fd *) slotalloc(3 + maxudp + maxtcp + maxtcpquery + MAXREFRESH + 16,sizeof(iopause_fd));
+  if (!timer_init(2 * maxudp + maxtcp + 2 * maxtcpquery + MAXREFRESH)) nomem();
+  for (j = 0;j < MAXREFRESH;++j)
+    f[j].q.timer.id = 8 * j + TIMER_REFRESH;
+}
+
+static void worker(unsigned long i)
+{
+  struct taia interval;
+  char strnum[FMT_ULONG];
+  char *x;
+  unsigned long j;
+  int fd;
+  int r;
+
+  if (pincpu)
+    if (cpupin(cpu + i) == -1)
+      strerr_die2sys(111,FATAL,"unable to set CPU affinity: ");
+  if (handoffsocket == -1) /* otherwise kept for handoff_put() */
+    for (j = 0;j < numsockets;++j)
+      if (j != i % numsockets) {
+        close(udpworker[j]);
+        close(tcpworker[j]);
+      }
+  udp53 = udpworker[i % numsockets];
+  tcp53 = tcpworker[i % numsockets];
+  myworkload = i;
+  metrics_worker(i);
+  if (profile_start(profilehz,metric + METRIC_PROFILE) == -1)
+    strerr_die2sys(111,FATAL,"unable to start profiling: ");
+  slots();
+  u_init();
+  t_init();
+  iopause_persistent();
+
+  dns_random_init(seed);
+  cache_seed(seed);
+  for (j = 0;j < sizeof dupkey;++j) dupkey[j] = dns_random(256);
+
+  if (cacheslots)
+    cache_slots(cacheshm ? cacheslots : cacheslots / numworkers);
+  if (cacheshm) {
+    if (!cache_init(cachesize))
+      strerr_die4sys(111,FATAL,"unable to map shared cache ",cacheshm,": ");
+    memlimit = 0; /* nothing to shrink */
+  }
+  else {
+    if (!cache_init(cachesize / numworkers))
+      strerr_die3x(111,FATAL,"not enough memory for cache of size ",cachesizestr);
+    cacheparts = numworkers;
+    memlimit /= numworkers;
+  }
+  cachewant = cache_size();
+
+  /* workers with caches of their own each take a file of their own */
+  x = env_get("CACHEFILE");
+  if (x) {
+    if (!stralloc_copys(&fntier,x)) nomem();
+    if ((numworkers > 1) && !cacheshm) {
+      if (!stralloc_cats(&fntier,".")) nomem();
+      if (!stralloc_catb(&fntier,strnum,fmt_ulong(strnum,i))) nomem();
+    }
+    if (!stralloc_0(&fntier)) nomem();
+    x = env_get("CACHEFILESIZE");
+    if (!x)
+      strerr_die2x(111,FATAL,"$CACHEFILE needs $CACHEFILESIZE");
+    scan_ulong(x,&j);
+    if (!cache_tier(fntier.s,j))
+      strerr_die4sys(111,FATAL,"unable to map ",fntier.s,": ");
+  }
+
+  x = env_get("CACHEDUMP");
+  if (cacheshm && i) x = 0; /* worker 0 dumps the cache they all share */
+  if (x) {
+    if (!stralloc_copys(&fndump,x)) nomem();
+    if (numworkers > 1) {
+      if (!stralloc_cats(&fndump,".")) nomem();
+      if (!stralloc_catb(&fndump,strnum,fmt_ulong(strnum,i))) nomem();
+    }
+    if (!stralloc_copy(&fndumptmp,&fndump)) nomem();
+    if (!stralloc_cats(&fndumptmp,".tmp")) nomem();
+    if (!stralloc_0(&fndumptmp)) nomem();
+    if (!stralloc_0(&fndump)) nomem();
+    fd = open_read(fndump.s);
+    if (fd == -1) {
+      if (errno != error_noent)
+        strerr_die4sys(111,FATAL,"unable to open ",fndump.s,": ");
+    }
+    else {
+      r = cache_load(fd);
+      if ((r == -1) && (errno != error_proto)) /* proto: another version */
+        strerr_die4sys(111,FATAL,"unable to read ",fndump.s,": ");
+      log_cacheload(r);
+      close(fd);
+    }
+  }
+  if (fndump.s || (handoffsocket != -1))
+    sig_catch(sig_term,sigterm);
+
+  x = env_get("STATEDUMP");
+  if (x) {
+    if (!stralloc_copys(&fnstate,x)) nomem();
+    if (numworkers > 1) {
+      if (!stralloc_cats(&fnstate,".")) nomem();
+      if (!stralloc_catb(&fnstate,strnum,fmt_ulong(strnum,i))) nomem();
+    }
+    if (!stralloc_copy(&fnstatetmp,&fnstate)) nomem();
+    if (!stralloc_cats(&fnstatetmp,".tmp")) nomem();
+    if (!stralloc_0(&fnstatetmp)) nomem();
+    if (!stralloc_0(&fnstate)) nomem();
+  }
+
+  sig_catch(sig_hangup,sighup);
+  sig_catch(sig_usr2,sigusr2);
+  sig_catch(sig_usr1,sigusr1);
+  x = env_get("STATSINTERVAL");
+  if (x) scan_ulong(x,&statsinterval);
+  taia_clock(&nextstats);
+  taia_uint(&interval,statsinterval);
+  taia_add(&nextstats,&nextstats,&interval);
+
+  if (prime.len && !(cacheshm && i)) {
+    flagprime = 1;
+    taia_clock(&primestart);
+  }
+
+  log_startup();
+  doit();
+}
+
+static int flagstop = 0;
+
+static void killworkers(int sig)
+{
+  unsigned long j;
+
+  for (j = 0;j < numworkers;++j)
+    if (pidworker[j]) kill(pidworker[j],sig);
+}
+
+static void forwardhup(void) { killworkers(sig_hangup); }
+static void forwardusr1(void) { killworkers(sig_usr1); }
+static void forwardusr2(void) { killworkers(sig_usr2); }
+static void forwardterm(void) { flagstop = 1; killworkers(sig_term); }
+
+static void supervise(void)
+{
+  unsigned long j;
+  int pid;
+  int wstat;
+  int flagfailed = 0;
+
+  sig_catch(sig_hangup,forwardhup);
+  sig_catch(sig_usr1,forwardusr1);
+  sig_catch(sig_usr2,forwardusr2);
+  sig_catch(sig_term,forwardterm);
+
+  for (;;) {
+    pid = logwait(&wstat);
+    if (pid == -1) {
+      if (errno == error_intr) continue;
+      logbuf_drain();
+      _exit(flagfailed ? 111 : 0);
+    }
+    for (j = 0;j < numworkers;++j)
+      if (pidworker[j] == pid) pidworker[j] = 0;
+    if (!flagstop) {
+      flagfailed = 1;
+      forwardterm();
+    }
+  }
+}
+
+static int bind53(int s)
+{
+  unsigned int i;
+  int r;
+
+  for (i = 0;;++i) {
+    if (numsockets > 1)
+      r = socket_bind4_reuseport(s,myipincoming,53);
+    else
+      r = socket_bind4_reuse(s,myipincoming,53);
+    if (r == 0) return 0;
+    if (!numhanded || (i >= HANDOFFWAIT)) return -1;
+    sleep(1); /* a predecessor may still hold the port */
+  }
+}
+
+/* $PEERS: addresses separated by commas or spaces, this cache's among them */
+#define MAXPEERS 16
+
+static char peers[4 * MAXPEERS];
+
+/* 0, or where the list stops making sense */
+static char *peerlist(char *x,unsigned int *n)
+{
+  unsigned int len;
+
+  *n = 0;
+  for (;;) {
+    while ((*x == ',') || (*x == ' ')) ++x;
+    if (!*x) return 0;
+    if (*n == MAXPEERS) return x;
+    len = ip4_scan(x,peers + 4 * *n);
+    if (!len) return x;
+    x += len;
+    if (*x && (*x != ',') && (*x != ' ')) return x;
+    ++*n;
+  }
+}
+
+static void prime_add(const char *type,const char *name,unsigned int len)
+{
+  static char *q = 0;
+
+  if (!dns_domain_fromdot(&q,name,len))
+    strerr_die2sys(111,FATAL,"unable to set up $PRIME: ");
+  if (!stralloc_catb(&prime,type,2)) nomem();
+  if (!stralloc_catb(&prime,q,dns_domain_length(q))) nomem();
+}
+
+static void prime_init(const char *fn,const char *tlds)
+{
+  stralloc names = {0};
+  unsigned int i;
+  unsigned int j;
+
+  prime_add(DNS_T_NS,".",1);
+  if (!tlds) tlds = PRIMETLDS;
+  for (i = 0;tlds[i];i = j) {
+    while ((tlds[i] == ',') || (tlds[i] == ' ')) ++i;
+    for (j = i;tlds[j] && (tlds[j] != ',') && (tlds[j] != ' ');++j) ;
+    if (j > i) prime_add(DNS_T_NS,tlds + i,j - i);
+  }
+
+  if (!*fn) return;
+  if (openreadclose(fn,&names,1024) != 1)
+    strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+  for (i = 0;i < names.len;i = j + 1) {
+    for (j = i;(j < names.len) && (names.s[j] != '\n');++j) ;
+    if ((j > i) && (names.s[i] != '#'))
+      prime_add(DNS_T_A,names.s + i,j - i);
+  }
+  alloc_free(names.s);
+}
 
 int main()
 {
   char *x;
-  unsigned long cachesize;
+  char *y;
+  unsigned int numpeers;
+  unsigned long peertimeout = 200;
+  unsigned long i;
+  unsigned long percent;
+  unsigned long infra;
+  unsigned long negative;
+  unsigned long nxlimit;
+  unsigned long glueless;
+  unsigned long packets;
+  unsigned long hedge;
+  unsigned long stalemax = 86400;
+  unsigned long edns;
+  unsigned long logsize;
+  unsigned long servermax = 0;
+  unsigned long serverrate = 0;
+  char *handoff;
+  int pid;
+  int r = 0;
 
   x = env_get("IP");
   if (!x)
@@ -397,25 +2294,101 @@ int main()
   if (!ip4_scan(x,myipincoming))
     strerr_die3x(111,FATAL,"unable to parse IP address ",x);
 
-  udp53 = socket_udp();
-  if (udp53 == -1)
-    strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
-  if (socket_bind4_reuse(udp53,myipincoming,53) == -1)
-    strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+  x = env_get("WORKERS");
+  if (x) {
+    scan_ulong(x,&numworkers);
+    if (numworkers < 1) numworkers = 1;
+    if (numworkers > MAXWORKERS) numworkers = MAXWORKERS;
+  }
+  numsockets = numworkers;
+  if (env_get("STEAL") && (numworkers > 1)) {
+    x = mmap(0,numworkers * sizeof(unsigned long),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANON,-1,0);
+    if (x == (char *) MAP_FAILED) nomem();
+    workload = (unsigned long *) x;
+    byte_zero(x,numworkers * sizeof(unsigned long));
+    numworkload = numworkers;
+    numsockets = 1;
+  }
+  pincpu = env_get("PINCPU");
+  if (pincpu) scan_ulong(pincpu,&cpu);
+  x = env_get("MAXUDP");
+  if (x) {
+    scan_ulong(x,&maxudp);
+    if (maxudp < 1) maxudp = 1;
+    maxudp = slotcap(maxudp,sizeof(struct udpclient) + 8 * sizeof(struct load));
+  }
+  x = env_get("MAXTCP");
+  if (x) {
+    scan_ulong(x,&maxtcp);
+    if (maxtcp < 1) maxtcp = 1;
+    maxtcp = slotcap(maxtcp,sizeof(struct tcpclient));
+  }
+  maxtcpquery = TCPQUERIES * maxtcp;
+  x = env_get("MAXTCPQUERY");
+  if (x) {
+    scan_ulong(x,&maxtcpquery);
+    if (maxtcpquery < 1) maxtcpquery = 1;
+  }
+  maxtcpquery = slotcap(maxtcpquery,sizeof(struct tcpquery));
+  x = env_get("TCPTIMEOUT");
+  if (x) {
+    scan_ulong(x,&tcptimeout);
+    if (tcptimeout < 1) tcptimeout = 1;
+    if (tcptimeout > 6553) tcptimeout = 6553; /* 100 ms units fit 16 bits */
+  }
+
+  handoff = env_get("HANDOFF");
+  if (handoff) {
+    if (2 * numsockets > sizeof handed / sizeof handed[0])
+      strerr_die2x(111,FATAL,"too many sockets for $HANDOFF");
+    numhanded = 2 * numsockets;
+    r = handoff_get(handoff,handed,numhanded);
+    if (r == -1)
+      strerr_die4sys(111,FATAL,"unable to take sockets from ",handoff,": ");
+  }
+
+  for (i = 0;i < numsockets;++i) {
+    if (r > 0) {
+      udpworker[i] = handed[2 * i];
+      tcpworker[i] = handed[2 * i + 1];
+      continue;
+    }
+    udpworker[i] = socket_udp();
+    if (udpworker[i] == -1)
+      strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+    if (bind53(udpworker[i]) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+
+    tcpworker[i] = socket_tcp();
+    if (tcpworker[i] == -1)
+      strerr_die2sys(111,FATAL,"unable to create TCP socket: ");
+    if (bind53(tcpworker[i]) == -1)
+      strerr_die2sys(111,FATAL,"unable to bind TCP socket: ");
+  }
+
+  for (i = 0;i < numsockets;++i) {
+    handed[2 * i] = udpworker[i];
+    handed[2 * i + 1] = tcpworker[i];
+    if (numsockets < numworkers) /* another worker may read first */
+      if ((ndelay_on(udpworker[i]) == -1) || (ndelay_on(tcpworker[i]) == -1))
+        strerr_die2sys(111,FATAL,"unable to set sockets nonblocking: ");
+  }
 
-  tcp53 = socket_tcp();
-  if (tcp53 == -1)
-    strerr_die2sys(111,FATAL,"unable to create TCP socket: ");
-  if (socket_bind4_reuse(tcp53,myipincoming,53) == -1)
-    strerr_die2sys(111,FATAL,"unable to bind TCP socket: ");
+  if (handoff) {
+    handoffsocket = handoff_listen(handoff);
+    if (handoffsocket == -1)
+      strerr_die4sys(111,FATAL,"unable to listen on ",handoff,": ");
+    if (ndelay_on(handoffsocket) == -1)
+      strerr_die2sys(111,FATAL,"unable to set sockets nonblocking: ");
+  }
 
   droproot(FATAL);
 
-  socket_tryreservein(udp53,131072);
+  for (i = 0;i < numsockets;++i)
+    socket_tryreservein(udpworker[i],131072);
 
   byte_zero(seed,sizeof seed);
   read(0,seed,sizeof seed);
-  dns_random_init(seed);
   close(0);
 
   x = env_get("IPSEND");
@@ -424,24 +2397,187 @@ int main()
   if (!ip4_scan(x,myipoutgoing))
     strerr_die3x(111,FATAL,"unable to parse IP address ",x);
 
-  x = env_get("CACHESIZE");
-  if (!x)
+  x = env_get("IPSEND6");
+  if (x) {
+    char ip6[16];
+    if (!ip6_scan(x,ip6))
+      strerr_die3x(111,FATAL,"unable to parse IP address ",x);
+    if (dns_ip6_local(ip6) == -1) nomem();
+  }
+
+  cachesizestr = env_get("CACHESIZE");
+  if (!cachesizestr)
     strerr_die2x(111,FATAL,"$CACHESIZE not set");
-  scan_ulong(x,&cachesize);
-  if (!cache_init(cachesize))
-    strerr_die3x(111,FATAL,"not enough memory for cache of size ",x);
+  scan_ulong(cachesizestr,&cachesize);
+  x = env_get("CACHESLOTS");
+  if (x) scan_ulong(x,&cacheslots);
+  x = env_get("MEMLIMIT");
+  if (x) scan_ulong(x,&memlimit);
+  x = env_get("OVERLOAD");
+  if (x) {
+    scan_ulong(x,&percent);
+    overload_init(percent);
+  }
+
+  if (env_get("SECONDCHANCE"))
+    cache_secondchance();
+  if (env_get("HUGEPAGES"))
+    cache_hugepages();
+  if (env_get("CACHEGHOST"))
+    cache_ghost();
+  cacheshm = env_get("CACHESHM");
+  if (cacheshm)
+    cache_shared(cacheshm);
+
+  x = env_get("PREFETCH");
+  if (x) {
+    scan_ulong(x,&percent);
+    cache_prefetch(percent);
+  }
+  x = env_get("CACHEINFRA");
+  y = env_get("CACHENEGATIVE");
+  if (x || y) {
+    infra = negative = 0;
+    if (x) scan_ulong(x,&infra);
+    if (y) scan_ulong(y,&negative);
+    query_partition(infra,negative);
+  }
 
   if (env_get("HIDETTL"))
     response_hidettl();
-  if (env_get("FORWARDONLY"))
+  if (env_get("FORWARDONLY")) {
     query_forwardonly();
+    flagforward = 1;
+  }
+  if (env_get("LOCALDATA"))
+    query_local();
+  if (env_get("CACHECOMPACT"))
+    query_compact();
+  if (env_get("MINIMALANY"))
+    query_minimalany();
+  x = env_get("PACKETCACHE");
+  if (x) {
+    scan_ulong(x,&packets);
+    if (packets) query_packets(packets);
+  }
+  x = env_get("GLUELESS");
+  if (x) {
+    scan_ulong(x,&glueless);
+    query_glueless(glueless);
+  }
+  x = env_get("NXLIMIT");
+  if (x) {
+    scan_ulong(x,&nxlimit);
+    query_nxlimit(nxlimit);
+  }
+  x = env_get("EDNSBUFSIZE");
+  if (x) {
+    scan_ulong(x,&edns);
+    if (edns > EDNSMAX) edns = EDNSMAX;
+    if (edns >= 512) ednssize = edns;
+    dns_transmit_edns(ednssize);
+  }
+  x = env_get("CLIENTMAX");
+  if (x) scan_ulong(x,&clientmax);
+  x = env_get("CLIENTRATE");
+  if (x) scan_ulong(x,&clientrate);
+  x = env_get("STALETIMEOUT");
+  if (x) {
+    scan_ulong(x,&staletimeout);
+    x = env_get("STALEMAX");
+    if (x) scan_ulong(x,&stalemax);
+    cache_stalemax(stalemax);
+  }
+  x = env_get("SERVERMAX");
+  if (x) scan_ulong(x,&servermax);
+  x = env_get("SERVERRATE");
+  if (x) scan_ulong(x,&serverrate);
+  dns_rtt_limit(servermax,serverrate);
+  x = env_get("PEERS");
+  if (x) {
+    x = peerlist(x,&numpeers);
+    if (x) strerr_die3x(111,FATAL,"unable to parse $PEERS at ",x);
+    y = env_get("PEERTIMEOUT");
+    if (y) scan_ulong(y,&peertimeout);
+    query_peers(peers,numpeers,byte_diff(myipoutgoing,4,"\0\0\0\0") ? myipoutgoing : myipincoming,peertimeout);
+  }
+  x = env_get("HEDGE");
+  if (x) {
+    scan_ulong(x,&hedge);
+    dns_transmit_hedge(hedge);
+  }
+  x = env_get("LOGSAMPLE");
+  if (x) {
+    scan_ulong(x,&logsize);
+    log_sample(logsize);
+  }
+  x = env_get("TOPN");
+  if (x) {
+    scan_ulong(x,&logsize);
+    log_topn(logsize);
+  }
+  x = env_get("LOGRATE");
+  if (x) {
+    scan_ulong(x,&logsize);
+    log_ratelimit(logsize);
+  }
+  x = env_get("TRACESLOW");
+  if (x) {
+    scan_ulong(x,&logsize);
+    query_trace(logsize);
+  }
+  x = env_get("METRICS");
+  if (x)
+    if (metrics_init(x,numworkers) == -1)
+      strerr_die2sys(111,FATAL,"unable to set up $METRICS: ");
+  x = env_get("PROFILE");
+  if (x) scan_ulong(x,&profilehz);
+  x = env_get("LOGBUFFER");
+  if (x) {
+    scan_ulong(x,&logsize);
+    if (logbuf_init(logsize) == -1)
+      strerr_die2x(111,FATAL,"out of memory");
+  }
+  x = env_get("LOGRING");
+  if (x && (numworkers > 1)) {
+    scan_ulong(x,&logsize);
+    if (logbuf_ring(logsize) == -1)
+      strerr_die2x(111,FATAL,"out of memory");
+  }
 
   if (!roots_init())
     strerr_die2sys(111,FATAL,"unable to read servers: ");
+  if (!okclient_init())
+    strerr_die2sys(111,FATAL,"unable to read ip: ");
+  x = env_get("PRIME");
+  if (x) prime_init(x,env_get("PRIMETLDS"));
+
+  for (i = 0;i < numsockets;++i)
+    if (socket_listen(tcpworker[i],20) == -1)
+      strerr_die2sys(111,FATAL,"unable to listen on TCP socket: ");
+
+  if (pincpu && env_get("STEER") && (numsockets > 1)) { /* after listen() */
+    if (socket_steercpu(udpworker[0],cpu,numsockets) == -1)
+      strerr_die2sys(111,FATAL,"unable to steer queries by CPU: ");
+    if (socket_steercpu(tcpworker[0],cpu,numsockets) == -1)
+      strerr_die2sys(111,FATAL,"unable to steer connections by CPU: ");
+  }
 
-  if (socket_listen(tcp53,20) == -1)
-    strerr_die2sys(111,FATAL,"unable to listen on TCP socket: ");
+  if (numworkers == 1) worker(0);
 
-  log_startup();
-  doit();
+  for (i = 0;i < numworkers;++i) {
+    pid = fork();
+    if (pid == -1) {
+      killworkers(sig_term);
+      strerr_die2sys(111,FATAL,"unable to fork: ");
+    }
+    if (pid == 0) worker(i);
+    pidworker[i] = pid;
+  }
+  for (i = 0;i < numsockets;++i) {
+    close(udpworker[i]);
+    close(tcpworker[i]);
+  }
+  if (handoffsocket != -1) close(handoffsocket);
+  supervise();
 }
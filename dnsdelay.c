@@ -0,0 +1,173 @@
+#include <unistd.h>
+#include "uint16.h"
+#include "strerr.h"
+#include "scan.h"
+#include "byte.h"
+#include "ip4.h"
+#include "taia.h"
+#include "iopause.h"
+#include "socket.h"
+#include "sgetopt.h"
+#include "exit.h"
+
+#define FATAL "dnsdelay: fatal: "
+
+/*
+Stands in front of a DNS server as a slow or lossy network would:
+takes UDP queries at ip port 53, drops -l per cent of them, holds
+the rest -d milliseconds, plus up to -j more, and passes them to the
+server at port 53; answers go straight back to their clients. Queries
+leave in the order they came, so jitter delays but never reorders.
+Which queries are dropped and how long each is held depends only on
+-s, so a run can be repeated. TCP is not passed on.
+*/
+
+void usage(void)
+{
+  strerr_die1x(100,"dnsdelay: usage: dnsdelay [ -d ms ] [ -j ms ] [ -l percent ] [ -s seed ] ip server");
+}
+
+#define PENDING 4096 /* queries held at once; more are dropped */
+
+static struct pending {
+  struct taia due;
+  char buf[512];
+  unsigned int len;
+} pending[PENDING];
+static unsigned int head = 0; /* oldest */
+static unsigned int num = 0;
+
+/* who asked, by the ID the server sees */
+static struct client {
+  char ip[4];
+  uint16 port;
+  char id[2];
+  int flagused;
+} client[65536];
+static unsigned int nextid = 0;
+
+static unsigned long delay = 0;
+static unsigned long jitter = 0;
+static unsigned long loss = 0;
+static unsigned long seed = 1;
+
+/* xorshift64*, as in dnsgen */
+static unsigned long long state;
+
+static unsigned long below(unsigned long n)
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  if (!n) return 0;
+  return (unsigned long) ((((state * 2685821657736338717ULL) >> 32) * n) >> 32);
+}
+
+static char buf[4096];
+
+int main(int argc,char **argv)
+{
+  struct taia now;
+  struct taia deadline;
+  struct taia t;
+  struct taia last;
+  iopause_fd x[2];
+  struct pending *p;
+  char ip[4];
+  char serverip[4];
+  char from[4];
+  uint16 port;
+  uint16 id;
+  unsigned long ms;
+  int opt;
+  int s;
+  int u;
+  int r;
+
+  while ((opt = getopt(argc,argv,"d:j:l:s:")) != opteof)
+    switch(opt) {
+      case 'd': scan_ulong(optarg,&delay); break;
+      case 'j': scan_ulong(optarg,&jitter); break;
+      case 'l': scan_ulong(optarg,&loss); break;
+      case 's': scan_ulong(optarg,&seed); break;
+      default: usage();
+    }
+  argv += optind;
+  if (!argv[0] || !argv[1]) usage();
+  if (!ip4_scan(argv[0],ip)) usage();
+  if (!ip4_scan(argv[1],serverip)) usage();
+  state = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+  s = socket_udp();
+  if (s == -1) strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+  if (socket_bind4_reuse(s,ip,53) == -1)
+    strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+  socket_tryreservein(s,1048576);
+  u = socket_udp();
+  if (u == -1) strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+  if (socket_bind4(u,ip,0) == -1)
+    strerr_die2sys(111,FATAL,"unable to bind UDP socket: ");
+  socket_tryreservein(u,1048576);
+
+  taia_now(&last);
+  for (;;) {
+    taia_now(&now);
+    while (num && !taia_less(&now,&pending[head].due)) {
+      p = pending + head;
+      socket_send4(u,p->buf,p->len,serverip,53);
+      head = (head + 1) % PENDING;
+      --num;
+    }
+
+    taia_uint(&t,10);
+    taia_add(&deadline,&now,&t);
+    if (num) deadline = pending[head].due;
+    x[0].fd = s;
+    x[0].events = IOPAUSE_READ;
+    x[1].fd = u;
+    x[1].events = IOPAUSE_READ;
+    iopause(x,2,&deadline,&now);
+
+    if (x[0].revents)
+      for (;;) {
+        r = socket_recv4(s,buf,sizeof buf,from,&port);
+        if (r == -1) break;
+        if ((r < 12) || (r > sizeof pending[0].buf)) continue;
+        if (below(100) < loss) continue;
+        if (num == PENDING) continue;
+
+        id = nextid++;
+        byte_copy(client[id].ip,4,from);
+        client[id].port = port;
+        byte_copy(client[id].id,2,buf);
+        client[id].flagused = 1;
+
+        p = pending + (head + num) % PENDING;
+        byte_copy(p->buf,r,buf);
+        p->buf[0] = id >> 8;
+        p->buf[1] = id;
+        p->len = r;
+        ms = delay + below(jitter + 1);
+        taia_uint(&t,ms / 1000);
+        t.nano = (ms % 1000) * 1000000;
+        taia_now(&now);
+        taia_add(&p->due,&now,&t);
+        if (taia_less(&p->due,&last)) p->due = last;
+        last = p->due;
+        ++num;
+      }
+
+    if (x[1].revents)
+      for (;;) {
+        r = socket_recv4(u,buf,sizeof buf,from,&port);
+        if (r == -1) break;
+        if (r < 12) continue;
+        if (byte_diff(from,4,serverip) || (port != 53)) continue;
+        id = ((unsigned char) buf[0] << 8) + (unsigned char) buf[1];
+        if (!client[id].flagused) continue;
+        client[id].flagused = 0;
+        byte_copy(buf,2,client[id].id);
+        socket_send4(s,buf,r,client[id].ip,client[id].port);
+      }
+  }
+}
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include "uint32.h"
 #include "strerr.h"
 #include "buffer.h"
 #include "stralloc.h"
@@ -20,17 +21,30 @@ void nomem(void)
   strerr_die2x(111,FATAL,"out of memory");
 }
 
+/*
+Lines wait in a ring of -l slots until they reach the front and their
+lookup is done, so output stays in input order. Only -c lookups are
+in flight at once, through dns_async_start(); a line whose address is
+already being looked up waits on that lookup instead of starting its
+own, and an answer seen before comes from the dns_cache_get() cache
+while its TTL lasts.
+*/
+
+#define NONE ((unsigned int) -1)
+
 struct line {
   stralloc left;
   stralloc middle;
   stralloc right;
-  struct dns_transmit dt;
+  char ip[4];
   int flagactive;
-  iopause_fd *io;
+  unsigned int next; /* next line waiting on the same lookup */
 } *x;
-struct line tmp;
 unsigned int xmax = 1000;
+unsigned int xhead = 0;
 unsigned int xnum = 0;
+
+struct dns_async a;
 unsigned int numactive = 0;
 unsigned int maxactive = 10;
 
@@ -48,23 +62,134 @@ char servers[64];
 char ip[4];
 char name[DNS_NAME4_DOMAIN];
 
-void errout(int i)
+void errout(struct line *l)
 {
   int j;
 
-  if (!stralloc_copys(&x[i].middle,":")) nomem();
-  if (!stralloc_cats(&x[i].middle,error_str(errno))) nomem();
-  for (j = 0;j < x[i].middle.len;++j)
-    if (x[i].middle.s[j] == ' ')
-      x[i].middle.s[j] = '-';
+  if (!stralloc_copys(&l->middle,":")) nomem();
+  if (!stralloc_cats(&l->middle,error_str(errno))) nomem();
+  for (j = 0;j < l->middle.len;++j)
+    if (l->middle.s[j] == ' ')
+      l->middle.s[j] = '-';
+}
+
+static unsigned int iphash(const char addr[4])
+{
+  uint32 u;
+
+  uint32_unpack(addr,&u);
+  u *= 2654435761UL;
+  return u ^ (u >> 15);
+}
+
+/* addresses being looked up: the line that started each, plus 1 */
+
+static unsigned int *pend;
+static unsigned int pendmask;
+
+static unsigned int *pend_slot(const char addr[4])
+{
+  unsigned int i;
+
+  i = iphash(addr) & pendmask;
+  while (pend[i] && byte_diff(x[pend[i] - 1].ip,4,addr))
+    i = (i + 1) & pendmask;
+  return pend + i;
+}
+
+static void pend_remove(const char addr[4])
+{
+  unsigned int i;
+  unsigned int j;
+  unsigned int k;
+
+  i = pend_slot(addr) - pend;
+  if (!pend[i]) return;
+  pend[i] = 0;
+  for (j = (i + 1) & pendmask;pend[j];j = (j + 1) & pendmask) {
+    k = iphash(x[pend[j] - 1].ip) & pendmask;
+    if (((j - k) & pendmask) >= ((j - i) & pendmask)) {
+      pend[i] = pend[j];
+      pend[j] = 0;
+      i = j;
+    }
+  }
+}
+
+#define CACHESIZE 65536
+
+void answer(struct line *l,stralloc *middle,int flagname)
+{
+  if (!stralloc_copy(&l->middle,middle)) nomem();
+  if (flagname && l->middle.len)
+    if (!stralloc_cats(&l->left,"=")) nomem();
+  l->flagactive = 0;
+}
+
+/* handles the end of the lookup for line l */
+void done(struct line *l,int r,char *packet,unsigned int len)
+{
+  unsigned int j;
+  int flagname = 0;
+
+  if (r == -1)
+    errout(l);
+  else {
+    if (dns_name_packet(&l->middle,packet,len) == -1)
+      errout(l);
+    else
+      flagname = 1;
+    alloc_free(packet);
+  }
+  if (flagname && l->middle.len)
+    if (!stralloc_cats(&l->left,"=")) nomem();
+  l->flagactive = 0;
+  pend_remove(l->ip);
+  for (j = l->next;j != NONE;j = x[j].next)
+    answer(x + j,&l->middle,flagname);
+  --numactive;
+}
+
+/* starts the lookup for the new line at slot i */
+void start(unsigned int i)
+{
+  struct line *l = x + i;
+  unsigned int *slot;
+
+  byte_copy(l->ip,4,ip);
+  l->next = NONE;
+
+  slot = pend_slot(ip);
+  if (*slot) {
+    l->next = x[*slot - 1].next;
+    x[*slot - 1].next = i;
+    l->flagactive = 1;
+    return;
+  }
+
+  dns_name4_domain(name,ip);
+  if (dns_resolvconfip(servers) == -1)
+    strerr_die2sys(111,FATAL,"unable to read /etc/resolv.conf: ");
+  if (dns_async_start(&a,name,DNS_T_PTR,l) == -1) {
+    errout(l);
+    return;
+  }
+  ++numactive;
+  *slot = i + 1;
+  l->flagactive = 1;
 }
 
 int main(int argc,char **argv)
 {
   struct taia stamp;
   struct taia deadline;
+  struct line *l;
+  void *data;
+  char *packet;
+  unsigned int len;
   int opt;
   unsigned long u;
+  unsigned int n;
   int i;
   int j;
   int r;
@@ -74,13 +199,13 @@ int main(int argc,char **argv)
       case 'c':
 	scan_ulong(optarg,&u);
 	if (u < 1) u = 1;
-	if (u > 1000) u = 1000;
+	if (u > 65536) u = 65536;
 	maxactive = u;
 	break;
       case 'l':
 	scan_ulong(optarg,&u);
 	if (u < 1) u = 1;
-	if (u > 1000000) u = 1000000;
+	if (u > 10000000) u = 10000000;
 	xmax = u;
 	break;
       default:
@@ -91,14 +216,25 @@ int main(int argc,char **argv)
   if (!x) nomem();
   byte_zero(x,xmax * sizeof(struct line));
 
-  io = (iopause_fd *) alloc((xmax + 1) * sizeof(iopause_fd)); 
+  if (dns_async_init(&a,maxactive) == -1) nomem();
+
+  for (n = 64;n < 2 * maxactive;n <<= 1) ;
+  pend = (unsigned int *) alloc(n * sizeof(unsigned int));
+  if (!pend) nomem();
+  byte_zero(pend,n * sizeof(unsigned int));
+  pendmask = n - 1;
+
+  if (!dns_cache_init(CACHESIZE)) nomem();
+
+  io = (iopause_fd *) alloc((maxactive + 1) * sizeof(iopause_fd));
   if (!io) nomem();
 
   if (!stralloc_copys(&partial,"")) nomem();
 
+  iopause_persistent();
 
   while (flag0 || inbuflen || partial.len || xnum) {
-    taia_now(&stamp);
+    taia_clock(&stamp);
     taia_uint(&deadline,120);
     taia_add(&deadline,&deadline,&stamp);
 
@@ -111,12 +247,9 @@ int main(int argc,char **argv)
         inio->events = IOPAUSE_READ;
       }
 
-    for (i = 0;i < xnum;++i)
-      if (x[i].flagactive) {
-	x[i].io = io + iolen++;
-	dns_transmit_io(&x[i].dt,x[i].io,&deadline);
-      }
+    iolen += dns_async_io(&a,io + iolen,&deadline);
 
+    buffer_flush(buffer_1);
     iopause(io,iolen,&deadline,&stamp);
 
     if (flag0)
@@ -128,36 +261,20 @@ int main(int argc,char **argv)
 	  else
 	    inbuflen += r;
         }
-    
-    for (i = 0;i < xnum;++i)
-      if (x[i].flagactive) {
-	r = dns_transmit_get(&x[i].dt,x[i].io,&stamp);
-	if (r == -1) {
-	  errout(i);
-	  x[i].flagactive = 0;
-	  --numactive;
-	}
-	else if (r == 1) {
-	  if (dns_name_packet(&x[i].middle,x[i].dt.packet,x[i].dt.packetlen) == -1)
-	    errout(i);
-	  if (x[i].middle.len)
-	    if (!stralloc_cats(&x[i].left,"=")) nomem();
-	  x[i].flagactive = 0;
-	  --numactive;
-	}
-      }
+
+    dns_async_get(&a,&stamp);
+    while ((r = dns_async_reap(&a,&data,&packet,&len)))
+      done((struct line *) data,r,packet,len);
 
     for (;;) {
 
-      if (xnum && !x[0].flagactive) {
-        buffer_put(buffer_1,x[0].left.s,x[0].left.len);
-        buffer_put(buffer_1,x[0].middle.s,x[0].middle.len);
-        buffer_put(buffer_1,x[0].right.s,x[0].right.len);
-        buffer_flush(buffer_1);
+      if (xnum && !x[xhead].flagactive) {
+        l = x + xhead;
+        buffer_put(buffer_1,l->left.s,l->left.len);
+        buffer_put(buffer_1,l->middle.s,l->middle.len);
+        buffer_put(buffer_1,l->right.s,l->right.len);
         --xnum;
-        tmp = x[0];
-        for (i = 0;i < xnum;++i) x[i] = x[i + 1];
-        x[xnum] = tmp;
+        if (++xhead == xmax) xhead = 0;
 	continue;
       }
 
@@ -174,33 +291,28 @@ int main(int argc,char **argv)
 	  if (!stralloc_catb(&partial,inbuf,i)) nomem();
 	  inbuflen -= i;
 	  for (j = 0;j < inbuflen;++j) inbuf[j] = inbuf[j + i];
-  
+
 	  if (partial.len) {
+	    n = xhead + xnum;
+	    if (n >= xmax) n -= xmax;
+	    l = x + n;
+
 	    i = byte_chr(partial.s,partial.len,'\n');
 	    i = byte_chr(partial.s,i,'\t');
 	    i = byte_chr(partial.s,i,' ');
-    
-	    if (!stralloc_copyb(&x[xnum].left,partial.s,i)) nomem();
-	    if (!stralloc_copys(&x[xnum].middle,"")) nomem();
-	    if (!stralloc_copyb(&x[xnum].right,partial.s + i,partial.len - i)) nomem();
-	    x[xnum].flagactive = 0;
-  
+
+	    if (!stralloc_copyb(&l->left,partial.s,i)) nomem();
+	    if (!stralloc_copys(&l->middle,"")) nomem();
+	    if (!stralloc_copyb(&l->right,partial.s + i,partial.len - i)) nomem();
+	    l->flagactive = 0;
+
 	    partial.len = i;
 	    if (!stralloc_0(&partial)) nomem();
-	    if (ip4_scan(partial.s,ip)) {
-	      dns_name4_domain(name,ip);
-	      if (dns_resolvconfip(servers) == -1)
-	        strerr_die2sys(111,FATAL,"unable to read /etc/resolv.conf: ");
-	      if (dns_transmit_start(&x[xnum].dt,servers,1,name,DNS_T_PTR,"\0\0\0\0") == -1)
-	        errout(xnum);
-	      else {
-	        x[xnum].flagactive = 1;
-	        ++numactive;
-	      }
-	    }
+	    if (ip4_scan(partial.s,ip))
+	      start(n);
 	    ++xnum;
 	  }
-  
+
 	  partial.len = 0;
 	  continue;
 	}
@@ -210,5 +322,6 @@ int main(int argc,char **argv)
     }
   }
 
+  buffer_flush(buffer_1);
   _exit(0);
 }
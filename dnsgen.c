@@ -0,0 +1,430 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "uint32.h"
+#include "strerr.h"
+#include "buffer.h"
+#include "alloc.h"
+#include "scan.h"
+#include "str.h"
+#include "case.h"
+#include "fmt.h"
+#include "open.h"
+#include "sgetopt.h"
+#include "exit.h"
+
+#define FATAL "dnsgen: fatal: "
+
+/*
+Writes a synthetic data file and a matching query workload into the
+current directory: with tinydns, data for tinydns-data; with rbldns,
+data for rbldns-data. The queries file has one "type name" line per
+query, for dnsreplay, with names drawn under a Zipf distribution (the
+name of rank r has weight 1/(r+1), and the ranks are shuffled, so
+popularity has nothing to do with the order in data).
+
+For tinydns: -n names in -z zones under .test, each -d labels deep at
+most, with record types mixed as -m says, such as
+a=60,aaaa=15,mx=5,txt=10,cname=5,ns=5; -w per cent of the names are
+wildcards; with -l, that many locations, and a quarter of the A names
+answer differently in one of them; -x per cent of the queries are for
+names that do not exist.
+
+For rbldns: -n addresses and networks under -b; half of the queries
+are for listed addresses.
+
+The output depends only on the options and on -s; so a dataset can
+be made again anywhere instead of being copied around.
+*/
+
+void usage(void)
+{
+  strerr_die1x(100,"dnsgen: usage: dnsgen [ -n names ] [ -z zones ] [ -d depth ] [ -m mix ] [ -w wildcards ] [ -l locations ] [ -q queries ] [ -x nxdomains ] [ -b base ] [ -s seed ] tinydns|rbldns");
+}
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+void die_write(const char *fn)
+{
+  strerr_die4sys(111,FATAL,"unable to write ",fn,": ");
+}
+
+#define T_A 0
+#define T_AAAA 1
+#define T_MX 2
+#define T_TXT 3
+#define T_CNAME 4
+#define T_NS 5
+#define TYPES 6
+
+static const char *typename[TYPES] = { "a", "aaaa", "mx", "txt", "cname", "ns" } ;
+static unsigned long mix[TYPES] = { 60, 15, 5, 10, 5, 5 } ;
+
+static unsigned long names = 100000;
+static unsigned long zones = 100;
+static unsigned long depth = 3;
+static unsigned long wildcards = 5;
+static unsigned long locations = 0;
+static unsigned long queries = 1000000;
+static unsigned long nxdomains = 5;
+static const char *base = "rbl.test";
+static unsigned long seed = 1;
+
+/* xorshift64*: the same stream on every system */
+static unsigned long long state;
+
+static uint32 rnd(void)
+{
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return (state * 2685821657736338717ULL) >> 32;
+}
+
+static unsigned long below(unsigned long n)
+{
+  if (!n) return 0;
+  return (unsigned long) (((unsigned long long) rnd() * n) >> 32);
+}
+
+static char outspace[8192];
+static buffer out;
+static int fdout;
+static const char *fnout;
+
+static void put(const char *s,unsigned int len)
+{
+  if (buffer_put(&out,s,len) == -1) die_write(fnout);
+}
+static void outs(const char *s)
+{
+  put(s,str_len(s));
+}
+static void putnum(unsigned long u)
+{
+  char strnum[FMT_ULONG];
+  put(strnum,fmt_ulong(strnum,u));
+}
+static void putip(uint32 ip)
+{
+  putnum(ip >> 24); outs(".");
+  putnum((ip >> 16) & 255); outs(".");
+  putnum((ip >> 8) & 255); outs(".");
+  putnum(ip & 255);
+}
+
+static void start(const char *fn)
+{
+  fnout = fn;
+  fdout = open_trunc(fn);
+  if (fdout == -1) die_write(fn);
+  buffer_init(&out,buffer_unixwrite,fdout,outspace,sizeof outspace);
+}
+static void finish(const char *fn,const char *fnfinal)
+{
+  if (buffer_flush(&out) == -1) die_write(fn);
+  if (fsync(fdout) == -1) die_write(fn);
+  if (close(fdout) == -1) die_write(fn); /* NFS stupidity */
+  if (rename(fn,fnfinal) == -1)
+    strerr_die6sys(111,FATAL,"unable to move ",fn," to ",fnfinal,": ");
+}
+
+/* Zipf ranks 0..n-1, then rank r is item perm[r] */
+static double *cdf;
+static uint32 *perm;
+
+static void zipfinit(unsigned long n)
+{
+  double sum = 0;
+  unsigned long i;
+  unsigned long j;
+  uint32 t;
+
+  cdf = (double *) alloc(n * sizeof(double));
+  perm = (uint32 *) alloc(n * sizeof(uint32));
+  if (!cdf || !perm) nomem();
+  for (i = 0;i < n;++i) {
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+    perm[i] = i;
+  }
+  for (i = n;i > 1;--i) {
+    j = below(i);
+    t = perm[i - 1]; perm[i - 1] = perm[j]; perm[j] = t;
+  }
+}
+
+static unsigned long zipf(unsigned long n)
+{
+  double x;
+  unsigned long lo;
+  unsigned long hi;
+  unsigned long mid;
+
+  x = (rnd() / 4294967296.0) * cdf[n - 1];
+  lo = 0; hi = n - 1;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < x) lo = mid + 1; else hi = mid;
+  }
+  return perm[lo];
+}
+
+static void parsemix(const char *s)
+{
+  unsigned int len;
+  unsigned int i;
+  unsigned int j;
+  unsigned long u;
+
+  for (i = 0;i < TYPES;++i) mix[i] = 0;
+  while (*s) {
+    len = str_chr(s,'=');
+    if (!s[len]) usage();
+    for (i = 0;i < TYPES;++i)
+      if ((str_len(typename[i]) == len) && !case_diffb(s,len,typename[i])) break;
+    if (i == TYPES) usage();
+    s += len + 1;
+    j = scan_ulong(s,&u);
+    if (!j) usage();
+    mix[i] = u;
+    s += j;
+    if (*s == ',') ++s;
+    else if (*s) usage();
+  }
+  u = 0;
+  for (i = 0;i < TYPES;++i) u += mix[i];
+  if (!u) usage();
+}
+
+/* name i: its own label, up to depth - 1 more, then its zone */
+static unsigned char *type;
+static unsigned char *extra; /* labels between the own label and the zone */
+static uint32 *zone;
+static unsigned char *flags;
+#define F_WILD 1
+#define F_LOC 2
+
+static void putzone(unsigned long z)
+{
+  outs("z"); putnum(z); outs(".test");
+}
+static void putsuffix(unsigned long i)
+{
+  unsigned int k;
+
+  for (k = 0;k < extra[i];++k) {
+    outs("l"); putnum((i + k) % 10); outs(".");
+  }
+  putzone(zone[i]);
+}
+static void putname(unsigned long i)
+{
+  if (flags[i] & F_WILD) outs("*.");
+  outs("n"); putnum(i); outs(".");
+  putsuffix(i);
+}
+/* a name that exists, or matches the wildcard */
+static void putqname(unsigned long i)
+{
+  if (flags[i] & F_WILD) { outs("w"); putnum(rnd()); outs("."); }
+  else if (type[i] == T_NS) outs("www.");
+  outs("n"); putnum(i); outs(".");
+  putsuffix(i);
+}
+static void putloc(unsigned long k)
+{
+  char ch[2];
+  ch[0] = 'a' + k / 26;
+  ch[1] = 'a' + k % 26;
+  put(ch,2);
+}
+
+static uint32 ipof(unsigned long i,unsigned int k)
+{
+  return 0x0a000000 + ((i * 4 + k) & 0xffffff);
+}
+
+static void tinydns(void)
+{
+  unsigned long total;
+  unsigned long i;
+  unsigned long u;
+  unsigned int t;
+  unsigned int k;
+  char ch[4];
+
+  if (!zones) usage();
+  if (locations > 676) locations = 676;
+  type = (unsigned char *) alloc(names);
+  extra = (unsigned char *) alloc(names);
+  flags = (unsigned char *) alloc(names);
+  zone = (uint32 *) alloc(names * sizeof(uint32));
+  if (!type || !extra || !flags || !zone) nomem();
+
+  total = 0;
+  for (t = 0;t < TYPES;++t) total += mix[t];
+
+  start("data.tmp");
+
+  for (k = 0;k < locations;++k) {
+    outs("%"); putloc(k); outs(":172."); putnum(16 + k / 256); outs(".");
+    putnum(k % 256); outs("\n");
+  }
+  if (locations) outs("%x\n");
+
+  for (u = 0;u < zones;++u) {
+    outs("."); putzone(u); outs(":192.0.2."); putnum(1 + u % 254);
+    outs(":a\n");
+  }
+
+  for (i = 0;i < names;++i) {
+    u = below(total);
+    for (t = 0;u >= mix[t];++t) u -= mix[t];
+    type[i] = t;
+    zone[i] = below(zones);
+    extra[i] = depth > 1 ? below(depth) : 0;
+    flags[i] = 0;
+    if (below(100) < wildcards) flags[i] |= F_WILD;
+    if (locations && (t == T_A) && !below(4)) flags[i] |= F_LOC;
+
+    switch (t) {
+      case T_A:
+        if (flags[i] & F_LOC) {
+          outs("+"); putname(i); outs(":"); putip(ipof(i,0));
+          outs(":::"); putloc(below(locations)); outs("\n");
+          outs("+"); putname(i); outs(":"); putip(ipof(i,1));
+          outs(":::x\n");
+          break;
+        }
+        u = below(2);
+        for (k = 0;k <= u;++k) {
+          outs("+"); putname(i); outs(":"); putip(ipof(i,k)); outs("\n");
+        }
+        break;
+      case T_AAAA:
+        outs(":"); putname(i); outs(":28:\\040\\001\\015\\270");
+        uint32_pack_big(ch,ipof(i,0));
+        for (k = 0;k < 8;++k) outs("\\000");
+        for (k = 0;k < 4;++k) {
+          outs("\\");
+          putnum(((unsigned char) ch[k] >> 6) & 7);
+          putnum(((unsigned char) ch[k] >> 3) & 7);
+          putnum((unsigned char) ch[k] & 7);
+        }
+        outs("\n");
+        break;
+      case T_MX:
+        outs("@"); putname(i); outs(":"); putip(ipof(i,0)); outs(":mx\n");
+        break;
+      case T_TXT:
+        outs("'"); putname(i); outs(":v=spf1 ip4:");
+        putip(ipof(i,0)); outs("/30 -all\n");
+        break;
+      case T_CNAME:
+        outs("C"); putname(i); outs(":");
+        if (i) { u = below(i); outs("n"); putnum(u); outs("."); putsuffix(u); }
+        else putzone(zone[i]);
+        outs("\n");
+        break;
+      case T_NS:
+        flags[i] &= ~F_WILD;
+        outs("&"); putname(i); outs(":"); putip(ipof(i,0)); outs(":ns\n");
+        break;
+    }
+  }
+
+  finish("data.tmp","data");
+
+  start("queries.tmp");
+  zipfinit(names);
+  for (u = 0;u < queries;++u) {
+    if (below(100) < nxdomains) {
+      outs("a nx"); putnum(rnd()); outs("."); putzone(below(zones)); outs("\n");
+      continue;
+    }
+    i = zipf(names);
+    switch (type[i]) {
+      case T_CNAME: case T_NS: outs("a "); break;
+      default: outs(typename[type[i]]); outs(" "); break;
+    }
+    putqname(i);
+    outs("\n");
+  }
+  finish("queries.tmp","queries");
+}
+
+static void rbldns(void)
+{
+  uint32 *ip;
+  unsigned long i;
+  unsigned long u;
+  uint32 x;
+
+  ip = (uint32 *) alloc(names * sizeof(uint32));
+  if (!ip) nomem();
+
+  start("data.tmp");
+  outs(":127.0.0.2:Listed, see http://"); outs(base); outs("/$\n");
+  for (i = 0;i < names;++i) {
+    x = rnd();
+    if (!below(10)) {
+      x &= 0xffffff00;
+      putip(x); outs("/24\n");
+      x += 1 + below(254);
+    }
+    else {
+      putip(x); outs("\n");
+    }
+    ip[i] = x;
+  }
+  finish("data.tmp","data");
+
+  start("queries.tmp");
+  zipfinit(names);
+  for (u = 0;u < queries;++u) {
+    x = below(2) ? ip[zipf(names)] : rnd();
+    outs(below(10) ? "a " : "txt ");
+    putnum(x & 255); outs(".");
+    putnum((x >> 8) & 255); outs(".");
+    putnum((x >> 16) & 255); outs(".");
+    putnum(x >> 24); outs(".");
+    outs(base); outs("\n");
+  }
+  finish("queries.tmp","queries");
+}
+
+int main(int argc,char **argv)
+{
+  int opt;
+
+  while ((opt = getopt(argc,argv,"n:z:d:m:w:l:q:x:b:s:")) != opteof)
+    switch (opt) {
+      case 'n': scan_ulong(optarg,&names); break;
+      case 'z': scan_ulong(optarg,&zones); break;
+      case 'd': scan_ulong(optarg,&depth); break;
+      case 'm': parsemix(optarg); break;
+      case 'w': scan_ulong(optarg,&wildcards); break;
+      case 'l': scan_ulong(optarg,&locations); break;
+      case 'q': scan_ulong(optarg,&queries); break;
+      case 'x': scan_ulong(optarg,&nxdomains); break;
+      case 'b': base = optarg; break;
+      case 's': scan_ulong(optarg,&seed); break;
+      default: usage();
+    }
+  argv += optind;
+  if (!*argv) usage();
+  if (!names) usage();
+  if (depth > 127) depth = 127;
+
+  state = 0x9e3779b97f4a7c15ULL ^ seed;
+  if (!state) state = 1;
+  rnd();
+
+  if (str_equal(*argv,"tinydns")) tinydns();
+  else if (str_equal(*argv,"rbldns")) rbldns();
+  else usage();
+
+  _exit(0);
+}
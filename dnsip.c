@@ -2,38 +2,65 @@
 #include "exit.h"
 #include "strerr.h"
 #include "ip4.h"
+#include "byte.h"
+#include "scan.h"
+#include "sgetopt.h"
 #include "dns.h"
+#include "dnsargs.h"
 
 #define FATAL "dnsip: fatal: "
 
 static char seed[128];
 
 static stralloc fqdn;
-static stralloc out;
 char str[IP4_FMT];
 
-int main(int argc,char **argv)
+int query(const char *arg,stralloc *out,char **q,char *qtype)
+{
+  int r;
+
+  if (!stralloc_copys(&fqdn,arg)) return -1;
+  r = dns_ip4_literal(out,&fqdn);
+  if (r) return r == 1 ? 0 : -1;
+  if (!dns_domain_fromdot(q,fqdn.s,fqdn.len)) return -1;
+  byte_copy(qtype,2,DNS_T_A);
+  return 1;
+}
+
+void print(const char *arg,stralloc *out)
 {
   int i;
 
-  dns_random_init(seed);
+  for (i = 0;i + 4 <= out->len;i += 4) {
+    buffer_put(buffer_1,str,ip4_fmt(str,out->s + i));
+    buffer_puts(buffer_1," ");
+  }
+  buffer_puts(buffer_1,"\n");
+}
+
+struct dnsargs d = {
+  FATAL, "unable to find IP address for ", query, dns_ip4_packet, print
+} ;
 
-  if (*argv) ++argv;
+int main(int argc,char **argv)
+{
+  unsigned long u = 100;
+  int opt;
 
-  while (*argv) {
-    if (!stralloc_copys(&fqdn,*argv))
-      strerr_die2x(111,FATAL,"out of memory");
-    if (dns_ip4(&out,&fqdn) == -1)
-      strerr_die4sys(111,FATAL,"unable to find IP address for ",*argv,": ");
+  dns_random_init(seed);
 
-    for (i = 0;i + 4 <= out.len;i += 4) {
-      buffer_put(buffer_1,str,ip4_fmt(str,out.s + i));
-      buffer_puts(buffer_1," ");
+  while ((opt = getopt(argc,argv,"c:")) != opteof)
+    switch(opt) {
+      case 'c':
+	scan_ulong(optarg,&u);
+	if (u < 1) u = 1;
+	if (u > 65536) u = 65536;
+	break;
+      default:
+	strerr_die1x(100,"dnsip: usage: dnsip [ -c concurrency ] fqdn ...");
     }
-    buffer_puts(buffer_1,"\n");
 
-    ++argv;
-  }
+  dnsargs(&d,argv + optind,u);
 
   buffer_flush(buffer_1);
   _exit(0);
@@ -0,0 +1,575 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "uint64.h"
+#include "strerr.h"
+#include "buffer.h"
+#include "getln.h"
+#include "stralloc.h"
+#include "alloc.h"
+#include "scan.h"
+#include "str.h"
+#include "byte.h"
+#include "fmt.h"
+#include "open.h"
+#include "seek.h"
+#include "error.h"
+#include "topn.h"
+#include "qlog.h"
+#include "sgetopt.h"
+#include "exit.h"
+
+#define FATAL "dnslogstats: fatal: "
+
+/*
+Sums up logs from dnscache, or from tinydns and its relatives, text
+or $LOGBINARY, by hour of the multilog timestamps: lines, queries,
+cached answers, queries sent out, records taken in, responses and
+their bytes, drops, servfails, nxdomains, the cache hit rate from
+the interval lines and latency percentiles from the latency lines.
+Then the -n heaviest query names, clients, servfailing names and lame
+servers, as Space-Saving counts with their error bounds.
+
+With -j, each file named is cut into that many pieces at line
+boundaries, and as many processes work through one piece of every
+file each; the parent puts their sums together. Input from stdin is
+read by one process.
+
+The hours are printed as TAI64N labels, for tai64nlocal.
+*/
+
+void usage(void)
+{
+  strerr_die1x(100,"dnslogstats: usage: dnslogstats [ -j workers ] [ -n top ] [ file ... ]");
+}
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+
+#define H_LINES 0
+#define H_QUERY 1
+#define H_CACHED 2
+#define H_TX 3
+#define H_RR 4
+#define H_SENT 5
+#define H_BYTES 6
+#define H_DROP 7
+#define H_SERVFAIL 8
+#define H_NXDOMAIN 9
+#define H_HITS 10
+#define H_MISSES 11
+#define H_LATENCY 12
+#define LATENCYBUCKETS 16 /* as in dnscache: bucket i, under 2^i ms */
+#define FIELDS (H_LATENCY + LATENCYBUCKETS)
+
+static const char *fieldname[H_LATENCY] = {
+  "lines", "queries", "cached", "tx", "rr", "sent", "bytes", "drop"
+, "servfail", "nxdomain", "hits", "misses"
+} ;
+
+#define NOHOUR 0xffffffffffffffffULL
+#define TAIBASE 4611686018427387914ULL /* 2^62 + 10 */
+
+struct hour {
+  uint64 hour; /* TAI64 label of its first second, or NOHOUR */
+  uint64 f[FIELDS];
+} ;
+
+static struct hour *hours;
+static unsigned int numhours = 0;
+static unsigned int maxhours = 0;
+static unsigned int lasthour = 0;
+
+static uint64 *field(uint64 h)
+{
+  struct hour *x;
+  unsigned int i;
+
+  if ((lasthour < numhours) && (hours[lasthour].hour == h))
+    return hours[lasthour].f;
+  for (i = 0;i < numhours;++i)
+    if (hours[i].hour == h) { lasthour = i; return hours[i].f; }
+
+  if (numhours == maxhours) {
+    maxhours = maxhours + (maxhours >> 1) + 64;
+    x = (struct hour *) alloc(maxhours * sizeof(struct hour));
+    if (!x) nomem();
+    byte_copy(x,numhours * sizeof(struct hour),hours);
+    if (hours) alloc_free((char *) hours);
+    hours = x;
+  }
+  /* kept in order; logs come mostly in order, so this is short */
+  for (i = numhours;i > 0;--i) {
+    if (hours[i - 1].hour < h) break;
+    hours[i] = hours[i - 1];
+  }
+  hours[i].hour = h;
+  byte_zero((char *) hours[i].f,sizeof hours[i].f);
+  ++numhours;
+  lasthour = i;
+  return hours[i].f;
+}
+
+#define T_NAME 0
+#define T_CLIENT 1
+#define T_SERVFAIL 2
+#define T_LAME 3
+#define TABLES 4
+
+static const char *tablename[TABLES] = {
+  "topname", "topclient", "topservfail", "toplame"
+} ;
+static struct topn table[TABLES];
+
+/* the line, cut into words */
+
+#define WORDS 8
+static char *word[WORDS];
+static unsigned int wordlen[WORDS];
+static unsigned int words;
+
+static void split(char *s,unsigned int len)
+{
+  unsigned int i;
+
+  words = 0;
+  while (len && (words < WORDS)) {
+    i = byte_chr(s,len,' ');
+    word[words] = s;
+    wordlen[words] = i;
+    ++words;
+    if (i == len) break;
+    s += i + 1;
+    len -= i + 1;
+  }
+}
+
+static int is(unsigned int w,const char *s)
+{
+  unsigned int len = str_len(s);
+  return (w < words) && (wordlen[w] == len) && byte_equal(word[w],len,s);
+}
+
+static uint64 num(unsigned int w)
+{
+  uint64 u = 0;
+  unsigned int i;
+
+  if (w >= words) return 0;
+  for (i = 0;i < wordlen[w];++i) {
+    if ((word[w][i] < '0') || (word[w][i] > '9')) break;
+    u = u * 10 + (word[w][i] - '0');
+  }
+  return u;
+}
+
+/* adds the numbers after each space in s to u[0], u[1], ... */
+static void numbers(const char *s,unsigned int len,uint64 *u,unsigned int n)
+{
+  uint64 x;
+
+  while (len && n) {
+    if (*s != ' ') break;
+    ++s; --len;
+    x = 0;
+    while (len && (*s >= '0') && (*s <= '9')) {
+      x = x * 10 + (*s++ - '0');
+      --len;
+    }
+    *u++ += x;
+    --n;
+  }
+}
+
+static int unhex(char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+
+/* 26 if s starts with a TAI64N label and a space; sets *h */
+static unsigned int stamp(const char *s,unsigned int len,uint64 *h)
+{
+  uint64 u = 0;
+  unsigned int i;
+  int x;
+
+  if ((len < 26) || (s[0] != '@') || (s[25] != ' ')) return 0;
+  for (i = 1;i < 25;++i) {
+    x = unhex(s[i]);
+    if (x == -1) return 0;
+    if (i <= 16) u = (u << 4) + x;
+  }
+  if (u < TAIBASE) return 0;
+  u -= TAIBASE;
+  *h = u - u % 3600 + TAIBASE;
+  return 26;
+}
+
+static char key[TOPN_KEY];
+
+/* "type name", the type in decimal as dnscache writes it */
+static void addname(const char *type,unsigned int typelen,const char *name,unsigned int namelen)
+{
+  unsigned int len;
+
+  len = typelen;
+  if (len > sizeof key - 1) len = sizeof key - 1;
+  byte_copy(key,len,type);
+  key[len++] = ' ';
+  if (namelen > sizeof key - len) namelen = sizeof key - len;
+  byte_copy(key + len,namelen,name);
+  topn_add(&table[T_NAME],key,len + namelen);
+}
+
+/* ip:port:id R type name, from qlog_text() */
+static int qlogline(uint64 *f,char *s,unsigned int len)
+{
+  char strnum[FMT_ULONG];
+  unsigned long u;
+  unsigned int i;
+  int x;
+
+  if (len < 26) return 0;
+  if ((s[8] != ':') || (s[13] != ':') || (s[18] != ' ') || (s[20] != ' ') || (s[25] != ' ')) return 0;
+  u = 0;
+  for (i = 21;i < 25;++i) {
+    x = unhex(s[i]);
+    if (x == -1) return 0;
+    u = (u << 4) + x;
+  }
+  ++f[H_QUERY];
+  if (s[19] == '-') ++f[H_DROP];
+  topn_add(&table[T_CLIENT],s,8);
+  if (s[19] != '/')
+    addname(strnum,fmt_ulong(strnum,u),s + 26,len - 26);
+  return 1;
+}
+
+static void dnscacheline(uint64 *f,char *s,unsigned int len)
+{
+  split(s,len);
+  if (!words) return;
+
+  if (is(0,"query")) {
+    ++f[H_QUERY];
+    if ((words >= 5) && (wordlen[2] >= 8))
+      topn_add(&table[T_CLIENT],word[2],8);
+    if (words >= 5)
+      addname(word[3],wordlen[3],word[4],s + len - word[4]);
+  }
+  else if (is(0,"sent") || is(0,"stale")) {
+    ++f[H_SENT];
+    f[H_BYTES] += num(2);
+  }
+  else if (is(0,"cached")) ++f[H_CACHED];
+  else if (is(0,"tx")) ++f[H_TX];
+  else if (is(0,"rr")) ++f[H_RR];
+  else if (is(0,"drop")) ++f[H_DROP];
+  else if (is(0,"nxdomain")) ++f[H_NXDOMAIN];
+  else if (is(0,"servfail")) {
+    ++f[H_SERVFAIL];
+    if (words >= 2) topn_add(&table[T_SERVFAIL],word[1],wordlen[1]);
+  }
+  else if (is(0,"lame")) {
+    if (words >= 2) topn_add(&table[T_LAME],word[1],wordlen[1]);
+  }
+  else if (is(0,"interval")) {
+    f[H_HITS] += num(1);
+    f[H_MISSES] += num(2);
+  }
+  else if (is(0,"latency"))
+    numbers(s + wordlen[0],len - wordlen[0],f + H_LATENCY,LATENCYBUCKETS);
+}
+
+static char decodespace[2048];
+static int nowrite() { errno = error_nomem; return -1; }
+static buffer decoded = BUFFER_INIT(nowrite,-1,decodespace,sizeof decodespace);
+
+static void doline(char *s,unsigned int len)
+{
+  uint64 h = NOHOUR;
+  uint64 *f;
+  unsigned int i;
+
+  i = stamp(s,len,&h);
+  s += i;
+  len -= i;
+  f = field(h);
+  ++f[H_LINES];
+
+  if (len && !s[0]) {
+    decoded.p = 0;
+    if (!qlog_decode(&decoded,s,len)) return;
+    if (decoded.p) --decoded.p; /* \n */
+    qlogline(f,decoded.x,decoded.p);
+    return;
+  }
+  if (qlogline(f,s,len)) return;
+  dnscacheline(f,s,len);
+}
+
+/* the lines starting in [start,end) of fd; end 0 for all */
+
+static char inspace[65536];
+static stralloc line;
+
+static void doinput(const char *fn,int fd,uint64 start,uint64 end)
+{
+  buffer in;
+  uint64 pos;
+  int match = 1;
+
+  pos = start;
+  if (start) {
+    --pos;
+    if (seek_set(fd,pos) == -1)
+      strerr_die4sys(111,FATAL,"unable to seek ",fn,": ");
+  }
+  buffer_init(&in,buffer_unixread,fd,inspace,sizeof inspace);
+  if (start) { /* the rest of the line before, unless it just ended */
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+    pos += line.len;
+  }
+  while (match) {
+    if (end && (pos >= end)) break;
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+    if (!line.len) break;
+    pos += line.len;
+    if (match) --line.len;
+    doline(line.s,line.len);
+  }
+}
+
+/* sums, as lines for merge() */
+
+static char outspace[8192];
+static buffer out;
+
+static void put(const char *s,unsigned int len)
+{
+  if (buffer_put(&out,s,len) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+}
+static void outs(const char *s)
+{
+  put(s,str_len(s));
+}
+static void outnum(uint64 u)
+{
+  char strnum[FMT_ULONG];
+  char buf[20];
+  unsigned int pos;
+
+  if (u <= 0xffffffffUL) { put(strnum,fmt_ulong(strnum,(unsigned long) u)); return; }
+  pos = sizeof buf;
+  do { buf[--pos] = '0' + (u % 10); u /= 10; } while (u && pos);
+  put(buf + pos,sizeof buf - pos);
+}
+
+static void dump(int fd)
+{
+  struct topn_entry *e;
+  unsigned int i;
+  unsigned int j;
+
+  buffer_init(&out,buffer_unixwrite,fd,outspace,sizeof outspace);
+  for (i = 0;i < numhours;++i) {
+    outs("h ");
+    outnum(hours[i].hour);
+    for (j = 0;j < FIELDS;++j) { outs(" "); outnum(hours[i].f[j]); }
+    outs("\n");
+  }
+  for (i = 0;i < TABLES;++i)
+    for (j = 0;j < table[i].n;++j) {
+      e = table[i].e + j;
+      outs("t "); outnum(i);
+      outs(" "); outnum(e->count);
+      outs(" "); outnum(e->error);
+      outs(" "); put(e->key,e->len);
+      outs("\n");
+    }
+  if (buffer_flush(&out) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+}
+
+static void merge(int fd)
+{
+  char space[8192];
+  buffer in;
+  uint64 *f;
+  unsigned int t;
+  int match = 1;
+
+  buffer_init(&in,buffer_unixread,fd,space,sizeof space);
+  while (match) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read from worker: ");
+    if (!line.len) break;
+    if (match) --line.len;
+    if ((line.len > 2) && (line.s[0] == 'h')) {
+      split(line.s,line.len);
+      if (words < 3) continue;
+      f = field(num(1));
+      numbers(word[2] - 1,line.s + line.len - word[2] + 1,f,FIELDS);
+    }
+    else if ((line.len > 2) && (line.s[0] == 't')) {
+      split(line.s,line.len);
+      if (words < 5) continue;
+      t = num(1);
+      if (t >= TABLES) continue;
+      topn_merge(&table[t],word[4],line.s + line.len - word[4],num(2),num(3));
+    }
+  }
+}
+
+/* the least bucket holding fraction p of the latencies, in ms */
+static void percentile(const char *what,uint64 *f,uint64 total,double p)
+{
+  uint64 sum = 0;
+  unsigned int i;
+
+  outs(" "); outs(what); outs(" ");
+  if (!total) { outs("-"); return; }
+  for (i = 0;i < LATENCYBUCKETS - 1;++i) {
+    sum += f[H_LATENCY + i];
+    if (sum >= p * total) break;
+  }
+  if (i == LATENCYBUCKETS - 1) { outs(">"); --i; }
+  outnum((uint64) 1 << i);
+}
+
+static void report(const char *label,struct hour *x)
+{
+  char strnum[FMT_ULONG];
+  uint64 total;
+  unsigned int i;
+
+  if (label) outs(label);
+  else if (x->hour == NOHOUR) outs("-");
+  else {
+    outs("@");
+    for (i = 0;i < 16;++i) put("0123456789abcdef" + ((x->hour >> (60 - 4 * i)) & 15),1);
+    outs("00000000");
+  }
+  for (i = 0;i < H_LATENCY;++i) {
+    if ((i == H_HITS) || (i == H_MISSES)) continue;
+    outs(" "); outs(fieldname[i]); outs(" "); outnum(x->f[i]);
+  }
+  outs(" hitrate ");
+  total = x->f[H_HITS] + x->f[H_MISSES];
+  if (!total) outs("-");
+  else {
+    i = (unsigned int) ((1000 * x->f[H_HITS]) / total);
+    put(strnum,fmt_ulong(strnum,i / 10)); outs(".");
+    put(strnum,fmt_ulong(strnum,i % 10)); outs("%");
+  }
+  total = 0;
+  for (i = 0;i < LATENCYBUCKETS;++i) total += x->f[H_LATENCY + i];
+  percentile("p50",x->f,total,0.5);
+  percentile("p90",x->f,total,0.9);
+  percentile("p99",x->f,total,0.99);
+  outs("\n");
+}
+
+static unsigned long workers = 1;
+static unsigned long top = 20;
+
+int main(int argc,char **argv)
+{
+  struct topn_entry *e;
+  struct hour sum;
+  struct stat st;
+  int pid[256];
+  int pi[256];
+  int p[2];
+  int wstat;
+  int opt;
+  int fd;
+  unsigned long w;
+  unsigned int i;
+  unsigned int j;
+  char **fn;
+
+  while ((opt = getopt(argc,argv,"j:n:")) != opteof)
+    switch (opt) {
+      case 'j': scan_ulong(optarg,&workers); break;
+      case 'n': scan_ulong(optarg,&top); break;
+      default: usage();
+    }
+  argv += optind;
+  if (workers < 1) workers = 1;
+  if (workers > 256) workers = 256;
+
+  for (i = 0;i < TABLES;++i)
+    if (topn_init(&table[i],TOPN_MAX) == -1) nomem();
+
+  if (!*argv)
+    doinput("stdin",0,0,0);
+  else if (workers == 1)
+    for (fn = argv;*fn;++fn) {
+      fd = open_read(*fn);
+      if (fd == -1) strerr_die4sys(111,FATAL,"unable to open ",*fn,": ");
+      doinput(*fn,fd,0,0);
+      close(fd);
+    }
+  else {
+    for (w = 0;w < workers;++w) {
+      if (pipe(p) == -1) strerr_die2sys(111,FATAL,"unable to create pipe: ");
+      pid[w] = fork();
+      if (pid[w] == -1) strerr_die2sys(111,FATAL,"unable to fork: ");
+      if (pid[w] == 0) {
+        close(p[0]);
+        for (fn = argv;*fn;++fn) {
+          fd = open_read(*fn);
+          if (fd == -1) strerr_die4sys(111,FATAL,"unable to open ",*fn,": ");
+          if (fstat(fd,&st) == -1) strerr_die4sys(111,FATAL,"unable to stat ",*fn,": ");
+          if (st.st_size)
+            doinput(*fn,fd,(st.st_size * (uint64) w) / workers,(st.st_size * (uint64) (w + 1)) / workers);
+          close(fd);
+        }
+        dump(p[1]);
+        _exit(0);
+      }
+      close(p[1]);
+      pi[w] = p[0];
+    }
+    for (w = 0;w < workers;++w) {
+      merge(pi[w]);
+      close(pi[w]);
+      if (waitpid(pid[w],&wstat,0) == -1)
+        strerr_die2sys(111,FATAL,"unable to wait for worker: ");
+      if (!WIFEXITED(wstat) || WEXITSTATUS(wstat))
+        strerr_die2x(111,FATAL,"worker failed");
+    }
+  }
+
+  buffer_init(&out,buffer_unixwrite,1,outspace,sizeof outspace);
+  byte_zero((char *) &sum,sizeof sum);
+  for (i = 0;i < numhours;++i) {
+    report(0,hours + i);
+    for (j = 0;j < FIELDS;++j) sum.f[j] += hours[i].f[j];
+  }
+  report("total",&sum);
+
+  for (i = 0;i < TABLES;++i) {
+    topn_sort(&table[i]);
+    for (j = 0;(j < table[i].n) && (j < top);++j) {
+      e = table[i].e + table[i].heap[j];
+      outs(tablename[i]);
+      outs(" "); outnum(e->count);
+      outs(" "); outnum(e->error);
+      outs(" "); put(e->key,e->len);
+      outs("\n");
+    }
+  }
+
+  if (buffer_flush(&out) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+  _exit(0);
+}
@@ -5,7 +5,10 @@
 #include "byte.h"
 #include "str.h"
 #include "fmt.h"
+#include "scan.h"
+#include "sgetopt.h"
 #include "dns.h"
+#include "dnsargs.h"
 
 #define FATAL "dnsmx: fatal: "
 
@@ -16,48 +19,66 @@ void nomem(void)
 
 static char seed[128];
 
-static stralloc fqdn;
-static char *q;
-static stralloc out;
+static char *name;
 char strnum[FMT_ULONG];
 
-int main(int argc,char **argv)
+int query(const char *arg,stralloc *out,char **q,char *qtype)
+{
+  if (!dns_domain_fromdot(q,arg,str_len(arg))) return -1;
+  byte_copy(qtype,2,DNS_T_MX);
+  return 1;
+}
+
+void print(const char *arg,stralloc *out)
 {
   int i;
   int j;
   uint16 pref;
 
-  dns_random_init(seed);
+  if (!out->len) {
+    if (!dns_domain_fromdot(&name,arg,str_len(arg))) nomem();
+    if (!stralloc_copys(out,"0 ")) nomem();
+    if (!dns_domain_todot_cat(out,name)) nomem();
+    if (!stralloc_cats(out,"\n")) nomem();
+    buffer_put(buffer_1,out->s,out->len);
+    return;
+  }
 
-  if (*argv) ++argv;
+  i = 0;
+  while (i + 2 < out->len) {
+    j = byte_chr(out->s + i + 2,out->len - i - 2,0);
+    uint16_unpack_big(out->s + i,&pref);
+    buffer_put(buffer_1,strnum,fmt_ulong(strnum,pref));
+    buffer_puts(buffer_1," ");
+    buffer_put(buffer_1,out->s + i + 2,j);
+    buffer_puts(buffer_1,"\n");
+    i += j + 3;
+  }
+}
 
-  while (*argv) {
-    if (!stralloc_copys(&fqdn,*argv)) nomem();
-    if (dns_mx(&out,&fqdn) == -1)
-      strerr_die4sys(111,FATAL,"unable to find MX records for ",*argv,": ");
+struct dnsargs d = {
+  FATAL, "unable to find MX records for ", query, dns_mx_packet, print
+} ;
 
-    if (!out.len) {
-      if (!dns_domain_fromdot(&q,*argv,str_len(*argv))) nomem();
-      if (!stralloc_copys(&out,"0 ")) nomem();
-      if (!dns_domain_todot_cat(&out,q)) nomem();
-      if (!stralloc_cats(&out,"\n")) nomem();
-      buffer_put(buffer_1,out.s,out.len);
-    }
-    else {
-      i = 0;
-      while (i + 2 < out.len) {
-	j = byte_chr(out.s + i + 2,out.len - i - 2,0);
-	uint16_unpack_big(out.s + i,&pref);
-	buffer_put(buffer_1,strnum,fmt_ulong(strnum,pref));
-	buffer_puts(buffer_1," ");
-	buffer_put(buffer_1,out.s + i + 2,j);
-	buffer_puts(buffer_1,"\n");
-	i += j + 3;
-      }
+int main(int argc,char **argv)
+{
+  unsigned long u = 100;
+  int opt;
+
+  dns_random_init(seed);
+
+  while ((opt = getopt(argc,argv,"c:")) != opteof)
+    switch(opt) {
+      case 'c':
+	scan_ulong(optarg,&u);
+	if (u < 1) u = 1;
+	if (u > 65536) u = 65536;
+	break;
+      default:
+	strerr_die1x(100,"dnsmx: usage: dnsmx [ -c concurrency ] fqdn ...");
     }
 
-    ++argv;
-  }
+  dnsargs(&d,argv + optind,u);
 
   buffer_flush(buffer_1);
   _exit(0);
@@ -2,32 +2,58 @@
 #include "exit.h"
 #include "strerr.h"
 #include "ip4.h"
+#include "byte.h"
+#include "scan.h"
+#include "sgetopt.h"
 #include "dns.h"
+#include "dnsargs.h"
 
 #define FATAL "dnsname: fatal: "
 
 static char seed[128];
 
 char ip[4];
-static stralloc out;
+char name[DNS_NAME4_DOMAIN];
 
-int main(int argc,char **argv)
+int query(const char *arg,stralloc *out,char **q,char *qtype)
 {
-  dns_random_init(seed);
+  if (!ip4_scan(arg,ip))
+    strerr_die3x(111,FATAL,"unable to parse IP address ",arg);
+  dns_name4_domain(name,ip);
+  if (!dns_domain_copy(q,name)) return -1;
+  byte_copy(qtype,2,DNS_T_PTR);
+  return 1;
+}
 
-  if (*argv) ++argv;
+void print(const char *arg,stralloc *out)
+{
+  buffer_put(buffer_1,out->s,out->len);
+  buffer_puts(buffer_1,"\n");
+}
 
-  while (*argv) {
-    if (!ip4_scan(*argv,ip))
-      strerr_die3x(111,FATAL,"unable to parse IP address ",*argv);
-    if (dns_name4(&out,ip) == -1)
-      strerr_die4sys(111,FATAL,"unable to find host name for ",*argv,": ");
+struct dnsargs d = {
+  FATAL, "unable to find host name for ", query, dns_name_packet, print
+} ;
 
-    buffer_put(buffer_1,out.s,out.len);
-    buffer_puts(buffer_1,"\n");
+int main(int argc,char **argv)
+{
+  unsigned long u = 100;
+  int opt;
+
+  dns_random_init(seed);
 
-    ++argv;
-  }
+  while ((opt = getopt(argc,argv,"c:")) != opteof)
+    switch(opt) {
+      case 'c':
+	scan_ulong(optarg,&u);
+	if (u < 1) u = 1;
+	if (u > 65536) u = 65536;
+	break;
+      default:
+	strerr_die1x(100,"dnsname: usage: dnsname [ -c concurrency ] ip ...");
+    }
+
+  dnsargs(&d,argv + optind,u);
 
   buffer_flush(buffer_1);
   _exit(0);
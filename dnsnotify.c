@@ -0,0 +1,204 @@
+#include <unistd.h>
+#include "uint16.h"
+#include "stralloc.h"
+#include "alloc.h"
+#include "strerr.h"
+#include "getln.h"
+#include "buffer.h"
+#include "byte.h"
+#include "ip4.h"
+#include "taia.h"
+#include "iopause.h"
+#include "socket.h"
+#include "error.h"
+#include "exit.h"
+#include "dns.h"
+
+#define FATAL "dnsnotify: fatal: "
+#define WARNING "dnsnotify: warning: "
+
+/*
+dnsnotify ip ... sends a NOTIFY for each zone named on stdin, one per
+line, to each ip, and waits for the answers. Unanswered ones are sent
+again, waiting 1, 2, 4 and then 8 seconds. Queries go out BATCH at a time, their
+IDs consecutive from a random start, so that an answer's ID finds its
+query directly.
+*/
+
+#define BATCH 1024
+
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+void usage(void)
+{
+  strerr_die1x(100,"dnsnotify: usage: dnsnotify ip ... < zones");
+}
+
+static char *ips;
+static unsigned int numips = 0;
+static stralloc zones; /* packed names */
+static unsigned int numzones = 0;
+
+struct notify {
+  const char *zone;
+  const char *ip;
+  int flagdone;
+} ;
+
+static struct notify batch[BATCH];
+static unsigned int batchlen;
+static unsigned int batchleft;
+static unsigned int base;
+static int udp;
+static unsigned long failures = 0;
+
+static stralloc query;
+
+void sendnotify(struct notify *n,unsigned int id)
+{
+  char header[12];
+
+  byte_copy(header,12,"\0\0\044\0\0\1\0\0\0\0\0\0");
+  uint16_pack_big(header,id);
+  if (!stralloc_copyb(&query,header,12)) nomem();
+  if (!stralloc_catb(&query,n->zone,dns_domain_length(n->zone))) nomem();
+  if (!stralloc_catb(&query,DNS_T_SOA DNS_C_IN,4)) nomem();
+  socket_send4(udp,query.s,query.len,n->ip,53);
+}
+
+void answer(const char *buf,unsigned int len,const char ip[4],uint16 port)
+{
+  static char *q;
+  struct notify *n;
+  uint16 id;
+  unsigned int pos;
+
+  if (port != 53) return;
+  if (len < 12) return;
+  if ((buf[2] & 0xf8) != 0xa0) return; /* response, opcode NOTIFY */
+  uint16_unpack_big(buf,&id);
+  id -= base;
+  if (id >= batchlen) return;
+  n = batch + id;
+  if (n->flagdone) return;
+  if (byte_diff(n->ip,4,ip)) return;
+  if (buf[4] || (buf[5] != 1)) return;
+  pos = dns_packet_getname(buf,len,12,&q);
+  if (!pos) return;
+  if (!dns_domain_equal(q,n->zone)) return;
+
+  n->flagdone = 1;
+  --batchleft;
+  if (buf[3] & 15) {
+    stralloc_copys(&query,"");
+    dns_domain_todot_cat(&query,n->zone);
+    stralloc_0(&query);
+    strerr_warn4(WARNING,"NOTIFY for ",query.s," refused by server",0);
+    ++failures;
+  }
+}
+
+void dobatch(void)
+{
+  struct taia stamp;
+  struct taia deadline;
+  iopause_fd x;
+  char buf[512];
+  char ip[4];
+  char ipstr[IP4_FMT];
+  uint16 port;
+  unsigned int i;
+  unsigned int timeout;
+  int r;
+
+  base = dns_random(65536);
+  batchleft = batchlen;
+
+  for (timeout = 1;batchleft && (timeout <= 8);timeout <<= 1) {
+    for (i = 0;i < batchlen;++i)
+      if (!batch[i].flagdone)
+        sendnotify(batch + i,(base + i) & 65535);
+
+    taia_now(&stamp);
+    taia_uint(&deadline,timeout);
+    taia_add(&deadline,&deadline,&stamp);
+    while (batchleft) {
+      taia_now(&stamp);
+      if (!taia_less(&stamp,&deadline)) break;
+      x.fd = udp;
+      x.events = IOPAUSE_READ;
+      iopause(&x,1,&deadline,&stamp);
+      for (;;) {
+        r = socket_recv4(udp,buf,sizeof buf,ip,&port);
+        if (r == -1) break;
+        answer(buf,r,ip,port);
+      }
+    }
+  }
+
+  for (i = 0;i < batchlen;++i)
+    if (!batch[i].flagdone) {
+      stralloc_copys(&query,"");
+      dns_domain_todot_cat(&query,batch[i].zone);
+      stralloc_0(&query);
+      ipstr[ip4_fmt(ipstr,batch[i].ip)] = 0;
+      strerr_warn5(WARNING,"no answer from ",ipstr," for ",query.s,0);
+      ++failures;
+    }
+  batchlen = 0;
+}
+
+static stralloc line;
+static char *d;
+static char seed[128];
+static char inspace[1024];
+static buffer in = BUFFER_INIT(buffer_unixread,0,inspace,sizeof inspace);
+
+int main(int argc,char **argv)
+{
+  unsigned int i;
+  unsigned int j;
+  unsigned int pos;
+  int match = 1;
+
+  dns_random_init(seed);
+
+  if (argc < 2) usage();
+  ips = alloc(4 * argc);
+  if (!ips) nomem();
+  while (*++argv) {
+    if (!ip4_scan(*argv,ips + 4 * numips))
+      strerr_die3x(100,FATAL,"unable to parse IP address ",*argv);
+    ++numips;
+  }
+
+  while (match) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    while (line.len && ((line.s[line.len - 1] == '\n') || (line.s[line.len - 1] == ' ')))
+      --line.len;
+    if (!line.len) continue;
+    if (!dns_domain_fromdot(&d,line.s,line.len)) nomem();
+    if (!stralloc_catb(&zones,d,dns_domain_length(d))) nomem();
+    ++numzones;
+  }
+
+  udp = socket_udp();
+  if (udp == -1) strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+
+  pos = 0;
+  for (i = 0;i < numzones;++i) {
+    for (j = 0;j < numips;++j) {
+      batch[batchlen].zone = zones.s + pos;
+      batch[batchlen].ip = ips + 4 * j;
+      batch[batchlen].flagdone = 0;
+      if (++batchlen == BATCH) dobatch();
+    }
+    pos += dns_domain_length(zones.s + pos);
+  }
+  if (batchlen) dobatch();
+
+  _exit(failures ? 111 : 0);
+}
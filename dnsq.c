@@ -10,12 +10,15 @@
 #include "printpacket.h"
 #include "parsetype.h"
 #include "dns.h"
+#include "getln.h"
+#include "fmt.h"
+#include "exit.h"
 
 #define FATAL "dnsq: fatal: "
 
 void usage(void)
 {
-  strerr_die1x(100,"dnsq: usage: dnsq type name server");
+  strerr_die1x(100,"dnsq: usage: dnsq { type name | batch } server");
 }
 void oops(void)
 {
@@ -34,7 +37,7 @@ int resolve(char *q,char qtype[2],char servers[64])
   if (dns_transmit_start(&tx,servers,0,q,qtype,"\0\0\0\0") == -1) return -1;
 
   for (;;) {
-    taia_now(&stamp);
+    taia_clock(&stamp);
     taia_uint(&deadline,120);
     taia_add(&deadline,&deadline,&stamp);
     dns_transmit_io(&tx,x,&deadline);
@@ -58,40 +61,188 @@ static stralloc out;
 
 static char seed[128];
 
-int main(int argc,char **argv)
+static void header(stralloc *sa,const char *name,const char qtype[2])
 {
   uint16 u16;
 
+  uint16_unpack_big(qtype,&u16);
+  if (!stralloc_catulong0(sa,u16,0)) oops();
+  if (!stralloc_cats(sa," ")) oops();
+  if (!dns_domain_todot_cat(sa,name)) oops();
+  if (!stralloc_cats(sa,":\n")) oops();
+}
+
+static void result(stralloc *sa,const struct dns_transmit *t,int r)
+{
+  if (r == -1) {
+    if (!stralloc_cats(sa,error_str(errno))) oops();
+    if (!stralloc_cats(sa,"\n")) oops();
+  }
+  else
+    if (!printpacket_cat(sa,t->packet,t->packetlen)) oops();
+}
+
+/*
+With batch, the queries are lines "type name" from stdin, up to
+BATCH of them out at once, each on its own dns_transmit under one
+iopause(). The answers are printed in the order of the queries.
+*/
+
+#define BATCH 64
+
+static struct slot {
+  struct dns_transmit tx;
+  char *q;
+  stralloc out;
+  int done;
+} slot[BATCH];
+
+static char inspace[4096];
+static buffer in = BUFFER_INIT(buffer_unixread,0,inspace,sizeof inspace);
+static stralloc line;
+
+/* 1 and a query in q and type, or 0 at the end of the input */
+static int nextline(void)
+{
+  static unsigned long linenum = 0;
+  char strnum[FMT_ULONG];
+  unsigned int i;
+  unsigned int j;
+  int match;
+
+  for (;;) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    if (!line.len) return 0;
+    ++linenum;
+    if (match) --line.len;
+    if (!stralloc_0(&line)) oops();
+    --line.len;
+
+    i = 0;
+    while ((i < line.len) && ((line.s[i] == ' ') || (line.s[i] == '\t'))) ++i;
+    if (i == line.len) continue;
+    j = i;
+    while ((j < line.len) && (line.s[j] != ' ') && (line.s[j] != '\t')) ++j;
+    if (j < line.len) line.s[j++] = 0;
+    if (!parsetype(line.s + i,type)) break;
+    while ((j < line.len) && ((line.s[j] == ' ') || (line.s[j] == '\t'))) ++j;
+    i = j;
+    while ((j < line.len) && (line.s[j] != ' ') && (line.s[j] != '\t')) ++j;
+    if (i == j) break;
+    if (!dns_domain_fromdot(&q,line.s + i,j - i)) oops();
+    while ((j < line.len) && ((line.s[j] == ' ') || (line.s[j] == '\t'))) ++j;
+    if (j < line.len) break;
+    return 1;
+  }
+
+  strnum[fmt_ulong(strnum,linenum)] = 0;
+  strerr_die3x(100,FATAL,"unable to parse query on line ",strnum);
+  return 0;
+}
+
+static void batch(void)
+{
+  iopause_fd x[BATCH];
+  unsigned int xs[BATCH];
+  struct taia stamp;
+  struct taia deadline;
+  struct slot *s;
+  unsigned int head;
+  unsigned int active;
+  unsigned int numx;
+  unsigned int j;
+  int flageof;
+  int r;
+
+  head = 0;
+  active = 0;
+  flageof = 0;
+
+  for (;;) {
+    while (!flageof && (active < BATCH)) {
+      if (!nextline()) { flageof = 1; break; }
+      s = slot + (head + active++) % BATCH;
+      s->out.len = 0;
+      header(&s->out,q,type);
+      if (!dns_domain_copy(&s->q,q)) oops();
+      s->done = 0;
+      if (dns_transmit_start(&s->tx,servers,0,s->q,type,"\0\0\0\0") == -1) {
+        result(&s->out,&s->tx,-1);
+        s->done = 1;
+      }
+    }
+
+    while (active && slot[head].done) {
+      s = slot + head;
+      if (buffer_put(buffer_1,s->out.s,s->out.len) == -1)
+        strerr_die2sys(111,FATAL,"unable to write output: ");
+      dns_transmit_free(&s->tx);
+      head = (head + 1) % BATCH;
+      --active;
+    }
+    if (!active) {
+      if (flageof) break;
+      continue;
+    }
+
+    taia_clock(&stamp);
+    taia_uint(&deadline,120);
+    taia_add(&deadline,&deadline,&stamp);
+    numx = 0;
+    for (j = 0;j < active;++j) {
+      s = slot + (head + j) % BATCH;
+      if (s->done) continue;
+      dns_transmit_io(&s->tx,x + numx,&deadline);
+      xs[numx++] = (head + j) % BATCH;
+    }
+    iopause(x,numx,&deadline,&stamp);
+    for (j = 0;j < numx;++j) {
+      s = slot + xs[j];
+      r = dns_transmit_get(&s->tx,x + j,&stamp);
+      if (r) {
+        result(&s->out,&s->tx,r);
+        s->done = 1;
+      }
+    }
+  }
+
+  if (buffer_flush(buffer_1) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+}
+
+static void getservers(const char *arg)
+{
+  if (!stralloc_copys(&out,arg)) oops();
+  if (dns_ip4_qualify(&ip,&fqdn,&out) == -1) oops();
+  if (ip.len >= 64) ip.len = 64;
+  byte_zero(servers,64);
+  byte_copy(servers,ip.len,ip.s);
+}
+
+int main(int argc,char **argv)
+{
   dns_random_init(seed);
 
   if (!*argv) usage();
   if (!*++argv) usage();
+  if (str_equal(*argv,"batch")) {
+    if (!*++argv) usage();
+    getservers(*argv);
+    batch();
+    _exit(0);
+  }
   if (!parsetype(*argv,type)) usage();
 
   if (!*++argv) usage();
   if (!dns_domain_fromdot(&q,*argv,str_len(*argv))) oops();
 
   if (!*++argv) usage();
-  if (!stralloc_copys(&out,*argv)) oops();
-  if (dns_ip4_qualify(&ip,&fqdn,&out) == -1) oops();
-  if (ip.len >= 64) ip.len = 64;
-  byte_zero(servers,64);
-  byte_copy(servers,ip.len,ip.s);
+  getservers(*argv);
 
   if (!stralloc_copys(&out,"")) oops();
-  uint16_unpack_big(type,&u16);
-  if (!stralloc_catulong0(&out,u16,0)) oops();
-  if (!stralloc_cats(&out," ")) oops();
-  if (!dns_domain_todot_cat(&out,q)) oops();
-  if (!stralloc_cats(&out,":\n")) oops();
-
-  if (resolve(q,type,servers) == -1) {
-    if (!stralloc_cats(&out,error_str(errno))) oops();
-    if (!stralloc_cats(&out,"\n")) oops();
-  }
-  else {
-    if (!printpacket_cat(&out,tx.packet,tx.packetlen)) oops();
-  }
+  header(&out,q,type);
+  result(&out,&tx,resolve(q,type,servers));
 
   buffer_putflush(buffer_1,out.s,out.len);
   _exit(0);
@@ -0,0 +1,635 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "uint16.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "strerr.h"
+#include "buffer.h"
+#include "getln.h"
+#include "stralloc.h"
+#include "alloc.h"
+#include "scan.h"
+#include "str.h"
+#include "byte.h"
+#include "case.h"
+#include "fmt.h"
+#include "ip4.h"
+#include "open.h"
+#include "error.h"
+#include "taia.h"
+#include "iopause.h"
+#include "socket.h"
+#include "sgetopt.h"
+#include "parsetype.h"
+#include "exit.h"
+#include "dns.h"
+
+#define FATAL "dnsreplay: fatal: "
+
+/*
+Replays the queries in a log from tinydns (or its relatives) or
+dnscache, or in lines "type name", against one server over UDP: up to
+-c at once, and with -r at most that many a second. Then prints how
+many were answered, the rate, and latency percentiles. With -w, it
+writes one line per query with a fingerprint of the answer; with -b,
+it compares the answers with such a file from an earlier run and
+counts those that differ. A fingerprint leaves out the ID, the TTLs
+and the order of the records.
+*/
+
+void usage(void)
+{
+  strerr_die1x(100,"dnsreplay: usage: dnsreplay [ -c concurrency ] [ -r rate ] [ -t timeout ] [ -w fingerprints ] [ -b baseline ] ip < log");
+}
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+
+static char inspace[4096];
+static buffer in = BUFFER_INIT(buffer_unixread,0,inspace,sizeof inspace);
+
+static stralloc line;
+static stralloc field;
+static char *q;
+
+/* the queries: qtype, then the name, at queries.s + qpos[i] */
+static stralloc queries;
+static uint32 *qpos;
+static unsigned int numq = 0;
+static unsigned int maxq = 0;
+static unsigned long skipped = 0;
+
+#define NOTYET 0xffffffff
+#define TIMEOUT 0xfffffffe
+static uint32 *lat; /* microseconds, or NOTYET, or TIMEOUT */
+static uint64 *fp;
+
+static void addquery(const char qtype[2])
+{
+  uint32 *x;
+
+  if (numq == maxq) {
+    maxq = maxq + (maxq >> 1) + 1024;
+    x = (uint32 *) alloc(maxq * sizeof(uint32));
+    if (!x) nomem();
+    byte_copy(x,numq * sizeof(uint32),qpos);
+    if (qpos) alloc_free((char *) qpos);
+    qpos = x;
+  }
+  qpos[numq++] = queries.len;
+  if (!stralloc_catb(&queries,qtype,2)) nomem();
+  if (!stralloc_catb(&queries,q,dns_domain_length(q))) nomem();
+}
+
+/* splits line into fields at spaces; returns how many, up to 8 */
+static unsigned int fpos[8];
+static unsigned int flen[8];
+
+static unsigned int split(unsigned int start)
+{
+  unsigned int n = 0;
+  unsigned int i;
+
+  i = start;
+  while (n < 8) {
+    while ((i < line.len) && (line.s[i] == ' ')) ++i;
+    if (i == line.len) break;
+    fpos[n] = i;
+    while ((i < line.len) && (line.s[i] != ' ')) ++i;
+    flen[n] = i - fpos[n];
+    ++n;
+  }
+  return n;
+}
+
+static int getfield(unsigned int j)
+{
+  if (!stralloc_copyb(&field,line.s + fpos[j],flen[j])) nomem();
+  if (!stralloc_0(&field)) nomem();
+  return 1;
+}
+
+static int hexdigit(char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+
+static void parseline(void)
+{
+  char qtype[2];
+  unsigned long u;
+  unsigned int start;
+  unsigned int n;
+  unsigned int i;
+  int d;
+
+  start = 0;
+  if (line.len && (line.s[0] == '@')) /* multilog timestamp */
+    start = byte_chr(line.s,line.len,' ') + 1;
+  n = split(start);
+
+  /* dnscache: query num ip:port:id type name */
+  if ((n == 5) && (flen[0] == 5) && byte_equal(line.s + fpos[0],5,"query")) {
+    getfield(3);
+    if (field.s[scan_ulong(field.s,&u)] || (u > 65535)) { ++skipped; return; }
+    uint16_pack_big(qtype,u);
+    getfield(4);
+  }
+  /* tinydns: ip:port:id result type name */
+  else if ((n == 4) && (flen[1] == 1) && (flen[2] == 4) && (byte_chr(line.s + fpos[0],flen[0],':') < flen[0])) {
+    u = 0;
+    for (i = 0;i < 4;++i) {
+      d = hexdigit(line.s[fpos[2] + i]);
+      if (d == -1) { ++skipped; return; }
+      u = (u << 4) + d;
+    }
+    uint16_pack_big(qtype,u);
+    getfield(3);
+  }
+  /* type name */
+  else if (n == 2) {
+    getfield(0);
+    if (!parsetype(field.s,qtype)) { ++skipped; return; }
+    getfield(1);
+  }
+  else {
+    ++skipped;
+    return;
+  }
+
+  if (!dns_domain_fromdot(&q,field.s,field.len - 1)) nomem();
+  addquery(qtype);
+}
+
+/* FNV-1a, 64 bits */
+
+static uint64 h;
+
+static void hashstart(void)
+{
+  h = ((uint64) 0xcbf29ce4 << 32) + 0x84222325;
+}
+
+static void hashadd(const char *s,unsigned int len)
+{
+  uint64 prime = ((uint64) 0x100 << 32) + 0x1b3;
+
+  while (len--) {
+    h ^= (unsigned char) *s++;
+    h *= prime;
+  }
+}
+
+static char *name;
+
+static int hashname(const char *buf,unsigned int len,unsigned int *pos)
+{
+  unsigned int n;
+
+  *pos = dns_packet_getname(buf,len,*pos,&name);
+  if (!*pos) return 0;
+  n = dns_domain_length(name);
+  case_lowerb(name,n);
+  hashadd(name,n);
+  return 1;
+}
+
+static uint64 rawprint(const char *buf,unsigned int len)
+{
+  hashstart();
+  hashadd(buf + 2,len - 2);
+  return h;
+}
+
+static uint64 fingerprint(const char *buf,unsigned int len)
+{
+  char header[12];
+  char misc[10];
+  uint64 top;
+  uint64 sum;
+  unsigned int pos;
+  unsigned int end;
+  unsigned int n;
+  uint16 datalen;
+  uint16 u;
+
+  pos = dns_packet_copy(buf,len,0,header,12); if (!pos) return rawprint(buf,len);
+  hashstart();
+  hashadd(header + 2,10);
+  top = h;
+
+  pos = dns_packet_skipname(buf,len,pos); if (!pos) return rawprint(buf,len);
+  pos += 4;
+
+  uint16_unpack_big(header + 6,&u); n = u;
+  uint16_unpack_big(header + 8,&u); n += u;
+  uint16_unpack_big(header + 10,&u); n += u;
+
+  sum = 0;
+  while (n--) {
+    hashstart();
+    if (!hashname(buf,len,&pos)) return rawprint(buf,len);
+    pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return rawprint(buf,len);
+    byte_zero(misc + 4,4);
+    uint16_unpack_big(misc + 8,&datalen);
+    hashadd(misc,8);
+    end = pos + datalen;
+    if (end > len) return rawprint(buf,len);
+
+    if (byte_equal(misc,2,DNS_T_NS) || byte_equal(misc,2,DNS_T_CNAME) || byte_equal(misc,2,DNS_T_PTR)) {
+      if (!hashname(buf,len,&pos)) return rawprint(buf,len);
+    }
+    else if (byte_equal(misc,2,DNS_T_MX)) {
+      hashadd(buf + pos,2);
+      pos += 2;
+      if (!hashname(buf,len,&pos)) return rawprint(buf,len);
+    }
+    else if (byte_equal(misc,2,DNS_T_SOA)) {
+      if (!hashname(buf,len,&pos)) return rawprint(buf,len);
+      if (!hashname(buf,len,&pos)) return rawprint(buf,len);
+      if (pos > end) return rawprint(buf,len);
+      hashadd(buf + pos,end - pos);
+    }
+    else
+      hashadd(buf + pos,datalen);
+    pos = end;
+    sum += h;
+  }
+
+  return top * 31 + sum;
+}
+
+/* queries in flight, by ID */
+
+struct slot {
+  unsigned int query;
+  struct taia sent;
+  int active;
+} ;
+
+static struct slot *slot;
+static uint16 *freeid;
+static unsigned int numfree;
+static uint16 *qid; /* ID of each query while in flight */
+
+#define BATCH 32
+
+static char outspace[BATCH][512];
+static char inspace2[BATCH][4096];
+static struct socket_dgram out[BATCH];
+static struct socket_dgram got[BATCH];
+
+static char serverip[4];
+static unsigned long maxinflight = 100;
+static unsigned long rate = 0;
+static unsigned long timeout = 5;
+static char *fnwrite = 0;
+static char *fnbase = 0;
+
+static unsigned long answered = 0;
+static unsigned long timedout = 0;
+static unsigned long mismatches = 0;
+static unsigned long compared = 0;
+
+static void answer(const char *buf,unsigned int len,struct taia *now)
+{
+  struct slot *x;
+  struct taia t;
+  unsigned int n;
+  uint16 id;
+  const char *query;
+
+  if (len < 12) return;
+  uint16_unpack_big(buf,&id);
+  if (id >= maxinflight) return;
+  x = slot + id;
+  if (!x->active) return;
+
+  query = queries.s + qpos[x->query];
+  n = dns_domain_length(query + 2);
+  if (len < 12 + n + 4) return;
+  if (case_diffb(buf + 12,n,query + 2)) return;
+  if (byte_diff(buf + 12 + n,2,query)) return;
+
+  if (taia_less(now,&x->sent))
+    lat[x->query] = 0;
+  else {
+    taia_sub(&t,now,&x->sent);
+    lat[x->query] = taia_approx(&t) * 1000000.0;
+    if (lat[x->query] >= TIMEOUT) lat[x->query] = TIMEOUT - 1;
+  }
+  fp[x->query] = fingerprint(buf,len);
+  ++answered;
+  x->active = 0;
+  freeid[numfree++] = id;
+}
+
+static int latcmp(const void *a,const void *b)
+{
+  uint32 x = *(const uint32 *) a;
+  uint32 y = *(const uint32 *) b;
+  if (x < y) return -1;
+  return x > y;
+}
+
+static void putms(const char *label,uint32 us)
+{
+  char strnum[FMT_ULONG];
+
+  buffer_puts(buffer_1,label);
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,us / 1000));
+  buffer_puts(buffer_1,".");
+  strnum[0] = '0' + (us % 1000) / 100;
+  strnum[1] = '0' + (us % 100) / 10;
+  strnum[2] = '0' + us % 10;
+  buffer_put(buffer_1,strnum,3);
+  buffer_puts(buffer_1," ms\n");
+}
+
+static void putnum(const char *label,unsigned long u)
+{
+  char strnum[FMT_ULONG];
+
+  buffer_puts(buffer_1,label);
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,u));
+  buffer_puts(buffer_1,"\n");
+}
+
+static char hexdigits[] = "0123456789abcdef";
+
+static void writeprints(void)
+{
+  char bspace[4096];
+  buffer b;
+  char hex[17];
+  unsigned int i;
+  int j;
+  int fd;
+
+  fd = open_trunc(fnwrite);
+  if (fd == -1) strerr_die4sys(111,FATAL,"unable to create ",fnwrite,": ");
+  buffer_init(&b,buffer_unixwrite,fd,bspace,sizeof bspace);
+  for (i = 0;i < numq;++i) {
+    if (lat[i] >= TIMEOUT) {
+      if (buffer_put(&b,"-\n",2) == -1) goto WRITEERR;
+      continue;
+    }
+    for (j = 0;j < 16;++j)
+      hex[j] = hexdigits[(fp[i] >> (60 - 4 * j)) & 15];
+    hex[16] = '\n';
+    if (buffer_put(&b,hex,17) == -1) goto WRITEERR;
+  }
+  if (buffer_flush(&b) == -1) goto WRITEERR;
+  if (fsync(fd) == -1) goto WRITEERR;
+  if (close(fd) == -1) goto WRITEERR;
+  return;
+
+  WRITEERR:
+  strerr_die4sys(111,FATAL,"unable to write ",fnwrite,": ");
+}
+
+static void comparebase(void)
+{
+  char bspace[4096];
+  buffer b;
+  uint64 u;
+  unsigned int i;
+  unsigned int j;
+  int match;
+  int fd;
+  int d;
+
+  fd = open_read(fnbase);
+  if (fd == -1) strerr_die4sys(111,FATAL,"unable to open ",fnbase,": ");
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+
+  for (i = 0;i < numq;++i) {
+    if (getln(&b,&line,&match,'\n') == -1)
+      strerr_die4sys(111,FATAL,"unable to read ",fnbase,": ");
+    if (!match) break;
+    if (lat[i] >= TIMEOUT) continue;
+    if (line.len != 17) continue;
+    u = 0;
+    for (j = 0;j < 16;++j) {
+      d = hexdigit(line.s[j]);
+      if (d == -1) break;
+      u = (u << 4) + d;
+    }
+    if (j < 16) continue;
+    ++compared;
+    if (u != fp[i]) ++mismatches;
+  }
+  close(fd);
+}
+
+int main(int argc,char **argv)
+{
+  struct taia start;
+  struct taia now;
+  struct taia deadline;
+  struct taia t;
+  iopause_fd x[1];
+  unsigned long sent = 0;
+  unsigned int next = 0;
+  unsigned int oldest = 0;
+  unsigned int inflight = 0;
+  unsigned int len;
+  unsigned int i;
+  unsigned int m;
+  uint32 *sorted;
+  double allowed = 0;
+  int match = 1;
+  int opt;
+  int s;
+  int r;
+  uint16 id;
+
+  while ((opt = getopt(argc,argv,"c:r:t:w:b:")) != opteof)
+    switch(opt) {
+      case 'c':
+	scan_ulong(optarg,&maxinflight);
+	if (maxinflight < 1) maxinflight = 1;
+	if (maxinflight > 65536) maxinflight = 65536;
+	break;
+      case 'r':
+	scan_ulong(optarg,&rate);
+	break;
+      case 't':
+	scan_ulong(optarg,&timeout);
+	if (timeout < 1) timeout = 1;
+	break;
+      case 'w':
+	fnwrite = optarg;
+	break;
+      case 'b':
+	fnbase = optarg;
+	break;
+      default:
+	usage();
+    }
+  argv += optind;
+  if (!*argv) usage();
+  if (!ip4_scan(*argv,serverip)) usage();
+
+  while (match) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    if (!line.len) break;
+    if (match) --line.len;
+    parseline();
+  }
+
+  lat = (uint32 *) alloc((numq + 1) * sizeof(uint32));
+  fp = (uint64 *) alloc((numq + 1) * sizeof(uint64));
+  qid = (uint16 *) alloc((numq + 1) * sizeof(uint16));
+  slot = (struct slot *) alloc(maxinflight * sizeof(struct slot));
+  freeid = (uint16 *) alloc(maxinflight * sizeof(uint16));
+  if (!lat || !fp || !qid || !slot || !freeid) nomem();
+  for (i = 0;i < numq;++i) lat[i] = NOTYET;
+  byte_zero(slot,maxinflight * sizeof(struct slot));
+  numfree = 0;
+  for (i = maxinflight;i > 0;--i) freeid[numfree++] = i - 1;
+
+  for (i = 0;i < BATCH;++i) {
+    out[i].buf = outspace[i];
+    byte_copy(out[i].ip,4,serverip);
+    out[i].port = 53;
+    got[i].buf = inspace2[i];
+  }
+
+  s = socket_udp();
+  if (s == -1) strerr_die2sys(111,FATAL,"unable to create UDP socket: ");
+  socket_tryreservein(s,1048576);
+
+  taia_now(&start);
+  now = start;
+
+  while ((next < numq) || inflight) {
+    m = 0;
+    if (rate) {
+      taia_sub(&t,&now,&start);
+      allowed = taia_approx(&t) * rate + 1;
+    }
+    while ((next < numq) && numfree && (m < BATCH)) {
+      if (rate && ((double) sent >= allowed)) break;
+      id = freeid[--numfree];
+      slot[id].query = next;
+      slot[id].sent = now;
+      slot[id].active = 1;
+      qid[next] = id;
+
+      len = dns_domain_length(queries.s + qpos[next] + 2);
+      if (len > 512 - 16) len = 512 - 16;
+      uint16_pack_big(out[m].buf,id);
+      byte_copy(out[m].buf + 2,10,"\1\0\0\1\0\0\0\0\0\0");
+      byte_copy(out[m].buf + 12,len,queries.s + qpos[next] + 2);
+      byte_copy(out[m].buf + 12 + len,2,queries.s + qpos[next]);
+      byte_copy(out[m].buf + 14 + len,2,DNS_C_IN);
+      out[m].len = 16 + len;
+      ++m; ++next; ++sent; ++inflight;
+    }
+    if (m) {
+      r = socket_send4_many(s,out,m);
+      if (r < 0) r = 0;
+      while (m > r) { /* try those again */
+        --m; --next; --sent; --inflight;
+        slot[qid[next]].active = 0;
+        freeid[numfree++] = qid[next];
+      }
+    }
+
+    taia_uint(&t,1);
+    taia_add(&deadline,&now,&t);
+    if (inflight) {
+      while ((oldest < next) && (lat[oldest] != NOTYET)) ++oldest;
+      if (oldest < next) {
+        taia_uint(&t,timeout);
+        taia_add(&t,&slot[qid[oldest]].sent,&t);
+        if (taia_less(&t,&deadline)) deadline = t;
+      }
+    }
+    if ((next < numq) && numfree) {
+      if (!rate)
+        deadline = now;
+      else {
+        taia_sub(&t,&now,&start);
+        if ((double) sent < taia_approx(&t) * rate + 1) deadline = now;
+        else {
+          taia_uint(&t,0);
+          t.atto = 1000000000;
+          taia_add(&t,&now,&t);
+          if (taia_less(&t,&deadline)) deadline = t; /* a millisecond */
+        }
+      }
+    }
+
+    x[0].fd = s;
+    x[0].events = IOPAUSE_READ;
+    iopause(x,1,&deadline,&now);
+    taia_now(&now);
+
+    for (;;) {
+      r = socket_recv4_many(s,got,BATCH,sizeof inspace2[0]);
+      if (r <= 0) break;
+      for (i = 0;i < r;++i) {
+        if (got[i].len < 0) continue;
+        if (byte_diff(got[i].ip,4,serverip) || (got[i].port != 53)) continue;
+        m = answered;
+        answer(got[i].buf,got[i].len,&now);
+        if (answered != m) --inflight;
+      }
+      if (r < BATCH) break;
+    }
+
+    while (oldest < next) {
+      if (lat[oldest] != NOTYET) { ++oldest; continue; }
+      taia_uint(&t,timeout);
+      taia_add(&t,&slot[qid[oldest]].sent,&t);
+      if (taia_less(&now,&t)) break;
+      lat[oldest] = TIMEOUT;
+      slot[qid[oldest]].active = 0;
+      freeid[numfree++] = qid[oldest];
+      ++timedout; --inflight;
+      ++oldest;
+    }
+  }
+
+  taia_sub(&t,&now,&start);
+
+  putnum("queries ",numq);
+  putnum("answered ",answered);
+  putnum("timeouts ",timedout);
+  putnum("skipped ",skipped);
+  putms("elapsed ",taia_approx(&t) * 1000000.0);
+  if (taia_approx(&t) > 0)
+    putnum("qps ",answered / taia_approx(&t));
+
+  sorted = (uint32 *) alloc((answered + 1) * sizeof(uint32));
+  if (!sorted) nomem();
+  m = 0;
+  for (i = 0;i < numq;++i)
+    if (lat[i] < TIMEOUT) sorted[m++] = lat[i];
+  if (m) {
+    qsort(sorted,m,sizeof(uint32),latcmp);
+    putms("p50 ",sorted[m / 2]);
+    putms("p90 ",sorted[(m * 9) / 10]);
+    putms("p99 ",sorted[(m * 99) / 100]);
+    putms("p999 ",sorted[(m * 999) / 1000]);
+    putms("max ",sorted[m - 1]);
+  }
+
+  if (fnbase) {
+    comparebase();
+    putnum("compared ",compared);
+    putnum("mismatches ",mismatches);
+  }
+  if (buffer_flush(buffer_1) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+
+  if (fnwrite) writeprints();
+
+  _exit(0);
+}
@@ -40,46 +40,6 @@ void printdomain(const char *d)
   buffer_put(buffer_1,tmp.s,tmp.len);
 }
 
-static struct dns_transmit tx;
-
-int resolve(char *q,char qtype[2],char ip[4])
-{
-  struct taia start;
-  struct taia stamp;
-  struct taia deadline;
-  char servers[64];
-  iopause_fd x[1];
-  int r;
-
-  taia_now(&start);
-
-  byte_zero(servers,64);
-  byte_copy(servers,4,ip);
-
-  if (dns_transmit_start(&tx,servers,0,q,qtype,"\0\0\0\0") == -1) return -1;
-
-  for (;;) {
-    taia_now(&stamp);
-    taia_uint(&deadline,120);
-    taia_add(&deadline,&deadline,&stamp);
-    dns_transmit_io(&tx,x,&deadline);
-    iopause(x,1,&deadline,&stamp);
-    r = dns_transmit_get(&tx,x,&stamp);
-    if (r == -1) return -1;
-    if (r == 1) break;
-  }
-
-  taia_now(&stamp);
-  taia_sub(&stamp,&stamp,&start);
-  taia_uint(&deadline,1);
-  if (taia_less(&deadline,&stamp)) {
-    buffer_put(buffer_1,querystr.s,querystr.len);
-    buffer_puts(buffer_1,"ALERT:took more than 1 second\n");
-  }
-
-  return 0;
-}
-
 struct address {
   char *owner;
   char ip[4];
@@ -118,6 +78,8 @@ struct qt {
   char type[2];
   char *control;
   char ip[4];
+  int waiting; /* for memo[memo] */
+  unsigned int memo;
 } ;
 
 GEN_ALLOC_typedef(qt_alloc,struct qt,s,len,a)
@@ -233,6 +195,139 @@ void address_add(const char *owner,const char ip[4])
 	  qt_add(query.s[j].owner,query.s[j].type,ns.s[i].owner,ip);
 }
 
+/*
+Answers are kept per (server, name, type) for the run: a question
+that comes up again under another control domain is not sent again.
+Up to PARALLEL questions are in flight at once; each output line
+starts with its question, so dnstracesort puts them in order.
+*/
+
+#define PARALLEL 16
+
+struct memo {
+  char *owner;
+  char type[2];
+  char ip[4];
+  int result; /* 0 in flight, 1 answered, -1 failed */
+  int err;
+  int flagslow; /* took more than 1 second */
+  char *packet;
+  unsigned int len;
+} ;
+
+GEN_ALLOC_typedef(memo_alloc,struct memo,s,len,a)
+GEN_ALLOC_readyplus(memo_alloc,struct memo,s,len,a,i,n,x,30,memo_alloc_readyplus)
+GEN_ALLOC_append(memo_alloc,struct memo,s,len,a,i,n,x,30,memo_alloc_readyplus,memo_alloc_append)
+
+static memo_alloc memo;
+
+struct slot {
+  struct dns_transmit tx;
+  char servers[64];
+  unsigned int memo;
+  struct taia start;
+  int active;
+} ;
+
+static struct slot slot[PARALLEL];
+static iopause_fd io[PARALLEL];
+static int numactive = 0;
+
+int memo_find(const char *q,const char type[2],const char ip[4])
+{
+  int i;
+
+  for (i = 0;i < memo.len;++i)
+    if (byte_equal(memo.s[i].ip,4,ip))
+      if (byte_equal(memo.s[i].type,2,type))
+        if (dns_domain_equal(memo.s[i].owner,q))
+          return i;
+  return -1;
+}
+
+/* caller checks that a slot is free */
+int memo_start(const char *q,const char type[2],const char ip[4])
+{
+  struct memo x;
+  unsigned int m;
+  int j;
+
+  byte_zero(&x,sizeof x);
+  if (!dns_domain_copy(&x.owner,q)) nomem();
+  byte_copy(x.type,2,type);
+  byte_copy(x.ip,4,ip);
+  if (!memo_alloc_append(&memo,&x)) nomem();
+  m = memo.len - 1;
+
+  for (j = 0;j < PARALLEL;++j)
+    if (!slot[j].active) break;
+
+  byte_zero(slot[j].servers,64);
+  byte_copy(slot[j].servers,4,memo.s[m].ip);
+  slot[j].memo = m;
+  taia_clock(&slot[j].start);
+  if (dns_transmit_start(&slot[j].tx,slot[j].servers,0,memo.s[m].owner,memo.s[m].type,"\0\0\0\0") == -1) {
+    memo.s[m].result = -1;
+    memo.s[m].err = errno;
+    return m;
+  }
+  slot[j].active = 1;
+  ++numactive;
+  return m;
+}
+
+void slot_done(int j,int r)
+{
+  struct memo *m;
+  struct taia stamp;
+  struct taia limit;
+
+  m = memo.s + slot[j].memo;
+  if (r == -1) {
+    m->result = -1;
+    m->err = errno;
+  }
+  else {
+    m->packet = alloc(slot[j].tx.packetlen);
+    if (!m->packet) nomem();
+    byte_copy(m->packet,slot[j].tx.packetlen,slot[j].tx.packet);
+    m->len = slot[j].tx.packetlen;
+    m->result = 1;
+    taia_clock(&stamp);
+    taia_sub(&stamp,&stamp,&slot[j].start);
+    taia_uint(&limit,1);
+    if (taia_less(&limit,&stamp)) m->flagslow = 1;
+  }
+  dns_transmit_free(&slot[j].tx);
+  slot[j].active = 0;
+  --numactive;
+}
+
+void slot_wait(void)
+{
+  struct taia stamp;
+  struct taia deadline;
+  int j;
+  int r;
+
+  taia_clock(&stamp);
+  taia_uint(&deadline,120);
+  taia_add(&deadline,&deadline,&stamp);
+  for (j = 0;j < PARALLEL;++j)
+    if (slot[j].active)
+      dns_transmit_io(&slot[j].tx,io + j,&deadline);
+    else {
+      io[j].fd = -1;
+      io[j].events = 0;
+    }
+  iopause(io,PARALLEL,&deadline,&stamp);
+  for (j = 0;j < PARALLEL;++j)
+    if (slot[j].active) {
+      r = dns_transmit_get(&slot[j].tx,io + j,&stamp);
+      if (r) slot_done(j,r);
+    }
+}
+
 char seed[128];
 
 static char *t1;
@@ -386,17 +481,75 @@ void parsepacket(const char *buf,unsigned int len,const char *d,const char dtype
   buffer_puts(buffer_1,"\n");
 }
 
+void report(int i)
+{
+  static char *q;
+  struct memo *m;
+  char *control;
+  char type[2];
+  char ip[4];
+  uint16 u16;
+
+  if (!dns_domain_copy(&q,qt.s[i].owner)) nomem();
+  control = qt.s[i].control;
+  byte_copy(type,2,qt.s[i].type);
+  byte_copy(ip,4,qt.s[i].ip);
+  m = memo.s + qt.s[i].memo;
+
+  if (!stralloc_copys(&querystr,"")) nomem();
+  uint16_unpack_big(type,&u16);
+  if (!stralloc_catulong0(&querystr,u16,0)) nomem();
+  if (!stralloc_cats(&querystr,":")) nomem();
+  if (!dns_domain_todot_cat(&querystr,q)) nomem();
+  if (!stralloc_cats(&querystr,":")) nomem();
+  if (!dns_domain_todot_cat(&querystr,control)) nomem();
+  if (!stralloc_cats(&querystr,":")) nomem();
+  if (!stralloc_catb(&querystr,ipstr,ip4_fmt(ipstr,ip))) nomem();
+  if (!stralloc_cats(&querystr,":")) nomem();
+
+  buffer_put(buffer_1,querystr.s,querystr.len);
+  buffer_puts(buffer_1,"tx\n");
+
+  if (m->result == -1) {
+    const char *x = error_str(m->err);
+    buffer_put(buffer_1,querystr.s,querystr.len);
+    buffer_puts(buffer_1,"ALERT:query failed; ");
+    buffer_puts(buffer_1,x);
+    buffer_puts(buffer_1,"\n");
+  }
+  else {
+    if (m->flagslow) {
+      buffer_put(buffer_1,querystr.s,querystr.len);
+      buffer_puts(buffer_1,"ALERT:took more than 1 second\n");
+    }
+    parsepacket(m->packet,m->len,q,type,control);
+  }
+
+  if (dns_domain_equal(q,"\011localhost\0")) {
+    buffer_put(buffer_1,querystr.s,querystr.len);
+    buffer_puts(buffer_1,"ALERT:some caches do not handle localhost internally\n");
+    address_add(q,"\177\0\0\1");
+  }
+  if (dd(q,"",ip) == 4) {
+    buffer_put(buffer_1,querystr.s,querystr.len);
+    buffer_puts(buffer_1,"ALERT:some caches do not handle IP addresses internally\n");
+    address_add(q,ip);
+  }
+
+  buffer_flush(buffer_1);
+}
+
 int main(int argc,char **argv)
 {
   static stralloc out;
   static stralloc fqdn;
   static stralloc udn;
   static char *q;
-  char *control;
   char type[2];
-  char ip[64];
+  int flagprogress;
+  int next;
   int i;
-  uint16 u16;
+  int m;
 
   dns_random_init(seed);
 
@@ -406,6 +559,7 @@ int main(int argc,char **argv)
   if (!query_alloc_readyplus(&query,1)) nomem();
   if (!ns_alloc_readyplus(&ns,1)) nomem();
   if (!qt_alloc_readyplus(&qt,1)) nomem();
+  if (!memo_alloc_readyplus(&memo,1)) nomem();
 
   if (!*argv) usage();
   if (!*++argv) usage();
@@ -424,50 +578,30 @@ int main(int argc,char **argv)
       address_add("",out.s + i);
   }
 
-  for (i = 0;i < qt.len;++i) {
-    if (!dns_domain_copy(&q,qt.s[i].owner)) nomem();
-    control = qt.s[i].control;
-    if (!dns_domain_suffix(q,control)) continue;
-    byte_copy(type,2,qt.s[i].type);
-    byte_copy(ip,4,qt.s[i].ip);
-
-    if (!stralloc_copys(&querystr,"")) nomem();
-    uint16_unpack_big(type,&u16);
-    if (!stralloc_catulong0(&querystr,u16,0)) nomem();
-    if (!stralloc_cats(&querystr,":")) nomem();
-    if (!dns_domain_todot_cat(&querystr,q)) nomem();
-    if (!stralloc_cats(&querystr,":")) nomem();
-    if (!dns_domain_todot_cat(&querystr,control)) nomem();
-    if (!stralloc_cats(&querystr,":")) nomem();
-    if (!stralloc_catb(&querystr,ipstr,ip4_fmt(ipstr,ip))) nomem();
-    if (!stralloc_cats(&querystr,":")) nomem();
-
-    buffer_put(buffer_1,querystr.s,querystr.len);
-    buffer_puts(buffer_1,"tx\n");
-    buffer_flush(buffer_1);
-
-    if (resolve(q,type,ip) == -1) {
-      const char *x = error_str(errno);
-      buffer_put(buffer_1,querystr.s,querystr.len);
-      buffer_puts(buffer_1,"ALERT:query failed; ");
-      buffer_puts(buffer_1,x);
-      buffer_puts(buffer_1,"\n");
-    }
-    else
-      parsepacket(tx.packet,tx.packetlen,q,type,control);
-
-    if (dns_domain_equal(q,"\011localhost\0")) {
-      buffer_put(buffer_1,querystr.s,querystr.len);
-      buffer_puts(buffer_1,"ALERT:some caches do not handle localhost internally\n");
-      address_add(q,"\177\0\0\1");
-    }
-    if (dd(q,"",ip) == 4) {
-      buffer_put(buffer_1,querystr.s,querystr.len);
-      buffer_puts(buffer_1,"ALERT:some caches do not handle IP addresses internally\n");
-      address_add(q,ip);
+  next = 0;
+  for (;;) {
+    while (next < qt.len) {
+      if (!dns_domain_suffix(qt.s[next].owner,qt.s[next].control)) { ++next; continue; }
+      m = memo_find(qt.s[next].owner,qt.s[next].type,qt.s[next].ip);
+      if (m == -1) {
+        if (numactive == PARALLEL) break;
+        m = memo_start(qt.s[next].owner,qt.s[next].type,qt.s[next].ip);
+      }
+      qt.s[next].memo = m;
+      qt.s[next].waiting = 1;
+      ++next;
     }
 
-    buffer_flush(buffer_1);
+    flagprogress = 0;
+    for (i = 0;i < next;++i)
+      if (qt.s[i].waiting && memo.s[qt.s[i].memo].result) {
+        qt.s[i].waiting = 0;
+        report(i);
+        flagprogress = 1;
+      }
+    if (flagprogress) continue;
+    if (!numactive) break;
+    slot_wait();
   }
 
   _exit(0);
@@ -1,32 +1,53 @@
 #include "buffer.h"
 #include "exit.h"
 #include "strerr.h"
+#include "byte.h"
+#include "str.h"
+#include "scan.h"
+#include "sgetopt.h"
 #include "dns.h"
+#include "dnsargs.h"
 
 #define FATAL "dnstxt: fatal: "
 
 static char seed[128];
 
-static stralloc fqdn;
-static stralloc out;
+int query(const char *arg,stralloc *out,char **q,char *qtype)
+{
+  if (!dns_domain_fromdot(q,arg,str_len(arg))) return -1;
+  byte_copy(qtype,2,DNS_T_TXT);
+  return 1;
+}
 
-int main(int argc,char **argv)
+void print(const char *arg,stralloc *out)
 {
-  dns_random_init(seed);
+  buffer_put(buffer_1,out->s,out->len);
+  buffer_puts(buffer_1,"\n");
+}
 
-  if (*argv) ++argv;
+struct dnsargs d = {
+  FATAL, "unable to find TXT records for ", query, dns_txt_packet, print
+} ;
 
-  while (*argv) {
-    if (!stralloc_copys(&fqdn,*argv))
-      strerr_die2x(111,FATAL,"out of memory");
-    if (dns_txt(&out,&fqdn) == -1)
-      strerr_die4sys(111,FATAL,"unable to find TXT records for ",*argv,": ");
+int main(int argc,char **argv)
+{
+  unsigned long u = 100;
+  int opt;
 
-    buffer_put(buffer_1,out.s,out.len);
-    buffer_puts(buffer_1,"\n");
+  dns_random_init(seed);
 
-    ++argv;
-  }
+  while ((opt = getopt(argc,argv,"c:")) != opteof)
+    switch(opt) {
+      case 'c':
+	scan_ulong(optarg,&u);
+	if (u < 1) u = 1;
+	if (u > 65536) u = 65536;
+	break;
+      default:
+	strerr_die1x(100,"dnstxt: usage: dnstxt [ -c concurrency ] fqdn ...");
+    }
+
+  dnsargs(&d,argv + optind,u);
 
   buffer_flush(buffer_1);
   _exit(0);
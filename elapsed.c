@@ -0,0 +1,42 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "strerr.h"
+#include "taia.h"
+#include "fmt.h"
+#include "exit.h"
+
+#define FATAL "elapsed: fatal: "
+
+/* elapsed prog args: runs prog, then prints how long it took in microseconds */
+
+char strnum[FMT_ULONG];
+
+int main(int argc,char **argv)
+{
+  struct taia start;
+  struct taia stop;
+  int wstat;
+  int pid;
+
+  if (!argv[1]) strerr_die1x(100,"elapsed: usage: elapsed prog args");
+
+  taia_now(&start);
+  pid = fork();
+  if (pid == -1) strerr_die2sys(111,FATAL,"unable to fork: ");
+  if (pid == 0) {
+    execvp(argv[1],argv + 1);
+    strerr_die4sys(111,FATAL,"unable to run ",argv[1],": ");
+  }
+  while (waitpid(pid,&wstat,0) == -1) ;
+  taia_now(&stop);
+  if (!WIFEXITED(wstat) || WEXITSTATUS(wstat))
+    strerr_die3x(111,FATAL,argv[1]," failed");
+
+  taia_sub(&stop,&stop,&start);
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,(unsigned long) (taia_approx(&stop) * 1000000.0)));
+  buffer_puts(buffer_1,"\n");
+  buffer_flush(buffer_1);
+  _exit(0);
+}
@@ -121,3 +121,10 @@ ECONNREFUSED;
 #else
 -17;
 #endif
+
+int error_srch =
+#ifdef ESRCH
+ESRCH;
+#else
+-18;
+#endif
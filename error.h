@@ -20,6 +20,7 @@ extern int error_nodevice;
 extern int error_proto;
 extern int error_isdir;
 extern int error_connrefused;
+extern int error_srch;
 
 extern const char *error_str(int);
 extern int error_temp(int);
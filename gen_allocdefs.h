@@ -1,13 +1,21 @@
 #ifndef GEN_ALLOC_DEFS_H
 #define GEN_ALLOC_DEFS_H
 
+/*
+A growing array gets twice what it needs, so appending costs O(1)
+per element however small the pieces; past 2^30 elements it gets an
+eighth more, so the size cannot wrap. Setting len to 0 keeps the
+space for reuse.
+*/
+#define GEN_ALLOC_spare(n) (((n) >> 30) ? ((n) >> 3) : (n))
+
 #define GEN_ALLOC_ready(ta,type,field,len,a,i,n,x,base,ta_ready) \
 int ta_ready(register ta *x,register unsigned int n) \
 { register unsigned int i; \
   if (x->field) { \
     i = x->a; \
     if (n > i) { \
-      x->a = base + n + (n >> 3); \
+      x->a = base + n + GEN_ALLOC_spare(n); \
       if (alloc_re(&x->field,i * sizeof(type),x->a * sizeof(type))) return 1; \
       x->a = i; return 0; } \
     return 1; } \
@@ -20,7 +28,7 @@ int ta_rplus(register ta *x,register unsigned int n) \
   if (x->field) { \
     i = x->a; n += x->len; \
     if (n > i) { \
-      x->a = base + n + (n >> 3); \
+      x->a = base + n + GEN_ALLOC_spare(n); \
       if (alloc_re(&x->field,i * sizeof(type),x->a * sizeof(type))) return 1; \
       x->a = i; return 0; } \
     return 1; } \
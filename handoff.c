@@ -0,0 +1,216 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "byte.h"
+#include "str.h"
+#include "error.h"
+#include "handoff.h"
+
+/*
+A server passes its bound sockets to its successor through a Unix
+socket at a path both are given. The successor calls handoff_get()
+before binding anything: if a predecessor is offering sockets there,
+it gets them, with whatever has queued on them since the predecessor
+stopped reading. It then calls handoff_listen() to make the same offer
+to its own successor, and when that successor connects, handoff_put()
+answers it.
+
+The predecessor first sends the number of descriptors, as four bytes,
+then the descriptors, HANDOFFCHUNK to a message, each message carrying
+one byte of data. Neither side waits more than HANDOFFTIMEOUT seconds
+for the other. A successor wanting another number of descriptors, as
+after a change of $WORKERS, takes them all the same, so that the
+predecessor can go, and closes them; it then binds its own.
+*/
+
+#define HANDOFFCHUNK 200 /* under SCM_MAX_FD */
+#define HANDOFFTIMEOUT 5
+
+static int path(struct sockaddr_un *sa,const char *fn)
+{
+  unsigned int len;
+
+  len = str_len(fn);
+  if (len >= sizeof sa->sun_path) { errno = error_proto; return -1; }
+  byte_zero((char *) sa,sizeof *sa);
+  sa->sun_family = AF_UNIX;
+  byte_copy(sa->sun_path,len,fn);
+  return 0;
+}
+
+static void timeout(int s)
+{
+  struct timeval tv;
+
+  tv.tv_sec = HANDOFFTIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof tv);
+  setsockopt(s,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof tv);
+}
+
+static int sendfds(int s,char *data,unsigned int len,int *fd,unsigned int n)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(HANDOFFCHUNK * sizeof(int))];
+
+  byte_zero((char *) &msg,sizeof msg);
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n) {
+    byte_zero(control,sizeof control);
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    byte_copy((char *) CMSG_DATA(cmsg),n * sizeof(int),(char *) fd);
+  }
+  if (sendmsg(s,&msg,0) != len) return -1;
+  return 0;
+}
+
+/* descriptors received, at most max; -1 on error */
+static int recvfds(int s,char *data,unsigned int len,int *fd,unsigned int max)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(HANDOFFCHUNK * sizeof(int))];
+  unsigned int n;
+  unsigned int i;
+  unsigned int k;
+  int flagextra;
+  int *p;
+  int r;
+
+  byte_zero((char *) &msg,sizeof msg);
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+  r = recvmsg(s,&msg,0);
+  if (r == -1) return -1;
+  if (r != len) { errno = error_proto; return -1; }
+
+  n = 0;
+  flagextra = 0;
+  for (cmsg = CMSG_FIRSTHDR(&msg);cmsg;cmsg = CMSG_NXTHDR(&msg,cmsg))
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+      p = (int *) CMSG_DATA(cmsg);
+      k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (i = 0;i < k;++i)
+        if (n < max) fd[n++] = p[i];
+        else { close(p[i]); flagextra = 1; }
+    }
+  if (flagextra || (msg.msg_flags & MSG_CTRUNC)) {
+    while (n > 0) close(fd[--n]);
+    errno = error_proto;
+    return -1;
+  }
+  return n;
+}
+
+/* n if it got n descriptors from the process offering them at fn; 0 if none is, or not n */
+int handoff_get(const char *fn,int *fd,unsigned int n)
+{
+  struct sockaddr_un sa;
+  char data[4];
+  unsigned long total;
+  unsigned int got;
+  int other[HANDOFFCHUNK];
+  int i;
+  int s;
+  int r;
+
+  if (path(&sa,fn) == -1) return -1;
+  s = socket(AF_UNIX,SOCK_STREAM,0);
+  if (s == -1) return -1;
+  if (connect(s,(struct sockaddr *) &sa,sizeof sa) == -1) {
+    close(s);
+    if ((errno == error_noent) || (errno == error_connrefused)) return 0;
+    return -1;
+  }
+  timeout(s);
+
+  if (recvfds(s,data,4,fd,0) == -1) { close(s); return -1; }
+  total = (unsigned char) data[0];
+  total = (total << 8) + (unsigned char) data[1];
+  total = (total << 8) + (unsigned char) data[2];
+  total = (total << 8) + (unsigned char) data[3];
+  if (total != n) {
+    for (got = 0;got < total;got += r) {
+      r = recvfds(s,data,1,other,HANDOFFCHUNK);
+      if (r <= 0) break;
+      for (i = 0;i < r;++i) close(other[i]);
+    }
+    close(s);
+    return 0;
+  }
+
+  for (got = 0;got < n;got += r) {
+    r = recvfds(s,data,1,fd + got,n - got);
+    if (r <= 0) {
+      while (got > 0) close(fd[--got]);
+      close(s);
+      if (!r) errno = error_proto;
+      return -1;
+    }
+  }
+  close(s);
+  return n;
+}
+
+/* listening socket at fn, replacing whatever was there */
+int handoff_listen(const char *fn)
+{
+  struct sockaddr_un sa;
+  int s;
+
+  if (path(&sa,fn) == -1) return -1;
+  s = socket(AF_UNIX,SOCK_STREAM,0);
+  if (s == -1) return -1;
+  if (unlink(fn) == -1)
+    if (errno != error_noent) { close(s); return -1; }
+  if (bind(s,(struct sockaddr *) &sa,sizeof sa) == -1) { close(s); return -1; }
+  if (listen(s,1) == -1) { close(s); return -1; }
+  return s;
+}
+
+/* 1 if it gave fd to a successor connecting to h; 0 if none was waiting */
+int handoff_put(int h,int *fd,unsigned int n)
+{
+  char data[4];
+  unsigned int i;
+  unsigned int chunk;
+  int s;
+
+  s = accept(h,(struct sockaddr *) 0,(socklen_t *) 0);
+  if (s == -1) {
+    if ((errno == error_again) || (errno == error_wouldblock)) return 0;
+    return -1;
+  }
+  timeout(s);
+
+  data[0] = n >> 24;
+  data[1] = n >> 16;
+  data[2] = n >> 8;
+  data[3] = n;
+  if (sendfds(s,data,4,fd,0) == -1) { close(s); return -1; }
+  for (i = 0;i < n;i += chunk) {
+    chunk = n - i;
+    if (chunk > HANDOFFCHUNK) chunk = HANDOFFCHUNK;
+    if (sendfds(s,data,1,fd + i,chunk) == -1) { close(s); return -1; }
+  }
+  close(s);
+  return 1;
+}
@@ -0,0 +1,8 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+extern int handoff_get(const char *,int *,unsigned int);
+extern int handoff_listen(const char *);
+extern int handoff_put(int,int *,unsigned int);
+
+#endif
@@ -24,16 +24,24 @@ void hier()
   c(auto_home,"bin","tinydns-get",-1,-1,0755);
   c(auto_home,"bin","tinydns-data",-1,-1,0755);
   c(auto_home,"bin","tinydns-edit",-1,-1,0755);
+  c(auto_home,"bin","tinydns-merge",-1,-1,0755);
+  c(auto_home,"bin","tinydns-dump",-1,-1,0755);
   c(auto_home,"bin","rbldns-data",-1,-1,0755);
   c(auto_home,"bin","pickdns-data",-1,-1,0755);
   c(auto_home,"bin","axfr-get",-1,-1,0755);
+  c(auto_home,"bin","axfr-pull",-1,-1,0755);
 
   c(auto_home,"bin","dnsip",-1,-1,0755);
   c(auto_home,"bin","dnsipq",-1,-1,0755);
   c(auto_home,"bin","dnsname",-1,-1,0755);
+  c(auto_home,"bin","dnsnotify",-1,-1,0755);
   c(auto_home,"bin","dnstxt",-1,-1,0755);
   c(auto_home,"bin","dnsmx",-1,-1,0755);
   c(auto_home,"bin","dnsfilter",-1,-1,0755);
+  c(auto_home,"bin","qlogdecode",-1,-1,0755);
+  c(auto_home,"bin","dnslogstats",-1,-1,0755);
+  c(auto_home,"bin","dnsreplay",-1,-1,0755);
+  c(auto_home,"bin","dnsgen",-1,-1,0755);
   c(auto_home,"bin","random-ip",-1,-1,0755);
   c(auto_home,"bin","dnsqr",-1,-1,0755);
   c(auto_home,"bin","dnsq",-1,-1,0755);
@@ -1,27 +1,33 @@
 #include "taia.h"
 #include "select.h"
 #include "iopause.h"
+#include "hasepoll.h"
+#include "haskqueue.h"
+#ifdef HASEPOLL
+#include <sys/epoll.h>
+#define IOPAUSE_PERSIST
+#include "hasuring.h"
+#ifdef HASURING
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
+#else
+#ifdef HASKQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#define IOPAUSE_PERSIST
+#endif
+#endif
+#include "alloc.h"
+#include "byte.h"
+#include "error.h"
 
-void iopause(iopause_fd *x,unsigned int len,struct taia *deadline,struct taia *stamp)
+static void classic(iopause_fd *x,unsigned int len,int millisecs)
 {
-  struct taia t;
-  int millisecs;
-  double d;
-  int i;
-
-  if (taia_less(deadline,stamp))
-    millisecs = 0;
-  else {
-    t = *stamp;
-    taia_sub(&t,deadline,&t);
-    d = taia_approx(&t);
-    if (d > 1000.0) d = 1000.0;
-    millisecs = d * 1000.0 + 20.0;
-  }
-
-  for (i = 0;i < len;++i)
-    x[i].revents = 0;
-
 #ifdef IOPAUSE_POLL
 
   poll(x,len,millisecs);
@@ -37,6 +43,7 @@ void iopause(iopause_fd *x,unsigned int len,struct taia *deadline,struct taia *s
   fd_set wfds;
   int nfds;
   int fd;
+  int i;
 
   FD_ZERO(&rfds);
   FD_ZERO(&wfds);
@@ -74,3 +81,541 @@ void iopause(iopause_fd *x,unsigned int len,struct taia *deadline,struct taia *s
 #endif
 
 }
+
+#ifdef IOPAUSE_PERSIST
+
+/* kernel keeps the interest set; we only tell it what changed */
+
+struct reg {
+  int events; /* as registered with the kernel; 0 if not registered */
+  unsigned long gen; /* last call that mentioned this fd */
+  unsigned int where; /* index into x during that call */
+  unsigned int pos; /* index into regfd while registered */
+} ;
+
+static int flagpersist = 0;
+static int kfd = -1;
+static unsigned long gen;
+static struct reg *reg;
+static unsigned int regsize;
+static int *regfd;
+static unsigned int reglen;
+static unsigned int regfdsize;
+
+#ifdef HASEPOLL
+static struct epoll_event *ev;
+#else
+static struct kevent *ev;
+#endif
+static unsigned int evsize;
+
+static int grow(char **p,unsigned int *size,unsigned int want,unsigned int each)
+{
+  unsigned int n;
+
+  if (want <= *size) return 1;
+  n = *size;
+  if (n < 16) n = 16;
+  while (n < want) n += n >> 1;
+  if (!*p) {
+    *p = alloc(n * each);
+    if (!*p) return 0;
+  }
+  else if (!alloc_re(p,*size * each,n * each)) return 0;
+  byte_zero(*p + *size * each,(n - *size) * each);
+  *size = n;
+  return 1;
+}
+
+static int growreg(int fd)
+{
+  return grow((char **) &reg,&regsize,fd + 1,sizeof(struct reg));
+}
+
+#ifdef HASEPOLL
+
+static int kset(int fd,int old,int new)
+{
+  struct epoll_event e;
+  int op;
+
+  byte_zero(&e,sizeof e);
+  e.data.fd = fd;
+  if (new & IOPAUSE_READ) e.events |= EPOLLIN;
+  if (new & IOPAUSE_WRITE) e.events |= EPOLLOUT;
+
+  if (!new) {
+    if (epoll_ctl(kfd,EPOLL_CTL_DEL,fd,&e) == -1)
+      if (errno != ENOENT && errno != EBADF) return -1;
+    return 0;
+  }
+
+  op = old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(kfd,op,fd,&e) == 0) return 0;
+  if (old && (errno == ENOENT))
+    return epoll_ctl(kfd,EPOLL_CTL_ADD,fd,&e);
+  if (!old && (errno == EEXIST))
+    return epoll_ctl(kfd,EPOLL_CTL_MOD,fd,&e);
+  return -1;
+}
+
+#else
+
+static int kfilter(int fd,int filter,int flags)
+{
+  struct kevent e;
+
+  EV_SET(&e,fd,filter,flags,0,0,0);
+  if (kevent(kfd,&e,1,(struct kevent *) 0,0,(struct timespec *) 0) == 0) return 0;
+  if ((flags & EV_DELETE) && (errno == ENOENT || errno == EBADF)) return 0;
+  return -1;
+}
+
+static int kset(int fd,int old,int new)
+{
+  if ((new & IOPAUSE_READ) && !(old & IOPAUSE_READ))
+    if (kfilter(fd,EVFILT_READ,EV_ADD) == -1) return -1;
+  if ((new & IOPAUSE_WRITE) && !(old & IOPAUSE_WRITE))
+    if (kfilter(fd,EVFILT_WRITE,EV_ADD) == -1) return -1;
+  if (!(new & IOPAUSE_READ) && (old & IOPAUSE_READ))
+    if (kfilter(fd,EVFILT_READ,EV_DELETE) == -1) return -1;
+  if (!(new & IOPAUSE_WRITE) && (old & IOPAUSE_WRITE))
+    if (kfilter(fd,EVFILT_WRITE,EV_DELETE) == -1) return -1;
+  return 0;
+}
+
+#endif
+
+static void unlist(int fd)
+{
+  unsigned int pos;
+  int last;
+
+  pos = reg[fd].pos;
+  last = regfd[--reglen];
+  regfd[pos] = last;
+  reg[last].pos = pos;
+  reg[fd].events = 0;
+}
+
+static int persist(iopause_fd *x,unsigned int len,int millisecs)
+{
+  unsigned int i;
+  int fd;
+  int want;
+  int r;
+
+  if (kfd == -1) {
+#ifdef HASEPOLL
+    kfd = epoll_create(len + 1);
+#else
+    kfd = kqueue();
+#endif
+    if (kfd == -1) { flagpersist = 0; return -1; }
+  }
+
+  ++gen;
+  for (i = 0;i < len;++i) {
+    fd = x[i].fd;
+    if (fd < 0) continue;
+    want = x[i].events & (IOPAUSE_READ | IOPAUSE_WRITE);
+    if (!want) continue;
+    if (!growreg(fd)) return -1;
+    if (reg[fd].gen == gen) return -1; /* same fd twice; let poll sort it out */
+    reg[fd].gen = gen;
+    reg[fd].where = i;
+    if (reg[fd].events == want) continue;
+    if (kset(fd,reg[fd].events,want) == -1) {
+      if (reg[fd].events) unlist(fd);
+      if (errno == error_perm) { /* regular file: always ready */
+	x[i].revents = want;
+	millisecs = 0;
+      }
+      continue;
+    }
+    if (!reg[fd].events) {
+      if (!grow((char **) &regfd,&regfdsize,reglen + 1,sizeof(int))) return -1;
+      reg[fd].pos = reglen;
+      regfd[reglen++] = fd;
+    }
+    reg[fd].events = want;
+  }
+
+  i = 0;
+  while (i < reglen) {
+    fd = regfd[i];
+    if (reg[fd].gen == gen) { ++i; continue; }
+    kset(fd,reg[fd].events,0);
+    unlist(fd);
+  }
+
+  if (!grow((char **) &ev,&evsize,reglen + 1,sizeof *ev)) return -1;
+
+#ifdef HASEPOLL
+  r = epoll_wait(kfd,ev,evsize,millisecs);
+  for (i = 0;(int) i < r;++i) {
+    fd = ev[i].data.fd;
+    if ((fd < 0) || (fd >= regsize) || (reg[fd].gen != gen)) continue;
+    want = x[reg[fd].where].events;
+    if (ev[i].events & (EPOLLERR | EPOLLHUP))
+      x[reg[fd].where].revents |= want;
+    if (ev[i].events & EPOLLIN)
+      x[reg[fd].where].revents |= want & IOPAUSE_READ;
+    if (ev[i].events & EPOLLOUT)
+      x[reg[fd].where].revents |= want & IOPAUSE_WRITE;
+  }
+#else
+{
+  struct timespec ts;
+
+  ts.tv_sec = millisecs / 1000;
+  ts.tv_nsec = 1000000 * (millisecs % 1000);
+  r = kevent(kfd,(struct kevent *) 0,0,ev,evsize,&ts);
+  for (i = 0;(int) i < r;++i) {
+    fd = ev[i].ident;
+    if ((fd < 0) || (fd >= regsize) || (reg[fd].gen != gen)) continue;
+    want = x[reg[fd].where].events;
+    if (ev[i].flags & (EV_ERROR | EV_EOF))
+      x[reg[fd].where].revents |= want;
+    if (ev[i].filter == EVFILT_READ)
+      x[reg[fd].where].revents |= want & IOPAUSE_READ;
+    if (ev[i].filter == EVFILT_WRITE)
+      x[reg[fd].where].revents |= want & IOPAUSE_WRITE;
+  }
+}
+#endif
+
+  return 0;
+}
+
+#ifdef HASURING
+
+/*
+With io_uring, each fd has at most one one-shot poll request
+outstanding. Changes to the interest set, and new polls for fds that
+fired last time, go into the submission queue, and one
+io_uring_enter() submits them all and waits. So dnscache, which
+starts and stops watching sockets all the time, no longer makes an
+epoll_ctl() for each. A poll for an fd that is still ready fires
+again at once, as poll() would. If io_uring_setup() fails, epoll or
+poll take over.
+*/
+
+#define UNOTE (~(uint64) 0) /* user_data of POLL_REMOVE requests */
+
+struct ureg {
+  int events; /* of the outstanding poll; 0 if none */
+  unsigned int seq; /* in the user_data of that poll */
+  unsigned long gen;
+  unsigned int where;
+  unsigned int pos; /* index into ulist while outstanding */
+} ;
+
+static int flaguring = 1; /* until io_uring_setup() fails */
+static int rfd = -1;
+static unsigned long ugen;
+static struct ureg *ureg;
+static unsigned int uregsize;
+static int *ulist;
+static unsigned int ulistlen;
+static unsigned int ulistsize;
+
+static unsigned int *sqhead;
+static unsigned int *sqtail;
+static unsigned int sqmask;
+static unsigned int sqentries;
+static struct io_uring_sqe *sqes;
+static unsigned int *cqhead;
+static unsigned int *cqtail;
+static unsigned int cqmask;
+static struct io_uring_cqe *cqes;
+static unsigned int tosubmit;
+
+static int usetup(void)
+{
+  struct io_uring_params p;
+  unsigned int *array;
+  char *sq;
+  char *cq;
+  unsigned int i;
+
+  byte_zero(&p,sizeof p);
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 4096;
+  rfd = syscall(__NR_io_uring_setup,1024,&p);
+  if (rfd == -1) return -1;
+  if (!(p.features & IORING_FEAT_EXT_ARG)) goto FAIL;
+
+  sq = mmap(0,p.sq_off.array + p.sq_entries * sizeof(unsigned int),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,rfd,IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) goto FAIL;
+  cq = mmap(0,p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,rfd,IORING_OFF_CQ_RING);
+  if (cq == MAP_FAILED) goto FAIL;
+  sqes = mmap(0,p.sq_entries * sizeof(struct io_uring_sqe),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,rfd,IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) goto FAIL;
+
+  sqhead = (unsigned int *) (sq + p.sq_off.head);
+  sqtail = (unsigned int *) (sq + p.sq_off.tail);
+  sqmask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+  sqentries = p.sq_entries;
+  array = (unsigned int *) (sq + p.sq_off.array);
+  for (i = 0;i < sqentries;++i) array[i] = i; /* slot i is sqes[i] */
+  cqhead = (unsigned int *) (cq + p.cq_off.head);
+  cqtail = (unsigned int *) (cq + p.cq_off.tail);
+  cqmask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+
+  FAIL:
+  close(rfd);
+  rfd = -1;
+  return -1;
+}
+
+/*
+iopause_send(fd,buf,len) queues a datagram for the peer fd is connected
+to. It goes out in the io_uring_enter() of the next iopause(), with the
+polls, so a loop iteration that starts many queries makes one system
+call for all their sends. buf is copied, since the caller may reuse it
+before then. The send has MSG_DONTWAIT, so it is done, or has failed,
+by the time io_uring_enter() returns; a failure is not reported, and
+looks to the caller like a datagram lost on the way. Without io_uring,
+or with SENDSLOTS datagrams already waiting, or for one over SENDMAX
+bytes, iopause_send() returns 0 and the caller sends for itself.
+*/
+
+#define SENDSLOTS 256
+#define SENDMAX 1024
+
+static char sendbuf[SENDSLOTS][SENDMAX];
+static unsigned int sendslots = 0; /* in use since the last enter() */
+
+static int enter(unsigned int wait,int millisecs)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int n;
+
+  n = tosubmit;
+  tosubmit = 0;
+  sendslots = 0;
+  if (!wait) return syscall(__NR_io_uring_enter,rfd,n,0,0,(void *) 0,0);
+  ts.tv_sec = millisecs / 1000;
+  ts.tv_nsec = 1000000 * (millisecs % 1000);
+  byte_zero(&arg,sizeof arg);
+  arg.ts = (unsigned long) &ts;
+  return syscall(__NR_io_uring_enter,rfd,n,1,IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,&arg,sizeof arg);
+}
+
+/* no SQPOLL: the kernel looks at the queue only in io_uring_enter() */
+static struct io_uring_sqe *sqe(void)
+{
+  struct io_uring_sqe *s;
+  unsigned int tail;
+
+  tail = *sqtail;
+  if (tail - __atomic_load_n(sqhead,__ATOMIC_ACQUIRE) >= sqentries) enter(0,0);
+  s = sqes + (tail & sqmask);
+  byte_zero(s,sizeof *s);
+  __atomic_store_n(sqtail,tail + 1,__ATOMIC_RELEASE);
+  ++tosubmit;
+  return s;
+}
+
+static void arm(int fd,int events)
+{
+  struct io_uring_sqe *s;
+
+  s = sqe();
+  s->opcode = IORING_OP_POLL_ADD;
+  s->fd = fd;
+  s->poll_events = ((events & IOPAUSE_READ) ? POLLIN : 0) | ((events & IOPAUSE_WRITE) ? POLLOUT : 0);
+  s->user_data = ((uint64) ++ureg[fd].seq << 32) | fd;
+}
+
+static void drop(int fd)
+{
+  unsigned int pos;
+  int last;
+
+  pos = ureg[fd].pos;
+  last = ulist[--ulistlen];
+  ulist[pos] = last;
+  ureg[last].pos = pos;
+  ureg[fd].events = 0;
+}
+
+static void disarm(int fd)
+{
+  struct io_uring_sqe *s;
+
+  s = sqe();
+  s->opcode = IORING_OP_POLL_REMOVE;
+  s->fd = -1;
+  s->addr = ((uint64) ureg[fd].seq << 32) | fd;
+  s->user_data = UNOTE;
+  drop(fd);
+}
+
+static int usend(int fd,const char *buf,unsigned int len)
+{
+  struct io_uring_sqe *s;
+  char *b;
+
+  if ((rfd == -1) || (fd < 0)) return 0;
+  if ((sendslots == SENDSLOTS) || (len > SENDMAX)) return 0;
+  s = sqe(); /* first: a full queue is entered, and sendslots reset */
+  b = sendbuf[sendslots++];
+  byte_copy(b,len,buf);
+  s->opcode = IORING_OP_SEND;
+  s->fd = fd;
+  s->addr = (unsigned long) b;
+  s->len = len;
+  s->msg_flags = MSG_DONTWAIT;
+  s->user_data = UNOTE;
+  return 1;
+}
+
+static int uring(iopause_fd *x,unsigned int len,int millisecs)
+{
+  struct io_uring_cqe *c;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int i;
+  uint64 ud;
+  int fd;
+  int want;
+  int r;
+
+  if (rfd == -1)
+    if (usetup() == -1) { flaguring = 0; return -1; }
+
+  ++ugen;
+  for (i = 0;i < len;++i) {
+    fd = x[i].fd;
+    if (fd < 0) continue;
+    want = x[i].events & (IOPAUSE_READ | IOPAUSE_WRITE);
+    if (!want) continue;
+    if (!grow((char **) &ureg,&uregsize,fd + 1,sizeof(struct ureg))) return -1;
+    if (ureg[fd].gen == ugen) return -1; /* same fd twice; let poll sort it out */
+    ureg[fd].gen = ugen;
+    ureg[fd].where = i;
+    if (ureg[fd].events == want) continue;
+    if (ureg[fd].events) disarm(fd);
+    if (!grow((char **) &ulist,&ulistsize,ulistlen + 1,sizeof(int))) return -1;
+    ureg[fd].pos = ulistlen;
+    ulist[ulistlen++] = fd;
+    arm(fd,want);
+    ureg[fd].events = want;
+  }
+
+  i = 0;
+  while (i < ulistlen) {
+    fd = ulist[i];
+    if (ureg[fd].gen == ugen) { ++i; continue; }
+    disarm(fd);
+  }
+
+  enter(1,millisecs);
+
+  head = *cqhead;
+  tail = __atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+  while (head != tail) {
+    c = cqes + (head++ & cqmask);
+    ud = c->user_data;
+    if (ud == UNOTE) continue;
+    fd = ud & 0xffffffff;
+    if ((fd >= uregsize) || !ureg[fd].events) continue;
+    if (ureg[fd].seq != (unsigned int) (ud >> 32)) continue;
+    drop(fd); /* a poll that fired is done */
+    if (ureg[fd].gen != ugen) continue;
+    want = x[ureg[fd].where].events;
+    r = c->res;
+    if ((r < 0) || (r & (POLLERR | POLLHUP | POLLNVAL)))
+      x[ureg[fd].where].revents |= want;
+    if (r > 0) {
+      if (r & POLLIN) x[ureg[fd].where].revents |= want & IOPAUSE_READ;
+      if (r & POLLOUT) x[ureg[fd].where].revents |= want & IOPAUSE_WRITE;
+    }
+  }
+  __atomic_store_n(cqhead,head,__ATOMIC_RELEASE);
+  return 0;
+}
+
+#endif
+
+#endif
+
+void iopause_persistent(void)
+{
+#ifdef IOPAUSE_PERSIST
+  flagpersist = 1;
+#endif
+}
+
+int iopause_send(int fd,const char *buf,unsigned int len)
+{
+#ifdef HASURING
+  if (flagpersist && flaguring) return usend(fd,buf,len);
+#endif
+  return 0;
+}
+
+void iopause_forget(int fd)
+{
+#ifdef HASURING
+  if (rfd != -1) {
+    if ((fd < 0) || (fd >= uregsize)) return;
+    if (ureg[fd].events) disarm(fd);
+    ureg[fd].gen = 0;
+    return;
+  }
+#endif
+#ifdef IOPAUSE_PERSIST
+  if (kfd == -1) return;
+  if ((fd < 0) || (fd >= regsize)) return;
+  if (reg[fd].events) {
+    kset(fd,reg[fd].events,0);
+    unlist(fd);
+  }
+  reg[fd].gen = 0;
+#endif
+}
+
+void iopause(iopause_fd *x,unsigned int len,struct taia *deadline,struct taia *stamp)
+{
+  struct taia t;
+  int millisecs;
+  double d;
+  int i;
+
+  if (taia_less(deadline,stamp))
+    millisecs = 0;
+  else {
+    t = *stamp;
+    taia_sub(&t,deadline,&t);
+    d = taia_approx(&t);
+    if (d > 1000.0) d = 1000.0;
+    millisecs = d * 1000.0 + 20.0;
+  }
+
+  for (i = 0;i < len;++i)
+    x[i].revents = 0;
+
+#ifdef HASURING
+  if (flagpersist && flaguring) {
+    if (uring(x,len,millisecs) == 0) return;
+    for (i = 0;i < len;++i)
+      x[i].revents = 0;
+    if (flaguring) { classic(x,len,millisecs); return; }
+  }
+#endif
+#ifdef IOPAUSE_PERSIST
+  if (flagpersist)
+    if (persist(x,len,millisecs) == 0)
+      return;
+  for (i = 0;i < len;++i)
+    x[i].revents = 0;
+#endif
+
+  classic(x,len,millisecs);
+}
@@ -1,18 +1,40 @@
 #include "fmt.h"
 #include "ip4.h"
 
+/* one octet in decimal, without fmt_ulong's loop to count digits */
+static unsigned int octet(char *s,unsigned int u)
+{
+  if (u >= 100) {
+    if (s) {
+      s[0] = '0' + u / 100;
+      s[1] = '0' + (u / 10) % 10;
+      s[2] = '0' + u % 10;
+    }
+    return 3;
+  }
+  if (u >= 10) {
+    if (s) {
+      s[0] = '0' + u / 10;
+      s[1] = '0' + u % 10;
+    }
+    return 2;
+  }
+  if (s) s[0] = '0' + u;
+  return 1;
+}
+
 unsigned int ip4_fmt(char *s,const char ip[4])
 {
   unsigned int len;
   unsigned int i;
  
   len = 0;
-  i = fmt_ulong(s,(unsigned long) (unsigned char) ip[0]); len += i; if (s) s += i;
+  i = octet(s,(unsigned char) ip[0]); len += i; if (s) s += i;
   if (s) *s++ = '.'; ++len;
-  i = fmt_ulong(s,(unsigned long) (unsigned char) ip[1]); len += i; if (s) s += i;
+  i = octet(s,(unsigned char) ip[1]); len += i; if (s) s += i;
   if (s) *s++ = '.'; ++len;
-  i = fmt_ulong(s,(unsigned long) (unsigned char) ip[2]); len += i; if (s) s += i;
+  i = octet(s,(unsigned char) ip[2]); len += i; if (s) s += i;
   if (s) *s++ = '.'; ++len;
-  i = fmt_ulong(s,(unsigned long) (unsigned char) ip[3]); len += i; if (s) s += i;
+  i = octet(s,(unsigned char) ip[3]); len += i; if (s) s += i;
   return len;
 }
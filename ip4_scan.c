@@ -1,6 +1,23 @@
 #include "scan.h"
 #include "ip4.h"
 
+/* same as scan_ulong, kept here so the compiler can inline it */
+static unsigned int number(const char *s,unsigned long *u)
+{
+  unsigned int pos;
+  unsigned long result;
+  unsigned long c;
+
+  pos = 0;
+  result = 0;
+  while ((c = (unsigned long) (unsigned char) (s[pos] - '0')) < 10) {
+    result = result * 10 + c;
+    ++pos;
+  }
+  *u = result;
+  return pos;
+}
+
 unsigned int ip4_scan(const char *s,char ip[4])
 {
   unsigned int i;
@@ -8,12 +25,12 @@ unsigned int ip4_scan(const char *s,char ip[4])
   unsigned long u;
  
   len = 0;
-  i = scan_ulong(s,&u); if (!i) return 0; ip[0] = u; s += i; len += i;
+  i = number(s,&u); if (!i) return 0; ip[0] = u; s += i; len += i;
   if (*s != '.') return 0; ++s; ++len;
-  i = scan_ulong(s,&u); if (!i) return 0; ip[1] = u; s += i; len += i;
+  i = number(s,&u); if (!i) return 0; ip[1] = u; s += i; len += i;
   if (*s != '.') return 0; ++s; ++len;
-  i = scan_ulong(s,&u); if (!i) return 0; ip[2] = u; s += i; len += i;
+  i = number(s,&u); if (!i) return 0; ip[2] = u; s += i; len += i;
   if (*s != '.') return 0; ++s; ++len;
-  i = scan_ulong(s,&u); if (!i) return 0; ip[3] = u; s += i; len += i;
+  i = number(s,&u); if (!i) return 0; ip[3] = u; s += i; len += i;
   return len;
 }
@@ -0,0 +1,69 @@
+#include "byte.h"
+#include "ip6.h"
+
+static unsigned int hexdigit(char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return 16;
+}
+
+/* eight groups of hex digits, or fewer around one ::; no dotted tail */
+unsigned int ip6_scan(const char *s,char ip[16])
+{
+  char tail[16];
+  unsigned int len;
+  unsigned int n;
+  unsigned int taillen;
+  unsigned int i;
+  unsigned int u;
+  unsigned int d;
+  int flagtail;
+
+  byte_zero(ip,16);
+  len = 0;
+  n = 0;
+  taillen = 0;
+  flagtail = 0;
+
+  if ((s[0] == ':') && (s[1] == ':')) {
+    flagtail = 1;
+    len = 2;
+    if (hexdigit(s[len]) == 16) return len;
+  }
+
+  for (;;) {
+    u = 0;
+    for (i = 0;i < 4;++i) {
+      d = hexdigit(s[len]);
+      if (d == 16) break;
+      u = (u << 4) + d;
+      ++len;
+    }
+    if (!i) return 0;
+    if (flagtail) {
+      if (taillen + n >= 16) return 0;
+      tail[taillen++] = u >> 8;
+      tail[taillen++] = u;
+    }
+    else {
+      if (n >= 16) return 0;
+      ip[n++] = u >> 8;
+      ip[n++] = u;
+    }
+    if (s[len] != ':') break;
+    if (s[len + 1] == ':') {
+      if (flagtail) return 0;
+      flagtail = 1;
+      len += 2;
+      if (hexdigit(s[len]) == 16) break;
+      continue;
+    }
+    ++len;
+  }
+
+  if (!flagtail) return (n == 16) ? len : 0;
+  byte_copy(ip + 16 - taillen,taillen,tail);
+  return len;
+}
@@ -0,0 +1,202 @@
+#include "alloc.h"
+#include "byte.h"
+#include "uint32.h"
+#include "cdb.h"
+#include "iptable.h"
+
+/*
+iptable_init() reads every listed address range out of a cdb, either
+the merged ranges at "\0i" or, in an older file, every 5-byte prefix
+record, into two bitmaps with one bit for each /24: full, if the
+whole /24 is listed, and part, if only some of it is. Each partial /24
+has a 256-bit leaf, found by counting the part bits before it; rank
+holds that count for each 32-bit word. A lookup is then at most a full
+word, a part word, its rank and one leaf byte. Each struct iptable
+has bitmaps of its own, 6MB of them.
+*/
+
+#define WORDS (1 << 19)
+
+static struct iptable *t; /* being filled by iptable_init() */
+
+struct sub { uint32 first; uint32 last; } ; /* inside one /24 */
+static struct sub *sub;
+static unsigned int numsubs;
+static unsigned int maxsubs;
+
+#ifdef __GNUC__
+#define popcount(u) __builtin_popcount(u)
+#else
+static unsigned int popcount(uint32 u)
+{
+  unsigned int n = 0;
+  while (u) { u &= u - 1; ++n; }
+  return n;
+}
+#endif
+
+static int addsub(uint32 first,uint32 last)
+{
+  unsigned int n;
+
+  if (numsubs == maxsubs) {
+    n = maxsubs + (maxsubs >> 1) + 1024;
+    if (!sub) sub = (struct sub *) alloc(n * sizeof(struct sub));
+    else if (!alloc_re((char **) &sub,maxsubs * sizeof(struct sub),n * sizeof(struct sub)))
+      return -1;
+    if (!sub) return -1;
+    maxsubs = n;
+  }
+  sub[numsubs].first = first;
+  sub[numsubs].last = last;
+  ++numsubs;
+  t->part[first >> 13] |= (uint32) 1 << ((first >> 8) & 31);
+  return 0;
+}
+
+static int mark(uint32 first,uint32 last)
+{
+  uint32 fb = first >> 8;
+  uint32 lb = last >> 8;
+
+  if (fb == lb) {
+    if (((first & 255) != 0) || ((last & 255) != 255))
+      return addsub(first,last);
+  }
+  else {
+    if (first & 255) {
+      if (addsub(first,first | 255) == -1) return -1;
+      ++fb;
+    }
+    if ((last & 255) != 255) {
+      if (addsub(last & ~(uint32) 255,last) == -1) return -1;
+      --lb;
+    }
+    if (fb > lb) return 0;
+  }
+  for (;;) {
+    t->full[fb >> 5] |= (uint32) 1 << (fb & 31);
+    if (fb == lb) return 0;
+    ++fb;
+  }
+}
+
+static int readranges(struct cdb *c)
+{
+  char *buf;
+  uint32 dlen;
+  uint32 pos;
+  uint32 first;
+  uint32 last;
+
+  dlen = cdb_datalen(c);
+  if (dlen & 7) return -1;
+  buf = alloc(dlen + 1);
+  if (!buf) return -1;
+  if (cdb_read(c,buf,dlen,cdb_datapos(c)) == -1) { alloc_free(buf); return -1; }
+  for (pos = 0;pos < dlen;pos += 8) {
+    uint32_unpack_big(buf + pos,&first);
+    uint32_unpack_big(buf + pos + 4,&last);
+    if (first > last) continue;
+    if (mark(first,last) == -1) { alloc_free(buf); return -1; }
+  }
+  alloc_free(buf);
+  return 0;
+}
+
+/* rbldns only ever matched /8 through /32 with no host bits set */
+static int readprefixes(struct cdb *c)
+{
+  char buf[13];
+  uint64 pos;
+  uint64 eod;
+  uint32 klen;
+  uint32 dlen;
+  uint32 first;
+  uint32 size;
+  unsigned int len;
+
+  if (cdb_eod(c,&eod) == -1) return -1;
+  for (pos = 2048;pos + 8 <= eod;pos += 8 + (uint64) klen + dlen) {
+    if (cdb_read(c,buf,8,pos) == -1) return -1;
+    uint32_unpack(buf,&klen);
+    uint32_unpack(buf + 4,&dlen);
+    if (klen != 5) continue;
+    if (cdb_read(c,buf + 8,5,pos + 8) == -1) return -1;
+    len = (unsigned char) buf[12];
+    if ((len < 8) || (len > 32)) continue;
+    uint32_unpack_big(buf + 8,&first);
+    size = (uint32) 1 << (32 - len);
+    if (first & (size - 1)) continue;
+    if (mark(first,first + (size - 1)) == -1) return -1;
+  }
+  return 0;
+}
+
+int iptable_init(struct iptable *table,struct cdb *c)
+{
+  unsigned int i;
+  uint32 u;
+  uint32 b;
+  uint32 x;
+  unsigned char *l;
+  int r;
+
+  t = table;
+  if (!t->full) {
+    t->full = (uint32 *) alloc(3 * WORDS * sizeof(uint32));
+    if (!t->full) return 0;
+    t->part = t->full + WORDS;
+    t->rank = t->part + WORDS;
+  }
+  byte_zero((char *) t->full,2 * WORDS * sizeof(uint32));
+  if (t->leaf) alloc_free((char *) t->leaf);
+  t->leaf = 0;
+  numsubs = 0;
+
+  r = cdb_find(c,"\0i",2);
+  if (r == -1) return 0;
+  if (r) r = readranges(c);
+  else r = readprefixes(c);
+  if (r == -1) return 0;
+
+  t->numleaves = 0;
+  for (i = 0;i < WORDS;++i) {
+    t->part[i] &= ~t->full[i];
+    t->rank[i] = t->numleaves;
+    t->numleaves += popcount(t->part[i]);
+  }
+
+  t->leaf = (unsigned char *) alloc(t->numleaves * 32 + 1);
+  if (!t->leaf) return 0;
+  byte_zero((char *) t->leaf,t->numleaves * 32);
+
+  for (i = 0;i < numsubs;++i) {
+    b = sub[i].first >> 8;
+    u = t->part[b >> 5];
+    if (!(u & ((uint32) 1 << (b & 31)))) continue;
+    l = t->leaf + 32 * (t->rank[b >> 5] + popcount(u & (((uint32) 1 << (b & 31)) - 1)));
+    for (x = sub[i].first & 255;x <= (sub[i].last & 255);++x)
+      l[x >> 3] |= 1 << (x & 7);
+  }
+
+  if (sub) alloc_free((char *) sub);
+  sub = 0;
+  maxsubs = 0;
+  return 1;
+}
+
+int iptable_find(const struct iptable *table,uint32 ipnum)
+{
+  uint32 b = ipnum >> 8;
+  uint32 bit = (uint32) 1 << (b & 31);
+  uint32 u;
+  unsigned char *l;
+
+  if (table->full[b >> 5] & bit) return 1;
+  u = table->part[b >> 5];
+  if (!(u & bit)) return 0;
+  l = table->leaf + 32 * (table->rank[b >> 5] + popcount(u & (bit - 1)));
+  ipnum &= 255;
+  return (l[ipnum >> 3] >> (ipnum & 7)) & 1;
+}
@@ -0,0 +1,18 @@
+#ifndef IPTABLE_H
+#define IPTABLE_H
+
+#include "uint32.h"
+#include "cdb.h"
+
+struct iptable {
+  uint32 *full;
+  uint32 *part;
+  uint32 *rank;
+  unsigned char *leaf;
+  uint32 numleaves;
+} ;
+
+extern int iptable_init(struct iptable *,struct cdb *);
+extern int iptable_find(const struct iptable *,uint32);
+
+#endif
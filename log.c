@@ -3,7 +3,12 @@
 #include "uint16.h"
 #include "error.h"
 #include "byte.h"
+#include "taia.h"
+#include "topn.h"
 #include "log.h"
+#include "logbuf.h"
+#include "perfcount.h"
+#include "profile.h"
 
 /* work around gcc 2.95.2 bug */
 #define number(x) ( (u64 = (x)), u64_print() )
@@ -23,10 +28,15 @@ static void u64_print(void)
   buffer_put(buffer_2,buf + pos,sizeof buf - pos);
 }
 
+static const char hexdigit[16] = "0123456789abcdef";
+
+/* straight into buffer_2's space, not one buffer_put() per digit */
 static void hex(unsigned char c)
 {
-  buffer_put(buffer_2,"0123456789abcdef" + (c >> 4),1);
-  buffer_put(buffer_2,"0123456789abcdef" + (c & 15),1);
+  char ch;
+
+  ch = hexdigit[c >> 4]; buffer_PUTC(buffer_2,ch);
+  ch = hexdigit[c & 15]; buffer_PUTC(buffer_2,ch);
 }
 
 static void string(const char *s)
@@ -37,7 +47,7 @@ static void string(const char *s)
 static void line(void)
 {
   string("\n");
-  buffer_flush(buffer_2);
+  logbuf_line();
 }
 
 static void space(void)
@@ -82,45 +92,235 @@ static void name(const char *q)
       --state;
       if ((ch <= 32) || (ch > 126)) ch = '?';
       if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
-      buffer_put(buffer_2,&ch,1);
+      buffer_PUTC(buffer_2,ch);
     }
     string(".");
   }
 }
 
+/*
+Sampling and rate limits. After log_sample(n), a query is logged only
+if its number is a multiple of n, and so are the lines written while
+dnscache works on it, as marked by log_for(). After log_ratelimit(n),
+each kind of line below goes out at most n times a second; the first
+line of a kind in a later second is preceded by "suppressed kind
+count" for what was left out.
+*/
+
+#define KIND_QUERY 0
+#define KIND_CACHED 1
+#define KIND_TX 2
+#define KIND_RR 3
+#define KIND_ANSWER 4
+#define KIND_TCP 5
+#define KIND_TRACE 6
+#define KINDS 7
+
+static const char *kindname[KINDS] = {
+  "query", "cached", "tx", "rr", "answer", "tcp", "slow"
+} ;
+
+static unsigned long sample = 0;
+static unsigned long ratelimit = 0;
+static int flagsampled = 1;
+static uint64 ratesec[KINDS];
+static unsigned long ratecount[KINDS];
+static unsigned long suppressed[KINDS];
+
+void log_sample(unsigned long n)
+{
+  sample = (n > 1) ? n : 0;
+}
+
+void log_ratelimit(unsigned long n)
+{
+  ratelimit = n;
+}
+
+static int sampled(uint64 *qnum)
+{
+  if (!sample) return 1;
+  return !(*qnum % sample);
+}
+
+/* the lines that follow are for query qnum; 0: for no query */
+void log_for(uint64 *qnum)
+{
+  flagsampled = qnum ? sampled(qnum) : 1;
+}
+
+static int limit(int kind)
+{
+  struct taia now;
+
+  if (!ratelimit) return 1;
+  taia_now(&now);
+  if (now.sec.x != ratesec[kind]) {
+    ratesec[kind] = now.sec.x;
+    ratecount[kind] = 0;
+    if (suppressed[kind]) {
+      string("suppressed "); string(kindname[kind]); space();
+      number(suppressed[kind]);
+      line();
+      suppressed[kind] = 0;
+    }
+  }
+  if (ratecount[kind] >= ratelimit) {
+    ++suppressed[kind];
+    return 0;
+  }
+  ++ratecount[kind];
+  return 1;
+}
+
+static int keep(int kind)
+{
+  if (!flagsampled) return 0;
+  return limit(kind);
+}
+
 void log_startup(void)
 {
   string("starting");
   line();
 }
 
+/*
+After log_topn(n), every query, sampled or not, goes into two
+Space-Saving sketches of n entries, of query names and of clients;
+log_top() writes out and clears both, heaviest first, as "topname
+count error name" and "topclient count error ip". A count may be
+high by up to its error.
+*/
+
+static struct topn_queries top;
+
+void log_topn(unsigned long n)
+{
+  topn_queriesinit(&top,n);
+}
+
+static void topname(struct topn_entry *e)
+{
+  string("topname "); number(e->count); space();
+  number(e->error); space(); name(e->key);
+  line();
+}
+
+static void topclient(struct topn_entry *e)
+{
+  string("topclient "); number(e->count); space();
+  number(e->error); space(); ip(e->key);
+  line();
+}
+
+void log_top(void)
+{
+  if (!top.flagon) return;
+  topn_each(&top.name,topname);
+  topn_each(&top.client,topclient);
+}
+
 void log_query(uint64 *qnum,const char client[4],unsigned int port,const char id[2],const char *q,const char qtype[2])
 {
+  PROFILE_ENTER(PROFILE_LOG)
+
+  topn_query(&top,q,client);
+
+  log_for(qnum);
+  if (!keep(KIND_QUERY)) { PROFILE_LEAVE return; }
+
   string("query "); number(*qnum); space();
   ip(client); string(":"); hex(port >> 8); hex(port & 255);
   string(":"); logid(id); space();
   logtype(qtype); space(); name(q);
   line();
+  PROFILE_LEAVE
 }
 
 void log_querydone(uint64 *qnum,unsigned int len)
 {
+  PROFILE_ENTER(PROFILE_LOG)
+
+  if (!sampled(qnum) || !limit(KIND_QUERY)) { PROFILE_LEAVE return; }
+
   string("sent "); number(*qnum); space();
   number(len);
   line();
+  PROFILE_LEAVE
+}
+
+void log_stale(uint64 *qnum,unsigned int len)
+{
+  if (!sampled(qnum) || !limit(KIND_QUERY)) return;
+
+  string("stale "); number(*qnum); space();
+  number(len);
+  line();
+}
+
+void log_queryretry(uint64 *qnum,uint64 *first)
+{
+  if (!sampled(qnum) || !limit(KIND_QUERY)) return;
+
+  string("retry "); number(*qnum); space();
+  number(*first);
+  line();
 }
 
 void log_querydrop(uint64 *qnum)
 {
   const char *x = error_str(errno);
 
+  if (!sampled(qnum) || !limit(KIND_QUERY)) return;
+
   string("drop "); number(*qnum); space();
   string(x);
   line();
 }
 
+/* slow qnum usec event... [lost n]; events as in query.c */
+
+static int flagtrace;
+
+void log_slow(uint64 *qnum,uint32 usec)
+{
+  flagtrace = limit(KIND_TRACE);
+  if (!flagtrace) return;
+
+  string("slow "); number(*qnum); space();
+  number(usec);
+}
+
+void log_slowevent(char what,unsigned int level,uint32 usec,const char server[4],unsigned int n)
+{
+  if (!flagtrace) return;
+
+  space();
+  buffer_put(buffer_2,&what,1);
+  number(level); string("@"); number(usec);
+  if (byte_diff(server,4,"\0\0\0\0")) {
+    string(":"); ip(server);
+  }
+  if (n) {
+    string("/"); number(n);
+  }
+}
+
+void log_slowdone(unsigned int lost)
+{
+  if (!flagtrace) return;
+
+  if (lost) {
+    string(" lost "); number(lost);
+  }
+  line();
+}
+
 void log_tcpopen(const char client[4],unsigned int port)
 {
+  if (!limit(KIND_TCP)) return;
+
   string("tcpopen ");
   ip(client); string(":"); hex(port >> 8); hex(port & 255);
   line();
@@ -129,6 +329,9 @@ void log_tcpopen(const char client[4],unsigned int port)
 void log_tcpclose(const char client[4],unsigned int port)
 {
   const char *x = error_str(errno);
+
+  if (!limit(KIND_TCP)) return;
+
   string("tcpclose ");
   ip(client); string(":"); hex(port >> 8); hex(port & 255); space();
   string(x);
@@ -139,6 +342,8 @@ void log_tx(const char *q,const char qtype[2],const char *control,const char ser
 {
   int i;
 
+  if (!keep(KIND_TX)) return;
+
   string("tx "); number(gluelessness); space();
   logtype(qtype); space(); name(q); space();
   name(control);
@@ -150,8 +355,28 @@ void log_tx(const char *q,const char qtype[2],const char *control,const char ser
   line();
 }
 
+void log_coalesce(const char *q,const char type[2])
+{
+  if (!keep(KIND_CACHED)) return;
+
+  string("coalesce "); logtype(type); space();
+  name(q);
+  line();
+}
+
+void log_prefetch(const char *q,const char type[2])
+{
+  if (!keep(KIND_CACHED)) return;
+
+  string("prefetch "); logtype(type); space();
+  name(q);
+  line();
+}
+
 void log_cachedanswer(const char *q,const char type[2])
 {
+  if (!keep(KIND_CACHED)) return;
+
   string("cached "); logtype(type); space();
   name(q);
   line();
@@ -159,24 +384,47 @@ void log_cachedanswer(const char *q,const char type[2])
 
 void log_cachedcname(const char *dn,const char *dn2)
 {
+  if (!keep(KIND_CACHED)) return;
+
   string("cached cname "); name(dn); space(); name(dn2);
   line();
 }
 
 void log_cachedns(const char *control,const char *ns)
 {
+  if (!keep(KIND_CACHED)) return;
+
   string("cached ns "); name(control); space(); name(ns);
   line();
 }
 
+void log_cachedservers(const char *control,const char servers[64])
+{
+  int i;
+
+  if (!keep(KIND_CACHED)) return;
+
+  string("cached servers "); name(control);
+  for (i = 0;i < 64;i += 4)
+    if (byte_diff(servers + i,4,"\0\0\0\0")) {
+      space();
+      ip(servers + i);
+    }
+  line();
+}
+
 void log_cachednxdomain(const char *dn)
 {
+  if (!keep(KIND_CACHED)) return;
+
   string("cached nxdomain "); name(dn);
   line();
 }
 
 void log_nxdomain(const char server[4],const char *q,unsigned int ttl)
 {
+  if (!keep(KIND_ANSWER)) return;
+
   string("nxdomain "); ip(server); space(); number(ttl); space();
   name(q);
   line();
@@ -184,6 +432,8 @@ void log_nxdomain(const char server[4],const char *q,unsigned int ttl)
 
 void log_nodata(const char server[4],const char *q,const char qtype[2],unsigned int ttl)
 {
+  if (!keep(KIND_ANSWER)) return;
+
   string("nodata "); ip(server); space(); number(ttl); space();
   logtype(qtype); space(); name(q);
   line();
@@ -191,6 +441,8 @@ void log_nodata(const char server[4],const char *q,const char qtype[2],unsigned
 
 void log_lame(const char server[4],const char *control,const char *referral)
 {
+  if (!keep(KIND_ANSWER)) return;
+
   string("lame "); ip(server); space();
   name(control); space(); name(referral);
   line();
@@ -200,15 +452,28 @@ void log_servfail(const char *dn)
 {
   const char *x = error_str(errno);
 
+  if (!keep(KIND_ANSWER)) return;
+
   string("servfail "); name(dn); space();
   string(x);
   line();
 }
 
+void log_nxlimit(const char *dn,const char *zone)
+{
+  if (!keep(KIND_ANSWER)) return;
+
+  string("nxlimit "); name(dn); space();
+  name(zone);
+  line();
+}
+
 void log_rr(const char server[4],const char *q,const char type[2],const char *buf,unsigned int len,unsigned int ttl)
 {
   int i;
 
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl); space();
   logtype(type); space(); name(q); space();
 
@@ -224,6 +489,8 @@ void log_rr(const char server[4],const char *q,const char type[2],const char *bu
 
 void log_rrns(const char server[4],const char *q,const char *data,unsigned int ttl)
 {
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl);
   string(" ns "); name(q); space();
   name(data);
@@ -232,6 +499,8 @@ void log_rrns(const char server[4],const char *q,const char *data,unsigned int t
 
 void log_rrcname(const char server[4],const char *q,const char *data,unsigned int ttl)
 {
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl);
   string(" cname "); name(q); space();
   name(data);
@@ -240,6 +509,8 @@ void log_rrcname(const char server[4],const char *q,const char *data,unsigned in
 
 void log_rrptr(const char server[4],const char *q,const char *data,unsigned int ttl)
 {
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl);
   string(" ptr "); name(q); space();
   name(data);
@@ -250,6 +521,8 @@ void log_rrmx(const char server[4],const char *q,const char *mx,const char pref[
 {
   uint16 u;
 
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl);
   string(" mx "); name(q); space();
   uint16_unpack_big(pref,&u);
@@ -262,6 +535,8 @@ void log_rrsoa(const char server[4],const char *q,const char *n1,const char *n2,
   uint32 u;
   int i;
 
+  if (!keep(KIND_RR)) return;
+
   string("rr "); ip(server); space(); number(ttl);
   string(" soa "); name(q); space();
   name(n1); space(); name(n2);
@@ -272,6 +547,127 @@ void log_rrsoa(const char server[4],const char *q,const char *n1,const char *n2,
   line();
 }
 
+void log_cachedump(int r)
+{
+  string("cachedump ");
+  string((r == -1) ? error_str(errno) : "ok");
+  line();
+}
+
+void log_cacheresize(unsigned long from,unsigned long to,int r)
+{
+  string("cacheresize "); number(from);
+  space(); number(to); space();
+  string((r == -1) ? error_str(errno) : "ok");
+  line();
+}
+
+void log_statedump(int r)
+{
+  string("statedump ");
+  string((r == -1) ? "failed" : "ok");
+  line();
+}
+
+void log_cacheload(int num)
+{
+  string("cacheload ");
+  if (num == -1) string(error_str(errno)); else number(num);
+  line();
+}
+
+void log_reload(const char *what,int r)
+{
+  string("reload "); string(what); space();
+  string((r == -1) ? error_str(errno) : "ok");
+  line();
+}
+
+void log_primed(unsigned int num,unsigned long ms)
+{
+  string("primed "); number(num); space(); number(ms);
+  line();
+}
+
+void log_interval(void)
+{
+  extern uint64 cache_hits;
+  extern uint64 cache_misses;
+  extern uint64 cache_expired;
+  extern uint64 cache_evictions;
+  extern uint64 query_sent;
+
+  string("interval ");
+  number(cache_hits); space();
+  number(cache_misses); space();
+  number(cache_expired); space();
+  number(cache_evictions); space();
+  number(query_sent);
+  line();
+}
+
+void log_latency(const uint64 *bucket,unsigned int n)
+{
+  unsigned int i;
+
+  string("latency");
+  for (i = 0;i < n;++i) {
+    space();
+    number(bucket[i]);
+  }
+  line();
+}
+
+void log_histogram(const char *what,const char *which,const uint64 *bucket,unsigned int n)
+{
+  unsigned int i;
+
+  string(what); space(); string(which);
+  for (i = 0;i < n;++i) {
+    space();
+    number(bucket[i]);
+  }
+  line();
+}
+
+void log_ghost(uint64 lookups,const uint64 *misses,unsigned int n)
+{
+  unsigned int i;
+
+  if (!lookups) return;
+  string("ghost "); number(lookups);
+  for (i = 0;i < n;++i) {
+    space();
+    number(misses[i]);
+  }
+  line();
+}
+
+void log_cacheindex(uint64 truncated,uint64 indexfull)
+{
+  string("cacheindex "); number(truncated);
+  space(); number(indexfull);
+  line();
+}
+
+/* perf site calls sampled cycles llcmisses branchmisses */
+void log_perf(void)
+{
+  int i;
+  int j;
+
+  for (i = 0;i < PERF_SITES;++i) {
+    if (!perfcount[i].calls) continue;
+    string("perf "); string(perfcount_name[i]); space();
+    number(perfcount[i].calls); space();
+    number(perfcount[i].sampled);
+    for (j = 0;j < PERF_EVENTS;++j) {
+      space(); number(perfcount[i].count[j]);
+    }
+    line();
+  }
+}
+
 void log_stats(void)
 {
   extern uint64 numqueries;
@@ -1,27 +1,45 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include "uint32.h"
 #include "uint64.h"
 
+extern void log_sample(unsigned long);
+extern void log_ratelimit(unsigned long);
+extern void log_for(uint64 *);
+
+extern void log_topn(unsigned long);
+extern void log_top(void);
+
 extern void log_startup(void);
 
 extern void log_query(uint64 *,const char *,unsigned int,const char *,const char *,const char *);
 extern void log_querydrop(uint64 *);
+extern void log_queryretry(uint64 *,uint64 *);
 extern void log_querydone(uint64 *,unsigned int);
+extern void log_stale(uint64 *,unsigned int);
+
+extern void log_slow(uint64 *,uint32);
+extern void log_slowevent(char,unsigned int,uint32,const char *,unsigned int);
+extern void log_slowdone(unsigned int);
 
 extern void log_tcpopen(const char *,unsigned int);
 extern void log_tcpclose(const char *,unsigned int);
 
 extern void log_cachedanswer(const char *,const char *);
+extern void log_coalesce(const char *,const char *);
+extern void log_prefetch(const char *,const char *);
 extern void log_cachedcname(const char *,const char *);
 extern void log_cachednxdomain(const char *);
 extern void log_cachedns(const char *,const char *);
+extern void log_cachedservers(const char *,const char [64]);
 
 extern void log_tx(const char *,const char *,const char *,const char *,unsigned int);
 
 extern void log_nxdomain(const char *,const char *,unsigned int);
 extern void log_nodata(const char *,const char *,const char *,unsigned int);
 extern void log_servfail(const char *);
+extern void log_nxlimit(const char *,const char *);
 extern void log_lame(const char *,const char *,const char *);
 
 extern void log_rr(const char *,const char *,const char *,const char *,unsigned int,unsigned int);
@@ -31,6 +49,19 @@ extern void log_rrptr(const char *,const char *,const char *,unsigned int);
 extern void log_rrmx(const char *,const char *,const char *,const char *,unsigned int);
 extern void log_rrsoa(const char *,const char *,const char *,const char *,const char *,unsigned int);
 
+extern void log_cachedump(int);
+extern void log_cacheresize(unsigned long,unsigned long,int);
+extern void log_statedump(int);
+extern void log_cacheload(int);
+extern void log_reload(const char *,int);
+extern void log_primed(unsigned int,unsigned long);
+
 extern void log_stats(void);
+extern void log_interval(void);
+extern void log_latency(const uint64 *,unsigned int);
+extern void log_histogram(const char *,const char *,const uint64 *,unsigned int);
+extern void log_perf(void);
+extern void log_ghost(uint64,const uint64 *,unsigned int);
+extern void log_cacheindex(uint64,uint64);
 
 #endif
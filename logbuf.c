@@ -0,0 +1,378 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "alloc.h"
+#include "byte.h"
+#include "error.h"
+#include "fmt.h"
+#include "ndelay.h"
+#include "logbuf.h"
+#include "profile.h"
+
+/*
+After logbuf_init(n), log lines collect in an n-byte buffer in place
+of buffer_2, and go out in one write when half of it is full or when
+the program calls logbuf_flush() before waiting for more work.
+Descriptor 2 is made non-blocking. If the reader falls behind, whole
+lines are dropped rather than waiting; a line cut short by a partial
+write is finished first, and the next write starts with a line
+"logdrop n" counting what was lost.
+
+Each write is at most PIPE_BUF bytes, ending at the end of a line
+where one fits, so that the lines of workers sharing descriptor 2
+as a pipe come out whole rather than mixed together.
+*/
+
+#define PENDMAX 1024
+#ifndef PIPE_BUF
+#define PIPE_BUF 512
+#endif
+
+static buffer b;
+static int flagon = 0;
+
+static char pend[PENDMAX + 1]; /* rest of a line already partly written */
+static unsigned int pendlen = 0;
+static int flagmid = 0; /* what went out ends in the middle of a line */
+static int flagskip = 0; /* dropping the rest of a line */
+static unsigned long dropped = 0;
+
+static void discard(const char *s,unsigned int len)
+{
+  unsigned int i;
+
+  if (flagskip) {
+    i = byte_chr(s,len,'\n');
+    if (i == len) return;
+    flagskip = 0;
+    s += i + 1;
+    len -= i + 1;
+  }
+  for (i = 0;i < len;++i)
+    if (s[i] == '\n') ++dropped;
+  if (len && (s[len - 1] != '\n')) {
+    ++dropped;
+    flagskip = 1;
+  }
+}
+
+/* 1 if all of s went out; else the line it stopped in goes to pend */
+static int push(int fd,const char *s,unsigned int len)
+{
+  unsigned int i;
+  int w;
+
+  while (len) {
+    i = len;
+    if (i > PIPE_BUF) {
+      for (i = PIPE_BUF;i > 0;--i)
+        if (s[i - 1] == '\n') break;
+      if (!i) i = PIPE_BUF;
+    }
+    w = write(fd,s,i);
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      break;
+    }
+    if (!w) break;
+    flagmid = (s[w - 1] != '\n');
+    s += w;
+    len -= w;
+  }
+  if (!len) return 1;
+
+  if (!flagmid) {
+    discard(s,len);
+    return 0;
+  }
+  i = byte_chr(s,len,'\n');
+  if (i < len) ++i;
+  if (i > PENDMAX) i = PENDMAX;
+  byte_copy(pend,i,s);
+  pendlen = i;
+  if (pend[i - 1] != '\n') {
+    pend[pendlen++] = '\n';
+    flagskip = 1;
+  }
+  discard(s + i,len - i);
+  return 0;
+}
+
+static int logwrite(int fd,const char *buf,unsigned int len)
+{
+  char line[8 + FMT_ULONG];
+  unsigned long u;
+  unsigned int n;
+
+  if (pendlen) {
+    n = pendlen;
+    pendlen = 0;
+    if (!push(fd,pend,n)) { discard(buf,len); return len; }
+  }
+
+  if (dropped && !flagmid) {
+    byte_copy(line,8,"logdrop ");
+    n = 8 + fmt_ulong(line + 8,dropped);
+    line[n++] = '\n';
+    u = dropped;
+    dropped = 0;
+    if (!push(fd,line,n)) {
+      if (!pendlen) dropped = u;
+      discard(buf,len);
+      return len;
+    }
+  }
+
+  push(fd,buf,len);
+  return len;
+}
+
+/* returns -1 if there was not enough memory */
+int logbuf_init(unsigned int n)
+{
+  char *x;
+
+  if (n < 2 * PENDMAX) n = 2 * PENDMAX;
+  x = alloc(n);
+  if (!x) return -1;
+  buffer_flush(buffer_2);
+  buffer_init(&b,logwrite,2,x,n);
+  buffer_2 = &b;
+  ndelay_on(2);
+  flagon = 1;
+  return 0;
+}
+
+/* called at the end of each line */
+void logbuf_line(void)
+{
+  PROFILE_ENTER(PROFILE_LOG)
+
+  if (!flagon)
+    buffer_flush(buffer_2);
+  else if (b.p >= b.n / 2)
+    buffer_flush(&b);
+  PROFILE_LEAVE
+}
+
+void logbuf_flush(void)
+{
+  PROFILE_ENTER(PROFILE_LOG)
+
+  if (flagon) {
+    if (b.p)
+      buffer_flush(&b);
+    else if (pendlen || dropped)
+      logwrite(2,"",0);
+  }
+  PROFILE_LEAVE
+}
+
+/*
+After logbuf_ring(n), called before fork(), each flush of the buffer,
+always whole lines, goes as one record into an n-byte ring in memory
+shared by every process, in place of descriptor 2. A process claims
+room for a record with one compare-and-swap on head, copies the lines
+in, and then sets the record's length word, so no process ever waits
+for another. logbuf_drain() writes the finished records out in order,
+blocking if it must, and zeroes the room behind it. A process finding
+no room drops the lines, counted in the ring; logbuf_drain() follows
+them with a line "logdrop n".
+
+Before each compare-and-swap a process notes the position and size it
+is claiming in its own slot of the ring. If a process dies between
+claiming room and setting the length word, logbuf_drain() finds the
+one slot naming that position, sees the process gone, and skips the
+room, counting it as a dropped line, rather than waiting for it
+forever.
+*/
+
+#define CLAIMS 256
+
+struct claim {
+  volatile int pid;
+  volatile unsigned long pos; /* 1 + position being claimed, or 0 */
+  volatile unsigned long need;
+} ;
+
+struct ring {
+  volatile unsigned long head; /* bytes claimed, ever */
+  volatile unsigned long tail; /* bytes drained, ever */
+  volatile unsigned long dropped; /* lines */
+  unsigned long size; /* a power of 2 */
+  struct claim claim[CLAIMS];
+} ;
+
+static struct ring *ring = 0;
+static char *ringspace;
+
+static int gone(int pid)
+{
+  return (kill(pid,0) == -1) && (errno == error_srch);
+}
+
+/* this process's slot; 0 if every slot is taken by a live process */
+static struct claim *claimslot(void)
+{
+  static struct claim *c = 0;
+  static int mypid = 0;
+  int pid;
+  int i;
+
+  pid = getpid();
+  if (pid == mypid) return c;
+  mypid = pid;
+  c = 0;
+  for (i = 0;i < CLAIMS;++i)
+    if (__sync_bool_compare_and_swap(&ring->claim[i].pid,0,pid)) {
+      c = &ring->claim[i];
+      return c;
+    }
+  for (i = 0;i < CLAIMS;++i) {
+    pid = ring->claim[i].pid;
+    if (!ring->claim[i].pos && gone(pid))
+      if (__sync_bool_compare_and_swap(&ring->claim[i].pid,pid,mypid)) {
+        c = &ring->claim[i];
+        return c;
+      }
+  }
+  return 0;
+}
+
+/* room claimed at pos by a process now gone; 0 if none or unsure */
+static unsigned long unclaim(unsigned long pos)
+{
+  struct claim *c = 0;
+  unsigned long need;
+  int i;
+
+  for (i = 0;i < CLAIMS;++i)
+    if (ring->claim[i].pos == pos + 1) {
+      if (c) return 0;
+      c = &ring->claim[i];
+    }
+  if (!c || !gone(c->pid)) return 0;
+  need = c->need;
+  c->pos = 0;
+  return need;
+}
+
+static void ringcopy(unsigned long pos,const char *buf,unsigned int len)
+{
+  unsigned long off;
+  unsigned long first;
+
+  off = pos & (ring->size - 1);
+  first = ring->size - off;
+  if (first > len) first = len;
+  byte_copy(ringspace + off,first,buf);
+  byte_copy(ringspace,len - first,buf + first);
+}
+
+static int ringwrite(int fd,const char *buf,unsigned int len)
+{
+  struct claim *c;
+  unsigned long need;
+  unsigned long h;
+  unsigned long n;
+  unsigned int i;
+
+  c = claimslot();
+  need = 4 + ((len + 3) & ~3);
+  for (;;) {
+    h = ring->head;
+    if (h + need - ring->tail > ring->size) {
+      if (c) c->pos = 0;
+      for (n = 0,i = 0;i < len;++i)
+        if (buf[i] == '\n') ++n;
+      __sync_fetch_and_add(&ring->dropped,n);
+      return len;
+    }
+    if (c) {
+      c->need = need;
+      __sync_synchronize();
+      c->pos = h + 1;
+    }
+    if (__sync_bool_compare_and_swap(&ring->head,h,h + need)) break;
+  }
+  ringcopy(h + 4,buf,len);
+  __sync_synchronize();
+  *(volatile unsigned int *) (ringspace + (h & (ring->size - 1))) = len + 1;
+  if (c) c->pos = 0;
+  return len;
+}
+
+/* returns -1 if there was not enough memory */
+int logbuf_ring(unsigned int n)
+{
+  unsigned long size;
+  char *x;
+
+  for (size = 4096;size < n;size <<= 1) ;
+  x = mmap(0,sizeof(struct ring) + size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANON,-1,0);
+  if (x == (char *) MAP_FAILED) return -1;
+  byte_zero(x,sizeof(struct ring));
+  ring = (struct ring *) x;
+  ring->size = size;
+  ringspace = x + sizeof(struct ring);
+  if (!flagon)
+    if (logbuf_init(2 * PENDMAX) == -1) return -1;
+  ndelay_off(2);
+  buffer_init(&b,ringwrite,2,b.x,b.n);
+  return 0;
+}
+
+static char drainspace[8192];
+static buffer drainout = BUFFER_INIT(buffer_unixwrite,2,drainspace,sizeof drainspace);
+
+/* returns 0 if there is no ring */
+int logbuf_drain(void)
+{
+  char line[8 + FMT_ULONG];
+  unsigned long pos;
+  unsigned long need;
+  unsigned long off;
+  unsigned long first;
+  unsigned long u;
+  unsigned int len;
+
+  if (!ring) return 0;
+  for (pos = ring->tail;pos != ring->head;pos += need) {
+    len = *(volatile unsigned int *) (ringspace + (pos & (ring->size - 1)));
+    if (len) {
+      __sync_synchronize();
+      --len;
+      need = 4 + ((len + 3) & ~3);
+      off = (pos + 4) & (ring->size - 1);
+      first = ring->size - off;
+      if (first > len) first = len;
+      buffer_put(&drainout,ringspace + off,first);
+      buffer_put(&drainout,ringspace,len - first);
+    }
+    else {
+      need = unclaim(pos);
+      if (!need) break; /* still being copied in */
+      __sync_fetch_and_add(&ring->dropped,1);
+    }
+    off = pos & (ring->size - 1);
+    first = ring->size - off;
+    if (first > need) first = need;
+    byte_zero(ringspace + off,first);
+    byte_zero(ringspace,need - first);
+  }
+  __sync_synchronize();
+  ring->tail = pos;
+
+  u = __sync_fetch_and_and(&ring->dropped,0);
+  if (u) {
+    byte_copy(line,8,"logdrop ");
+    len = 8 + fmt_ulong(line + 8,u);
+    line[len++] = '\n';
+    buffer_put(&drainout,line,len);
+  }
+  buffer_flush(&drainout);
+  return 1;
+}
@@ -0,0 +1,10 @@
+#ifndef LOGBUF_H
+#define LOGBUF_H
+
+extern int logbuf_init(unsigned int);
+extern void logbuf_line(void);
+extern void logbuf_flush(void);
+extern int logbuf_ring(unsigned int);
+extern int logbuf_drain(void);
+
+#endif
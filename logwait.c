@@ -0,0 +1,38 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "iopause.h"
+#include "taia.h"
+#include "logbuf.h"
+#include "logwait.h"
+
+/*
+logwait(&wstat) is waitpid(-1,&wstat,0) for a supervisor whose
+workers log through logbuf_ring(): it writes the ring out every
+NAP milliseconds while it waits.
+*/
+
+#define NAP 10
+
+static void nap(void)
+{
+  struct taia stamp;
+  struct taia deadline;
+
+  taia_now(&stamp);
+  taia_uint(&deadline,0);
+  deadline.nano = NAP * 1000000;
+  taia_add(&deadline,&deadline,&stamp);
+  iopause((iopause_fd *) 0,0,&deadline,&stamp);
+}
+
+int logwait(int *wstat)
+{
+  int pid;
+
+  for (;;) {
+    if (!logbuf_drain()) return waitpid(-1,wstat,0);
+    pid = waitpid(-1,wstat,WNOHANG);
+    if (pid) return pid;
+    nap();
+  }
+}
@@ -0,0 +1,6 @@
+#ifndef LOGWAIT_H
+#define LOGWAIT_H
+
+extern int logwait(int *);
+
+#endif
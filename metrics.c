@@ -0,0 +1,185 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "byte.h"
+#include "str.h"
+#include "uint16.h"
+#include "dns.h"
+#include "response.h"
+#include "metrics.h"
+
+/*
+Counters, kept by each worker in its own row of memory shared by all
+workers, so no worker ever writes where another does and none of
+them locks. metrics_answer() adds up the rows. It answers a TXT
+query in class CHAOS for the name given to metrics_init(), with one
+string "name value" for each counter that is not 0; a client can get
+queries per second from two readings. For i.name it answers the same
+from worker i's row alone, so a worker doing more than its share
+shows.
+
+Rows start on a page of their own: no two workers write in one cache
+line, and a row is in the memory of the CPU that first writes it.
+
+Before metrics_init(), or if it fails, metric points at a private
+row, so counting costs the same and shows nowhere.
+*/
+
+static uint64 own[METRICS];
+uint64 *metric = own;
+
+static uint64 *rows = 0;
+static unsigned int numrows = 0;
+static unsigned int rowlen = METRICS; /* uint64s from one row to the next */
+static char *name = 0;
+
+/* returns -1 if there was not enough memory; call before fork() */
+int metrics_init(const char *dotted,unsigned int workers)
+{
+  char *x;
+  long page;
+
+  if (!dns_domain_fromdot(&name,dotted,str_len(dotted))) return -1;
+  if (!workers) workers = 1;
+  page = sysconf(_SC_PAGESIZE);
+  if (page < (long) sizeof(uint64)) page = 4096;
+  rowlen = METRICS + page / sizeof(uint64) - 1;
+  rowlen -= rowlen % (page / sizeof(uint64));
+  x = mmap(0,workers * rowlen * sizeof(uint64),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANON,-1,0);
+  if (x == (char *) MAP_FAILED) return -1;
+  rows = (uint64 *) x; /* zero, and untouched until a worker counts */
+  numrows = workers;
+  metric = rows;
+  return 0;
+}
+
+void metrics_worker(unsigned int i)
+{
+  if (rows && (i < numrows)) metric = rows + i * rowlen;
+}
+
+/* counts the rcode of the packet in response */
+void metrics_rcode(const char *packet)
+{
+  ++metric[METRIC_RCODE + (packet[3] & 15)];
+}
+
+void metrics_since(int base,const struct taia *start)
+{
+  struct taia now;
+  double d;
+  int i;
+
+  taia_clock(&now);
+  if (taia_less(&now,start)) { ++metric[base]; return; }
+  taia_sub(&now,&now,start);
+  d = taia_approx(&now) * 1000.0;
+  for (i = 0;i < 15;++i)
+    if (d < (double) (1 << i)) break;
+  ++metric[base + i];
+}
+
+static const char *label[METRICS] = {
+  "queries", "answers", "dropped", "reloads"
+, "udpactive", "tcpactive", "udpevicted", "tcpevicted"
+, "cachehits", "cachemisses", "cacheexpired", "cacheevictions"
+, "upstream"
+, "rcode0", "rcode1", "rcode2", "rcode3", "rcode4", "rcode5", "rcode6", "rcode7"
+, "rcode8", "rcode9", "rcode10", "rcode11", "rcode12", "rcode13", "rcode14", "rcode15"
+, "latency0", "latency1", "latency2", "latency3", "latency4", "latency5", "latency6", "latency7"
+, "latency8", "latency9", "latency10", "latency11", "latency12", "latency13", "latency14", "latency15"
+, "rtt0", "rtt1", "rtt2", "rtt3", "rtt4", "rtt5", "rtt6", "rtt7"
+, "rtt8", "rtt9", "rtt10", "rtt11", "rtt12", "rtt13", "rtt14", "rtt15"
+, "cacheentries"
+, "stale"
+, "ratelimited"
+, "clientlimited"
+, "ghostlookups", "ghostmisses50", "ghostmisses100", "ghostmisses200"
+, "ghostmisses400", "ghostmisses800"
+, "loopbusy0", "loopbusy1", "loopbusy2", "loopbusy3", "loopbusy4", "loopbusy5", "loopbusy6", "loopbusy7"
+, "loopbusy8", "loopbusy9", "loopbusy10", "loopbusy11", "loopbusy12", "loopbusy13", "loopbusy14", "loopbusy15"
+, "loopbusy16", "loopbusy17", "loopbusy18", "loopbusy19"
+, "loopwait0", "loopwait1", "loopwait2", "loopwait3", "loopwait4", "loopwait5", "loopwait6", "loopwait7"
+, "loopwait8", "loopwait9", "loopwait10", "loopwait11", "loopwait12", "loopwait13", "loopwait14", "loopwait15"
+, "loopwait16", "loopwait17", "loopwait18", "loopwait19"
+, "udpoccupancy0", "udpoccupancy1", "udpoccupancy2", "udpoccupancy3", "udpoccupancy4", "udpoccupancy5"
+, "udpoccupancy6", "udpoccupancy7", "udpoccupancy8", "udpoccupancy9", "udpoccupancy10"
+, "tcpoccupancy0", "tcpoccupancy1", "tcpoccupancy2", "tcpoccupancy3", "tcpoccupancy4", "tcpoccupancy5"
+, "tcpoccupancy6", "tcpoccupancy7", "tcpoccupancy8", "tcpoccupancy9", "tcpoccupancy10"
+, "cachetruncated", "cacheindexfull"
+, "rxdrops", "rxqueue", "shed"
+, "cachereclaimed", "cachecompacted"
+, "retransmits"
+, "profileother", "profilewait", "profilereceive", "profileparse", "profilecache"
+, "profilecdb", "profileresolve", "profileresponse", "profilelog", "profilesend"
+} ;
+
+static unsigned int fmt(char *s,uint64 u)
+{
+  char buf[20];
+  unsigned int len;
+  unsigned int i;
+
+  len = 0;
+  do {
+    buf[len++] = '0' + (u % 10);
+    u /= 10;
+  } while (u);
+  for (i = 0;i < len;++i) s[i] = buf[len - 1 - i];
+  return len;
+}
+
+/* 1 if q asks for the counters; then response holds the answer */
+int metrics_answer(const char *q,const char qtype[2])
+{
+  char str[64];
+  char misc[10];
+  unsigned int dpos;
+  unsigned int len;
+  unsigned int i;
+  unsigned int j;
+  unsigned int first;
+  unsigned int last;
+  uint64 u;
+
+  if (!rows) return 0;
+  first = 0;
+  last = numrows;
+  if (!dns_domain_equal(q,name)) {
+    if (!*q || !dns_domain_equal(q + 1 + (unsigned char) *q,name)) return 0;
+    if (*q > 5) return 0;
+    first = 0;
+    for (i = 1;i <= (unsigned char) *q;++i) {
+      if ((q[i] < '0') || (q[i] > '9')) return 0;
+      first = first * 10 + (q[i] - '0');
+    }
+    if (first >= numrows) return 0;
+    last = first + 1;
+  }
+  if (byte_diff(qtype,2,DNS_T_TXT) && byte_diff(qtype,2,DNS_T_ANY)) return 0;
+
+  if (!response_query(q,qtype,DNS_C_CH)) return 0;
+  response[2] |= 4;
+  if (!response_addbytes("\300\14",2)) return 0;
+  byte_copy(misc,10,DNS_T_TXT DNS_C_CH "\0\0\0\0\0\0");
+  if (!response_addbytes(misc,10)) return 0;
+  dpos = response_len;
+
+  for (i = 0;i < METRICS;++i) {
+    u = 0;
+    for (j = first;j < last;++j) u += rows[j * rowlen + i];
+    if (!u) continue;
+    len = str_len(label[i]);
+    byte_copy(str + 1,len,label[i]);
+    str[++len] = ' ';
+    len += fmt(str + len + 1,u);
+    str[0] = len;
+    if (!response_addbytes(str,len + 1)) return 0;
+  }
+  if (response_len == dpos)
+    if (!response_addbytes("\0",1)) return 0;
+
+  uint16_pack_big(response + dpos - 2,response_len - dpos);
+  response[7] = 1;
+  return 1;
+}
@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "uint64.h"
+#include "taia.h"
+
+#define METRIC_QUERIES 0
+#define METRIC_ANSWERS 1
+#define METRIC_DROPPED 2
+#define METRIC_RELOADS 3 /* data.cdb opened anew */
+#define METRIC_UDPACTIVE 4
+#define METRIC_TCPACTIVE 5
+#define METRIC_UDPEVICTED 6 /* dropped for lack of a UDP slot */
+#define METRIC_TCPEVICTED 7
+#define METRIC_CACHEHITS 8
+#define METRIC_CACHEMISSES 9
+#define METRIC_CACHEEXPIRED 10
+#define METRIC_CACHEEVICTIONS 11
+#define METRIC_UPSTREAM 12 /* queries sent to other servers */
+#define METRIC_RCODE 13 /* 16 of them, by rcode */
+#define METRIC_LATENCY 29 /* 16 buckets: under 2^i ms; last: the rest */
+#define METRIC_RTT 45 /* 16 buckets, as METRIC_LATENCY */
+#define METRIC_CACHEENTRIES 61 /* now, not a running total */
+#define METRIC_STALE 62 /* answers from expired cache entries */
+#define METRIC_RATELIMITED 63 /* over $RATELIMIT: dropped or truncated */
+#define METRIC_CLIENTLIMITED 64 /* dropped by per-client limits */
+#define METRIC_GHOSTLOOKUPS 65 /* with $CACHEGHOST; see cache_ghost() */
+#define METRIC_GHOSTMISSES 66 /* 5 estimates: at half, 1, 2, 4, 8 times the size */
+#define METRIC_LOOPBUSY 71 /* 20 buckets: each pass of the event loop, under 2^i usec */
+#define METRIC_LOOPWAIT 91 /* 20 buckets, as METRIC_LOOPBUSY, for iopause() */
+#define METRIC_UDPOCCUPANCY 111 /* 11 buckets: i tenths of the slots in use */
+#define METRIC_TCPOCCUPANCY 122 /* 11 buckets, as METRIC_UDPOCCUPANCY */
+#define METRIC_CACHETRUNCATED 133 /* cache walks cut off at MAXPROBE */
+#define METRIC_CACHEINDEXFULL 134 /* evictions for want of an index slot */
+#define METRIC_RXDROPS 135 /* datagrams the kernel dropped for want of room */
+#define METRIC_RXQUEUE 136 /* now: bytes waiting on the UDP sockets; see overload.c */
+#define METRIC_SHED 137 /* queries shed while overloaded */
+#define METRIC_CACHERECLAIMED 138 /* cache bytes freed ahead of oldest; see cache.c */
+#define METRIC_CACHECOMPACTED 139 /* cache bytes moved to make that room */
+#define METRIC_RETRANSMITS 140 /* UDP queries absorbed by one in progress */
+#define METRIC_PROFILE 141 /* with $PROFILE, samples in each phase; see profile.h */
+#define METRICS 151
+
+extern uint64 *metric;
+
+extern int metrics_init(const char *,unsigned int);
+extern void metrics_worker(unsigned int);
+extern void metrics_rcode(const char *);
+extern void metrics_since(int,const struct taia *);
+extern int metrics_answer(const char *,const char *);
+
+#endif
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "exit.h"
+#include "byte.h"
+#include "case.h"
+#include "cache.h"
+#include "cdb.h"
+#include "cdb_make.h"
+#include "dns.h"
+#include "response.h"
+#include "alloc.h"
+#include "open.h"
+#include "scan.h"
+#include "fmt.h"
+#include "ip4.h"
+#include "qlog.h"
+#include "strerr.h"
+#include "taia.h"
+#include "uint16.h"
+#include "uint32.h"
+
+#define FATAL "microbench: fatal: "
+
+/*
+Standard workloads for the hot paths: Zipfian get/set on cache.c at
+several sizes, cdb_find on synthetic files, response_addname on a
+large referral, dns_packet_getname on its result, the byte and case
+routines on names of typical lengths, dns_random, stralloc_catb
+growing a string from small pieces, ip4_fmt, ip4_scan and a qlog
+line. Each line gives
+ns/op; the cache lines also give hits and index probes per operation,
+which track memory traffic. Arguments are numbers of cdb keys; the
+default is 1000000.
+*/
+
+#define OPS 1000000
+#define UNIVERSE 1000000 /* distinct cache keys */
+#define KEYLEN 16
+#define CDBFILE "microbench.cdb"
+#define CDBTMP "microbench.tmp"
+
+char strnum[FMT_ULONG];
+uint32 seed = 1;
+uint32 *sample; /* OPS indexes under a Zipf distribution */
+struct taia start;
+
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+
+uint32 rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+void put(const char *s)
+{
+  buffer_puts(buffer_1,s);
+}
+
+void putnum(unsigned long u)
+{
+  buffer_put(buffer_1,strnum,fmt_ulong(strnum,u));
+}
+
+void begin(void)
+{
+  taia_now(&start);
+}
+
+/* prints name and ns/op for the ops since begin() */
+void end(const char *name,unsigned long ops)
+{
+  struct taia stop;
+  double ns;
+
+  taia_now(&stop);
+  taia_sub(&stop,&stop,&start);
+  ns = taia_approx(&stop) * 1000000000.0 / ops;
+  put(name);
+  put(": ns/op "); putnum((unsigned long) ns);
+  put("."); putnum((unsigned long) (ns * 10) % 10);
+}
+
+/* s = 1: key i is drawn with weight 1/(i+1) */
+void makezipf(void)
+{
+  double *cdf;
+  double sum;
+  double x;
+  unsigned long i;
+  unsigned long lo;
+  unsigned long hi;
+  unsigned long mid;
+
+  cdf = (double *) alloc(UNIVERSE * sizeof(double));
+  sample = (uint32 *) alloc(OPS * sizeof(uint32));
+  if (!cdf || !sample) nomem();
+
+  sum = 0;
+  for (i = 0;i < UNIVERSE;++i) {
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+  for (i = 0;i < OPS;++i) {
+    x = (rnd() / 4294967296.0) * sum;
+    lo = 0; hi = UNIVERSE - 1;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < x) lo = mid + 1; else hi = mid;
+    }
+    sample[i] = lo;
+  }
+  alloc_free((char *) cdf);
+}
+
+/* a cache key shaped like dnscache's: type, then a name */
+void cachekey(char key[KEYLEN],uint32 i)
+{
+  int j;
+
+  key[0] = 0; key[1] = 1; key[2] = 12;
+  for (j = 3;j < KEYLEN - 1;++j) {
+    key[j] = 'a' + (i % 26);
+    i /= 26;
+  }
+  key[KEYLEN - 1] = 0;
+}
+
+void benchcache(unsigned int size)
+{
+  char key[KEYLEN];
+  char data[40];
+  unsigned int datalen;
+  uint32 ttl;
+  uint64 hits;
+  uint64 links;
+  unsigned long i;
+
+  if (!cache_init(size)) nomem();
+  byte_zero(data,sizeof data);
+
+  /* warm up, then measure: get, and set on a miss */
+  for (i = 0;i < OPS;++i) {
+    cachekey(key,sample[i]);
+    if (!cache_get(key,KEYLEN,&datalen,&ttl))
+      cache_set(key,KEYLEN,data,sizeof data,86400);
+  }
+
+  hits = cache_hits;
+  links = cache_links;
+  begin();
+  for (i = 0;i < OPS;++i) {
+    cachekey(key,sample[OPS - 1 - i]);
+    if (!cache_get(key,KEYLEN,&datalen,&ttl))
+      cache_set(key,KEYLEN,data,sizeof data,86400);
+  }
+  end("cache",OPS);
+  hits = cache_hits - hits;
+  links = cache_links - links;
+  put(" size "); putnum(size);
+  put(" hits% "); putnum((unsigned long) (hits * 100 / OPS));
+  put(" probes/op "); putnum((unsigned long) (links / OPS));
+  put("."); putnum((unsigned long) ((links * 10 / OPS) % 10));
+  put("\n");
+  buffer_flush(buffer_1);
+}
+
+unsigned int cdbkey(char *key,unsigned long i)
+{
+  byte_copy(key,4,"key.");
+  return 4 + fmt_ulong(key + 4,i);
+}
+
+void benchcdb(unsigned long numkeys)
+{
+  struct cdb_make cm;
+  struct cdb c;
+  char key[4 + FMT_ULONG];
+  unsigned long found;
+  unsigned long i;
+  int fd;
+
+  fd = open_trunc(CDBTMP);
+  if (fd == -1) strerr_die4sys(111,FATAL,"unable to create ",CDBTMP,": ");
+  if (cdb_make_start(&cm,fd) == -1) nomem();
+  for (i = 0;i < numkeys;++i)
+    if (cdb_make_add(&cm,key,cdbkey(key,i),"\1\2\3\4",4) == -1)
+      strerr_die4sys(111,FATAL,"unable to write ",CDBTMP,": ");
+  if (cdb_make_finish(&cm) == -1)
+    strerr_die4sys(111,FATAL,"unable to write ",CDBTMP,": ");
+  if (close(fd) == -1)
+    strerr_die4sys(111,FATAL,"unable to write ",CDBTMP,": ");
+  if (rename(CDBTMP,CDBFILE) == -1)
+    strerr_die6sys(111,FATAL,"unable to move ",CDBTMP," to ",CDBFILE,": ");
+
+  fd = open_read(CDBFILE);
+  if (fd == -1) strerr_die4sys(111,FATAL,"unable to open ",CDBFILE,": ");
+  cdb_init(&c,fd);
+
+  /* half present, half absent */
+  found = 0;
+  begin();
+  for (i = 0;i < OPS;++i)
+    if (cdb_find(&c,key,cdbkey(key,rnd() % (numkeys * 2))) > 0) ++found;
+  end("cdb_find",OPS);
+  put(" keys "); putnum(numkeys);
+  put(" found "); putnum(found);
+  put("\n");
+  buffer_flush(buffer_1);
+
+  cdb_free(&c);
+  close(fd);
+  unlink(CDBFILE);
+}
+
+#define NS 13
+#define ROUNDS 100000
+
+char *zone;
+char *nsname[NS];
+
+void benchresponse(void)
+{
+  char *q = 0;
+  char *d = 0;
+  unsigned long i;
+  unsigned long names;
+  unsigned int pos;
+  int j;
+
+  if (!dns_domain_fromdot(&q,"www.example.co.uk",17)) nomem();
+  if (!dns_domain_fromdot(&zone,"example.co.uk",13)) nomem();
+  for (j = 0;j < NS;++j) {
+    char buf[64];
+    unsigned int len;
+    len = 0;
+    buf[len++] = 'a' + j;
+    byte_copy(buf + len,34,".ns.provider-network.example.co.uk");
+    len += 34;
+    if (!dns_domain_fromdot(&nsname[j],buf,len)) nomem();
+  }
+
+  names = 0;
+  begin();
+  for (i = 0;i < ROUNDS;++i) {
+    response_query(q,DNS_T_A,DNS_C_IN);
+    for (j = 0;j < NS;++j) {
+      response_rstart(zone,DNS_T_NS,86400);
+      response_addname(nsname[j]);
+      response_rfinish(RESPONSE_AUTHORITY);
+    }
+    for (j = 0;j < NS;++j) {
+      response_rstart(nsname[j],DNS_T_A,86400);
+      response_addbytes("\300\0\2\1",4);
+      response_rfinish(RESPONSE_ADDITIONAL);
+    }
+    names += 3 * NS;
+  }
+  end("response_addname",names);
+  put(" names/referral "); putnum(3 * NS);
+  put(" bytes "); putnum(response_len);
+  put("\n");
+
+  /* walk the referral: every owner and NS target */
+  names = 0;
+  begin();
+  for (i = 0;i < ROUNDS;++i) {
+    pos = dns_packet_skipname(response,response_len,12) + 4;
+    for (j = 0;j < 2 * NS;++j) {
+      pos = dns_packet_getname(response,response_len,pos,&d);
+      if (!pos) strerr_die2x(111,FATAL,"bad referral");
+      pos += 10;
+      if (j < NS) {
+        if (!dns_packet_getname(response,response_len,pos,&d))
+          strerr_die2x(111,FATAL,"bad referral");
+        ++names;
+        pos = dns_packet_skipname(response,response_len,pos);
+      }
+      else
+        pos += 4;
+      ++names;
+    }
+  }
+  end("dns_packet_getname",names);
+  put("\n");
+  buffer_flush(buffer_1);
+}
+
+/* a name of len bytes in mixed case; t gets it in lower case */
+void bytename(char *s,char *t,unsigned int len)
+{
+  unsigned int i;
+
+  for (i = 0;i < len;++i) {
+    t[i] = (i % 7) ? 'a' + i % 26 : 3;
+    s[i] = ((i % 3) || (t[i] == 3)) ? t[i] : t[i] - 32;
+  }
+}
+
+#define BYTEOPS 10000000
+
+void benchbytes(unsigned int len)
+{
+  char s[64];
+  char t[64];
+  char u[64];
+  unsigned long i;
+  int sum;
+
+  bytename(s,t,len);
+  sum = 0;
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) byte_copy(u,len,s);
+  end("byte_copy",BYTEOPS);
+  put(" len "); putnum(len); put("\n");
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) sum += byte_diff(u,len,s);
+  end("byte_diff",BYTEOPS);
+  put(" len "); putnum(len); put("\n");
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) sum += case_diffb(s,len,t);
+  end("case_diffb",BYTEOPS);
+  put(" len "); putnum(len); put("\n");
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) { byte_copy(u,len,s); case_lowerb(u,len); }
+  end("byte_copy+case_lowerb",BYTEOPS);
+  put(" len "); putnum(len); put("\n");
+
+  if (sum || byte_diff(u,len,t)) strerr_die2x(111,FATAL,"byte routines disagree");
+  buffer_flush(buffer_1);
+}
+
+void benchrandom(void)
+{
+  char key[128];
+  unsigned long i;
+  unsigned int sum;
+
+  byte_zero(key,sizeof key);
+  dns_random_init(key);
+  sum = 0;
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) sum += dns_random(65536);
+  end("dns_random",BYTEOPS);
+  put(" sum "); putnum(sum);
+  put("\n");
+  buffer_flush(buffer_1);
+}
+
+#define PIECES 4000000
+
+void benchstralloc(void)
+{
+  stralloc sa = {0};
+  unsigned long i;
+
+  begin();
+  for (i = 0;i < PIECES;++i)
+    if (!stralloc_catb(&sa,"12345678",8)) nomem();
+  end("stralloc_catb",PIECES);
+  put(" bytes "); putnum(sa.len);
+  put("\n");
+  buffer_flush(buffer_1);
+  alloc_free(sa.s);
+}
+
+#define FMTIPS 256
+
+int nowrite(int fd,const char *buf,unsigned int len)
+{
+  return len;
+}
+
+void benchfmt(void)
+{
+  char ip[FMTIPS][4];
+  char text[FMTIPS][IP4_FMT];
+  char out[BUFFER_OUTSIZE];
+  buffer b;
+  unsigned long i;
+  unsigned long sum;
+
+  for (i = 0;i < FMTIPS;++i) uint32_pack(ip[i],rnd());
+  sum = 0;
+
+  begin();
+  for (i = 0;i < BYTEOPS;++i) sum += ip4_fmt(text[i % FMTIPS],ip[i % FMTIPS]);
+  end("ip4_fmt",BYTEOPS);
+  put(" chars "); putnum(sum); put("\n");
+
+  for (i = 0;i < FMTIPS;++i) text[i][ip4_fmt(text[i],ip[i])] = 0;
+  sum = 0;
+  begin();
+  for (i = 0;i < BYTEOPS;++i) sum += ip4_scan(text[i % FMTIPS],ip[i % FMTIPS]);
+  end("ip4_scan",BYTEOPS);
+  put(" chars "); putnum(sum); put("\n");
+
+  buffer_init(&b,nowrite,-1,out,sizeof out);
+  begin();
+  for (i = 0;i < BYTEOPS;++i)
+    qlog_text(&b,ip[i % FMTIPS],i,"\1\2","\3www\7example\3com\0",DNS_T_A,"+");
+  end("qlog_text",BYTEOPS);
+  put("\n");
+  buffer_flush(buffer_1);
+}
+
+int main(int argc,char **argv)
+{
+  unsigned long numkeys;
+
+  makezipf();
+  benchcache(1000000);
+  benchcache(10000000);
+  benchcache(100000000);
+
+  if (!argv[1])
+    benchcdb(1000000);
+  else
+    while (*++argv) {
+      scan_ulong(*argv,&numkeys);
+      if (numkeys < 1) numkeys = 1;
+      benchcdb(numkeys);
+    }
+
+  benchresponse();
+  benchbytes(10);
+  benchbytes(30);
+  benchbytes(60);
+  benchrandom();
+  benchstralloc();
+  benchfmt();
+  _exit(0);
+}
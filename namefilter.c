@@ -0,0 +1,54 @@
+#include "dns.h"
+#include "namefilter.h"
+
+/*
+A Bloom filter of owner names, which tinydns-data leaves under "\0b"
+with $NAMEFILTER: one byte giving k, then the bits. A name is in the
+filter if bits h0 + i h1, for i below k, modulo the number of bits,
+are all set. Names are hashed without regard to case.
+*/
+
+void namefilter_hash(const char *d,uint32 *h)
+{
+  unsigned int len;
+  unsigned char c;
+  uint32 h0 = 5381;
+  uint32 h1 = 0x811c9dc5;
+
+  len = dns_domain_length(d);
+  while (len--) {
+    c = *d++;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    h0 = ((h0 << 5) + h0) ^ c;
+    h1 = (h1 ^ c) * 16777619;
+  }
+  h[0] = h0;
+  h[1] = h1 | 1;
+}
+
+void namefilter_set(char *bits,uint32 numbits,unsigned int k,const uint32 *h)
+{
+  uint32 u;
+  uint32 i;
+
+  u = h[0];
+  while (k--) {
+    i = u % numbits;
+    bits[i >> 3] |= 1 << (i & 7);
+    u += h[1];
+  }
+}
+
+int namefilter_test(const char *bits,uint32 numbits,unsigned int k,const uint32 *h)
+{
+  uint32 u;
+  uint32 i;
+
+  u = h[0];
+  while (k--) {
+    i = u % numbits;
+    if (!(bits[i >> 3] & (1 << (i & 7)))) return 0;
+    u += h[1];
+  }
+  return 1;
+}
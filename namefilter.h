@@ -0,0 +1,13 @@
+#ifndef NAMEFILTER_H
+#define NAMEFILTER_H
+
+#include "uint32.h"
+
+#define NAMEFILTER_BITS 10 /* per name: about 1% false positives */
+#define NAMEFILTER_K 7
+
+extern void namefilter_hash(const char *,uint32 *);
+extern void namefilter_set(char *,uint32,unsigned int,const uint32 *);
+extern int namefilter_test(const char *,uint32,unsigned int,const uint32 *);
+
+#endif
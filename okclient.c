@@ -1,16 +1,80 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "str.h"
+#include "byte.h"
 #include "ip4.h"
+#include "error.h"
+#include "alloc.h"
+#include "uint32.h"
+#include "direntry.h"
 #include "okclient.h"
 
+/*
+okclient_init() reads the names in ip/ into a prefix table, and
+okclient() then checks the client's address against it with a few
+memory accesses, instead of up to four stat() calls. Until
+okclient_init() first succeeds, okclient() uses stat() as before. A
+failed okclient_init() leaves the previous table in use.
+
+Only names that ip4_fmt() could produce for a prefix of 1 to 4 octets
+are kept; no other name ever matched. One-octet and two-octet
+prefixes are bits in oct1 and oct2; longer ones are in an
+open-addressing table of (address, octets), where octets 0 marks an
+empty slot.
+*/
+
 static char fn[3 + IP4_FMT];
 
+struct entry {
+  uint32 ip; /* the prefix, in the high octets */
+  unsigned int octets;
+} ;
+
+struct acl {
+  char oct1[256 / 8];
+  char oct2[65536 / 8];
+  struct entry *table;
+  unsigned int size; /* power of 2 */
+} ;
+
+static struct acl *acl = 0;
+
+static unsigned int hash(uint32 ip,unsigned int octets)
+{
+  return ((ip * 0x9e3779b1) >> 8) ^ octets;
+}
+
+static int find(struct acl *a,uint32 ip,unsigned int octets)
+{
+  unsigned int i;
+
+  i = hash(ip,octets) & (a->size - 1);
+  while (a->table[i].octets) {
+    if ((a->table[i].ip == ip) && (a->table[i].octets == octets)) return 1;
+    i = (i + 1) & (a->size - 1);
+  }
+  return 0;
+}
+
+static int bit(const char *map,unsigned int i)
+{
+  return (map[i >> 3] >> (i & 7)) & 1;
+}
+
 int okclient(char ip[4])
 {
   struct stat st;
+  uint32 u;
   int i;
 
+  if (acl) {
+    uint32_unpack_big(ip,&u);
+    if (find(acl,u,4)) return 1;
+    if (find(acl,u & 0xffffff00,3)) return 1;
+    if (bit(acl->oct2,u >> 16)) return 1;
+    return bit(acl->oct1,u >> 24);
+  }
+
   fn[0] = 'i';
   fn[1] = 'p';
   fn[2] = '/';
@@ -24,3 +88,97 @@ int okclient(char ip[4])
     fn[i] = 0;
   }
 }
+
+/* number of octets in s as ip4_fmt() writes them, or 0 */
+static unsigned int prefix(const char *s,uint32 *ip)
+{
+  unsigned int octets;
+  unsigned int digits;
+  unsigned int u;
+
+  *ip = 0;
+  for (octets = 0;octets < 4;) {
+    u = 0;
+    for (digits = 0;(s[digits] >= '0') && (s[digits] <= '9');++digits)
+      u = u * 10 + (s[digits] - '0');
+    if (!digits || (digits > 3) || (u > 255)) return 0;
+    if ((digits > 1) && (s[0] == '0')) return 0;
+    *ip += u << (24 - 8 * octets);
+    ++octets;
+    s += digits;
+    if (!*s) return octets;
+    if (*s != '.') return 0;
+    ++s;
+  }
+  return 0;
+}
+
+/* the table has room: a->size is at least twice the number of names */
+static void add(struct acl *a,const char *name)
+{
+  uint32 ip;
+  unsigned int octets;
+  unsigned int i;
+
+  octets = prefix(name,&ip);
+  if (!octets) return;
+  if (octets == 1) { a->oct1[ip >> 27] |= 1 << ((ip >> 24) & 7); return; }
+  if (octets == 2) { a->oct2[ip >> 19] |= 1 << ((ip >> 16) & 7); return; }
+  if (find(a,ip,octets)) return;
+
+  i = hash(ip,octets) & (a->size - 1);
+  while (a->table[i].octets) i = (i + 1) & (a->size - 1);
+  a->table[i].ip = ip;
+  a->table[i].octets = octets;
+}
+
+static void aclfree(struct acl *a)
+{
+  if (!a) return;
+  if (a->table) alloc_free((char *) a->table);
+  alloc_free((char *) a);
+}
+
+int okclient_init(void)
+{
+  DIR *dir;
+  direntry *d;
+  struct acl *a;
+  unsigned int n;
+
+  /* first pass: count names, for the size of the table */
+  dir = opendir("ip");
+  if (!dir) return 0;
+  n = 0;
+  for (;;) {
+    errno = 0;
+    d = readdir(dir);
+    if (!d) break;
+    ++n;
+  }
+  if (errno) { closedir(dir); return 0; }
+
+  a = (struct acl *) alloc(sizeof(struct acl));
+  if (!a) { closedir(dir); return 0; }
+  byte_zero((char *) a,sizeof(struct acl));
+  a->size = 16;
+  while (a->size < 2 * n) a->size <<= 1;
+  a->table = (struct entry *) alloc(a->size * sizeof(struct entry));
+  if (!a->table) { aclfree(a); closedir(dir); return 0; }
+  byte_zero((char *) a->table,a->size * sizeof(struct entry));
+
+  rewinddir(dir);
+  for (;;) {
+    errno = 0;
+    d = readdir(dir);
+    if (!d) break;
+    if (n-- == 0) break; /* directory grew; the rest waits for a reload */
+    add(a,d->d_name);
+  }
+  if (errno) { aclfree(a); closedir(dir); return 0; }
+  closedir(dir);
+
+  aclfree(acl);
+  acl = a;
+  return 1;
+}
@@ -2,5 +2,6 @@
 #define OKCLIENT_H
 
 extern int okclient(char *);
+extern int okclient_init(void);
 
 #endif
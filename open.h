@@ -6,5 +6,6 @@ extern int open_excl(const char *);
 extern int open_append(const char *);
 extern int open_trunc(const char *);
 extern int open_write(const char *);
+extern int open_rwtrunc(const char *);
 
 #endif
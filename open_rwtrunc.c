@@ -0,0 +1,6 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include "open.h"
+
+int open_rwtrunc(const char *fn)
+{ return open(fn,O_RDWR | O_NDELAY | O_TRUNC | O_CREAT,0600); }
@@ -0,0 +1,62 @@
+#include "socket.h"
+#include "metrics.h"
+#include "overload.h"
+
+/*
+A server reading UDP queries calls overload_read() after each read
+from a socket, with what the read returned and the most it asked for.
+After a full batch, which suggests more is waiting, and otherwise
+every OVERLOADLOOK reads, overload_read() asks the kernel how much is
+queued on the socket and how many datagrams it has dropped, and keeps
+METRIC_RXQUEUE and METRIC_RXDROPS.
+
+With overload_init(p) for p from 1 to 100, overload is set by a look
+finding new drops, or the queue at p percent of the socket's receive
+buffer, and cleared by OVERLOADCALM looks in a row finding no new
+drops and the queue under half that. While it is set, the server
+sheds what it can best do without; with p 0, it never is.
+*/
+
+#define OVERLOADLOOK 64
+#define OVERLOADCALM 4
+
+int overload = 0;
+static unsigned long percent = 0;
+static unsigned int calm = 0;
+
+void overload_init(unsigned long p)
+{
+  if (p > 100) p = 100;
+  percent = p;
+}
+
+void overload_read(struct overload *o,int s,int n,int max)
+{
+  uint32 queued;
+  uint32 size;
+  uint32 drops;
+  int flagnew;
+
+  if (n <= 0) return;
+  if ((n < max) && (++o->reads < OVERLOADLOOK)) return;
+  o->reads = 0;
+
+  if (socket_backlog(s,&queued,&size,&drops) == -1) return;
+  metric[METRIC_RXQUEUE] -= o->queued;
+  metric[METRIC_RXQUEUE] += queued;
+  o->queued = queued;
+  flagnew = (drops != o->drops);
+  metric[METRIC_RXDROPS] += (uint32) (drops - o->drops);
+  o->drops = drops;
+
+  if (!percent) return;
+  size = size / 100 * percent;
+  if (flagnew || (queued >= size)) {
+    overload = 1;
+    calm = 0;
+  }
+  else if (queued < size / 2) {
+    if (calm < OVERLOADCALM) ++calm;
+    if (calm == OVERLOADCALM) overload = 0;
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include "uint32.h"
+
+struct overload {
+  uint32 queued; /* bytes waiting at the last look */
+  uint32 drops; /* kernel's count of drops at the last look */
+  unsigned int reads; /* since the last look */
+} ;
+
+extern int overload;
+
+extern void overload_init(unsigned long);
+extern void overload_read(struct overload *,int,int,int);
+
+#endif
@@ -0,0 +1 @@
+env - PATH="`pwd`:$PATH" TOLERANCE="${TOLERANCE-10}" sh perf.tests
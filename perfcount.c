@@ -0,0 +1,92 @@
+#include "hasperf.h"
+#ifdef HASPERF
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#endif
+#include "byte.h"
+#include "perfcount.h"
+
+/*
+Cycles, last-level cache misses and branch misses in user mode, read
+as one group around one call in PERF_SAMPLE at each site. The counters
+are opened at the first sampled call, so each worker opens its own.
+Where they are not available, only the calls are counted.
+*/
+
+struct perfcount perfcount[PERF_SITES];
+
+const char *perfcount_name[PERF_SITES] = {
+  "cache_get", "cache_set", "cdb_findnext", "response_addname",
+  "dns_packet_getname", "tdlookup", "query"
+} ;
+
+static int fd = -2; /* -2: not opened yet; -1: not available */
+
+#ifdef HASPERF
+static int event(unsigned long config,int group)
+{
+  struct perf_event_attr attr;
+
+  byte_zero((char *) &attr,sizeof attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof attr;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open,&attr,0,-1,group,0);
+}
+#endif
+
+static void start(void)
+{
+  fd = -1;
+#ifdef HASPERF
+  fd = event(PERF_COUNT_HW_CPU_CYCLES,-1);
+  if (fd == -1) return;
+  event(PERF_COUNT_HW_CACHE_MISSES,fd);
+  event(PERF_COUNT_HW_BRANCH_MISSES,fd);
+#endif
+}
+
+static int readcounts(uint64 *x)
+{
+#ifdef HASPERF
+  uint64 buf[1 + PERF_EVENTS];
+  int r;
+  int i;
+
+  r = read(fd,(char *) buf,sizeof buf);
+  if (r < (int) (2 * sizeof(uint64))) return 0;
+  for (i = 0;i < PERF_EVENTS;++i)
+    x[i] = (i < buf[0]) ? buf[1 + i] : 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+int perfcount_begin(unsigned int site)
+{
+  struct perfcount *p = perfcount + site;
+
+  if (++p->calls % PERF_SAMPLE) return 0;
+  if (fd == -2) start();
+  if (fd == -1) return 0;
+  return readcounts(p->start);
+}
+
+void perfcount_end(unsigned int site,int flag)
+{
+  struct perfcount *p = perfcount + site;
+  uint64 x[PERF_EVENTS];
+  int i;
+
+  if (!flag) return;
+  if (!readcounts(x)) return;
+  for (i = 0;i < PERF_EVENTS;++i)
+    p->count[i] += x[i] - p->start[i];
+  ++p->sampled;
+}
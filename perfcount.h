@@ -0,0 +1,48 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include "uint64.h"
+
+#define PERF_CACHE_GET 0
+#define PERF_CACHE_SET 1
+#define PERF_CDB_FINDNEXT 2
+#define PERF_RESPONSE_ADDNAME 3
+#define PERF_PACKET_GETNAME 4
+#define PERF_TDLOOKUP 5
+#define PERF_QUERY 6
+#define PERF_SITES 7
+
+#define PERF_CYCLES 0
+#define PERF_LLCMISSES 1
+#define PERF_BRANCHMISSES 2
+#define PERF_EVENTS 3
+
+#define PERF_SAMPLE 64 /* one call in this many is measured */
+
+struct perfcount {
+  uint64 calls;
+  uint64 sampled;
+  uint64 count[PERF_EVENTS]; /* summed over the sampled calls */
+  uint64 start[PERF_EVENTS];
+} ;
+
+extern struct perfcount perfcount[PERF_SITES];
+extern const char *perfcount_name[PERF_SITES];
+
+extern int perfcount_begin(unsigned int);
+extern void perfcount_end(unsigned int,int);
+
+/*
+The hooks are compiled in only with -DPERFCOUNT in conf-cc.
+PERFCOUNT_BEGIN goes last among the declarations of the function.
+*/
+
+#ifdef PERFCOUNT
+#define PERFCOUNT_BEGIN(site) int perfflag = perfcount_begin(site);
+#define PERFCOUNT_END(site) perfcount_end(site,perfflag);
+#else
+#define PERFCOUNT_BEGIN(site)
+#define PERFCOUNT_END(site)
+#endif
+
+#endif
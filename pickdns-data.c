@@ -18,6 +18,9 @@
 #include "fmt.h"
 #include "ip4.h"
 #include "dns.h"
+#include "uint16.h"
+#include "uint32.h"
+#include "uint64.h"
 
 #define FATAL "pickdns-data: fatal: "
 
@@ -49,6 +52,7 @@ struct address {
   unsigned int namelen;
   char ip[4];
   char location[2];
+  uint32 weight;
 } ;
 
 int address_diff(struct address *p,struct address *q)
@@ -106,12 +110,13 @@ int fdcdb;
 struct cdb_make cdb;
 static stralloc key;
 static stralloc result;
+static stralloc locs; /* the % lines pickdns matches, for "\0l"; see clientloc.c */
 
 static stralloc line;
 int match = 1;
 unsigned long linenum = 0;
 
-#define NUMFIELDS 3
+#define NUMFIELDS 4
 static stralloc f[NUMFIELDS];
 
 char strnum[FMT_ULONG];
@@ -126,6 +131,82 @@ void die_datatmp(void)
   strerr_die2sys(111,FATAL,"unable to create data.tmp: ");
 }
 
+/*
+A name whose addresses all have weight 1 gets a plain list of them,
+as always. Any other weights make a pool: a tag byte, 1, then for each
+address the IP address, a 16-bit alias and a 16-bit threshold, big-
+endian. pickdns picks entry i at random and keeps it if a random
+number below 65536 is below the threshold, else takes its alias
+(Vose's alias method); an entry that is its own alias is always kept.
+The tag makes the length 1 more than a multiple of 4, which no plain
+list has.
+*/
+
+#define POOLMAX 65536
+
+static uint64 *scaled;
+static unsigned int *small;
+static unsigned int *large;
+static unsigned int poolalloc = 0;
+
+void pool(struct address *a,unsigned int n)
+{
+  unsigned int numsmall = 0;
+  unsigned int numlarge = 0;
+  unsigned int i;
+  unsigned int l;
+  unsigned int g;
+  uint64 total = 0;
+  uint64 u;
+  char buf[8];
+
+  if (n > POOLMAX)
+    strerr_die2x(111,FATAL,"too many weighted addresses for one name");
+  if (n > poolalloc) {
+    if (poolalloc) {
+      alloc_free((char *) scaled);
+      alloc_free((char *) small);
+      alloc_free((char *) large);
+    }
+    scaled = (uint64 *) alloc(n * sizeof(uint64));
+    small = (unsigned int *) alloc(n * sizeof(unsigned int));
+    large = (unsigned int *) alloc(n * sizeof(unsigned int));
+    if (!scaled || !small || !large) nomem();
+    poolalloc = n;
+  }
+
+  for (i = 0;i < n;++i) total += a[i].weight;
+  for (i = 0;i < n;++i) {
+    scaled[i] = (uint64) a[i].weight * n; /* total is the average */
+    if (scaled[i] < total) small[numsmall++] = i;
+    else large[numlarge++] = i;
+  }
+
+  if (!stralloc_copyb(&result,"\1",1)) nomem();
+  if (!stralloc_readyplus(&result,8 * n)) nomem();
+  for (i = 0;i < n;++i) { /* the leftovers keep themselves */
+    byte_copy(result.s + 1 + 8 * i,4,a[i].ip);
+    uint16_pack_big(result.s + 1 + 8 * i + 4,i);
+    uint16_pack_big(result.s + 1 + 8 * i + 6,65535);
+  }
+  result.len = 1 + 8 * n;
+
+  while (numsmall && numlarge) {
+    l = small[--numsmall];
+    g = large[numlarge - 1];
+    u = (scaled[l] << 16) / total;
+    if (u > 65535) u = 65535;
+    uint16_pack_big(buf,g);
+    uint16_pack_big(buf + 2,u);
+    byte_copy(result.s + 1 + 8 * l + 4,4,buf);
+    scaled[g] -= total - scaled[l];
+    if (scaled[g] < total) {
+      --numlarge;
+      small[numsmall++] = g;
+    }
+  }
+}
+
 int main()
 {
   struct address t;
@@ -133,6 +214,7 @@ int main()
   int j;
   int k;
   char ch;
+  unsigned long u;
 
   umask(022);
 
@@ -187,7 +269,15 @@ int main()
 	if (!stralloc_0(&f[2])) nomem();
 	if (!stralloc_0(&f[2])) nomem();
 	byte_copy(t.location,2,f[2].s);
-	if (!address_alloc_append(&x,&t)) nomem();
+	t.weight = 1;
+	if (f[3].len) {
+	  if (!stralloc_0(&f[3])) nomem();
+	  if (!scan_ulong(f[3].s,&u)) syntaxerror(": malformed weight");
+	  t.weight = u;
+	  if (t.weight != u) syntaxerror(": malformed weight");
+	}
+	if (t.weight)
+	  if (!address_alloc_append(&x,&t)) nomem();
 	break;
       case '%':
 	if (!stralloc_0(&f[0])) nomem();
@@ -198,6 +288,12 @@ int main()
 	ipprefix_cat(&key,f[1].s);
         if (cdb_make_add(&cdb,key.s,key.len,result.s,result.len) == -1)
           die_datatmp();
+	if ((key.len >= 2) && (key.len <= 5)) {
+	  ch = key.len - 1;
+	  if (!stralloc_catb(&locs,&ch,1)) nomem();
+	  if (!stralloc_catb(&locs,key.s + 1,key.len - 1)) nomem();
+	  if (!stralloc_catb(&locs,result.s,2)) nomem();
+	}
 	break;
     }
   }
@@ -213,13 +309,22 @@ int main()
     if (!stralloc_copys(&key,"+")) nomem();
     if (!stralloc_catb(&key,x.s[i].location,2)) nomem();
     if (!stralloc_catb(&key,x.s[i].name,x.s[i].namelen)) nomem();
-    if (!stralloc_copys(&result,"")) nomem();
-    while (i < j)
-      if (!stralloc_catb(&result,x.s[i++].ip,4)) nomem();
+    for (k = i;k < j;++k)
+      if (x.s[k].weight != 1) break;
+    if (k < j) {
+      pool(x.s + i,j - i);
+      i = j;
+    }
+    else {
+      if (!stralloc_copys(&result,"")) nomem();
+      while (i < j)
+        if (!stralloc_catb(&result,x.s[i++].ip,4)) nomem();
+    }
     if (cdb_make_add(&cdb,key.s,key.len,result.s,result.len) == -1)
       die_datatmp();
   }
 
+  if (cdb_make_add(&cdb,"\0l",2,locs.s,locs.len) == -1) die_datatmp();
   if (cdb_make_finish(&cdb) == -1) die_datatmp();
   if (fsync(fdcdb) == -1) die_datatmp();
   if (close(fdcdb) == -1) die_datatmp(); /* NFS stupidity */
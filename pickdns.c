@@ -1,24 +1,186 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include "byte.h"
 #include "case.h"
-#include "dns.h"
+#include "env.h"
 #include "open.h"
+#include "tai.h"
+#include "dns.h"
 #include "cdb.h"
+#include "cdbmap.h"
+#include "clientloc.h"
+#include "uint16.h"
 #include "response.h"
+#include "metrics.h"
 
 const char *fatal = "pickdns: fatal: ";
 const char *starting = "starting pickdns\n";
 
 static char seed[128];
 
+/*
+With $HEALTH set to a file name, under the root like data.cdb, pickdns
+passes over addresses marked down there. The file holds a 4-byte
+big-endian count n, then n addresses in ascending order, then n bits,
+the first address's in the high bit of the first byte; a bit is 1
+while its address is down. A checker marks addresses up and down by
+changing bits in place: the file is mapped shared, so the next query
+sees the change. It changes the list of addresses by writing a new
+file and renaming it into place; pickdns looks for one once a second.
+An address not in the file counts as up, as does every address if
+there is no file or it is short. A name whose addresses are all down
+is answered as if none were.
+*/
+
+static char *health = 0;
+static char *hmap = 0; /* 0 if there is no usable file */
+static unsigned long hsize;
+static uint32 hnum;
+static struct stat hst;
+static struct tai hchecked;
+
 void initialize(void)
 {
   dns_random_init(seed);
+  health = env_get("HEALTH");
+}
+
+static void health_refresh(void)
+{
+  struct tai now;
+  struct stat st;
+  char *x;
+  uint32 n;
+  int fd;
+
+  tai_now(&now);
+  if (!tai_less(&hchecked,&now)) return;
+  hchecked = now;
+
+  if (stat(health,&st) == 0)
+    if (hmap && (st.st_ino == hst.st_ino) && (st.st_dev == hst.st_dev) && (st.st_size == hst.st_size))
+      return;
+  if (hmap) { munmap(hmap,hsize); hmap = 0; }
+
+  fd = open_read(health);
+  if (fd == -1) return;
+  if ((fstat(fd,&st) == -1) || (st.st_size < 4)) { close(fd); return; }
+  x = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (x == (char *) MAP_FAILED) return;
+  uint32_unpack_big(x,&n);
+  if (4 + 4 * (uint64) n + (n + 7) / 8 > (uint64) st.st_size) {
+    munmap(x,st.st_size);
+    return;
+  }
+  hmap = x;
+  hsize = st.st_size;
+  hnum = n;
+  hst = st;
+}
+
+static int down(const char ip[4])
+{
+  uint32 lo = 0;
+  uint32 hi = hnum;
+  uint32 mid;
+  int r;
+
+  if (!hmap) return 0;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    r = byte_diff(hmap + 4 + 4 * mid,4,ip);
+    if (!r) return (hmap[4 + 4 * hnum + mid / 8] >> (7 - (mid & 7))) & 1;
+    if (r < 0) lo = mid + 1; else hi = mid;
+  }
+  return 0;
+}
+
+/* drops the addresses that are down from the list, unless all are */
+static unsigned int up(char *ips,unsigned int len)
+{
+  unsigned int i;
+  unsigned int j;
+
+  if (!hmap) return len;
+  for (i = 0;i + 4 <= len;i += 4)
+    if (!down(ips + i)) break;
+  if (i + 4 > len) return len;
+  for (j = 0;i + 4 <= len;i += 4)
+    if (!down(ips + i)) {
+      byte_copy(ips + j,4,ips + i);
+      j += 4;
+    }
+  return j;
 }
 
 static struct cdb c;
 static char key[258];
 static char data[512];
+static int flagloctable; /* "\0l" from pickdns-data; see clientloc.c */
+
+/* one draw from a pool built by pickdns-data; see there */
+
+static int pick(uint32 dpos,unsigned int n,char ip[4])
+{
+  char entry[8];
+  uint16 u;
+  unsigned int i;
+
+  i = dns_random(n);
+  if (cdb_read(&c,entry,8,dpos + 1 + 8 * i) == -1) return -1;
+  uint16_unpack_big(entry + 4,&u);
+  if (u != i) {
+    uint16_unpack_big(entry + 6,&u);
+    if (dns_random(65536) >= u) {
+      uint16_unpack_big(entry + 4,&u);
+      if (u >= n) return -1;
+      if (cdb_read(&c,entry,4,dpos + 1 + 8 * u) == -1) return -1;
+    }
+  }
+  byte_copy(ip,4,entry);
+  return 0;
+}
+
+/* up to 3 different addresses from the pool, by weight; with flaghealth, up */
+
+static int pool(uint32 dpos,uint32 dlen,int flaghealth)
+{
+  unsigned int n = dlen >> 3;
+  unsigned int num = 0;
+  unsigned int tries;
+  unsigned int start;
+  unsigned int i;
+  char entry[4];
+
+  if (!n) return 0;
+  for (tries = 0;(num < 3) && (num < n) && (tries < 24);++tries) {
+    if (pick(dpos,n,data + 4 * num) == -1) return -1;
+    if (flaghealth && down(data + 4 * num)) continue;
+    for (i = 0;i < num;++i)
+      if (byte_equal(data + 4 * i,4,data + 4 * num)) break;
+    if (i == num) ++num;
+  }
+  if (num < 3) { /* light entries: take the next ones in turn */
+    start = dns_random(n);
+    for (tries = 0;(num < 3) && (tries < n);++tries) {
+      if (cdb_read(&c,data + 4 * num,4,dpos + 1 + 8 * ((start + tries) % n)) == -1) return -1;
+      if (flaghealth && down(data + 4 * num)) continue;
+      for (i = 0;i < num;++i)
+        if (byte_equal(data + 4 * i,4,data + 4 * num)) break;
+      if (i == num) ++num;
+    }
+  }
+  if (!num && flaghealth) return pool(dpos,dlen,0);
+  for (i = 0;i < num / 2;++i) { /* answered last to first */
+    byte_copy(entry,4,data + 4 * i);
+    byte_copy(data + 4 * i,4,data + 4 * (num - 1 - i));
+    byte_copy(data + 4 * (num - 1 - i),4,entry);
+  }
+  return 4 * num;
+}
 
 static int doit(char *q,char qtype[2],char ip[4])
 {
@@ -36,19 +198,24 @@ static int doit(char *q,char qtype[2],char ip[4])
   if (byte_equal(qtype,2,DNS_T_ANY)) flaga = flagmx = 1;
   if (!flaga && !flagmx) goto REFUSE;
 
-  key[0] = '%';
-  byte_copy(key + 1,4,ip);
+  if (flagloctable) {
+    if (clientloc_find(&c,ip,key + 1) == -1) return 0;
+  }
+  else {
+    key[0] = '%';
+    byte_copy(key + 1,4,ip);
 
-  r = cdb_find(&c,key,5);
-  if (!r) r = cdb_find(&c,key,4);
-  if (!r) r = cdb_find(&c,key,3);
-  if (!r) r = cdb_find(&c,key,2);
-  if (r == -1) return 0;
+    r = cdb_find(&c,key,5);
+    if (!r) r = cdb_find(&c,key,4);
+    if (!r) r = cdb_find(&c,key,3);
+    if (!r) r = cdb_find(&c,key,2);
+    if (r == -1) return 0;
 
+    byte_zero(key + 1,2);
+    if (r && (cdb_datalen(&c) == 2))
+      if (cdb_read(&c,key + 1,2,cdb_datapos(&c)) == -1) return 0;
+  }
   key[0] = '+';
-  byte_zero(key + 1,2);
-  if (r && (cdb_datalen(&c) == 2))
-    if (cdb_read(&c,key + 1,2,cdb_datapos(&c)) == -1) return 0;
 
   byte_copy(key + 3,qlen,q);
   case_lowerb(key + 3,qlen + 3);
@@ -62,11 +229,22 @@ static int doit(char *q,char qtype[2],char ip[4])
   if (r == -1) return 0;
   dlen = cdb_datalen(&c);
 
-  if (dlen > 512) dlen = 512;
-  if (cdb_read(&c,data,dlen,cdb_datapos(&c)) == -1) return 0;
+  if ((dlen & 3) == 1) {
+    r = 0;
+    if (flaga) r = pool(cdb_datapos(&c),dlen,!!hmap);
+    if (r == -1) return 0;
+    dlen = r;
+  }
+  else {
+    if (dlen > 512) dlen = 512;
+    if (cdb_read(&c,data,dlen,cdb_datapos(&c)) == -1) return 0;
+    if (flaga) {
+      dns_sortip(data,dlen);
+      dlen = up(data,dlen);
+    }
+  }
 
   if (flaga) {
-    dns_sortip(data,dlen);
     if (dlen > 12) dlen = 12;
     while (dlen >= 4) {
       dlen -= 4;
@@ -86,16 +264,17 @@ static int doit(char *q,char qtype[2],char ip[4])
   return 1;
 }
 
-int respond(char *q,char qtype[2],char ip[4])
+int respond(char *q,char qtype[2],char ip[4],uint32 qhash)
 {
-  int fd;
-  int result;
+  int r;
 
-  fd = open_read("data.cdb");
-  if (fd == -1) return 0;
-  cdb_init(&c,fd);
-  result = doit(q,qtype,ip);
-  cdb_free(&c);
-  close(fd);
-  return result;
+  r = cdbmap(&c,"data.cdb");
+  if (!r) return 0;
+  if (r == 2) {
+    ++metric[METRIC_RELOADS];
+    flagloctable = (cdb_find(&c,"\0l",2) == 1);
+    if (flagloctable) clientloc_init(&c);
+  }
+  if (health) health_refresh();
+  return doit(q,qtype,ip);
 }
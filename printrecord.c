@@ -5,7 +5,7 @@
 #include "dns.h"
 #include "printrecord.h"
 
-static char *d;
+static char d[DNS_NAME];
 
 unsigned int printrecord_cat(stralloc *out,const char *buf,unsigned int len,unsigned int pos,const char *q,const char qtype[2])
 {
@@ -18,7 +18,7 @@ unsigned int printrecord_cat(stralloc *out,const char *buf,unsigned int len,unsi
   int i;
   unsigned char ch;
 
-  pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return 0;
+  pos = dns_packet_getnamebuf(buf,len,pos,d); if (!pos) return 0;
   pos = dns_packet_copy(buf,len,pos,misc,10); if (!pos) return 0;
   uint16_unpack_big(misc + 8,&datalen);
   newpos = pos + datalen;
@@ -45,14 +45,14 @@ unsigned int printrecord_cat(stralloc *out,const char *buf,unsigned int len,unsi
   if (byte_equal(misc,2,DNS_T_PTR)) x = " PTR ";
   if (byte_equal(misc,2,DNS_T_CNAME)) x = " CNAME ";
   if (x) {
-    pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(buf,len,pos,d); if (!pos) return 0;
     if (!stralloc_cats(out,x)) return 0;
     if (!dns_domain_todot_cat(out,d)) return 0;
   }
   else if (byte_equal(misc,2,DNS_T_MX)) {
     if (!stralloc_cats(out," MX ")) return 0;
     pos = dns_packet_copy(buf,len,pos,misc,2); if (!pos) return 0;
-    pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(buf,len,pos,d); if (!pos) return 0;
     uint16_unpack_big(misc,&u16);
     if (!stralloc_catulong0(out,u16,0)) return 0;
     if (!stralloc_cats(out," ")) return 0;
@@ -60,10 +60,10 @@ unsigned int printrecord_cat(stralloc *out,const char *buf,unsigned int len,unsi
   }
   else if (byte_equal(misc,2,DNS_T_SOA)) {
     if (!stralloc_cats(out," SOA ")) return 0;
-    pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(buf,len,pos,d); if (!pos) return 0;
     if (!dns_domain_todot_cat(out,d)) return 0;
     if (!stralloc_cats(out," ")) return 0;
-    pos = dns_packet_getname(buf,len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(buf,len,pos,d); if (!pos) return 0;
     if (!dns_domain_todot_cat(out,d)) return 0;
     pos = dns_packet_copy(buf,len,pos,misc,20); if (!pos) return 0;
     for (i = 0;i < 5;++i) {
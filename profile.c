@@ -0,0 +1,56 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <signal.h>
+#include "profile.h"
+
+/*
+A sampler that is cheap enough to leave on. The code says what it is
+doing by setting profile_phase as it goes; profile_start() has the
+kernel send SIGPROF every so much CPU time used, user or system, and
+each one adds 1 to count[profile_phase]. An idle process costs
+nothing, and a busy one about a microsecond per sample.
+
+Timers are not inherited, so each worker calls profile_start() after
+fork(). The handler is installed with SA_RESTART, so that blocking
+reads and writes carry on; iopause() just returns early.
+*/
+
+volatile int profile_phase = PROFILE_OTHER;
+static uint64 *count = 0;
+
+static void sample(int sig)
+{
+  int p = profile_phase;
+
+  if ((p >= 0) && (p < PROFILE_PHASES)) ++count[p];
+}
+
+/* returns the phase that was running */
+int profile_enter(int phase)
+{
+  int p = profile_phase;
+
+  profile_phase = phase;
+  return p;
+}
+
+/* hz samples a second of CPU time, at most 1000, into c[PROFILE_PHASES] */
+int profile_start(unsigned long hz,uint64 *c)
+{
+  struct sigaction sa;
+  struct itimerval it;
+
+  if (!hz) return 0;
+  if (hz > 1000) hz = 1000;
+  count = c;
+
+  sa.sa_handler = sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF,&sa,(struct sigaction *) 0) == -1) return -1;
+
+  it.it_interval.tv_sec = 1 / hz;
+  it.it_interval.tv_usec = (1000000 / hz) % 1000000;
+  it.it_value = it.it_interval;
+  return setitimer(ITIMER_PROF,&it,(struct itimerval *) 0);
+}
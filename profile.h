@@ -0,0 +1,31 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "uint64.h"
+
+#define PROFILE_OTHER 0
+#define PROFILE_WAIT 1 /* in iopause() */
+#define PROFILE_RECEIVE 2 /* reading queries */
+#define PROFILE_PARSE 3 /* taking queries apart */
+#define PROFILE_CACHE 4 /* cache_get(), cache_set(), tinydns answer cache */
+#define PROFILE_CDB 5 /* finding records in data.cdb */
+#define PROFILE_RESOLVE 6 /* dnscache: a step of a query */
+#define PROFILE_RESPONSE 7 /* building answers */
+#define PROFILE_LOG 8
+#define PROFILE_SEND 9 /* writing answers */
+#define PROFILE_PHASES 10
+
+extern volatile int profile_phase;
+
+extern int profile_start(unsigned long,uint64 *);
+extern int profile_enter(int);
+
+/*
+PROFILE_ENTER goes last among the declarations of the function, and
+PROFILE_LEAVE before each return, as with PERFCOUNT_BEGIN.
+*/
+
+#define PROFILE_ENTER(phase) int profsaved = profile_enter(phase);
+#define PROFILE_LEAVE profile_phase = profsaved;
+
+#endif
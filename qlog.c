@@ -1,9 +1,18 @@
 #include "buffer.h"
+#include "byte.h"
+#include "dns.h"
+#include "fmt.h"
+#include "taia.h"
+#include "topn.h"
 #include "qlog.h"
+#include "logbuf.h"
+#include "profile.h"
+
+static buffer *out;
 
 static void put(char c)
 {
-  buffer_put(buffer_2,&c,1);
+  buffer_PUTC(out,c);
 }
 
 static void hex(unsigned char c)
@@ -20,26 +29,11 @@ static void octal(unsigned char c)
   put('0' + (c & 7));
 }
 
-void qlog(const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char *result)
+static void name(const char *q)
 {
   char ch;
   char ch2;
 
-  hex(ip[0]);
-  hex(ip[1]);
-  hex(ip[2]);
-  hex(ip[3]);
-  put(':');
-  hex(port >> 8);
-  hex(port & 255);
-  put(':');
-  hex(id[0]);
-  hex(id[1]);
-  buffer_puts(buffer_2,result);
-  hex(qtype[0]);
-  hex(qtype[1]);
-  put(' ');
-
   if (!*q)
     put('.');
   else
@@ -57,7 +51,231 @@ void qlog(const char ip[4],uint16 port,const char id[2],const char *q,const char
       if (!*q) break;
       put('.');
     }
+}
+
+void qlog_text(buffer *b,const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char *result)
+{
+  out = b;
+
+  hex(ip[0]);
+  hex(ip[1]);
+  hex(ip[2]);
+  hex(ip[3]);
+  put(':');
+  hex(port >> 8);
+  hex(port & 255);
+  put(':');
+  hex(id[0]);
+  hex(id[1]);
+  buffer_puts(out,result);
+  hex(qtype[0]);
+  hex(qtype[1]);
+  put(' ');
+  name(q);
+  put('\n');
+}
+
+/*
+Binary records, after qlog_binary(): a line holding a 0 byte, the
+client IP address, port and query ID, the middle character of the
+result, the query type, and the query name as it came in, with \n
+written as \\n and \\ as \\\\ so that a record is still one line for
+multilog. qlog_decode() turns one back into the text line.
+*/
+
+static int flagbinary = 0;
+
+void qlog_binary(void)
+{
+  flagbinary = 1;
+}
+
+static void binary(const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char *result)
+{
+  char raw[QLOG_RAW];
+  char line[2 * QLOG_RAW + 1];
+  unsigned int rawlen;
+  unsigned int len;
+  unsigned int i;
+  unsigned int j;
+
+  raw[0] = 0;
+  byte_copy(raw + 1,4,ip);
+  raw[5] = port >> 8;
+  raw[6] = port;
+  byte_copy(raw + 7,2,id);
+  raw[9] = result[1];
+  byte_copy(raw + 10,2,qtype);
+  i = dns_domain_length(q);
+  byte_copy(raw + 12,i,q);
+  rawlen = 12 + i;
+
+  len = 0;
+  for (j = 0;j < rawlen;++j)
+    if (raw[j] == '\n') { line[len++] = '\\'; line[len++] = 'n'; }
+    else if (raw[j] == '\\') { line[len++] = '\\'; line[len++] = '\\'; }
+    else line[len++] = raw[j];
+  line[len++] = '\n';
+  buffer_put(buffer_2,line,len);
+}
+
+/*
+After qlog_sample(n), only every nth query is logged. After
+qlog_ratelimit(n), at most n queries a second are; the first line in
+a later second is preceded by "suppressed query count" for what was
+left out.
+*/
+
+static unsigned long sample = 0;
+static unsigned long samplecount = 0;
+static unsigned long ratelimit = 0;
+static unsigned long ratecount = 0;
+static uint64 ratesec = 0;
+static unsigned long suppressed = 0;
+
+void qlog_sample(unsigned long n)
+{
+  sample = (n > 1) ? n : 0;
+}
+
+void qlog_ratelimit(unsigned long n)
+{
+  ratelimit = n;
+}
+
+static int limit(void)
+{
+  struct taia now;
+  char strnum[FMT_ULONG];
+
+  if (!ratelimit) return 1;
+  taia_now(&now);
+  if (now.sec.x != ratesec) {
+    ratesec = now.sec.x;
+    ratecount = 0;
+    if (suppressed) {
+      buffer_puts(buffer_2,"suppressed query ");
+      buffer_put(buffer_2,strnum,fmt_ulong(strnum,suppressed));
+      buffer_puts(buffer_2,"\n");
+      logbuf_line();
+      suppressed = 0;
+    }
+  }
+  if (ratecount >= ratelimit) {
+    ++suppressed;
+    return 0;
+  }
+  ++ratecount;
+  return 1;
+}
+
+/*
+After qlog_topn(n), each query, sampled or not, also goes into two
+Space-Saving sketches of n entries, one of query names and one of
+client addresses; qlog_top() writes out and clears both, heaviest
+first, as "topname worker count error name" and "topclient worker
+count error ip" lines. A count may be high by up to its error.
+*/
+
+static struct topn_queries top;
+static unsigned long topworker;
+
+void qlog_topn(unsigned long n)
+{
+  topn_queriesinit(&top,n);
+}
 
+static void number(unsigned long u)
+{
+  char strnum[FMT_ULONG];
+  buffer_put(out,strnum,fmt_ulong(strnum,u));
+}
+
+static void counts(const char *what,struct topn_entry *e)
+{
+  buffer_puts(out,what); put(' ');
+  number(topworker); put(' ');
+  number(e->count); put(' ');
+  number(e->error); put(' ');
+}
+
+static void topname(struct topn_entry *e)
+{
+  counts("topname",e);
+  name(e->key);
+  put('\n');
+}
+
+static void topclient(struct topn_entry *e)
+{
+  counts("topclient",e);
+  hex(e->key[0]);
+  hex(e->key[1]);
+  hex(e->key[2]);
+  hex(e->key[3]);
   put('\n');
-  buffer_flush(buffer_2);
+}
+
+void qlog_top(buffer *b,unsigned long worker)
+{
+  if (!top.flagon) return;
+  out = b;
+  topworker = worker;
+  topn_each(&top.name,topname);
+  topn_each(&top.client,topclient);
+}
+
+void qlog(const char ip[4],uint16 port,const char id[2],const char *q,const char qtype[2],const char *result)
+{
+  PROFILE_ENTER(PROFILE_LOG)
+
+  topn_query(&top,(result[1] != '/') ? q : 0,ip);
+
+  if (sample) {
+    if (++samplecount < sample) { PROFILE_LEAVE return; }
+    samplecount = 0;
+  }
+  if (!limit()) { PROFILE_LEAVE return; }
+
+  if (flagbinary)
+    binary(ip,port,id,q,qtype,result);
+  else
+    qlog_text(buffer_2,ip,port,id,q,qtype,result);
+  logbuf_line();
+  PROFILE_LEAVE
+}
+
+/* s, len: one line without \n; 1 if it was a binary record */
+int qlog_decode(buffer *b,const char *s,unsigned int len)
+{
+  char raw[QLOG_RAW];
+  char result[4];
+  unsigned int rawlen;
+  unsigned int i;
+  unsigned int j;
+  uint16 port;
+
+  if (!len || s[0]) return 0;
+  rawlen = 0;
+  for (j = 0;j < len;++j) {
+    if (rawlen >= sizeof raw) return 0;
+    if (s[j] != '\\')
+      raw[rawlen++] = s[j];
+    else if (++j == len)
+      return 0;
+    else
+      raw[rawlen++] = (s[j] == 'n') ? '\n' : s[j];
+  }
+  if (rawlen < 13) return 0;
+  for (i = 12;raw[i];i += (unsigned char) raw[i] + 1)
+    if (i + (unsigned char) raw[i] + 1 >= rawlen) return 0;
+
+  port = (unsigned char) raw[5];
+  port = (port << 8) + (unsigned char) raw[6];
+  result[0] = ' ';
+  result[1] = raw[9];
+  result[2] = ' ';
+  result[3] = 0;
+  qlog_text(b,raw + 1,port,raw + 7,raw + 12,raw + 10,result);
+  return 1;
 }
@@ -2,7 +2,17 @@
 #define QLOG_H
 
 #include "uint16.h"
+#include "buffer.h"
+
+#define QLOG_RAW 268 /* longest binary record before escaping */
 
 extern void qlog(const char *,uint16,const char *,const char *,const char *,const char *);
+extern void qlog_text(buffer *,const char *,uint16,const char *,const char *,const char *,const char *);
+extern void qlog_binary(void);
+extern void qlog_sample(unsigned long);
+extern void qlog_ratelimit(unsigned long);
+extern void qlog_topn(unsigned long);
+extern void qlog_top(buffer *,unsigned long);
+extern int qlog_decode(buffer *,const char *,unsigned int);
 
 #endif
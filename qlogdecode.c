@@ -0,0 +1,55 @@
+#include "buffer.h"
+#include "stralloc.h"
+#include "getln.h"
+#include "strerr.h"
+#include "qlog.h"
+#include "exit.h"
+
+#define FATAL "qlogdecode: fatal: "
+
+/*
+Reads a log from tinydns, walldns, rbldns or pickdns and writes it
+with each binary record from $LOGBINARY turned back into the usual
+text line. Other lines, and a leading multilog timestamp, are copied
+as they are.
+*/
+
+static char inspace[4096];
+static buffer in = BUFFER_INIT(buffer_unixread,0,inspace,sizeof inspace);
+
+static stralloc line;
+static int match = 1;
+
+static int stamplen(const char *s,unsigned int len)
+{
+  unsigned int i;
+
+  if ((len < 26) || (s[0] != '@') || (s[25] != ' ')) return 0;
+  for (i = 1;i < 25;++i)
+    if (!(((s[i] >= '0') && (s[i] <= '9')) || ((s[i] >= 'a') && (s[i] <= 'f'))))
+      return 0;
+  return 26;
+}
+
+int main()
+{
+  unsigned int i;
+
+  while (match) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    if (!line.len) break;
+    if (match) --line.len;
+
+    i = stamplen(line.s,line.len);
+    buffer_put(buffer_1,line.s,i);
+    if (!qlog_decode(buffer_1,line.s + i,line.len - i)) {
+      buffer_put(buffer_1,line.s + i,line.len - i);
+      buffer_put(buffer_1,"\n",1);
+    }
+  }
+
+  if (buffer_flush(buffer_1) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+  _exit(0);
+}
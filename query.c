@@ -8,16 +8,274 @@
 #include "uint64.h"
 #include "uint32.h"
 #include "uint16.h"
+#include "tai.h"
+#include "taia.h"
 #include "dd.h"
 #include "alloc.h"
 #include "response.h"
 #include "query.h"
+#include "metrics.h"
+#include "perfcount.h"
+#include "profile.h"
+#include "cdb.h"
+
+uint64 query_sent = 0;
 
 static int flagforwardonly = 0;
 
 void query_forwardonly(void)
 {
   flagforwardonly = 1;
+  dns_rtt_balance();
+}
+
+static int flagcompact = 0;
+
+void query_compact(void)
+{
+  flagcompact = 1;
+}
+
+/*
+With query_minimalany(), an ANY answer from a server reaches the
+client as its first RRset only, as RFC 8482 allows; all of it still
+goes into the cache. From the cache, ANY already gets a single RRset.
+*/
+
+static int flagminimalany = 0;
+
+void query_minimalany(void)
+{
+  flagminimalany = 1;
+}
+
+/*
+nx[] counts NXDOMAIN answers per zone (the SOA owner) in the current
+second. Once a zone has had nxlimit of them, further uncached names
+under it fail locally for the rest of that second; a flood of random
+names under one zone then costs at most nxlimit upstream queries and
+cache entries per second.
+*/
+
+#define NXZONES 256
+
+static unsigned long nxlimit = 0;
+static struct {
+  char *zone;
+  uint32 second;
+  unsigned long count;
+} nx[NXZONES];
+
+void query_nxlimit(unsigned long n)
+{
+  nxlimit = n;
+}
+
+static uint32 thissecond(void)
+{
+  struct tai now;
+  tai_now(&now);
+  return now.x;
+}
+
+static unsigned int nxslot(const char *d)
+{
+  unsigned int len;
+  unsigned int h = 5381;
+  unsigned char c;
+
+  len = dns_domain_length(d);
+  while (len--) {
+    c = *d++;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    h = (h << 5) + h;
+    h ^= c;
+  }
+  return h & (NXZONES - 1);
+}
+
+static void nx_record(const char *zone)
+{
+  unsigned int i;
+  uint32 second;
+
+  if (!nxlimit) return;
+  second = thissecond();
+  i = nxslot(zone);
+  if (!nx[i].zone || !dns_domain_equal(nx[i].zone,zone)) {
+    if (!dns_domain_copy(&nx[i].zone,zone)) return;
+    nx[i].count = 0;
+  }
+  if (nx[i].second != second) {
+    nx[i].second = second;
+    nx[i].count = 0;
+  }
+  ++nx[i].count;
+}
+
+/* zone over its limit that contains d, or 0 */
+static const char *nx_over(const char *d)
+{
+  unsigned int i;
+  uint32 second;
+
+  if (!nxlimit) return 0;
+  second = thissecond();
+  while (*d) {
+    i = nxslot(d);
+    if (nx[i].zone && (nx[i].second == second) && (nx[i].count >= nxlimit))
+      if (dns_domain_equal(nx[i].zone,d))
+        return d;
+    d += 1 + (unsigned int) (unsigned char) *d;
+  }
+  return 0;
+}
+
+/*
+Peers. With query_peers(), a question this cache would send to the
+authorities goes first, as a recursive query, to the peer that owns
+its name, if that is not us. Each name has one owner, the peer with
+the highest hash of (name, address), so the caches of a cluster
+share one copy of each answer and a cache joining or leaving moves
+only its own names. If the owner fails, or has not answered within
+peertimeout, the question goes to the authorities as usual. The
+caller marks queries from peers with flagfrompeer; those are never
+passed on, so a peer list that differs from node to node cannot loop.
+*/
+
+#define PEERS 16
+
+static unsigned int numpeers = 0;
+static char peerservers[PEERS][64]; /* one address each, for dns_transmit */
+static char peerself[4];
+static unsigned long peertimeout = 0;
+
+void query_peers(const char *ip,unsigned int n,const char self[4],unsigned long ms)
+{
+  if (n > PEERS) n = PEERS;
+  byte_zero(peerservers,sizeof peerservers);
+  for (numpeers = 0;numpeers < n;++numpeers)
+    byte_copy(peerservers[numpeers],4,ip + 4 * numpeers);
+  byte_copy(peerself,4,self);
+  peertimeout = ms;
+}
+
+int query_ispeer(const char ip[4])
+{
+  unsigned int i;
+
+  for (i = 0;i < numpeers;++i)
+    if (byte_equal(peerservers[i],4,ip)) return 1;
+  return 0;
+}
+
+/* the owner of d, or 0 if that is us */
+static const char *peerowner(const char *d)
+{
+  unsigned int len;
+  unsigned int i;
+  uint32 h = 5381;
+  uint32 w;
+  uint32 best;
+  const char *owner;
+  unsigned char c;
+
+  len = dns_domain_length(d);
+  while (len--) {
+    c = *d++;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    h = (h << 5) + h;
+    h ^= c;
+  }
+
+  owner = 0;
+  best = 0;
+  for (i = 0;i < numpeers;++i) {
+    uint32_unpack(peerservers[i],&w);
+    w = (w ^ h) * 0x9e3779b1;
+    w ^= w >> 15;
+    w *= 0x85ebca6b;
+    w ^= w >> 13;
+    if (!owner || (w > best)) { owner = peerservers[i]; best = w; }
+  }
+  if (!owner || byte_equal(owner,4,peerself)) return 0;
+  return owner;
+}
+
+/*
+Tracing. After query_trace(ms), each query records timed events: s
+when it starts, w when it waits for an identical query in flight and l
+when that one is done, c at each round of cache lookups for a name, t
+for each transmission (to the first server, of n), T when that falls
+back to TCP, r for a response (n: on which pass through the servers), f
+when all servers failed, p when a peer failed or was too slow and
+the question goes to the authorities. Each carries the level, 0 for the question
+and higher for glueless lookups of nameserver addresses.
+query_slow() says whether the query has taken at least ms.
+*/
+
+static unsigned long traceslow = 0;
+
+void query_trace(unsigned long ms)
+{
+  traceslow = ms;
+}
+
+static void trace(struct query *z,char what,const char *ip,unsigned int n)
+{
+  struct query_event *e;
+  struct taia now;
+  struct taia t;
+
+  if (!traceslow) return;
+  taia_clock(&now);
+  if (what == 's') {
+    z->tracestart = now;
+    z->numtrace = 0;
+    z->tracelost = 0;
+  }
+  if (z->numtrace >= QUERY_MAXTRACE) { ++z->tracelost; return; }
+  e = z->trace + z->numtrace++;
+  e->what = what;
+  e->level = z->level;
+  if (ip) byte_copy(e->ip,4,ip); else byte_zero(e->ip,4);
+  e->n = n;
+  e->usec = 0;
+  if (taia_less(&z->tracestart,&now)) {
+    taia_sub(&t,&now,&z->tracestart);
+    e->usec = taia_approx(&t) * 1000000.0;
+  }
+}
+
+int query_slow(struct query *z,uint32 *usec)
+{
+  struct taia now;
+  struct taia t;
+
+  if (!traceslow || !z->numtrace) return 0;
+  taia_clock(&now);
+  if (!taia_less(&z->tracestart,&now)) return 0;
+  taia_sub(&t,&now,&z->tracestart);
+  if (taia_approx(&t) * 1000.0 < traceslow) return 0;
+  *usec = taia_approx(&t) * 1000000.0;
+  return 1;
+}
+
+static void tracetx(struct query *z)
+{
+  unsigned int j;
+  unsigned int n;
+
+  if (!traceslow) return;
+  n = 0;
+  for (j = 0;j < 64;j += 4)
+    if (byte_diff(z->dt.servers + j,4,"\0\0\0\0")) ++n;
+  trace(z,'t',z->dt.servers + 4 * z->dt.curserver,n);
+  z->tracetcp = 0;
+  if ((z->dt.tcpstate > 0) && (z->dt.tcpstate < 6)) {
+    z->tracetcp = 1;
+    trace(z,'T',z->dt.servers + 4 * z->dt.curserver,0);
+  }
 }
 
 static void cachegeneric(const char type[2],const char *d,const char *data,unsigned int datalen,uint32 ttl)
@@ -35,28 +293,174 @@ static void cachegeneric(const char type[2],const char *d,const char *data,unsig
   cache_set(key,len + 2,data,datalen,ttl);
 }
 
-static char save_buf[8192];
-static unsigned int save_len;
+/*
+The addresses found for a zone's servers, cached under this private
+type with the zone as the name, for the smallest TTL among the NS
+records and the A records that went into them. A later query under
+the zone then needs no NS lookup and no A lookups for the NS names.
+IPv6 servers are left out: their dns_ip6 handles mean nothing to
+another process sharing the cache.
+*/
+
+#define T_SERVERS "\377\376"
+
+static void cacheservers(struct query *z)
+{
+  char data[64];
+  unsigned int len;
+  unsigned int k;
+
+  if (flagforwardonly || !z->lv[z->level]->serversttl) return;
+  len = 0;
+  for (k = 0;k < 64;k += 4)
+    if (byte_diff(z->lv[z->level]->servers + k,4,"\0\0\0\0"))
+      if ((unsigned char) z->lv[z->level]->servers[k] < 0xf0) {
+        byte_copy(data + len,4,z->lv[z->level]->servers + k);
+        len += 4;
+      }
+  if (len) cachegeneric(T_SERVERS,z->control[z->level],data,len,z->lv[z->level]->serversttl);
+  z->lv[z->level]->serversttl = 0;
+}
+
+/* must be called before cache_init(); see cache_partition() */
+void query_partition(unsigned int infra,unsigned int negative)
+{
+  cache_partition(infra,negative);
+  cache_infra(DNS_T_NS);
+  cache_infra(T_SERVERS);
+}
+
+static void addressttl(struct query *z,uint32 ttl)
+{
+  if (ttl < z->lv[z->level - 1]->serversttl) z->lv[z->level - 1]->serversttl = ttl;
+}
+
+/* adds the cached AAAA addresses of server d, as dns_ip6 handles; returns how many */
+static int addaaaa(struct query *z,const char *d,uint32 *ttl)
+{
+  char key[257];
+  char handle[4];
+  char *cached;
+  unsigned int cachedlen;
+  unsigned int dlen;
+  unsigned int pos;
+  unsigned int k;
+  uint16 datalen;
+  int n;
+
+  if (!dns_ip6_on(0)) return 0;
+  dlen = dns_domain_length(d);
+  if (dlen > 255) return 0;
+  byte_copy(key,2,DNS_T_AAAA);
+  byte_copy(key + 2,dlen,d);
+  case_lowerb(key + 2,dlen);
+  cached = cache_get(key,dlen + 2,&cachedlen,ttl);
+  if (!cached) return 0;
+
+  n = 0;
+  pos = 0;
+  while (pos + 2 <= cachedlen) {
+    datalen = uint16_UNPACK_BIG(cached + pos);
+    pos += 2;
+    if (datalen > cachedlen - pos) break;
+    if (datalen == 16)
+      if (dns_ip6_handle(handle,cached + pos)) {
+        for (k = 0;k < 64;k += 4)
+          if (byte_equal(z->lv[z->level - 1]->servers + k,4,handle)) break;
+        if (k == 64)
+          for (k = 0;k < 64;k += 4)
+            if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+              byte_copy(z->lv[z->level - 1]->servers + k,4,handle);
+              ++n;
+              break;
+            }
+      }
+    pos += datalen;
+  }
+  return n;
+}
+
+/* grows as needed; an RRset comes from one packet, so it stays small */
+static stralloc save_buf = {0};
 static unsigned int save_ok;
 
+/*
+With query_compact(), names in a cached NS, PTR or MX set point back
+at earlier names in the same set, as in a packet; save_names lists
+where each label written in full starts. Offsets are from the start
+of the cached data, which dns_packet_getnamebuf() reads either way.
+*/
+
+#define SAVENAMES 64
+
+static unsigned int save_names[SAVENAMES];
+static unsigned int save_numnames;
+
 static void save_start(void)
 {
-  save_len = 0;
+  save_buf.len = 0;
   save_ok = 1;
+  save_numnames = 0;
 }
 
 static void save_data(const char *buf,unsigned int len)
 {
   if (!save_ok) return;
-  if (len > (sizeof save_buf) - save_len) { save_ok = 0; return; }
-  byte_copy(save_buf + save_len,len,buf);
-  save_len += len;
+  if (!stralloc_catb(&save_buf,buf,len)) save_ok = 0;
+}
+
+static int save_match(const char *d,unsigned int pos)
+{
+  unsigned char c;
+
+  for (;;) {
+    c = save_buf.s[pos];
+    if (c >= 192) {
+      pos = ((c & 63) << 8) + (unsigned char) save_buf.s[pos + 1];
+      continue;
+    }
+    if (c != (unsigned char) *d) return 0;
+    if (!c) return 1;
+    if (byte_diff(d + 1,c,save_buf.s + pos + 1)) return 0;
+    d += c + 1;
+    pos += c + 1;
+  }
+}
+
+static void save_labels(const char *d,unsigned int len)
+{
+  unsigned int k;
+
+  for (k = 0;(k < len) && d[k];k += (unsigned char) d[k] + 1)
+    if ((save_numnames < SAVENAMES) && (save_buf.len + k < 16384))
+      save_names[save_numnames++] = save_buf.len + k;
+  save_data(d,len);
+}
+
+static void save_name(const char *d)
+{
+  unsigned int i;
+  unsigned int j;
+  char buf[2];
+
+  if (!save_ok) return;
+  if (!flagcompact) { save_data(d,dns_domain_length(d)); return; }
+
+  for (i = 0;d[i];i += (unsigned char) d[i] + 1)
+    for (j = 0;j < save_numnames;++j)
+      if (save_match(d + i,save_names[j])) {
+        save_labels(d,i);
+        uint16_pack_big(buf,49152 + save_names[j]);
+        save_data(buf,2);
+        return;
+      }
+  save_labels(d,i + 1);
 }
 
 static void save_finish(const char type[2],const char *d,uint32 ttl)
 {
   if (!save_ok) return;
-  cachegeneric(type,d,save_buf,save_len,ttl);
+  cachegeneric(type,d,save_buf.s,save_buf.len,ttl);
 }
 
 
@@ -69,42 +473,127 @@ static uint32 ttlget(char buf[4])
 {
   uint32 ttl;
 
-  uint32_unpack_big(buf,&ttl);
+  ttl = uint32_UNPACK_BIG(buf);
   if (ttl > 1000000000) return 0;
   if (ttl > 604800) return 604800;
   return ttl;
 }
 
 
+/*
+Memory belonging to z: names, and the level and alias tables, which
+are set up only when a query gets that far; a query answered from the
+cache at level 0 uses a name or two and nothing else. All of it comes
+from z->arena, or from alloc() once that is full.
+*/
+
+static char *qalloc(struct query *z,unsigned int len,unsigned int align)
+{
+  unsigned int pad;
+  char *x;
+
+  pad = (unsigned long) (z->arena + z->arenaused) % align;
+  if (pad) pad = align - pad;
+  if (pad + len <= QUERY_ARENA - z->arenaused) {
+    x = z->arena + z->arenaused + pad;
+    z->arenaused += pad + len;
+    return x;
+  }
+  return alloc(len);
+}
+
+static void qrelease(struct query *z,char *x)
+{
+  if ((x < z->arena) || (x >= z->arena + QUERY_ARENA))
+    alloc_free(x);
+}
+
+static void qfree(struct query *z,char **out)
+{
+  if (*out) {
+    qrelease(z,*out);
+    *out = 0;
+  }
+}
+
+static int qcopy(struct query *z,char **out,const char *in)
+{
+  unsigned int len;
+  char *x;
+
+  len = dns_domain_length(in);
+  x = qalloc(z,len,1);
+  if (!x) return 0;
+  byte_copy(x,len,in);
+  qfree(z,out);
+  *out = x;
+  return 1;
+}
+
+/* sets up z->lv[z->level], empty, if it is not there yet */
+static int levelready(struct query *z)
+{
+  struct query_level *l;
+
+  if (z->lv[z->level]) return 1;
+  l = (struct query_level *) qalloc(z,sizeof(struct query_level),sizeof(char *));
+  if (!l) return 0;
+  byte_zero((char *) l,sizeof(struct query_level));
+  z->lv[z->level] = l;
+  return 1;
+}
+
+static int aliasready(struct query *z)
+{
+  struct query_alias *a;
+
+  if (z->alias) return 1;
+  a = (struct query_alias *) qalloc(z,sizeof(struct query_alias),sizeof(char *));
+  if (!a) return 0;
+  byte_zero((char *) a,sizeof(struct query_alias));
+  z->alias = a;
+  return 1;
+}
+
 static void cleanup(struct query *z)
 {
   int j;
   int k;
 
   dns_transmit_free(&z->dt);
-  for (j = 0;j < QUERY_MAXALIAS;++j)
-    dns_domain_free(&z->alias[j]);
+  if (z->alias) {
+    for (j = 0;j < QUERY_MAXALIAS;++j)
+      qfree(z,&z->alias->name[j]);
+    qrelease(z,(char *) z->alias);
+    z->alias = 0;
+  }
   for (j = 0;j < QUERY_MAXLEVEL;++j) {
-    dns_domain_free(&z->name[j]);
-    for (k = 0;k < QUERY_MAXNS;++k)
-      dns_domain_free(&z->ns[j][k]);
+    qfree(z,&z->name[j]);
+    if (z->lv[j]) {
+      for (k = 0;k < QUERY_MAXNS;++k)
+        qfree(z,&z->lv[j]->ns[k]);
+      qrelease(z,(char *) z->lv[j]);
+      z->lv[j] = 0;
+    }
   }
+  z->arenaused = 0;
 }
 
 static int rqa(struct query *z)
 {
   int i;
 
-  for (i = QUERY_MAXALIAS - 1;i >= 0;--i)
-    if (z->alias[i]) {
-      if (!response_query(z->alias[i],z->type,z->class)) return 0;
-      while (i > 0) {
-        if (!response_cname(z->alias[i],z->alias[i - 1],z->aliasttl[i])) return 0;
-        --i;
+  if (z->alias)
+    for (i = QUERY_MAXALIAS - 1;i >= 0;--i)
+      if (z->alias->name[i]) {
+        if (!response_query(z->alias->name[i],z->type,z->class)) return 0;
+        while (i > 0) {
+          if (!response_cname(z->alias->name[i],z->alias->name[i - 1],z->alias->ttl[i])) return 0;
+          --i;
+        }
+        if (!response_cname(z->alias->name[0],z->name[0],z->alias->ttl[0])) return 0;
+        return 1;
       }
-      if (!response_cname(z->alias[0],z->name[0],z->aliasttl[0])) return 0;
-      return 1;
-    }
 
   if (!response_query(z->name[0],z->type,z->class)) return 0;
   return 1;
@@ -120,43 +609,452 @@ static int globalip(char *d,char ip[4])
   return 0;
 }
 
-static char *t1 = 0;
-static char *t2 = 0;
-static char *t3 = 0;
-static char *cname = 0;
+static char t1[DNS_NAME];
+static char t2[DNS_NAME];
+static char t3[DNS_NAME];
+static char cname[DNS_NAME];
 static char *referral = 0;
-static unsigned int *records = 0;
+static char *soazone = 0;
+
+/*
+A chain of two or more CNAMEs followed from the name asked about,
+cached under this private type with the head of the chain as the
+name: the smallest TTL among the links, then the TTL and target of
+each link in turn, the last target being the end of the chain. A
+later query for the head then takes the whole chain in one step,
+instead of one pass through the cache per link. The entry lasts as
+long as the shortest link; a link's TTL is aged by the time the entry
+has been in the cache.
+*/
+
+#define T_CHAIN "\377\375"
+
+static void cachechain(struct query *z)
+{
+  char data[4 + QUERY_MAXALIAS * (4 + DNS_NAME)];
+  unsigned int len;
+  unsigned int n;
+  uint32 min;
+  char *target;
+  int i;
+  int j;
 
-static int smaller(char *buf,unsigned int len,unsigned int pos1,unsigned int pos2)
+  if (!z->alias) return;
+  for (i = QUERY_MAXALIAS - 1;i > 0;--i)
+    if (z->alias->name[i]) break;
+  if (!i) return;
+
+  min = z->alias->ttl[i];
+  len = 4;
+  for (j = i;j >= 0;--j) {
+    target = j ? z->alias->name[j - 1] : z->name[0];
+    n = dns_domain_length(target);
+    uint32_pack_big(data + len,z->alias->ttl[j]);
+    byte_copy(data + len + 4,n,target);
+    len += 4 + n;
+    if (z->alias->ttl[j] < min) min = z->alias->ttl[j];
+  }
+  uint32_pack_big(data,min);
+  cachegeneric(T_CHAIN,z->alias->name[i],data,len,min);
+}
+
+/* 0 if data is no usable chain; -1 on failure; 1 once z->name[0] is its end */
+static int cachedchain(struct query *z,const char *data,unsigned int datalen,uint32 ttl)
 {
-  char header1[12];
-  char header2[12];
-  int r;
-  unsigned int len1;
-  unsigned int len2;
+  char t[DNS_NAME];
+  uint32 min;
+  uint32 age;
+  uint32 linkttl;
+  unsigned int pos;
+  unsigned int n;
+  int j;
 
-  pos1 = dns_packet_getname(buf,len,pos1,&t1);
-  dns_packet_copy(buf,len,pos1,header1,10);
-  pos2 = dns_packet_getname(buf,len,pos2,&t2);
-  dns_packet_copy(buf,len,pos2,header2,10);
+  if (datalen < 4) return 0;
+  uint32_unpack_big(data,&min);
+  age = (ttl < min) ? min - ttl : 0;
+
+  n = 0;
+  pos = 4;
+  while (pos < datalen) {
+    if (pos + 4 > datalen) return 0;
+    pos = dns_packet_getnamebuf(data,datalen,pos + 4,t);
+    if (!pos) return 0;
+    if (++n > QUERY_MAXALIAS) return 0;
+  }
+  if (n < 2) return 0;
+  if (!aliasready(z)) return -1;
+  if (z->alias->name[QUERY_MAXALIAS - n]) return 0;
+
+  pos = 4;
+  while (pos < datalen) {
+    uint32_unpack_big(data + pos,&linkttl);
+    pos = dns_packet_getnamebuf(data,datalen,pos + 4,t);
+    for (j = QUERY_MAXALIAS - 1;j > 0;--j)
+      z->alias->name[j] = z->alias->name[j - 1];
+    for (j = QUERY_MAXALIAS - 1;j > 0;--j)
+      z->alias->ttl[j] = z->alias->ttl[j - 1];
+    z->alias->name[0] = z->name[0];
+    z->alias->ttl[0] = (linkttl > age) ? linkttl - age : 0;
+    z->name[0] = 0;
+    if (!qcopy(z,&z->name[0],t)) return -1;
+    log_cachedcname(z->alias->name[0],z->name[0]);
+  }
+  return 1;
+}
+
+/*
+Each record of an upstream packet is decoded once: its owner goes into
+rrnames, and sorting and grouping work from the copies.
+*/
+
+struct rr {
+  unsigned int pos; /* of the record */
+  unsigned int data; /* of its rdata */
+  unsigned int name; /* of its owner in rrnames */
+  unsigned int namelen;
+  uint32 hash; /* of the owner, case-folded */
+  char header[10]; /* type, class, TTL, rdata length */
+} ;
+
+static struct rr *records = 0;
+static stralloc rrnames = {0};
+
+static uint32 rrhash(const char *d,unsigned int len)
+{
+  uint32 h = 5381;
+  unsigned char c;
+
+  while (len--) {
+    c = *d++;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    h = (h << 5) + h;
+    h ^= c;
+  }
+  return h;
+}
 
-  r = byte_diff(header1,4,header2);
+static int sameowner(const struct rr *a,const struct rr *b)
+{
+  if (a->hash != b->hash) return 0;
+  if (a->namelen != b->namelen) return 0;
+  return !case_diffb(rrnames.s + a->name,a->namelen,rrnames.s + b->name);
+}
+
+static int smaller(const struct rr *a,const struct rr *b)
+{
+  int r;
+
+  r = byte_diff(a->header,4,b->header);
   if (r < 0) return 1;
   if (r > 0) return 0;
 
-  len1 = dns_domain_length(t1);
-  len2 = dns_domain_length(t2);
-  if (len1 < len2) return 1;
-  if (len1 > len2) return 0;
+  if (a->namelen < b->namelen) return 1;
+  if (a->namelen > b->namelen) return 0;
 
-  r = case_diffb(t1,len1,t2);
+  r = case_diffb(rrnames.s + a->name,a->namelen,rrnames.s + b->name);
   if (r < 0) return 1;
   if (r > 0) return 0;
 
-  if (pos1 < pos2) return 1;
+  if (a->pos < b->pos) return 1;
+  return 0;
+}
+
+/*
+Servers found lame for a zone, or answering queries under it with a
+failure such as SERVFAIL or REFUSED, by server and zone. Such a
+server is left out of the zone's list for BADTTL seconds, doubling
+with each failure while it is out or soon after, up to BADMAX; but
+never so as to leave the zone no server at all. Timeouts are for
+dns_rtt, which holds back a server that stops answering anything.
+Under $FORWARDONLY the zone is always the root, so there a failure
+holds back a server for the name alone.
+*/
+
+#define BADSIZE 1024 /* 2^10, for badslot() */
+#define BADTTL 60
+#define BADMAX 3600
+
+static struct bad {
+  char ip[4];
+  uint32 zone; /* rrhash() of the zone */
+  uint32 until;
+  uint32 ttl;
+} bad[BADSIZE];
+
+static int flagbad = 0;
+
+static uint32 badclock(void)
+{
+  struct taia t;
+  taia_clock(&t);
+  return t.sec.x;
+}
+
+static struct bad *badslot(const char ip[4],uint32 zone)
+{
+  uint32 u;
+
+  uint32_unpack(ip,&u);
+  return bad + ((((u ^ zone) * 2654435761UL) & 0xffffffff) >> 22);
+}
+
+static void badmark(const char ip[4],const char *zone)
+{
+  struct bad *b;
+  uint32 h;
+  uint32 t;
+
+  if (byte_equal(ip,4,"\0\0\0\0")) return;
+  h = rrhash(zone,dns_domain_length(zone));
+  b = badslot(ip,h);
+  t = badclock();
+  if (byte_equal(b->ip,4,ip) && (b->zone == h) && (t - b->until + b->ttl < 2 * b->ttl))
+    b->ttl = (b->ttl < BADMAX / 2) ? 2 * b->ttl : BADMAX;
+  else {
+    byte_copy(b->ip,4,ip);
+    b->zone = h;
+    b->ttl = BADTTL;
+  }
+  b->until = t + b->ttl;
+  flagbad = 1;
+}
+
+static int isbad(const char ip[4],uint32 zone,uint32 t)
+{
+  struct bad *b;
+
+  b = badslot(ip,zone);
+  if (byte_diff(b->ip,4,ip) || (b->zone != zone)) return 0;
+  return t - b->until + b->ttl < b->ttl;
+}
+
+static void badskip(char servers[64],const char *zone)
+{
+  unsigned int j;
+  unsigned int good;
+  unsigned int skip;
+  uint32 h;
+  uint32 t;
+
+  if (!flagbad) return;
+  h = rrhash(zone,dns_domain_length(zone));
+  t = badclock();
+  good = skip = 0;
+  for (j = 0;j < 64;j += 4)
+    if (byte_diff(servers + j,4,"\0\0\0\0")) {
+      if (isbad(servers + j,h,t)) ++skip; else ++good;
+    }
+  if (!skip || !good) return;
+  for (j = 0;j < 64;j += 4)
+    if (byte_diff(servers + j,4,"\0\0\0\0"))
+      if (isbad(servers + j,h,t)) byte_zero(servers + j,4);
+}
+
+static const char *badzone(struct query *z)
+{
+  return flagforwardonly ? z->name[z->level] : z->control[z->level];
+}
+
+static void badnote(struct query *z)
+{
+  unsigned int j;
+
+  for (j = 0;j < 16;++j)
+    if (z->dt.failed & (1 << j))
+      badmark(z->dt.servers + 4 * j,badzone(z));
+}
+
+/* from the directory built by cache_dir() for the name being resolved */
+static char *cachedanswer(struct query *z,const char type[2],unsigned int *datalen,uint32 *ttl)
+{
+  char *result;
+
+  cache_due = 0;
+  result = cache_dirget(type,datalen,ttl);
+  if (result && cache_due && !z->level) z->flagdue = 1;
+  return result;
+}
+
+/*
+With query_local(), a name that data.cdb in the current directory, in
+tinydns format, has a zone for is looked up there, by the code tinydns
+uses, before any server: doit() takes the answer as if a server had
+sent it, with every record in bailiwick, and caches it the same way.
+A name data.cdb delegates gets its referral, a name it has no zone for
+goes to servers as before, and a missing data.cdb is no zone at all.
+Lookups are done as for a client with no location. The log shows the
+server as 00000000.
+*/
+
+extern int respond(char *,char *,char *,uint32);
+
+static int flaglocal = 0;
+
+void query_local(void)
+{
+  flaglocal = 1;
+}
+
+static char localserver[4];
+
+/* 1 if z->dt has the answer from data.cdb; 0 if it has no zone for d */
+static int local(struct query *z,const char *d,const char dtype[2])
+{
+  char q[256];
+  char qtype[2];
+  unsigned int len;
+  int j;
+
+  len = dns_domain_length(d);
+  byte_copy(q,len,d);
+  case_lowerb(q,len);
+  byte_copy(qtype,2,dtype);
+  if (!response_query(q,qtype,DNS_C_IN)) return -1;
+  response[2] |= 4;
+  if (!respond(q,qtype,localserver,cdb_hash(q,len))) return 0;
+
+  z->control[z->level] = z->name[z->level] + len - 1;
+  byte_zero(z->lv[z->level]->servers,64);
+  for (j = 0;j < QUERY_MAXNS;++j)
+    qfree(z,&z->lv[z->level]->ns[j]);
+  z->lv[z->level]->serversttl = 0;
+  if (dns_transmit_packet(&z->dt,z->lv[z->level]->servers,response,response_len) == -1) return -1;
+  return 1;
+}
+
+/*
+Glueless prefetch: after query_glueless(n), when a referral names
+servers the cache has no addresses for, the query looks up the first
+of them itself, as always, and queues the rest, each once, up to n
+waiting at once, for the caller to look up in the background, all at
+the same time, with query_nextglueless(). Servers the cache has
+addresses for are taken first; once there are any, the query leaves
+out the others rather than waiting for them; serversttl is then 0,
+since the list is short. The next query for the zone finds every
+address in the cache and caches the whole list under T_SERVERS, which
+goes to the infra ring with cache_partition().
+*/
+
+static stralloc glueless = {0}; /* names, one after another */
+static unsigned int gluelesspos = 0; /* next name in glueless.s */
+static unsigned int gluelessnum = 0; /* names waiting */
+static unsigned long gluelessmax = 0;
+
+void query_glueless(unsigned long n)
+{
+  gluelessmax = n;
+}
+
+/* the next name to look up; 0 if none */
+char *query_nextglueless(void)
+{
+  static char name[256];
+  unsigned int len;
+
+  if (!gluelessnum) return 0;
+  len = dns_domain_length(glueless.s + gluelesspos);
+  byte_copy(name,len,glueless.s + gluelesspos);
+  gluelesspos += len;
+  if (!--gluelessnum) glueless.len = gluelesspos = 0;
+  return name;
+}
+
+static void gluelessqueue(const char *dn)
+{
+  unsigned int pos;
+  unsigned int i;
+
+  if (gluelessnum >= gluelessmax) return;
+  pos = gluelesspos;
+  for (i = 0;i < gluelessnum;++i) {
+    if (dns_domain_equal(glueless.s + pos,dn)) return;
+    pos += dns_domain_length(glueless.s + pos);
+  }
+  if (gluelesspos) {
+    glueless.len -= gluelesspos;
+    byte_copy(glueless.s,glueless.len,glueless.s + gluelesspos);
+    gluelesspos = 0;
+  }
+  if (!stralloc_catb(&glueless,dn,dns_domain_length(dn))) return;
+  ++gluelessnum;
+}
+
+/* 1 if the cache, or dn itself, has an address for the server dn */
+static int addressed(char *dn)
+{
+  char key[257];
+  char ip[4];
+  unsigned int dlen;
+  unsigned int len;
+  uint32 ttl;
+
+  if (globalip(dn,ip)) return 1;
+  dlen = dns_domain_length(dn);
+  if (dlen > 255) return 1;
+  byte_copy(key,2,DNS_T_A);
+  byte_copy(key + 2,dlen,dn);
+  case_lowerb(key + 2,dlen);
+  if (cache_get(key,dlen + 2,&len,&ttl) && len) return 1;
+  if (!dns_ip6_on(0)) return 0;
+  byte_copy(key,2,DNS_T_AAAA);
+  return cache_get(key,dlen + 2,&len,&ttl) && len;
+}
+
+/* queues the names in lv->ns the query itself will not look up first */
+static void gluelessstart(struct query_level *lv)
+{
+  int first;
+  int j;
+
+  lv->glueless = 0;
+  if (!gluelessmax || flagforwardonly) return;
+  first = 1;
+  for (j = 0;j < QUERY_MAXNS;++j)
+    if (lv->ns[j] && addressed(lv->ns[j])) first = 0;
+  for (j = 0;j < QUERY_MAXNS;++j)
+    if (lv->ns[j] && !addressed(lv->ns[j])) {
+      if (first) { first = 0; continue; }
+      gluelessqueue(lv->ns[j]);
+      lv->glueless = 1;
+    }
+}
+
+/* 1 if servers has an address */
+static int hasservers(const char servers[64])
+{
+  int j;
+
+  for (j = 0;j < 64;j += 4)
+    if (byte_diff(servers + j,4,"\0\0\0\0")) return 1;
   return 0;
 }
 
+/* the server in z->lv[z->level]->ns to look up next; -1 if none */
+/* after a referral with glueless names queued, those with addresses */
+/* in the cache come first, and the rest are dropped once there are */
+/* servers; the first of them otherwise */
+static int nextns(struct query *z)
+{
+  struct query_level *lv = z->lv[z->level];
+  int j;
+
+  if (lv->glueless) {
+    for (j = 0;j < QUERY_MAXNS;++j)
+      if (lv->ns[j] && addressed(lv->ns[j])) return j;
+    if (hasservers(lv->servers)) {
+      for (j = 0;j < QUERY_MAXNS;++j)
+        if (lv->ns[j]) {
+          qfree(z,&lv->ns[j]);
+          lv->serversttl = 0;
+        }
+      return -1;
+    }
+  }
+  for (j = 0;j < QUERY_MAXNS;++j)
+    if (lv->ns[j]) return j;
+  return -1;
+}
+
 static int doit(struct query *z,int state)
 {
   char key[257];
@@ -176,10 +1074,14 @@ static int doit(struct query *z,int state)
   uint16 numglue;
   unsigned int pos;
   unsigned int pos2;
-  uint16 datalen;
+  unsigned int datalen;
   char *control;
   char *d;
+  struct dns_domain controldn;
+  struct dns_domain referraldn;
+  struct dns_domain owner;
   const char *dtype;
+  char anytype[2];
   unsigned int dlen;
   int flagout;
   int flagcname;
@@ -193,6 +1095,8 @@ static int doit(struct query *z,int state)
   int k;
   int p;
   int q;
+  struct rr rr;
+  struct taia t;
 
   errno = error_io;
   if (state == 1) goto HAVEPACKET;
@@ -200,10 +1104,17 @@ static int doit(struct query *z,int state)
     log_servfail(z->name[z->level]);
     goto SERVFAIL;
   }
+  if (state == 2) { /* the cache is done with; see query_resume() */
+    d = z->name[z->level];
+    dtype = z->level ? DNS_T_A : z->type;
+    dlen = dns_domain_length(d);
+    goto UNCACHED;
+  }
 
 
   NEWNAME:
   if (++z->loop == 100) goto DIE;
+  trace(z,'c',0,0);
   d = z->name[z->level];
   dtype = z->level ? DNS_T_A : z->type;
   dlen = dns_domain_length(d);
@@ -211,8 +1122,8 @@ static int doit(struct query *z,int state)
   if (globalip(d,misc)) {
     if (z->level) {
       for (k = 0;k < 64;k += 4)
-        if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-	  byte_copy(z->servers[z->level - 1] + k,4,misc);
+        if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+	  byte_copy(z->lv[z->level - 1]->servers + k,4,misc);
 	  break;
 	}
       goto LOWERLEVEL;
@@ -240,18 +1151,38 @@ static int doit(struct query *z,int state)
     return 1;
   }
 
-  if (dlen <= 255) {
-    byte_copy(key,2,DNS_T_ANY);
+  if ((dlen <= 255) && (z->level || !z->flagrefresh)) {
     byte_copy(key + 2,dlen,d);
     case_lowerb(key + 2,dlen);
-    cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+    cache_dir(key + 2,dlen);
+    cached = cachedanswer(z,DNS_T_ANY,&cachedlen,&ttl);
     if (cached) {
       log_cachednxdomain(d);
       goto NXDOMAIN;
     }
 
-    byte_copy(key,2,DNS_T_CNAME);
-    cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+    /* nothing exists below a name that does not exist; RFC 8020 */
+    i = 2;
+    for (;;) {
+      i += 1 + (unsigned int) (unsigned char) key[i];
+      if (!key[i]) break;
+      byte_copy(key + i - 2,2,DNS_T_ANY);
+      if (cache_get(key + i - 2,dlen + 4 - i,&cachedlen,&ttl)) {
+        log_cachednxdomain(d);
+        goto NXDOMAIN;
+      }
+    }
+
+    if (!z->level && !typematch(DNS_T_CNAME,dtype)) {
+      cached = cachedanswer(z,T_CHAIN,&cachedlen,&ttl);
+      if (cached)
+        switch (cachedchain(z,cached,cachedlen,ttl)) {
+          case -1: goto DIE;
+          case 1: goto NEWNAME;
+        }
+    }
+
+    cached = cachedanswer(z,DNS_T_CNAME,&cachedlen,&ttl);
     if (cached) {
       if (typematch(DNS_T_CNAME,dtype)) {
         log_cachedanswer(d,DNS_T_CNAME);
@@ -261,18 +1192,18 @@ static int doit(struct query *z,int state)
 	return 1;
       }
       log_cachedcname(d,cached);
-      if (!dns_domain_copy(&cname,cached)) goto DIE;
+      if (dns_domain_length(cached) > sizeof cname) goto DIE;
+      byte_copy(cname,dns_domain_length(cached),cached);
       goto CNAME;
     }
 
     if (typematch(DNS_T_NS,dtype)) {
-      byte_copy(key,2,DNS_T_NS);
-      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      cached = cachedanswer(z,DNS_T_NS,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_NS);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
-	while (pos = dns_packet_getname(cached,cachedlen,pos,&t2)) {
+	while (pos = dns_packet_getnamebuf(cached,cachedlen,pos,t2)) {
 	  if (!response_rstart(d,DNS_T_NS,ttl)) goto DIE;
 	  if (!response_addname(t2)) goto DIE;
 	  response_rfinish(RESPONSE_ANSWER);
@@ -283,13 +1214,12 @@ static int doit(struct query *z,int state)
     }
 
     if (typematch(DNS_T_PTR,dtype)) {
-      byte_copy(key,2,DNS_T_PTR);
-      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      cached = cachedanswer(z,DNS_T_PTR,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_PTR);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
-	while (pos = dns_packet_getname(cached,cachedlen,pos,&t2)) {
+	while (pos = dns_packet_getnamebuf(cached,cachedlen,pos,t2)) {
 	  if (!response_rstart(d,DNS_T_PTR,ttl)) goto DIE;
 	  if (!response_addname(t2)) goto DIE;
 	  response_rfinish(RESPONSE_ANSWER);
@@ -300,14 +1230,13 @@ static int doit(struct query *z,int state)
     }
 
     if (typematch(DNS_T_MX,dtype)) {
-      byte_copy(key,2,DNS_T_MX);
-      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      cached = cachedanswer(z,DNS_T_MX,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,DNS_T_MX);
 	if (!rqa(z)) goto DIE;
 	pos = 0;
 	while (pos = dns_packet_copy(cached,cachedlen,pos,misc,2)) {
-	  pos = dns_packet_getname(cached,cachedlen,pos,&t2);
+	  pos = dns_packet_getnamebuf(cached,cachedlen,pos,t2);
 	  if (!pos) break;
 	  if (!response_rstart(d,DNS_T_MX,ttl)) goto DIE;
 	  if (!response_addbytes(misc,2)) goto DIE;
@@ -320,20 +1249,21 @@ static int doit(struct query *z,int state)
     }
 
     if (typematch(DNS_T_A,dtype)) {
-      byte_copy(key,2,DNS_T_A);
-      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      cached = cachedanswer(z,DNS_T_A,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	if (z->level) {
 	  log_cachedanswer(d,DNS_T_A);
 	  while (cachedlen >= 4) {
 	    for (k = 0;k < 64;k += 4)
-	      if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-		byte_copy(z->servers[z->level - 1] + k,4,cached);
+	      if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+		byte_copy(z->lv[z->level - 1]->servers + k,4,cached);
 		break;
 	      }
 	    cached += 4;
 	    cachedlen -= 4;
 	  }
+	  addressttl(z,ttl);
+	  if (addaaaa(z,d,&ttl)) addressttl(z,ttl);
 	  goto LOWERLEVEL;
 	}
 
@@ -351,14 +1281,20 @@ static int doit(struct query *z,int state)
       }
     }
 
+    /* a server with only IPv6 glue needs no A lookup */
+    if (z->level && addaaaa(z,d,&ttl)) {
+      log_cachedanswer(d,DNS_T_AAAA);
+      addressttl(z,ttl);
+      goto LOWERLEVEL;
+    }
+
     if (!typematch(DNS_T_ANY,dtype) && !typematch(DNS_T_AXFR,dtype) && !typematch(DNS_T_CNAME,dtype) && !typematch(DNS_T_NS,dtype) && !typematch(DNS_T_PTR,dtype) && !typematch(DNS_T_A,dtype) && !typematch(DNS_T_MX,dtype)) {
-      byte_copy(key,2,dtype);
-      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      cached = cachedanswer(z,dtype,&cachedlen,&ttl);
       if (cached && (cachedlen || byte_diff(dtype,2,DNS_T_ANY))) {
 	log_cachedanswer(d,dtype);
 	if (!rqa(z)) goto DIE;
 	while (cachedlen >= 2) {
-	  uint16_unpack_big(cached,&datalen);
+	  datalen = uint16_UNPACK_BIG(cached);
 	  cached += 2;
 	  cachedlen -= 2;
 	  if (datalen > cachedlen) goto DIE;
@@ -374,14 +1310,43 @@ static int doit(struct query *z,int state)
     }
   }
 
+  if (z->flagcache) return 2;
+
+  UNCACHED:
+  if (!levelready(z)) goto DIE;
+
+  if (flaglocal)
+    switch (local(z,d,dtype)) {
+      case -1: goto DIE;
+      case 1: goto HAVEPACKET;
+    }
+
   for (;;) {
-    if (roots(z->servers[z->level],d)) {
+    if (roots(z->lv[z->level]->servers,d)) {
       for (j = 0;j < QUERY_MAXNS;++j)
-        dns_domain_free(&z->ns[z->level][j]);
+        qfree(z,&z->lv[z->level]->ns[j]);
       z->control[z->level] = d;
+      z->lv[z->level]->serversttl = 0;
       break;
     }
 
+    if (!flagforwardonly && (dlen < 255)) {
+      byte_copy(key,2,T_SERVERS);
+      byte_copy(key + 2,dlen,d);
+      case_lowerb(key + 2,dlen);
+      cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
+      if (cached && (cachedlen >= 4) && (cachedlen <= 64)) {
+        z->control[z->level] = d;
+        byte_zero(z->lv[z->level]->servers,64);
+        byte_copy(z->lv[z->level]->servers,cachedlen & ~3,cached);
+        for (j = 0;j < QUERY_MAXNS;++j)
+          qfree(z,&z->lv[z->level]->ns[j]);
+        z->lv[z->level]->serversttl = 0;
+        log_cachedservers(d,z->lv[z->level]->servers);
+        break;
+      }
+    }
+
     if (!flagforwardonly && (z->level < 2))
       if (dlen < 255) {
         byte_copy(key,2,DNS_T_NS);
@@ -390,15 +1355,17 @@ static int doit(struct query *z,int state)
         cached = cache_get(key,dlen + 2,&cachedlen,&ttl);
         if (cached && cachedlen) {
 	  z->control[z->level] = d;
-          byte_zero(z->servers[z->level],64);
+          byte_zero(z->lv[z->level]->servers,64);
+          z->lv[z->level]->serversttl = ttl;
+          z->lv[z->level]->glueless = 0;
           for (j = 0;j < QUERY_MAXNS;++j)
-            dns_domain_free(&z->ns[z->level][j]);
+            qfree(z,&z->lv[z->level]->ns[j]);
           pos = 0;
           j = 0;
-          while (pos = dns_packet_getname(cached,cachedlen,pos,&t1)) {
+          while (pos = dns_packet_getnamebuf(cached,cachedlen,pos,t1)) {
 	    log_cachedns(d,t1);
             if (j < QUERY_MAXNS)
-              if (!dns_domain_copy(&z->ns[z->level][j++],t1)) goto DIE;
+              if (!qcopy(z,&z->lv[z->level]->ns[j++],t1)) goto DIE;
 	  }
           break;
         }
@@ -412,38 +1379,67 @@ static int doit(struct query *z,int state)
 
 
   HAVENS:
-  for (j = 0;j < QUERY_MAXNS;++j)
-    if (z->ns[z->level][j]) {
-      if (z->level + 1 < QUERY_MAXLEVEL) {
-        if (!dns_domain_copy(&z->name[z->level + 1],z->ns[z->level][j])) goto DIE;
-        dns_domain_free(&z->ns[z->level][j]);
-        ++z->level;
-        goto NEWNAME;
-      }
-      dns_domain_free(&z->ns[z->level][j]);
+  while ((j = nextns(z)) != -1) {
+    if (z->level + 1 < QUERY_MAXLEVEL) {
+      if (!qcopy(z,&z->name[z->level + 1],z->lv[z->level]->ns[j])) goto DIE;
+      qfree(z,&z->lv[z->level]->ns[j]);
+      ++z->level;
+      goto NEWNAME;
     }
+    qfree(z,&z->lv[z->level]->ns[j]);
+  }
 
   for (j = 0;j < 64;j += 4)
-    if (byte_diff(z->servers[z->level] + j,4,"\0\0\0\0"))
+    if (byte_diff(z->lv[z->level]->servers + j,4,"\0\0\0\0"))
       break;
   if (j == 64) goto SERVFAIL;
 
-  dns_sortip(z->servers[z->level],64);
+  if (nx_over(z->name[z->level])) {
+    log_nxlimit(z->name[z->level],nx_over(z->name[z->level]));
+    goto SERVFAIL;
+  }
+
+  cacheservers(z);
+  dns_sortip(z->lv[z->level]->servers,64);
+  dns_rtt_sort(z->lv[z->level]->servers,64);
+  badskip(z->lv[z->level]->servers,badzone(z));
   if (z->level) {
-    log_tx(z->name[z->level],DNS_T_A,z->control[z->level],z->servers[z->level],z->level);
-    if (dns_transmit_start(&z->dt,z->servers[z->level],flagforwardonly,z->name[z->level],DNS_T_A,z->localip) == -1) goto DIE;
+    log_tx(z->name[z->level],DNS_T_A,z->control[z->level],z->lv[z->level]->servers,z->level);
+    if (dns_transmit_start(&z->dt,z->lv[z->level]->servers,flagforwardonly,z->name[z->level],DNS_T_A,z->localip) == -1) goto DIE;
+    ++query_sent;
+    tracetx(z);
   }
   else {
-    log_tx(z->name[0],z->type,z->control[0],z->servers[0],0);
-    if (dns_transmit_start(&z->dt,z->servers[0],flagforwardonly,z->name[0],z->type,z->localip) == -1) goto DIE;
+    if (!z->peer) {
+      z->peer = 2;
+      whichserver = z->flagfrompeer ? 0 : peerowner(z->name[0]);
+      if (whichserver) {
+        z->peer = 1;
+        z->control[0] = z->name[0] + dns_domain_length(z->name[0]) - 1;
+        log_tx(z->name[0],z->type,z->control[0],whichserver,0);
+        if (dns_transmit_start(&z->dt,whichserver,1,z->name[0],z->type,z->localip) == -1) goto DIE;
+        taia_clock(&z->peerdeadline);
+        taia_uint(&t,peertimeout / 1000);
+        t.nano = (peertimeout % 1000) * 1000000;
+        taia_add(&z->peerdeadline,&z->peerdeadline,&t);
+        ++query_sent;
+        tracetx(z);
+        return 0;
+      }
+    }
+    log_tx(z->name[0],z->type,z->control[0],z->lv[0]->servers,0);
+    if (dns_transmit_start(&z->dt,z->lv[0]->servers,flagforwardonly,z->name[0],z->type,z->localip) == -1) goto DIE;
+    ++query_sent;
+    tracetx(z);
   }
   return 0;
 
 
   LOWERLEVEL:
-  dns_domain_free(&z->name[z->level]);
-  for (j = 0;j < QUERY_MAXNS;++j)
-    dns_domain_free(&z->ns[z->level][j]);
+  qfree(z,&z->name[z->level]);
+  if (z->lv[z->level])
+    for (j = 0;j < QUERY_MAXNS;++j)
+      qfree(z,&z->lv[z->level]->ns[j]);
   --z->level;
   goto HAVENS;
 
@@ -455,6 +1451,7 @@ static int doit(struct query *z,int state)
 
   whichserver = z->dt.servers + 4 * z->dt.curserver;
   control = z->control[z->level];
+  dns_domain_handle(&controldn,control);
   d = z->name[z->level];
   dtype = z->level ? DNS_T_A : z->type;
 
@@ -463,9 +1460,9 @@ static int doit(struct query *z,int state)
   pos += 4;
   posanswers = pos;
 
-  uint16_unpack_big(header + 6,&numanswers);
-  uint16_unpack_big(header + 8,&numauthority);
-  uint16_unpack_big(header + 10,&numglue);
+  numanswers = uint16_UNPACK_BIG(header + 6);
+  numauthority = uint16_UNPACK_BIG(header + 8);
+  numglue = uint16_UNPACK_BIG(header + 10);
 
   rcode = header[3] & 15;
   if (rcode && (rcode != 3)) goto DIE; /* impossible; see irrelevant() */
@@ -477,30 +1474,31 @@ static int doit(struct query *z,int state)
   soattl = 0;
   cnamettl = 0;
   for (j = 0;j < numanswers;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+    pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+    pos = dns_packet_rrheader(buf,len,pos,header,&datalen); if (!pos) goto DIE;
 
     if (dns_domain_equal(t1,d))
       if (byte_equal(header + 2,2,DNS_C_IN)) { /* should always be true */
         if (typematch(header,dtype))
           flagout = 1;
         else if (typematch(header,DNS_T_CNAME)) {
-          if (!dns_packet_getname(buf,len,pos,&cname)) goto DIE;
+          if (!dns_packet_getnamebuf(buf,len,pos,cname)) goto DIE;
           flagcname = 1;
 	  cnamettl = ttlget(header + 4);
         }
       }
   
-    uint16_unpack_big(header + 8,&datalen);
     pos += datalen;
   }
   posauthority = pos;
 
   for (j = 0;j < numauthority;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+    pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+    pos = dns_packet_rrheader(buf,len,pos,header,&datalen); if (!pos) goto DIE;
 
     if (typematch(header,DNS_T_SOA)) {
+      if (!flagsoa)
+        if (!dns_domain_copy(&soazone,t1)) goto DIE;
       flagsoa = 1;
       soattl = ttlget(header + 4);
       if (soattl > 3600) soattl = 3600;
@@ -510,74 +1508,80 @@ static int doit(struct query *z,int state)
       if (!dns_domain_copy(&referral,t1)) goto DIE;
     }
 
-    uint16_unpack_big(header + 8,&datalen);
     pos += datalen;
   }
   posglue = pos;
 
 
-  if (!flagcname && !rcode && !flagout && flagreferral && !flagsoa)
-    if (dns_domain_equal(referral,control) || !dns_domain_suffix(referral,control)) {
+  if (!flagcname && !rcode && !flagout && flagreferral && !flagsoa) {
+    dns_domain_handle(&referraldn,referral);
+    if (dns_domain_same(&referraldn,&controldn) || !dns_domain_under(&referraldn,&controldn)) {
       log_lame(whichserver,control,referral);
+      badmark(whichserver,badzone(z));
       byte_zero(whichserver,4);
       goto HAVENS;
     }
+  }
 
 
   if (records) { alloc_free(records); records = 0; }
 
   k = numanswers + numauthority + numglue;
-  records = (unsigned int *) alloc(k * sizeof(unsigned int));
+  records = (struct rr *) alloc(k * sizeof(struct rr));
   if (!records) goto DIE;
+  rrnames.len = 0;
 
   pos = posanswers;
   for (j = 0;j < k;++j) {
-    records[j] = pos;
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-    uint16_unpack_big(header + 8,&datalen);
+    records[j].pos = pos;
+    pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+    pos = dns_packet_rrheader(buf,len,pos,records[j].header,&datalen); if (!pos) goto DIE;
+    records[j].data = pos;
+    records[j].name = rrnames.len;
+    records[j].namelen = dns_domain_length(t1);
+    records[j].hash = rrhash(t1,records[j].namelen);
+    if (!stralloc_catb(&rrnames,t1,records[j].namelen)) goto DIE;
     pos += datalen;
   }
 
   i = j = k;
   while (j > 1) {
-    if (i > 1) { --i; pos = records[i - 1]; }
-    else { pos = records[j - 1]; records[j - 1] = records[i - 1]; --j; }
+    if (i > 1) { --i; rr = records[i - 1]; }
+    else { rr = records[j - 1]; records[j - 1] = records[i - 1]; --j; }
 
     q = i;
     while ((p = q * 2) < j) {
-      if (!smaller(buf,len,records[p],records[p - 1])) ++p;
+      if (!smaller(records + p,records + p - 1)) ++p;
       records[q - 1] = records[p - 1]; q = p;
     }
     if (p == j) {
       records[q - 1] = records[p - 1]; q = p;
     }
-    while ((q > i) && smaller(buf,len,records[(p = q/2) - 1],pos)) {
+    while ((q > i) && smaller(records + (p = q/2) - 1,&rr)) {
       records[q - 1] = records[p - 1]; q = p;
     }
-    records[q - 1] = pos;
+    records[q - 1] = rr;
   }
 
   i = 0;
   while (i < k) {
     char type[2];
 
-    pos = dns_packet_getname(buf,len,records[i],&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-    ttl = ttlget(header + 4);
+    byte_copy(t1,records[i].namelen,rrnames.s + records[i].name);
+    owner.dn = t1;
+    owner.len = records[i].namelen;
+    ttl = ttlget(records[i].header + 4);
 
-    byte_copy(type,2,header);
-    if (byte_diff(header + 2,2,DNS_C_IN)) { ++i; continue; }
+    byte_copy(type,2,records[i].header);
+    if (byte_diff(records[i].header + 2,2,DNS_C_IN)) { ++i; continue; }
 
     for (j = i + 1;j < k;++j) {
-      pos = dns_packet_getname(buf,len,records[j],&t2); if (!pos) goto DIE;
-      pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-      if (!dns_domain_equal(t1,t2)) break;
-      if (byte_diff(header,2,type)) break;
-      if (byte_diff(header + 2,2,DNS_C_IN)) break;
+      if (!sameowner(records + i,records + j)) break;
+      if (byte_diff(records[j].header,2,type)) break;
+      if (byte_diff(records[j].header + 2,2,DNS_C_IN)) break;
     }
 
-    if (!dns_domain_suffix(t1,control)) { i = j; continue; }
+    if (!dns_domain_under(&owner,&controldn)) { i = j; continue; }
     if (!roots_same(t1,control)) { i = j; continue; }
 
     if (byte_equal(type,2,DNS_T_ANY))
@@ -586,28 +1590,25 @@ static int doit(struct query *z,int state)
       ;
     else if (byte_equal(type,2,DNS_T_SOA)) {
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos,&t3); if (!pos) goto DIE;
+        pos = dns_packet_getnamebuf(buf,len,records[i].data,t2); if (!pos) goto DIE;
+        pos = dns_packet_getnamebuf(buf,len,pos,t3); if (!pos) goto DIE;
         pos = dns_packet_copy(buf,len,pos,misc,20); if (!pos) goto DIE;
-        if (records[i] < posauthority)
+        if (records[i].pos < posauthority)
           log_rrsoa(whichserver,t1,t2,t3,misc,ttl);
         ++i;
       }
     }
     else if (byte_equal(type,2,DNS_T_CNAME)) {
-      pos = dns_packet_skipname(buf,len,records[j - 1]); if (!pos) goto DIE;
-      pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+      pos = dns_packet_getnamebuf(buf,len,records[j - 1].data,t2); if (!pos) goto DIE;
       log_rrcname(whichserver,t1,t2,ttl);
       cachegeneric(DNS_T_CNAME,t1,t2,dns_domain_length(t2),ttl);
     }
     else if (byte_equal(type,2,DNS_T_PTR)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+        pos = dns_packet_getnamebuf(buf,len,records[i].data,t2); if (!pos) goto DIE;
         log_rrptr(whichserver,t1,t2,ttl);
-        save_data(t2,dns_domain_length(t2));
+        save_name(t2);
         ++i;
       }
       save_finish(DNS_T_PTR,t1,ttl);
@@ -615,10 +1616,9 @@ static int doit(struct query *z,int state)
     else if (byte_equal(type,2,DNS_T_NS)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos + 10,&t2); if (!pos) goto DIE;
+        pos = dns_packet_getnamebuf(buf,len,records[i].data,t2); if (!pos) goto DIE;
         log_rrns(whichserver,t1,t2,ttl);
-        save_data(t2,dns_domain_length(t2));
+        save_name(t2);
         ++i;
       }
       save_finish(DNS_T_NS,t1,ttl);
@@ -626,12 +1626,11 @@ static int doit(struct query *z,int state)
     else if (byte_equal(type,2,DNS_T_MX)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos + 10,misc,2); if (!pos) goto DIE;
-        pos = dns_packet_getname(buf,len,pos,&t2); if (!pos) goto DIE;
+        pos = dns_packet_copy(buf,len,records[i].data,misc,2); if (!pos) goto DIE;
+        pos = dns_packet_getnamebuf(buf,len,pos,t2); if (!pos) goto DIE;
         log_rrmx(whichserver,t1,t2,misc,ttl);
         save_data(misc,2);
-        save_data(t2,dns_domain_length(t2));
+        save_name(t2);
         ++i;
       }
       save_finish(DNS_T_MX,t1,ttl);
@@ -639,10 +1638,8 @@ static int doit(struct query *z,int state)
     else if (byte_equal(type,2,DNS_T_A)) {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        if (byte_equal(header + 8,2,"\0\4")) {
-          pos = dns_packet_copy(buf,len,pos,header,4); if (!pos) goto DIE;
+        if (byte_equal(records[i].header + 8,2,"\0\4")) {
+          pos = dns_packet_copy(buf,len,records[i].data,header,4); if (!pos) goto DIE;
           save_data(header,4);
           log_rr(whichserver,t1,DNS_T_A,header,4,ttl);
         }
@@ -653,11 +1650,10 @@ static int doit(struct query *z,int state)
     else {
       save_start();
       while (i < j) {
-        pos = dns_packet_skipname(buf,len,records[i]); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        uint16_unpack_big(header + 8,&datalen);
+        pos = records[i].data;
+        datalen = uint16_UNPACK_BIG(records[i].header + 8);
         if (datalen > len - pos) goto DIE;
-        save_data(header + 8,2);
+        save_data(records[i].header + 8,2);
         save_data(buf + pos,datalen);
         log_rr(whichserver,t1,type,buf + pos,datalen,ttl);
         ++i;
@@ -675,22 +1671,25 @@ static int doit(struct query *z,int state)
     ttl = cnamettl;
     CNAME:
     if (!z->level) {
-      if (z->alias[QUERY_MAXALIAS - 1]) goto DIE;
+      if (!aliasready(z)) goto DIE;
+      if (z->alias->name[QUERY_MAXALIAS - 1]) goto DIE;
       for (j = QUERY_MAXALIAS - 1;j > 0;--j)
-        z->alias[j] = z->alias[j - 1];
+        z->alias->name[j] = z->alias->name[j - 1];
       for (j = QUERY_MAXALIAS - 1;j > 0;--j)
-        z->aliasttl[j] = z->aliasttl[j - 1];
-      z->alias[0] = z->name[0];
-      z->aliasttl[0] = ttl;
+        z->alias->ttl[j] = z->alias->ttl[j - 1];
+      z->alias->name[0] = z->name[0];
+      z->alias->ttl[0] = ttl;
       z->name[0] = 0;
     }
-    if (!dns_domain_copy(&z->name[z->level],cname)) goto DIE;
+    if (!qcopy(z,&z->name[z->level],cname)) goto DIE;
+    if (!z->level) cachechain(z);
     goto NEWNAME;
   }
 
   if (rcode == 3) {
     log_nxdomain(whichserver,d,soattl);
     cachegeneric(DNS_T_ANY,d,"",0,soattl);
+    nx_record(flagsoa ? soazone : control);
 
     NXDOMAIN:
     if (z->level) goto LOWERLEVEL;
@@ -716,50 +1715,56 @@ static int doit(struct query *z,int state)
     if (z->level) {
       pos = posanswers;
       for (j = 0;j < numanswers;++j) {
-        pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-        pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-        uint16_unpack_big(header + 8,&datalen);
+        pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+        pos = dns_packet_rrheader(buf,len,pos,header,&datalen); if (!pos) goto DIE;
         if (dns_domain_equal(t1,d))
           if (typematch(header,DNS_T_A))
             if (byte_equal(header + 2,2,DNS_C_IN)) /* should always be true */
-              if (datalen == 4)
+              if (datalen == 4) {
+                addressttl(z,ttlget(header + 4));
                 for (k = 0;k < 64;k += 4)
-                  if (byte_equal(z->servers[z->level - 1] + k,4,"\0\0\0\0")) {
-                    if (!dns_packet_copy(buf,len,pos,z->servers[z->level - 1] + k,4)) goto DIE;
+                  if (byte_equal(z->lv[z->level - 1]->servers + k,4,"\0\0\0\0")) {
+                    if (!dns_packet_copy(buf,len,pos,z->lv[z->level - 1]->servers + k,4)) goto DIE;
                     break;
                   }
+              }
         pos += datalen;
       }
+      if (addaaaa(z,d,&ttl)) addressttl(z,ttl);
       goto LOWERLEVEL;
     }
 
     if (!rqa(z)) goto DIE;
 
+    byte_zero(anytype,2);
     pos = posanswers;
     for (j = 0;j < numanswers;++j) {
-      pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-      pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
+      pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+      pos = dns_packet_rrheader(buf,len,pos,header,&datalen); if (!pos) goto DIE;
       ttl = ttlget(header + 4);
-      uint16_unpack_big(header + 8,&datalen);
       if (dns_domain_equal(t1,d))
         if (byte_equal(header + 2,2,DNS_C_IN)) /* should always be true */
           if (typematch(header,dtype)) {
+            if (flagminimalany && byte_equal(dtype,2,DNS_T_ANY)) {
+              if (byte_equal(anytype,2,"\0\0")) byte_copy(anytype,2,header);
+              if (byte_diff(anytype,2,header)) { pos += datalen; continue; }
+            }
             if (!response_rstart(t1,header,ttl)) goto DIE;
   
             if (typematch(header,DNS_T_NS) || typematch(header,DNS_T_CNAME) || typematch(header,DNS_T_PTR)) {
-              if (!dns_packet_getname(buf,len,pos,&t2)) goto DIE;
+              if (!dns_packet_getnamebuf(buf,len,pos,t2)) goto DIE;
               if (!response_addname(t2)) goto DIE;
             }
             else if (typematch(header,DNS_T_MX)) {
               pos2 = dns_packet_copy(buf,len,pos,misc,2); if (!pos2) goto DIE;
               if (!response_addbytes(misc,2)) goto DIE;
-              if (!dns_packet_getname(buf,len,pos2,&t2)) goto DIE;
+              if (!dns_packet_getnamebuf(buf,len,pos2,t2)) goto DIE;
               if (!response_addname(t2)) goto DIE;
             }
             else if (typematch(header,DNS_T_SOA)) {
-              pos2 = dns_packet_getname(buf,len,pos,&t2); if (!pos2) goto DIE;
+              pos2 = dns_packet_getnamebuf(buf,len,pos,t2); if (!pos2) goto DIE;
               if (!response_addname(t2)) goto DIE;
-              pos2 = dns_packet_getname(buf,len,pos2,&t3); if (!pos2) goto DIE;
+              pos2 = dns_packet_getnamebuf(buf,len,pos2,t3); if (!pos2) goto DIE;
               if (!response_addname(t3)) goto DIE;
               pos2 = dns_packet_copy(buf,len,pos2,misc,20); if (!pos2) goto DIE;
               if (!response_addbytes(misc,20)) goto DIE;
@@ -780,26 +1785,33 @@ static int doit(struct query *z,int state)
   }
 
 
-  if (!dns_domain_suffix(d,referral)) goto DIE;
-  control = d + dns_domain_suffixpos(d,referral);
+  dns_domain_handle(&owner,d);
+  dns_domain_handle(&referraldn,referral);
+  if (!dns_domain_under(&owner,&referraldn)) goto DIE;
+  control = d + owner.len - referraldn.len;
   z->control[z->level] = control;
-  byte_zero(z->servers[z->level],64);
+  byte_zero(z->lv[z->level]->servers,64);
+  z->lv[z->level]->serversttl = 604800;
   for (j = 0;j < QUERY_MAXNS;++j)
-    dns_domain_free(&z->ns[z->level][j]);
+    qfree(z,&z->lv[z->level]->ns[j]);
   k = 0;
 
   pos = posauthority;
   for (j = 0;j < numauthority;++j) {
-    pos = dns_packet_getname(buf,len,pos,&t1); if (!pos) goto DIE;
-    pos = dns_packet_copy(buf,len,pos,header,10); if (!pos) goto DIE;
-    uint16_unpack_big(header + 8,&datalen);
+    pos = dns_packet_getnamebuf(buf,len,pos,t1); if (!pos) goto DIE;
+    pos = dns_packet_rrheader(buf,len,pos,header,&datalen); if (!pos) goto DIE;
     if (dns_domain_equal(referral,t1)) /* should always be true */
       if (typematch(header,DNS_T_NS)) /* should always be true */
         if (byte_equal(header + 2,2,DNS_C_IN)) /* should always be true */
-          if (k < QUERY_MAXNS)
-            if (!dns_packet_getname(buf,len,pos,&z->ns[z->level][k++])) goto DIE;
+          if (k < QUERY_MAXNS) {
+            if (!dns_packet_getnamebuf(buf,len,pos,t2)) goto DIE;
+            if (!qcopy(z,&z->lv[z->level]->ns[k++],t2)) goto DIE;
+            ttl = ttlget(header + 4);
+            if (ttl < z->lv[z->level]->serversttl) z->lv[z->level]->serversttl = ttl;
+          }
     pos += datalen;
   }
+  gluelessstart(z->lv[z->level]);
 
   goto HAVENS;
 
@@ -818,34 +1830,543 @@ static int doit(struct query *z,int state)
   return -1;
 }
 
+static int step(struct query *z,int state)
+{
+  int r;
+  PERFCOUNT_BEGIN(PERF_QUERY)
+  PROFILE_ENTER(PROFILE_RESOLVE)
+
+  r = doit(z,state);
+  PROFILE_LEAVE
+  PERFCOUNT_END(PERF_QUERY)
+  return r;
+}
+
+/* identical queries in flight share one resolution */
+
+static struct query *inflight = 0;
+
+static void inflight_add(struct query *z)
+{
+  z->previnflight = 0;
+  z->nextinflight = inflight;
+  if (inflight) inflight->previnflight = z;
+  inflight = z;
+  z->flaginflight = 1;
+}
+
+static void inflight_del(struct query *z)
+{
+  if (!z->flaginflight) return;
+  if (z->previnflight)
+    z->previnflight->nextinflight = z->nextinflight;
+  else
+    inflight = z->nextinflight;
+  if (z->nextinflight)
+    z->nextinflight->previnflight = z->previnflight;
+  z->flaginflight = 0;
+}
+
+static void answerfree(struct query *z)
+{
+  if (!z->answer) return;
+  alloc_free(z->answer);
+  z->answer = 0;
+}
+
+static void unfollow(struct query *z)
+{
+  struct query **p;
+
+  if (!z->leader) return;
+  for (p = &z->leader->follower;*p;p = &(*p)->nextfollower)
+    if (*p == z) {
+      *p = z->nextfollower;
+      break;
+    }
+  z->leader = 0;
+}
+
+/*
+z->timer is set while query_get() has something to do without I/O:
+at once for a follower with a result, otherwise at the transmission's
+deadline. It is clear while z waits for a leader or is done.
+*/
+
+static void wake(struct query *z)
+{
+  struct taia now;
+
+  taia_uint(&now,0);
+  timer_set(&z->timer,&now);
+}
+
+static int schedule(struct query *z,int r)
+{
+  struct taia deadline;
+
+  if (r || z->leader) {
+    timer_clear(&z->timer);
+    return r;
+  }
+  if (z->result) {
+    wake(z);
+    return r;
+  }
+  deadline = z->dt.deadline;
+  dns_transmit_deadline(&z->dt,&deadline);
+  if ((z->peer == 1) && taia_less(&z->peerdeadline,&deadline))
+    deadline = z->peerdeadline;
+  timer_set(&z->timer,&deadline);
+  return r;
+}
+
+static void finish(struct query *z,int r)
+{
+  struct query *y;
+
+  inflight_del(z);
+  while (z->follower) {
+    y = z->follower;
+    z->follower = y->nextfollower;
+    y->leader = 0;
+    y->result = r;
+    y->resulterrno = errno;
+    wake(y);
+    if (r == 1) {
+      answerfree(y);
+      y->answer = alloc(response_len);
+      if (!y->answer) { y->result = -1; y->resulterrno = error_nomem; continue; }
+      byte_copy(y->answer,response_len,response);
+      y->answerlen = response_len;
+      y->answertc = response_tcpos();
+    }
+  }
+}
+
+static void abandon(struct query *z)
+{
+  struct query *y;
+
+  unfollow(z);
+  inflight_del(z);
+  while (z->follower) {
+    y = z->follower;
+    z->follower = y->nextfollower;
+    y->leader = 0;
+    y->result = 2;
+    wake(y);
+  }
+  answerfree(z);
+  z->result = 0;
+  timer_clear(&z->timer);
+}
+
+static int start(struct query *z,int state)
+{
+  struct query *y;
+  unsigned int len;
+  int r;
+
+  len = dns_domain_length(z->qname);
+  for (y = inflight;y;y = y->nextinflight) {
+    if (y->flagrefresh) continue; /* cache may still have the answer */
+    if (byte_diff(y->type,2,z->type)) continue;
+    if (byte_diff(y->class,2,z->class)) continue;
+    if (dns_domain_length(y->qname) != len) continue;
+    if (byte_diff(y->qname,len,z->qname)) continue;
+    z->result = 0;
+    z->leader = y;
+    z->nextfollower = y->follower;
+    y->follower = z;
+    log_coalesce(z->qname,z->type);
+    trace(z,'w',0,0);
+    return 0;
+  }
+
+  r = step(z,state);
+  if (r == 0) inflight_add(z);
+  return r;
+}
+
 int query_start(struct query *z,char *dn,char type[2],char class[2],char localip[4])
 {
   if (byte_equal(type,2,DNS_T_AXFR)) { errno = error_perm; return -1; }
 
+  abandon(z);
   cleanup(z);
   z->level = 0;
   z->loop = 0;
+  z->flagdue = 0;
+  z->flagrefresh = 0;
+  z->flagcache = 0;
+  z->peer = 0;
 
-  if (!dns_domain_copy(&z->name[0],dn)) return -1;
+  if (!qcopy(z,&z->name[0],dn)) return -1;
+  if (!dns_domain_copy(&z->qname,dn)) return -1;
   byte_copy(z->type,2,type);
   byte_copy(z->class,2,class);
   byte_copy(z->localip,4,localip);
 
-  return doit(z,0);
+  trace(z,'s',0,0);
+  return schedule(z,start(z,0));
 }
 
-int query_get(struct query *z,iopause_fd *x,struct taia *stamp)
+int query_refresh(struct query *z,char *dn,char type[2],char class[2],char localip[4])
 {
+  abandon(z);
+  cleanup(z);
+  z->level = 0;
+  z->loop = 0;
+  z->flagdue = 0;
+  z->flagrefresh = 1;
+  z->flagcache = 0;
+  z->peer = 0;
+
+  if (!qcopy(z,&z->name[0],dn)) return -1;
+  if (!dns_domain_copy(&z->qname,dn)) return -1;
+  byte_copy(z->type,2,type);
+  byte_copy(z->class,2,class);
+  byte_copy(z->localip,4,localip);
+
+  log_prefetch(dn,type);
+  trace(z,'s',0,0);
+  return schedule(z,start(z,0));
+}
+
+/*
+1 if the answer to dn is in response, from the cache alone. Otherwise
+z->flagcache is 2 if the walk stopped where dn needs the network, and
+z then holds what query_resume() needs to go on from there.
+*/
+static int cacheonly(struct query *z,const char *dn,const char type[2],const char class[2],const char localip[4])
+{
+  int r;
+
+  abandon(z);
+  cleanup(z);
+  z->level = 0;
+  z->loop = 0;
+  z->flagdue = 0;
+  z->flagrefresh = 0;
+  z->flagcache = 1;
+
+  if (!qcopy(z,&z->name[0],dn)) return 0;
+  byte_copy(z->type,2,type);
+  byte_copy(z->class,2,class);
+  byte_copy(z->localip,4,localip);
+  trace(z,'s',0,0);
+
+  r = step(z,0);
+  if (r == 2) z->flagcache = 2;
+  return r == 1;
+}
+
+/*
+Packet cache. With query_packets(n), query_cached() keeps up to n of
+the responses it builds, keyed by the question, with the offset and
+TTL of each record, and answers a repeat of the question with a copy,
+the question name in the client's case and each TTL less the seconds
+since. An entry is used until its shortest TTL runs out, and for at
+most PACKETAGE seconds, after which the question goes through the
+cache again; so prefetch still sees hot names, and new data in the
+cache shows up within PACKETAGE seconds. Responses without records,
+and those with more than PACKETTTLS, are not kept.
+*/
+
+#define PACKETAGE 5
+#define PACKETTTLS 32
+
+struct packet {
+  char *buf; /* 0, or the key followed by the response */
+  unsigned int keylen;
+  unsigned int len;
+  unsigned int tcpos;
+  uint32 stored;
+  uint32 expire;
+  unsigned int numttls;
+  unsigned int ttlpos[PACKETTTLS];
+  uint32 ttl[PACKETTTLS];
+} ;
+
+static struct packet *packet = 0;
+static unsigned int numpackets = 0; /* power of 2 */
+
+void query_packets(unsigned long n)
+{
+  numpackets = 1;
+  while ((numpackets < n) && (numpackets < 1048576)) numpackets <<= 1;
+  packet = (struct packet *) alloc(numpackets * sizeof(struct packet));
+  if (!packet) { numpackets = 0; return; }
+  byte_zero((char *) packet,numpackets * sizeof(struct packet));
+}
+
+static unsigned int packetkey(char *key,const char *dn,const char type[2],const char class[2])
+{
+  unsigned int len;
+
+  len = dns_domain_length(dn);
+  byte_copy(key,len,dn);
+  case_lowerb(key,len);
+  byte_copy(key + len,2,type);
+  byte_copy(key + len + 2,2,class);
+  return len + 4;
+}
+
+static struct packet *packetslot(const char *key,unsigned int keylen)
+{
+  uint32 h = 5381;
+  unsigned int i;
+
+  for (i = 0;i < keylen;++i)
+    h = ((h << 5) + h) ^ (unsigned char) key[i];
+  return packet + (h & (numpackets - 1));
+}
+
+static int packetget(const char *dn,const char type[2],const char class[2])
+{
+  char key[259];
+  unsigned int keylen;
+  struct packet *p;
+  uint32 now;
+  uint32 age;
+  unsigned int i;
+
+  keylen = packetkey(key,dn,type,class);
+  p = packetslot(key,keylen);
+  if (!p->buf || (p->keylen != keylen) || byte_diff(p->buf,keylen,key)) return 0;
+  now = thissecond();
+  if (now - p->stored >= p->expire - p->stored) return 0;
+
+  response_restore(p->buf + keylen,p->len,p->tcpos);
+  byte_copy(response + 12,keylen - 4,dn);
+  age = now - p->stored;
+  for (i = 0;i < p->numttls;++i)
+    uint32_pack_big(response + p->ttlpos[i],p->ttl[i] - age);
+  ++cache_hits;
+  return 1;
+}
+
+static void packetput(const char *dn,const char type[2],const char class[2])
+{
+  char key[259];
+  unsigned int keylen;
+  struct packet *p;
+  struct packet new;
+  unsigned int i;
+  uint32 ttl;
+
+  if (!response_ttls(new.ttlpos,PACKETTTLS,&new.numttls)) return;
+  if (!new.numttls) return;
+  ttl = PACKETAGE;
+  for (i = 0;i < new.numttls;++i) {
+    uint32_unpack_big(response + new.ttlpos[i],&new.ttl[i]);
+    if (new.ttl[i] < ttl) ttl = new.ttl[i];
+  }
+  if (!ttl) return;
+
+  keylen = packetkey(key,dn,type,class);
+  new.buf = alloc(keylen + response_len);
+  if (!new.buf) return;
+  byte_copy(new.buf,keylen,key);
+  byte_copy(new.buf + keylen,response_len,response);
+  new.keylen = keylen;
+  new.len = response_len;
+  new.tcpos = response_tcpos();
+  new.stored = thissecond();
+  new.expire = new.stored + ttl;
+
+  p = packetslot(key,keylen);
+  if (p->buf) alloc_free(p->buf);
+  *p = new;
+}
+
+/*
+Answers from the cache, before a query gets a slot: 1 if the answer
+is in response, 0 if the question needs resolving after all. z is
+scratch; afterwards it is only good for flagdue and for f_start()'s
+refresh, or, on a miss, for query_resume(). A miss that query_resume()
+cannot take up is not counted, since query_start() makes its cache
+lookups again.
+*/
+int query_cached(struct query *z,char *dn,char type[2],char class[2],char localip[4])
+{
+  uint64 hits;
+  uint64 misses;
+  uint64 expired;
+
+  if (byte_equal(type,2,DNS_T_AXFR)) return 0;
+
+  if (numpackets)
+    if (packetget(dn,type,class)) {
+      z->flagdue = 0;
+      return 1;
+    }
+
+  hits = cache_hits;
+  misses = cache_misses;
+  expired = cache_expired;
+  if (cacheonly(z,dn,type,class,localip)) {
+    if (z->flagdue)
+      if (!dns_domain_copy(&z->qname,dn)) z->flagdue = 0;
+    if (numpackets && !z->flagdue)
+      packetput(dn,type,class);
+    return 1;
+  }
+  if (z->flagcache == 2) return 0;
+  cache_hits = hits;
+  cache_misses = misses;
+  cache_expired = expired;
+  return 0;
+}
+
+/*
+Starts z on the question that query_cached() could not answer from
+the cache, going on from where its walk in hit stopped: the name it
+got to, through CNAMEs, and the aliases on the way. So a miss reads
+the cache, and logs what it found there, once. Without such a walk
+it is query_start().
+*/
+int query_resume(struct query *z,struct query *hit,char *dn,char type[2],char class[2],char localip[4])
+{
+  int j;
+
+  if (hit->flagcache != 2) return query_start(z,dn,type,class,localip);
+
+  abandon(z);
+  cleanup(z);
+  z->level = 0;
+  z->loop = hit->loop;
+  z->flagdue = hit->flagdue;
+  z->flagrefresh = 0;
+  z->flagcache = 0;
+  z->peer = 0;
+
+  if (!qcopy(z,&z->name[0],hit->name[0])) return -1;
+  if (hit->alias) {
+    if (!aliasready(z)) return -1;
+    for (j = 0;j < QUERY_MAXALIAS;++j) {
+      if (hit->alias->name[j])
+        if (!qcopy(z,&z->alias->name[j],hit->alias->name[j])) return -1;
+      z->alias->ttl[j] = hit->alias->ttl[j];
+    }
+  }
+  if (!dns_domain_copy(&z->qname,dn)) return -1;
+  byte_copy(z->type,2,type);
+  byte_copy(z->class,2,class);
+  byte_copy(z->localip,4,localip);
+
+  byte_copy((char *) z->trace,hit->numtrace * sizeof(struct query_event),(char *) hit->trace);
+  z->numtrace = hit->numtrace;
+  z->tracelost = hit->tracelost;
+  z->tracetcp = 0;
+  z->tracestart = hit->tracestart;
+  return schedule(z,start(z,2));
+}
+
+/*
+Builds an answer to z's question in response from the cache alone,
+using entries up to cache_stalemax() seconds past expiry, for a client
+that has waited long enough or would otherwise get SERVFAIL. z itself
+is left alone, to go on resolving and refresh the cache. 1 if there
+is an answer.
+*/
+static struct query stale;
+
+int query_stale(struct query *z)
+{
+  int r;
+
+  cache_stale = 1;
+  r = cacheonly(&stale,z->qname,z->type,z->class,z->localip);
+  cache_stale = 0;
+  return r;
+}
+
+/* the peer let us down; ask the authorities */
+static int unpeer(struct query *z)
+{
+  int r;
+
+  trace(z,'p',z->dt.servers + 4 * z->dt.curserver,0);
+  dns_transmit_free(&z->dt);
+  z->peer = 2;
+  r = step(z,0);
+  if (r) finish(z,r);
+  return r;
+}
+
+static int get(struct query *z,iopause_fd *x,struct taia *stamp)
+{
+  int r;
+
+  if (z->leader) return 0;
+  switch(z->result) {
+    case 1:
+      trace(z,'l',0,0);
+      z->result = 0;
+      response_restore(z->answer,z->answerlen,z->answertc);
+      answerfree(z);
+      cleanup(z);
+      return 1;
+    case -1:
+      trace(z,'l',0,0);
+      z->result = 0;
+      cleanup(z);
+      errno = z->resulterrno;
+      return -1;
+    case 2:
+      z->result = 0;
+      return start(z,0);
+  }
+
+  if ((z->peer == 1) && !taia_less(stamp,&z->peerdeadline))
+    return unpeer(z);
   switch(dns_transmit_get(&z->dt,x,stamp)) {
     case 1:
-      return doit(z,1);
+      metrics_since(METRIC_RTT,&z->dt.sent);
+      trace(z,'r',z->dt.servers + 4 * z->dt.curserver,z->dt.udploop);
+      if (z->peer != 1) badnote(z);
+      z->peer = 2;
+      r = step(z,1);
+      if (r) finish(z,r);
+      return r;
     case -1:
-      return doit(z,-1);
+      if (z->peer == 1) return unpeer(z);
+      trace(z,'f',0,0);
+      badnote(z);
+      r = step(z,-1);
+      if (r) finish(z,r);
+      return r;
+  }
+  if ((z->dt.tcpstate > 0) && (z->dt.tcpstate < 6) && !z->tracetcp) {
+    z->tracetcp = 1;
+    trace(z,'T',z->dt.servers + 4 * z->dt.curserver,0);
   }
   return 0;
 }
 
-void query_io(struct query *z,iopause_fd *x,struct taia *deadline)
+int query_get(struct query *z,iopause_fd *x,struct taia *stamp)
+{
+  return schedule(z,get(z,x,stamp));
+}
+
+/* deadlines are in z->timer */
+void query_io(struct query *z,iopause_fd *x)
 {
-  dns_transmit_io(&z->dt,x,deadline);
+  struct taia deadline;
+
+  if (z->leader || z->result) {
+    x->fd = -1;
+    x->events = 0;
+    return;
+  }
+  deadline = z->dt.deadline;
+  dns_transmit_io(&z->dt,x,&deadline);
+}
+
+void query_forget(struct query *z)
+{
+  abandon(z);
+  cleanup(z);
 }
@@ -3,30 +3,100 @@
 
 #include "dns.h"
 #include "uint32.h"
+#include "uint64.h"
+#include "timer.h"
 
 #define QUERY_MAXLEVEL 5
 #define QUERY_MAXALIAS 16
 #define QUERY_MAXNS 16
+#define QUERY_MAXTRACE 32
+#define QUERY_ARENA 2048
+
+/* what: see query_trace() in query.c */
+struct query_event {
+  char what;
+  unsigned char level;
+  char ip[4];
+  unsigned int n;
+  uint32 usec; /* since the query started */
+} ;
+
+/* the servers for name[level] */
+struct query_level {
+  char *ns[QUERY_MAXNS];
+  char servers[64];
+  uint32 serversttl; /* 0: servers not to be cached */
+  int glueless; /* some of ns queued for query_nextglueless() */
+} ;
+
+/* the CNAMEs followed to name[0], latest first */
+struct query_alias {
+  char *name[QUERY_MAXALIAS];
+  uint32 ttl[QUERY_MAXALIAS];
+} ;
 
 struct query {
   unsigned int loop;
   unsigned int level;
   char *name[QUERY_MAXLEVEL];
   char *control[QUERY_MAXLEVEL]; /* pointing inside name */
-  char *ns[QUERY_MAXLEVEL][QUERY_MAXNS];
-  char servers[QUERY_MAXLEVEL][64];
-  char *alias[QUERY_MAXALIAS];
-  uint32 aliasttl[QUERY_MAXALIAS];
+  struct query_level *lv[QUERY_MAXLEVEL]; /* 0 until the level needs servers */
+  struct query_alias *alias; /* 0 until the first CNAME */
   char localip[4];
   char type[2];
   char class[2];
   struct dns_transmit dt;
+  char *qname; /* name[0] as given to query_start */
+  struct query *leader; /* 0, or in-flight query we are waiting for */
+  struct query *follower; /* first query waiting for us */
+  struct query *nextfollower;
+  struct query *previnflight; /* if we are in the in-flight list */
+  struct query *nextinflight;
+  int flaginflight;
+  int result; /* for followers: 0 waiting, 1 answered, -1 failed, 2 restart */
+  int resulterrno;
+  char *answer; /* 0, or copy of leader's response */
+  unsigned int answerlen;
+  unsigned int answertc;
+  int flagdue; /* answered from a hot cache entry close to expiry */
+  int flagrefresh; /* ignore cached answers for the question itself */
+  int flagcache; /* answer from the cache alone */
+  int flagfrompeer; /* set by the caller before query_start: never ask a peer */
+  int peer; /* 0: may ask a peer, 1: asking one, 2: done with peers */
+  struct taia peerdeadline;
+  struct query_event trace[QUERY_MAXTRACE];
+  unsigned int numtrace;
+  unsigned int tracelost; /* events past QUERY_MAXTRACE */
+  int tracetcp; /* TCP fallback seen for the current transmission */
+  struct taia tracestart;
+  struct timer timer; /* see schedule() in query.c */
+  char arena[QUERY_ARENA]; /* name, lv, ns, alias; reset by cleanup */
+  unsigned int arenaused;
 } ;
 
 extern int query_start(struct query *,char *,char *,char *,char *);
-extern void query_io(struct query *,iopause_fd *,struct taia *);
+extern void query_io(struct query *,iopause_fd *);
 extern int query_get(struct query *,iopause_fd *,struct taia *);
+extern void query_forget(struct query *);
+extern int query_refresh(struct query *,char *,char *,char *,char *);
+extern int query_stale(struct query *);
+extern int query_cached(struct query *,char *,char [2],char [2],char [4]);
+extern int query_resume(struct query *,struct query *,char *,char *,char *,char *);
 
 extern void query_forwardonly(void);
+extern void query_local(void);
+extern void query_compact(void);
+extern void query_minimalany(void);
+extern void query_packets(unsigned long);
+extern void query_nxlimit(unsigned long);
+extern void query_partition(unsigned int,unsigned int);
+extern void query_trace(unsigned long);
+extern void query_peers(const char *,unsigned int,const char *,unsigned long);
+extern int query_ispeer(const char *);
+extern int query_slow(struct query *,uint32 *);
+extern void query_glueless(unsigned long);
+extern char *query_nextglueless(void);
+
+extern uint64 query_sent;
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -13,6 +14,10 @@
 #include "scan.h"
 #include "fmt.h"
 #include "ip4.h"
+#include "alloc.h"
+#include "uint32.h"
+#include "env.h"
+#include "buildstat.h"
 
 #define FATAL "rbldns-data: fatal: "
 
@@ -26,6 +31,7 @@ buffer b;
 char bspace[1024];
 
 int fdcdb;
+int fdspill;
 struct cdb_make cdb;
 static stralloc tmp;
 
@@ -40,11 +46,123 @@ void syntaxerror(const char *why)
   strnum[fmt_ulong(strnum,linenum)] = 0;
   strerr_die4x(111,FATAL,"unable to parse data line ",strnum,why);
 }
+int dataread(int fddata,char *buf,unsigned int len)
+{
+  int r;
+
+  buildstat_start(BUILDSTAT_READ);
+  r = read(fddata,buf,len);
+  buildstat_stop(BUILDSTAT_READ,r > 0 ? r : 0);
+  return r;
+}
+
 void die_datatmp(void)
 {
   strerr_die2sys(111,FATAL,"unable to create data.tmp: ");
 }
 
+/*
+Listed addresses are collected as ranges, merged, and written back
+as the fewest prefixes that cover them. The merged ranges also go
+into one record at "\0i", as sorted pairs of 4-byte big-endian first
+and last addresses, for rbldns to search. rbldns never matched a
+prefix shorter than 8 bits or one with host bits set, so those are
+dropped here. With $COMPACT, only "\0i" is written; rbldns then needs
+no prefix records, but older versions of rbldns find nothing.
+*/
+
+static int flagcompact = 0;
+
+struct range { uint32 first; uint32 last; } ;
+static struct range *range;
+static unsigned int numranges = 0;
+static unsigned int maxranges = 0;
+
+void range_add(const char ip[4],unsigned long len)
+{
+  uint32 first;
+  uint32 size;
+
+  if (len < 8) return;
+  uint32_unpack_big(ip,&first);
+  size = (uint32) 1 << (32 - len);
+  if (first & (size - 1)) return;
+
+  if (numranges >= maxranges) {
+    maxranges = maxranges + (maxranges >> 1) + 1024;
+    if (!range) range = (struct range *) alloc(maxranges * sizeof(struct range));
+    else if (!alloc_re((char **) &range,numranges * sizeof(struct range),maxranges * sizeof(struct range)))
+      range = 0;
+    if (!range) nomem();
+  }
+  range[numranges].first = first;
+  range[numranges].last = first + (size - 1);
+  ++numranges;
+}
+
+int rangecmp(const void *x,const void *y)
+{
+  uint32 u = ((const struct range *) x)->first;
+  uint32 v = ((const struct range *) y)->first;
+  return (u < v) ? -1 : (u > v);
+}
+
+void prefix_add(uint32 first,unsigned int len)
+{
+  char key[5];
+
+  if (flagcompact) return;
+  uint32_pack_big(key,first);
+  key[4] = len;
+  buildstat_start(BUILDSTAT_ADD);
+  if (cdb_make_add(&cdb,key,5,"",0) == -1) die_datatmp();
+  buildstat_stop(BUILDSTAT_ADD,5);
+}
+
+void ranges_finish(void)
+{
+  unsigned int i;
+  unsigned int n;
+  unsigned int len;
+  uint32 first;
+  uint32 size;
+  char buf[8];
+
+  if (numranges)
+    qsort(range,numranges,sizeof(struct range),rangecmp);
+
+  n = 0;
+  for (i = 0;i < numranges;++i) {
+    if (n && ((range[i].first <= range[n - 1].last) || (range[i].first - 1 == range[n - 1].last))) {
+      if (range[i].last > range[n - 1].last) range[n - 1].last = range[i].last;
+      continue;
+    }
+    range[n++] = range[i];
+  }
+
+  if (!stralloc_copys(&tmp,"")) nomem();
+  for (i = 0;i < n;++i) {
+    uint32_pack_big(buf,range[i].first);
+    uint32_pack_big(buf + 4,range[i].last);
+    if (!stralloc_catb(&tmp,buf,8)) nomem();
+
+    first = range[i].first;
+    for (;;) {
+      for (len = 8;;++len) {
+        size = (uint32) 1 << (32 - len);
+        if (!(first & (size - 1)))
+          if (size - 1 <= range[i].last - first) break;
+      }
+      prefix_add(first,len);
+      if (first + (size - 1) == range[i].last) break;
+      first += size;
+    }
+  }
+  buildstat_start(BUILDSTAT_ADD);
+  if (cdb_make_add(&cdb,"\0i",2,tmp.s,tmp.len) == -1) die_datatmp();
+  buildstat_stop(BUILDSTAT_ADD,2 + tmp.len);
+}
+
 int main()
 {
   char ip[4];
@@ -55,13 +173,24 @@ int main()
 
   umask(022);
 
+  if (env_get("COMPACT")) flagcompact = 1;
+
+  buildstat_init(0);
+  buildstat_phase("parse");
+
   fd = open_read("data");
   if (fd == -1) strerr_die2sys(111,FATAL,"unable to open data: ");
-  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+  buffer_init(&b,dataread,fd,bspace,sizeof bspace);
 
   fdcdb = open_trunc("data.tmp");
   if (fdcdb == -1) die_datatmp();
   if (cdb_make_start(&cdb,fdcdb) == -1) die_datatmp();
+  cdb_make_buffer(&cdb,CDB_BUFFER);
+  fdspill = open_rwtrunc("data.spill");
+  if (fdspill == -1)
+    strerr_die2sys(111,FATAL,"unable to create data.spill: ");
+  unlink("data.spill");
+  cdb_make_spill(&cdb,fdspill);
 
   while (match) {
     ++linenum;
@@ -74,6 +203,7 @@ int main()
       --line.len;
     }
     if (!line.len) continue;
+    buildstat_line((line.s[0] >= '0') && (line.s[0] <= '9') ? '0' : line.s[0]);
 
     switch(line.s[0]) {
       default:
@@ -86,8 +216,10 @@ int main()
 	if (ip4_scan(line.s + 1,ip) != j) syntaxerror(": malformed IP address");
 	if (!stralloc_copyb(&tmp,ip,4)) nomem();
 	if (!stralloc_catb(&tmp,line.s + j + 2,line.len - j - 2)) nomem();
+	buildstat_start(BUILDSTAT_ADD);
         if (cdb_make_add(&cdb,"",0,tmp.s,tmp.len) == -1)
           die_datatmp();
+	buildstat_stop(BUILDSTAT_ADD,tmp.len);
         break;
       case '0': case '1': case '2': case '3': case '4':
       case '5': case '6': case '7': case '8': case '9':
@@ -110,19 +242,21 @@ int main()
 	else
 	  u = 32;
 	if (u > 32) u = 32;
-	ch = u;
-	if (!stralloc_catb(&tmp,&ch,1)) nomem();
-        if (cdb_make_add(&cdb,tmp.s,tmp.len,"",0) == -1)
-          die_datatmp();
+	range_add(tmp.s,u);
 	break;
     }
   }
+  buildstat_phase("index");
+  ranges_finish();
 
+  buildstat_phase("finish");
   if (cdb_make_finish(&cdb) == -1) die_datatmp();
+  buildstat_phase("sync");
   if (fsync(fdcdb) == -1) die_datatmp();
   if (close(fdcdb) == -1) die_datatmp(); /* NFS stupidity */
   if (rename("data.tmp","data.cdb") == -1)
     strerr_die2sys(111,FATAL,"unable to move data.tmp to data.cdb: ");
 
+  buildstat_report("data.cdb");
   _exit(0);
 }
@@ -1,20 +1,82 @@
-#include <unistd.h>
 #include "str.h"
 #include "byte.h"
+#include "alloc.h"
 #include "ip4.h"
-#include "open.h"
 #include "env.h"
 #include "cdb.h"
+#include "cdbmap.h"
 #include "dns.h"
 #include "dd.h"
 #include "strerr.h"
 #include "response.h"
+#include "iptable.h"
+#include "metrics.h"
+#include "zonestat.h"
+
+/*
+$BASE is a list of up to MAXZONES zones, separated by commas or
+spaces, each a name or name:file. A zone's addresses come from its
+file, data.cdb if none is given, so one process can serve many
+lists. A query picks its zone by what is left after its four address
+labels, in one pass over the zones; each file stays open, with its
+merged ranges or $PRELOAD table, for as long as it does not change.
+With $ZONESTATS, answers are counted against the zone they picked.
+*/
+
+#define MAXZONES 64
+
+static struct zone {
+  char *base;
+  const char *fn;
+  struct cdb c;
+  struct iptable table; /* with $PRELOAD */
+  int flagtable;
+  const char *ranges; /* merged ranges from rbldns-data, read in place */
+  uint32 numranges;
+} zone[MAXZONES];
+static unsigned int numzones = 0;
+
+static struct zone *z; /* the zone of the query */
+
+static char key[25][5];
+static const char *keys[25];
+static unsigned int keylen[25];
+static char data[100 + IP4_FMT];
 
-static char *base;
+/* with $PRELOAD, every new file is loaded into its zone's iptable */
+static int flagpreload = 0;
 
-static struct cdb c;
-static char key[5];
-static char data[100 + IP4_FMT];
+static void ranges_init(void)
+{
+  uint32 dlen;
+
+  z->ranges = 0;
+  if (!z->c.map) return;
+  if (cdb_find(&z->c,"\0i",2) != 1) return;
+  dlen = cdb_datalen(&z->c);
+  if (dlen & 7) return;
+  if (cdb_datapos(&z->c) + dlen > z->c.size) return;
+  z->ranges = z->c.map + cdb_datapos(&z->c);
+  z->numranges = dlen >> 3;
+}
+
+static int ranges_find(uint32 ipnum)
+{
+  const char *ranges = z->ranges;
+  uint32 lo = 0;
+  uint32 hi = z->numranges;
+  uint32 mid;
+  uint32 u;
+
+  while (lo < hi) { /* first range starting after ipnum */
+    mid = lo + ((hi - lo) >> 1);
+    uint32_unpack_big(ranges + 8 * mid,&u);
+    if (u <= ipnum) lo = mid + 1; else hi = mid;
+  }
+  if (!lo) return 0;
+  uint32_unpack_big(ranges + 8 * lo - 4,&u);
+  return ipnum <= u;
+}
 
 static int doit(char *q,char qtype[2])
 {
@@ -33,26 +95,35 @@ static int doit(char *q,char qtype[2])
   if (byte_equal(qtype,2,DNS_T_ANY)) flaga = flagtxt = 1;
   if (!flaga && !flagtxt) goto REFUSE;
 
-  if (dd(q,base,reverseip) != 4) goto REFUSE;
+  if (dd(q,z->base,reverseip) != 4) goto REFUSE;
   uint32_unpack(reverseip,&ipnum);
   uint32_pack_big(ip,ipnum);
 
-  for (i = 0;i <= 24;++i) {
-    ipnum >>= i;
-    ipnum <<= i;
-    uint32_pack_big(key,ipnum);
-    key[4] = 32 - i;
-    r = cdb_find(&c,key,5);
+  if (z->flagtable) {
+    if (!iptable_find(&z->table,ipnum)) { response_nxdomain(); return 1; }
+  }
+  else if (z->ranges) {
+    if (!ranges_find(ipnum)) { response_nxdomain(); return 1; }
+  }
+  else {
+    for (i = 0;i <= 24;++i) {
+      ipnum >>= i;
+      ipnum <<= i;
+      uint32_pack_big(key[i],ipnum);
+      key[i][4] = 32 - i;
+      keys[i] = key[i];
+      keylen[i] = 5;
+    }
+    r = cdb_findfirst(&z->c,keys,keylen,25);
     if (r == -1) return 0;
-    if (r) break;
+    if (!r) { response_nxdomain(); return 1; }
   }
-  if (!r) { response_nxdomain(); return 1; }
 
-  r = cdb_find(&c,"",0);
+  r = cdb_find(&z->c,"",0);
   if (r == -1) return 0;
-  if (r && ((dlen = cdb_datalen(&c)) >= 4)) {
+  if (r && ((dlen = cdb_datalen(&z->c)) >= 4)) {
     if (dlen > 100) dlen = 100;
-    if (cdb_read(&c,data,dlen,cdb_datapos(&c)) == -1) return 0;
+    if (cdb_read(&z->c,data,dlen,cdb_datapos(&z->c)) == -1) return 0;
   }
   else {
     dlen = 12;
@@ -87,23 +158,74 @@ static int doit(char *q,char qtype[2])
   return 1;
 }
 
-int respond(char *q,char qtype[2],char ip[4])
+/* the zone q is in, after four labels, or 0 */
+static struct zone *pick(const char *q)
 {
-  int fd;
-  int result;
-
-  fd = open_read("data.cdb");
-  if (fd == -1) return 0;
-  cdb_init(&c,fd);
-  result = doit(q,qtype);
-  cdb_free(&c);
-  close(fd);
-  return result;
+  unsigned int i;
+
+  for (i = 0;i < 4;++i) {
+    if ((*q <= 0) || (*q >= 4)) return 0;
+    q += *q + 1;
+  }
+  for (i = 0;i < numzones;++i)
+    if (dns_domain_equal(q,zone[i].base)) return zone + i;
+  return 0;
+}
+
+int respond(char *q,char qtype[2],char ip[4],uint32 qhash)
+{
+  int r;
+
+  z = pick(q);
+  if (z)
+    zonestat_zone(z->base);
+  else
+    z = zone; /* doit() refuses it */
+  r = cdbmap(&z->c,z->fn);
+  if (!r) { z->ranges = 0; z->flagtable = 0; return 0; }
+  if (r == 2) {
+    ++metric[METRIC_RELOADS];
+    z->flagtable = flagpreload ? iptable_init(&z->table,&z->c) : 0;
+    ranges_init();
+  }
+  return doit(q,qtype);
 }
 
 const char *fatal = "rbldns: fatal: ";
 const char *starting = "starting rbldns\n";
 
+/* 0 if all of x is zones, else where it stops making sense */
+static char *zonelist(char *x)
+{
+  char *fn;
+  unsigned int n;
+  unsigned int len;
+
+  for (;;) {
+    while ((*x == ',') || (*x == ' ')) ++x;
+    if (!*x) return 0;
+    if (numzones == MAXZONES) return x;
+    z = zone + numzones;
+    for (n = 0;x[n] && (x[n] != ',') && (x[n] != ' ') && (x[n] != ':');++n) ;
+    if (!dns_domain_fromdot(&z->base,x,n)) return x;
+    x += n;
+    len = 0;
+    if (*x == ':')
+      for (++x;x[len] && (x[len] != ',') && (x[len] != ' ');++len) ;
+    if (!len)
+      z->fn = "data.cdb";
+    else {
+      fn = alloc(len + 1);
+      if (!fn) return x;
+      byte_copy(fn,len,x);
+      fn[len] = 0;
+      z->fn = fn;
+      x += len;
+    }
+    ++numzones;
+  }
+}
+
 void initialize(void)
 {
   char *x;
@@ -111,6 +233,8 @@ void initialize(void)
   x = env_get("BASE");
   if (!x)
     strerr_die2x(111,fatal,"$BASE not set");
-  if (!dns_domain_fromdot(&base,x,str_len(x)))
+  x = zonelist(x);
+  if (x || !numzones)
     strerr_die2x(111,fatal,"unable to parse $BASE");
+  if (env_get("PRELOAD")) flagpreload = 1;
 }
@@ -0,0 +1,6 @@
+env - PATH="`pwd`:$PATH" TOLERANCE="${TOLERANCE-10}" \
+NAMES="${NAMES-20000}" ZONES="${ZONES-200}" ZONESERVERS="${ZONESERVERS-4}" \
+QUERIES="${QUERIES-100000}" CONCURRENCY="${CONCURRENCY-100}" SEED="${SEED-1}" \
+LATENCY="${LATENCY-0,0,0}" JITTER="${JITTER-0}" LOSS="${LOSS-0}" LAME="${LAME-0}" \
+CACHESIZE="${CACHESIZE-10000000}" \
+sh resolvebench.tests
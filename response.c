@@ -1,16 +1,59 @@
 #include "dns.h"
 #include "byte.h"
+#include "case.h"
 #include "uint16.h"
 #include "response.h"
+#include "perfcount.h"
 
 char response[65535];
 unsigned int response_len = 0; /* <= 65535 */
 static unsigned int tctarget;
 
-#define NAMES 100
-static char name[NAMES][128];
-static unsigned int name_ptr[NAMES]; /* each < 16384 */
-static unsigned int name_num;
+/*
+Compression table: every suffix written so far at an offset below
+16384, keyed by a hash of its lowercased labels, which is computed
+from the root up so each suffix costs one label of hashing. Entries
+are matched against the packet itself, following its pointers, so
+nothing is copied. Slots are stamped with a generation, which
+response_query() bumps instead of clearing the table.
+*/
+
+#define NAMES 16384 /* power of 2; more than a packet can point to */
+
+struct name {
+  uint32 hash;
+  unsigned int pos;
+  unsigned int gen;
+} ;
+
+static struct name name[NAMES];
+static unsigned int name_gen = 1;
+
+static int name_match(const char *d,unsigned int pos)
+{
+  unsigned char c;
+
+  for (;;) {
+    c = response[pos];
+    if (c >= 192) {
+      pos = ((c & 63) << 8) + (unsigned char) response[pos + 1];
+      continue;
+    }
+    if (c != (unsigned char) *d) return 0;
+    if (!c) return 1;
+    if (case_diffb(d + 1,c,response + pos + 1)) return 0;
+    d += c + 1;
+    pos += c + 1;
+  }
+}
+
+static void name_forget(void)
+{
+  if (!++name_gen) {
+    byte_zero(name,sizeof name);
+    name_gen = 1;
+  }
+}
 
 int response_addbytes(const char *buf,unsigned int len)
 {
@@ -20,39 +63,66 @@ int response_addbytes(const char *buf,unsigned int len)
   return 1;
 }
 
-int response_addname(const char *d)
+static int addname(const char *d)
 {
-  unsigned int dlen;
+  unsigned int label[128];
+  uint32 hash[128];
+  unsigned int labels;
   unsigned int i;
+  unsigned int j;
+  unsigned int k;
+  unsigned char ch;
+  uint32 h;
   char buf[2];
 
-  dlen = dns_domain_length(d);
-
-  while (*d) {
-    for (i = 0;i < name_num;++i)
-      if (dns_domain_equal(d,name[i])) {
-        uint16_pack_big(buf,49152 + name_ptr[i]);
-        return response_addbytes(buf,2);
-      }
-    if (dlen <= 128)
-      if (name_num < NAMES) {
-	byte_copy(name[name_num],dlen,d);
-	name_ptr[name_num] = response_len;
-	++name_num;
-      }
-    i = (unsigned char) *d;
-    ++i;
-    if (!response_addbytes(d,i)) return 0;
-    d += i;
-    dlen -= i;
+  labels = 0;
+  for (i = 0;d[i] && (labels < 128);i += (unsigned char) d[i] + 1)
+    label[labels++] = i;
+
+  h = 5381;
+  for (j = labels;j > 0;--j) {
+    i = label[j - 1];
+    for (k = 0;k <= (unsigned char) d[i];++k) {
+      ch = d[i + k];
+      if ((k > 0) && (ch >= 'A') && (ch <= 'Z')) ch += 32;
+      h = ((h << 5) + h) ^ ch;
+    }
+    hash[j - 1] = h;
+  }
+
+  for (j = 0;j < labels;++j) {
+    h = hash[j];
+    for (k = h & (NAMES - 1);name[k].gen == name_gen;k = (k + 1) & (NAMES - 1))
+      if (name[k].hash == h)
+        if (name_match(d + label[j],name[k].pos)) {
+          uint16_pack_big(buf,49152 + name[k].pos);
+          return response_addbytes(buf,2);
+        }
+    if (response_len < 16384) {
+      name[k].hash = h;
+      name[k].pos = response_len;
+      name[k].gen = name_gen;
+    }
+    i = (unsigned char) d[label[j]] + 1;
+    if (!response_addbytes(d + label[j],i)) return 0;
   }
-  return response_addbytes(d,1);
+  return response_addbytes("",1);
+}
+
+int response_addname(const char *d)
+{
+  int r;
+  PERFCOUNT_BEGIN(PERF_RESPONSE_ADDNAME)
+
+  r = addname(d);
+  PERFCOUNT_END(PERF_RESPONSE_ADDNAME)
+  return r;
 }
 
 int response_query(const char *q,const char qtype[2],const char qclass[2])
 {
   response_len = 0;
-  name_num = 0;
+  name_forget();
   if (!response_addbytes("\0\0\201\200\0\1\0\0\0\0\0\0",12)) return 0;
   if (!response_addname(q)) return 0;
   if (!response_addbytes(qtype,2)) return 0;
@@ -117,5 +187,143 @@ void response_id(const char id[2])
 void response_tc(void)
 {
   response[2] |= 2;
+  byte_zero(response + 6,6);
   response_len = tctarget;
 }
+
+/*
+response_trim() fits the response into max bytes. An authoritative
+response sheds additional records from the end, which nothing earlier
+points into, and goes out whole if that is enough (RFC 2181, 9); if
+not, an authoritative answer also sheds its authority records. A
+referral, whose additional records are glue, or a denial, whose SOA
+is needed, is truncated as before.
+*/
+
+static unsigned int skiprr(unsigned int pos)
+{
+  uint16 len;
+
+  pos = dns_packet_skipname(response,response_len,pos);
+  if (!pos) return 0;
+  if (pos + 10 > response_len) return 0;
+  uint16_unpack_big(response + pos + 8,&len);
+  pos += 10 + len;
+  if (pos > response_len) return 0;
+  return pos;
+}
+
+/* end of the first n records starting at pos, or 0 */
+static unsigned int skiprrs(unsigned int pos,unsigned int n)
+{
+  while (pos && n--) pos = skiprr(pos);
+  return pos;
+}
+
+void response_trim(unsigned int max)
+{
+  uint16 an;
+  uint16 ns;
+  uint16 ar;
+  unsigned int keep;
+  unsigned int pos;
+  unsigned int next;
+
+  if (response_len <= max) return;
+  if (!(response[2] & 4)) { response_tc(); return; }
+  uint16_unpack_big(response + RESPONSE_ANSWER,&an);
+  uint16_unpack_big(response + RESPONSE_AUTHORITY,&ns);
+  uint16_unpack_big(response + RESPONSE_ADDITIONAL,&ar);
+
+  pos = skiprrs(tctarget,an);
+  if (!pos || (pos > max)) { response_tc(); return; }
+  next = skiprrs(pos,ns);
+  if (!next) { response_tc(); return; }
+  if (next > max) {
+    if (!an) { response_tc(); return; }
+    ar = ns = 0;
+  }
+  else
+    pos = next;
+
+  for (keep = 0;keep < ar;++keep) {
+    next = skiprr(pos);
+    if (!next || (next > max)) break;
+    pos = next;
+  }
+  uint16_pack_big(response + RESPONSE_AUTHORITY,ns);
+  uint16_pack_big(response + RESPONSE_ADDITIONAL,keep);
+  response_len = pos;
+  name_forget();
+}
+
+/*
+response_ttls() puts the offsets of the TTLs of all records in pos,
+for patching a copy of the response later. 0 if there are more than
+max, or the response does not parse.
+*/
+int response_ttls(unsigned int *pos,unsigned int max,unsigned int *n)
+{
+  uint16 an;
+  uint16 ns;
+  uint16 ar;
+  unsigned int records;
+  unsigned int p;
+  unsigned int next;
+
+  uint16_unpack_big(response + RESPONSE_ANSWER,&an);
+  uint16_unpack_big(response + RESPONSE_AUTHORITY,&ns);
+  uint16_unpack_big(response + RESPONSE_ADDITIONAL,&ar);
+  records = an + ns + ar;
+  if (records > max) return 0;
+
+  p = tctarget;
+  for (*n = 0;*n < records;++*n) {
+    next = skiprr(p);
+    if (!next) return 0;
+    pos[*n] = dns_packet_skipname(response,response_len,p) + 4;
+    p = next;
+  }
+  return 1;
+}
+
+static unsigned int optpos; /* rdlength of the OPT record just added */
+
+int response_opt(unsigned int size,int flagbadvers)
+{
+  char buf[11];
+
+  byte_copy(buf,11,"\0\0\51\0\0\0\0\0\0\0\0");
+  uint16_pack_big(buf + 3,size);
+  if (flagbadvers) buf[5] = 1;
+  optpos = response_len + 9;
+  if (!response_addbytes(buf,11)) return 0;
+  if (!++response[RESPONSE_ADDITIONAL + 1]) ++response[RESPONSE_ADDITIONAL];
+  return 1;
+}
+
+/* appends an option to the OPT record, which must be the last record */
+int response_optadd(const char code[2],const char *data,unsigned int len)
+{
+  char buf[4];
+
+  byte_copy(buf,2,code);
+  uint16_pack_big(buf + 2,len);
+  if (!response_addbytes(buf,4)) return 0;
+  if (!response_addbytes(data,len)) return 0;
+  uint16_pack_big(response + optpos,response_len - optpos - 2);
+  return 1;
+}
+
+unsigned int response_tcpos(void)
+{
+  return tctarget;
+}
+
+void response_restore(const char *buf,unsigned int len,unsigned int tcpos)
+{
+  byte_copy(response,len,buf);
+  response_len = len;
+  tctarget = tcpos;
+  name_forget();
+}
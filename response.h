@@ -11,6 +11,12 @@ extern void response_nxdomain(void);
 extern void response_servfail(void);
 extern void response_id(const char *);
 extern void response_tc(void);
+extern void response_trim(unsigned int);
+extern int response_opt(unsigned int,int);
+extern int response_optadd(const char *,const char *,unsigned int);
+extern int response_ttls(unsigned int *,unsigned int,unsigned int *);
+extern unsigned int response_tcpos(void);
+extern void response_restore(const char *,unsigned int,unsigned int);
 
 extern int response_addbytes(const char *,unsigned int);
 extern int response_addname(const char *);
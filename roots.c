@@ -8,25 +8,87 @@
 #include "ip4.h"
 #include "dns.h"
 #include "openreadclose.h"
+#include "alloc.h"
 #include "roots.h"
 
+/*
+data holds each configured domain followed by its 64 bytes of
+servers. table indexes data by open addressing: each slot is a
+position in data plus 1, or 0 if empty, and the size is a power of 2
+at least twice the number of domains. A domain configured twice keeps
+the first entry, as the linear scan did. roots_init() builds newdata
+and newtable, and swaps them in only once they are complete, so a
+failed reload leaves the old servers in use.
+*/
+
 static stralloc data;
+static unsigned int *table = 0;
+static unsigned int tablesize = 0;
 
-static int roots_find(char *q)
+static stralloc newdata;
+static unsigned int *newtable;
+static unsigned int newtablesize;
+
+static unsigned int hash(const char *q)
 {
-  int i;
-  int j;
+  unsigned int len;
+  unsigned int h = 5381;
+  unsigned char c;
+
+  len = dns_domain_length(q);
+  while (len--) {
+    c = *q++;
+    if ((c >= 'A') && (c <= 'Z')) c += 32;
+    h = (h << 5) + h;
+    h ^= c;
+  }
+  return h;
+}
 
-  i = 0;
-  while (i < data.len) {
-    j = dns_domain_length(data.s + i);
-    if (dns_domain_equal(data.s + i,q)) return i + j;
-    i += j;
-    i += 64;
+static int find(stralloc *sa,unsigned int *t,unsigned int size,const char *q)
+{
+  unsigned int i;
+  unsigned int j;
+
+  if (!size) return -1;
+  i = hash(q) & (size - 1);
+  while (j = t[i]) {
+    --j;
+    if (dns_domain_equal(sa->s + j,q)) return j + dns_domain_length(sa->s + j);
+    i = (i + 1) & (size - 1);
   }
   return -1;
 }
 
+static int roots_find(char *q)
+{
+  return find(&data,table,tablesize,q);
+}
+
+static int maketable(void)
+{
+  unsigned int n;
+  unsigned int i;
+  unsigned int j;
+
+  n = 0;
+  for (j = 0;j < newdata.len;j += dns_domain_length(newdata.s + j) + 64) ++n;
+
+  newtablesize = 16;
+  while (newtablesize < 2 * n) newtablesize <<= 1;
+  newtable = (unsigned int *) alloc(newtablesize * sizeof(unsigned int));
+  if (!newtable) return 0;
+  byte_zero((char *) newtable,newtablesize * sizeof(unsigned int));
+
+  for (j = 0;j < newdata.len;j += dns_domain_length(newdata.s + j) + 64)
+    if (find(&newdata,newtable,newtablesize,newdata.s + j) == -1) {
+      i = hash(newdata.s + j) & (newtablesize - 1);
+      while (newtable[i]) i = (i + 1) & (newtablesize - 1);
+      newtable[i] = j + 1;
+    }
+  return 1;
+}
+
 static int roots_search(char *q)
 {
   int r;
@@ -92,8 +154,8 @@ static int init2(DIR *dir)
 	}
       byte_zero(servers + serverslen,64 - serverslen);
 
-      if (!stralloc_catb(&data,q,dns_domain_length(q))) return 0;
-      if (!stralloc_catb(&data,servers,64)) return 0;
+      if (!stralloc_catb(&newdata,q,dns_domain_length(q))) return 0;
+      if (!stralloc_catb(&newdata,servers,64)) return 0;
     }
   }
 }
@@ -113,15 +175,23 @@ static int init1(void)
 
 int roots_init(void)
 {
+  stralloc sa;
   int fddir;
   int r;
 
-  if (!stralloc_copys(&data,"")) return 0;
+  if (!stralloc_copys(&newdata,"")) return 0;
 
   fddir = open_read(".");
   if (fddir == -1) return 0;
   r = init1();
   if (fchdir(fddir) == -1) r = 0;
   close(fddir);
-  return r;
+  if (!r) return 0;
+  if (!maketable()) return 0;
+
+  sa = data; data = newdata; newdata = sa;
+  if (table) alloc_free((char *) table);
+  table = newtable;
+  tablesize = newtablesize;
+  return 1;
 }
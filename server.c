@@ -1,29 +1,150 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include "byte.h"
-#include "case.h"
 #include "env.h"
 #include "buffer.h"
 #include "strerr.h"
 #include "ip4.h"
 #include "uint16.h"
+#include "uint32.h"
 #include "ndelay.h"
 #include "socket.h"
 #include "droproot.h"
+#include "handoff.h"
+#include "overload.h"
+#include "scan.h"
 #include "qlog.h"
+#include "zonestat.h"
+#include "logbuf.h"
+#include "logwait.h"
+#include "metrics.h"
+#include "perfcount.h"
+#include "profile.h"
 #include "response.h"
 #include "dns.h"
+#include "sig.h"
+#include "error.h"
+#include "fmt.h"
+#include "cpupin.h"
+#include "stralloc.h"
+#include "iopause.h"
+#include "taia.h"
+#include "xsk.h"
+#include "cdbmap.h"
 
 extern char *fatal;
 extern char *starting;
-extern int respond(char *,char *,char *);
+extern int respond(char *,char *,char *,uint32);
 extern void initialize(void);
 
 static char ip[4];
 static uint16 port;
 
-static char buf[513];
+#define BATCH 32
+
+#define EDNSMAX 4096
+
+static char inbuf[BATCH][513];
+static char outbuf[BATCH][EDNSMAX];
+static struct socket_dgram in[BATCH];
+static struct socket_dgram out[BATCH];
+
+static char *buf;
 static int len;
 
-static char *q;
+static char qasked[DNS_NAME]; /* as the client wrote it */
+static char qlower[DNS_NAME];
+static uint32 qhash; /* cdb_hash() of qlower */
+static char *q; /* qasked, until doit() is done with its case */
+
+static unsigned int ednssize = 0; /* 0: no EDNS; else advertised size */
+static unsigned int udpsize; /* 0, or client's advertised size */
+static int flagbadvers;
+static int flagudp; /* query came over UDP */
+
+/*
+With $RATELIMIT, UDP answers for each name to each client /24 are
+limited to that many a second, with bursts of up to that many; spoofed
+queries then make a poor reflector. Over the limit, every $RATESLIP-th
+query (default 2; 0 for none) gets an empty truncated answer, so that
+a real client retries over TCP, and the others are dropped, before
+any lookup is done. Each process keeps its own table of RRLSIZE token
+buckets, indexed by a keyed hash of the /24 and the name; a bucket
+whose slot is taken over by another starts full again.
+*/
+
+#define RRLSIZE 65536
+
+struct bucket {
+  uint32 tag; /* 0: unused */
+  uint16 when; /* seconds, modulo 65536 */
+  uint16 tokens;
+} ;
+
+static struct bucket rrl[RRLSIZE];
+static unsigned long rrlrate = 0; /* 0: no limit */
+static unsigned long rrlslip = 2;
+static unsigned long rrlslipcount = 0;
+static uint32 rrlkey;
+static uint16 rrlnow;
+
+#define RRL_OK 0
+#define RRL_DROP 1
+#define RRL_SLIP 2
+
+/*
+With $OVERLOAD, while UDP queries queue up faster than they are read
+(see overload.c), ANY queries over UDP, the ones whose answers cost
+the most to find and to send, get an empty truncated answer instead,
+so that a real client retries over TCP.
+*/
+
+static void rrl_clock(void)
+{
+  struct taia now;
+
+  if (!rrlrate) return;
+  taia_clock(&now);
+  rrlnow = now.sec.x;
+}
+
+static int rrl_check(const char client[4],const char *name)
+{
+  struct bucket *b;
+  uint32 h;
+  unsigned int namelen;
+  unsigned int i;
+  unsigned long tokens;
+
+  if (!rrlrate) return RRL_OK;
+
+  h = rrlkey;
+  for (i = 0;i < 3;++i) h = (h ^ (unsigned char) client[i]) * 16777619;
+  namelen = dns_domain_length(name);
+  for (i = 0;i < namelen;++i) h = (h ^ (unsigned char) name[i]) * 16777619;
+  if (!h) h = 1;
+
+  b = rrl + (h & (RRLSIZE - 1));
+  if (b->tag != h) {
+    b->tag = h;
+    b->tokens = rrlrate;
+  }
+  else {
+    tokens = b->tokens + (unsigned long) (uint16) (rrlnow - b->when) * rrlrate;
+    b->tokens = (tokens > rrlrate) ? rrlrate : tokens;
+  }
+  b->when = rrlnow;
+
+  if (b->tokens) { --b->tokens; return RRL_OK; }
+  ++metric[METRIC_RATELIMITED];
+  if (rrlslip && (++rrlslipcount >= rrlslip)) {
+    rrlslipcount = 0;
+    return RRL_SLIP;
+  }
+  return RRL_DROP;
+}
 
 static int doit(void)
 {
@@ -32,30 +153,63 @@ static int doit(void)
   char qtype[2];
   char qclass[2];
 
-  if (len >= sizeof buf) goto NOQ;
+  profile_phase = PROFILE_PARSE;
+  if (len >= sizeof inbuf[0]) goto NOQ;
   pos = dns_packet_copy(buf,len,0,header,12); if (!pos) goto NOQ;
   if (header[2] & 128) goto NOQ;
   if (header[4]) goto NOQ;
   if (header[5] != 1) goto NOQ;
 
-  pos = dns_packet_getname(buf,len,pos,&q); if (!pos) goto NOQ;
+  pos = dns_packet_getquestion(buf,len,pos,qasked,qlower,&qhash); if (!pos) goto NOQ;
+  q = qasked;
   pos = dns_packet_copy(buf,len,pos,qtype,2); if (!pos) goto NOQ;
   pos = dns_packet_copy(buf,len,pos,qclass,2); if (!pos) goto NOQ;
 
+  udpsize = 0;
+  flagbadvers = 0;
+  if (ednssize)
+    if (dns_packet_edns(buf,len,pos,&udpsize) == -1)
+      flagbadvers = 1;
+
+  profile_phase = PROFILE_RESPONSE;
   if (!response_query(q,qtype,qclass)) goto NOQ;
   response_id(header);
   if (byte_equal(qclass,2,DNS_C_IN))
     response[2] |= 4;
   else
-    if (byte_diff(qclass,2,DNS_C_ANY)) goto WEIRDCLASS;
+    if (byte_diff(qclass,2,DNS_C_ANY) && byte_diff(qclass,2,DNS_C_CH)) goto WEIRDCLASS;
   response[3] &= ~128;
   if (!(header[2] & 1)) response[2] &= ~1;
 
   if (header[2] & 126) goto NOTIMP;
   if (byte_equal(qtype,2,DNS_T_AXFR)) goto NOTIMP;
+  if (flagbadvers) goto BADVERS;
 
-  case_lowerb(q,dns_domain_length(q));
-  if (!respond(q,qtype,ip)) {
+  q = qlower;
+  if (byte_equal(qclass,2,DNS_C_CH)) {
+    if (!metrics_answer(q,qtype)) goto WEIRDCLASS;
+    response_id(header);
+    if (!(header[2] & 1)) response[2] &= ~1;
+    qlog(ip,port,header,q,qtype," + ");
+    return 1;
+  }
+  if (flagudp)
+    switch(rrl_check(ip,q)) {
+      case RRL_DROP:
+        qlog(ip,port,header,q,qtype," R ");
+        return 0;
+      case RRL_SLIP:
+        response_tc();
+        qlog(ip,port,header,q,qtype," T ");
+        return 1;
+    }
+  if (flagudp && overload && byte_equal(qtype,2,DNS_T_ANY)) {
+    response_tc();
+    ++metric[METRIC_SHED];
+    qlog(ip,port,header,q,qtype," O ");
+    return 1;
+  }
+  if (!respond(q,qtype,ip,qhash)) {
     qlog(ip,port,header,q,qtype," - ");
     return 0;
   }
@@ -68,6 +222,11 @@ static int doit(void)
   qlog(ip,port,header,q,qtype," I ");
   return 1;
 
+  BADVERS:
+  response[3] &= ~15;
+  qlog(ip,port,header,q,qtype," V ");
+  return 1;
+
   WEIRDCLASS:
   response[3] &= ~15;
   response[3] |= 1;
@@ -79,38 +238,767 @@ static int doit(void)
   return 0;
 }
 
+/*
+With $WORKERS, that many processes each read their own socket on
+the same address, bound with SO_REUSEPORT, and the kernel spreads
+queries across them. With $PINCPU, worker i runs only on CPU
+$PINCPU + i, and its memory comes from that CPU's node as it first
+touches it. With $STEER as well, the kernel hands what it takes in
+on CPU $PINCPU + i to worker i instead of spreading it by hash, so a
+query is read and answered on the CPU its interrupt came in on, if
+the network card's queues are set to interrupt those CPUs. The
+parent forwards TERM and USR1 to the workers, and stops them all if
+one of them dies.
+
+$IP may list up to MAXIPS addresses, separated by commas or spaces;
+each process then has a socket on each, and answers each query from
+the address it was sent to.
+*/
+
+#define MAXWORKERS 64
+#define MAXIPS 64
+static char ips[4 * MAXIPS];
+static unsigned int numips = 0;
+static int udpworker[MAXWORKERS][MAXIPS];
+static int tcpworker[MAXWORKERS][MAXIPS];
+static int pidworker[MAXWORKERS];
+static struct overload udpload[MAXIPS];
+static unsigned long numworkers = 1;
+static unsigned long worker;
+
+static int flagstats = 0;
+static unsigned long profilehz = 0; /* $PROFILE; see profile.c */
+
+static void sigusr1(void) { flagstats = 1; }
+
+static void number(unsigned long u)
+{
+  char strnum[FMT_ULONG];
+  buffer_put(buffer_2,strnum,fmt_ulong(strnum,u));
+}
+
+static void stats(void)
+{
+  int i;
+  int j;
+
+  flagstats = 0;
+  buffer_puts(buffer_2,"stats ");
+  number(worker); buffer_puts(buffer_2," ");
+  number(metric[METRIC_QUERIES]); buffer_puts(buffer_2," ");
+  number(metric[METRIC_ANSWERS]); buffer_puts(buffer_2," ");
+  number(metric[METRIC_DROPPED]);
+  buffer_puts(buffer_2,"\n");
+  for (i = 0;i < PERF_SITES;++i) {
+    if (!perfcount[i].calls) continue;
+    buffer_puts(buffer_2,"perf ");
+    number(worker); buffer_puts(buffer_2," ");
+    buffer_puts(buffer_2,perfcount_name[i]); buffer_puts(buffer_2," ");
+    number(perfcount[i].calls); buffer_puts(buffer_2," ");
+    number(perfcount[i].sampled);
+    for (j = 0;j < PERF_EVENTS;++j) {
+      buffer_puts(buffer_2," ");
+      number(perfcount[i].count[j]);
+    }
+    buffer_puts(buffer_2,"\n");
+  }
+  qlog_top(buffer_2,worker);
+  buffer_flush(buffer_2);
+  zonestat_flush(buffer_2,worker);
+}
+
+/* answers d[0..n) into o[]; with o == d, each in its own buf */
+static int answer(struct socket_dgram *d,int n,struct socket_dgram *o,unsigned int max)
+{
+  int m;
+  int i;
+
+  flagudp = 1;
+  rrl_clock();
+  m = 0;
+  for (i = 0;i < n;++i) {
+    buf = d[i].buf;
+    len = d[i].len;
+    byte_copy(ip,4,d[i].ip);
+    port = d[i].port;
+    if (len < 0) continue;
+    ++metric[METRIC_QUERIES];
+    zonestat_start();
+    if (!doit()) { ++metric[METRIC_DROPPED]; continue; }
+    metrics_rcode(response);
+    if (udpsize) {
+      if (udpsize > ednssize) udpsize = ednssize;
+      if (udpsize > max) udpsize = max;
+      response_trim(udpsize - 11);
+      response_opt(ednssize,flagbadvers);
+    }
+    else
+      response_trim(512);
+    zonestat_answer(response,response_len);
+    if (o == d) o[m].buf = d[i].buf;
+    byte_copy(o[m].buf,response_len,response);
+    o[m].len = response_len;
+    byte_copy(o[m].ip,4,ip);
+    o[m].port = port;
+    ++m;
+  }
+  metric[METRIC_ANSWERS] += m;
+  return m;
+}
+
+static void udpbatch(int udp53,struct overload *o)
+{
+  int n;
+  int m;
+
+  profile_phase = PROFILE_RECEIVE;
+  n = socket_recv4_many(udp53,in,BATCH,sizeof inbuf[0]);
+  overload_read(o,udp53,n,BATCH);
+  if (n > 0) {
+    m = answer(in,n,out,EDNSMAX);
+    profile_phase = PROFILE_SEND;
+    socket_send4_many(udp53,out,m);
+    /* may block for buffer space; if it fails, too bad */
+    logbuf_flush();
+  }
+  profile_phase = PROFILE_OTHER;
+}
+
+/*
+With $XDP set to the name of a network interface, worker i also takes
+UDP queries for the first address in $IP off queue $XDPQUEUE + i of
+that interface through an AF_XDP socket, skipping the kernel's UDP
+code, and answers each from the frame the query came in; see xsk.c.
+The UDP sockets still get whatever does not come that way: other
+addresses, other queues, IP options, fragments. Answers are held to what fits in a frame and in the MTU,
+as if the client had asked for that EDNS size.
+*/
+
+static struct xsk xsk[MAXWORKERS];
+static struct socket_dgram xin[BATCH];
+
+static void xdpbatch(struct xsk *x)
+{
+  int n;
+  int m;
+
+  profile_phase = PROFILE_RECEIVE;
+  n = xsk_recv4_many(x,xin,BATCH);
+  m = 0;
+  if (n > 0) m = answer(xin,n,xin,x->room);
+  profile_phase = PROFILE_SEND;
+  xsk_send4_many(x,xin,m);
+  logbuf_flush();
+  profile_phase = PROFILE_OTHER;
+}
+
+/*
+With $TCP, each process also answers DNS over TCP on $IP:53, for up
+to MAXTCP connections at once; the oldest goes when another arrives.
+Queries on a connection are answered in order as soon as each is
+complete, so clients may pipeline them. Responses are never
+truncated. A connection idle for 10 seconds is closed. Zone
+transfers still need axfrdns.
+*/
+
+#define MAXTCP 100
+#define TCPBUF 1026
+#define TCPOUT 65536
+
+struct tcpclient {
+  int tcp; /* -1: free */
+  char ip[4];
+  uint16 port;
+  struct taia timeout;
+  char buf[TCPBUF];
+  unsigned int len;
+  stralloc out;
+  unsigned int pos;
+  iopause_fd *io;
+} ;
+
+static struct tcpclient t[MAXTCP];
+static iopause_fd io[1 + 2 * MAXIPS + MAXTCP];
+
+static void t_timeout(struct tcpclient *x)
+{
+  struct taia now;
+
+  taia_clock(&now);
+  taia_uint(&x->timeout,10);
+  taia_add(&x->timeout,&x->timeout,&now);
+}
+
+static void t_close(struct tcpclient *x)
+{
+  iopause_forget(x->tcp);
+  close(x->tcp);
+  x->tcp = -1;
+  x->out.len = 0;
+}
+
+static void t_answer(struct tcpclient *x)
+{
+  char num[2];
+  uint16 n;
+
+  while (x->len >= 2) {
+    uint16_unpack_big(x->buf,&n);
+    if (!n || (n + 2 > TCPBUF)) { t_close(x); return; }
+    if (x->len < n + 2) return;
+
+    buf = x->buf + 2;
+    len = n;
+    byte_copy(ip,4,x->ip);
+    port = x->port;
+    flagudp = 0;
+    ++metric[METRIC_QUERIES];
+    zonestat_start();
+    if (doit()) {
+      metrics_rcode(response);
+      if (udpsize) response_opt(ednssize,flagbadvers);
+      zonestat_answer(response,response_len);
+      uint16_pack_big(num,response_len);
+      if (!stralloc_catb(&x->out,num,2)) { t_close(x); return; }
+      if (!stralloc_catb(&x->out,response,response_len)) { t_close(x); return; }
+      ++metric[METRIC_ANSWERS];
+    }
+    else
+      ++metric[METRIC_DROPPED];
+
+    x->len -= n + 2;
+    byte_copy(x->buf,x->len,x->buf + n + 2);
+  }
+}
+
+static void t_rw(struct tcpclient *x)
+{
+  int r;
+
+  if (x->io->revents & IOPAUSE_WRITE) {
+    profile_phase = PROFILE_SEND;
+    r = write(x->tcp,x->out.s + x->pos,x->out.len - x->pos);
+    profile_phase = PROFILE_OTHER;
+    if (r <= 0) { t_close(x); return; }
+    x->pos += r;
+    if (x->pos == x->out.len) x->pos = x->out.len = 0;
+    t_timeout(x);
+  }
+
+  if (x->io->revents & IOPAUSE_READ) {
+    profile_phase = PROFILE_RECEIVE;
+    r = read(x->tcp,x->buf + x->len,TCPBUF - x->len);
+    profile_phase = PROFILE_OTHER;
+    if (r <= 0) { t_close(x); return; }
+    x->len += r;
+    t_timeout(x);
+    t_answer(x);
+    profile_phase = PROFILE_OTHER;
+  }
+}
+
+static void t_new(int tcp53)
+{
+  struct tcpclient *x;
+  int j;
+
+  x = 0;
+  for (j = 0;j < MAXTCP;++j)
+    if (t[j].tcp == -1) { x = t + j; break; }
+  if (!x) {
+    x = t;
+    for (j = 1;j < MAXTCP;++j)
+      if (taia_less(&t[j].timeout,&x->timeout)) x = t + j;
+    t_close(x);
+    ++metric[METRIC_TCPEVICTED];
+  }
+
+  x->tcp = socket_accept4(tcp53,x->ip,&x->port);
+  if (x->tcp == -1) return;
+  if (ndelay_on(x->tcp) == -1) { close(x->tcp); x->tcp = -1; return; }
+  x->len = 0;
+  x->out.len = 0;
+  x->pos = 0;
+  t_timeout(x);
+}
+
+/*
+$HANDOFF, a path: a successor started with the same $HANDOFF takes
+this process's sockets, still bound and with the queries queued on
+them, instead of binding its own; see handoff_get(). Then every worker
+keeps every socket. On SIGTERM a worker forks; the parent exits, so
+the successor can start, and the child stops reading new queries and
+finishes writing its TCP answers, and in worker 0 offers the sockets
+at the path. It exits once its answers are written and the sockets
+are taken, or HANDOFFWAIT seconds after the SIGTERM. Once the sockets
+are taken, or at once in the other workers, it closes its TCP
+sockets. A successor with another number of sockets binds its own,
+trying for up to HANDOFFWAIT seconds while the predecessor lets go of
+the port. XDP sockets are not handed on.
+*/
+
+#define HANDOFFWAIT 30
+
+static int handoffsocket = -1;
+static int handed[2 * MAXWORKERS * MAXIPS];
+static unsigned int numhanded = 0;
+static int flagtcp = 0; /* then a TCP socket follows each UDP one */
+static int flagexit = 0;
+static int flagtaken = 0;
+
+static void sigterm(void) { flagexit = 1; }
+
+/* closes the TCP sockets, which no longer take connections */
+static void unlisten(void)
+{
+  unsigned int k;
+
+  if (!flagtcp) return;
+  for (k = 0;k < numhanded;k += 2) {
+    iopause_forget(handed[k + 1]);
+    close(handed[k + 1]);
+  }
+}
+
+static int drained(void)
+{
+  int i;
+
+  for (i = 0;i < MAXTCP;++i)
+    if ((t[i].tcp != -1) && t[i].out.len) return 0;
+  return 1;
+}
+
+static void serve(int *udp53,int *tcp53,struct xsk *x)
+{
+  struct taia stamp;
+  struct taia deadline;
+  struct taia drainend;
+  iopause_fd *udpio;
+  iopause_fd *tcpio;
+  iopause_fd *xskio;
+  iopause_fd *handoffio;
+  unsigned int iolen;
+  int flagdrain = 0;
+  unsigned int j;
+  int i;
+
+  sig_catch(sig_usr1,sigusr1);
+  if (handoffsocket != -1) sig_catch(sig_term,sigterm);
+
+  for (i = 0;i < BATCH;++i) {
+    in[i].buf = inbuf[i];
+    out[i].buf = outbuf[i];
+  }
+
+  if (profile_start(profilehz,metric + METRIC_PROFILE) == -1)
+    strerr_die2sys(111,fatal,"unable to start profiling: ");
+
+  buffer_putsflush(buffer_2,starting);
+
+  if ((numips == 1) && (tcp53[0] == -1) && !x && (handoffsocket == -1))
+    for (;;) {
+      if (flagstats) stats();
+      if (zonestat_due()) zonestat_flush(buffer_2,worker);
+      udpbatch(udp53[0],udpload);
+    }
+
+  for (i = 0;i < MAXTCP;++i) t[i].tcp = -1;
+  iopause_persistent();
+
+  for (;;) {
+    if (flagstats) stats();
+    if (zonestat_due()) zonestat_flush(buffer_2,worker);
+
+    taia_tick(&stamp);
+    taia_uint(&deadline,120);
+    taia_add(&deadline,&deadline,&stamp);
+
+    if (flagexit) {
+      if (fork()) _exit(0);
+      sig_uncatch(sig_term);
+      flagexit = 0;
+      flagdrain = 1;
+      if (worker) { /* worker 0 offers the sockets */
+        flagtaken = 1;
+        unlisten();
+      }
+      taia_uint(&drainend,HANDOFFWAIT);
+      taia_add(&drainend,&drainend,&stamp);
+    }
+
+    iolen = 0;
+    udpio = 0;
+    tcpio = 0;
+    xskio = 0;
+    handoffio = 0;
+    if (flagdrain) {
+      if (!taia_less(&stamp,&drainend)) _exit(0);
+      if (flagtaken && drained()) _exit(0);
+      if (taia_less(&drainend,&deadline)) deadline = drainend;
+      if (!flagtaken) {
+        handoffio = io + iolen++;
+        handoffio->fd = handoffsocket;
+        handoffio->events = IOPAUSE_READ;
+      }
+    }
+    else {
+      udpio = io + iolen;
+      for (j = 0;j < numips;++j) {
+        io[iolen].fd = udp53[j];
+        io[iolen++].events = IOPAUSE_READ;
+      }
+      if (tcp53[0] != -1) {
+        tcpio = io + iolen;
+        for (j = 0;j < numips;++j) {
+          io[iolen].fd = tcp53[j];
+          io[iolen++].events = IOPAUSE_READ;
+        }
+      }
+      if (x) {
+        xskio = io + iolen++;
+        xskio->fd = x->fd;
+        xskio->events = IOPAUSE_READ;
+      }
+    }
+    for (i = 0;i < MAXTCP;++i)
+      if (t[i].tcp != -1) {
+        t[i].io = io + iolen++;
+        t[i].io->fd = t[i].tcp;
+        t[i].io->events = 0;
+        if (t[i].out.len < TCPOUT) t[i].io->events |= IOPAUSE_READ;
+        if (t[i].out.len) t[i].io->events |= IOPAUSE_WRITE;
+        if (taia_less(&t[i].timeout,&deadline)) deadline = t[i].timeout;
+      }
+
+    logbuf_flush();
+    profile_phase = PROFILE_WAIT;
+    iopause(io,iolen,&deadline,&stamp);
+    profile_phase = PROFILE_OTHER;
+    taia_tick(&stamp);
+    cdbmap_quiescent();
+
+    for (i = 0;i < MAXTCP;++i)
+      if (t[i].tcp != -1) {
+        if (t[i].io->revents)
+          t_rw(t + i);
+        else if (!taia_less(&stamp,&t[i].timeout))
+          t_close(t + i);
+      }
+
+    if (udpio)
+      for (j = 0;j < numips;++j)
+        if (udpio[j].revents) udpbatch(udp53[j],udpload + j);
+    if (xskio && xskio->revents) xdpbatch(x);
+    if (tcpio)
+      for (j = 0;j < numips;++j)
+        if (tcpio[j].revents) t_new(tcp53[j]);
+    if (handoffio && handoffio->revents)
+      if (handoff_put(handoffsocket,handed,numhanded) == 1) {
+        iopause_forget(handoffsocket);
+        close(handoffsocket);
+        flagtaken = 1;
+        unlisten();
+      }
+  }
+}
+
+static int flagstop = 0;
+
+static void killworkers(int sig)
+{
+  unsigned long j;
+
+  for (j = 0;j < numworkers;++j)
+    if (pidworker[j]) kill(pidworker[j],sig);
+}
+
+static void forwardusr1(void) { killworkers(sig_usr1); }
+static void forwardterm(void) { flagstop = 1; killworkers(sig_term); }
+
+static void supervise(void)
+{
+  unsigned long j;
+  int pid;
+  int wstat;
+  int flagfailed = 0;
+
+  for (;;) {
+    pid = logwait(&wstat);
+    if (pid == -1) {
+      if (errno == error_intr) continue;
+      logbuf_drain();
+      _exit(flagfailed ? 111 : 0);
+    }
+    for (j = 0;j < numworkers;++j)
+      if (pidworker[j] == pid) pidworker[j] = 0;
+    if (!flagstop) {
+      flagfailed = 1;
+      forwardterm();
+    }
+  }
+}
+
+static int bind53(int s,char a[4])
+{
+  unsigned int i;
+  int r;
+
+  for (i = 0;;++i) {
+    if (numworkers > 1)
+      r = socket_bind4_reuseport(s,a,53);
+    else
+      r = socket_bind4_reuse(s,a,53);
+    if (r == 0) return 0;
+    if (!numhanded || (i >= HANDOFFWAIT)) return -1;
+    sleep(1); /* a predecessor may still hold the port */
+  }
+}
+
+/* 0 if all of x is addresses, else where it stops making sense */
+static char *iplist(char *x)
+{
+  unsigned int n;
+
+  for (;;) {
+    while ((*x == ',') || (*x == ' ')) ++x;
+    if (!*x) return 0;
+    if (numips == MAXIPS) return x;
+    n = ip4_scan(x,ips + 4 * numips);
+    if (!n) return x;
+    x += n;
+    if (*x && (*x != ',') && (*x != ' ')) return x;
+    ++numips;
+  }
+}
+
+static void pin(unsigned long cpu)
+{
+  if (cpupin(cpu) == -1)
+    strerr_die2sys(111,fatal,"unable to set CPU affinity: ");
+}
+
+static void closeworker(unsigned long i)
+{
+  unsigned int j;
+
+  for (j = 0;j < numips;++j) {
+    close(udpworker[i][j]);
+    if (tcpworker[i][j] != -1) close(tcpworker[i][j]);
+  }
+}
+
 int main()
 {
   char *x;
-  int udp53;
+  char *y;
+  char *pincpu;
+  char *xdp;
+  unsigned long xdpqueue;
+  unsigned long u;
+  unsigned long cpu;
+  unsigned long i;
+  unsigned int j;
+  unsigned int k;
+  int flagsteer;
+  int pid;
+  int r = 0;
+  char *handoff;
+  struct taia now;
+
+  x = env_get("EDNSBUFSIZE");
+  if (x) {
+    scan_ulong(x,&u);
+    if (u > EDNSMAX) u = EDNSMAX;
+    if (u >= 512) ednssize = u;
+  }
+
+  x = env_get("WORKERS");
+  if (x) {
+    scan_ulong(x,&numworkers);
+    if (numworkers < 1) numworkers = 1;
+    if (numworkers > MAXWORKERS) numworkers = MAXWORKERS;
+  }
+  if (env_get("LOGBINARY")) qlog_binary();
+  x = env_get("LOGSAMPLE");
+  if (x) {
+    scan_ulong(x,&u);
+    qlog_sample(u);
+  }
+  x = env_get("TOPN");
+  if (x) {
+    scan_ulong(x,&u);
+    qlog_topn(u);
+  }
+  x = env_get("ZONESTATS");
+  if (x) {
+    scan_ulong(x,&u);
+    if (zonestat_init(u) == -1)
+      strerr_die2x(111,fatal,"out of memory");
+  }
+  x = env_get("LOGRATE");
+  if (x) {
+    scan_ulong(x,&u);
+    qlog_ratelimit(u);
+  }
+  x = env_get("METRICS");
+  if (x)
+    if (metrics_init(x,numworkers) == -1)
+      strerr_die2sys(111,fatal,"unable to set up $METRICS: ");
+  x = env_get("PROFILE");
+  if (x) scan_ulong(x,&profilehz);
+  x = env_get("LOGBUFFER");
+  if (x) {
+    scan_ulong(x,&u);
+    if (logbuf_init(u) == -1)
+      strerr_die2x(111,fatal,"out of memory");
+  }
+  x = env_get("LOGRING");
+  if (x && (numworkers > 1)) {
+    scan_ulong(x,&u);
+    if (logbuf_ring(u) == -1)
+      strerr_die2x(111,fatal,"out of memory");
+  }
+  x = env_get("OVERLOAD");
+  if (x) {
+    scan_ulong(x,&u);
+    overload_init(u);
+  }
+  x = env_get("RATELIMIT");
+  if (x) {
+    scan_ulong(x,&rrlrate);
+    if (rrlrate > 65535) rrlrate = 65535;
+    x = env_get("RATESLIP");
+    if (x) scan_ulong(x,&rrlslip);
+    taia_now(&now);
+    rrlkey = now.nano ^ getpid();
+  }
+  flagtcp = 0;
+  if (env_get("TCP")) flagtcp = 1;
+  pincpu = env_get("PINCPU");
+  cpu = 0;
+  if (pincpu) scan_ulong(pincpu,&cpu);
+  flagsteer = pincpu && env_get("STEER") && (numworkers > 1);
+  xdp = env_get("XDP");
+  xdpqueue = 0;
+  x = env_get("XDPQUEUE");
+  if (x) scan_ulong(x,&xdpqueue);
 
   x = env_get("IP");
   if (!x)
     strerr_die2x(111,fatal,"$IP not set");
-  if (!ip4_scan(x,ip))
-    strerr_die3x(111,fatal,"unable to parse IP address ",x);
+  y = iplist(x);
+  if (y || !numips)
+    strerr_die3x(111,fatal,"unable to parse IP address ",y ? y : x);
+
+  handoff = env_get("HANDOFF");
+  if (handoff) {
+    numhanded = numworkers * numips * (flagtcp ? 2 : 1);
+    r = handoff_get(handoff,handed,numhanded);
+    if (r == -1)
+      strerr_die4sys(111,fatal,"unable to take sockets from ",handoff,": ");
+  }
+
+  k = 0;
+  for (i = 0;i < numworkers;++i)
+    for (j = 0;j < numips;++j) {
+      if (r > 0) {
+        udpworker[i][j] = handed[k++];
+        tcpworker[i][j] = flagtcp ? handed[k++] : -1;
+        continue;
+      }
+      udpworker[i][j] = socket_udp();
+      if (udpworker[i][j] == -1)
+        strerr_die2sys(111,fatal,"unable to create UDP socket: ");
+      if (bind53(udpworker[i][j],ips + 4 * j) == -1)
+        strerr_die2sys(111,fatal,"unable to bind UDP socket: ");
 
-  udp53 = socket_udp();
-  if (udp53 == -1)
-    strerr_die2sys(111,fatal,"unable to create UDP socket: ");
-  if (socket_bind4_reuse(udp53,ip,53) == -1)
-    strerr_die2sys(111,fatal,"unable to bind UDP socket: ");
+      tcpworker[i][j] = -1;
+      if (flagtcp) {
+        tcpworker[i][j] = socket_tcp();
+        if (tcpworker[i][j] == -1)
+          strerr_die2sys(111,fatal,"unable to create TCP socket: ");
+        if (bind53(tcpworker[i][j],ips + 4 * j) == -1)
+          strerr_die2sys(111,fatal,"unable to bind TCP socket: ");
+      }
+    }
+
+  if (handoff) {
+    k = 0;
+    for (i = 0;i < numworkers;++i)
+      for (j = 0;j < numips;++j) {
+        handed[k++] = udpworker[i][j];
+        if (flagtcp) handed[k++] = tcpworker[i][j];
+      }
+    handoffsocket = handoff_listen(handoff);
+    if (handoffsocket == -1)
+      strerr_die4sys(111,fatal,"unable to listen on ",handoff,": ");
+    ndelay_on(handoffsocket);
+  }
+
+  if (xdp) {
+    if (xsk_prog(xdp,ips,53) == -1)
+      strerr_die4sys(111,fatal,"unable to attach XDP program to ",xdp,": ");
+    for (i = 0;i < numworkers;++i)
+      if (xsk_open(&xsk[i],xdpqueue + i) == -1)
+        strerr_die2sys(111,fatal,"unable to create AF_XDP socket: ");
+  }
 
   droproot(fatal);
 
   initialize();
   
-  ndelay_off(udp53);
-  socket_tryreservein(udp53,65536);
+  for (i = 0;i < numworkers;++i)
+    for (j = 0;j < numips;++j) {
+      if (flagtcp || xdp || (numips > 1) || handoff)
+        ndelay_on(udpworker[i][j]);
+      else
+        ndelay_off(udpworker[i][j]);
+      if (flagtcp) {
+        if (socket_listen(tcpworker[i][j],20) == -1)
+          strerr_die2sys(111,fatal,"unable to listen on TCP socket: ");
+        ndelay_on(tcpworker[i][j]);
+      }
+      socket_tryreservein(udpworker[i][j],65536);
+    }
 
-  buffer_putsflush(buffer_2,starting);
+  if (flagsteer) /* after listen(), or TCP sockets would not share */
+    for (j = 0;j < numips;++j) {
+      if (socket_steercpu(udpworker[0][j],cpu,numworkers) == -1)
+        strerr_die2sys(111,fatal,"unable to steer queries by CPU: ");
+      if (flagtcp)
+        if (socket_steercpu(tcpworker[0][j],cpu,numworkers) == -1)
+          strerr_die2sys(111,fatal,"unable to steer connections by CPU: ");
+    }
 
-  for (;;) {
-    len = socket_recv4(udp53,buf,sizeof buf,ip,&port);
-    if (len < 0) continue;
-    if (!doit()) continue;
-    if (response_len > 512) response_tc();
-    socket_send4(udp53,response,response_len,ip,port);
-    /* may block for buffer space; if it fails, too bad */
+  if (numworkers == 1) {
+    if (pincpu) pin(cpu);
+    serve(udpworker[0],tcpworker[0],xdp ? xsk : 0);
+  }
+
+  sig_catch(sig_usr1,forwardusr1);
+  sig_catch(sig_term,forwardterm);
+
+  for (i = 0;i < numworkers;++i) {
+    pid = fork();
+    if (pid == -1) {
+      killworkers(sig_term);
+      strerr_die2sys(111,fatal,"unable to fork: ");
+    }
+    if (pid == 0) {
+      if (pincpu) pin(cpu + i); /* before touching anything of its own */
+      sig_uncatch(sig_term);
+      worker = i;
+      metrics_worker(i);
+      if (!handoff)
+        for (u = 0;u < numworkers;++u)
+          if (u != i) closeworker(u);
+      serve(udpworker[i],tcpworker[i],xdp ? xsk + i : 0);
+    }
+    pidworker[i] = pid;
   }
+  for (i = 0;i < numworkers;++i)
+    closeworker(i);
+  if (handoffsocket != -1) close(handoffsocket);
+  supervise();
 }
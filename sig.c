@@ -0,0 +1,11 @@
+#include <signal.h>
+#include "sig.h"
+
+int sig_hangup = SIGHUP;
+int sig_term = SIGTERM;
+int sig_pipe = SIGPIPE;
+int sig_usr1 = SIGUSR1;
+int sig_usr2 = SIGUSR2;
+
+void (*sig_defaulthandler)() = SIG_DFL;
+void (*sig_ignorehandler)() = SIG_IGN;
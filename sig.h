@@ -0,0 +1,16 @@
+#ifndef SIG_H
+#define SIG_H
+
+extern int sig_hangup;
+extern int sig_term;
+extern int sig_pipe;
+extern int sig_usr1;
+extern int sig_usr2;
+
+extern void sig_catch(int,void (*)());
+#define sig_ignore(s) (sig_catch((s),sig_ignorehandler))
+#define sig_uncatch(s) (sig_catch((s),sig_defaulthandler))
+extern void (*sig_defaulthandler)();
+extern void (*sig_ignorehandler)();
+
+#endif
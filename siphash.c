@@ -0,0 +1,55 @@
+#include "uint64.h"
+#include "siphash.h"
+
+/* SipHash-2-4, Aumasson and Bernstein */
+
+#define ROTATE(x,b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define ROUND \
+  v0 += v1; v1 = ROTATE(v1,13); v1 ^= v0; v0 = ROTATE(v0,32); \
+  v2 += v3; v3 = ROTATE(v3,16); v3 ^= v2; \
+  v0 += v3; v3 = ROTATE(v3,21); v3 ^= v0; \
+  v2 += v1; v1 = ROTATE(v1,17); v1 ^= v2; v2 = ROTATE(v2,32);
+
+#define CONSTANT(hi,lo) ((((uint64) (hi)) << 32) | (uint64) (lo))
+
+static uint64 unpack(const char *s,unsigned int len)
+{
+  uint64 result = 0;
+
+  while (len) {
+    --len;
+    result <<= 8;
+    result += (unsigned char) s[len];
+  }
+  return result;
+}
+
+uint64 siphash(const char key[16],const char *in,unsigned int len)
+{
+  uint64 k0 = unpack(key,8);
+  uint64 k1 = unpack(key + 8,8);
+  uint64 v0 = k0 ^ CONSTANT(0x736f6d65,0x70736575);
+  uint64 v1 = k1 ^ CONSTANT(0x646f7261,0x6e646f6d);
+  uint64 v2 = k0 ^ CONSTANT(0x6c796765,0x6e657261);
+  uint64 v3 = k1 ^ CONSTANT(0x74656462,0x79746573);
+  uint64 m;
+  unsigned int n = len;
+
+  while (n >= 8) {
+    m = unpack(in,8);
+    v3 ^= m;
+    ROUND ROUND
+    v0 ^= m;
+    in += 8;
+    n -= 8;
+  }
+
+  m = unpack(in,n) | (((uint64) (len & 255)) << 56);
+  v3 ^= m;
+  ROUND ROUND
+  v0 ^= m;
+
+  v2 ^= 255;
+  ROUND ROUND ROUND ROUND
+  return v0 ^ v1 ^ v2 ^ v3;
+}
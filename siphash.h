@@ -0,0 +1,8 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include "uint64.h"
+
+extern uint64 siphash(const char [16],const char *,unsigned int);
+
+#endif
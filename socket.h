@@ -2,21 +2,41 @@
 #define SOCKET_H
 
 #include "uint16.h"
+#include "uint32.h"
 
 extern int socket_tcp(void);
 extern int socket_udp(void);
+extern int socket_tcp6(void);
+extern int socket_udp6(void);
 
 extern int socket_connect4(int,const char *,uint16);
+extern int socket_connect6(int,const char *,uint16);
 extern int socket_connected(int);
 extern int socket_bind4(int,char *,uint16);
+extern int socket_bind6(int,const char *,uint16);
 extern int socket_bind4_reuse(int,char *,uint16);
+extern int socket_bind4_reuseport(int,char *,uint16);
 extern int socket_listen(int,int);
 extern int socket_accept4(int,char *,uint16 *);
 extern int socket_recv4(int,char *,int,char *,uint16 *);
 extern int socket_send4(int,const char *,int,const char *,uint16);
+extern int socket_recv6(int,char *,int,char *,uint16 *);
+extern int socket_send6(int,const char *,int,const char *,uint16);
 extern int socket_local4(int,char *,uint16 *);
 extern int socket_remote4(int,char *,uint16 *);
 
 extern void socket_tryreservein(int,int);
+extern int socket_backlog(int,uint32 *,uint32 *,uint32 *);
+extern int socket_steercpu(int,unsigned long,unsigned long);
+
+struct socket_dgram {
+  char *buf;
+  int len;
+  char ip[4];
+  uint16 port;
+} ;
+
+extern int socket_recv4_many(int,struct socket_dgram *,unsigned int,int);
+extern int socket_send4_many(int,struct socket_dgram *,unsigned int);
 
 #endif
@@ -0,0 +1,33 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include "error.h"
+#include "socket.h"
+#include "hasmeminfo.h"
+#ifdef HASMEMINFO
+#include <linux/sock_diag.h>
+#endif
+
+/*
+0 with *queued the bytes of datagrams waiting to be read on s, *size
+the most the kernel will let wait there, and *drops the kernel's
+running count of datagrams it threw away for want of room; -1 if the
+system cannot say.
+*/
+int socket_backlog(int s,uint32 *queued,uint32 *size,uint32 *drops)
+{
+#ifdef HASMEMINFO
+  uint32 m[SK_MEMINFO_VARS];
+  socklen_t len = sizeof m;
+
+  if (getsockopt(s,SOL_SOCKET,SO_MEMINFO,m,&len) == -1) return -1;
+  if (len <= SK_MEMINFO_DROPS * sizeof(uint32)) { errno = error_proto; return -1; }
+  *queued = m[SK_MEMINFO_RMEM_ALLOC];
+  *size = m[SK_MEMINFO_RCVBUF];
+  *drops = m[SK_MEMINFO_DROPS];
+  return 0;
+#else
+  errno = error_proto;
+  return -1;
+#endif
+}
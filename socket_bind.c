@@ -17,6 +17,18 @@ int socket_bind4(int s,char ip[4],uint16 port)
   return bind(s,(struct sockaddr *) &sa,sizeof sa);
 }
 
+int socket_bind6(int s,const char ip[16],uint16 port)
+{
+  struct sockaddr_in6 sa;
+
+  byte_zero(&sa,sizeof sa);
+  sa.sin6_family = AF_INET6;
+  uint16_pack_big((char *) &sa.sin6_port,port);
+  byte_copy((char *) &sa.sin6_addr,16,ip);
+
+  return bind(s,(struct sockaddr *) &sa,sizeof sa);
+}
+
 int socket_bind4_reuse(int s,char ip[4],uint16 port)
 {
   int opt = 1;
@@ -24,6 +36,16 @@ int socket_bind4_reuse(int s,char ip[4],uint16 port)
   return socket_bind4(s,ip,port);
 }
 
+int socket_bind4_reuseport(int s,char ip[4],uint16 port)
+{
+  int opt = 1;
+  setsockopt(s,SOL_SOCKET,SO_REUSEADDR,&opt,sizeof opt);
+#ifdef SO_REUSEPORT
+  setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof opt);
+#endif
+  return socket_bind4(s,ip,port);
+}
+
 void socket_tryreservein(int s,int size)
 {
   while (size >= 1024) {
@@ -18,9 +18,21 @@ int socket_connect4(int s,const char ip[4],uint16 port)
   return connect(s,(struct sockaddr *) &sa,sizeof sa);
 }
 
+int socket_connect6(int s,const char ip[16],uint16 port)
+{
+  struct sockaddr_in6 sa;
+
+  byte_zero(&sa,sizeof sa);
+  sa.sin6_family = AF_INET6;
+  uint16_pack_big((char *) &sa.sin6_port,port);
+  byte_copy((char *) &sa.sin6_addr,16,ip);
+
+  return connect(s,(struct sockaddr *) &sa,sizeof sa);
+}
+
 int socket_connected(int s)
 {
-  struct sockaddr_in sa;
+  struct sockaddr_in6 sa; /* room for either */
   int dummy;
   char ch;
 
@@ -19,3 +19,18 @@ int socket_recv4(int s,char *buf,int len,char ip[4],uint16 *port)
 
   return r;
 }
+
+int socket_recv6(int s,char *buf,int len,char ip[16],uint16 *port)
+{
+  struct sockaddr_in6 sa;
+  int dummy = sizeof sa;
+  int r;
+
+  r = recvfrom(s,buf,len,0,(struct sockaddr *) &sa,&dummy);
+  if (r == -1) return -1;
+
+  byte_copy(ip,16,(char *) &sa.sin6_addr);
+  uint16_unpack_big((char *) &sa.sin6_port,port);
+
+  return r;
+}
@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "byte.h"
+#include "socket.h"
+#include "hasmmsg.h"
+
+#ifdef HASMMSG
+
+#define MANY 64
+
+int socket_recv4_many(int s,struct socket_dgram *d,unsigned int n,int size)
+{
+  struct mmsghdr m[MANY];
+  struct iovec iov[MANY];
+  struct sockaddr_in sa[MANY];
+  int r;
+  int i;
+
+  if (n > MANY) n = MANY;
+  byte_zero(m,n * sizeof(struct mmsghdr));
+  for (i = 0;i < n;++i) {
+    iov[i].iov_base = d[i].buf;
+    iov[i].iov_len = size;
+    m[i].msg_hdr.msg_name = (char *) &sa[i];
+    m[i].msg_hdr.msg_namelen = sizeof sa[i];
+    m[i].msg_hdr.msg_iov = &iov[i];
+    m[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  r = recvmmsg(s,m,n,MSG_WAITFORONE,(struct timespec *) 0);
+  if (r == -1) return -1;
+
+  for (i = 0;i < r;++i) {
+    d[i].len = m[i].msg_len;
+    byte_copy(d[i].ip,4,(char *) &sa[i].sin_addr);
+    uint16_unpack_big((char *) &sa[i].sin_port,&d[i].port);
+  }
+  return r;
+}
+
+#else
+
+int socket_recv4_many(int s,struct socket_dgram *d,unsigned int n,int size)
+{
+  if (!n) return 0;
+  d->len = socket_recv4(s,d->buf,size,d->ip,&d->port);
+  if (d->len == -1) return -1;
+  return 1;
+}
+
+#endif
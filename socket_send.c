@@ -16,3 +16,15 @@ int socket_send4(int s,const char *buf,int len,const char ip[4],uint16 port)
 
   return sendto(s,buf,len,0,(struct sockaddr *) &sa,sizeof sa);
 }
+
+int socket_send6(int s,const char *buf,int len,const char ip[16],uint16 port)
+{
+  struct sockaddr_in6 sa;
+
+  byte_zero(&sa,sizeof sa);
+  sa.sin6_family = AF_INET6;
+  uint16_pack_big((char *) &sa.sin6_port,port);
+  byte_copy((char *) &sa.sin6_addr,16,ip);
+
+  return sendto(s,buf,len,0,(struct sockaddr *) &sa,sizeof sa);
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "byte.h"
+#include "socket.h"
+#include "hasmmsg.h"
+
+#ifdef HASMMSG
+
+#define MANY 64
+
+int socket_send4_many(int s,struct socket_dgram *d,unsigned int n)
+{
+  struct mmsghdr m[MANY];
+  struct iovec iov[MANY];
+  struct sockaddr_in sa[MANY];
+  unsigned int numsent = 0;
+  unsigned int pos = 0;
+  unsigned int k;
+  int i;
+  int r;
+
+  while (pos < n) {
+    k = n - pos;
+    if (k > MANY) k = MANY;
+    byte_zero(m,k * sizeof(struct mmsghdr));
+    byte_zero(sa,k * sizeof(struct sockaddr_in));
+    for (i = 0;i < k;++i) {
+      sa[i].sin_family = AF_INET;
+      uint16_pack_big((char *) &sa[i].sin_port,d[pos + i].port);
+      byte_copy((char *) &sa[i].sin_addr,4,d[pos + i].ip);
+      iov[i].iov_base = d[pos + i].buf;
+      iov[i].iov_len = d[pos + i].len;
+      m[i].msg_hdr.msg_name = (char *) &sa[i];
+      m[i].msg_hdr.msg_namelen = sizeof sa[i];
+      m[i].msg_hdr.msg_iov = &iov[i];
+      m[i].msg_hdr.msg_iovlen = 1;
+    }
+    r = sendmmsg(s,m,k,0);
+    if (r <= 0) { ++pos; continue; } /* skip the datagram that failed */
+    pos += r;
+    numsent += r;
+  }
+  return numsent;
+}
+
+#else
+
+int socket_send4_many(int s,struct socket_dgram *d,unsigned int n)
+{
+  unsigned int numsent = 0;
+  unsigned int i;
+
+  for (i = 0;i < n;++i)
+    if (socket_send4(s,d[i].buf,d[i].len,d[i].ip,d[i].port) != -1)
+      ++numsent;
+  return numsent;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include "error.h"
+#include "socket.h"
+#include "hassteer.h"
+#ifdef HASSTEER
+#include <linux/filter.h>
+#endif
+
+/*
+Hands each datagram or connection for the SO_REUSEPORT group of s to
+the member, counting in the order they were bound from 0, numbered
+(c - base) modulo n, where c is the CPU the kernel took it in on. So
+if member i runs on CPU base + i, everything stays on the CPU that
+saw it first. -1 if the system cannot do that.
+*/
+int socket_steercpu(int s,unsigned long base,unsigned long n)
+{
+#ifdef HASSTEER
+  struct sock_filter code[4];
+  struct sock_fprog prog;
+
+  if (!n) n = 1;
+  code[0].code = BPF_LD | BPF_W | BPF_ABS;
+  code[0].k = SKF_AD_OFF + SKF_AD_CPU;
+  code[1].code = BPF_ALU | BPF_ADD | BPF_K;
+  code[1].k = n - base % n;
+  code[2].code = BPF_ALU | BPF_MOD | BPF_K;
+  code[2].k = n;
+  code[3].code = BPF_RET | BPF_A;
+  code[3].k = 0;
+  code[0].jt = code[1].jt = code[2].jt = code[3].jt = 0;
+  code[0].jf = code[1].jf = code[2].jf = code[3].jf = 0;
+  prog.len = 4;
+  prog.filter = code;
+  return setsockopt(s,SOL_SOCKET,SO_ATTACH_REUSEPORT_CBPF,&prog,sizeof prog);
+#else
+  errno = error_proto;
+  return -1;
+#endif
+}
@@ -15,3 +15,13 @@ int socket_tcp(void)
   if (ndelay_on(s) == -1) { close(s); return -1; }
   return s;
 }
+
+int socket_tcp6(void)
+{
+  int s;
+
+  s = socket(AF_INET6,SOCK_STREAM,0);
+  if (s == -1) return -1;
+  if (ndelay_on(s) == -1) { close(s); return -1; }
+  return s;
+}
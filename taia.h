@@ -12,6 +12,8 @@ struct taia {
 extern void taia_tai(const struct taia *,struct tai *);
 
 extern void taia_now(struct taia *);
+extern void taia_clock(struct taia *);
+extern void taia_tick(struct taia *);
 
 extern double taia_approx(const struct taia *);
 extern double taia_frac(const struct taia *);
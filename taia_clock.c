@@ -0,0 +1,44 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include "hasmono.h"
+#include "taia.h"
+
+/*
+taia_clock() is the clock for deadlines and durations: monotonic where
+the system has one, so it does not jump with the wall clock. Its
+epoch is arbitrary; compare it only with itself. A program that calls
+taia_tick() once per wakeup gets that reading back from every
+taia_clock() call until the next tick, instead of a system call each.
+*/
+
+static struct taia ticked;
+static int flagticked = 0;
+
+static void readclock(struct taia *t)
+{
+#ifdef HASMONO
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  tai_unix(&t->sec,ts.tv_sec);
+  t->nano = ts.tv_nsec;
+  t->atto = 0;
+#else
+  taia_now(t);
+#endif
+}
+
+void taia_tick(struct taia *t)
+{
+  readclock(&ticked);
+  flagticked = 1;
+  *t = ticked;
+}
+
+void taia_clock(struct taia *t)
+{
+  if (flagticked)
+    *t = ticked;
+  else
+    readclock(t);
+}
@@ -1,18 +1,26 @@
-#include <unistd.h>
 #include "uint16.h"
-#include "open.h"
 #include "tai.h"
 #include "cdb.h"
+#include "cdbmap.h"
+#include "clientloc.h"
 #include "byte.h"
 #include "case.h"
 #include "dns.h"
 #include "seek.h"
 #include "response.h"
+#include "alloc.h"
+#include "metrics.h"
+#include "perfcount.h"
+#include "profile.h"
+#include "env.h"
+#include "namefilter.h"
+#include "txtdict.h"
+#include "zonestat.h"
 
 static int want(const char *owner,const char type[2])
 {
   unsigned int pos;
-  static char *d;
+  static char d[DNS_NAME];
   char x[10];
   uint16 datalen;
 
@@ -20,7 +28,7 @@ static int want(const char *owner,const char type[2])
   pos += 4;
 
   while (pos < response_len) {
-    pos = dns_packet_getname(response,response_len,pos,&d); if (!pos) return 0;
+    pos = dns_packet_getnamebuf(response,response_len,pos,d); if (!pos) return 0;
     pos = dns_packet_copy(response,response_len,pos,x,10); if (!pos) return 0;
     if (dns_domain_equal(d,owner))
       if (byte_equal(type,2,x))
@@ -31,36 +39,101 @@ static int want(const char *owner,const char type[2])
   return 1;
 }
 
-static char *d1;
+static char d1[DNS_NAME];
 
 static char clientloc[2];
 static struct tai now;
 static struct cdb c;
+static struct cdb *db = &c; /* c, or delta for names it has */
 
-static char data[32767];
+static char databuf[32767];
+static const char *data; /* into the cdb map, or else databuf */
 static uint32 dlen;
 static unsigned int dpos;
 static char type[2];
 static uint32 ttl;
+static int flagpacked; /* data from dpos on is packed; see unpack() */
 
-static int find(char *d,int flagwild)
+/* what the answer being built depends on, for the answer cache */
+static int flagexpire;
+static struct tai expire; /* if flagexpire: answer may change now */
+static int flagcacheable;
+static int flagchild;
+static int flagnx;
+static unsigned int zonelen; /* the zone cut found: the last zonelen bytes of q */
+static int flagminimal = -1; /* -1 until respond() looks */
+static int flagminimalany; /* 1: one RRset for ANY; 2: HINFO instead */
+static unsigned int apos; /* start of shuffled A records in answer */
+static unsigned int anum;
+
+static void soonest(const struct tai *t)
+{
+  if (!flagexpire || tai_less(t,&expire)) expire = *t;
+  flagexpire = 1;
+}
+
+static const char *qkey; /* q as given to respond() */
+static uint32 qhash; /* cdb_hash() of qkey */
+
+/*
+Location index from tinydns-data: records for one location other
+than the root's are under their owner key and then the location.
+Once findkey() has read the records under a key, it goes on to that
+key and clientloc, and the caller sees one search.
+*/
+
+static int flaglocindex;
+static char lkey[263];
+static unsigned int lkeylen; /* 0 unless findkey() is reading lkey */
+
+static int findkey(const char *key,unsigned int len,int flagwild)
 {
+  const char *k = key;
+  unsigned int klen = len;
   int r;
   char ch;
   struct tai cutoff;
+  struct tai next;
+  struct tai one;
   char ttd[8];
   char ttlstr[4];
   char recordloc[2];
   double newttl;
 
+  if (lkeylen) {
+    if (db->loop && (lkeylen == len + 2) && byte_equal(lkey,len,key)) {
+      k = lkey;
+      klen = lkeylen;
+    }
+    else
+      lkeylen = 0;
+  }
+  if ((k == qkey) && !db->loop) cdb_findstarthash(db,qhash);
   for (;;) {
-    r = cdb_findnext(&c,d,dns_domain_length(d));
-    if (r <= 0) return r;
-    dlen = cdb_datalen(&c);
-    if (dlen > sizeof data) return -1;
-    if (cdb_read(&c,data,dlen,cdb_datapos(&c)) == -1) return -1;
+    r = cdb_findnext(db,k,klen);
+    if (r == -1) return -1;
+    if (!r) {
+      if (lkeylen || !flaglocindex || byte_equal(clientloc,2,"\0\0")) {
+        lkeylen = 0;
+        return 0;
+      }
+      if ((len == 1) || ((len == 5) && !key[0])) return 0; /* the root */
+      byte_copy(lkey,len,key);
+      byte_copy(lkey + len,2,clientloc);
+      k = lkey;
+      klen = lkeylen = len + 2;
+      cdb_findstart(db);
+      continue;
+    }
+    dlen = cdb_datalen(db);
+    if (dlen > sizeof databuf) return -1;
+    data = cdb_get(db,databuf,dlen,cdb_datapos(db));
+    if (!data) return -1;
     dpos = dns_packet_copy(data,dlen,0,type,2); if (!dpos) return -1;
+    if (byte_equal(type,2,"\0\0")) continue; /* tombstone */
     dpos = dns_packet_copy(data,dlen,dpos,&ch,1); if (!dpos) return -1;
+    flagpacked = !!(ch & 128);
+    ch &= 127;
     if ((ch == '=' + 1) || (ch == '*' + 1)) {
       --ch;
       dpos = dns_packet_copy(data,dlen,dpos,recordloc,2); if (!dpos) return -1;
@@ -72,8 +145,11 @@ static int find(char *d,int flagwild)
     dpos = dns_packet_copy(data,dlen,dpos,ttd,8); if (!dpos) return -1;
     if (byte_diff(ttd,8,"\0\0\0\0\0\0\0\0")) {
       tai_unpack(ttd,&cutoff);
+      tai_uint(&one,1);
       if (ttl == 0) {
 	if (tai_less(&cutoff,&now)) continue;
+	tai_add(&next,&now,&one);
+	soonest(&next);
 	tai_sub(&cutoff,&cutoff,&now);
 	newttl = tai_approx(&cutoff);
 	if (newttl <= 2.0) newttl = 2.0;
@@ -81,26 +157,331 @@ static int find(char *d,int flagwild)
 	ttl = newttl;
       }
       else
-	if (!tai_less(&cutoff,&now)) continue;
+	if (!tai_less(&cutoff,&now)) {
+	  tai_add(&next,&cutoff,&one);
+	  soonest(&next);
+	  continue;
+	}
     }
     return 1;
   }
 }
 
+/*
+Name filter from tinydns-data, read in place from the map: a name
+it does not have is not in data.cdb, and the hash tables need not be
+read for it. Names found in delta/data.cdb are looked up as before.
+*/
+
+static const char *filter;
+static uint32 filterbits;
+static unsigned int filterk;
+
+static void filter_init(void)
+{
+  uint32 len;
+
+  filter = 0;
+  if (!c.map) return;
+  if (cdb_find(&c,"\0b",2) != 1) return;
+  len = cdb_datalen(&c);
+  if ((len < 2) || (cdb_datapos(&c) + len > c.size)) return;
+  filterk = (unsigned char) c.map[cdb_datapos(&c)];
+  filterbits = (len - 1) * 8;
+  filter = c.map + cdb_datapos(&c) + 1;
+}
+
+/* 1 if data.cdb may have d */
+static int maybe(const char *d)
+{
+  uint32 h[2];
+
+  if (!filter) return 1;
+  namefilter_hash(d,h);
+  return namefilter_test(filter,filterbits,filterk,h);
+}
+
+/* 1 if db, as picked by start(), surely does not have d */
+static int absent(const char *d)
+{
+  return (db == &c) && !maybe(d);
+}
+
+/* findkey(), profiled as reading data.cdb */
+static int findcdb(const char *key,unsigned int len,int flagwild)
+{
+  int r;
+  PROFILE_ENTER(PROFILE_CDB)
+
+  r = findkey(key,len,flagwild);
+  PROFILE_LEAVE
+  return r;
+}
+
+static int find(const char *d,int flagwild)
+{
+  if (absent(d)) return 0;
+  return findcdb(d,dns_domain_length(d),flagwild);
+}
+
+static int flagtypeindex;
+static int flagcutindex;
+static int flagwildindex;
+
+/*
+TXT dictionary from tinydns-data, under "\0c": records whose flag
+byte has its high bit set hold their data packed against it, and
+unpack() unpacks the data of the record just found, once it is
+clear the record goes into the answer.
+*/
+
+static char dictbase[TXTDICT_MAX];
+static char dictdelta[TXTDICT_MAX];
+static unsigned int dictbaselen;
+static unsigned int dictdeltalen;
+static const char *dict;
+static unsigned int dictlen;
+static char unpacked[32767];
+
+static unsigned int dict_init(struct cdb *x,char *buf)
+{
+  uint32 len;
+
+  if (cdb_find(x,"\0c",2) != 1) return 0;
+  len = cdb_datalen(x);
+  if (len > TXTDICT_MAX) return 0;
+  if (cdb_read(x,buf,len,cdb_datapos(x)) == -1) return 0;
+  return len;
+}
+
+static int unpack(void)
+{
+  int r;
+
+  if (!flagpacked) return 1;
+  r = txtdict_unpack(dict,dictlen,data + dpos,dlen - dpos,unpacked,sizeof unpacked);
+  if (r == -1) return 0;
+  data = unpacked;
+  dpos = 0;
+  dlen = r;
+  flagpacked = 0;
+  return 1;
+}
+
+/*
+Delta overlay: delta/data.cdb, built by tinydns-data in the delta
+directory, replaces everything data.cdb has under each name it has,
+including the records of the wildcard below that name. A ~ line there
+leaves only a tombstone, which find() skips. start() picks the cdb
+for d and starts a search in it.
+*/
+
+static struct cdb delta;
+static int flagdelta;
+static int flagtypebase;
+static int flaglocbase;
+static int flagcutbase;
+static int flagwildbase;
+static int flagtypedelta;
+static int flaglocdelta;
+static int flagcutdelta;
+static int flagwilddelta;
+
+static int start(const char *d)
+{
+  int r;
+
+  db = &c;
+  flagtypeindex = flagtypebase;
+  flaglocindex = flaglocbase;
+  flagcutindex = flagcutbase;
+  flagwildindex = flagwildbase;
+  dict = dictbase;
+  dictlen = dictbaselen;
+  if (flagdelta) {
+    if (d == qkey) {
+      cdb_findstarthash(&delta,qhash);
+      r = cdb_findnext(&delta,d,dns_domain_length(d));
+    }
+    else
+      r = cdb_find(&delta,d,dns_domain_length(d));
+    if (r == -1) return -1;
+    if (r) {
+      db = &delta;
+      flagtypeindex = flagtypedelta;
+      flaglocindex = flaglocdelta;
+      flagcutindex = flagcutdelta;
+      flagwildindex = flagwilddelta;
+      dict = dictdelta;
+      dictlen = dictdeltalen;
+    }
+  }
+  cdb_findstart(db);
+  return 0;
+}
+
+/*
+Type index from tinydns-data: each record also under "\0t", type,
+owner. findtype() returns records of type t and maybe others; without
+the index it is find().
+*/
+
+static char tkey[259];
+
+static int findtype(const char *d,const char t[2],int flagwild)
+{
+  unsigned int len;
+
+  if (!flagtypeindex) return find(d,flagwild);
+  if (absent(d)) return 0;
+  len = dns_domain_length(d);
+  byte_copy(tkey,2,"\0t");
+  byte_copy(tkey + 2,2,t);
+  byte_copy(tkey + 4,len,d);
+  return findcdb(tkey,len + 4,flagwild);
+}
+
+/*
+Records of type qtype, else CNAME records. A CNAME cannot share its
+owner with other data, so once qtype records turn up the CNAME probe
+is skipped.
+*/
+
+static int answerpass;
+
+/*
+With $MINIMALANY, ANY gets the RRset of the first record at the name,
+as RFC 8482 allows; with the type index, the rest of the name is not
+looked at.
+*/
+
+static char anytype[2];
+
+static int findany(const char *d,int flagwild)
+{
+  int r;
+
+  if (!answerpass) {
+    r = find(d,flagwild);
+    if (r <= 0) return r;
+    byte_copy(anytype,2,type);
+    answerpass = 1;
+    if (!flagtypeindex || (flagminimalany == 2)) return 1;
+    cdb_findstart(db);
+  }
+  if (flagtypeindex) return findtype(d,anytype,flagwild);
+  while (r = find(d,flagwild)) {
+    if (r == -1) return -1;
+    if (byte_equal(type,2,anytype)) return 1;
+  }
+  return 0;
+}
+
+static int findanswer(const char *d,const char qtype[2],int flagwild)
+{
+  int r;
+
+  if (byte_equal(qtype,2,DNS_T_ANY) && flagminimalany) return findany(d,flagwild);
+  if (!flagtypeindex || byte_equal(qtype,2,DNS_T_ANY)) return find(d,flagwild);
+  if (answerpass == 1) return findtype(d,DNS_T_CNAME,flagwild);
+  r = findtype(d,qtype,flagwild);
+  if (r) { answerpass = 2; return r; }
+  if (answerpass == 2) return 0;
+  if (byte_equal(qtype,2,DNS_T_CNAME)) return 0;
+  answerpass = 1;
+  cdb_findstart(db);
+  return findtype(d,DNS_T_CNAME,flagwild);
+}
+
+/*
+Zone cut index from tinydns-data; see there. cut() also says
+CUT_WILD whenever the index cannot rule out wildcard records.
+*/
+
+#define CUT_NS 1
+#define CUT_SOA 2
+#define CUT_SCAN 4
+#define CUT_WILD 8
+
+static unsigned int cutkey(char key[257],const char *d)
+{
+  unsigned int len;
+
+  len = dns_domain_length(d);
+  byte_copy(key,2,"\0/");
+  byte_copy(key + 2,len,d);
+  return len + 2;
+}
+
+/* start fetching the index entries for d and all its parents */
+
+static void cutprefetch(const char *d)
+{
+  char key[257];
+
+  if (!flagcutbase) return;
+  for (;;) {
+    if (maybe(d)) cdb_prefetch(&c,key,cutkey(key,d));
+    if (!*d) return;
+    d += *d;
+    d += 1;
+  }
+}
+
+static int cut(const char *d)
+{
+  char key[257];
+  unsigned int len;
+  char flags;
+  char ch;
+  int r;
+
+  if (start(d) == -1) return -1;
+  if (absent(d)) return 0;
+  if (!flagcutindex) return CUT_SCAN | CUT_WILD;
+  len = cutkey(key,d);
+
+  flags = flagwildindex ? 0 : CUT_WILD;
+  while (r = cdb_findnext(db,key,len)) {
+    if (r == -1) return -1;
+    if (cdb_datalen(db) != 1) return CUT_SCAN | CUT_WILD;
+    if (cdb_read(db,&ch,1,cdb_datapos(db)) == -1) return -1;
+    flags |= ch;
+  }
+  return flags;
+}
+
+/*
+Record data in data.cdb is already in wire format, with names
+uncompressed, so it goes into the response straight from the map:
+dobytes() copies once, and doname() only checks that the name is
+whole before response_addname() compresses it in place.
+*/
+
 static int dobytes(unsigned int len)
 {
-  char buf[20];
-  if (len > 20) return 0;
-  dpos = dns_packet_copy(data,dlen,dpos,buf,len);
-  if (!dpos) return 0;
-  return response_addbytes(buf,len);
+  if (len > dlen - dpos) return 0;
+  if (!response_addbytes(data + dpos,len)) return 0;
+  dpos += len;
+  return 1;
 }
 
 static int doname(void)
 {
-  dpos = dns_packet_getname(data,dlen,dpos,&d1);
-  if (!dpos) return 0;
-  return response_addname(d1);
+  unsigned int pos;
+  unsigned char len;
+
+  pos = dpos;
+  do {
+    if (pos >= dlen) return 0;
+    len = data[pos];
+    if (len >= 64) return 0;
+    pos += 1 + len;
+    if (pos - dpos > 255) return 0;
+  } while (len);
+  if (!response_addname(data + dpos)) return 0;
+  dpos = pos;
+  return 1;
 }
 
 static int doit(char *q,char qtype[2])
@@ -111,6 +492,7 @@ static int doit(char *q,char qtype[2])
   unsigned int arpos;
   char *control;
   char *wild;
+  char wildat[256]; /* by offset in q: cut() said CUT_WILD there */
   int flaggavesoa;
   int flagfound;
   int r;
@@ -125,24 +507,34 @@ static int doit(char *q,char qtype[2])
 
   anpos = response_len;
 
+  cutprefetch(q);
   control = q;
   for (;;) {
-    flagns = 0;
-    flagauthoritative = 0;
-    cdb_findstart(&c);
-    while (r = find(control,0)) {
-      if (r == -1) return 0;
-      if (byte_equal(type,2,DNS_T_SOA)) flagauthoritative = 1;
-      if (byte_equal(type,2,DNS_T_NS)) flagns = 1;
+    r = cut(control);
+    if (r == -1) return 0;
+    wildat[control - q] = r & CUT_WILD;
+    flagns = r & CUT_NS;
+    flagauthoritative = r & CUT_SOA;
+    if (r & CUT_SCAN) {
+      flagns = 0;
+      flagauthoritative = 0;
+      cdb_findstart(db);
+      while (r = find(control,0)) {
+        if (r == -1) return 0;
+        if (byte_equal(type,2,DNS_T_SOA)) flagauthoritative = 1;
+        if (byte_equal(type,2,DNS_T_NS)) flagns = 1;
+      }
     }
     if (flagns) break;
     if (!*control) return 0; /* q is not within our bailiwick */
     control += *control;
     control += 1;
   }
+  zonelen = dns_domain_length(control);
 
   if (!flagauthoritative) {
     response[2] &= ~4;
+    flagchild = 1;
     goto AUTHORITY; /* q is in a child zone */
   }
 
@@ -152,14 +544,27 @@ static int doit(char *q,char qtype[2])
   wild = q;
 
   for (;;) {
+    if ((wild != q) && !wildat[wild - q]) { /* no *.wild */
+      if (wild == control) break;
+      wild += *wild;
+      wild += 1;
+      continue;
+    }
     addrnum = 0;
     addrttl = 0;
-    cdb_findstart(&c);
-    while (r = find(wild,wild != q)) {
+    if (start(wild) == -1) return 0;
+    answerpass = 0;
+    while (r = findanswer(wild,qtype,wild != q)) {
       if (r == -1) return 0;
       flagfound = 1;
       if (flaggavesoa && byte_equal(type,2,DNS_T_SOA)) continue;
       if (byte_diff(type,2,qtype) && byte_diff(qtype,2,DNS_T_ANY) && byte_diff(type,2,DNS_T_CNAME)) continue;
+      if ((flagminimalany == 2) && byte_equal(qtype,2,DNS_T_ANY)) {
+        if (!response_rstart(q,DNS_T_HINFO,3600)) return 0;
+        if (!response_addbytes("\7RFC8482\0",9)) return 0;
+        response_rfinish(RESPONSE_ANSWER);
+        break;
+      }
       if (byte_equal(type,2,DNS_T_A) && (dlen - dpos == 4)) {
 	addrttl = ttl;
 	i = dns_random(addrnum + 1);
@@ -185,10 +590,15 @@ static int doit(char *q,char qtype[2])
 	if (!dobytes(20)) return 0;
         flaggavesoa = 1;
       }
-      else
+      else {
+        if (!unpack()) return 0;
         if (!response_addbytes(data + dpos,dlen - dpos)) return 0;
+      }
       response_rfinish(RESPONSE_ANSWER);
     }
+    if (addrnum > 8) flagcacheable = 0;
+    apos = response_len;
+    anum = addrnum;
     for (i = 0;i < addrnum;++i)
       if (i < 8) {
 	if (!response_rstart(q,DNS_T_A,addrttl)) return 0;
@@ -196,6 +606,12 @@ static int doit(char *q,char qtype[2])
 	response_rfinish(RESPONSE_ANSWER);
       }
 
+    if (!flagfound && flagtypeindex) {
+      cdb_findstart(db);
+      r = find(wild,wild != q);
+      if (r == -1) return 0;
+      flagfound = r;
+    }
     if (flagfound) break;
     if (wild == control) break;
     if (!*wild) break; /* impossible */
@@ -203,16 +619,21 @@ static int doit(char *q,char qtype[2])
     wild += 1;
   }
 
-  if (!flagfound)
+  if (!flagfound) {
     response_nxdomain();
+    flagnx = 1;
+  }
 
 
   AUTHORITY:
   aupos = response_len;
 
+  /* with $MINIMAL, an answer stands alone; referrals and denials do not */
+  if (flagminimal && flagauthoritative && (aupos != anpos)) return 1;
+
   if (flagauthoritative && (aupos == anpos)) {
-    cdb_findstart(&c);
-    while (r = find(control,0)) {
+    if (start(control) == -1) return 0;
+    while (r = findtype(control,DNS_T_SOA,0)) {
       if (r == -1) return 0;
       if (byte_equal(type,2,DNS_T_SOA)) {
         if (!response_rstart(control,DNS_T_SOA,ttl)) return 0;
@@ -226,8 +647,8 @@ static int doit(char *q,char qtype[2])
   }
   else
     if (want(control,DNS_T_NS)) {
-      cdb_findstart(&c);
-      while (r = find(control,0)) {
+      if (start(control) == -1) return 0;
+      while (r = findtype(control,DNS_T_NS,0)) {
         if (r == -1) return 0;
         if (byte_equal(type,2,DNS_T_NS)) {
           if (!response_rstart(control,DNS_T_NS,ttl)) return 0;
@@ -245,14 +666,14 @@ static int doit(char *q,char qtype[2])
     bpos = dns_packet_copy(response,arpos,bpos,x,10); if (!bpos) return 0;
     if (byte_equal(x,2,DNS_T_NS) || byte_equal(x,2,DNS_T_MX)) {
       if (byte_equal(x,2,DNS_T_NS)) {
-        if (!dns_packet_getname(response,arpos,bpos,&d1)) return 0;
+        if (!dns_packet_getnamebuf(response,arpos,bpos,d1)) return 0;
       }
       else
-        if (!dns_packet_getname(response,arpos,bpos + 2,&d1)) return 0;
+        if (!dns_packet_getnamebuf(response,arpos,bpos + 2,d1)) return 0;
       case_lowerb(d1,dns_domain_length(d1));
       if (want(d1,DNS_T_A)) {
-	cdb_findstart(&c);
-	while (r = find(d1,0)) {
+	if (start(d1) == -1) return 0;
+	while (r = findtype(d1,DNS_T_A,0)) {
           if (r == -1) return 0;
 	  if (byte_equal(type,2,DNS_T_A)) {
             if (!response_rstart(d1,DNS_T_A,ttl)) return 0;
@@ -266,45 +687,447 @@ static int doit(char *q,char qtype[2])
     bpos += u16;
   }
 
-  if (flagauthoritative && (response_len > 512)) {
-    byte_zero(response + RESPONSE_ADDITIONAL,2);
-    response_len = arpos;
-    if (response_len > 512) {
-      byte_zero(response + RESPONSE_AUTHORITY,2);
-      response_len = aupos;
+  return 1;
+}
+
+static int lookup(char *q,char qtype[2])
+{
+  int r;
+  PERFCOUNT_BEGIN(PERF_TDLOOKUP)
+  PROFILE_ENTER(PROFILE_RESPONSE)
+
+  r = doit(q,qtype);
+  PROFILE_LEAVE
+  PERFCOUNT_END(PERF_TDLOOKUP)
+  return r;
+}
+
+/*
+Answer cache: complete answers, less the header and question, keyed
+by qname, qtype and client location. Every entry is dropped when
+data.cdb changes, and an entry built from records with timestamps
+goes stale when any of them would next appear, disappear or change
+its TTL. A records are reshuffled on every hit, as doit() would.
+*/
+
+#define ANSWERS 1024
+#define ANSWERMAX 1024
+
+struct answer {
+  char *key; /* 0, or allocated: key, then body */
+  unsigned int keylen;
+  unsigned int bodylen;
+  char counts[8];
+  int flagexpire;
+  struct tai expire;
+  int flagchild;
+  int flagnx;
+  unsigned int zonelen;
+  unsigned int apos; /* relative to body */
+  unsigned int anum;
+} ;
+
+static struct answer answer[ANSWERS];
+static char akey[259];
+static unsigned int akeylen;
+
+static void answer_flush(void)
+{
+  int i;
+
+  for (i = 0;i < ANSWERS;++i)
+    if (answer[i].key) {
+      alloc_free(answer[i].key);
+      answer[i].key = 0;
     }
+}
+
+/* akey is qkey and 4 more bytes, so its hash goes on from qhash */
+static struct answer *answer_slot(void)
+{
+  uint32 h = qhash;
+  unsigned int i;
+
+  for (i = akeylen - 4;i < akeylen;++i)
+    h = (h + (h << 5)) ^ (unsigned char) akey[i];
+  return answer + (h % ANSWERS);
+}
+
+static int answer_get(void)
+{
+  struct answer *a;
+  char *body;
+  unsigned int pos;
+  unsigned int i;
+  unsigned int j;
+  char tmp[4];
+
+  a = answer_slot();
+  if (!a->key) return 0;
+  if (a->keylen != akeylen) return 0;
+  if (byte_diff(a->key,akeylen,akey)) return 0;
+  if (a->flagexpire && !tai_less(&now,&a->expire)) return 0;
+
+  body = a->key + a->keylen;
+  pos = response_len + a->apos;
+  if (!response_addbytes(body,a->bodylen)) return 0;
+  byte_copy(response + 4,8,a->counts);
+  if (a->flagchild) response[2] &= ~4;
+  if (a->flagnx) response_nxdomain();
+  zonelen = a->zonelen;
+
+  for (i = a->anum;i > 1;--i) {
+    j = dns_random(i);
+    byte_copy(tmp,4,response + pos + 16 * j + 12);
+    byte_copy(response + pos + 16 * j + 12,4,response + pos + 16 * (i - 1) + 12);
+    byte_copy(response + pos + 16 * (i - 1) + 12,4,tmp);
   }
+  return 1;
+}
+
+static void answer_put(unsigned int start)
+{
+  struct answer *a;
+  unsigned int bodylen;
+  unsigned int i;
+  char *key;
+
+  if (!flagcacheable) return;
+  bodylen = response_len - start;
+  if (bodylen > ANSWERMAX) return;
+  if (anum < 2) anum = 0;
+  for (i = 0;i < anum;++i) /* each A record must be a pointer and 14 bytes */
+    if (byte_diff(response + apos + 16 * i,6,"\300\14\0\1\0\1")) return;
+
+  key = alloc(akeylen + bodylen);
+  if (!key) return;
+  byte_copy(key,akeylen,akey);
+  byte_copy(key + akeylen,bodylen,response + start);
+
+  a = answer_slot();
+  if (a->key) alloc_free(a->key);
+  a->key = key;
+  a->keylen = akeylen;
+  a->bodylen = bodylen;
+  byte_copy(a->counts,8,response + 4);
+  a->expire = expire;
+  a->flagchild = flagchild;
+  a->flagnx = flagnx;
+  a->zonelen = zonelen;
+  a->flagexpire = flagexpire;
+  a->apos = apos - start;
+  a->anum = anum;
+}
+
+/*
+Schedule: tinydns-data lists under "\0d" every distinct timestamp in
+the records of data.cdb, sorted, each 8 bytes as in a record. A second
+after each, some answer may change. Entries in both caches carry the
+times of the records they were built from, but when the next moment
+in data.cdb or delta/data.cdb comes, respond() empties both caches
+anyway, so nothing outlives a change in the data, whichever records
+an answer was built from. Only the next moment of each is kept, read
+from the cdb as it comes.
+*/
+
+struct schedule {
+  struct cdb *x;
+  uint64 pos; /* of the list in x */
+  uint32 num;
+  uint32 i; /* next moment; num if none */
+  struct tai next; /* if i < num: a second after it */
+} ;
+
+static struct schedule basesched;
+static struct schedule deltasched;
 
+static int schedule_get(struct schedule *s,uint32 i,struct tai *t)
+{
+  char buf[8];
+
+  if (cdb_read(s->x,buf,8,s->pos + 8 * (uint64) i) == -1) return 0;
+  tai_unpack(buf,t);
   return 1;
 }
 
-int respond(char *q,char qtype[2],char ip[4])
+static void schedule_read(struct schedule *s)
+{
+  struct tai one;
+
+  if (s->i >= s->num) return;
+  if (!schedule_get(s,s->i,&s->next)) { s->i = s->num; return; }
+  tai_uint(&one,1);
+  tai_add(&s->next,&s->next,&one);
+}
+
+static void schedule_init(struct schedule *s,struct cdb *x)
+{
+  struct tai t;
+  uint32 lo;
+  uint32 hi;
+  uint32 mid;
+
+  s->x = x;
+  s->num = s->i = 0;
+  if (cdb_find(x,"\0d",2) != 1) return;
+  s->pos = cdb_datapos(x);
+  s->num = cdb_datalen(x) / 8;
+
+  lo = 0; hi = s->num; /* the first at or after now */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (!schedule_get(s,mid,&t)) { s->num = 0; return; }
+    if (tai_less(&t,&now)) lo = mid + 1; else hi = mid;
+  }
+  s->i = lo;
+  schedule_read(s);
+}
+
+/* 1 if a moment has come since the last call */
+static int schedule_due(struct schedule *s)
 {
-  int fd;
+  int r = 0;
+
+  while ((s->i < s->num) && !tai_less(&now,&s->next)) {
+    ++s->i;
+    schedule_read(s);
+    r = 1;
+  }
+  return r;
+}
+
+/*
+Negative cache. With the name filter, a name q that data.cdb surely
+does not have, nor any of its parents below e, the nearest one it may
+have, gets the same denial as every other such name under e: doit()
+finds nothing until it reaches e, and from e on nothing depends on q.
+So NXDOMAIN and NODATA answers for such names are kept by e, qtype and
+client location, with the SOA record uncompressed, and are written out
+again for the next name under e. They are not put in the answer cache,
+which a flood of random names would otherwise wash out.
+*/
+
+#define NEGATIVES 1024
+
+struct negative {
+  char *key; /* 0, or allocated: key, then SOA data */
+  unsigned int keylen;
+  unsigned int soalen; /* 0 if no SOA record */
+  unsigned int zonelen; /* the zone, and the owner of any SOA record */
+  uint32 ttl;
+  int flagexpire;
+  struct tai expire;
+  int flagnx;
+} ;
+
+static struct negative negative[NEGATIVES];
+static char nkey[259];
+static unsigned int nkeylen;
+
+static void negative_flush(void)
+{
+  int i;
+
+  for (i = 0;i < NEGATIVES;++i)
+    if (negative[i].key) {
+      alloc_free(negative[i].key);
+      negative[i].key = 0;
+    }
+}
+
+/* e as above, if q is surely absent; else 0 */
+static const char *existing(const char *q)
+{
+  const char *e;
+
+  if (!filter) return 0;
+  for (e = q;;e += *e + 1) {
+    if (start(e) == -1) return 0;
+    if (!absent(e)) return (e == q) ? 0 : e;
+    if (!*e) return 0;
+  }
+}
+
+static struct negative *negative_slot(void)
+{
+  uint32 h = 5381;
+  unsigned int i;
+
+  for (i = 0;i < nkeylen;++i)
+    h = (h + (h << 5)) ^ (unsigned char) nkey[i];
+  return negative + (h % NEGATIVES);
+}
+
+static int negative_get(const char *q)
+{
+  struct negative *n;
+  const char *soa;
+  unsigned int pos;
+
+  n = negative_slot();
+  if (!n->key) return 0;
+  if (n->keylen != nkeylen) return 0;
+  if (byte_diff(n->key,nkeylen,nkey)) return 0;
+  if (n->flagexpire && !tai_less(&now,&n->expire)) return 0;
+
+  if (n->soalen) {
+    soa = n->key + n->keylen;
+    if (!response_rstart(q + dns_domain_length(q) - n->zonelen,DNS_T_SOA,n->ttl)) return 0;
+    pos = dns_domain_length(soa);
+    if (!response_addname(soa)) return 0;
+    if (!response_addname(soa + pos)) return 0;
+    pos += dns_domain_length(soa + pos);
+    if (!response_addbytes(soa + pos,20)) return 0;
+    response_rfinish(RESPONSE_AUTHORITY);
+  }
+  if (n->flagnx) response_nxdomain();
+  zonelen = n->zonelen;
+  return 1;
+}
+
+/* 1 if the answer from start on is a denial, now in the negative cache or not */
+static int negative_put(unsigned int start)
+{
+  struct negative *n;
+  char soa[DNS_NAME + DNS_NAME + 20];
+  unsigned int soalen;
+  unsigned int pos;
+  char x[10];
+  uint32 u;
+  char *key;
+
+  if (flagchild) return 0;
+  if (byte_diff(response + 6,2,"\0\0")) return 0;
+  if (byte_diff(response + 10,2,"\0\0")) return 0;
+  if (!flagcacheable) return 1;
+
+  soalen = 0;
+  u = 0;
+  if (byte_equal(response + 8,2,"\0\1")) {
+    pos = dns_packet_skipname(response,response_len,start); if (!pos) return 1;
+    pos = dns_packet_copy(response,response_len,pos,x,10); if (!pos) return 1;
+    if (byte_diff(x,2,DNS_T_SOA)) return 1;
+    uint32_unpack_big(x + 4,&u);
+    pos = dns_packet_getnamebuf(response,response_len,pos,d1); if (!pos) return 1;
+    soalen = dns_domain_length(d1);
+    byte_copy(soa,soalen,d1);
+    pos = dns_packet_getnamebuf(response,response_len,pos,d1); if (!pos) return 1;
+    byte_copy(soa + soalen,dns_domain_length(d1),d1);
+    soalen += dns_domain_length(d1);
+    pos = dns_packet_copy(response,response_len,pos,soa + soalen,20); if (!pos) return 1;
+    soalen += 20;
+  }
+  else if (byte_diff(response + 8,2,"\0\0")) return 1;
+
+  key = alloc(nkeylen + soalen);
+  if (!key) return 1;
+  byte_copy(key,nkeylen,nkey);
+  byte_copy(key + nkeylen,soalen,soa);
+
+  n = negative_slot();
+  if (n->key) alloc_free(n->key);
+  n->key = key;
+  n->keylen = nkeylen;
+  n->soalen = soalen;
+  n->zonelen = zonelen;
+  n->ttl = u;
+  n->flagexpire = flagexpire;
+  n->expire = expire;
+  n->flagnx = flagnx;
+  return 1;
+}
+
+int respond(char *q,char qtype[2],char ip[4],uint32 h)
+{
+  char *x;
+  const char *e;
   int r;
-  char key[6];
+  int phase;
+  unsigned int start;
 
+  if (flagminimal == -1) {
+    flagminimal = !!env_get("MINIMAL");
+    x = env_get("MINIMALANY");
+    if (x) flagminimalany = (*x == 'h') ? 2 : 1;
+  }
+  qkey = q;
+  qhash = h;
   tai_now(&now);
-  fd = open_read("data.cdb");
-  if (fd == -1) return 0;
-  cdb_init(&c,fd);
-
-  byte_zero(clientloc,2);
-  key[0] = 0;
-  key[1] = '%';
-  byte_copy(key + 2,4,ip);
-  r = cdb_find(&c,key,6);
-  if (!r) r = cdb_find(&c,key,5);
-  if (!r) r = cdb_find(&c,key,4);
-  if (!r) r = cdb_find(&c,key,3);
-  if (!r) r = cdb_find(&c,key,2);
-  if (r == -1) return 0;
-  if (r && (cdb_datalen(&c) == 2))
-    if (cdb_read(&c,clientloc,2,cdb_datapos(&c)) == -1) return 0;
+  r = cdbmap(&c,"data.cdb");
+  if (!r) return 0;
+  if (r == 2) {
+    ++metric[METRIC_RELOADS];
+    answer_flush();
+    negative_flush();
+    flagcutbase = (cdb_find(&c,"\0/",2) == 1);
+    flagwildbase = (cdb_find(&c,"\0*",2) == 1);
+    flagtypebase = (cdb_find(&c,"\0t",2) == 1);
+    flaglocbase = (cdb_find(&c,"\0v",2) == 1);
+    dictbaselen = dict_init(&c,dictbase);
+    filter_init();
+    clientloc_init(&c);
+    schedule_init(&basesched,&c);
+  }
+  r = cdbmap(&delta,"delta/data.cdb");
+  if (r != flagdelta) { answer_flush(); negative_flush(); }
+  if (r == 2) {
+    flagcutdelta = (cdb_find(&delta,"\0/",2) == 1);
+    flagwilddelta = (cdb_find(&delta,"\0*",2) == 1);
+    flagtypedelta = (cdb_find(&delta,"\0t",2) == 1);
+    flaglocdelta = (cdb_find(&delta,"\0v",2) == 1);
+    dictdeltalen = dict_init(&delta,dictdelta);
+    schedule_init(&deltasched,&delta);
+    r = 1;
+  }
+  flagdelta = r;
 
-  r = doit(q,qtype);
+  if (schedule_due(&basesched) | (flagdelta && schedule_due(&deltasched))) {
+    answer_flush();
+    negative_flush();
+  }
 
-  cdb_free(&c);
-  close(fd);
-  return r;
+  if (clientloc_find(&c,ip,clientloc) == -1) return 0;
+
+  akeylen = dns_domain_length(q);
+  byte_copy(akey,akeylen,q);
+  byte_copy(akey + akeylen,2,qtype);
+  byte_copy(akey + akeylen + 2,2,clientloc);
+  akeylen += 4;
+  phase = profile_enter(PROFILE_CACHE);
+  r = answer_get();
+  profile_phase = phase;
+  if (r) {
+    zonestat_zone(q + dns_domain_length(q) - zonelen);
+    return 1;
+  }
+
+  e = existing(q);
+  if (e) {
+    nkeylen = dns_domain_length(e);
+    byte_copy(nkey,nkeylen,e);
+    byte_copy(nkey + nkeylen,2,qtype);
+    byte_copy(nkey + nkeylen + 2,2,clientloc);
+    nkeylen += 4;
+    phase = profile_enter(PROFILE_CACHE);
+    r = negative_get(q);
+    profile_phase = phase;
+    if (r) {
+      zonestat_zone(q + dns_domain_length(q) - zonelen);
+      return 1;
+    }
+  }
+
+  start = response_len;
+  flagexpire = 0;
+  flagcacheable = 1;
+  flagchild = 0;
+  flagnx = 0;
+  anum = 0;
+  if (!lookup(q,qtype)) return 0;
+  zonestat_zone(q + dns_domain_length(q) - zonelen);
+  phase = profile_enter(PROFILE_CACHE);
+  if (!e || !negative_put(start)) answer_put(start);
+  profile_phase = phase;
+  return 1;
 }
+
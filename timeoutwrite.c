@@ -1,9 +1,16 @@
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "error.h"
 #include "iopause.h"
+#include "uint64.h"
+#include "hassendfile.h"
 #include "timeoutwrite.h"
+#ifdef HASSENDFILE
+#include <sys/sendfile.h>
+#endif
 
-int timeoutwrite(int t,int fd,char *buf,int len)
+static int ready(int t,int fd)
 {
   struct taia now;
   struct taia deadline;
@@ -18,11 +25,51 @@ int timeoutwrite(int t,int fd,char *buf,int len)
   for (;;) {
     taia_now(&now);
     iopause(&x,1,&deadline,&now);
-    if (x.revents) break;
+    if (x.revents) return 0;
     if (taia_less(&deadline,&now)) {
       errno = error_timeout;
       return -1;
     }
   }
+}
+
+int timeoutwrite(int t,int fd,char *buf,int len)
+{
+  if (ready(t,fd) == -1) return -1;
   return write(fd,buf,len);
 }
+
+int timeoutwritev(int t,int fd,struct iovec *v,int n)
+{
+  if (ready(t,fd) == -1) return -1;
+  return writev(fd,v,n);
+}
+
+/* up to len bytes of the file in, from *pos on, which it advances */
+int writefile(int fd,int in,uint64 *pos,unsigned int len)
+{
+#ifdef HASSENDFILE
+  off_t off;
+#else
+  char buf[8192];
+#endif
+  int r;
+
+#ifdef HASSENDFILE
+  off = *pos;
+  r = sendfile(fd,in,&off,len);
+#else
+  if (len > sizeof buf) len = sizeof buf;
+  r = pread(in,buf,len,*pos);
+  if (r <= 0) { if (!r) errno = error_io; return -1; }
+  r = write(fd,buf,r);
+#endif
+  if (r > 0) *pos += r;
+  return r;
+}
+
+int timeoutsendfile(int t,int fd,int in,uint64 *pos,unsigned int len)
+{
+  if (ready(t,fd) == -1) return -1;
+  return writefile(fd,in,pos,len);
+}
@@ -2,5 +2,8 @@
 #define TIMEOUTWRITE_H
 
 extern int timeoutwrite();
+extern int timeoutwritev();
+extern int timeoutsendfile();
+extern int writefile();
 
 #endif
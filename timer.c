@@ -0,0 +1,111 @@
+#include "alloc.h"
+#include "taia.h"
+#include "timer.h"
+
+/*
+A binary min-heap of the timers that are set, earliest first. Each
+timer knows its place, so timer_set() and timer_clear() take
+O(log n) and timer_first() O(1); nothing ever scans the whole set.
+timer_init(n) makes room for n timers; a program must not set more.
+*/
+
+static struct timer **heap = 0;
+static unsigned int len = 0;
+static unsigned int size = 0;
+
+int timer_init(unsigned int n)
+{
+  struct timer **x;
+
+  if (n > 0x7fffffff / sizeof(struct timer *)) return 0;
+  x = (struct timer **) alloc(n * sizeof(struct timer *));
+  if (!x) return 0;
+  if (heap) alloc_free((char *) heap);
+  heap = x;
+  len = 0;
+  size = n;
+  return 1;
+}
+
+static void place(struct timer *x,unsigned int i)
+{
+  heap[i] = x;
+  x->pos = i + 1;
+}
+
+static void up(unsigned int i)
+{
+  struct timer *x;
+  unsigned int parent;
+
+  x = heap[i];
+  while (i) {
+    parent = (i - 1) / 2;
+    if (!taia_less(&x->when,&heap[parent]->when)) break;
+    place(heap[parent],i);
+    i = parent;
+  }
+  place(x,i);
+}
+
+static void down(unsigned int i)
+{
+  struct timer *x;
+  unsigned int child;
+
+  x = heap[i];
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= len) break;
+    if (child + 1 < len)
+      if (taia_less(&heap[child + 1]->when,&heap[child]->when)) ++child;
+    if (!taia_less(&heap[child]->when,&x->when)) break;
+    place(heap[child],i);
+    i = child;
+  }
+  place(x,i);
+}
+
+void timer_set(struct timer *x,const struct taia *when)
+{
+  x->when = *when;
+  if (!x->pos) {
+    if (len == size) return; /* more timers than timer_init() was told */
+    place(x,len++);
+  }
+  up(x->pos - 1);
+  down(x->pos - 1);
+}
+
+void timer_clear(struct timer *x)
+{
+  struct timer *last;
+  unsigned int i;
+
+  if (!x->pos) return;
+  i = x->pos - 1;
+  x->pos = 0;
+  last = heap[--len];
+  if (i == len) return;
+  place(last,i);
+  up(i);
+  down(last->pos - 1);
+}
+
+/* 0 if no timer is set */
+struct timer *timer_first(void)
+{
+  return len ? heap[0] : 0;
+}
+
+/* clears and returns the earliest timer, if it is not after *now */
+struct timer *timer_due(const struct taia *now)
+{
+  struct timer *x;
+
+  if (!len) return 0;
+  x = heap[0];
+  if (taia_less(now,&x->when)) return 0;
+  timer_clear(x);
+  return x;
+}
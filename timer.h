@@ -0,0 +1,18 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "taia.h"
+
+struct timer {
+  struct taia when;
+  unsigned int pos; /* 1 + place in the heap, if set; otherwise 0 */
+  unsigned long id; /* for the owner; timer.c does not touch it */
+} ;
+
+extern int timer_init(unsigned int);
+extern void timer_set(struct timer *,const struct taia *);
+extern void timer_clear(struct timer *);
+extern struct timer *timer_first(void);
+extern struct timer *timer_due(const struct taia *);
+
+#endif
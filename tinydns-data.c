@@ -1,9 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include "uint16.h"
 #include "uint32.h"
+#include "uint64.h"
+#include "cdb.h"
 #include "str.h"
 #include "byte.h"
 #include "fmt.h"
@@ -18,6 +22,14 @@
 #include "stralloc.h"
 #include "open.h"
 #include "dns.h"
+#include "env.h"
+#include "alloc.h"
+#include "error.h"
+#include "direntry.h"
+#include "namefilter.h"
+#include "openreadclose.h"
+#include "txtdict.h"
+#include "buildstat.h"
 
 #define TTL_NS 259200
 #define TTL_POSITIVE 86400
@@ -121,10 +133,455 @@ void defaultsoa_init(int fd)
 }
 
 int fdcdb;
+int fdspill;
 struct cdb_make cdb;
 static stralloc key;
 static stralloc result;
 
+/*
+If data is a directory, every file in it whose name does not start
+with a dot is read in name order, and the records from data/NAME are
+saved in seg/NAME behind a header with the size, mtime and inode of
+data/NAME. While the header still matches, later runs copy seg/NAME
+into data.cdb instead of parsing data/NAME. Each file takes its
+default SOA serial from its own mtime.
+*/
+
+static int flagseg = 0;
+static stralloc segtmp;
+int fdseg;
+buffer sb;
+char sbspace[8192];
+
+void die_segtmp(void)
+{
+  strerr_die4sys(111,FATAL,"unable to create ",segtmp.s,": ");
+}
+
+void seg_put(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  char buf[8];
+
+  if (!flagseg) return;
+  uint32_pack(buf,klen);
+  uint32_pack(buf + 4,dlen);
+  if (buffer_put(&sb,buf,8) == -1) die_segtmp();
+  if (buffer_put(&sb,k,klen) == -1) die_segtmp();
+  if (buffer_put(&sb,d,dlen) == -1) die_segtmp();
+}
+
+/*
+Name filter, if $NAMEFILTER is set: a Bloom filter of every owner
+name, under "\0b", so that tinydns can tell most names that are not
+there without reading the hash tables. Records come through cdbadd()
+grouped by owner, so one hash per run of the same owner is kept.
+*/
+
+static int flagnamefilter = 0;
+static stralloc filterhash;
+static uint32 lasthash[2];
+
+static void filter_add(const char *k,unsigned int klen)
+{
+  uint32 h[2];
+
+  if (!flagnamefilter) return;
+  if (!klen || (!k[0] && (klen > 1))) return; /* "\0" keys but the root */
+  namefilter_hash(k,h);
+  if (filterhash.len && (h[0] == lasthash[0]) && (h[1] == lasthash[1])) return;
+  lasthash[0] = h[0];
+  lasthash[1] = h[1];
+  if (!stralloc_catb(&filterhash,(char *) h,sizeof h)) nomem();
+}
+
+static void namefilter(void)
+{
+  stralloc bits = {0};
+  uint32 numbits;
+  uint32 h[2];
+  unsigned int i;
+
+  numbits = (filterhash.len / sizeof h) * NAMEFILTER_BITS;
+  if (numbits < 64) numbits = 64;
+  numbits = (numbits + 7) & ~7;
+  if (!stralloc_ready(&bits,1 + numbits / 8)) nomem();
+  bits.len = 1 + numbits / 8;
+  byte_zero(bits.s,bits.len);
+  bits.s[0] = NAMEFILTER_K;
+  for (i = 0;i < filterhash.len;i += sizeof h) {
+    byte_copy((char *) h,sizeof h,filterhash.s + i);
+    namefilter_set(bits.s + 1,numbits,NAMEFILTER_K,h);
+  }
+  if (cdb_make_add(&cdb,"\0b",2,bits.s,bits.len) == -1) die_datatmp();
+  alloc_free(bits.s);
+}
+
+/*
+TXT dictionary, if $TXTDICT names a file: the data of each TXT record
+is packed against the dictionary in that file, as txtdict_pack() does,
+when that makes the record shorter, and the record's flag byte gets
+its high bit set. The dictionary itself goes under "\0c" for tinydns
+and axfrdns. If the file is not there, this run packs nothing but
+trains a dictionary on the first SAMPLEMAX bytes of TXT data and
+leaves it in the file for the next run; remove the file to train
+anew. A new dictionary changes every packed record, so the old
+journals are then dropped.
+*/
+
+#define SAMPLEMAX 1048576
+#define DICTSIZE 32768
+
+static stralloc dictfn;
+static stralloc dicttmp;
+static stralloc dict;
+static struct txtdict txtdict;
+static int flagdict = 0;
+static int flagtrain = 0;
+static int flagtrained = 0;
+static stralloc sample;
+static stralloc packed;
+
+void die_dictread(void)
+{
+  strerr_die4sys(111,FATAL,"unable to read ",dictfn.s,": ");
+}
+void die_dicttmp(void)
+{
+  strerr_die4sys(111,FATAL,"unable to create ",dicttmp.s,": ");
+}
+
+static void dictread(void)
+{
+  switch(openreadclose(dictfn.s,&dict,1024)) {
+    case -1: die_dictread();
+    case 0: flagtrain = 1; return;
+  }
+  if (!dict.len) return;
+  if (dict.len > TXTDICT_MAX) dict.len = TXTDICT_MAX;
+  if (txtdict_index(&txtdict,dict.s,dict.len) == -1) nomem();
+  flagdict = 1;
+}
+
+/* length of the fixed part of a record that may be packed, or 0 */
+static unsigned int packable(const char *d,unsigned int dlen)
+{
+  unsigned int len;
+
+  if (dlen < 15) return 0;
+  if (byte_diff(d,2,DNS_T_TXT)) return 0;
+  if ((d[2] == '=') || (d[2] == '*')) len = 15;
+  else if ((d[2] == '=' + 1) || (d[2] == '*' + 1)) len = 17;
+  else return 0;
+  return (dlen > len) ? len : 0;
+}
+
+/* the strings of a TXT record, each ended by a 0, for training */
+static void sampleadd(const char *d,unsigned int dlen)
+{
+  unsigned int i;
+  unsigned int n;
+
+  if (sample.len + dlen + 1 > SAMPLEMAX) return;
+  for (i = 0;i < dlen;i += n) {
+    n = (unsigned char) d[i++];
+    if (n > dlen - i) n = dlen - i;
+    if (!stralloc_catb(&sample,d + i,n)) nomem();
+    if (!stralloc_0(&sample)) nomem();
+  }
+}
+
+/* 1 if packed holds the record packed, and is shorter */
+static int pack(const char *d,unsigned int dlen)
+{
+  unsigned int len;
+
+  len = packable(d,dlen);
+  if (!len) return 0;
+  if (flagtrain) sampleadd(d + len,dlen - len);
+  if (!flagdict) return 0;
+  if (!stralloc_copyb(&packed,d,len)) nomem();
+  packed.s[2] |= 128;
+  if (txtdict_pack(&txtdict,&packed,d + len,dlen - len) == -1) nomem();
+  return packed.len < dlen;
+}
+
+static void dictfinish(void)
+{
+  int fd;
+
+  if (flagdict)
+    if (cdb_make_add(&cdb,"\0c",2,dict.s,dict.len) == -1) die_datatmp();
+  if (!flagtrain) return;
+  if (txtdict_train(&dict,sample.s,sample.len,DICTSIZE) == -1) nomem();
+  fd = open_trunc(dicttmp.s);
+  if (fd == -1) die_dicttmp();
+  if (write(fd,dict.s,dict.len) != (int) dict.len) die_dicttmp();
+  if (fsync(fd) == -1) die_dicttmp();
+  if (close(fd) == -1) die_dicttmp(); /* NFS stupidity */
+  flagtrained = 1;
+}
+
+/*
+Hot names, if $HOTNAMES names a file: each line is a count and a
+name, or a "topname" line as tinydns writes it with $TOPN, the count
+third and the name fifth; counts for the same name add up. Records
+owned by a listed name, and their type index copies, are held back
+and written after all the others, the most queried name first, so
+that the records most queries read share a few pages of data.cdb
+instead of each sitting on its own page. A record's place among
+those of the same owner does not change.
+*/
+
+struct hot {
+  unsigned int name; /* position in hotnames */
+  unsigned int len;
+  uint64 count;
+  stralloc recs; /* klen, dlen, key, data, for each record */
+} ;
+
+static stralloc hotnames;
+static struct hot *hot;
+static unsigned int numhot = 0;
+static unsigned int maxhot = 0;
+static unsigned int *hotslot; /* name number plus 1, or 0 */
+static unsigned int numhotslots = 0;
+static stralloc hotline;
+static char *hotname;
+
+void die_hotread(void)
+{
+  strerr_die2sys(111,FATAL,"unable to read $HOTNAMES: ");
+}
+
+static unsigned int *hot_slot(const char *d,unsigned int len)
+{
+  unsigned int i;
+  struct hot *x;
+
+  i = cdb_hash(d,len) & (numhotslots - 1);
+  while (hotslot[i]) {
+    x = hot + hotslot[i] - 1;
+    if (x->len == len)
+      if (byte_equal(hotnames.s + x->name,len,d)) break;
+    i = (i + 1) & (numhotslots - 1);
+  }
+  return hotslot + i;
+}
+
+static void hot_grow(void)
+{
+  unsigned int i;
+  unsigned int n;
+
+  n = maxhot + (maxhot >> 1) + 64;
+  if (!hot) hot = (struct hot *) alloc(n * sizeof(struct hot));
+  else if (!alloc_re((char **) &hot,maxhot * sizeof(struct hot),n * sizeof(struct hot)))
+    nomem();
+  if (!hot) nomem();
+  maxhot = n;
+
+  if (hotslot) alloc_free((char *) hotslot);
+  numhotslots = 64;
+  while (numhotslots < 2 * maxhot) numhotslots <<= 1;
+  hotslot = (unsigned int *) alloc(numhotslots * sizeof(unsigned int));
+  if (!hotslot) nomem();
+  for (i = 0;i < numhotslots;++i) hotslot[i] = 0;
+  for (i = 0;i < numhot;++i)
+    *hot_slot(hotnames.s + hot[i].name,hot[i].len) = i + 1;
+}
+
+static void hotread(const char *fn)
+{
+  buffer hb;
+  char hbspace[1024];
+  unsigned int field[5];
+  unsigned int numfields;
+  unsigned int *slot;
+  unsigned int len;
+  unsigned int i;
+  unsigned long u;
+  struct hot *x;
+  int flag = 1;
+  int fd;
+
+  fd = open_read(fn);
+  if (fd == -1) die_hotread();
+  buffer_init(&hb,buffer_unixread,fd,hbspace,sizeof hbspace);
+  while (flag) {
+    if (getln(&hb,&hotline,&flag,'\n') == -1) die_hotread();
+    if (!stralloc_0(&hotline)) nomem();
+    numfields = 0;
+    for (i = 0;i < hotline.len;++i) {
+      if ((hotline.s[i] == ' ') || (hotline.s[i] == '\t') || (hotline.s[i] == '\n') || !hotline.s[i]) {
+        hotline.s[i] = 0;
+        continue;
+      }
+      if (!i || !hotline.s[i - 1])
+        if (numfields < 5) field[numfields++] = i;
+    }
+    if ((numfields == 5) && str_equal(hotline.s + field[0],"topname")) {
+      field[0] = field[2];
+      field[1] = field[4];
+    }
+    else if (numfields != 2) continue;
+    if (!scan_ulong(hotline.s + field[0],&u)) continue;
+
+    if (!dns_domain_fromdot(&hotname,hotline.s + field[1],str_len(hotline.s + field[1]))) nomem();
+    len = dns_domain_length(hotname);
+    case_lowerb(hotname,len);
+    if (numhot == maxhot) hot_grow();
+    slot = hot_slot(hotname,len);
+    if (!*slot) {
+      x = hot + numhot;
+      x->name = hotnames.len;
+      x->len = len;
+      x->count = 0;
+      x->recs.s = 0;
+      x->recs.len = 0;
+      x->recs.a = 0;
+      if (!stralloc_catb(&hotnames,hotname,len)) nomem();
+      *slot = ++numhot;
+    }
+    hot[*slot - 1].count += u;
+  }
+  close(fd);
+}
+
+/* 1 if the record was held back */
+static int hotadd(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  unsigned int *slot;
+  struct hot *x;
+  char buf[8];
+
+  if (!numhot) return 0;
+  if ((klen > 4) && byte_equal(k,2,"\0t")) slot = hot_slot(k + 4,klen - 4);
+  else if (klen && k[0]) slot = hot_slot(k,klen);
+  else return 0;
+  if (!*slot) return 0;
+  x = hot + *slot - 1;
+  uint32_pack(buf,klen);
+  uint32_pack(buf + 4,dlen);
+  if (!stralloc_catb(&x->recs,buf,8)) nomem();
+  if (!stralloc_catb(&x->recs,k,klen)) nomem();
+  if (!stralloc_catb(&x->recs,d,dlen)) nomem();
+  return 1;
+}
+
+static int hotcmp(const void *a,const void *b)
+{
+  const struct hot *x = a;
+  const struct hot *y = b;
+
+  if (x->count != y->count) return (x->count > y->count) ? -1 : 1;
+  if (x->name != y->name) return (x->name < y->name) ? -1 : 1;
+  return 0;
+}
+
+static void hotflush(void)
+{
+  struct hot *x;
+  unsigned int pos;
+  uint32 klen;
+  uint32 dlen;
+
+  if (!numhot) return;
+  qsort(hot,numhot,sizeof(struct hot),hotcmp);
+  for (x = hot;x < hot + numhot;++x) {
+    for (pos = 0;pos < x->recs.len;pos += 8 + klen + dlen) {
+      uint32_unpack(x->recs.s + pos,&klen);
+      uint32_unpack(x->recs.s + pos + 4,&dlen);
+      if (cdb_make_add(&cdb,x->recs.s + pos + 8,klen,x->recs.s + pos + 8 + klen,dlen) == -1)
+        die_datatmp();
+    }
+    if (x->recs.s) alloc_free(x->recs.s);
+  }
+  alloc_free((char *) hotslot);
+  numhot = 0;
+}
+
+/*
+A zone cut record that repeats the one before it is dropped here as
+well as in cut_add(), so that the output does not depend on where
+segments begin.
+*/
+
+static stralloc lastcut;
+
+/*
+Every timestamp in a record is also kept in ttds, and the distinct
+ones go into data.cdb under "\0d", sorted, for tinydns to know when
+its cached answers must go; see the schedule in tdlookup.c.
+*/
+
+static stralloc ttds;
+
+static void ttd_add(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  unsigned int pos;
+
+  if ((klen > 1) && !k[0]) return; /* location or index */
+  if (dlen < 3) return;
+  pos = 3;
+  if (((d[2] & 127) == '=' + 1) || ((d[2] & 127) == '*' + 1)) pos += 2;
+  pos += 4;
+  if (dlen < pos + 8) return;
+  if (byte_equal(d + pos,8,"\0\0\0\0\0\0\0\0")) return;
+  if (!stralloc_catb(&ttds,d + pos,8)) nomem();
+}
+
+static int ttdcmp(const void *a,const void *b)
+{
+  return byte_diff((const char *) a,8,(const char *) b);
+}
+
+static void ttdflush(void)
+{
+  unsigned int i;
+  unsigned int j;
+
+  if (!ttds.len) return;
+  qsort(ttds.s,ttds.len / 8,8,ttdcmp);
+  j = 8;
+  for (i = 8;i < ttds.len;i += 8)
+    if (byte_diff(ttds.s + i,8,ttds.s + j - 8)) {
+      byte_copy(ttds.s + j,8,ttds.s + i);
+      j += 8;
+    }
+  ttds.len = j;
+  if (cdb_make_add(&cdb,"\0d",2,ttds.s,ttds.len) == -1) die_datatmp();
+}
+
+void zone_add(const char *,unsigned int,const char *,unsigned int);
+
+void cdbadd(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  ttd_add(k,klen,d,dlen);
+  if (pack(d,dlen)) { d = packed.s; dlen = packed.len; }
+  if (klen && k[0] && (dlen >= 3) && byte_equal(d,2,DNS_T_SOA))
+    if ((d[2] == '=') || (d[2] == '>'))
+      zone_add(k,klen,d,dlen);
+  if ((klen > 2) && byte_equal(k,2,"\0/") && (dlen == 1)) {
+    if ((lastcut.len == klen + 1) && byte_equal(lastcut.s,klen,k))
+      if (lastcut.s[klen] == *d) return;
+    if (!stralloc_copyb(&lastcut,k,klen)) nomem();
+    if (!stralloc_catb(&lastcut,d,1)) nomem();
+  }
+  filter_add(k,klen);
+  if (hotadd(k,klen,d,dlen)) return;
+  buildstat_start(BUILDSTAT_ADD);
+  if (cdb_make_add(&cdb,k,klen,d,dlen) == -1) die_datatmp();
+  buildstat_stop(BUILDSTAT_ADD,klen + dlen);
+}
+
+static int flagworker = 0; /* records go only to the segment */
+
+void add(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  seg_put(k,klen,d,dlen);
+  if (!flagworker) cdbadd(k,klen,d,dlen);
+}
+
 void rr_add(const char *buf,unsigned int len)
 {
   if (!stralloc_catb(&result,buf,len)) nomem();
@@ -147,16 +604,925 @@ void rr_start(const char type[2],unsigned long ttl,const char ttd[8],const char
   rr_add(buf,4);
   rr_add(ttd,8);
 }
+/*
+Zone cut index: key "\0/" plus a name that owns NS or SOA records,
+or wildcard records below it, data one byte of CUT_ flags; several
+records at one key are ORed. The empty key "\0/" says the index is
+there, and the empty key "\0*" that it has every CUT_WILD.
+*/
+
+#define CUT_NS 1
+#define CUT_SOA 2
+#define CUT_SCAN 4 /* some of them have a location or a timestamp */
+#define CUT_WILD 8 /* *.name has records */
+
+static stralloc cutkey;
+static char cutlast;
+
+static void cut_put(const char *owner,char flag)
+{
+  if (cutkey.len == dns_domain_length(owner) + 2)
+    if (case_diffb(cutkey.s + 2,cutkey.len - 2,owner) == 0)
+      if (flag == cutlast) return;
+
+  if (!stralloc_copyb(&cutkey,"\0/",2)) nomem();
+  if (!stralloc_catb(&cutkey,owner,dns_domain_length(owner))) nomem();
+  case_lowerb(cutkey.s,cutkey.len);
+  cutlast = flag;
+  add(cutkey.s,cutkey.len,&flag,1);
+}
+
+void cut_add(const char *owner)
+{
+  char flag;
+
+  if (byte_equal(result.s,2,DNS_T_NS)) flag = CUT_NS;
+  else if (byte_equal(result.s,2,DNS_T_SOA)) flag = CUT_SOA;
+  else return;
+  if (result.s[2] != '=') flag |= CUT_SCAN;
+  else if (byte_diff(result.s + 7,8,"\0\0\0\0\0\0\0\0")) flag |= CUT_SCAN;
+  cut_put(owner,flag);
+}
+
+/*
+Zone index: key "\0z" plus a name that owns an SOA record, data the
+byte ranges of data.cdb, an 8-byte start and end each, that hold
+every record within the zone, so that axfrdns can read only those.
+A range may take in index records between them; axfrdns skips those.
+zoneindex() finds the ranges by reading data.tmp back once.
+*/
+
+struct zone {
+  unsigned int name; /* position in zonenames */
+  unsigned int len;
+  uint64 seq; /* the last record in the zone, plus 1 */
+  stralloc ranges;
+  char serial[4]; /* of its first SOA record */
+  int flagauto; /* some SOA record here has the default serial */
+  char autoserial[4]; /* that serial, as parsed */
+  char newserial[4]; /* and as written */
+  uint64 hash;
+  int flagold; /* listed in $ZONEHASH */
+  uint64 oldhash;
+  uint32 oldserial;
+} ;
+
+static stralloc zonenames;
+static struct zone *zone;
+static unsigned int numzones = 0;
+static unsigned int maxzones = 0;
+static unsigned int *zoneslot; /* zone number plus 1, or 0 */
+static unsigned int numzoneslots = 0;
+static char zonelens[32]; /* a bit for each length of zone name */
+
+static unsigned int *zone_slot(const char *d,unsigned int len)
+{
+  unsigned int i;
+  struct zone *z;
+
+  i = cdb_hash(d,len) & (numzoneslots - 1);
+  while (zoneslot[i]) {
+    z = zone + zoneslot[i] - 1;
+    if (z->len == len)
+      if (byte_equal(zonenames.s + z->name,len,d)) break;
+    i = (i + 1) & (numzoneslots - 1);
+  }
+  return zoneslot + i;
+}
+
+static void zone_grow(void)
+{
+  unsigned int i;
+  unsigned int n;
+
+  n = maxzones + (maxzones >> 1) + 64;
+  if (!zone) zone = (struct zone *) alloc(n * sizeof(struct zone));
+  else if (!alloc_re((char **) &zone,maxzones * sizeof(struct zone),n * sizeof(struct zone)))
+    nomem();
+  if (!zone) nomem();
+  maxzones = n;
+
+  if (zoneslot) alloc_free((char *) zoneslot);
+  numzoneslots = 64;
+  while (numzoneslots < 2 * maxzones) numzoneslots <<= 1;
+  zoneslot = (unsigned int *) alloc(numzoneslots * sizeof(unsigned int));
+  if (!zoneslot) nomem();
+  for (i = 0;i < numzoneslots;++i) zoneslot[i] = 0;
+  for (i = 0;i < numzones;++i)
+    *zone_slot(zonenames.s + zone[i].name,zone[i].len) = i + 1;
+}
+
+/* finds the serial in the data of an SOA record; 0 if it is not there */
+static unsigned int soaserialpos(const char *d,unsigned int dlen)
+{
+  unsigned int pos;
+
+  if (dlen < 3) return 0;
+  pos = ((d[2] == '>') || (d[2] == '+')) ? 17 : 15;
+  pos = dns_packet_skipname(d,dlen,pos);
+  if (pos) pos = dns_packet_skipname(d,dlen,pos);
+  if (pos && (pos + 4 > dlen)) pos = 0;
+  return pos;
+}
+
+static int soaserial(const char *d,unsigned int dlen,char serial[4])
+{
+  unsigned int pos;
+
+  pos = soaserialpos(d,dlen);
+  if (pos) byte_copy(serial,4,d + pos);
+  return pos != 0;
+}
+
+void zone_add(const char *d,unsigned int len,const char *soa,unsigned int soalen)
+{
+  unsigned int *slot;
+  struct zone *z;
+
+  if (numzones == maxzones) zone_grow();
+  slot = zone_slot(d,len);
+  if (*slot) return;
+  z = zone + numzones;
+  z->name = zonenames.len;
+  z->len = len;
+  z->seq = 0;
+  z->ranges.s = 0;
+  z->ranges.len = 0;
+  z->ranges.a = 0;
+  if (!soaserial(soa,soalen,z->serial)) byte_zero(z->serial,4);
+  z->flagauto = 0;
+  z->hash = 0;
+  z->flagold = 0;
+  if (!stralloc_catb(&zonenames,d,len)) nomem();
+  zonelens[(len >> 3) & 31] |= 1 << (len & 7);
+  *slot = ++numzones;
+}
+
+static void pack64(char *s,uint64 u)
+{
+  uint32_pack(s,(uint32) u);
+  uint32_pack(s + 4,(uint32) (u >> 32));
+}
+
+void die_zoneread(void)
+{
+  strerr_die2sys(111,FATAL,"unable to read data.tmp: ");
+}
+
+/* marks zone d as having an SOA record with the default serial */
+void zone_auto(const char *d,unsigned int len,const char serial[4])
+{
+  struct zone *z;
+  unsigned int *slot;
+
+  if (!numzoneslots) return;
+  slot = zone_slot(d,len);
+  if (!*slot) return;
+  z = zone + *slot - 1;
+  if (z->flagauto) return;
+  z->flagauto = 1;
+  byte_copy(z->autoserial,4,serial);
+}
+
+static stralloc autokey;
+
+void auto_add(const char *owner,const char serial[4])
+{
+  if (!stralloc_copyb(&autokey,"\0a",2)) nomem();
+  if (!stralloc_catb(&autokey,owner,dns_domain_length(owner))) nomem();
+  case_lowerb(autokey.s + 2,autokey.len - 2);
+  seg_put(autokey.s,autokey.len,serial,4);
+  if (!flagworker) zone_auto(autokey.s + 2,autokey.len - 2,serial);
+}
+
+#define ZONEHITS 16
+
+/* finds the zones that owner k is in; returns their number */
+static unsigned int zonehits(const char *k,unsigned int klen,unsigned int hit[ZONEHITS],int *flagdeep)
+{
+  unsigned int numhits = 0;
+  unsigned int i = 0;
+  unsigned int *slot;
+
+  while (i < klen) {
+    if (zonelens[((klen - i) >> 3) & 31] & (1 << ((klen - i) & 7))) {
+      slot = zone_slot(k + i,klen - i);
+      if (*slot) {
+        if (numhits == ZONEHITS) *flagdeep = 1;
+        else hit[numhits++] = *slot - 1;
+      }
+    }
+    if (!k[i]) break;
+    i += 1 + (unsigned char) k[i];
+  }
+  return numhits;
+}
+
+int zoneindex(void)
+{
+  struct cdb zc;
+  char buf[16];
+  const char *k;
+  uint64 pos;
+  uint64 end;
+  uint64 seq;
+  uint32 klen;
+  uint32 dlen;
+  unsigned int i;
+  struct zone *z;
+  static stralloc last; /* previous owner, and the zones it is in */
+  unsigned int hit[ZONEHITS];
+  unsigned int numhits = 0;
+  int flagdeep = 0; /* too many zones in zones: no index */
+  int fd;
+
+  if (!numzones) return 0;
+  if (cdb_make_flush(&cdb) == -1) die_datatmp();
+  fd = open_read("data.tmp");
+  if (fd == -1) strerr_die2sys(111,FATAL,"unable to read data.tmp: ");
+  cdb_init(&zc,fd);
+
+  seq = 0;
+  end = cdb.pos;
+  for (pos = 2048;pos < end;pos += 8 + (uint64) klen + dlen) {
+    k = cdb_get(&zc,buf,8,pos);
+    if (!k) die_zoneread();
+    uint32_unpack(k,&klen);
+    uint32_unpack(k + 4,&dlen);
+    if (!stralloc_ready(&key,klen)) nomem();
+    k = cdb_get(&zc,key.s,klen,pos + 8);
+    if (!k) die_zoneread();
+
+    if (klen && k[0]) {
+      ++seq;
+      if ((last.len != klen) || byte_diff(last.s,klen,k)) {
+	if (!stralloc_copyb(&last,k,klen)) nomem();
+	numhits = zonehits(k,dns_domain_length(k),hit,&flagdeep);
+      }
+      for (i = 0;i < numhits;++i) {
+	z = zone + hit[i];
+	if (z->ranges.len && (z->seq == seq - 1))
+	  pack64(z->ranges.s + z->ranges.len - 8,pos + 8 + klen + dlen);
+	else {
+	  pack64(buf,pos);
+	  pack64(buf + 8,pos + 8 + klen + dlen);
+	  if (!stralloc_catb(&z->ranges,buf,16)) nomem();
+	}
+	z->seq = seq;
+      }
+    }
+  }
+  cdb_free(&zc);
+  close(fd);
+  if (flagdeep) return 0;
+
+  for (i = 0;i < numzones;++i) {
+    z = zone + i;
+    if (!stralloc_copyb(&key,"\0z",2)) nomem();
+    if (!stralloc_catb(&key,zonenames.s + z->name,z->len)) nomem();
+    if (cdb_make_add(&cdb,key.s,key.len,z->ranges.s,z->ranges.len) == -1)
+      die_datatmp();
+  }
+  return 1;
+}
+
+/*
+Zone hashes, if $ZONEHASH is set: a zone whose SOA serial is the
+default keeps the serial it got last time, unless its records have
+changed since; then it gets the default, the mtime of the data file,
+or one more than the old serial if that is not larger. The file
+named by $ZONEHASH lists each such zone with a hash of its records,
+serials left out, and the serial it got. zonehash() writes the new
+serials into data.tmp, and the list to $ZONEHASH.tmp, which is moved
+into place after data.cdb.
+*/
+
+static stralloc hashfn;
+static stralloc hashtmp;
+static int flaghashed = 0;
+static stralloc patches; /* zone number and position of each serial */
+static stralloc hashline;
+static char *hashname;
+
+void die_hashtmp(void)
+{
+  strerr_die4sys(111,FATAL,"unable to create ",hashtmp.s,": ");
+}
+void die_hashread(void)
+{
+  strerr_die4sys(111,FATAL,"unable to read ",hashfn.s,": ");
+}
+
+static uint64 hashbytes(uint64 h,const char *s,unsigned int len)
+{
+  while (len--) {
+    h ^= (unsigned char) *s++;
+    h *= ((uint64) 0x100 << 32) + 0x1b3;
+  }
+  return h;
+}
+
+/* a default serial at k in data d; 0 if there is none */
+static unsigned int autopos(const char *k,unsigned int klen,const char *d,unsigned int dlen,unsigned int *num)
+{
+  unsigned int *slot;
+  unsigned int pos;
+  struct zone *z;
+
+  if ((dlen < 3) || byte_diff(d,2,DNS_T_SOA)) return 0;
+  slot = zone_slot(k,klen);
+  if (!*slot) return 0;
+  z = zone + *slot - 1;
+  if (!z->flagauto) return 0;
+  pos = soaserialpos(d,dlen);
+  if (!pos || byte_diff(d + pos,4,z->autoserial)) return 0;
+  *num = *slot - 1;
+  return pos;
+}
+
+static void patch_add(unsigned int num,uint64 pos)
+{
+  char buf[12];
+
+  uint32_pack(buf,num);
+  pack64(buf + 4,pos);
+  if (!stralloc_catb(&patches,buf,12)) nomem();
+}
+
+static void hashread(void)
+{
+  buffer hb;
+  char hbspace[1024];
+  unsigned int *slot;
+  unsigned int i;
+  unsigned int j;
+  unsigned long u;
+  struct zone *z;
+  uint64 h;
+  int flag = 1;
+  int fd;
+  char ch;
+
+  fd = open_read(hashfn.s);
+  if (fd == -1) {
+    if (errno == error_noent) return;
+    die_hashread();
+  }
+  buffer_init(&hb,buffer_unixread,fd,hbspace,sizeof hbspace);
+  while (flag) {
+    if (getln(&hb,&hashline,&flag,'\n') == -1) die_hashread();
+    if (hashline.len && (hashline.s[hashline.len - 1] == '\n')) --hashline.len;
+    i = byte_chr(hashline.s,hashline.len,':');
+    if (i + 18 > hashline.len) continue;
+    if (hashline.s[i + 17] != ':') continue;
+    h = 0;
+    for (j = i + 1;j < i + 17;++j) {
+      ch = hashline.s[j];
+      if ((ch >= '0') && (ch <= '9')) ch -= '0';
+      else if ((ch >= 'a') && (ch <= 'f')) ch -= 'a' - 10;
+      else break;
+      h = (h << 4) + ch;
+    }
+    if (j < i + 17) continue;
+    if (!stralloc_0(&hashline)) nomem();
+    if (!scan_ulong(hashline.s + i + 18,&u)) continue;
+    if (!dns_domain_fromdot(&hashname,hashline.s,i)) nomem();
+    case_lowerb(hashname,dns_domain_length(hashname));
+    slot = zone_slot(hashname,dns_domain_length(hashname));
+    if (!*slot) continue;
+    z = zone + *slot - 1;
+    z->flagold = 1;
+    z->oldhash = h;
+    z->oldserial = u;
+  }
+  close(fd);
+}
+
+void zonehash(void)
+{
+  struct cdb zc;
+  char buf[8];
+  const char *k;
+  const char *d;
+  uint64 pos;
+  uint64 end;
+  uint64 h;
+  uint32 klen;
+  uint32 dlen;
+  uint32 u;
+  unsigned int hit[ZONEHITS];
+  unsigned int numhits = 0;
+  unsigned int num;
+  unsigned int i;
+  unsigned int j;
+  static stralloc last;
+  struct zone *z;
+  buffer hb;
+  char hbspace[1024];
+  char strnum[FMT_ULONG];
+  int flagdeep = 0;
+  int fd;
+
+  if (!numzones) return;
+  if (cdb_make_flush(&cdb) == -1) die_datatmp();
+  fd = open_read("data.tmp");
+  if (fd == -1) die_zoneread();
+  cdb_init(&zc,fd);
+
+  end = cdb.pos;
+  for (pos = 2048;pos < end;pos += 8 + (uint64) klen + dlen) {
+    k = cdb_get(&zc,buf,8,pos);
+    if (!k) die_zoneread();
+    uint32_unpack(k,&klen);
+    uint32_unpack(k + 4,&dlen);
+    if (!stralloc_ready(&result,klen + dlen)) nomem();
+    k = cdb_get(&zc,result.s,klen + dlen,pos + 8);
+    if (!k) die_zoneread();
+    d = k + klen;
+
+    if ((klen > 4) && byte_equal(k,2,"\0t")) { /* a copy for the type index */
+      i = autopos(k + 4,klen - 4,d,dlen,&num);
+      if (i) patch_add(num,pos + 8 + klen + i);
+      continue;
+    }
+    if (!klen || !k[0]) continue;
+
+    if ((last.len != klen) || byte_diff(last.s,klen,k)) {
+      if (!stralloc_copyb(&last,k,klen)) nomem();
+      numhits = zonehits(k,dns_domain_length(k),hit,&flagdeep);
+    }
+    h = hashbytes(((uint64) 0xcbf29ce4 << 32) + 0x84222325,k,klen);
+    i = autopos(k,klen,d,dlen,&num);
+    if (i) {
+      patch_add(num,pos + 8 + klen + i);
+      h = hashbytes(h,d,i);
+      h = hashbytes(h,"\0\0\0\0",4);
+      h = hashbytes(h,d + i + 4,dlen - i - 4);
+    }
+    else
+      h = hashbytes(h,d,dlen);
+    for (i = 0;i < numhits;++i)
+      zone[hit[i]].hash += h; /* the order of records does not matter */
+  }
+  cdb_free(&zc);
+  close(fd);
+  if (flagdeep) return;
+
+  hashread();
+
+  for (z = zone;z < zone + numzones;++z) {
+    if (!z->flagauto) continue;
+    byte_copy(z->newserial,4,z->autoserial);
+    if (!z->flagold) continue;
+    if (z->hash == z->oldhash)
+      u = z->oldserial;
+    else {
+      uint32_unpack_big(z->autoserial,&u);
+      if (u <= z->oldserial) {
+        u = z->oldserial + 1;
+        if (!u) u = 1;
+      }
+    }
+    uint32_pack_big(z->newserial,u);
+    if (byte_equal(z->serial,4,z->autoserial))
+      byte_copy(z->serial,4,z->newserial);
+  }
+
+  for (i = 0;i < patches.len;i += 12) {
+    uint32_unpack(patches.s + i,&u);
+    z = zone + u;
+    if (byte_equal(z->newserial,4,z->autoserial)) continue;
+    uint32_unpack(patches.s + i + 4,&u);
+    uint32_unpack(patches.s + i + 8,&klen);
+    pos = ((uint64) klen << 32) + u;
+    if (pwrite(fdcdb,z->newserial,4,(off_t) pos) != 4) die_datatmp();
+  }
+
+  fd = open_trunc(hashtmp.s);
+  if (fd == -1) die_hashtmp();
+  buffer_init(&hb,buffer_unixwrite,fd,hbspace,sizeof hbspace);
+  for (z = zone;z < zone + numzones;++z) {
+    if (!z->flagauto) continue;
+    key.len = 0;
+    if (!dns_domain_todot_cat(&key,zonenames.s + z->name)) nomem();
+    if (!stralloc_readyplus(&key,18)) nomem();
+    key.s[key.len++] = ':';
+    for (j = 0;j < 16;++j)
+      key.s[key.len++] = "0123456789abcdef"[(z->hash >> (60 - 4 * j)) & 15];
+    key.s[key.len++] = ':';
+    uint32_unpack_big(z->newserial,&u);
+    if (!stralloc_catb(&key,strnum,fmt_ulong(strnum,u))) nomem();
+    if (!stralloc_cats(&key,"\n")) nomem();
+    if (buffer_put(&hb,key.s,key.len) == -1) die_hashtmp();
+  }
+  if (buffer_flush(&hb) == -1) die_hashtmp();
+  if (fsync(fd) == -1) die_hashtmp();
+  if (close(fd) == -1) die_hashtmp(); /* NFS stupidity */
+  flaghashed = 1;
+}
+
+/*
+Journal, if $IXFR is set: key "\0j" plus a name that owns an SOA
+record, data the changes that brought the zone to its current SOA
+serial, oldest first, so that axfrdns can answer IXFR. A change is
+its old and new serial, big-endian, the lengths of its deleted and
+added parts, 4 bytes each as in cdb, and then those parts: records
+laid out as in data.cdb. journal() compares each zone in data.tmp
+with the same zone in the data.cdb about to be replaced, and keeps at
+most $IXFR changes, fewer if together they outgrow the zone.
+*/
+
+static unsigned long ixfrmax = 0;
+
+struct jrec {
+  const char *s;
+  unsigned int len;
+} ;
+
+static int jreccmp(const void *x,const void *y)
+{
+  const struct jrec *a = x;
+  const struct jrec *b = y;
+  int r;
+
+  r = byte_diff(a->s,a->len < b->len ? a->len : b->len,b->s);
+  if (r) return r;
+  if (a->len == b->len) return 0;
+  return (a->len < b->len) ? -1 : 1;
+}
+
+void die_journal(void)
+{
+  strerr_die2sys(111,FATAL,"unable to read data.cdb: ");
+}
+
+/* copies every record of zone z in the given ranges to out */
+static void jread(struct cdb *c,const char *ranges,unsigned int len,const char *z,stralloc *out)
+{
+  char buf[8];
+  const char *k;
+  uint64 pos;
+  uint64 end;
+  uint32 klen;
+  uint32 dlen;
+  uint32 lo;
+  uint32 hi;
+  unsigned int i;
+  unsigned int n;
+
+  out->len = 0;
+  for (i = 0;i + 16 <= len;i += 16) {
+    uint32_unpack(ranges + i,&lo);
+    uint32_unpack(ranges + i + 4,&hi);
+    pos = ((uint64) hi << 32) + lo;
+    uint32_unpack(ranges + i + 8,&lo);
+    uint32_unpack(ranges + i + 12,&hi);
+    end = ((uint64) hi << 32) + lo;
+    while (pos < end) {
+      k = cdb_get(c,buf,8,pos);
+      if (!k) die_journal();
+      uint32_unpack(k,&klen);
+      uint32_unpack(k + 4,&dlen);
+      if (!stralloc_readyplus(out,8 + klen + dlen)) nomem();
+      k = cdb_get(c,out->s + out->len,8 + klen + dlen,pos);
+      if (!k) die_journal();
+      pos += 8 + (uint64) klen + dlen;
+      if (!klen || ((klen > 1) && !k[8])) continue; /* location or index */
+      if ((dlen < 2) || byte_equal(k + 8 + klen,2,"\0\0")) continue;
+      n = dns_packet_skipname(k + 8,klen,0); /* then any location */
+      if ((n != klen) && (n + 2 != klen)) continue;
+      if (!dns_domain_suffix(k + 8,z)) continue;
+      if (k != out->s + out->len) byte_copy(out->s + out->len,8 + klen + dlen,k);
+      out->len += 8 + klen + dlen;
+    }
+  }
+}
+
+/* sorts the records in sa; 0 if there is no SOA record at z */
+static struct jrec *jsplit(stralloc *sa,unsigned int *num,const char *z,char serial[4])
+{
+  struct jrec *r;
+  const char *d;
+  unsigned int i;
+  unsigned int n;
+  uint32 klen;
+  uint32 dlen;
+  int flagserial = 0;
+
+  n = 0;
+  for (i = 0;i < sa->len;i += 8 + klen + dlen) {
+    uint32_unpack(sa->s + i,&klen);
+    uint32_unpack(sa->s + i + 4,&dlen);
+    ++n;
+  }
+  r = (struct jrec *) alloc((n + 1) * sizeof(struct jrec));
+  if (!r) nomem();
+
+  n = 0;
+  for (i = 0;i < sa->len;i += 8 + klen + dlen) {
+    uint32_unpack(sa->s + i,&klen);
+    uint32_unpack(sa->s + i + 4,&dlen);
+    r[n].s = sa->s + i;
+    r[n++].len = 8 + klen + dlen;
+    if (flagserial) continue;
+    d = sa->s + i + 8 + klen;
+    if ((dlen < 3) || byte_diff(d,2,DNS_T_SOA)) continue;
+    if (!dns_domain_equal(sa->s + i + 8,z)) continue;
+    flagserial = soaserial(d,dlen,serial);
+  }
+  if (!flagserial) {
+    alloc_free((char *) r);
+    return 0;
+  }
+  qsort(r,n,sizeof(struct jrec),jreccmp);
+  *num = n;
+  return r;
+}
+
+static stralloc jold; /* the zone in data.cdb */
+static stralloc jnew; /* the zone in data.tmp */
+static stralloc jdel;
+static stralloc jadd;
+static stralloc jprev; /* the journal in data.cdb */
+
+/* appends the changes in jprev that fit with len more bytes */
+static void jkeep(const char oserial[4],uint32 len,unsigned int zonelen)
+{
+  unsigned int *start;
+  unsigned int num;
+  unsigned int i;
+  uint32 u;
+  uint32 v;
+
+  start = (unsigned int *) alloc((jprev.len / 16 + 1) * sizeof(unsigned int));
+  if (!start) nomem();
+  num = 0;
+  for (i = 0;jprev.len - i >= 16;i += 16 + u + v) {
+    uint32_unpack(jprev.s + i + 8,&u);
+    uint32_unpack(jprev.s + i + 12,&v);
+    if ((u > jprev.len) || (v > jprev.len - u) || (jprev.len - i - 16 < u + v)) break;
+    start[num++] = i;
+  }
+  if ((i != jprev.len) || !num || byte_diff(jprev.s + start[num - 1] + 4,4,oserial))
+    num = 0; /* damaged, or not a chain to this change */
+
+  for (i = 0;i < num;++i)
+    if ((num - i < ixfrmax) && (jprev.len - start[i] <= zonelen - len)) {
+      if (!stralloc_catb(&result,jprev.s + start[i],jprev.len - start[i])) nomem();
+      break;
+    }
+  alloc_free((char *) start);
+}
+
+/* 1 if c was packed with the dictionary in use now */
+static int samedict(struct cdb *c)
+{
+  int r;
+
+  r = cdb_find(c,"\0c",2);
+  if (r == -1) die_journal();
+  if (!r) return !flagdict;
+  if (!flagdict || (cdb_datalen(c) != dict.len)) return 0;
+  if (!stralloc_ready(&result,dict.len)) nomem();
+  if (cdb_read(c,result.s,dict.len,cdb_datapos(c)) == -1) die_journal();
+  return byte_equal(result.s,dict.len,dict.s);
+}
+
+void journal(void)
+{
+  struct cdb oc;
+  struct cdb nc;
+  struct jrec *o;
+  struct jrec *n;
+  struct zone *z;
+  const char *name;
+  unsigned int numo;
+  unsigned int numn;
+  unsigned int i;
+  unsigned int j;
+  char oserial[4];
+  char nserial[4];
+  int fdold;
+  int fdnew;
+  int r;
+
+  fdold = open_read("data.cdb");
+  if (fdold == -1) {
+    if (errno == error_noent) return;
+    die_journal();
+  }
+  if (cdb_make_flush(&cdb) == -1) die_datatmp();
+  fdnew = open_read("data.tmp");
+  if (fdnew == -1) die_zoneread();
+  cdb_init(&oc,fdold);
+  cdb_init(&nc,fdnew);
+  if (!samedict(&oc)) {
+    cdb_free(&oc);
+    cdb_free(&nc);
+    close(fdold);
+    close(fdnew);
+    return;
+  }
+
+  for (z = zone;z < zone + numzones;++z) {
+    name = zonenames.s + z->name;
+    if (!stralloc_copyb(&key,"\0z",2)) nomem();
+    if (!stralloc_catb(&key,name,z->len)) nomem();
+    r = cdb_find(&oc,key.s,key.len);
+    if (r == -1) die_journal();
+    if (!r) continue;
+    if (!stralloc_ready(&result,cdb_datalen(&oc))) nomem();
+    if (cdb_read(&oc,result.s,cdb_datalen(&oc),cdb_datapos(&oc)) == -1) die_journal();
+    jread(&oc,result.s,cdb_datalen(&oc),name,&jold);
+    jread(&nc,z->ranges.s,z->ranges.len,name,&jnew);
+
+    key.s[1] = 'j';
+    jprev.len = 0;
+    r = cdb_find(&oc,key.s,key.len);
+    if (r == -1) die_journal();
+    if (r) {
+      if (!stralloc_ready(&jprev,cdb_datalen(&oc))) nomem();
+      if (cdb_read(&oc,jprev.s,cdb_datalen(&oc),cdb_datapos(&oc)) == -1) die_journal();
+      jprev.len = cdb_datalen(&oc);
+    }
+
+    o = jsplit(&jold,&numo,name,oserial);
+    if (!o) continue;
+    n = jsplit(&jnew,&numn,name,nserial);
+    if (!n) { alloc_free((char *) o); continue; }
+
+    result.len = 0;
+    if (byte_equal(oserial,4,nserial)) {
+      if (!stralloc_copy(&result,&jprev)) nomem();
+    }
+    else {
+      jdel.len = jadd.len = 0;
+      i = j = 0;
+      while ((i < numo) || (j < numn)) {
+        r = (i == numo) ? 1 : (j == numn) ? -1 : jreccmp(o + i,n + j);
+        if (r < 0) {
+          if (!stralloc_catb(&jdel,o[i].s,o[i].len)) nomem();
+          ++i;
+        }
+        else if (r > 0) {
+          if (!stralloc_catb(&jadd,n[j].s,n[j].len)) nomem();
+          ++j;
+        }
+        else { ++i; ++j; }
+      }
+
+      if (16 + jdel.len + jadd.len <= jnew.len) {
+        jkeep(oserial,16 + jdel.len + jadd.len,jnew.len);
+        if (!stralloc_readyplus(&result,16)) nomem();
+        byte_copy(result.s + result.len,4,oserial);
+        byte_copy(result.s + result.len + 4,4,nserial);
+        uint32_pack(result.s + result.len + 8,jdel.len);
+        uint32_pack(result.s + result.len + 12,jadd.len);
+        result.len += 16;
+        if (!stralloc_cat(&result,&jdel)) nomem();
+        if (!stralloc_cat(&result,&jadd)) nomem();
+      }
+    }
+    alloc_free((char *) o);
+    alloc_free((char *) n);
+
+    if (result.len)
+      if (cdb_make_add(&cdb,key.s,key.len,result.s,result.len) == -1)
+        die_datatmp();
+  }
+
+  cdb_free(&oc);
+  cdb_free(&nc);
+  close(fdold);
+  close(fdnew);
+}
+
+/*
+Changed zones, if $NOTIFY is set: every zone whose SOA serial is not
+the one in the data.cdb about to be replaced is listed in the file
+named by $NOTIFY, one name per line, for dnsnotify. The list is
+written to $NOTIFY.tmp and moved into place after data.cdb.
+*/
+
+static stralloc notifyfn;
+static stralloc notifytmp;
+
+void die_notifytmp(void)
+{
+  strerr_die4sys(111,FATAL,"unable to create ",notifytmp.s,": ");
+}
+
+void notifylist(void)
+{
+  struct cdb oc;
+  struct zone *z;
+  buffer nb;
+  char nbspace[1024];
+  char serial[4];
+  int fdold;
+  int fd;
+  int r;
+
+  fdold = open_read("data.cdb");
+  if (fdold == -1)
+    if (errno != error_noent) die_journal();
+  if (fdold != -1) cdb_init(&oc,fdold);
+
+  fd = open_trunc(notifytmp.s);
+  if (fd == -1) die_notifytmp();
+  buffer_init(&nb,buffer_unixwrite,fd,nbspace,sizeof nbspace);
+
+  for (z = zone;z < zone + numzones;++z) {
+    if (fdold != -1) {
+      cdb_findstart(&oc);
+      for (;;) {
+        r = cdb_findnext(&oc,zonenames.s + z->name,z->len);
+        if (r == -1) die_journal();
+        if (!r) break;
+        if (!stralloc_ready(&result,cdb_datalen(&oc))) nomem();
+        if (cdb_read(&oc,result.s,cdb_datalen(&oc),cdb_datapos(&oc)) == -1) die_journal();
+        result.len = cdb_datalen(&oc);
+        if ((result.len < 3) || byte_diff(result.s,2,DNS_T_SOA)) continue;
+        if ((result.s[2] != '=') && (result.s[2] != '>')) continue;
+        if (!soaserial(result.s,result.len,serial)) continue;
+        break;
+      }
+      if (r && byte_equal(serial,4,z->serial)) continue;
+    }
+    key.len = 0;
+    if (!dns_domain_todot_cat(&key,zonenames.s + z->name)) nomem();
+    if (!stralloc_cats(&key,"\n")) nomem();
+    if (buffer_put(&nb,key.s,key.len) == -1) die_notifytmp();
+  }
+
+  if (buffer_flush(&nb) == -1) die_notifytmp();
+  if (fsync(fd) == -1) die_notifytmp();
+  if (close(fd) == -1) die_notifytmp(); /* NFS stupidity */
+  if (fdold != -1) {
+    cdb_free(&oc);
+    close(fdold);
+  }
+}
+
+/*
+Type index, if $TYPEINDEX is set: every record is written again
+under "\0t", its type, and its owner, so that tinydns can read one
+RRset without the rest. The empty key "\0t" says the index is there.
+*/
+
+static int flagtypeindex = 0;
+
+/*
+Location index, if $LOCINDEX is set: a record for one location, other
+than an SOA record or one at the root, goes under its owner and then
+its 2-byte location, in the type index as well, so that tinydns reads
+only the records of the client's location and those for every
+location. The owner itself gets a tombstone, once, so a delta still
+replaces everything under it. The empty key "\0v" says the index is
+there.
+*/
+
+static int flaglocindex = 0;
+static stralloc lastloc; /* owner of the last tombstone */
+
+static unsigned int locsuffix(const char *owner)
+{
+  if (!flaglocindex) return 0;
+  if ((result.s[2] != '>') && (result.s[2] != '+')) return 0;
+  if (byte_equal(result.s,2,DNS_T_SOA)) return 0;
+  if (!*owner) return 0;
+  if ((lastloc.len != dns_domain_length(owner)) || case_diffb(lastloc.s,lastloc.len,owner)) {
+    if (!stralloc_copyb(&lastloc,owner,dns_domain_length(owner))) nomem();
+    case_lowerb(lastloc.s,lastloc.len);
+    add(lastloc.s,lastloc.len,"\0\0=\0\0\0\0\0\0\0\0\0\0\0\0",15);
+  }
+  return 2;
+}
+
 void rr_finish(const char *owner)
 {
+  unsigned int loclen;
+
   if (byte_equal(owner,2,"\1*")) {
     owner += 2;
     result.s[2] -= 19;
+    cut_put(owner,CUT_WILD);
   }
+  else
+    cut_add(owner);
+  loclen = locsuffix(owner);
   if (!stralloc_copyb(&key,owner,dns_domain_length(owner))) nomem();
   case_lowerb(key.s,key.len);
-  if (cdb_make_add(&cdb,key.s,key.len,result.s,result.len) == -1)
-    die_datatmp();
+  if (!stralloc_catb(&key,result.s + 3,loclen)) nomem();
+  add(key.s,key.len,result.s,result.len);
+
+  if (!flagtypeindex) return;
+  if (!stralloc_copyb(&key,"\0t",2)) nomem();
+  if (!stralloc_catb(&key,result.s,2)) nomem();
+  if (!stralloc_catb(&key,owner,dns_domain_length(owner))) nomem();
+  case_lowerb(key.s + 4,key.len - 4);
+  if (!stralloc_catb(&key,result.s + 3,loclen)) nomem();
+  add(key.s,key.len,result.s,result.len);
 }
 
 buffer b;
@@ -165,25 +1531,156 @@ char bspace[1024];
 static stralloc line;
 int match = 1;
 unsigned long linenum = 0;
+const char *dataname = "data";
+unsigned long chunkstart = 0;
+unsigned long chunkleft;
 
 #define NUMFIELDS 15
 static stralloc f[NUMFIELDS];
 
 static char *d1;
 static char *d2;
+static stralloc locs; /* all % lines, for "\0l"; see clientloc.c */
 char dptr[DNS_NAME4_DOMAIN];
 
 char strnum[FMT_ULONG];
 
 void syntaxerror(const char *why)
 {
+  int fd;
+  int r;
+  int i;
+
+  if (chunkstart) {
+    fd = open_read("data");
+    if (fd == -1) strerr_die2sys(111,FATAL,"unable to open data: ");
+    while (chunkstart) {
+      r = read(fd,bspace,chunkstart < sizeof bspace ? chunkstart : sizeof bspace);
+      if (r <= 0) break;
+      for (i = 0;i < r;++i)
+        if (bspace[i] == '\n') ++linenum;
+      chunkstart -= r;
+    }
+  }
   strnum[fmt_ulong(strnum,linenum)] = 0;
-  strerr_die4x(111,FATAL,"unable to parse data line ",strnum,why);
+  strerr_die6x(111,FATAL,"unable to parse ",dataname," line ",strnum,why);
 }
 
-int main()
+int dataread(int fd,char *buf,unsigned int len)
+{
+  int r;
+
+  buildstat_start(BUILDSTAT_READ);
+  r = read(fd,buf,len);
+  buildstat_stop(BUILDSTAT_READ,r > 0 ? r : 0);
+  return r;
+}
+
+int chunkread(int fd,char *buf,unsigned int len)
+{
+  int r;
+
+  if (len > chunkleft) len = chunkleft;
+  if (!len) return 0;
+  r = dataread(fd,buf,len);
+  if (r > 0) chunkleft -= r;
+  return r;
+}
+
+/*
+A data file, or a file in data/, that starts with the 8 bytes of
+BINMAGIC holds records in binary instead of lines, for programs that
+generate data: each a 2-byte big-endian length and then that many
+bytes, the owner in wire format, the type, 4 bytes of TTL, the 8
+bytes of timestamp a ":" line would give, 2 bytes of location, "\0\0"
+for none, and the rdata, with any names in it uncompressed. Each goes
+through rr_start(), rr_add() and rr_finish() as the equivalent line
+would, so data.cdb comes out the same. Only AXFR is refused. There
+is no binary "%" line, nor a default SOA serial; those stay in text.
+Such a file is parsed by one process even with $WORKERS.
+*/
+
+#define BINMAGIC "\0tdrr\0\0\1"
+
+static stralloc rec;
+
+void binerror(const char *why)
+{
+  strnum[fmt_ulong(strnum,linenum)] = 0;
+  strerr_die6x(111,FATAL,"unable to parse ",dataname," record ",strnum,why);
+}
+
+/* returns 0 at the end of the input */
+int binget(char *buf,unsigned int len)
+{
+  int r;
+  unsigned int got = 0;
+
+  while (got < len) {
+    r = buffer_get(&b,buf + got,len - got);
+    if (r == -1) strerr_die2sys(111,FATAL,"unable to read data: ");
+    if (r == 0) {
+      if (!got) return 0;
+      binerror(": truncated record");
+    }
+    got += r;
+  }
+  return 1;
+}
+
+void binparse(void)
+{
+  char buf[2];
+  unsigned int len;
+  unsigned int pos;
+  unsigned int i;
+  uint16 u;
+  uint32 ttl;
+
+  for (;;) {
+    ++linenum;
+    if (!binget(buf,2)) return;
+    uint16_unpack_big(buf,&u);
+    len = u;
+    if (!stralloc_ready(&rec,len)) nomem();
+    if (len && !binget(rec.s,len)) binerror(": truncated record");
+
+    pos = 0;
+    for (;;) {
+      if (pos >= len) binerror(": truncated record");
+      i = (unsigned char) rec.s[pos];
+      if (i > 63) binerror(": bad owner");
+      pos += i + 1;
+      if (!i) break;
+    }
+    if (pos > 255) binerror(": bad owner");
+    if (len < pos + 16) binerror(": truncated record");
+    if (byte_equal(rec.s + pos,2,DNS_T_AXFR))
+      binerror(": type AXFR prohibited");
+
+    uint32_unpack_big(rec.s + pos + 2,&ttl);
+    rr_start(rec.s + pos,ttl,rec.s + pos + 6,rec.s + pos + 14);
+    rr_add(rec.s + pos + 16,len - pos - 16);
+    rr_finish(rec.s);
+    buildstat_line(0);
+  }
+}
+
+/* returns 1 if fddata, read from the start, holds binary records */
+int binfile(int fddata)
+{
+  char buf[8];
+  int r;
+
+  r = read(fddata,buf,8);
+  if (r == -1) strerr_die2sys(111,FATAL,"unable to read data: ");
+  if (lseek(fddata,(off_t) 0,SEEK_SET) == -1)
+    strerr_die2sys(111,FATAL,"unable to read data: ");
+  return (r == 8) && byte_equal(buf,8,BINMAGIC);
+}
+
+void parse(int fddata,int (*op)())
 {
-  int fddata;
   int i;
   int j;
   int k;
@@ -196,19 +1693,21 @@ int main()
   char type[2];
   char soa[20];
   char buf[4];
+  int flagauto;
 
-  umask(022);
-
-  fddata = open_read("data");
-  if (fddata == -1)
-    strerr_die2sys(111,FATAL,"unable to open data: ");
   defaultsoa_init(fddata);
-
-  buffer_init(&b,buffer_unixread,fddata,bspace,sizeof bspace);
-
-  fdcdb = open_trunc("data.tmp");
-  if (fdcdb == -1) die_datatmp();
-  if (cdb_make_start(&cdb,fdcdb) == -1) die_datatmp();
+  buffer_init(&b,op,fddata,bspace,sizeof bspace);
+  match = 1;
+  linenum = 0;
+  cutkey.len = 0;
+
+  i = buffer_feed(&b);
+  if (i == -1) strerr_die2sys(111,FATAL,"unable to read line: ");
+  if ((i >= 8) && byte_equal(buffer_PEEK(&b),8,BINMAGIC)) {
+    buffer_SEEK(&b,8);
+    binparse();
+    return;
+  }
 
   while (match) {
     ++linenum;
@@ -221,6 +1720,7 @@ int main()
       --line.len;
     }
     if (!line.len) continue;
+    buildstat_line(line.s[0]);
     if (line.s[0] == '#') continue;
     if (line.s[0] == '-') continue;
 
@@ -243,15 +1743,23 @@ int main()
 	if (!stralloc_copyb(&key,"\0%",2)) nomem();
 	if (!stralloc_0(&f[1])) nomem();
 	ipprefix_cat(&key,f[1].s);
-        if (cdb_make_add(&cdb,key.s,key.len,loc,2) == -1)
-          die_datatmp();
+	add(key.s,key.len,loc,2);
+	if (key.len <= 6) {
+	  i = locs.len;
+	  ch = key.len - 2;
+	  if (!stralloc_catb(&locs,&ch,1)) nomem();
+	  if (!stralloc_catb(&locs,key.s + 2,key.len - 2)) nomem();
+	  if (!stralloc_catb(&locs,loc,2)) nomem();
+	  seg_put("\0l",2,locs.s + i,locs.len - i);
+	}
 	break;
 
       case 'Z':
 	if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
 
 	if (!stralloc_0(&f[3])) nomem();
-	if (!scan_ulong(f[3].s,&u)) uint32_unpack_big(defaultsoa,&u);
+	flagauto = !scan_ulong(f[3].s,&u);
+	if (flagauto) uint32_unpack_big(defaultsoa,&u);
 	uint32_pack_big(soa,u);
 	if (!stralloc_0(&f[4])) nomem();
 	if (!scan_ulong(f[4].s,&u)) uint32_unpack_big(defaultsoa + 4,&u);
@@ -278,6 +1786,7 @@ int main()
 	rr_addname(d2);
 	rr_add(soa,20);
 	rr_finish(d1);
+	if (flagauto) auto_add(d1,soa);
 	break;
 
       case '.': case '&':
@@ -302,6 +1811,7 @@ int main()
 	  rr_addname(d1);
 	  rr_add(defaultsoa,20);
 	  rr_finish(d1);
+	  auto_add(d1,defaultsoa);
 	}
 
 	rr_start(DNS_T_NS,ttl,ttd,loc);
@@ -441,16 +1951,505 @@ int main()
 	rr_finish(d1);
 	break;
 
+      case '~':
+	if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
+	rr_start("\0\0",0,"\0\0\0\0\0\0\0\0","\0\0");
+	rr_finish(d1);
+	break;
+
       default:
         syntaxerror(": unrecognized leading character");
     }
   }
+}
+
+void seghead(char h[32],struct stat *st)
+{
+  byte_copy(h,8,"tdseg\0\1\0"); /* \1: with "\0a" records */
+  h[7] = flagtypeindex + 2 * flaglocindex;
+  uint32_pack(h + 8,(uint32) st->st_size);
+  uint32_pack(h + 12,(uint32) ((st->st_size >> 16) >> 16));
+  uint32_pack(h + 16,(uint32) st->st_mtime);
+  uint32_pack(h + 20,(uint32) ((st->st_mtime >> 16) >> 16));
+  uint32_pack(h + 24,(uint32) st->st_ino);
+  uint32_pack(h + 28,(uint32) ((st->st_ino >> 16) >> 16));
+}
 
+/* returns 0 at the end of the segment */
+int seg_get(const char *fn,char *buf,unsigned int len)
+{
+  int r;
+  unsigned int got = 0;
+
+  while (got < len) {
+    r = buffer_get(&sb,buf + got,len - got);
+    if (r == -1) strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+    if (r == 0) {
+      if (!got) return 0;
+      strerr_die4x(111,FATAL,"unable to read ",fn,": truncated file");
+    }
+    got += r;
+  }
+  return 1;
+}
+
+/* returns 0 if fn is missing or was built from another version */
+int seg_open(const char *fn,const char h[32])
+{
+  char buf[32];
+
+  fdseg = open_read(fn);
+  if (fdseg == -1) {
+    if (errno == error_noent) return 0;
+    strerr_die4sys(111,FATAL,"unable to open ",fn,": ");
+  }
+  buffer_init(&sb,buffer_unixread,fdseg,sbspace,sizeof sbspace);
+  if (!seg_get(fn,buf,32) || byte_diff(buf,32,h)) {
+    close(fdseg);
+    return 0;
+  }
+  return 1;
+}
+
+void seg_copy(const char *fn)
+{
+  char buf[8];
+  uint32 klen;
+  uint32 dlen;
+
+  while (seg_get(fn,buf,8)) {
+    uint32_unpack(buf,&klen);
+    uint32_unpack(buf + 4,&dlen);
+    if (!stralloc_ready(&key,klen)) nomem();
+    if (!stralloc_ready(&result,dlen)) nomem();
+    if (!seg_get(fn,key.s,klen) && klen)
+      strerr_die4x(111,FATAL,"unable to read ",fn,": truncated file");
+    if (!seg_get(fn,result.s,dlen) && dlen)
+      strerr_die4x(111,FATAL,"unable to read ",fn,": truncated file");
+    if ((klen == 2) && byte_equal(key.s,2,"\0l")) {
+      if (!stralloc_catb(&locs,result.s,dlen)) nomem();
+    }
+    else if ((klen > 2) && byte_equal(key.s,2,"\0a")) {
+      if (dlen == 4) zone_auto(key.s + 2,klen - 2,result.s);
+    }
+    else
+      cdbadd(key.s,klen,result.s,dlen);
+  }
+
+  close(fdseg);
+}
+
+static stralloc path;
+static stralloc segname;
+
+/* returns -1 if data/fn is not a regular file */
+int datafile_open(const char *fn,char h[32])
+{
+  struct stat st;
+  int fddata;
+
+  if (!stralloc_copys(&path,"data/")) nomem();
+  if (!stralloc_cats(&path,fn)) nomem();
+  if (!stralloc_0(&path)) nomem();
+  if (!stralloc_copys(&segname,"seg/")) nomem();
+  if (!stralloc_cats(&segname,fn)) nomem();
+  if (!stralloc_0(&segname)) nomem();
+  if (!stralloc_copys(&segtmp,"seg/.")) nomem();
+  if (!stralloc_cats(&segtmp,fn)) nomem();
+  if (!stralloc_cats(&segtmp,".tmp")) nomem();
+  if (!stralloc_0(&segtmp)) nomem();
+
+  fddata = open_read(path.s);
+  if (fddata == -1)
+    strerr_die4sys(111,FATAL,"unable to open ",path.s,": ");
+  if (fstat(fddata,&st) == -1)
+    strerr_die4sys(111,FATAL,"unable to stat ",path.s,": ");
+  if (!S_ISREG(st.st_mode)) { close(fddata); return -1; }
+  seghead(h,&st);
+  return fddata;
+}
+
+void seg_write(int fddata,const char h[32])
+{
+  fdseg = open_trunc(segtmp.s);
+  if (fdseg == -1) die_segtmp();
+  buffer_init(&sb,buffer_unixwrite,fdseg,sbspace,sizeof sbspace);
+  if (buffer_put(&sb,h,32) == -1) die_segtmp();
+  flagseg = 1;
+  dataname = path.s;
+  parse(fddata,dataread);
+  flagseg = 0;
+  if (buffer_flush(&sb) == -1) die_segtmp();
+  if (fsync(fdseg) == -1) die_segtmp();
+  if (close(fdseg) == -1) die_segtmp();
+  if (rename(segtmp.s,segname.s) == -1)
+    strerr_die6sys(111,FATAL,"unable to move ",segtmp.s," to ",segname.s,": ");
+}
+
+void datafile(const char *fn)
+{
+  int fddata;
+  char h[32];
+
+  fddata = datafile_open(fn,h);
+  if (fddata == -1) return;
+  if (seg_open(segname.s,h))
+    seg_copy(segname.s);
+  else
+    seg_write(fddata,h);
+  close(fddata);
+}
+
+/*
+With $WORKERS, that many processes parse at once. For a data file,
+worker i parses the i-th of $WORKERS line-aligned chunks into
+data.tmp.i; for a data directory, the workers split the files whose
+segments are out of date. The parent then reads the segments in
+order, so the output is the same as from a single process. The hash
+tables at the end of data.cdb are filled by as many processes too;
+see cdb_make_workers().
+*/
+
+#define MAXWORKERS 64
+static int pidworker[MAXWORKERS];
+static unsigned long numworkers = 1;
+
+/* returns 0 if a worker failed */
+int waitworkers(unsigned long n)
+{
+  unsigned long i;
+  int wstat;
+  int flagfailed = 0;
+
+  for (i = 0;i < n;++i) {
+    while (waitpid(pidworker[i],&wstat,0) == -1)
+      if (errno != error_intr)
+        strerr_die2sys(111,FATAL,"unable to wait for worker: ");
+    if (!WIFEXITED(wstat) || WEXITSTATUS(wstat)) flagfailed = 1;
+  }
+  return !flagfailed;
+}
+
+void chunkname(unsigned long i)
+{
+  if (!stralloc_copys(&segtmp,"data.tmp.")) nomem();
+  if (!stralloc_catb(&segtmp,strnum,fmt_ulong(strnum,i))) nomem();
+  if (!stralloc_0(&segtmp)) nomem();
+}
+
+void chunks(int fddata,struct stat *st)
+{
+  unsigned long pos[MAXWORKERS + 1];
+  unsigned long i;
+  int r;
+  int pid;
+  char h[32];
+
+  seghead(h,st);
+
+  pos[0] = 0;
+  for (i = 1;i < numworkers;++i) {
+    pos[i] = (unsigned long) st->st_size / numworkers * i;
+    if (pos[i] < pos[i - 1]) pos[i] = pos[i - 1];
+    if (lseek(fddata,(off_t) pos[i],SEEK_SET) == -1)
+      strerr_die2sys(111,FATAL,"unable to read data: ");
+    buffer_init(&b,buffer_unixread,fddata,bspace,sizeof bspace);
+    for (;;) {
+      r = buffer_get(&b,bspace,1);
+      if (r == -1) strerr_die2sys(111,FATAL,"unable to read data: ");
+      if (r == 0) break;
+      ++pos[i];
+      if (bspace[0] == '\n') break;
+    }
+  }
+  pos[numworkers] = st->st_size;
+
+  for (i = 0;i < numworkers;++i) {
+    chunkname(i);
+    pid = fork();
+    if (pid == -1) strerr_die2sys(111,FATAL,"unable to fork: ");
+    if (pid == 0) {
+      close(fddata);
+      fddata = open_read("data");
+      if (fddata == -1)
+        strerr_die2sys(111,FATAL,"unable to open data: ");
+      if (lseek(fddata,(off_t) pos[i],SEEK_SET) == -1)
+        strerr_die2sys(111,FATAL,"unable to read data: ");
+      fdseg = open_trunc(segtmp.s);
+      if (fdseg == -1) die_segtmp();
+      buffer_init(&sb,buffer_unixwrite,fdseg,sbspace,sizeof sbspace);
+      if (buffer_put(&sb,h,32) == -1) die_segtmp();
+      flagseg = 1;
+      flagworker = 1;
+      buildstat_worker(i);
+      chunkstart = pos[i];
+      chunkleft = pos[i + 1] - pos[i];
+      parse(fddata,chunkread);
+      if (buffer_flush(&sb) == -1) die_segtmp();
+      if (close(fdseg) == -1) die_segtmp();
+      _exit(0);
+    }
+    pidworker[i] = pid;
+  }
+  if (!waitworkers(numworkers)) {
+    for (i = 0;i < numworkers;++i) {
+      chunkname(i);
+      unlink(segtmp.s);
+    }
+    _exit(111);
+  }
+
+  for (i = 0;i < numworkers;++i) {
+    chunkname(i);
+    if (!seg_open(segtmp.s,h))
+      strerr_die4x(111,FATAL,"unable to read ",segtmp.s,": bad header");
+    seg_copy(segtmp.s);
+    if (unlink(segtmp.s) == -1)
+      strerr_die4sys(111,FATAL,"unable to remove ",segtmp.s,": ");
+  }
+}
+
+static stralloc names;
+static char **name;
+static unsigned int numnames = 0;
+
+int namecmp(const void *x,const void *y)
+{
+  return str_diff(*(char * const *) x,*(char * const *) y);
+}
+
+void readnames(void)
+{
+  DIR *dir;
+  direntry *d;
+  unsigned int i;
+  unsigned int j;
+
+  dir = opendir("data");
+  if (!dir) strerr_die2sys(111,FATAL,"unable to open data: ");
+  for (;;) {
+    errno = 0;
+    d = readdir(dir);
+    if (!d) {
+      if (errno) strerr_die2sys(111,FATAL,"unable to read data: ");
+      break;
+    }
+    if (d->d_name[0] == '.') continue;
+    if (!stralloc_cats(&names,d->d_name)) nomem();
+    if (!stralloc_0(&names)) nomem();
+    ++numnames;
+  }
+  closedir(dir);
+
+  name = (char **) alloc((numnames + 1) * sizeof(char *));
+  if (!name) nomem();
+  j = 0;
+  for (i = 0;i < numnames;++i) {
+    name[i] = names.s + j;
+    j += str_len(names.s + j) + 1;
+  }
+  qsort(name,numnames,sizeof(char *),namecmp);
+}
+
+/* brings the out-of-date segments up to date, in parallel */
+void refresh(void)
+{
+  char *stale;
+  unsigned long numstale = 0;
+  unsigned long n;
+  unsigned long w;
+  unsigned int i;
+  int fddata;
+  int pid;
+  char h[32];
+
+  stale = alloc(numnames + 1);
+  if (!stale) nomem();
+  for (i = 0;i < numnames;++i) {
+    stale[i] = 0;
+    fddata = datafile_open(name[i],h);
+    if (fddata == -1) continue;
+    if (seg_open(segname.s,h))
+      close(fdseg);
+    else {
+      stale[i] = 1;
+      ++numstale;
+    }
+    close(fddata);
+  }
+
+  n = numworkers;
+  if (n > numstale) n = numstale;
+  if (n > 1) {
+    for (w = 0;w < n;++w) {
+      pid = fork();
+      if (pid == -1) strerr_die2sys(111,FATAL,"unable to fork: ");
+      if (pid == 0) {
+        flagworker = 1;
+        buildstat_worker(w);
+        numstale = 0;
+        for (i = 0;i < numnames;++i)
+          if (stale[i])
+            if (numstale++ % n == w) {
+              fddata = datafile_open(name[i],h);
+              if (fddata == -1) continue;
+              seg_write(fddata,h);
+              close(fddata);
+            }
+        _exit(0);
+      }
+      pidworker[w] = pid;
+    }
+    if (!waitworkers(n)) _exit(111);
+  }
+  alloc_free(stale);
+}
+
+/* removes segments of files that are gone, and leftover temporaries */
+void sweep(void)
+{
+  DIR *dir;
+  direntry *d;
+  char *fn;
+
+  dir = opendir("seg");
+  if (!dir) strerr_die2sys(111,FATAL,"unable to open seg: ");
+  for (;;) {
+    errno = 0;
+    d = readdir(dir);
+    if (!d) {
+      if (errno) strerr_die2sys(111,FATAL,"unable to read seg: ");
+      break;
+    }
+    fn = d->d_name;
+    if (str_equal(fn,".") || str_equal(fn,"..")) continue;
+    if (bsearch(&fn,name,numnames,sizeof(char *),namecmp)) continue;
+    if (!stralloc_copys(&segname,"seg/")) nomem();
+    if (!stralloc_cats(&segname,fn)) nomem();
+    if (!stralloc_0(&segname)) nomem();
+    if (unlink(segname.s) == -1)
+      strerr_die4sys(111,FATAL,"unable to remove ",segname.s,": ");
+  }
+  closedir(dir);
+}
+
+int main()
+{
+  struct stat st;
+  int fddata;
+  unsigned int i;
+  char *x;
+
+  umask(022);
+
+  x = env_get("WORKERS");
+  if (x) {
+    scan_ulong(x,&numworkers);
+    if (numworkers < 1) numworkers = 1;
+    if (numworkers > MAXWORKERS) numworkers = MAXWORKERS;
+  }
+  buildstat_init(numworkers);
+  buildstat_phase("parse");
+
+  fddata = open_read("data");
+  if (fddata == -1)
+    strerr_die2sys(111,FATAL,"unable to open data: ");
+  if (fstat(fddata,&st) == -1)
+    strerr_die2sys(111,FATAL,"unable to stat data: ");
+
+  fdcdb = open_trunc("data.tmp");
+  if (fdcdb == -1) die_datatmp();
+  if (cdb_make_start(&cdb,fdcdb) == -1) die_datatmp();
+  cdb_make_buffer(&cdb,CDB_BUFFER);
+  fdspill = open_rwtrunc("data.spill");
+  if (fdspill == -1)
+    strerr_die2sys(111,FATAL,"unable to create data.spill: ");
+  unlink("data.spill");
+  cdb_make_spill(&cdb,fdspill);
+  cdb_make_workers(&cdb,numworkers);
+  if (cdb_make_add(&cdb,"\0/",2,"",0) == -1) die_datatmp();
+  if (cdb_make_add(&cdb,"\0*",2,"",0) == -1) die_datatmp();
+  if (env_get("TYPEINDEX")) {
+    flagtypeindex = 1;
+    if (cdb_make_add(&cdb,"\0t",2,"",0) == -1) die_datatmp();
+  }
+  if (env_get("LOCINDEX")) {
+    flaglocindex = 1;
+    if (cdb_make_add(&cdb,"\0v",2,"",0) == -1) die_datatmp();
+  }
+  if (env_get("NAMEFILTER")) flagnamefilter = 1;
+  x = env_get("HOTNAMES");
+  if (x) hotread(x);
+  x = env_get("TXTDICT");
+  if (x) {
+    if (!stralloc_copys(&dictfn,x)) nomem();
+    if (!stralloc_copy(&dicttmp,&dictfn)) nomem();
+    if (!stralloc_cats(&dicttmp,".tmp")) nomem();
+    if (!stralloc_0(&dictfn)) nomem();
+    if (!stralloc_0(&dicttmp)) nomem();
+    dictread();
+  }
+  x = env_get("IXFR");
+  if (x) scan_ulong(x,&ixfrmax);
+  x = env_get("ZONEHASH");
+  if (x) {
+    if (!stralloc_copys(&hashfn,x)) nomem();
+    if (!stralloc_copy(&hashtmp,&hashfn)) nomem();
+    if (!stralloc_cats(&hashtmp,".tmp")) nomem();
+    if (!stralloc_0(&hashfn)) nomem();
+    if (!stralloc_0(&hashtmp)) nomem();
+  }
+  x = env_get("NOTIFY");
+  if (x) {
+    if (!stralloc_copys(&notifyfn,x)) nomem();
+    if (!stralloc_copy(&notifytmp,&notifyfn)) nomem();
+    if (!stralloc_cats(&notifytmp,".tmp")) nomem();
+    if (!stralloc_0(&notifyfn)) nomem();
+    if (!stralloc_0(&notifytmp)) nomem();
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    close(fddata);
+    readnames();
+    if (mkdir("seg",0755) == -1)
+      if (errno != error_exist)
+        strerr_die2sys(111,FATAL,"unable to create seg: ");
+    if (numworkers > 1) refresh();
+    for (i = 0;i < numnames;++i) datafile(name[i]);
+    sweep();
+  }
+  else if ((numworkers > 1) && !binfile(fddata))
+    chunks(fddata,&st);
+  else
+    parse(fddata,dataread);
+
+  buildstat_phase("index");
+  hotflush();
+  if (dictfn.len) dictfinish();
+  if (hashfn.len) zonehash();
+  if (zoneindex())
+    if (ixfrmax) journal();
+  if (notifyfn.len) notifylist();
+  if (flagnamefilter) namefilter();
+  if (cdb_make_add(&cdb,"\0l",2,locs.s,locs.len) == -1) die_datatmp();
+  ttdflush();
+  buildstat_phase("finish");
   if (cdb_make_finish(&cdb) == -1) die_datatmp();
+  buildstat_phase("sync");
   if (fsync(fdcdb) == -1) die_datatmp();
   if (close(fdcdb) == -1) die_datatmp(); /* NFS stupidity */
   if (rename("data.tmp","data.cdb") == -1)
     strerr_die2sys(111,FATAL,"unable to move data.tmp to data.cdb: ");
-
+  if (flaghashed)
+    if (rename(hashtmp.s,hashfn.s) == -1)
+      strerr_die6sys(111,FATAL,"unable to move ",hashtmp.s," to ",hashfn.s,": ");
+  if (flagtrained)
+    if (rename(dicttmp.s,dictfn.s) == -1)
+      strerr_die6sys(111,FATAL,"unable to move ",dicttmp.s," to ",dictfn.s,": ");
+  if (notifyfn.len)
+    if (rename(notifytmp.s,notifyfn.s) == -1)
+      strerr_die6sys(111,FATAL,"unable to move ",notifytmp.s," to ",notifyfn.s,": ");
+
+  buildstat_report("data.cdb");
   _exit(0);
 }
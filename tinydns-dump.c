@@ -0,0 +1,84 @@
+#include "uint32.h"
+#include "uint64.h"
+#include "buffer.h"
+#include "strerr.h"
+#include "fmt.h"
+#include "scan.h"
+#include "open.h"
+#include "exit.h"
+#include "cdb.h"
+
+#define FATAL "tinydns-dump: fatal: "
+
+/*
+tinydns-dump prints the records of data.cdb, a cdb or a cdb64, in
+file order, in the format cdbmake reads: +klen,dlen:key->data, then
+an empty line at the end. tinydns-dump i n prints only the i-th of n
+parts, counting from 0, so that n of them can go at once; the empty
+line comes with the last part, and the parts put together in order
+are what tinydns-dump prints by itself.
+*/
+
+void usage(void)
+{
+  strerr_die1x(100,"tinydns-dump: usage: tinydns-dump [ i n ]");
+}
+void die_read(void)
+{
+  strerr_die2sys(111,FATAL,"unable to read data.cdb: ");
+}
+void die_write(void)
+{
+  strerr_die2sys(111,FATAL,"unable to write output: ");
+}
+
+void put(const char *s,unsigned int len)
+{
+  if (buffer_put(buffer_1,s,len) == -1) die_write();
+}
+
+char strnum[FMT_ULONG];
+
+void putnum(unsigned long u)
+{
+  put(strnum,fmt_ulong(strnum,u));
+}
+
+static struct cdb c;
+static struct cdb_scan s;
+
+int main(int argc,char **argv)
+{
+  unsigned long i = 0;
+  unsigned long n = 1;
+  int fd;
+  int r;
+
+  if (argc > 1) {
+    if (argc != 3) usage();
+    if (!*argv[1] || argv[1][scan_ulong(argv[1],&i)]) usage();
+    if (!*argv[2] || argv[2][scan_ulong(argv[2],&n)]) usage();
+    if (!n || (i >= n) || (n > 65536)) usage();
+  }
+
+  fd = open_read("data.cdb");
+  if (fd == -1) die_read();
+  cdb_init(&c,fd);
+  if (cdb_scanshard(&s,&c,i,n) == -1) die_read();
+
+  while ((r = cdb_scannext(&s)) == 1) {
+    put("+",1);
+    putnum(s.klen);
+    put(",",1);
+    putnum(s.dlen);
+    put(":",1);
+    put(s.key,s.klen);
+    put("->",2);
+    put(s.data,s.dlen);
+    put("\n",1);
+  }
+  if (r == -1) die_read();
+  if (i + 1 == n) put("\n",1);
+  if (buffer_flush(buffer_1) == -1) die_write();
+  _exit(0);
+}
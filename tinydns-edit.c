@@ -14,6 +14,14 @@
 #include "fmt.h"
 #include "ip4.h"
 #include "dns.h"
+#include "case.h"
+#include "env.h"
+#include "alloc.h"
+#include "error.h"
+#include "seek.h"
+#include "uint32.h"
+#include "cdb.h"
+#include "cdb_make.h"
 
 #define FATAL "tinydns-edit: fatal: "
 
@@ -25,7 +33,7 @@ char *fnnew;
 
 void die_usage()
 {
-  strerr_die1x(100,"tinydns-edit: usage: tinydns-edit data data.new add [ns|childns|host|alias|mx] domain a.b.c.d");
+  strerr_die1x(100,"tinydns-edit: usage: tinydns-edit data data.new { add [ns|childns|host|alias|mx] domain a.b.c.d | batch }");
 }
 void nomem()
 {
@@ -40,10 +48,6 @@ void die_write()
   strerr_die4sys(100,FATAL,"tinydns-edit: fatal: unable to write ",fnnew,": ");
 }
 
-char mode;
-static char *target;
-char targetip[4];
-
 int fd;
 buffer b;
 char bspace[1024];
@@ -64,53 +68,560 @@ char ip[4];
 char ipstr[IP4_FMT];
 char strnum[FMT_ULONG];
 
-static char *names[26];
-static int used[26];
-
 void put(const char *buf,unsigned int len)
 {
   if (buffer_putalign(&bnew,buf,len) == -1) die_write();
 }
 
-int main(int argc,char **argv)
+/*
+The operations are read first, from the command line or, for batch,
+one "add ..." line each from stdin. Every name, IP address or domain
+they touch is a key in a small hash table: "=" and a host name, "i"
+and an IP address, or "." "&" "@" and a domain, which collects a
+bit for each letter already used in its NS or MX names and the TTL
+of its last record. One pass over data fills in the keys, and the
+operations are then checked and applied in order, as if run one at
+a time.
+*/
+
+struct op {
+  char mode;
+  char *target;
+  char ip[4];
+  unsigned long linenum;
+} ;
+
+static struct op *op;
+static unsigned int numops = 0;
+static unsigned int maxops = 0;
+static int flagbatch = 0;
+
+struct entry {
+  unsigned int key; /* position in keys */
+  unsigned int keylen;
+  uint32 mask;
+  uint32 ttl;
+  int flagused;
+} ;
+
+static stralloc keys;
+static struct entry *entry;
+static unsigned int numentries = 0;
+static unsigned int *slot; /* entry number plus 1, or 0 */
+static unsigned int numslots = 0;
+
+static stralloc key;
+
+void key_make(char mode,const char *d,unsigned int len)
+{
+  if (!stralloc_copyb(&key,&mode,1)) nomem();
+  if (!stralloc_catb(&key,d,len)) nomem();
+  case_lowerb(key.s + 1,key.len - 1);
+}
+
+struct entry *entry_find(int flagcreate)
+{
+  unsigned int i;
+  struct entry *e;
+
+  if (!numslots) return 0;
+  i = cdb_hash(key.s,key.len) & (numslots - 1);
+  while (slot[i]) {
+    e = entry + slot[i] - 1;
+    if (e->keylen == key.len)
+      if (byte_equal(keys.s + e->key,key.len,key.s)) return e;
+    i = (i + 1) & (numslots - 1);
+  }
+  if (!flagcreate) return 0;
+
+  e = entry + numentries++;
+  slot[i] = numentries;
+  e->key = keys.len;
+  e->keylen = key.len;
+  e->mask = 0;
+  e->ttl = (key.s[0] == '@') ? TTL_POSITIVE : TTL_NS;
+  e->flagused = 0;
+  if (!stralloc_catb(&keys,key.s,key.len)) nomem();
+  return e;
+}
+
+void entries_init(void)
+{
+  unsigned int i;
+
+  numslots = 64;
+  while (numslots < 4 * numops) numslots <<= 1;
+  slot = (unsigned int *) alloc(numslots * sizeof(unsigned int));
+  if (!slot) nomem();
+  for (i = 0;i < numslots;++i) slot[i] = 0;
+  entry = (struct entry *) alloc(2 * numops * sizeof(struct entry) + 1);
+  if (!entry) nomem();
+
+  for (i = 0;i < numops;++i)
+    switch(op[i].mode) {
+      case '=':
+	key_make('=',op[i].target,dns_domain_length(op[i].target));
+	entry_find(1);
+	key_make('i',op[i].ip,4);
+	entry_find(1);
+	break;
+      case '.': case '&': case '@':
+	key_make(op[i].mode,op[i].target,dns_domain_length(op[i].target));
+	entry_find(1);
+	break;
+    }
+}
+
+/* ties a new key from data to the table, and to the index if any */
+static int flagindex = 0;
+struct cdb_make cdbm;
+
+void found(uint32 mask,uint32 ttl)
+{
+  struct entry *e;
+  char buf[8];
+
+  if (flagindex == 2) {
+    uint32_pack(buf,mask);
+    uint32_pack(buf + 4,ttl);
+    if (cdb_make_add(&cdbm,key.s,key.len,buf,8) == -1) die_write();
+  }
+  e = entry_find(0);
+  if (!e) return;
+  e->flagused = 1;
+  e->mask |= mask;
+  if (key.s[0] != '=') if (key.s[0] != 'i') e->ttl = ttl;
+}
+
+/* bit for x.ns.d1 or x.mx.d1 */
+uint32 letter(const char *d,const char *ns,const char *parent)
+{
+  unsigned char ch;
+
+  if (d[0] != 1) return 0;
+  ch = d[1];
+  if ((ch >= 'A') && (ch <= 'Z')) ch += 32;
+  if ((ch < 'a') || (ch > 'z')) return 0;
+  if (d[2] != 2) return 0;
+  if (case_diffb(d + 3,2,ns)) return 0;
+  if (!dns_domain_equal(d + 5,parent)) return 0;
+  return (uint32) 1 << (ch - 'a');
+}
+
+void line_keys(void)
 {
-  unsigned long ttl;
-  struct stat st;
   int i;
   int j;
   int k;
   char ch;
+  unsigned long ttl;
+
+  while (line.len) {
+    ch = line.s[line.len - 1];
+    if ((ch != ' ') && (ch != '\t') && (ch != '\n')) break;
+    --line.len;
+  }
+  if (!line.len) return;
+  if (line.s[0] == '#') return;
+
+  j = 1;
+  for (i = 0;i < NUMFIELDS;++i) {
+    if (j >= line.len) {
+      if (!stralloc_copys(&f[i],"")) nomem();
+    }
+    else {
+      k = byte_chr(line.s + j,line.len - j,':');
+      if (!stralloc_copyb(&f[i],line.s + j,k)) nomem();
+      j += k + 1;
+    }
+  }
+
+  switch(line.s[0]) {
+    case '.': case '&':
+      if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
+      if (byte_chr(f[2].s,f[2].len,'.') >= f[2].len) {
+	if (!stralloc_cats(&f[2],".ns.")) nomem();
+	if (!stralloc_catb(&f[2],f[0].s,f[0].len)) nomem();
+      }
+      if (!dns_domain_fromdot(&d2,f[2].s,f[2].len)) nomem();
+      if (!stralloc_0(&f[3])) nomem();
+      if (!scan_ulong(f[3].s,&ttl)) ttl = TTL_NS;
+      key_make(line.s[0],d1,dns_domain_length(d1));
+      found(letter(d2,"ns",d1),ttl);
+      break;
+
+    case '=':
+      if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
+      key_make('=',d1,dns_domain_length(d1));
+      found(0,0);
+      if (!stralloc_0(&f[1])) nomem();
+      if (ip4_scan(f[1].s,ip)) {
+	key_make('i',ip,4);
+	found(0,0);
+      }
+      break;
+
+    case '@':
+      if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
+      if (byte_chr(f[2].s,f[2].len,'.') >= f[2].len) {
+	if (!stralloc_cats(&f[2],".mx.")) nomem();
+	if (!stralloc_catb(&f[2],f[0].s,f[0].len)) nomem();
+      }
+      if (!dns_domain_fromdot(&d2,f[2].s,f[2].len)) nomem();
+      if (!stralloc_0(&f[4])) nomem();
+      if (!scan_ulong(f[4].s,&ttl)) ttl = TTL_POSITIVE;
+      key_make('@',d1,dns_domain_length(d1));
+      found(letter(d2,"mx",d1),ttl);
+      break;
+  }
+}
+
+static stralloc out;
+
+void fail(struct op *o,const char *why)
+{
+  if (!flagbatch) strerr_die2x(100,FATAL,why);
+  strnum[fmt_ulong(strnum,o->linenum)] = 0;
+  strerr_die5x(100,FATAL,"input line ",strnum,": ",why);
+}
+
+void apply(struct op *o)
+{
+  struct entry *e = 0;
+  struct entry *e2;
+  unsigned long ttl;
+  int i;
+  char ch;
+
+  switch(o->mode) {
+    case '=':
+      key_make('=',o->target,dns_domain_length(o->target));
+      e = entry_find(0);
+      if (e->flagused) fail(o,"host name already used");
+      key_make('i',o->ip,4);
+      e2 = entry_find(0);
+      if (e2->flagused) fail(o,"IP address already used");
+      e->flagused = e2->flagused = 1;
+      ttl = TTL_POSITIVE;
+      break;
+    case '+':
+      ttl = TTL_POSITIVE;
+      break;
+    default:
+      key_make(o->mode,o->target,dns_domain_length(o->target));
+      e = entry_find(0);
+      ttl = e->ttl;
+      break;
+  }
+
+  if (!stralloc_catb(&out,&o->mode,1)) nomem();
+  if (!dns_domain_todot_cat(&out,o->target)) nomem();
+  if (!stralloc_cats(&out,":")) nomem();
+  if (!stralloc_catb(&out,ipstr,ip4_fmt(ipstr,o->ip))) nomem();
+  switch(o->mode) {
+    case '.': case '&': case '@':
+      for (i = 0;i < 26;++i)
+	if (!(e->mask & ((uint32) 1 << i)))
+	  break;
+      if (i >= 26)
+	fail(o,"too many records for that domain");
+      e->mask |= (uint32) 1 << i;
+      ch = 'a' + i;
+      if (!stralloc_cats(&out,":")) nomem();
+      if (!stralloc_catb(&out,&ch,1)) nomem();
+      if (o->mode == '@')
+        if (!stralloc_cats(&out,":")) nomem();
+      break;
+  }
+  if (!stralloc_cats(&out,":")) nomem();
+  if (!stralloc_catb(&out,strnum,fmt_ulong(strnum,ttl))) nomem();
+  if (!stralloc_cats(&out,"\n")) nomem();
+}
+
+void op_add(char **argv,unsigned long linenum)
+{
+  struct op *o;
+  unsigned int n;
+
+  if (numops == maxops) {
+    n = maxops + (maxops >> 1) + 16;
+    if (!op) op = (struct op *) alloc(n * sizeof(struct op));
+    else if (!alloc_re((char **) &op,maxops * sizeof(struct op),n * sizeof(struct op)))
+      nomem();
+    if (!op) nomem();
+    maxops = n;
+  }
+  o = op + numops;
+  o->linenum = linenum;
+  o->target = 0;
 
   if (!*argv) die_usage();
+  if (str_diff(*argv,"add")) die_usage();
 
   if (!*++argv) die_usage();
-  fn = *argv;
+  if (str_equal(*argv,"ns")) o->mode = '.';
+  else if (str_equal(*argv,"childns")) o->mode = '&';
+  else if (str_equal(*argv,"host")) o->mode = '=';
+  else if (str_equal(*argv,"alias")) o->mode = '+';
+  else if (str_equal(*argv,"mx")) o->mode = '@';
+  else die_usage();
 
   if (!*++argv) die_usage();
-  fnnew = *argv;
+  if (!dns_domain_fromdot(&o->target,*argv,str_len(*argv))) nomem();
 
   if (!*++argv) die_usage();
-  if (str_diff(*argv,"add")) die_usage();
+  if (!ip4_scan(*argv,o->ip)) die_usage();
+  ++numops;
+}
+
+/* each stdin line is split on spaces and tabs into an argv */
+void readops(void)
+{
+  static stralloc ops;
+  char *words[5];
+  unsigned long linenum = 0;
+  unsigned int i;
+  unsigned int n;
+  int flagmatch = 1;
+
+  buffer_init(&b,buffer_unixread,0,bspace,sizeof bspace);
+  while (flagmatch) {
+    ++linenum;
+    if (getln(&b,&ops,&flagmatch,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    if (!stralloc_0(&ops)) nomem();
+    n = 0;
+    i = 0;
+    for (;;) {
+      while ((ops.s[i] == ' ') || (ops.s[i] == '\t') || (ops.s[i] == '\n')) ops.s[i++] = 0;
+      if (!ops.s[i]) break;
+      if (n == 4) die_usage();
+      words[n++] = ops.s + i;
+      while (ops.s[i] && (ops.s[i] != ' ') && (ops.s[i] != '\t') && (ops.s[i] != '\n')) ++i;
+    }
+    if (!n) continue;
+    if (words[0][0] == '#') continue;
+    words[n] = 0;
+    op_add(words,linenum);
+  }
+}
+
+/*
+With $INDEX, data.idx is a cdb of every key in data, plus the size,
+mtime and inode of data at "\0", and data.idx.journal holds the lines
+added since then behind the size, mtime and inode of data after the
+last of them. While they match data, an add reads only the two of
+them and appends to data in place. Otherwise, or once data.idx.journal
+passes JOURNALMAX bytes, data.idx is rebuilt from data, through data.new.
+*/
+
+#define JOURNALMAX 65536
+
+static stralloc idxname;
+static stralloc journalname;
+static stralloc journal;
+
+void statpack(char s[24],struct stat *st)
+{
+  uint32_pack(s,(uint32) st->st_size);
+  uint32_pack(s + 4,(uint32) ((st->st_size >> 16) >> 16));
+  uint32_pack(s + 8,(uint32) st->st_mtime);
+  uint32_pack(s + 12,(uint32) ((st->st_mtime >> 16) >> 16));
+  uint32_pack(s + 16,(uint32) st->st_ino);
+  uint32_pack(s + 20,(uint32) ((st->st_ino >> 16) >> 16));
+}
+
+void die_idx(void)
+{
+  strerr_die4sys(111,FATAL,"unable to read ",idxname.s,": ");
+}
+void die_journal(void)
+{
+  strerr_die4sys(111,FATAL,"unable to write ",journalname.s,": ");
+}
+
+/* returns 1 if data.idx and data.idx.journal are up to date */
+int index_open(struct cdb *c,struct stat *st)
+{
+  char now[24];
+  char buf[24];
+  int fdidx;
+  int fdjournal;
+  int r;
+
+  if (!stralloc_copys(&idxname,fn)) nomem();
+  if (!stralloc_cats(&idxname,".idx")) nomem();
+  if (!stralloc_0(&idxname)) nomem();
+  if (!stralloc_copys(&journalname,fn)) nomem();
+  if (!stralloc_cats(&journalname,".idx.journal")) nomem();
+  if (!stralloc_0(&journalname)) nomem();
+  statpack(now,st);
+
+  if (!stralloc_copys(&journal,"")) nomem();
+  fdjournal = open_read(journalname.s);
+  if (fdjournal == -1) {
+    if (errno != error_noent) die_journal();
+  }
+  else {
+    buffer_init(&b,buffer_unixread,fdjournal,bspace,sizeof bspace);
+    for (;;) {
+      r = buffer_feed(&b);
+      if (r == -1) die_journal();
+      if (!r) break;
+      if (!stralloc_catb(&journal,buffer_peek(&b),r)) nomem();
+      buffer_seek(&b,r);
+    }
+    close(fdjournal);
+  }
+  if (journal.len > JOURNALMAX) return 0;
+
+  fdidx = open_read(idxname.s);
+  if (fdidx == -1) {
+    if (errno != error_noent) die_idx();
+    return 0;
+  }
+  cdb_init(c,fdidx);
+  r = cdb_find(c,"",1);
+  if (r == -1) die_idx();
+  if (!r || (cdb_datalen(c) != 24)) return 0;
+  if (cdb_read(c,buf,24,cdb_datapos(c)) == -1) die_idx();
+
+  if (journal.len >= 24) return byte_equal(journal.s,24,now);
+  return byte_equal(buf,24,now);
+}
+
+void index_lookup(struct cdb *c)
+{
+  unsigned int i;
+  uint32 mask;
+  uint32 ttl;
+  char buf[8];
+  int r;
+
+  for (i = 0;i < numentries;++i) {
+    if (!stralloc_copyb(&key,keys.s + entry[i].key,entry[i].keylen)) nomem();
+    cdb_findstart(c);
+    while ((r = cdb_findnext(c,key.s,key.len))) {
+      if (r == -1) die_idx();
+      if (cdb_datalen(c) != 8) continue;
+      if (cdb_read(c,buf,8,cdb_datapos(c)) == -1) die_idx();
+      uint32_unpack(buf,&mask);
+      uint32_unpack(buf + 4,&ttl);
+      found(mask,ttl);
+    }
+  }
+}
+
+void index_rebuild(struct stat *st)
+{
+  char buf[24];
+
+  fdnew = open_trunc(fnnew);
+  if (fdnew == -1) die_write();
+  if (cdb_make_start(&cdbm,fdnew) == -1) die_write();
+  flagindex = 2;
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+  match = 1;
+  while (match) {
+    if (getln(&b,&line,&match,'\n') == -1) die_read();
+    line_keys();
+  }
+  flagindex = 1;
+  statpack(buf,st);
+  if (cdb_make_add(&cdbm,"",1,buf,24) == -1) die_write();
+  if (cdb_make_finish(&cdbm) == -1) die_write();
+  if (fsync(fdnew) == -1) die_write();
+  if (close(fdnew) == -1) die_write();
+  if (unlink(journalname.s) == -1)
+    if (errno != error_noent) die_journal();
+  if (rename(fnnew,idxname.s) == -1)
+    strerr_die6sys(111,FATAL,"unable to move ",fnnew," to ",idxname.s,": ");
+  if (!stralloc_copys(&journal,"")) nomem();
+}
+
+void index_append(struct stat *st)
+{
+  struct cdb c;
+  unsigned int i;
+  unsigned int j;
+  int fdjournal;
+  char ch = '\n';
+
+  if (!index_open(&c,st))
+    index_rebuild(st);
+  else {
+    index_lookup(&c);
+    for (i = 24;i < journal.len;i = j + 1) {
+      j = i + byte_chr(journal.s + i,journal.len - i,'\n');
+      if (!stralloc_copyb(&line,journal.s + i,j - i)) nomem();
+      line_keys();
+    }
+  }
+
+  for (i = 0;i < numops;++i) apply(op + i);
+
+  if (st->st_size > 0) {
+    if (seek_set(fd,(seek_pos) st->st_size - 1) == -1) die_read();
+    if (read(fd,&ch,1) != 1) die_read();
+  }
+
+  fdnew = open_append(fn);
+  if (fdnew == -1) die_write();
+  buffer_init(&bnew,buffer_unixwrite,fdnew,bnewspace,sizeof bnewspace);
+  if (ch != '\n') put("\n",1);
+  put(out.s,out.len);
+  if (buffer_flush(&bnew) == -1) die_write();
+  if (fsync(fdnew) == -1) die_write();
+  if (fstat(fdnew,st) == -1) die_write();
+  if (close(fdnew) == -1) die_write();
+
+  if (journal.len < 24)
+    if (!stralloc_copyb(&journal,"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",24)) nomem();
+  statpack(journal.s,st);
+  if (!stralloc_cat(&journal,&out)) nomem();
+  fdjournal = open_trunc(journalname.s);
+  if (fdjournal == -1) die_journal();
+  buffer_init(&bnew,buffer_unixwrite,fdjournal,bnewspace,sizeof bnewspace);
+  if (buffer_putflush(&bnew,journal.s,journal.len) == -1) die_journal();
+  if (fsync(fdjournal) == -1) die_journal();
+  if (close(fdjournal) == -1) die_journal();
+}
+
+int main(int argc,char **argv)
+{
+  struct stat st;
+  unsigned int i;
+
+  if (!*argv) die_usage();
 
   if (!*++argv) die_usage();
-  if (str_equal(*argv,"ns")) mode = '.';
-  else if (str_equal(*argv,"childns")) mode = '&';
-  else if (str_equal(*argv,"host")) mode = '=';
-  else if (str_equal(*argv,"alias")) mode = '+';
-  else if (str_equal(*argv,"mx")) mode = '@';
-  else die_usage();
+  fn = *argv;
 
   if (!*++argv) die_usage();
-  if (!dns_domain_fromdot(&target,*argv,str_len(*argv))) nomem();
+  fnnew = *argv;
 
   if (!*++argv) die_usage();
-  if (!ip4_scan(*argv,targetip)) die_usage();
+  if (str_equal(*argv,"batch")) {
+    if (argv[1]) die_usage();
+    flagbatch = 1;
+    readops();
+  }
+  else
+    op_add(argv,0);
+  entries_init();
 
   umask(077);
 
   fd = open_read(fn);
   if (fd == -1) die_read();
   if (fstat(fd,&st) == -1) die_read();
+
+  if (env_get("INDEX")) {
+    flagindex = 1;
+    index_append(&st);
+    _exit(0);
+  }
+
   buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
 
   fdnew = open_trunc(fnnew);
@@ -118,135 +629,17 @@ int main(int argc,char **argv)
   if (fchmod(fdnew,st.st_mode & 0644) == -1) die_write();
   buffer_init(&bnew,buffer_unixwrite,fdnew,bnewspace,sizeof bnewspace);
 
-  switch(mode) {
-    case '.': case '&':
-      ttl = TTL_NS;
-      for (i = 0;i < 26;++i) {
-	ch = 'a' + i;
-	if (!stralloc_copyb(&f[0],&ch,1)) nomem();
-	if (!stralloc_cats(&f[0],".ns.")) nomem();
-	if (!dns_domain_todot_cat(&f[0],target)) nomem();
-	if (!dns_domain_fromdot(&names[i],f[0].s,f[0].len)) nomem();
-      }
-      break;
-    case '+': case '=':
-      ttl = TTL_POSITIVE;
-      break;
-    case '@':
-      ttl = TTL_POSITIVE;
-      for (i = 0;i < 26;++i) {
-	ch = 'a' + i;
-	if (!stralloc_copyb(&f[0],&ch,1)) nomem();
-	if (!stralloc_cats(&f[0],".mx.")) nomem();
-	if (!dns_domain_todot_cat(&f[0],target)) nomem();
-	if (!dns_domain_fromdot(&names[i],f[0].s,f[0].len)) nomem();
-      }
-      break;
-  }
-
   while (match) {
     if (getln(&b,&line,&match,'\n') == -1) die_read();
 
     put(line.s,line.len);
     if (line.len && !match) put("\n",1);
 
-    while (line.len) {
-      ch = line.s[line.len - 1];
-      if ((ch != ' ') && (ch != '\t') && (ch != '\n')) break;
-      --line.len;
-    }
-    if (!line.len) continue;
-    if (line.s[0] == '#') continue;
-
-    j = 1;
-    for (i = 0;i < NUMFIELDS;++i) {
-      if (j >= line.len) {
-	if (!stralloc_copys(&f[i],"")) nomem();
-      }
-      else {
-        k = byte_chr(line.s + j,line.len - j,':');
-	if (!stralloc_copyb(&f[i],line.s + j,k)) nomem();
-	j += k + 1;
-      }
-    }
-
-    switch(mode) {
-      case '.': case '&':
-	if (line.s[0] == mode) {
-          if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
-	  if (dns_domain_equal(d1,target)) {
-	    if (byte_chr(f[2].s,f[2].len,'.') >= f[2].len) {
-	      if (!stralloc_cats(&f[2],".ns.")) nomem();
-	      if (!stralloc_catb(&f[2],f[0].s,f[0].len)) nomem();
-	    }
-	    if (!dns_domain_fromdot(&d2,f[2].s,f[2].len)) nomem();
-	    if (!stralloc_0(&f[3])) nomem();
-	    if (!scan_ulong(f[3].s,&ttl)) ttl = TTL_NS;
-	    for (i = 0;i < 26;++i)
-	      if (dns_domain_equal(d2,names[i])) {
-	        used[i] = 1;
-		break;
-	      }
-	  }
-	}
-	break;
-
-      case '=':
-	if (line.s[0] == '=') {
-	  if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
-	  if (dns_domain_equal(d1,target))
-	    strerr_die2x(100,FATAL,"host name already used");
-	  if (!stralloc_0(&f[1])) nomem();
-	  if (ip4_scan(f[1].s,ip))
-	    if (byte_equal(ip,4,targetip))
-	      strerr_die2x(100,FATAL,"IP address already used");
-	}
-	break;
-
-      case '@':
-	if (line.s[0] == '@') {
-          if (!dns_domain_fromdot(&d1,f[0].s,f[0].len)) nomem();
-	  if (dns_domain_equal(d1,target)) {
-	    if (byte_chr(f[2].s,f[2].len,'.') >= f[2].len) {
-	      if (!stralloc_cats(&f[2],".mx.")) nomem();
-	      if (!stralloc_catb(&f[2],f[0].s,f[0].len)) nomem();
-	    }
-	    if (!dns_domain_fromdot(&d2,f[2].s,f[2].len)) nomem();
-	    if (!stralloc_0(&f[4])) nomem();
-	    if (!scan_ulong(f[4].s,&ttl)) ttl = TTL_POSITIVE;
-	    for (i = 0;i < 26;++i)
-	      if (dns_domain_equal(d2,names[i])) {
-	        used[i] = 1;
-		break;
-	      }
-	  }
-	}
-	break;
-    }
+    line_keys();
   }
 
-  if (!stralloc_copyb(&f[0],&mode,1)) nomem();
-  if (!dns_domain_todot_cat(&f[0],target)) nomem();
-  if (!stralloc_cats(&f[0],":")) nomem();
-  if (!stralloc_catb(&f[0],ipstr,ip4_fmt(ipstr,targetip))) nomem();
-  switch(mode) {
-    case '.': case '&': case '@':
-      for (i = 0;i < 26;++i)
-	if (!used[i])
-	  break;
-      if (i >= 26)
-	strerr_die2x(100,FATAL,"too many records for that domain");
-      ch = 'a' + i;
-      if (!stralloc_cats(&f[0],":")) nomem();
-      if (!stralloc_catb(&f[0],&ch,1)) nomem();
-      if (mode == '@')
-        if (!stralloc_cats(&f[0],":")) nomem();
-      break;
-  }
-  if (!stralloc_cats(&f[0],":")) nomem();
-  if (!stralloc_catb(&f[0],strnum,fmt_ulong(strnum,ttl))) nomem();
-  if (!stralloc_cats(&f[0],"\n")) nomem();
-  put(f[0].s,f[0].len);
+  for (i = 0;i < numops;++i) apply(op + i);
+  put(out.s,out.len);
 
   if (buffer_flush(&bnew) == -1) die_write();
   if (fsync(fdnew) == -1) die_write();
@@ -1,4 +1,5 @@
 #include "str.h"
+#include "fmt.h"
 #include "byte.h"
 #include "scan.h"
 #include "exit.h"
@@ -12,43 +13,37 @@
 #include "parsetype.h"
 #include "ip4.h"
 #include "dns.h"
+#include "getln.h"
+#include "cdb.h"
 
-extern int respond(char *,char *,char *);
+extern int respond(char *,char *,char *,uint32);
 
 #define FATAL "tinydns-get: fatal: "
 
 void usage(void)
 {
-  strerr_die1x(100,"tinydns-get: usage: tinydns-get type name [ip]");
+  strerr_die1x(100,"tinydns-get: usage: tinydns-get { type name [ip] | batch }");
 }
 void oops(void)
 {
   strerr_die2sys(111,FATAL,"unable to parse: ");
 }
 
+/*
+With batch, the queries are lines "type name [ip]" from stdin, each
+answered as if by a separate run, with data.cdb opened once.
+*/
+
 static char ip[4];
 static char type[2];
 static char *q;
 
 static stralloc out;
 
-int main(int argc,char **argv)
+static void get(void)
 {
   uint16 u16;
 
-  if (!*argv) usage();
-
-  if (!*++argv) usage();
-  if (!parsetype(*argv,type)) usage();
-
-  if (!*++argv) usage();
-  if (!dns_domain_fromdot(&q,*argv,str_len(*argv))) oops();
-
-  if (*++argv) {
-    if (!ip4_scan(*argv,ip)) usage();
-  }
-
-  if (!stralloc_copys(&out,"")) oops();
   uint16_unpack_big(type,&u16);
   if (!stralloc_catulong0(&out,u16,0)) oops();
   if (!stralloc_cats(&out," ")) oops();
@@ -66,11 +61,91 @@ int main(int argc,char **argv)
     response[3] |= 4;
   }
   else
-    if (!respond(q,type,ip)) goto DONE;
+    if (!respond(q,type,ip,cdb_hash(q,dns_domain_length(q)))) return;
 
   if (!printpacket_cat(&out,response,response_len)) oops();
+}
+
+static char inspace[4096];
+static buffer in = BUFFER_INIT(buffer_unixread,0,inspace,sizeof inspace);
+
+static stralloc line;
+static char *field[3];
+
+static unsigned int split(void)
+{
+  unsigned int i;
+  unsigned int n;
+
+  n = 0;
+  i = 0;
+  for (;;) {
+    while ((i < line.len) && ((line.s[i] == ' ') || (line.s[i] == '\t'))) line.s[i++] = 0;
+    if (i == line.len) return n;
+    if (n == 3) return 4;
+    field[n++] = line.s + i;
+    while ((i < line.len) && (line.s[i] != ' ') && (line.s[i] != '\t')) ++i;
+  }
+}
+
+static void batch(void)
+{
+  unsigned long linenum;
+  char strnum[FMT_ULONG];
+  int match;
+  unsigned int n;
+
+  for (linenum = 1;;++linenum) {
+    if (getln(&in,&line,&match,'\n') == -1)
+      strerr_die2sys(111,FATAL,"unable to read input: ");
+    if (!line.len) break;
+    if (match) --line.len;
+    if (!stralloc_0(&line)) oops();
+    --line.len;
+    n = split();
+    if (!n) continue;
+    if ((n > 3) || (n < 2) || !parsetype(field[0],type)) {
+      strnum[fmt_ulong(strnum,linenum)] = 0;
+      strerr_die3x(100,FATAL,"unable to parse query on line ",strnum);
+    }
+    if (!dns_domain_fromdot(&q,field[1],str_len(field[1]))) oops();
+    byte_zero(ip,4);
+    if (n == 3)
+      if (!ip4_scan(field[2],ip)) {
+        strnum[fmt_ulong(strnum,linenum)] = 0;
+        strerr_die3x(100,FATAL,"unable to parse IP address on line ",strnum);
+      }
+    out.len = 0;
+    get();
+    if (buffer_put(buffer_1,out.s,out.len) == -1)
+      strerr_die2sys(111,FATAL,"unable to write output: ");
+    if (!match) break;
+  }
+  if (buffer_flush(buffer_1) == -1)
+    strerr_die2sys(111,FATAL,"unable to write output: ");
+}
+
+int main(int argc,char **argv)
+{
+  if (!*argv) usage();
+
+  if (!*++argv) usage();
+  if (str_equal(*argv,"batch")) {
+    if (argv[1]) usage();
+    batch();
+    _exit(0);
+  }
+  if (!parsetype(*argv,type)) usage();
+
+  if (!*++argv) usage();
+  if (!dns_domain_fromdot(&q,*argv,str_len(*argv))) oops();
 
-  DONE:
+  if (*++argv) {
+    if (!ip4_scan(*argv,ip)) usage();
+  }
+
+  if (!stralloc_copys(&out,"")) oops();
+  get();
   buffer_putflush(buffer_1,out.s,out.len);
   _exit(0);
 }
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "uint32.h"
+#include "uint64.h"
+#include "byte.h"
+#include "buffer.h"
+#include "strerr.h"
+#include "stralloc.h"
+#include "open.h"
+#include "seek.h"
+#include "cdb.h"
+#include "cdb_make.h"
+#include "dns.h"
+#include "txtdict.h"
+
+#define FATAL "tinydns-merge: fatal: "
+
+/*
+tinydns-merge writes a new data.cdb with delta/data.cdb folded into
+it, as tinydns would see the two: every name delta/data.cdb has loses
+all its records in data.cdb, index entries included, and gets those
+from delta/data.cdb, less tombstones. The zone cut and type indexes
+for those names are written afresh, as data.cdb has them. Locations
+come from data.cdb alone. Under $LOCINDEX both files must have the
+location index; a name in delta/data.cdb hides its records for every
+location, and keeps its tombstone from delta/data.cdb. Packed TXT records from delta/data.cdb are repacked
+against the dictionary of data.cdb.
+*/
+
+const char *fn;
+
+void nomem(void)
+{
+  strerr_die2x(111,FATAL,"out of memory");
+}
+void die_read(void)
+{
+  strerr_die4sys(111,FATAL,"unable to read ",fn,": ");
+}
+void die_format(void)
+{
+  strerr_die4x(111,FATAL,"unable to read ",fn,": format error");
+}
+void die_datatmp(void)
+{
+  strerr_die2sys(111,FATAL,"unable to create data.tmp: ");
+}
+
+struct cdb_make cdbm;
+static stralloc key;
+
+void add(const char *k,unsigned int klen,const char *d,unsigned int dlen)
+{
+  if (cdb_make_add(&cdbm,k,klen,d,dlen) == -1) die_datatmp();
+}
+
+buffer b;
+char bspace[8192];
+
+static stralloc k;
+static stralloc d;
+
+void get(char *buf,unsigned int len)
+{
+  int r;
+
+  while (len > 0) {
+    r = buffer_get(&b,buf,len);
+    if (r < 0) die_read();
+    if (!r) die_format();
+    buf += r;
+    len -= r;
+  }
+}
+
+/* reads every record of a cdb in order, calling op for each */
+
+void scan(int fd,uint64 eod,void (*op)(void))
+{
+  char num[8];
+  uint32 klen;
+  uint32 dlen;
+  uint64 pos;
+
+  if (seek_begin(fd) == -1) die_read();
+  buffer_init(&b,buffer_unixread,fd,bspace,sizeof bspace);
+
+  pos = 0;
+  while (pos < 2048) { get(num,8); pos += 8; }
+
+  while (pos < eod) {
+    if (eod - pos < 8) die_format();
+    get(num,8); pos += 8;
+    uint32_unpack(num,&klen);
+    uint32_unpack(num + 4,&dlen);
+    if (eod - pos < klen) die_format();
+    pos += klen;
+    if (eod - pos < dlen) die_format();
+    pos += dlen;
+
+    if (!stralloc_ready(&k,klen)) nomem();
+    get(k.s,klen); k.len = klen;
+    if (!stralloc_ready(&d,dlen)) nomem();
+    get(d.s,dlen); d.len = dlen;
+    op();
+  }
+}
+
+struct cdb delta;
+int flagcutindex;
+int flagtypeindex;
+int flaglocindex;
+
+/* length of the name at the start of s, without a location after it */
+unsigned int ownerlen(const char *s,unsigned int len)
+{
+  unsigned int i = 0;
+
+  while (i < len) {
+    if (!s[i]) return i + 1;
+    i += (unsigned char) s[i] + 1;
+  }
+  die_format();
+  return 0;
+}
+
+/* a data.cdb record is kept unless its name is in delta/data.cdb */
+
+void base(void)
+{
+  const char *owner = k.s;
+  unsigned int len = k.len;
+  int r;
+
+  if (len && !k.s[0]) {
+    if ((len > 4) && (k.s[1] == 't')) { owner += 4; len -= 4; }
+    else if ((len > 2) && (k.s[1] == '/')) { owner += 2; len -= 2; }
+    else { add(k.s,k.len,d.s,d.len); return; }
+  }
+  len = ownerlen(owner,len);
+  r = cdb_find(&delta,owner,len);
+  if (r == -1) strerr_die2sys(111,FATAL,"unable to read delta/data.cdb: ");
+  if (!r) add(k.s,k.len,d.s,d.len);
+}
+
+#define CUT_NS 1
+#define CUT_SOA 2
+#define CUT_SCAN 4
+
+static stralloc dictbase;
+static struct txtdict txtdict;
+static int flagdict;
+static char dictdelta[TXTDICT_MAX];
+static unsigned int dictdeltalen;
+static char unpacked[65535];
+static stralloc packed;
+
+unsigned int dictread(struct cdb *x,char *buf)
+{
+  uint32 len;
+  int r;
+
+  r = cdb_find(x,"\0c",2);
+  if (r == -1) die_read();
+  if (!r) return 0;
+  len = cdb_datalen(x);
+  if (len > TXTDICT_MAX) die_format();
+  if (cdb_read(x,buf,len,cdb_datapos(x)) == -1) die_read();
+  return len;
+}
+
+/* d packed against the dictionary of data.cdb, or not packed */
+
+void repack(void)
+{
+  unsigned int len;
+  int r;
+
+  if (dictdeltalen == dictbase.len)
+    if (byte_equal(dictdelta,dictdeltalen,dictbase.s)) return;
+  len = ((d.s[2] & 127) == '=') || ((d.s[2] & 127) == '*') ? 15 : 17;
+  if (d.len < len) die_format();
+  r = txtdict_unpack(dictdelta,dictdeltalen,d.s + len,d.len - len,unpacked,sizeof unpacked);
+  if (r == -1) die_format();
+  if (!stralloc_copyb(&packed,d.s,len)) nomem();
+  packed.s[2] &= 127;
+  if (flagdict) {
+    packed.s[2] |= 128;
+    if (txtdict_pack(&txtdict,&packed,unpacked,r) == -1) nomem();
+    if (packed.len < len + r) {
+      if (!stralloc_copy(&d,&packed)) nomem();
+      return;
+    }
+    packed.len = len;
+    packed.s[2] &= 127;
+  }
+  if (!stralloc_catb(&packed,unpacked,r)) nomem();
+  if (!stralloc_copy(&d,&packed)) nomem();
+}
+
+void overlay(void)
+{
+  char flag;
+
+  if (!k.len || !k.s[0]) return;
+  if (d.len < 3) die_format();
+  if (byte_equal(d.s,2,"\0\0")) { /* tombstone */
+    if (flaglocindex) add(k.s,k.len,d.s,d.len);
+    return;
+  }
+  if (d.s[2] & 128) repack();
+  add(k.s,k.len,d.s,d.len);
+
+  if (flagtypeindex) {
+    if (!stralloc_copyb(&key,"\0t",2)) nomem();
+    if (!stralloc_catb(&key,d.s,2)) nomem();
+    if (!stralloc_cat(&key,&k)) nomem();
+    add(key.s,key.len,d.s,d.len);
+  }
+
+  if (!flagcutindex) return;
+  if (byte_equal(d.s,2,DNS_T_NS)) flag = CUT_NS;
+  else if (byte_equal(d.s,2,DNS_T_SOA)) flag = CUT_SOA;
+  else return;
+  if (d.s[2] == '=') {
+    if (d.len < 15) die_format();
+    if (byte_diff(d.s + 7,8,"\0\0\0\0\0\0\0\0")) flag |= CUT_SCAN;
+  }
+  else if (d.s[2] == '>')
+    flag |= CUT_SCAN;
+  else
+    return; /* wildcard */
+  if (!stralloc_copyb(&key,"\0/",2)) nomem();
+  if (!stralloc_catb(&key,k.s,ownerlen(k.s,k.len))) nomem();
+  add(key.s,key.len,&flag,1);
+}
+
+int main()
+{
+  struct cdb c;
+  uint64 eodbase;
+  uint64 eoddelta;
+  int fdbase;
+  int fddelta;
+  int fdcdb;
+  int fdspill;
+  int r;
+
+  umask(022);
+
+  fn = "data.cdb";
+  fdbase = open_read(fn);
+  if (fdbase == -1) die_read();
+  cdb_init(&c,fdbase);
+  r = cdb_find(&c,"\0/",2);
+  if (r == -1) die_read();
+  flagcutindex = r;
+  r = cdb_find(&c,"\0t",2);
+  if (r == -1) die_read();
+  flagtypeindex = r;
+  r = cdb_find(&c,"\0v",2);
+  if (r == -1) die_read();
+  flaglocindex = r;
+  if (!stralloc_ready(&dictbase,TXTDICT_MAX)) nomem();
+  dictbase.len = dictread(&c,dictbase.s);
+  if (dictbase.len) {
+    if (txtdict_index(&txtdict,dictbase.s,dictbase.len) == -1) nomem();
+    flagdict = 1;
+  }
+  if (cdb_eod(&c,&eodbase) == -1) die_read();
+  cdb_free(&c);
+
+  fn = "delta/data.cdb";
+  fddelta = open_read(fn);
+  if (fddelta == -1) die_read();
+  cdb_init(&delta,fddelta);
+  r = cdb_find(&delta,"\0v",2);
+  if (r == -1) die_read();
+  if (r != flaglocindex)
+    strerr_die2x(111,FATAL,"data.cdb and delta/data.cdb differ in $LOCINDEX");
+  dictdeltalen = dictread(&delta,dictdelta);
+  if (cdb_eod(&delta,&eoddelta) == -1) die_read();
+
+  fdcdb = open_trunc("data.tmp");
+  if (fdcdb == -1) die_datatmp();
+  if (cdb_make_start(&cdbm,fdcdb) == -1) die_datatmp();
+  cdb_make_buffer(&cdbm,CDB_BUFFER);
+  fdspill = open_rwtrunc("data.spill");
+  if (fdspill == -1)
+    strerr_die2sys(111,FATAL,"unable to create data.spill: ");
+  unlink("data.spill");
+  cdb_make_spill(&cdbm,fdspill);
+
+  fn = "data.cdb";
+  scan(fdbase,eodbase,base);
+  cdb_free(&delta);
+  fn = "delta/data.cdb";
+  scan(fddelta,eoddelta,overlay);
+
+  if (cdb_make_finish(&cdbm) == -1) die_datatmp();
+  if (fsync(fdcdb) == -1) die_datatmp();
+  if (close(fdcdb) == -1) die_datatmp(); /* NFS stupidity */
+  if (rename("data.tmp","data.cdb") == -1)
+    strerr_die2sys(111,FATAL,"unable to move data.tmp to data.cdb: ");
+
+  _exit(0);
+}
@@ -0,0 +1,194 @@
+#include "alloc.h"
+#include "byte.h"
+#include "case.h"
+#include "dns.h"
+#include "topn.h"
+
+/*
+Space-Saving: the heaviest keys of a stream in max entries. A key
+already there counts one more; a new key, once all entries are in
+use, takes over the entry with the least count, which it inherits
+as its error. A key seen more than a max-th of the time is sure to
+be there, and its count is off by at most its error. The entries
+are kept in a min-heap by count, found by key through a hash table,
+so each key costs a hash, a short chain and a few heap steps.
+
+topn_sort() puts the heap in order, heaviest first, for reading out
+t->e[t->heap[i]] for i below t->n; topn_clear() must follow before
+the next topn_add(). topn_each() does all three, handing each entry
+to a function. topn_merge() adds the entries of another topn, count
+and error, so sketches made apart can be put together.
+
+A struct topn_queries is the pair that the query logs keep, of query
+names and of client addresses, on once topn_queriesinit() succeeds.
+*/
+
+static unsigned int hash(const char *key,unsigned int len)
+{
+  unsigned int h = 5381;
+
+  while (len--) h = ((h << 5) + h) ^ (unsigned char) *key++;
+  return h;
+}
+
+static void swap(struct topn *t,unsigned int i,unsigned int j)
+{
+  unsigned int x;
+
+  x = t->heap[i]; t->heap[i] = t->heap[j]; t->heap[j] = x;
+  t->pos[t->heap[i]] = i;
+  t->pos[t->heap[j]] = j;
+}
+
+static void down(struct topn *t,unsigned int i)
+{
+  unsigned int j;
+
+  for (;;) {
+    j = 2 * i + 1;
+    if (j >= t->n) return;
+    if ((j + 1 < t->n) && (t->e[t->heap[j + 1]].count < t->e[t->heap[j]].count)) ++j;
+    if (t->e[t->heap[i]].count <= t->e[t->heap[j]].count) return;
+    swap(t,i,j);
+    i = j;
+  }
+}
+
+static void up(struct topn *t,unsigned int i)
+{
+  while (i && (t->e[t->heap[i]].count < t->e[t->heap[(i - 1) / 2]].count)) {
+    swap(t,i,(i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+/* returns -1 if there was not enough memory */
+int topn_init(struct topn *t,unsigned int max)
+{
+  if (max < 1) max = 1;
+  if (max > TOPN_MAX) max = TOPN_MAX;
+  t->e = (struct topn_entry *) alloc(max * sizeof(struct topn_entry));
+  t->heap = (unsigned int *) alloc(max * sizeof(unsigned int));
+  t->pos = (unsigned int *) alloc(max * sizeof(unsigned int));
+  t->bucket = (int *) alloc(2 * max * sizeof(int));
+  if (!t->e || !t->heap || !t->pos || !t->bucket) return -1;
+  t->max = max;
+  topn_clear(t);
+  return 0;
+}
+
+void topn_clear(struct topn *t)
+{
+  unsigned int i;
+
+  for (i = 0;i < 2 * t->max;++i) t->bucket[i] = -1;
+  t->n = 0;
+}
+
+static void unchain(struct topn *t,unsigned int k)
+{
+  int *p;
+
+  p = t->bucket + hash(t->e[k].key,t->e[k].len) % (2 * t->max);
+  while (*p != (int) k) p = &t->e[*p].next;
+  *p = t->e[k].next;
+}
+
+/* count more of key, of which error may not have been; for merging */
+void topn_merge(struct topn *t,const char *key,unsigned int len,uint64 count,uint64 error)
+{
+  struct topn_entry *x;
+  unsigned int b;
+  unsigned int k;
+  int i;
+
+  if (len > TOPN_KEY) len = TOPN_KEY;
+  b = hash(key,len) % (2 * t->max);
+  for (i = t->bucket[b];i != -1;i = t->e[i].next)
+    if ((t->e[i].len == len) && byte_equal(t->e[i].key,len,key)) {
+      t->e[i].count += count;
+      t->e[i].error += error;
+      down(t,t->pos[i]);
+      return;
+    }
+
+  if (t->n < t->max) {
+    k = t->n;
+    x = t->e + k;
+    x->count = count;
+    x->error = error;
+    t->heap[k] = k;
+    t->pos[k] = k;
+    ++t->n;
+  }
+  else {
+    k = t->heap[0];
+    x = t->e + k;
+    unchain(t,k);
+    x->error = x->count + error;
+    x->count += count;
+  }
+  x->len = len;
+  byte_copy(x->key,len,key);
+  x->next = t->bucket[b];
+  t->bucket[b] = k;
+  up(t,t->pos[k]);
+  down(t,t->pos[k]);
+}
+
+void topn_add(struct topn *t,const char *key,unsigned int len)
+{
+  topn_merge(t,key,len,1,0);
+}
+
+/* d in lower case, as the key */
+void topn_name(struct topn *t,const char *d)
+{
+  char key[TOPN_KEY];
+  unsigned int len;
+
+  len = dns_domain_length(d);
+  if (len > TOPN_KEY) len = TOPN_KEY;
+  byte_copy(key,len,d);
+  case_lowerb(key,len);
+  topn_add(t,key,len);
+}
+
+void topn_sort(struct topn *t)
+{
+  unsigned int n;
+
+  /* heapsort: each least count goes to the end, leaving most first */
+  n = t->n;
+  while (t->n > 1) {
+    swap(t,0,t->n - 1);
+    --t->n;
+    down(t,0);
+  }
+  t->n = n;
+}
+
+void topn_each(struct topn *t,void (*op)(struct topn_entry *))
+{
+  unsigned int i;
+
+  topn_sort(t);
+  for (i = 0;i < t->n;++i) op(t->e + t->heap[i]);
+  topn_clear(t);
+}
+
+void topn_queriesinit(struct topn_queries *t,unsigned long n)
+{
+  if (!n) return;
+  if (topn_init(&t->name,n) == -1) return;
+  if (topn_init(&t->client,n) == -1) return;
+  t->flagon = 1;
+}
+
+/* d is not counted if it is 0 */
+void topn_query(struct topn_queries *t,const char *d,const char ip[4])
+{
+  if (!t->flagon) return;
+  if (d) topn_name(&t->name,d);
+  topn_add(&t->client,ip,4);
+}
@@ -0,0 +1,43 @@
+#ifndef TOPN_H
+#define TOPN_H
+
+#include "uint64.h"
+
+#define TOPN_MAX 1024
+#define TOPN_KEY 255
+
+struct topn_entry {
+  uint64 count; /* at most this many */
+  uint64 error; /* at least count - error */
+  int next; /* in the hash chain */
+  unsigned int len;
+  char key[TOPN_KEY];
+} ;
+
+struct topn {
+  struct topn_entry *e;
+  unsigned int *heap; /* entries, least count first */
+  unsigned int *pos; /* of each entry in heap */
+  int *bucket;
+  unsigned int n;
+  unsigned int max;
+} ;
+
+extern int topn_init(struct topn *,unsigned int);
+extern void topn_add(struct topn *,const char *,unsigned int);
+extern void topn_merge(struct topn *,const char *,unsigned int,uint64,uint64);
+extern void topn_name(struct topn *,const char *);
+extern void topn_sort(struct topn *);
+extern void topn_clear(struct topn *);
+extern void topn_each(struct topn *,void (*)(struct topn_entry *));
+
+struct topn_queries {
+  int flagon;
+  struct topn name;
+  struct topn client;
+} ;
+
+extern void topn_queriesinit(struct topn_queries *,unsigned long);
+extern void topn_query(struct topn_queries *,const char *,const char *);
+
+#endif
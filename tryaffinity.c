@@ -0,0 +1,12 @@
+#define _GNU_SOURCE
+#include <sched.h>
+
+int main()
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(0,&set);
+  if (sched_setaffinity(0,sizeof set,&set) == -1) _exit(1);
+  _exit(0);
+}
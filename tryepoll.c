@@ -0,0 +1,15 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+int main()
+{
+  int fd;
+  struct epoll_event ev;
+
+  fd = epoll_create(1);
+  if (fd == -1) _exit(1);
+  ev.events = EPOLLIN;
+  ev.data.fd = 0;
+  if (epoll_wait(fd,&ev,1,0) == -1) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,17 @@
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+int main()
+{
+  int kq;
+  struct kevent kev;
+  struct timespec ts;
+
+  kq = kqueue();
+  if (kq == -1) _exit(1);
+  ts.tv_sec = 0;
+  ts.tv_nsec = 0;
+  if (kevent(kq,(struct kevent *) 0,0,&kev,1,&ts) == -1) _exit(1);
+  _exit(0);
+}
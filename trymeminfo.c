@@ -0,0 +1,16 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+
+int main()
+{
+  unsigned int m[SK_MEMINFO_VARS];
+  socklen_t len = sizeof m;
+  int s;
+
+  s = socket(AF_INET,SOCK_DGRAM,0);
+  if (s == -1) _exit(1);
+  if (getsockopt(s,SOL_SOCKET,SO_MEMINFO,m,&len) == -1) _exit(1);
+  if (len <= SK_MEMINFO_DROPS * sizeof(unsigned int)) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,16 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+int main()
+{
+  struct mmsghdr m;
+  int s;
+
+  s = socket(AF_INET,SOCK_DGRAM,0);
+  if (s == -1) _exit(1);
+  if (recvmmsg(s,&m,0,MSG_DONTWAIT,(struct timespec *) 0) == -1) _exit(1);
+  if (sendmmsg(s,&m,0,0) == -1) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,9 @@
+#include <time.h>
+
+int main()
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC,&ts) == -1) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,15 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+int main()
+{
+  struct perf_event_attr attr;
+
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.read_format = PERF_FORMAT_GROUP;
+  syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+  _exit(0);
+}
@@ -0,0 +1,10 @@
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+int main()
+{
+  off_t pos = 0;
+
+  if (sendfile(1,0,&pos,0) == -1) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,22 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+int main()
+{
+  struct sock_filter code[2] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU }
+  , { BPF_RET | BPF_A, 0, 0, 0 }
+  } ;
+  struct sock_fprog prog;
+  int opt = 1;
+  int s;
+
+  prog.len = 2;
+  prog.filter = code;
+  s = socket(AF_INET,SOCK_DGRAM,0);
+  if (s == -1) _exit(1);
+  if (setsockopt(s,SOL_SOCKET,SO_REUSEPORT,&opt,sizeof opt) == -1) _exit(1);
+  if (setsockopt(s,SOL_SOCKET,SO_ATTACH_REUSEPORT_CBPF,&prog,sizeof prog) == -1) _exit(1);
+  _exit(0);
+}
@@ -0,0 +1,19 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+int main()
+{
+  struct io_uring_params p;
+  struct io_uring_getevents_arg arg;
+  struct io_uring_sqe sqe;
+
+  p.features = IORING_FEAT_EXT_ARG;
+  arg.ts = 0;
+  sqe.opcode = IORING_OP_POLL_REMOVE;
+  sqe.poll_events = 0;
+  if (syscall(__NR_io_uring_setup,1,&p) == -1) _exit(1);
+  if (syscall(__NR_io_uring_enter,0,0,0,IORING_ENTER_EXT_ARG,&arg,sizeof arg) == -1) _exit(1);
+  _exit(sqe.opcode != IORING_OP_POLL_REMOVE);
+}
@@ -0,0 +1,19 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <unistd.h>
+
+int main()
+{
+  union bpf_attr attr;
+  struct sockaddr_xdp sa;
+  unsigned int u = 0;
+
+  attr.link_create.attach_type = BPF_XDP;
+  sa.sxdp_family = AF_XDP;
+  __atomic_store_n(&u,__atomic_load_n(&u,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+  if (syscall(__NR_bpf,BPF_LINK_CREATE,&attr,0) == -1) _exit(u);
+  _exit(sa.sxdp_family != AF_XDP);
+}
@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include "alloc.h"
+#include "byte.h"
+#include "cdb.h"
+#include "txtdict.h"
+
+/*
+Compression of record data against a shared dictionary. The packed
+form is a series of pieces: a byte b below 128 followed by b + 1
+bytes to copy as they are, or a byte 128 + n followed by a 2-byte
+big-endian position in the dictionary, to copy n + 4 bytes from
+there. Unpacking needs nothing but the dictionary, and checks every
+piece against both ends.
+
+txtdict_train() builds a dictionary from a sample: it counts the
+words of the sample, a word ending at a space or one of ;=:," or
+before a byte outside printable ASCII, and the first 8, 16, 32 and
+64 bytes of longer words, which catches the fixed start of keys and
+tokens. It keeps what would save the most and is not already in the
+dictionary, in the order it first turns up in the sample, so that
+words which usually follow one another stay next to each other and
+a match can run across both.
+*/
+
+#define WORDMIN 4
+#define WORDMAX 131
+
+struct word {
+  unsigned int pos; /* first place in the sample */
+  unsigned int len;
+  unsigned long count;
+} ;
+
+static int wordcmp(const void *a,const void *b)
+{
+  const struct word *x = a;
+  const struct word *y = b;
+  unsigned long sx;
+  unsigned long sy;
+
+  sx = (x->count - 1) * (x->len - 3);
+  sy = (y->count - 1) * (y->len - 3);
+  if (sx != sy) return (sx > sy) ? -1 : 1;
+  if (x->pos != y->pos) return (x->pos < y->pos) ? -1 : 1;
+  return (x->len > y->len) ? -1 : (x->len < y->len);
+}
+
+static int poscmp(const void *a,const void *b)
+{
+  const struct word *x = a;
+  const struct word *y = b;
+
+  if (x->pos != y->pos) return (x->pos < y->pos) ? -1 : 1;
+  return (x->len > y->len) ? -1 : (x->len < y->len);
+}
+
+static int ends(char ch)
+{
+  return (ch == ' ') || (ch == ';') || (ch == '=') || (ch == ':') || (ch == ',') || (ch == '"');
+}
+
+static const char *sample;
+static struct word *w;
+static unsigned int numwords;
+static unsigned int *slot;
+static unsigned int numslots;
+
+static void count(unsigned int pos,unsigned int len)
+{
+  unsigned int i;
+
+  i = cdb_hash(sample + pos,len) & (numslots - 1);
+  while (slot[i]) {
+    if (w[slot[i] - 1].len == len)
+      if (byte_equal(sample + w[slot[i] - 1].pos,len,sample + pos)) {
+        ++w[slot[i] - 1].count;
+        return;
+      }
+    i = (i + 1) & (numslots - 1);
+  }
+  w[numwords].pos = pos;
+  w[numwords].len = len;
+  w[numwords].count = 1;
+  slot[i] = ++numwords;
+}
+
+/* 1 if s[0..n) is somewhere in d[0..len) */
+static int within(const char *d,unsigned int len,const char *s,unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0;i + n <= len;++i)
+    if (d[i] == s[0])
+      if (byte_equal(d + i,n,s)) return 1;
+  return 0;
+}
+
+/* returns -1 if there was not enough memory */
+int txtdict_train(stralloc *dict,const char *s,unsigned int len,unsigned int max)
+{
+  stralloc chosen = {0};
+  unsigned int maxwords;
+  unsigned int i;
+  unsigned int j;
+  unsigned int n;
+  unsigned int k;
+
+  if (max > TXTDICT_MAX) max = TXTDICT_MAX;
+  dict->len = 0;
+  sample = s;
+
+  maxwords = 5 * (len / WORDMIN + 1);
+  numslots = 64;
+  while (numslots < 2 * maxwords) numslots <<= 1;
+  slot = (unsigned int *) alloc(numslots * sizeof(unsigned int));
+  if (!slot) return -1;
+  w = (struct word *) alloc(maxwords * sizeof(struct word));
+  if (!w) { alloc_free((char *) slot); return -1; }
+  for (i = 0;i < numslots;++i) slot[i] = 0;
+  numwords = 0;
+
+  for (i = 0;i < len;i = j) {
+    for (j = i;j < len;++j) {
+      if (((unsigned char) s[j] < 32) || ((unsigned char) s[j] > 126)) {
+        if (j == i) ++j;
+        break;
+      }
+      if (ends(s[j])) { ++j; break; }
+    }
+    n = j - i;
+    if (n < WORDMIN) continue;
+    if (n <= WORDMAX) count(i,n);
+    for (k = 8;k <= 64;k <<= 1)
+      if (n > k) count(i,k);
+  }
+  alloc_free((char *) slot);
+
+  qsort(w,numwords,sizeof(struct word),wordcmp);
+  n = 0;
+  for (i = 0;i < numwords;++i) {
+    if (w[i].count < 2) break;
+    if (chosen.len + w[i].len > max) continue;
+    if (within(chosen.s,chosen.len,s + w[i].pos,w[i].len)) continue;
+    if (!stralloc_catb(&chosen,s + w[i].pos,w[i].len)) goto nomem;
+    w[n++] = w[i];
+  }
+  qsort(w,n,sizeof(struct word),poscmp);
+  for (i = 0;i < n;++i)
+    if (!stralloc_catb(dict,s + w[i].pos,w[i].len)) goto nomem;
+  alloc_free((char *) w);
+  if (chosen.s) alloc_free(chosen.s);
+  return 0;
+
+  nomem:
+  alloc_free((char *) w);
+  if (chosen.s) alloc_free(chosen.s);
+  return -1;
+}
+
+static unsigned int hash4(const char *s)
+{
+  unsigned int h;
+
+  h = (unsigned char) s[0];
+  h = (h << 8) + (unsigned char) s[1];
+  h = (h << 8) + (unsigned char) s[2];
+  h = (h << 8) + (unsigned char) s[3];
+  return (h * 2654435761U) >> 16;
+}
+
+/* returns -1 if there was not enough memory; dict must stay put */
+int txtdict_index(struct txtdict *d,const char *dict,unsigned int len)
+{
+  unsigned int i;
+  unsigned int h;
+
+  if (len > TXTDICT_MAX) len = TXTDICT_MAX;
+  d->s = dict;
+  d->len = len;
+  d->head = (int *) alloc(65536 * sizeof(int));
+  if (!d->head) return -1;
+  d->prev = (int *) alloc((len + 1) * sizeof(int));
+  if (!d->prev) return -1;
+  for (i = 0;i < 65536;++i) d->head[i] = -1;
+  for (i = 0;i + WORDMIN <= len;++i) {
+    h = hash4(dict + i) & 65535;
+    d->prev[i] = d->head[h];
+    d->head[h] = i;
+  }
+  return 0;
+}
+
+static int literal(stralloc *out,const char *s,unsigned int len)
+{
+  unsigned int n;
+  char ch;
+
+  while (len) {
+    n = (len > 128) ? 128 : len;
+    ch = n - 1;
+    if (!stralloc_append(out,&ch)) return -1;
+    if (!stralloc_catb(out,s,n)) return -1;
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* appends s packed to out; returns -1 if there was not enough memory */
+int txtdict_pack(struct txtdict *d,stralloc *out,const char *s,unsigned int len)
+{
+  unsigned int i;
+  unsigned int lit;
+  unsigned int m;
+  unsigned int best;
+  unsigned int bestpos;
+  unsigned int depth;
+  int p;
+  char buf[3];
+
+  i = lit = 0;
+  while (i + WORDMIN <= len) {
+    best = 0;
+    bestpos = 0;
+    depth = 0;
+    for (p = d->head[hash4(s + i) & 65535];(p != -1) && (depth < TXTDICT_DEPTH);p = d->prev[p]) {
+      ++depth;
+      for (m = 0;(m < WORDMAX) && (i + m < len) && (p + m < d->len);++m)
+        if (d->s[p + m] != s[i + m]) break;
+      if (m > best) { best = m; bestpos = p; }
+    }
+    if (best < WORDMIN) { ++i; continue; }
+    if (literal(out,s + lit,i - lit) == -1) return -1;
+    buf[0] = 128 + best - WORDMIN;
+    buf[1] = bestpos >> 8;
+    buf[2] = bestpos;
+    if (!stralloc_catb(out,buf,3)) return -1;
+    i += best;
+    lit = i;
+  }
+  return literal(out,s + lit,len - lit);
+}
+
+/* returns the length unpacked into out, or -1 if s is not valid */
+int txtdict_unpack(const char *dict,unsigned int dictlen,const char *s,unsigned int len,char *out,unsigned int max)
+{
+  unsigned int i;
+  unsigned int o;
+  unsigned int n;
+  unsigned int pos;
+  unsigned char b;
+
+  i = o = 0;
+  while (i < len) {
+    b = s[i++];
+    if (b < 128) {
+      n = b + 1;
+      if ((n > len - i) || (n > max - o)) return -1;
+      byte_copy(out + o,n,s + i);
+      i += n;
+    }
+    else {
+      n = b - 128 + WORDMIN;
+      if (len - i < 2) return -1;
+      pos = ((unsigned int) (unsigned char) s[i] << 8) + (unsigned char) s[i + 1];
+      i += 2;
+      if ((pos > dictlen) || (n > dictlen - pos) || (n > max - o)) return -1;
+      byte_copy(out + o,n,dict + pos);
+    }
+    o += n;
+  }
+  return o;
+}
@@ -0,0 +1,21 @@
+#ifndef TXTDICT_H
+#define TXTDICT_H
+
+#include "stralloc.h"
+
+#define TXTDICT_MAX 65535 /* offsets into it are 2 bytes */
+#define TXTDICT_DEPTH 32 /* candidates tried for each match */
+
+struct txtdict {
+  const char *s;
+  unsigned int len;
+  int *head; /* last position of each hash of 4 bytes */
+  int *prev; /* earlier position with the same hash */
+} ;
+
+extern int txtdict_train(stralloc *,const char *,unsigned int,unsigned int);
+extern int txtdict_index(struct txtdict *,const char *,unsigned int);
+extern int txtdict_pack(struct txtdict *,stralloc *,const char *,unsigned int);
+extern int txtdict_unpack(const char *,unsigned int,const char *,unsigned int,char *,unsigned int);
+
+#endif
@@ -8,4 +8,9 @@ extern void uint16_pack_big(char *,uint16);
 extern void uint16_unpack(const char *,uint16 *);
 extern void uint16_unpack_big(const char *,uint16 *);
 
+/* in-line versions, for packet parsers; gcc makes each one load */
+#define uint16_UNPACK_BIG(s) \
+  ( (uint16) (((unsigned int) (unsigned char) (s)[0] << 8) \
+  | (unsigned int) (unsigned char) (s)[1]) )
+
 #endif
@@ -11,11 +11,31 @@ void initialize(void)
   ;
 }
 
+/*
+Every answer owns the query name, which response_query() always puts
+at offset 12, so each record is a fixed header pointing there,
+followed by the address or, for PTR, the same pointer again. This
+skips response_rstart() and the compression table.
+*/
+
+static char rra[12] = "\300\14\0\1\0\1\0\12\0\0\0\4";
+static char rrptr[14] = "\300\14\0\14\0\1\0\12\0\0\0\2\300\14";
+
+static int answer(const char *rr,unsigned int rrlen,const char *ip)
+{
+  if (!response_addbytes(rr,rrlen)) return 0;
+  if (ip)
+    if (!response_addbytes(ip,4)) return 0;
+  if (!++response[RESPONSE_ANSWER + 1]) ++response[RESPONSE_ANSWER];
+  return 1;
+}
+
 int respond(char *q,char qtype[2])
 {
   int flaga;
   int flagptr;
   char ip[4];
+  char rev[4];
   int j;
 
   flaga = byte_equal(qtype,2,DNS_T_A);
@@ -24,28 +44,21 @@ int respond(char *q,char qtype[2])
 
   if (flaga || flagptr) {
     if (dd(q,"",ip) == 4) {
-      if (flaga) {
-        if (!response_rstart(q,DNS_T_A,655360)) return 0;
-        if (!response_addbytes(ip,4)) return 0;
-        response_rfinish(RESPONSE_ANSWER);
-      }
+      if (flaga)
+        if (!answer(rra,sizeof rra,ip)) return 0;
       return 1;
     }
     j = dd(q,"\7in-addr\4arpa",ip);
     if (j >= 0) {
       if (flaga && (j == 4)) {
-        if (!response_rstart(q,DNS_T_A,655360)) return 0;
-        if (!response_addbytes(ip + 3,1)) return 0;
-        if (!response_addbytes(ip + 2,1)) return 0;
-        if (!response_addbytes(ip + 1,1)) return 0;
-        if (!response_addbytes(ip + 0,1)) return 0;
-        response_rfinish(RESPONSE_ANSWER);
-      }
-      if (flagptr) {
-        if (!response_rstart(q,DNS_T_PTR,655360)) return 0;
-        if (!response_addname(q)) return 0;
-        response_rfinish(RESPONSE_ANSWER);
+        rev[0] = ip[3];
+        rev[1] = ip[2];
+        rev[2] = ip[1];
+        rev[3] = ip[0];
+        if (!answer(rra,sizeof rra,rev)) return 0;
       }
+      if (flagptr)
+        if (!answer(rrptr,sizeof rrptr,0)) return 0;
       return 1;
     }
   }
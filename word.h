@@ -0,0 +1,67 @@
+#ifndef WORD_H
+#define WORD_H
+
+/*
+Word-at-a-time helpers for byte.a and unix.a. A word is an unsigned
+long, loaded and stored through __builtin_memcpy(), which gcc turns
+into one unaligned move where the machine allows it. Without gcc,
+WORD_FAST is not defined and the callers keep their byte loops;
+word_equal() is then byte_equal(), from byte.h.
+*/
+
+#ifdef __GNUC__
+#define WORD_FAST
+typedef unsigned long word;
+#define word_load(w,p) __builtin_memcpy(&(w),(p),sizeof(word))
+#define word_store(p,w) __builtin_memcpy((p),&(w),sizeof(word))
+
+#define WORD_ONES ((word) -1 / 255) /* 0x01 in every byte */
+#define WORD_HIGH (WORD_ONES * 0x80)
+
+/* 0x20 in each byte of w that is 'A' through 'Z'; 0 elsewhere */
+#define word_upper(w) \
+  ((((((w) & ~WORD_HIGH) + WORD_ONES * (0x80 - 'A')) \
+  ^ (((w) & ~WORD_HIGH) + WORD_ONES * (0x80 - 'Z' - 1))) \
+  & ~(w) & WORD_HIGH) >> 2)
+
+/*
+word_equal(s,t,n) is byte_equal(s,n,t) for short keys, such as cdb
+and cache keys, without a call or a byte loop: a word at a time with
+the last word overlapping the one before, so 8 and 16 bytes are one
+and two compares and 12 is two; 4 to 7 bytes are two overlapping
+4-byte compares.
+*/
+static __inline__ int word_equal(const char *s,const char *t,unsigned int n)
+{
+  word x;
+  word y;
+  unsigned int u; /* 4 bytes wherever gcc runs */
+  unsigned int v;
+  unsigned int i;
+
+  if (n >= sizeof x) {
+    for (i = sizeof x;i < n;i += sizeof x) {
+      word_load(x,s + i - sizeof x);
+      word_load(y,t + i - sizeof x);
+      if (x != y) return 0;
+    }
+    word_load(x,s + n - sizeof x);
+    word_load(y,t + n - sizeof x);
+    return x == y;
+  }
+  if (n >= 4) {
+    __builtin_memcpy(&u,s,4);
+    __builtin_memcpy(&v,t,4);
+    if (u != v) return 0;
+    __builtin_memcpy(&u,s + n - 4,4);
+    __builtin_memcpy(&v,t + n - 4,4);
+    return u == v;
+  }
+  if (n >= 2) return (s[0] == t[0]) && (s[1] == t[1]) && (s[n - 1] == t[n - 1]);
+  return !n || (s[0] == t[0]);
+}
+#else
+#define word_equal(s,t,n) byte_equal((s),(n),(t))
+#endif
+
+#endif
@@ -0,0 +1,418 @@
+#define _FILE_OFFSET_BITS 64
+#include <sys/types.h>
+#include <unistd.h>
+#include "hasxdp.h"
+#ifdef HASXDP
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#endif
+#include "byte.h"
+#include "str.h"
+#include "error.h"
+#include "uint16.h"
+#include "uint32.h"
+#include "xsk.h"
+
+/*
+An AF_XDP socket gets the frames the kernel would have handed to the
+UDP socket, straight off one queue of the network interface, in a
+region of memory (the UMEM) shared with the kernel, and sends answers
+from the same frames without copying them.
+
+xsk_prog() loads and attaches to the interface an XDP program that
+sends on to the socket for its queue only what a UDP socket bound to
+ip, port would get, as plain IPv4: no IP options, no fragments.
+Everything else, and everything on a queue without a socket, goes on
+through the kernel as before. The program stays attached while some
+process still has it open, so it goes away with the last worker.
+
+xsk_open() makes the socket for one queue. Frames go around: fill
+ring, rx ring, to the caller, tx ring, completion ring, fill ring.
+xsk_recv4_many() hands out the UDP payloads of up to n frames;
+xsk_send4_many() sends each answer from the frame its datagram's buf
+points into, written over the query, with addresses and ports
+swapped. Frames of the last batch that get no answer go back on the
+fill ring. UDP checksums on queries are not checked; the ones on
+answers are filled in.
+*/
+
+#ifdef HASXDP
+
+#define FRAMESIZE 4096
+#define FRAMES 2048 /* per socket; every ring has room for all of them */
+#define HEADERS 42 /* Ethernet, IPv4 without options, UDP */
+#define QUEUES 64
+
+static int ifindex = 0;
+static int mapfd = -1;
+static unsigned int mtu = 0;
+
+static long bpf(int cmd,union bpf_attr *attr)
+{
+  return syscall(__NR_bpf,cmd,attr,sizeof *attr);
+}
+
+#define INSN(code,dst,src,off,imm) { (code), (dst), (src), (off), (imm) }
+#define PASS 24 /* r0 = XDP_PASS */
+
+static struct bpf_insn prog[] = {
+  INSN(BPF_LDX | BPF_MEM | BPF_W,2,1,0,0), /* r2 = data */
+  INSN(BPF_LDX | BPF_MEM | BPF_W,3,1,4,0), /* r3 = data_end */
+  INSN(BPF_ALU64 | BPF_MOV | BPF_X,4,2,0,0),
+  INSN(BPF_ALU64 | BPF_ADD | BPF_K,4,0,0,HEADERS),
+  INSN(BPF_JMP | BPF_JGT | BPF_X,4,3,PASS - 5,0),
+  INSN(BPF_LDX | BPF_MEM | BPF_H,5,2,12,0), /* 5: Ethernet type */
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 7,0),
+  INSN(BPF_LDX | BPF_MEM | BPF_B,5,2,14,0), /* IP version, header length */
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 9,0x45),
+  INSN(BPF_LDX | BPF_MEM | BPF_H,5,2,20,0), /* 9: more fragments, offset */
+  INSN(BPF_ALU | BPF_AND | BPF_K,5,0,0,0),
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 12,0),
+  INSN(BPF_LDX | BPF_MEM | BPF_B,5,2,23,0), /* protocol */
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 14,17),
+  INSN(BPF_LDX | BPF_MEM | BPF_W,5,2,30,0), /* 14: destination */
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 16,0),
+  INSN(BPF_LDX | BPF_MEM | BPF_H,5,2,36,0), /* 16: destination port */
+  INSN(BPF_JMP32 | BPF_JNE | BPF_K,5,0,PASS - 18,0),
+  INSN(BPF_LDX | BPF_MEM | BPF_W,2,1,16,0), /* r2 = rx_queue_index */
+  INSN(BPF_LD | BPF_DW | BPF_IMM,1,BPF_PSEUDO_MAP_FD,0,0), /* 19: r1 = map */
+  INSN(0,0,0,0,0),
+  INSN(BPF_ALU64 | BPF_MOV | BPF_K,3,0,0,XDP_PASS), /* if no socket */
+  INSN(BPF_JMP | BPF_CALL,0,0,0,BPF_FUNC_redirect_map),
+  INSN(BPF_JMP | BPF_EXIT,0,0,0,0),
+  INSN(BPF_ALU64 | BPF_MOV | BPF_K,0,0,0,XDP_PASS),
+  INSN(BPF_JMP | BPF_EXIT,0,0,0,0)
+} ;
+
+/* the packet bytes s as the program loads them */
+static uint32 native(const char *s,unsigned int n)
+{
+  uint16 u16;
+  uint32 u32;
+
+  if (n == 2) { byte_copy((char *) &u16,2,s); return u16; }
+  byte_copy((char *) &u32,4,s);
+  return u32;
+}
+
+static void getmtu(const char *ifname)
+{
+  struct ifreq ifr;
+  int s;
+
+  if (str_len(ifname) >= sizeof ifr.ifr_name) return;
+  byte_zero((char *) &ifr,sizeof ifr);
+  byte_copy(ifr.ifr_name,str_len(ifname),ifname);
+  s = socket(AF_INET,SOCK_DGRAM,0);
+  if (s == -1) return;
+  if (ioctl(s,SIOCGIFMTU,&ifr) == 0)
+    if (ifr.ifr_mtu > 28) mtu = ifr.ifr_mtu;
+  close(s);
+}
+
+int xsk_prog(const char *ifname,const char ip[4],uint16 port)
+{
+  union bpf_attr attr;
+  char b[2];
+  int progfd;
+
+  ifindex = if_nametoindex(ifname);
+  if (!ifindex) return -1;
+  getmtu(ifname);
+
+  byte_zero((char *) &attr,sizeof attr);
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = 4;
+  attr.value_size = 4;
+  attr.max_entries = QUEUES;
+  mapfd = bpf(BPF_MAP_CREATE,&attr);
+  if (mapfd == -1) return -1;
+
+  prog[6].imm = native("\10\0",2);
+  prog[10].imm = native("\77\377",2);
+  if (byte_equal(ip,4,"\0\0\0\0")) {
+    prog[15].code = BPF_JMP | BPF_JA;
+    prog[15].off = 0;
+  }
+  else
+    prog[15].imm = native(ip,4);
+  uint16_pack_big(b,port);
+  prog[17].imm = native(b,2);
+  prog[19].imm = mapfd;
+
+  byte_zero((char *) &attr,sizeof attr);
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (unsigned long) prog;
+  attr.insn_cnt = sizeof prog / sizeof prog[0];
+  attr.license = (unsigned long) "BSD";
+  progfd = bpf(BPF_PROG_LOAD,&attr);
+  if (progfd == -1) return -1;
+
+  /* the link, left open, holds the program on the interface */
+  byte_zero((char *) &attr,sizeof attr);
+  attr.link_create.prog_fd = progfd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  if (bpf(BPF_LINK_CREATE,&attr) == -1) { close(progfd); return -1; }
+  close(progfd);
+  return 0;
+}
+
+static unsigned int load(unsigned int *p)
+{
+  return __atomic_load_n(p,__ATOMIC_ACQUIRE);
+}
+
+static void store(unsigned int *p,unsigned int u)
+{
+  __atomic_store_n(p,u,__ATOMIC_RELEASE);
+}
+
+static int ring(struct xsk_ring *r,int fd,struct xdp_ring_offset *off,off_t pgoff,unsigned int each)
+{
+  char *map;
+
+  map = mmap(0,off->desc + FRAMES * each,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,pgoff);
+  if (map == MAP_FAILED) return -1;
+  r->producer = (unsigned int *) (map + off->producer);
+  r->consumer = (unsigned int *) (map + off->consumer);
+  r->desc = map + off->desc;
+  r->mask = FRAMES - 1;
+  return 0;
+}
+
+static void fill(struct xsk *x,uint64 addr)
+{
+  unsigned int p;
+
+  p = *x->fill.producer;
+  ((uint64 *) x->fill.desc)[p & x->fill.mask] = addr - addr % FRAMESIZE;
+  store(x->fill.producer,p + 1);
+}
+
+/* sent frames come back for more queries */
+static void reap(struct xsk *x)
+{
+  unsigned int c;
+  unsigned int p;
+
+  c = *x->comp.consumer;
+  p = load(x->comp.producer);
+  while (c != p) {
+    fill(x,((uint64 *) x->comp.desc)[c & x->comp.mask]);
+    ++c;
+  }
+  store(x->comp.consumer,c);
+}
+
+int xsk_open(struct xsk *x,unsigned int queue)
+{
+  struct xdp_umem_reg reg;
+  struct xdp_mmap_offsets off;
+  struct sockaddr_xdp sa;
+  union bpf_attr attr;
+  socklen_t len;
+  unsigned int n;
+  uint32 key;
+  uint32 value;
+  char *map;
+
+  if ((mapfd == -1) || (queue >= QUEUES)) { errno = error_nodevice; return -1; }
+  x->fd = socket(AF_XDP,SOCK_RAW,0);
+  if (x->fd == -1) return -1;
+
+  /* shared, so that workers forked later write where the kernel reads */
+  map = mmap(0,FRAMES * FRAMESIZE,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+  if (map == MAP_FAILED) goto FAIL;
+  x->umem = map;
+  byte_zero((char *) &reg,sizeof reg);
+  reg.addr = (unsigned long) x->umem;
+  reg.len = FRAMES * FRAMESIZE;
+  reg.chunk_size = FRAMESIZE;
+  if (setsockopt(x->fd,SOL_XDP,XDP_UMEM_REG,&reg,sizeof reg) == -1) goto FAIL;
+
+  n = FRAMES;
+  if (setsockopt(x->fd,SOL_XDP,XDP_UMEM_FILL_RING,&n,sizeof n) == -1) goto FAIL;
+  if (setsockopt(x->fd,SOL_XDP,XDP_UMEM_COMPLETION_RING,&n,sizeof n) == -1) goto FAIL;
+  if (setsockopt(x->fd,SOL_XDP,XDP_RX_RING,&n,sizeof n) == -1) goto FAIL;
+  if (setsockopt(x->fd,SOL_XDP,XDP_TX_RING,&n,sizeof n) == -1) goto FAIL;
+  len = sizeof off;
+  if (getsockopt(x->fd,SOL_XDP,XDP_MMAP_OFFSETS,&off,&len) == -1) goto FAIL;
+  if (ring(&x->fill,x->fd,&off.fr,XDP_UMEM_PGOFF_FILL_RING,sizeof(uint64)) == -1) goto FAIL;
+  if (ring(&x->comp,x->fd,&off.cr,XDP_UMEM_PGOFF_COMPLETION_RING,sizeof(uint64)) == -1) goto FAIL;
+  if (ring(&x->rx,x->fd,&off.rx,XDP_PGOFF_RX_RING,sizeof(struct xdp_desc)) == -1) goto FAIL;
+  if (ring(&x->tx,x->fd,&off.tx,XDP_PGOFF_TX_RING,sizeof(struct xdp_desc)) == -1) goto FAIL;
+
+  for (n = 0;n < FRAMES;++n)
+    fill(x,(uint64) n * FRAMESIZE);
+
+  byte_zero((char *) &sa,sizeof sa);
+  sa.sxdp_family = AF_XDP;
+  sa.sxdp_ifindex = ifindex;
+  sa.sxdp_queue_id = queue;
+  if (bind(x->fd,(struct sockaddr *) &sa,sizeof sa) == -1) goto FAIL;
+
+  key = queue;
+  value = x->fd;
+  byte_zero((char *) &attr,sizeof attr);
+  attr.map_fd = mapfd;
+  attr.key = (unsigned long) &key;
+  attr.value = (unsigned long) &value;
+  if (bpf(BPF_MAP_UPDATE_ELEM,&attr) == -1) goto FAIL;
+
+  x->room = FRAMESIZE - XDP_PACKET_HEADROOM - HEADERS;
+  if (mtu && (mtu - 28 < x->room)) x->room = mtu - 28;
+  x->numheld = 0;
+  return 0;
+
+  FAIL:
+  close(x->fd);
+  return -1;
+}
+
+int xsk_recv4_many(struct xsk *x,struct socket_dgram *d,unsigned int n)
+{
+  struct xdp_desc *desc;
+  unsigned char *pkt;
+  unsigned int c;
+  unsigned int p;
+  unsigned int iplen;
+  unsigned int udplen;
+  int i;
+
+  reap(x);
+  while (x->numheld) fill(x,x->held[--x->numheld]);
+  if (n > XSK_MANY) n = XSK_MANY;
+
+  i = 0;
+  c = *x->rx.consumer;
+  p = load(x->rx.producer);
+  while ((c != p) && (i < n)) {
+    desc = (struct xdp_desc *) x->rx.desc + (c++ & x->rx.mask);
+    pkt = (unsigned char *) x->umem + desc->addr;
+    if (desc->len < HEADERS) goto DROP;
+    if ((pkt[12] != 8) || pkt[13] || (pkt[14] != 0x45)) goto DROP;
+    if ((pkt[20] & 0x3f) || pkt[21] || (pkt[23] != 17)) goto DROP;
+    iplen = (pkt[16] << 8) + pkt[17];
+    udplen = (pkt[38] << 8) + pkt[39];
+    if ((iplen < 28) || (14 + iplen > desc->len)) goto DROP;
+    if ((udplen < 8) || (udplen > iplen - 20)) goto DROP;
+
+    d[i].buf = (char *) pkt + HEADERS;
+    d[i].len = udplen - 8;
+    byte_copy(d[i].ip,4,(char *) pkt + 26);
+    uint16_unpack_big((char *) pkt + 34,&d[i].port);
+    x->held[x->numheld++] = desc->addr;
+    ++i;
+    continue;
+
+    DROP:
+    fill(x,desc->addr);
+  }
+  store(x->rx.consumer,c);
+  return i;
+}
+
+static uint32 sum(const unsigned char *s,unsigned int n,uint32 u)
+{
+  while (n > 1) { u += (s[0] << 8) + s[1]; s += 2; n -= 2; }
+  if (n) u += s[0] << 8;
+  return u;
+}
+
+static unsigned int fold(uint32 u)
+{
+  while (u >> 16) u = (u & 0xffff) + (u >> 16);
+  return ~u & 0xffff;
+}
+
+/* turns the query in pkt around into an answer of len bytes to ip, port */
+static void turn(unsigned char *pkt,unsigned int len,const char ip[4],uint16 port)
+{
+  char mac[6];
+  unsigned int c;
+
+  byte_copy(mac,6,(char *) pkt);
+  byte_copy((char *) pkt,6,(char *) pkt + 6);
+  byte_copy((char *) pkt + 6,6,mac);
+
+  uint16_pack_big((char *) pkt + 16,28 + len);
+  pkt[18] = pkt[19] = 0;
+  pkt[20] = 0x40; pkt[21] = 0; /* DF */
+  pkt[22] = 64;
+  byte_copy((char *) pkt + 26,4,(char *) pkt + 30);
+  byte_copy((char *) pkt + 30,4,ip);
+  pkt[24] = pkt[25] = 0;
+  uint16_pack_big((char *) pkt + 24,fold(sum(pkt + 14,20,0)));
+
+  byte_copy((char *) pkt + 34,2,(char *) pkt + 36);
+  uint16_pack_big((char *) pkt + 36,port);
+  uint16_pack_big((char *) pkt + 38,8 + len);
+  pkt[40] = pkt[41] = 0;
+  c = fold(sum(pkt + 34,8 + len,sum(pkt + 26,8,17 + 8 + len)));
+  uint16_pack_big((char *) pkt + 40,c ? c : 0xffff);
+}
+
+int xsk_send4_many(struct xsk *x,struct socket_dgram *d,unsigned int n)
+{
+  struct xdp_desc *desc;
+  uint64 addr;
+  unsigned int p;
+  unsigned int i;
+  unsigned int j;
+  int sent;
+
+  sent = 0;
+  p = *x->tx.producer;
+  for (i = 0;i < n;++i) {
+    addr = d[i].buf - HEADERS - x->umem;
+    for (j = 0;j < x->numheld;++j)
+      if (x->held[j] == addr) break;
+    if (j == x->numheld) continue; /* not from the last batch */
+    x->held[j] = x->held[--x->numheld];
+    if ((d[i].len < 0) || (d[i].len > x->room)) { fill(x,addr); continue; }
+
+    turn((unsigned char *) d[i].buf - HEADERS,d[i].len,d[i].ip,d[i].port);
+    desc = (struct xdp_desc *) x->tx.desc + (p++ & x->tx.mask);
+    desc->addr = addr;
+    desc->len = HEADERS + d[i].len;
+    desc->options = 0;
+    ++sent;
+  }
+  store(x->tx.producer,p);
+  while (x->numheld) fill(x,x->held[--x->numheld]);
+
+  if (sent) sendto(x->fd,(char *) 0,0,MSG_DONTWAIT,(struct sockaddr *) 0,0);
+  return sent;
+}
+
+#else
+
+int xsk_prog(const char *ifname,const char ip[4],uint16 port)
+{
+  errno = error_nodevice;
+  return -1;
+}
+
+int xsk_open(struct xsk *x,unsigned int queue)
+{
+  errno = error_nodevice;
+  return -1;
+}
+
+int xsk_recv4_many(struct xsk *x,struct socket_dgram *d,unsigned int n)
+{
+  return 0;
+}
+
+int xsk_send4_many(struct xsk *x,struct socket_dgram *d,unsigned int n)
+{
+  return 0;
+}
+
+#endif
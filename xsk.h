@@ -0,0 +1,34 @@
+#ifndef XSK_H
+#define XSK_H
+
+#include "uint16.h"
+#include "uint64.h"
+#include "socket.h"
+
+#define XSK_MANY 64
+
+struct xsk_ring {
+  unsigned int *producer;
+  unsigned int *consumer;
+  char *desc;
+  unsigned int mask;
+} ;
+
+struct xsk {
+  int fd;
+  char *umem;
+  struct xsk_ring fill;
+  struct xsk_ring comp;
+  struct xsk_ring rx;
+  struct xsk_ring tx;
+  unsigned int room; /* largest UDP payload a frame can send */
+  uint64 held[XSK_MANY]; /* frames handed out by the last xsk_recv4_many */
+  unsigned int numheld;
+} ;
+
+extern int xsk_prog(const char *,const char [4],uint16);
+extern int xsk_open(struct xsk *,unsigned int);
+extern int xsk_recv4_many(struct xsk *,struct socket_dgram *,unsigned int);
+extern int xsk_send4_many(struct xsk *,struct socket_dgram *,unsigned int);
+
+#endif
@@ -0,0 +1,176 @@
+#include "alloc.h"
+#include "byte.h"
+#include "dns.h"
+#include "fmt.h"
+#include "stralloc.h"
+#include "taia.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "zonestat.h"
+
+/*
+After zonestat_init(seconds), each answer is also counted against the
+zone it came from, as named to zonestat_zone() while it was built:
+queries, response bytes, microseconds from zonestat_start() to
+zonestat_answer(), and rcodes. Answers with no zone, such as those
+outside the bailiwick, are not counted. Once zonestat_due() says the
+interval is up, zonestat_flush() writes out and clears the table, one
+"zone worker queries bytes usec noerror nxdomain other name" line for
+each zone seen since the last flush.
+
+The table holds ZONES zones between flushes; answers for more zones
+are counted only in a "zonedrop worker answers" line.
+*/
+
+#define ZONES 65536
+#define SLOTS (2 * ZONES) /* power of 2 */
+
+struct zone {
+  uint32 name; /* 1 + position in names; 0 if empty */
+  uint32 queries;
+  uint32 rcode[3]; /* noerror, nxdomain, other */
+  uint64 bytes;
+  uint64 usec;
+} ;
+
+static int flagon = 0;
+static struct zone *zone;
+static uint32 *used; /* slots in use, in order of first use */
+static unsigned int numused = 0;
+static stralloc names = {0};
+static unsigned long dropped = 0;
+static struct taia interval;
+static struct taia due;
+static struct taia begin;
+static const char *current = 0;
+
+int zonestat_init(unsigned long seconds)
+{
+  struct taia now;
+
+  if (!seconds) return 0;
+  zone = (struct zone *) alloc(SLOTS * sizeof(struct zone));
+  if (!zone) return -1;
+  used = (uint32 *) alloc(ZONES * sizeof(uint32));
+  if (!used) { alloc_free((char *) zone); return -1; }
+  byte_zero((char *) zone,SLOTS * sizeof(struct zone));
+  taia_uint(&interval,seconds);
+  taia_now(&now);
+  taia_add(&due,&now,&interval);
+  flagon = 1;
+  return 0;
+}
+
+void zonestat_start(void)
+{
+  if (!flagon) return;
+  current = 0;
+  taia_now(&begin);
+}
+
+/* z must stay put until zonestat_answer() */
+void zonestat_zone(const char *z)
+{
+  current = z;
+}
+
+static struct zone *find(const char *z)
+{
+  unsigned int len;
+  uint32 h = 5381;
+  uint32 i;
+  unsigned int j;
+
+  len = dns_domain_length(z);
+  for (j = 0;j < len;++j) h = (h + (h << 5)) ^ (unsigned char) z[j];
+
+  for (i = h & (SLOTS - 1);zone[i].name;i = (i + 1) & (SLOTS - 1))
+    if (dns_domain_equal(names.s + zone[i].name - 1,z))
+      return zone + i;
+  if (numused >= ZONES) return 0;
+  zone[i].name = names.len + 1;
+  if (!stralloc_catb(&names,z,len)) { zone[i].name = 0; return 0; }
+  used[numused++] = i;
+  return zone + i;
+}
+
+void zonestat_answer(const char *response,unsigned int len)
+{
+  struct zone *z;
+  struct taia now;
+  unsigned int rcode;
+
+  if (!flagon || !current) return;
+  z = find(current);
+  current = 0;
+  if (!z) { ++dropped; return; }
+
+  ++z->queries;
+  z->bytes += len;
+  rcode = response[3] & 15;
+  ++z->rcode[(rcode == 0) ? 0 : (rcode == 3) ? 1 : 2];
+  taia_now(&now);
+  if (!taia_less(&now,&begin)) {
+    taia_sub(&now,&now,&begin);
+    z->usec += (uint64) (taia_approx(&now) * 1000000.0);
+  }
+}
+
+int zonestat_due(void)
+{
+  struct taia now;
+
+  if (!flagon) return 0;
+  taia_now(&now);
+  return !taia_less(&now,&due);
+}
+
+static void number(buffer *b,uint64 u)
+{
+  char strnum[FMT_ULONG];
+
+  buffer_puts(b," ");
+  buffer_put(b,strnum,fmt_ulong(strnum,u));
+}
+
+static stralloc dot = {0};
+
+void zonestat_flush(buffer *b,unsigned long worker)
+{
+  struct zone *z;
+  struct taia now;
+  unsigned int i;
+
+  if (!flagon) return;
+  for (i = 0;i < numused;++i) {
+    z = zone + used[i];
+    buffer_puts(b,"zone");
+    number(b,worker);
+    number(b,z->queries);
+    number(b,z->bytes);
+    number(b,z->usec);
+    number(b,z->rcode[0]);
+    number(b,z->rcode[1]);
+    number(b,z->rcode[2]);
+    buffer_puts(b," ");
+    dot.len = 0;
+    if (dns_domain_todot_cat(&dot,names.s + z->name - 1))
+      buffer_put(b,dot.s,dot.len);
+    buffer_puts(b,"\n");
+    byte_zero((char *) z,sizeof *z);
+  }
+  if (dropped) {
+    buffer_puts(b,"zonedrop");
+    number(b,worker);
+    number(b,dropped);
+    buffer_puts(b,"\n");
+  }
+  buffer_flush(b);
+
+  numused = 0;
+  names.len = 0;
+  dropped = 0;
+  current = 0;
+  taia_now(&now);
+  taia_add(&due,&now,&interval);
+}
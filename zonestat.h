@@ -0,0 +1,13 @@
+#ifndef ZONESTAT_H
+#define ZONESTAT_H
+
+#include "buffer.h"
+
+extern int zonestat_init(unsigned long);
+extern void zonestat_start(void);
+extern void zonestat_zone(const char *);
+extern void zonestat_answer(const char *,unsigned int);
+extern int zonestat_due(void);
+extern void zonestat_flush(buffer *,unsigned long);
+
+#endif